@@ -5,15 +5,20 @@
 #include "AddressSpace.h"
 
 #include <linux/kdev_t.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <limits>
 
 #include "preload/preload_interface.h"
 
 #include "AutoRemoteSyscalls.h"
+#include "kernel_metadata.h"
+#include "kernel_supplement.h"
 #include "log.h"
+#include "MemoryAccounting.h"
 #include "RecordSession.h"
 #include "Session.h"
 #include "task.h"
@@ -156,65 +161,205 @@ struct map_iterator_data {
 typedef void (*memory_map_iterator_t)(void* it_data, Task* t,
                                       const struct map_iterator_data* data);
 
+static uint64_t parse_hex(char** p) {
+  uint64_t v = 0;
+  while (true) {
+    char c = **p;
+    if (c >= '0' && c <= '9') {
+      v = v * 16 + (c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+      v = v * 16 + (c - 'a' + 10);
+    } else {
+      return v;
+    }
+    ++*p;
+  }
+}
+
+static uint64_t parse_dec(char** p) {
+  uint64_t v = 0;
+  while (**p >= '0' && **p <= '9') {
+    v = v * 10 + (**p - '0');
+    ++*p;
+  }
+  return v;
+}
+
+static bool skip_char(char** p, char c) {
+  if (**p != c) {
+    return false;
+  }
+  ++*p;
+  return true;
+}
+
+/**
+ * Parse one NUL-terminated /proc/maps |line| into |data|. This runs for
+ * every segment on every verify(), so it's hand-rolled rather than sscanf.
+ */
+static bool parse_map_line(char* line, struct map_iterator_data* data) {
+  char* p = line;
+  data->raw_map_line = line;
+  uint64_t start = parse_hex(&p);
+  if (!skip_char(&p, '-')) {
+    return false;
+  }
+  uint64_t end = parse_hex(&p);
+  if (!skip_char(&p, ' ') || strlen(p) < 5) {
+    return false;
+  }
+  struct mapped_segment_info& info = data->info;
+  info.prot |= p[0] == 'r' ? PROT_READ : 0;
+  info.prot |= p[1] == 'w' ? PROT_WRITE : 0;
+  info.prot |= p[2] == 'x' ? PROT_EXEC : 0;
+  info.flags |= p[3] == 'p' ? MAP_PRIVATE : 0;
+  info.flags |= p[3] == 's' ? MAP_SHARED : 0;
+  p += 4;
+  if (!skip_char(&p, ' ')) {
+    return false;
+  }
+  info.file_offset = parse_hex(&p);
+  if (!skip_char(&p, ' ')) {
+    return false;
+  }
+  info.dev_major = parse_hex(&p);
+  if (!skip_char(&p, ':')) {
+    return false;
+  }
+  info.dev_minor = parse_hex(&p);
+  if (!skip_char(&p, ' ')) {
+    return false;
+  }
+  info.inode = parse_dec(&p);
+  if (*p && *p != ' ') {
+    return false;
+  }
+  info.name = trim_leading_blanks(p);
+  info.start_addr = start;
+  info.end_addr = end;
+  return true;
+}
+
+static void check_segment_arch(Task* t, const struct map_iterator_data& data) {
+#if defined(__i386__)
+  if (data.info.start_addr.as_int() > numeric_limits<uint32_t>::max() ||
+      data.info.end_addr.as_int() > numeric_limits<uint32_t>::max() ||
+      data.info.name == "[vsyscall]") {
+    // We manually read the exe link here because
+    // this helper is used to set
+    // |t->vm()->exe_image()|, so we can't rely on
+    // that being correct yet.
+    char proc_exe[PATH_MAX];
+    char exe[PATH_MAX];
+    snprintf(proc_exe, sizeof(proc_exe), "/proc/%d/exe", t->tid);
+    readlink(proc_exe, exe, sizeof(exe));
+    FATAL() << "Sorry, tracee " << t->tid << " has x86-64 image " << exe
+            << " and that's not supported with a 32-bit rr.";
+  }
+#endif
+}
+
 static void iterate_memory_map(Task* t, memory_map_iterator_t it,
                                void* it_data) {
-  FILE* maps_file;
-  char line[PATH_MAX * 2];
-  {
-    char maps_path[PATH_MAX];
-    snprintf(maps_path, sizeof(maps_path) - 1, "/proc/%d/maps", t->tid);
-    ASSERT(t, (maps_file = fopen(maps_path, "r"))) << "Failed to open "
-                                                   << maps_path;
-  }
-  while (fgets(line, sizeof(line), maps_file)) {
-    struct map_iterator_data data;
-    data.raw_map_line = line;
-    uint64_t start, end;
-    char flags[32];
-    int chars_scanned;
-    int nparsed = sscanf(
-        line, "%" SCNx64 "-%" SCNx64 " %31s %" SCNx64 " %x:%x %" SCNu64 " %n",
-        &start, &end, flags, &data.info.file_offset, &data.info.dev_major,
-        &data.info.dev_minor, &data.info.inode, &chars_scanned);
-    ASSERT(t, (8 /*number of info fields*/ == nparsed ||
-               7 /*num fields if name is blank*/ == nparsed))
-        << "Only parsed " << nparsed << " fields of segment info from\n"
-        << data.raw_map_line;
-
-    // trim trailing newline, if any
-    int last_char = strlen(line) - 1;
-    if (line[last_char] == '\n') {
-      line[last_char] = 0;
+  char maps_path[PATH_MAX];
+  snprintf(maps_path, sizeof(maps_path) - 1, "/proc/%d/maps", t->tid);
+  ScopedFd fd(maps_path, O_RDONLY | O_CLOEXEC);
+  ASSERT(t, fd.is_open()) << "Failed to open " << maps_path;
+  // Read the whole file at once. The kernel returns at most a page per
+  // read() of a seq_file, so ask for plenty and keep going until EOF.
+  vector<char> buf(64 * 1024);
+  size_t len = 0;
+  while (true) {
+    if (buf.size() - len < 4096) {
+      buf.resize(buf.size() * 2);
     }
-    data.info.name = trim_leading_blanks(line + chars_scanned);
-#if defined(__i386__)
-    if (start > numeric_limits<uint32_t>::max() ||
-        end > numeric_limits<uint32_t>::max() ||
-        data.info.name == "[vsyscall]") {
-      // We manually read the exe link here because
-      // this helper is used to set
-      // |t->vm()->exe_image()|, so we can't rely on
-      // that being correct yet.
-      char proc_exe[PATH_MAX];
-      char exe[PATH_MAX];
-      snprintf(proc_exe, sizeof(proc_exe), "/proc/%d/exe", t->tid);
-      readlink(proc_exe, exe, sizeof(exe));
-      FATAL() << "Sorry, tracee " << t->tid << " has x86-64 image " << exe
-              << " and that's not supported with a 32-bit rr.";
+    ssize_t ret = read(fd, buf.data() + len, buf.size() - len - 1);
+    if (ret < 0 && errno == EINTR) {
+      continue;
     }
-#endif
-    data.info.start_addr = start;
-    data.info.end_addr = end;
+    ASSERT(t, ret >= 0) << "Failed to read " << maps_path;
+    if (ret == 0) {
+      break;
+    }
+    len += ret;
+  }
+  buf[len] = 0;
 
-    data.info.prot |= strchr(flags, 'r') ? PROT_READ : 0;
-    data.info.prot |= strchr(flags, 'w') ? PROT_WRITE : 0;
-    data.info.prot |= strchr(flags, 'x') ? PROT_EXEC : 0;
-    data.info.flags |= strchr(flags, 'p') ? MAP_PRIVATE : 0;
-    data.info.flags |= strchr(flags, 's') ? MAP_SHARED : 0;
+  char* line = buf.data();
+  while (*line) {
+    char* eol = strchr(line, '\n');
+    if (eol) {
+      *eol = 0;
+    }
+    struct map_iterator_data data;
+    ASSERT(t, parse_map_line(line, &data))
+        << "Can't parse segment info from\n" << line;
+    check_segment_arch(t, data);
+    it(it_data, t, &data);
+    if (!eol) {
+      break;
+    }
+    line = eol + 1;
+  }
+}
 
+/**
+ * Call |it| for each segment overlapping [start, end), using the
+ * PROCMAP_QUERY ioctl so we don't have to read and parse the whole
+ * /proc/maps. |fd| is /proc/<tid>/maps. Returns false if the kernel
+ * doesn't support PROCMAP_QUERY, in which case |it| hasn't been called.
+ * |raw_map_line| is null in the segments this passes to |it|.
+ */
+static bool query_memory_map(Task* t, const ScopedFd& fd,
+                             remote_ptr<void> start, remote_ptr<void> end,
+                             memory_map_iterator_t it, void* it_data) {
+  static bool unsupported = false;
+  if (unsupported) {
+    return false;
+  }
+  char name[PATH_MAX];
+  remote_ptr<void> addr = start;
+  while (addr < end) {
+    struct procmap_query q;
+    memset(&q, 0, sizeof(q));
+    q.size = sizeof(q);
+    q.query_flags = PROCMAP_QUERY_COVERING_OR_NEXT_VMA;
+    q.query_addr = addr.as_int();
+    q.vma_name_addr = reinterpret_cast<uintptr_t>(name);
+    q.vma_name_size = sizeof(name);
+    if (ioctl(fd, PROCMAP_QUERY, &q) < 0) {
+      if (errno == ENOENT) {
+        // No segments at or after |addr|.
+        return true;
+      }
+      ASSERT(t, addr == start && (errno == ENOTTY || errno == EINVAL))
+          << "PROCMAP_QUERY failed: " << errno_name(errno);
+      unsupported = true;
+      return false;
+    }
+    if (q.vma_start >= end.as_int()) {
+      break;
+    }
+    struct map_iterator_data data;
+    struct mapped_segment_info& info = data.info;
+    info.start_addr = q.vma_start;
+    info.end_addr = q.vma_end;
+    info.prot |= (q.vma_flags & PROCMAP_QUERY_VMA_READABLE) ? PROT_READ : 0;
+    info.prot |= (q.vma_flags & PROCMAP_QUERY_VMA_WRITABLE) ? PROT_WRITE : 0;
+    info.prot |= (q.vma_flags & PROCMAP_QUERY_VMA_EXECUTABLE) ? PROT_EXEC : 0;
+    info.flags =
+        (q.vma_flags & PROCMAP_QUERY_VMA_SHARED) ? MAP_SHARED : MAP_PRIVATE;
+    info.file_offset = q.vma_offset;
+    info.dev_major = q.dev_major;
+    info.dev_minor = q.dev_minor;
+    info.inode = q.inode;
+    if (q.vma_name_size) {
+      info.name = name;
+    }
     it(it_data, t, &data);
+    addr = info.end_addr;
   }
-  fclose(maps_file);
+  return true;
 }
 
 static void print_process_mmap_iterator(void* unused, Task* t,
@@ -230,7 +375,16 @@ static void print_process_mmap(Task* t) {
   iterate_memory_map(t, print_process_mmap_iterator, nullptr);
 }
 
-AddressSpace::~AddressSpace() { session_->on_destroy(this); }
+AddressSpace::~AddressSpace() {
+  for (auto& buf : syscallbuf_pool) {
+    munmap(buf.local, buf.num_bytes);
+    MemoryAccounting::remove(MemoryAccounting::SYSCALLBUF_POOL, buf.num_bytes);
+  }
+  MemoryAccounting::remove(MemoryAccounting::ADDRESS_SPACES,
+                           sizeof(AddressSpace));
+  note_all_shared_mappings(false);
+  session_->on_destroy(this);
+}
 
 void AddressSpace::after_clone() { allocate_watchpoints(); }
 
@@ -284,6 +438,37 @@ remote_ptr<uint8_t> AddressSpace::find_syscall_instruction(Task* t) {
   return vdso().start.cast<uint8_t>() + offset_to_syscall_in_vdso[arch];
 }
 
+/**
+ * Offset of the x86-64 syscall batch stub in the rr page.
+ */
+static const size_t SYSCALL_BATCH_OFFSET = 32;
+
+static const uint8_t x86_64_syscall_batch_slot[] = {
+  0x48, 0x8b, 0x03,       // mov (%rbx),%rax
+  0x48, 0x8b, 0x7b, 0x08, // mov 0x8(%rbx),%rdi
+  0x48, 0x8b, 0x73, 0x10, // mov 0x10(%rbx),%rsi
+  0x48, 0x8b, 0x53, 0x18, // mov 0x18(%rbx),%rdx
+  0x4c, 0x8b, 0x53, 0x20, // mov 0x20(%rbx),%r10
+  0x4c, 0x8b, 0x43, 0x28, // mov 0x28(%rbx),%r8
+  0x4c, 0x8b, 0x4b, 0x30, // mov 0x30(%rbx),%r9
+  0x0f, 0x05,             // syscall
+  0x48, 0x89, 0x43, 0x38, // mov %rax,0x38(%rbx)
+  0x48, 0x83, 0xc3, 0x40  // add $0x40,%rbx
+};
+static_assert(AddressSpace::SYSCALL_BATCH_ENTRY_WORDS * 8 == 0x40,
+              "Batch stub doesn't match the entry size");
+
+remote_ptr<uint8_t> AddressSpace::rr_page_syscall_batch_ip(size_t count) {
+  assert(0 < count && count <= SYSCALL_BATCH_MAX);
+  return rr_page_start().cast<uint8_t>() + SYSCALL_BATCH_OFFSET +
+         (SYSCALL_BATCH_MAX - count) * sizeof(x86_64_syscall_batch_slot);
+}
+
+remote_ptr<uint8_t> AddressSpace::rr_page_syscall_batch_end() {
+  return rr_page_start().cast<uint8_t>() + SYSCALL_BATCH_OFFSET +
+         SYSCALL_BATCH_MAX * sizeof(x86_64_syscall_batch_slot) + 1;
+}
+
 static void write_rr_page(Task* t, ScopedFd& fd) {
   switch (t->arch()) {
     case x86: {
@@ -317,8 +502,21 @@ static void write_rr_page(Task* t, ScopedFd& fd) {
         // rr_page_ip_in_traced_syscall:
         0xc3 // ret
       };
-      ASSERT(t, sizeof(x86_64_data) ==
-                    write(fd, x86_64_data, sizeof(x86_64_data)));
+      uint8_t data[SYSCALL_BATCH_OFFSET +
+                   AddressSpace::SYSCALL_BATCH_MAX *
+                       sizeof(x86_64_syscall_batch_slot) +
+                   1];
+      static_assert(sizeof(x86_64_data) <= SYSCALL_BATCH_OFFSET,
+                    "Batch stub overlaps the syscall entry points");
+      memset(data, 0x90, sizeof(data));
+      memcpy(data, x86_64_data, sizeof(x86_64_data));
+      for (int i = 0; i < AddressSpace::SYSCALL_BATCH_MAX; ++i) {
+        memcpy(data + SYSCALL_BATCH_OFFSET +
+                   i * sizeof(x86_64_syscall_batch_slot),
+               x86_64_syscall_batch_slot, sizeof(x86_64_syscall_batch_slot));
+      }
+      data[sizeof(data) - 1] = 0xcc; // int3
+      ASSERT(t, sizeof(data) == write(fd, data, sizeof(data)));
       break;
   }
 }
@@ -366,8 +564,9 @@ void AddressSpace::map_rr_page(Task* t) {
 void AddressSpace::post_exec_syscall(Task* t) {
   // First locate a syscall instruction we can use for remote syscalls.
   traced_syscall_ip_ = find_syscall_instruction(t);
-  // Now remote syscalls work, we can open_mem_fd.
-  t->open_mem_fd();
+  // Task::post_exec() opened the mem fd if it could. Otherwise, now
+  // remote syscalls work, we can open_mem_fd.
+  t->open_mem_fd_if_needed();
   // Now we can set up the "rr page" at its fixed address. This gives
   // us traced and untraced syscall instructions at known, fixed addresses.
   map_rr_page(t);
@@ -392,6 +591,7 @@ void AddressSpace::brk(remote_ptr<void> addr) {
 void AddressSpace::dump() const {
   fprintf(stderr, "  (heap: %p-%p)\n", (void*)heap.start.as_int(),
           (void*)heap.end.as_int());
+  const MemoryMap& mem = *mem_;
   for (auto it = mem.begin(); it != mem.end(); ++it) {
     const Mapping& m = it->first;
     const MappableResource& r = it->second;
@@ -406,6 +606,9 @@ TrapType AddressSpace::get_breakpoint_type_for_retired_insn(
 }
 
 TrapType AddressSpace::get_breakpoint_type_at_addr(remote_ptr<uint8_t> addr) {
+  if (!breakpoint_page_count(addr)) {
+    return TRAP_NONE;
+  }
   auto it = breakpoints.find(addr);
   return it == breakpoints.end() ? TRAP_NONE : it->second.type();
 }
@@ -419,7 +622,7 @@ void AddressSpace::map(remote_ptr<void> addr, size_t num_bytes, int prot,
   num_bytes = ceil_page_size(num_bytes);
 
   Mapping m(addr, num_bytes, prot, flags, offset_bytes);
-  if (mem.end() != mem.find(m)) {
+  if (mem_->end() != mem_->find(m)) {
     // The mmap() man page doesn't specifically describe
     // what should happen if an existing map is
     // "overwritten" by a new map (of the same resource).
@@ -442,6 +645,10 @@ void AddressSpace::map(remote_ptr<void> addr, size_t num_bytes, int prot,
 template <typename Arch> void AddressSpace::at_preload_init_arch(Task* t) {
   auto params = t->read_mem(
       remote_ptr<rrcall_init_preload_params<Arch> >(t->regs().arg1()));
+  remote_ptr<volatile char> fds_disabled = params.syscallbuf_fds_disabled;
+  remote_ptr<volatile char> fds_nonblocking = params.syscallbuf_fds_nonblocking;
+  syscallbuf_fds_disabled_ = fds_disabled.cast<char>();
+  syscallbuf_fds_nonblocking_ = fds_nonblocking.cast<char>();
 
   ASSERT(t, !t->session().as_record() ||
                 t->session().as_record()->use_syscall_buffer() ==
@@ -456,6 +663,7 @@ template <typename Arch> void AddressSpace::at_preload_init_arch(Task* t) {
     return;
   }
 
+  syscallbuf_sites = params.syscallbuf_sites.rptr();
   monkeypatch_state.patch_at_preload_init(t);
 }
 
@@ -465,8 +673,29 @@ void AddressSpace::at_preload_init(Task* t) {
   RR_ARCH_FUNCTION(at_preload_init_arch, t->arch(), t);
 }
 
+void AddressSpace::note_buffered_syscall_descheduled(Task* t) {
+  if (syscallbuf_sites.is_null()) {
+    return;
+  }
+  const struct syscallbuf_record* rec = next_record(t->syscallbuf_hdr);
+  auto addr = syscallbuf_sites + rec->site;
+  auto site = t->read_mem(addr);
+  ++site.descheds;
+  // Trace the site if at least three quarters of its calls block.
+  if (site.attempts >= SYSCALLBUF_SITE_MIN_ATTEMPTS &&
+      4 * site.descheds >= 3 * site.attempts) {
+    if (!site.trace) {
+      LOG(debug) << "  tracing may-block syscall site slot " << int(rec->site)
+                 << " from now on";
+    }
+    site.trace = 1;
+  }
+  t->write_mem(addr, site);
+}
+
 typedef AddressSpace::MemoryMap::value_type MappingResourcePair;
 MappingResourcePair AddressSpace::mapping_of(remote_ptr<void> addr) const {
+  const MemoryMap& mem = *mem_;
   auto it = mem.find(Mapping(addr, 1));
   assert(it != mem.end());
   assert(it->first.has_subset(Mapping(addr, 1)));
@@ -483,45 +712,60 @@ static off64_t adjust_offset(const MappableResource& r, const Mapping& m,
   return r.id.is_real_device() ? m.offset + delta : 0;
 }
 
+AddressSpace::MemoryMap::iterator AddressSpace::split_mapping_at(
+    remote_ptr<void> addr) {
+  MemoryMap& mem = writable_mem();
+  auto it = mem.find(Mapping(addr, 1));
+  if (it == mem.end() || it->first.start == addr) {
+    return it;
+  }
+  Mapping m = it->first;
+  MappableResource r = it->second;
+  LOG(debug) << "  splitting (" << m << ") at " << addr;
+  // Both halves go back exactly where |m| was, so the hinted inserts
+  // don't need to search the tree.
+  auto next = mem.erase(it);
+  mem.emplace_hint(next, Mapping(m.start, addr, m.prot, m.flags, m.offset),
+                   r);
+  return mem.emplace_hint(next,
+                          Mapping(addr, m.end, m.prot, m.flags,
+                                  adjust_offset(r, m, addr - m.start)),
+                          move(r));
+}
+
 void AddressSpace::protect(remote_ptr<void> addr, size_t num_bytes, int prot) {
   LOG(debug) << "mprotect(" << addr << ", " << num_bytes << ", " << HEX(prot)
              << ")";
 
-  Mapping last_overlap;
-  auto protector = [this, prot, &last_overlap](
-      const Mapping& m, const MappableResource& r, const Mapping& rem) {
-    LOG(debug) << "  protecting (" << rem << ") ...";
-
-    mem.erase(m);
-    LOG(debug) << "  erased (" << m << ")";
-
-    // If the first segment we protect underflows the
-    // region, remap the underflow region with previous
-    // prot.
-    if (m.start < rem.start) {
-      Mapping underflow(m.start, rem.start, m.prot, m.flags, m.offset);
-      mem[underflow] = r;
-    }
-    // Remap the overlapping region with the new prot.
-    remote_ptr<void> new_end = min(rem.end, m.end);
-    Mapping overlap(rem.start, new_end, prot, m.flags,
-                    adjust_offset(r, m, rem.start - m.start));
-    mem[overlap] = r;
-    last_overlap = overlap;
-
-    // If the last segment we protect overflows the
-    // region, remap the overflow region with previous
-    // prot.
-    if (rem.end < m.end) {
-      Mapping overflow(rem.end, m.end, m.prot, m.flags,
-                       adjust_offset(r, m, rem.end - m.start));
-      mem[overflow] = r;
+  remote_ptr<void> region_start = floor_page_size(addr);
+  remote_ptr<void> region_end = ceil_page_size(addr + num_bytes);
+  mark_verify_dirty(region_start, region_end);
+  MemoryMap& mem = writable_mem();
+  // Only the mappings contiguous with |region_start| are protected.
+  auto it = split_mapping_at(region_start);
+  auto last_overlap = mem.end();
+  remote_ptr<void> last_end = region_start;
+  while (it != mem.end() && it->first.start == last_end &&
+         last_end < region_end) {
+    if (region_end < it->first.end) {
+      // The last segment we protect overflows the region, so leave the
+      // overflow with its previous prot.
+      it = prev(split_mapping_at(region_end));
     }
-  };
-  for_each_in_range(addr, num_bytes, protector, ITERATE_CONTIGUOUS);
+    Mapping m = it->first;
+    LOG(debug) << "  protecting (" << m << ") ...";
+    MappableResource r = move(it->second);
+    it = mem.erase(it);
+    last_overlap = mem.emplace_hint(
+        it, Mapping(m.start, m.end, prot, m.flags, m.offset), move(r));
+    last_end = m.end;
+  }
+  if (last_overlap == mem.end()) {
+    return;
+  }
   // All mappings that we altered which might need coalescing
   // are adjacent to |last_overlap|.
-  coalesce_around(mem.find(last_overlap));
+  coalesce_around(last_overlap);
 }
 
 void AddressSpace::remap(remote_ptr<void> old_addr, size_t old_num_bytes,
@@ -565,21 +809,145 @@ bool AddressSpace::add_breakpoint(remote_ptr<uint8_t> addr, TrapType type) {
     }
     t->write_mem(addr, breakpoint_insn);
 
-    auto it_and_is_new = breakpoints.insert(make_pair(addr, Breakpoint()));
-    assert(it_and_is_new.second);
-    it_and_is_new.first->second.overwritten_data = overwritten_data;
-    it = it_and_is_new.first;
+    Breakpoint bp;
+    bp.overwritten_data = overwritten_data;
+    it = insert_breakpoint(addr, bp);
   }
   it->second.ref(type);
   return true;
 }
 
+void AddressSpace::add_breakpoints(vector<remote_ptr<uint8_t> > addrs,
+                                   TrapType type) {
+  sort(addrs.begin(), addrs.end());
+  Task* t = *task_set().begin();
+  vector<uint8_t> buf;
+  size_t i = 0;
+  while (i < addrs.size()) {
+    // Set the new breakpoints in the page of addrs[i] with one read and
+    // one write covering all of them.
+    remote_ptr<void> page = floor_page_size(addrs[i]);
+    size_t end = i;
+    remote_ptr<uint8_t> first_new = nullptr;
+    remote_ptr<uint8_t> last_new = nullptr;
+    for (; end < addrs.size() && floor_page_size(addrs[end]) == page; ++end) {
+      if (breakpoints.find(addrs[end]) == breakpoints.end()) {
+        first_new = first_new.is_null() ? addrs[end] : first_new;
+        last_new = addrs[end];
+      }
+    }
+    if (!first_new.is_null()) {
+      size_t len = last_new - first_new + 1;
+      buf.resize(len);
+      if (t->read_bytes_fallible(first_new, len, buf.data()) != ssize_t(len)) {
+        // Let add_breakpoint() sort out which ones can be set.
+        for (; i < end; ++i) {
+          add_breakpoint(addrs[i], type);
+        }
+        continue;
+      }
+      for (size_t j = i; j < end; ++j) {
+        if (breakpoints.find(addrs[j]) == breakpoints.end()) {
+          Breakpoint bp;
+          bp.overwritten_data = buf[addrs[j] - first_new];
+          insert_breakpoint(addrs[j], bp);
+          buf[addrs[j] - first_new] = breakpoint_insn;
+        }
+      }
+      t->write_bytes_helper(first_new, len, buf.data());
+    }
+    for (; i < end; ++i) {
+      breakpoints.find(addrs[i])->second.ref(type);
+    }
+  }
+}
+
 void AddressSpace::remove_all_breakpoints() {
-  while (!breakpoints.empty()) {
-    destroy_breakpoint(breakpoints.begin());
+  if (breakpoints.empty()) {
+    return;
+  }
+  vector<remote_ptr<uint8_t> > addrs;
+  for (auto& it : breakpoints) {
+    addrs.push_back(it.first);
+  }
+  sort(addrs.begin(), addrs.end());
+  // Restore the overwritten bytes with one read and one write per page.
+  Task* t = *task_set().begin();
+  vector<uint8_t> buf;
+  size_t i = 0;
+  while (i < addrs.size()) {
+    remote_ptr<void> page = floor_page_size(addrs[i]);
+    size_t end = i + 1;
+    while (end < addrs.size() && floor_page_size(addrs[end]) == page) {
+      ++end;
+    }
+    size_t len = addrs[end - 1] - addrs[i] + 1;
+    buf.resize(len);
+    if (t->read_bytes_fallible(addrs[i], len, buf.data()) != ssize_t(len)) {
+      for (; i < end; ++i) {
+        destroy_breakpoint(breakpoints.find(addrs[i]));
+      }
+      continue;
+    }
+    for (size_t j = i; j < end; ++j) {
+      buf[addrs[j] - addrs[i]] =
+          breakpoints.find(addrs[j])->second.overwritten_data;
+    }
+    t->write_bytes_helper(addrs[i], len, buf.data());
+    for (; i < end; ++i) {
+      erase_breakpoint(breakpoints.find(addrs[i]));
+    }
   }
 }
 
+void AddressSpace::suspend_breakpoints(remote_ptr<uint8_t> addr, size_t len) {
+  assert(suspended_breakpoints.empty());
+  for (size_t i = 0; i < len; ++i) {
+    if (!breakpoint_page_count(addr + i)) {
+      continue;
+    }
+    auto it = breakpoints.find(addr + i);
+    if (it != breakpoints.end()) {
+      suspended_breakpoints.insert(*it);
+      destroy_breakpoint(it);
+    }
+  }
+}
+
+void AddressSpace::resume_breakpoints() {
+  if (task_set().empty()) {
+    // The tasks exited or exec'd while the breakpoints were suspended.
+    suspended_breakpoints.clear();
+    return;
+  }
+  Task* t = *task_set().begin();
+  for (auto& it : suspended_breakpoints) {
+    Breakpoint bp = it.second;
+    if (sizeof(bp.overwritten_data) !=
+        t->read_bytes_fallible(it.first, sizeof(bp.overwritten_data),
+                               &bp.overwritten_data)) {
+      continue;
+    }
+    t->write_mem(it.first, breakpoint_insn);
+    insert_breakpoint(it.first, bp);
+  }
+  suspended_breakpoints.clear();
+}
+
+AddressSpace::BreakpointMap::iterator AddressSpace::insert_breakpoint(
+    remote_ptr<uint8_t> addr, const Breakpoint& bp) {
+  auto it_and_is_new = breakpoints.insert(make_pair(addr, bp));
+  assert(it_and_is_new.second);
+  ++breakpoint_page_count(addr);
+  return it_and_is_new.first;
+}
+
+void AddressSpace::erase_breakpoint(BreakpointMap::const_iterator it) {
+  assert(breakpoint_page_count(it->first) > 0);
+  --breakpoint_page_count(it->first);
+  breakpoints.erase(it);
+}
+
 int AddressSpace::access_bits_of(WatchType type) {
   switch (type) {
     case WATCH_EXEC:
@@ -663,11 +1031,18 @@ bool AddressSpace::update_watchpoint_value(const MemoryRange& range,
 void AddressSpace::update_watchpoint_values(remote_ptr<void> start,
                                             remote_ptr<void> end) {
   MemoryRange r(start, end);
-  for (auto& it : watchpoints) {
+  vector<WatchpointIterator> wps;
+  for (auto it = watchpoints.begin(); it != watchpoints.end(); ++it) {
+    if (it->first.intersects(r)) {
+      wps.push_back(it);
+    }
+  }
+  // We do nothing to track kernel reads of read-write watchpoints...
+  update_watchpoint_values(wps, 0);
+  for (auto& it : page_watches) {
     if (it.first.intersects(r) &&
-        update_watchpoint_value(it.first, it.second)) {
+        update_page_watch_value(it.first, it.second)) {
       it.second.changed = true;
-      // We do nothing to track kernel reads of read-write watchpoints...
     }
   }
 }
@@ -678,16 +1053,52 @@ static bool watchpoint_triggered(uintptr_t debug_status, int8_t reg) {
   return reg >= 0 && (debug_status & DR_WATCHPOINT(reg));
 }
 
-void AddressSpace::notify_watchpoint_fired(uintptr_t debug_status) {
-  for (auto& it : watchpoints) {
-    if (update_watchpoint_value(it.first, it.second) ||
-        watchpoint_triggered(debug_status, it.second.in_register_exec) ||
-        watchpoint_triggered(debug_status, it.second.in_register_readwrite)) {
-      it.second.changed = true;
+void AddressSpace::update_watchpoint_values(
+    const vector<WatchpointIterator>& wps, uintptr_t debug_status) {
+  if (wps.empty()) {
+    return;
+  }
+  Task* t = *task_set().begin();
+  vector<vector<uint8_t> > values(wps.size());
+  vector<RemoteIovec> ranges;
+  for (size_t i = 0; i < wps.size(); ++i) {
+    values[i].resize(wps[i]->first.num_bytes);
+    ranges.push_back(
+        { wps[i]->first.addr, values[i].data(), values[i].size() });
+  }
+  ssize_t nread = t->read_bytes_fallible(ranges);
+
+  for (size_t i = 0; i < wps.size(); ++i) {
+    Watchpoint& w = wps[i]->second;
+    bool changed;
+    if (nread >= (ssize_t)ranges[i].size) {
+      nread -= ranges[i].size;
+      changed = !w.valid ||
+                memcmp(values[i].data(), w.value_bytes.data(),
+                       values[i].size()) != 0;
+      w.valid = true;
+      w.value_bytes.swap(values[i]);
+    } else {
+      // Some of this range (or an earlier one) couldn't be read. Let
+      // update_watchpoint_value() work out which parts are mapped.
+      nread = 0;
+      changed = update_watchpoint_value(wps[i]->first, w);
+    }
+    if (changed || watchpoint_triggered(debug_status, w.in_register_exec) ||
+        watchpoint_triggered(debug_status, w.in_register_readwrite)) {
+      w.changed = true;
     }
   }
 }
 
+void AddressSpace::notify_watchpoint_fired(uintptr_t debug_status) {
+  vector<WatchpointIterator> wps;
+  for (auto it = watchpoints.begin(); it != watchpoints.end(); ++it) {
+    wps.push_back(it);
+  }
+  update_watchpoint_values(wps, debug_status);
+}
+
 void AddressSpace::notify_written(remote_ptr<void> addr, size_t num_bytes) {
   update_watchpoint_values(addr, addr + num_bytes);
   session()->accumulate_bytes_written(num_bytes);
@@ -702,6 +1113,99 @@ bool AddressSpace::consume_watchpoint_change(remote_ptr<void>* addr) {
       it.second.changed = false;
     }
   }
+  for (auto& it : page_watches) {
+    if (it.second.changed) {
+      changed = true;
+      *addr = it.first.addr;
+      it.second.changed = false;
+    }
+  }
+  return changed;
+}
+
+bool AddressSpace::update_page_watch_value(const MemoryRange& range,
+                                           PageWatch& watch) {
+  Task* t = *task_set().begin();
+  vector<uint8_t> value(range.num_bytes);
+  ssize_t nread =
+      t->read_bytes_fallible(range.addr, value.size(), value.data());
+  value.resize(max<ssize_t>(nread, 0));
+  bool changed = value != watch.value;
+  watch.value.swap(value);
+  return changed;
+}
+
+void AddressSpace::add_page_watch(remote_ptr<void> addr, size_t num_bytes) {
+  assert(protected_watch_pages.empty());
+  MemoryRange range(addr, num_bytes);
+  PageWatch& watch = page_watches[range];
+  watch.changed = false;
+  update_page_watch_value(range, watch);
+}
+
+void AddressSpace::remove_all_page_watches(Task* t) {
+  unprotect_page_watches(t);
+  page_watches.clear();
+}
+
+void AddressSpace::protect_page_watches(Task* t) {
+  if (page_watches.empty() || !protected_watch_pages.empty()) {
+    return;
+  }
+  for (auto& it : page_watches) {
+    for (remote_ptr<void> page = floor_page_size(it.first.addr);
+         page < it.first.end(); page += page_size()) {
+      auto protect = [this, page](const Mapping& m, const MappableResource& r,
+                                  const Mapping& rem) {
+        // Writes by rr through /proc/<pid>/mem can't bypass the protection
+        // of shared mappings, so leave those alone.
+        if ((m.prot & PROT_WRITE) && !(m.flags & MAP_SHARED)) {
+          protected_watch_pages[page] = m.prot;
+        }
+      };
+      for_each_in_range(page, page_size(), protect);
+    }
+  }
+  if (protected_watch_pages.empty()) {
+    return;
+  }
+
+  AutoRemoteSyscalls remote(t);
+  for (auto& it : protected_watch_pages) {
+    long ret = remote.syscall(syscall_number_for_mprotect(remote.arch()),
+                              it.first, page_size(), it.second & ~PROT_WRITE);
+    ASSERT(t, ret == 0) << "Failed to protect watched page " << it.first;
+  }
+  update_page_watch_values(false);
+}
+
+void AddressSpace::unprotect_page_watches(Task* t) {
+  if (protected_watch_pages.empty()) {
+    return;
+  }
+  AutoRemoteSyscalls remote(t);
+  for (auto& it : protected_watch_pages) {
+    long ret = remote.syscall(syscall_number_for_mprotect(remote.arch()),
+                              it.first, page_size(), it.second);
+    ASSERT(t, ret == 0) << "Failed to unprotect watched page " << it.first;
+  }
+  protected_watch_pages.clear();
+}
+
+bool AddressSpace::is_page_watch_fault(remote_ptr<void> addr) const {
+  return protected_watch_pages.count(floor_page_size(addr)) > 0;
+}
+
+bool AddressSpace::update_page_watch_values(bool report_changes) {
+  bool changed = false;
+  for (auto& it : page_watches) {
+    if (update_page_watch_value(it.first, it.second)) {
+      changed = true;
+      if (report_changes) {
+        it.second.changed = true;
+      }
+    }
+  }
   return changed;
 }
 
@@ -714,29 +1218,108 @@ void AddressSpace::unmap(remote_ptr<void> addr, ssize_t num_bytes) {
   LOG(debug) << "munmap(" << addr << ", " << num_bytes << ")";
   num_bytes = ceil_page_size(num_bytes);
 
-  auto unmapper = [this](const Mapping& m, const MappableResource& r,
-                         const Mapping& rem) {
-    LOG(debug) << "  unmapping (" << rem << ") ...";
+  // Split the segments that underflow or overflow the unmap region, then
+  // erase everything in between.
+  remote_ptr<void> region_start = floor_page_size(addr);
+  remote_ptr<void> region_end = ceil_page_size(addr + num_bytes);
+  mark_verify_dirty(region_start, region_end);
+  MemoryMap& mem = writable_mem();
+  split_mapping_at(region_end);
+  split_mapping_at(region_start);
+  auto first = mem.lower_bound(Mapping(region_start, region_end));
+  auto last = first;
+  while (last != mem.end() && last->first.start < region_end) {
+    LOG(debug) << "  unmapping (" << last->first << ") ...";
+    add_shared_mapping_bytes(last->second, -last->first.num_bytes());
+    ++last;
+  }
+  mem.erase(first, last);
+  update_watchpoint_values(addr, addr + num_bytes);
+}
 
-    mem.erase(m);
-    LOG(debug) << "  erased (" << m << ") ...";
+void AddressSpace::add_scratch_region(const MemoryRange& range) {
+  scratch_regions_.push_back(range);
+}
 
-    // If the first segment we unmap underflows the unmap
-    // region, remap the underflow region.
-    if (m.start < rem.start) {
-      Mapping underflow(m.start, rem.start, m.prot, m.flags, m.offset);
-      mem[underflow] = r;
+void AddressSpace::clear_scratch_regions() {
+  scratch_regions_.clear();
+  scratch_reservations.clear();
+}
+
+bool AddressSpace::is_scratch_region_start(remote_ptr<void> addr) const {
+  for (auto& r : scratch_regions_) {
+    if (r.addr == addr) {
+      return true;
     }
-    // If the last segment we unmap overflows the unmap
-    // region, remap the overflow region.
-    if (rem.end < m.end) {
-      Mapping overflow(rem.end, m.end, m.prot, m.flags,
-                       adjust_offset(r, m, rem.end - m.start));
-      mem[overflow] = r;
+  }
+  return false;
+}
+
+MemoryRange AddressSpace::free_scratch() const {
+  MemoryRange best(remote_ptr<void>(), size_t(0));
+  for (auto& region : scratch_regions_) {
+    // Walk the region's gaps between reservations. Reservations are
+    // keyed by task, so order them by address first.
+    vector<MemoryRange> used;
+    for (auto& kv : scratch_reservations) {
+      if (kv.second.intersects(region)) {
+        used.push_back(kv.second);
+      }
     }
-  };
-  for_each_in_range(addr, num_bytes, unmapper);
-  update_watchpoint_values(addr, addr + num_bytes);
+    sort(used.begin(), used.end());
+    remote_ptr<void> gap_start = region.addr;
+    for (auto& u : used) {
+      if (u.addr > gap_start && size_t(u.addr - gap_start) > best.num_bytes) {
+        best = MemoryRange(gap_start, u.addr);
+      }
+      gap_start = max(gap_start, u.end());
+    }
+    if (region.end() > gap_start &&
+        size_t(region.end() - gap_start) > best.num_bytes) {
+      best = MemoryRange(gap_start, region.end());
+    }
+  }
+  return best;
+}
+
+void AddressSpace::reserve_scratch(Task* t, const MemoryRange& range) {
+  for (auto& kv : scratch_reservations) {
+    assert(kv.first == t || !kv.second.intersects(range));
+  }
+  scratch_reservations.erase(t);
+  scratch_reservations.insert(make_pair(t, range));
+}
+
+void AddressSpace::release_scratch(Task* t) { scratch_reservations.erase(t); }
+
+/**
+ * Thread-per-request servers exit and create threads at about the same
+ * rate, so a few pooled syscallbufs cover them.
+ */
+static const size_t SYSCALLBUF_POOL_SIZE = 16;
+
+bool AddressSpace::pool_syscallbuf(const PooledSyscallbuf& buf) {
+  if (syscallbuf_pool.size() >= SYSCALLBUF_POOL_SIZE) {
+    return false;
+  }
+  syscallbuf_pool.push_back(buf);
+  MemoryAccounting::add(MemoryAccounting::SYSCALLBUF_POOL, buf.num_bytes);
+  return true;
+}
+
+bool AddressSpace::take_pooled_syscallbuf(remote_ptr<void> addr,
+                                          PooledSyscallbuf* buf) {
+  for (auto it = syscallbuf_pool.rbegin(); it != syscallbuf_pool.rend();
+       ++it) {
+    if (addr.is_null() || it->child == addr) {
+      *buf = *it;
+      syscallbuf_pool.erase(next(it).base());
+      MemoryAccounting::remove(MemoryAccounting::SYSCALLBUF_POOL,
+                               buf->num_bytes);
+      return true;
+    }
+  }
+  return false;
 }
 
 /**
@@ -825,8 +1408,19 @@ static PseudoDevice pseudodevice_for_name(const string& name) {
 struct VerifyAddressSpace {
   typedef AddressSpace::MemoryMap::const_iterator const_iterator;
 
-  VerifyAddressSpace(const AddressSpace* as)
-      : as(as), it(as->mem.begin()), phase(NO_PHASE) {}
+  /**
+   * Check the cached mappings [begin, end) against the kernel segments
+   * overlapping [window_start, window_end).
+   */
+  VerifyAddressSpace(const AddressSpace* as, const_iterator begin,
+                     const_iterator end, remote_ptr<void> window_start,
+                     remote_ptr<void> window_end)
+      : as(as),
+        it(begin),
+        end(end),
+        window_start(window_start),
+        window_end(window_end),
+        phase(NO_PHASE) {}
 
   /**
    * |km| and |m| are the same mapping of the same resource, or
@@ -843,8 +1437,12 @@ struct VerifyAddressSpace {
   /* The resource that |km| and |m| map. */
   MappableResource r;
   const AddressSpace* as;
-  /* Iterator over mappings in |as|. */
+  /* Iterator over mappings in |as|, and where to stop. */
   const_iterator it;
+  const_iterator end;
+  /* Kernel segments outside this range are ignored. */
+  remote_ptr<void> window_start;
+  remote_ptr<void> window_end;
   /* Which mapping-checking phase we're in.  See below. */
   enum {
     NO_PHASE,
@@ -917,14 +1515,18 @@ void VerifyAddressSpace::assert_segments_match(Task* t) {
 /*static*/ void AddressSpace::check_segment_iterator(
     void* pvas, Task* t, const struct map_iterator_data* data) {
   VerifyAddressSpace* vas = static_cast<VerifyAddressSpace*>(pvas);
-  const AddressSpace* as = vas->as;
   const struct mapped_segment_info& info = data->info;
 
+  if (info.end_addr <= vas->window_start ||
+      vas->window_end <= info.start_addr) {
+    return;
+  }
   LOG(debug) << "examining /proc/maps segment " << info;
 
   // Merge adjacent cached mappings.
   if (vas->NO_PHASE == vas->phase) {
-    assert(vas->it != as->mem.end());
+    ASSERT(t, vas->it != vas->end) << "Kernel segment " << info
+                                   << " isn't in the cached mappings";
 
     vas->phase = vas->MERGING_CACHED;
     // Start of next segment range to match.
@@ -932,7 +1534,7 @@ void VerifyAddressSpace::assert_segments_match(Task* t) {
     vas->r = vas->it->second.to_kernel();
     do {
       ++vas->it;
-    } while (vas->it != as->mem.end() &&
+    } while (vas->it != vas->end &&
              try_merge_adjacent(&vas->m, vas->r, vas->it->first.to_kernel(),
                                 vas->it->second.to_kernel()));
     vas->phase = vas->INITING_KERNEL;
@@ -961,7 +1563,8 @@ void VerifyAddressSpace::assert_segments_match(Task* t) {
                  // gc.  So this suffices for now.
            ||
            string::npos != kr.fsname.find(SHMEM_FS "/rr-emufs") ||
-           string::npos != kr.fsname.find(SHMEM_FS2 "/rr-emufs"));
+           string::npos != kr.fsname.find(SHMEM_FS2 "/rr-emufs") ||
+           string::npos != kr.fsname.find("/memfd:rr-emufs"));
     vas->km = km;
     vas->r = kr;
     vas->phase = vas->MERGING_KERNEL;
@@ -985,14 +1588,140 @@ Mapping AddressSpace::vdso() const {
   return mapping_of(vdso_start_addr).first;
 }
 
+static void collect_segment_iterator(void* pv, Task* t,
+                                     const struct map_iterator_data* data) {
+  auto segments = static_cast<vector<map_iterator_data>*>(pv);
+  segments->push_back(*data);
+  segments->back().raw_map_line = nullptr;
+}
+
+AddressSpace::VerifyWindow AddressSpace::verify_window_for(
+    const MemoryRange& range) const {
+  // Widen the range to whole runs of contiguous cached mappings, since
+  // both we and the kernel may merge across the range's edges.
+  const MemoryMap& mem = *mem_;
+  VerifyWindow w;
+  w.begin = mem.lower_bound(Mapping(range.addr, range.end()));
+  while (w.begin != mem.begin() && w.begin != mem.end() &&
+         prev(w.begin)->first.end == w.begin->first.start) {
+    --w.begin;
+  }
+  w.end = w.begin;
+  while (w.end != mem.end() && w.end->first.start < range.end()) {
+    ++w.end;
+  }
+  while (w.end != w.begin && w.end != mem.end() &&
+         prev(w.end)->first.end == w.end->first.start) {
+    ++w.end;
+  }
+  w.start = range.addr;
+  if (w.begin != mem.end()) {
+    w.start = min(w.start, w.begin->first.start);
+  }
+  w.finish = range.end();
+  if (w.end != w.begin) {
+    w.finish = max(w.finish, prev(w.end)->first.end);
+  }
+  return w;
+}
+
 void AddressSpace::verify(Task* t) const {
   assert(task_set().end() != task_set().find(t));
 
-  VerifyAddressSpace vas(this);
-  iterate_memory_map(t, check_segment_iterator, &vas);
+  vector<VerifyWindow> windows;
+  bool check_all =
+      verify_all_dirty || ++verify_count % FULL_VERIFY_INTERVAL == 0;
+  if (check_all) {
+    // Also catch changes we never heard about, e.g. from syscalls we
+    // don't model.
+    windows.push_back({ mem_->begin(), mem_->end(), nullptr,
+                        remote_ptr<void>(numeric_limits<uintptr_t>::max()) });
+  } else {
+    sort(verify_dirty_ranges.begin(), verify_dirty_ranges.end());
+    for (auto& range : verify_dirty_ranges) {
+      VerifyWindow w = verify_window_for(range);
+      if (!windows.empty() && w.start <= windows.back().finish) {
+        windows.back().end = w.end;
+        windows.back().finish = max(windows.back().finish, w.finish);
+      } else {
+        windows.push_back(w);
+      }
+    }
+  }
+  verify_dirty_ranges.clear();
+  verify_all_dirty = false;
+  if (windows.empty()) {
+    return;
+  }
 
-  assert(vas.MERGING_KERNEL == vas.phase);
-  vas.assert_segments_match(t);
+  vector<map_iterator_data> segments;
+  bool queried = false;
+  if (!check_all) {
+    // Ask the kernel for just the segments in the windows, so a large
+    // process doesn't cost us its whole /proc/maps each time.
+    char maps_path[PATH_MAX];
+    snprintf(maps_path, sizeof(maps_path) - 1, "/proc/%d/maps", t->tid);
+    ScopedFd fd(maps_path, O_RDONLY | O_CLOEXEC);
+    queried = fd.is_open();
+    for (auto& w : windows) {
+      if (!queried) {
+        break;
+      }
+      queried = query_memory_map(t, fd, w.start, w.finish,
+                                 collect_segment_iterator, &segments);
+    }
+  }
+  if (!queried) {
+    segments.clear();
+    iterate_memory_map(t, collect_segment_iterator, &segments);
+  }
+  for (auto& w : windows) {
+    VerifyAddressSpace vas(this, w.begin, w.end, w.start, w.finish);
+    for (auto& data : segments) {
+      check_segment_iterator(&vas, t, &data);
+    }
+    if (vas.NO_PHASE == vas.phase) {
+      ASSERT(t, vas.it == vas.end) << "Cached mapping " << vas.it->first
+                                   << " isn't mapped by the kernel";
+      continue;
+    }
+    assert(vas.MERGING_KERNEL == vas.phase);
+    vas.assert_segments_match(t);
+  }
+}
+
+void AddressSpace::add_shared_mapping_bytes(const MappableResource& r,
+                                            ssize_t delta) {
+  if (!r.is_shared_mmap_file()) {
+    return;
+  }
+  size_t& bytes = shared_mapping_bytes[r.id];
+  bool was_mapped = bytes > 0;
+  bytes += delta;
+  bool is_mapped = bytes > 0;
+  if (!is_mapped) {
+    shared_mapping_bytes.erase(r.id);
+  }
+  // A clone doesn't have a session until Session::clone() gives it one,
+  // and tells the session about all our shared files then.
+  if (session_ && was_mapped != is_mapped) {
+    session_->on_shared_mapping_change(r.id, is_mapped);
+  }
+}
+
+void AddressSpace::note_all_shared_mappings(bool mapped) {
+  for (auto& kv : shared_mapping_bytes) {
+    session_->on_shared_mapping_change(kv.first, mapped);
+  }
+}
+
+void AddressSpace::mark_verify_dirty(remote_ptr<void> start,
+                                     remote_ptr<void> end) {
+  verify_dirty_ranges.push_back(MemoryRange(start, end));
+  page_checksums_.erase(page_checksums_.lower_bound(start),
+                        page_checksums_.lower_bound(end));
+  recorded_file_pages_.erase(recorded_file_pages_.lower_bound(start),
+                             recorded_file_pages_.lower_bound(end));
 }
 
 AddressSpace::AddressSpace(Task* t, const string& exe, uint32_t exec_count)
@@ -1001,8 +1730,13 @@ AddressSpace::AddressSpace(Task* t, const string& exe, uint32_t exec_count)
       leader_serial(t->tuid().serial()),
       exec_count(exec_count),
       is_clone(false),
+      mem_(make_shared<MemoryMap>()),
       session_(&t->session()),
-      child_mem_fd(-1) {
+      child_mem_fd(-1),
+      verify_all_dirty(true),
+      verify_count(0) {
+  MemoryAccounting::add(MemoryAccounting::ADDRESS_SPACES, sizeof(AddressSpace));
+  memset(breakpoint_page_filter, 0, sizeof(breakpoint_page_filter));
   // TODO: this is a workaround of
   // https://github.com/mozilla/rr/issues/1113 .
   if (session_->can_validate()) {
@@ -1033,17 +1767,25 @@ AddressSpace::AddressSpace(Task* t, const AddressSpace& o, uint32_t exec_count)
       exec_count(exec_count),
       heap(o.heap),
       is_clone(true),
-      mem(o.mem),
+      mem_(o.mem_),
+      shared_mapping_bytes(o.shared_mapping_bytes),
       session_(nullptr),
       vdso_start_addr(o.vdso_start_addr),
       monkeypatch_state(o.monkeypatch_state),
       traced_syscall_ip_(o.traced_syscall_ip_),
       untraced_syscall_ip_(o.untraced_syscall_ip_),
       syscallbuf_lib_start_(o.syscallbuf_lib_start_),
-      syscallbuf_lib_end_(o.syscallbuf_lib_end_) {
-  for (auto& it : o.breakpoints) {
-    breakpoints.insert(make_pair(it.first, it.second));
-  }
+      syscallbuf_lib_end_(o.syscallbuf_lib_end_),
+      syscallbuf_sites(o.syscallbuf_sites),
+      syscallbuf_fds_disabled_(o.syscallbuf_fds_disabled_),
+      syscallbuf_fds_nonblocking_(o.syscallbuf_fds_nonblocking_),
+      verify_all_dirty(true),
+      verify_count(0),
+      scratch_regions_(o.scratch_regions_) {
+  MemoryAccounting::add(MemoryAccounting::ADDRESS_SPACES, sizeof(AddressSpace));
+  memcpy(breakpoint_page_filter, o.breakpoint_page_filter,
+         sizeof(breakpoint_page_filter));
+  breakpoints = o.breakpoints;
   for (auto& it : o.watchpoints) {
     watchpoints.insert(make_pair(it.first, it.second));
   }
@@ -1136,6 +1878,8 @@ bool AddressSpace::allocate_watchpoints() {
 }
 
 void AddressSpace::coalesce_around(MemoryMap::iterator it) {
+  // |it| came from a writable map, so this doesn't copy.
+  MemoryMap& mem = writable_mem();
   Mapping m = it->first;
   MappableResource r = it->second;
 
@@ -1165,16 +1909,14 @@ void AddressSpace::coalesce_around(MemoryMap::iterator it) {
             first_kv->first.offset);
   LOG(debug) << "  coalescing " << c;
 
-  mem.erase(first_kv, ++last_kv);
-
-  auto ins = mem.insert(MemoryMap::value_type(c, r));
-  assert(ins.second); // key didn't already exist
+  auto next = mem.erase(first_kv, ++last_kv);
+  mem.emplace_hint(next, c, move(r));
 }
 
 void AddressSpace::destroy_breakpoint(BreakpointMap::const_iterator it) {
   Task* t = *task_set().begin();
   t->write_mem(it->first, it->second.overwritten_data);
-  breakpoints.erase(it);
+  erase_breakpoint(it);
 }
 
 void AddressSpace::for_each_in_range(
@@ -1185,21 +1927,22 @@ void AddressSpace::for_each_in_range(
   remote_ptr<void> region_start = floor_page_size(addr);
   remote_ptr<void> last_unmapped_end = region_start;
   remote_ptr<void> region_end = ceil_page_size(addr + num_bytes);
+  if (last_unmapped_end >= region_end) {
+    return;
+  }
+  const MemoryMap& mem = *mem_;
+  auto it = mem.lower_bound(Mapping(region_start, region_end));
   while (last_unmapped_end < region_end) {
     // Invariant: |rem| is always exactly the region of
-    // memory remaining to be examined for pages to be
-    // unmapped.
+    // memory remaining to be examined.
     Mapping rem(last_unmapped_end, region_end);
 
-    // The next page to iterate may not be contiguous with
-    // the last one seen.
-    auto it = mem.lower_bound(rem);
     if (mem.end() == it) {
       LOG(debug) << "  not found, done.";
       return;
     }
 
-    Mapping m = it->first;
+    const Mapping& m = it->first;
     if (rem.end <= m.start) {
       LOG(debug) << "  mapping at " << m.start << " out of range, done.";
       return;
@@ -1210,17 +1953,17 @@ void AddressSpace::for_each_in_range(
       return;
     }
 
-    MappableResource r = it->second;
-    f(m, r, rem);
+    f(m, it->second, rem);
 
     // Maintain the loop invariant.
     last_unmapped_end = m.end;
+    ++it;
   }
 }
 
 void AddressSpace::for_all_mappings(
     std::function<void(const Mapping& m, const MappableResource& r)> f) {
-  for (auto& m : mem) {
+  for (auto& m : *mem_) {
     f(m.first, m.second);
   }
 }
@@ -1229,8 +1972,10 @@ void AddressSpace::map_and_coalesce(const Mapping& m,
                                     const MappableResource& r) {
   LOG(debug) << "  mapping " << m;
 
-  auto ins = mem.insert(MemoryMap::value_type(m, r));
+  mark_verify_dirty(m.start, m.end);
+  auto ins = writable_mem().insert(MemoryMap::value_type(m, r));
   assert(ins.second); // key didn't already exist
+  add_shared_mapping_bytes(r, m.num_bytes());
   coalesce_around(ins.first);
 
   update_watchpoint_values(m.start, m.end);
@@ -9,6 +9,8 @@
 #include <map>
 #include <memory>
 #include <set>
+#include <unordered_map>
+#include <vector>
 
 #include "preload/preload_interface.h"
 
@@ -350,6 +352,11 @@ struct MappableResource {
    * system.
    */
   std::string fsname;
+  /**
+   * During replay, the file in or next to the trace that was mapped
+   * instead of |fsname|, if any. Debuggers read it to load symbols.
+   */
+  std::string backing_fsname;
 
   static ino_t nr_anonymous_maps;
 };
@@ -516,7 +523,7 @@ public:
   /**
    * Return the memory map.
    */
-  const MemoryMap& memmap() const { return mem; }
+  const MemoryMap& memmap() const { return *mem_; }
 
   /**
    * Change the protection bits of [addr, addr + num_bytes) to
@@ -539,6 +546,13 @@ public:
 
   /** Ensure a breakpoint of |type| is set at |addr|. */
   bool add_breakpoint(remote_ptr<uint8_t> addr, TrapType type);
+  /**
+   * Like calling add_breakpoint() for each of |addrs|, but tracee memory
+   * is read and written once per page instead of once per breakpoint.
+   * Breakpoints that can't be set are skipped.
+   */
+  void add_breakpoints(std::vector<remote_ptr<uint8_t> > addrs,
+                       TrapType type);
   /**
    * Remove a |type| reference to the breakpoint at |addr|.  If
    * the removed reference was the last, the breakpoint is
@@ -550,6 +564,12 @@ public:
    * reference counts.
    */
   void remove_all_breakpoints();
+  /**
+   * Temporarily remove the breakpoints in [addr, addr + len) and restore
+   * the memory they overwrote, until resume_breakpoints() is called.
+   */
+  void suspend_breakpoints(remote_ptr<uint8_t> addr, size_t len);
+  void resume_breakpoints();
 
   /**
    * Manage watchpoints.  Analogous to breakpoint-managing
@@ -584,6 +604,39 @@ public:
    */
   bool consume_watchpoint_change(remote_ptr<void>* addr);
 
+  /**
+   * Manage write watchpoints implemented by write-protecting the pages they
+   * are on, for use during replay when the debug registers run out. While
+   * the pages are protected, ReplaySession steps faulting tasks over the
+   * write and recomputes the watched values. Page watches are reported
+   * through consume_watchpoint_change() like ordinary watchpoints.
+   */
+  void add_page_watch(remote_ptr<void> addr, size_t num_bytes);
+  void remove_all_page_watches(Task* t);
+  bool has_page_watches() const { return !page_watches.empty(); }
+  /**
+   * Write-protect the watched pages if they aren't already, using remote
+   * syscalls in |t|. Only private writable pages are protected; writes to
+   * other watched pages aren't caught this way.
+   */
+  void protect_page_watches(Task* t);
+  /**
+   * Restore the original protection of the watched pages, if they're
+   * protected.
+   */
+  void unprotect_page_watches(Task* t);
+  /**
+   * Return true if a fault at |addr| was caused by protect_page_watches().
+   */
+  bool is_page_watch_fault(remote_ptr<void> addr) const;
+  /**
+   * Reread the watched values after a write to a watched page. If
+   * |report_changes|, remember changed watches for
+   * consume_watchpoint_change(); otherwise just refresh the values. Return
+   * true if any value changed.
+   */
+  bool update_page_watch_values(bool report_changes);
+
   /**
    * Replace all our user breakpoints with the user breakpoints of 'o'.
    * Asserts that there are no internal breakpoints currently set.
@@ -603,9 +656,81 @@ public:
   /** Return the vdso mapping of this. */
   Mapping vdso() const;
 
+  /**
+   * Scratch memory is shared by all the tasks in this address space.
+   * Each task blocked in a switchable syscall holds a reservation of
+   * the scratch its parameters were moved to; new syscalls are given the
+   * largest range nobody has reserved. Regions are added when the
+   * address space is created and when a syscall needs more scratch than
+   * is free.
+   */
+  bool has_scratch() const { return !scratch_regions_.empty(); }
+  const std::vector<MemoryRange>& scratch_regions() const {
+    return scratch_regions_;
+  }
+  void add_scratch_region(const MemoryRange& range);
+  /**
+   * Forget all scratch regions. The caller unmaps them.
+   */
+  void clear_scratch_regions();
+  bool is_scratch_region_start(remote_ptr<void> addr) const;
+  /**
+   * Return the largest range of scratch not reserved by any task. Its
+   * size is zero if there's none.
+   */
+  MemoryRange free_scratch() const;
+  /**
+   * Reserve |range|, which must be free scratch, for |t| until
+   * release_scratch(t). A task holds at most one reservation.
+   */
+  void reserve_scratch(Task* t, const MemoryRange& range);
+  void release_scratch(Task* t);
+
+  /**
+   * A syscallbuf no task is using, still mapped in the tracee at |child|
+   * and in rr at |local|.
+   */
+  struct PooledSyscallbuf {
+    remote_ptr<void> child;
+    void* local;
+    size_t num_bytes;
+  };
+  /**
+   * Keep |buf|, the syscallbuf of a thread that's exiting, for a thread
+   * created later, so that thread's setup needs no remote syscalls.
+   * Returns false if the pool is full; the caller unmaps |buf| then.
+   */
+  bool pool_syscallbuf(const PooledSyscallbuf& buf);
+  /**
+   * Take the pooled syscallbuf at |addr| into |buf|, or the most recently
+   * pooled one if |addr| is null. Returns false if there's no such
+   * syscallbuf.
+   */
+  bool take_pooled_syscallbuf(remote_ptr<void> addr, PooledSyscallbuf* buf);
+
+  /**
+   * Checksums of whole private pages as of the last time this address
+   * space was checksummed, keyed by page address. Pages whose soft-dirty
+   * bit is still clear keep these checksums. Pages whose mapping changed
+   * are dropped.
+   */
+  std::map<remote_ptr<void>, uint32_t>& page_checksums() {
+    return page_checksums_;
+  }
+
+  /**
+   * Hashes of the pieces of shared file mappings, keyed by address, that
+   * record_file_change() last recorded, at most a page each. Pieces whose
+   * mapping changed are dropped.
+   */
+  std::map<remote_ptr<void>, Hash128>& recorded_file_pages() {
+    return recorded_file_pages_;
+  }
+
   /**
    * Verify that this cached address space matches what the
-   * kernel thinks it should be.
+   * kernel thinks it should be. Usually only the mappings changed since
+   * the last verify() are checked.
    */
   void verify(Task* t) const;
 
@@ -644,6 +769,27 @@ public:
 
   bool syscallbuf_enabled() const { return syscallbuf_lib_start_ != nullptr; }
 
+  /**
+   * The preload library's bitmap of fds that mustn't be buffered, and its
+   * table of fds known to be nonblocking. They're per process, so they live
+   * here rather than in every Task. Null before preload init; a forked
+   * copy of the library keeps them at the same addresses.
+   */
+  remote_ptr<char> syscallbuf_fds_disabled() const {
+    return syscallbuf_fds_disabled_;
+  }
+  remote_ptr<char> syscallbuf_fds_nonblocking() const {
+    return syscallbuf_fds_nonblocking_;
+  }
+
+  /**
+   * Note that the buffered may-block syscall |t| is making was
+   * descheduled, and tell the preload library to trace the syscall's site
+   * from now on if most of its recent calls were. Called at the same
+   * point in recording and replay, since it changes tracee memory.
+   */
+  void note_buffered_syscall_descheduled(Task* t);
+
   /**
    * We'll map a page of memory here into every exec'ed process for our own
    * use.
@@ -685,6 +831,26 @@ public:
     return rr_page_ip_in_traced_syscall() -
            rr::syscall_instruction_length(arch);
   }
+  /**
+   * On x86-64 the rr page also holds a straight-line stub that makes up to
+   * SYSCALL_BATCH_MAX syscalls described by consecutive
+   * SYSCALL_BATCH_ENTRY_WORDS-word entries {syscallno, arg1..arg6, result}
+   * at $rbx, storing each result back into its entry, and then executes an
+   * int3. Entering the stub at rr_page_syscall_batch_ip(n) makes exactly
+   * the last n syscalls of the stub. The stub contains no branches, so it
+   * doesn't perturb the tick count.
+   */
+  enum {
+    SYSCALL_BATCH_MAX = 8
+  };
+  enum {
+    SYSCALL_BATCH_ENTRY_WORDS = 8
+  };
+  static remote_ptr<uint8_t> rr_page_syscall_batch_ip(size_t count);
+  /**
+   * ip() after the stub has executed its final int3.
+   */
+  static remote_ptr<uint8_t> rr_page_syscall_batch_end();
 
   /**
    * Locate a syscall instruction in t's VDSO.
@@ -696,7 +862,26 @@ public:
 
 private:
   class Breakpoint;
-  typedef std::map<remote_ptr<uint8_t>, Breakpoint> BreakpointMap;
+  struct BreakpointAddrHash {
+    size_t operator()(remote_ptr<uint8_t> addr) const {
+      return std::hash<uintptr_t>()(addr.as_int());
+    }
+  };
+  typedef std::unordered_map<remote_ptr<uint8_t>, Breakpoint,
+                             BreakpointAddrHash> BreakpointMap;
+  /**
+   * Breakpoint counts per page, hashed into a small table, so that the
+   * common case of looking up an address in a page without breakpoints
+   * doesn't have to search |breakpoints|.
+   */
+  enum { BREAKPOINT_PAGE_FILTER_SIZE = 1024 };
+  uint32_t& breakpoint_page_count(remote_ptr<uint8_t> addr) {
+    return breakpoint_page_filter[(addr.as_int() / page_size()) %
+                                  BREAKPOINT_PAGE_FILTER_SIZE];
+  }
+  BreakpointMap::iterator insert_breakpoint(remote_ptr<uint8_t> addr,
+                                            const Breakpoint& bp);
+  void erase_breakpoint(BreakpointMap::const_iterator it);
   class Watchpoint;
 
   AddressSpace(Task* t, const std::string& exe, uint32_t exec_count);
@@ -707,6 +892,16 @@ private:
   bool update_watchpoint_value(const MemoryRange& range,
                                Watchpoint& watchpoint);
   void update_watchpoint_values(remote_ptr<void> start, remote_ptr<void> end);
+  typedef std::map<MemoryRange, Watchpoint>::iterator WatchpointIterator;
+  /**
+   * Reread the watchpoints in |wps|, all with one vectored read if we
+   * can, and mark the ones whose values changed, or whose debug register
+   * fired according to |debug_status|, as changed.
+   */
+  void update_watchpoint_values(const std::vector<WatchpointIterator>& wps,
+                                uintptr_t debug_status);
+  struct PageWatch;
+  bool update_page_watch_value(const MemoryRange& range, PageWatch& watch);
 
   std::vector<WatchConfig> all_watchpoints_internal(bool will_set_task_state);
 
@@ -731,11 +926,30 @@ private:
    */
   void destroy_breakpoint(BreakpointMap::const_iterator it);
 
+  /**
+   * If a mapping contains |addr| but doesn't start there, split it into
+   * two mappings at |addr|. Return the mapping starting at |addr|, or
+   * mem_->end() if |addr| isn't mapped.
+   */
+  MemoryMap::iterator split_mapping_at(remote_ptr<void> addr);
+
+  /**
+   * Return |mem_| for modification, first giving this address space its
+   * own copy if a clone still shares it. Take iterators into the map only
+   * after calling this.
+   */
+  MemoryMap& writable_mem() {
+    if (mem_.use_count() > 1) {
+      mem_ = std::make_shared<MemoryMap>(*mem_);
+    }
+    return *mem_;
+  }
+
   /**
    * For each mapped segment overlapping [addr, addr +
    * num_bytes), call |f|.  Pass |f| the overlapping mapping,
    * the mapped resource, and the range of addresses remaining
-   * to be iterated over.
+   * to be iterated over. |f| must not modify |mem_|.
    *
    * Pass |ITERATE_CONTIGUOUS| to stop iterating when the last
    * contiguous mapping after |addr| within the region is seen.
@@ -757,6 +971,34 @@ private:
    */
   void map_and_coalesce(const Mapping& m, const MappableResource& r);
 
+  /**
+   * Note that the mappings in [start, end) changed, so the next verify()
+   * must check them and their cached page checksums are stale.
+   */
+  void mark_verify_dirty(remote_ptr<void> start, remote_ptr<void> end);
+  /**
+   * Account for |delta| bytes of |r| being mapped (or unmapped, if
+   * negative), telling the session when we start or stop mapping a
+   * shared file.
+   */
+  void add_shared_mapping_bytes(const MappableResource& r, ssize_t delta);
+  /**
+   * Tell the session about all the shared files we map, when we join it
+   * (|mapped|) or go away.
+   */
+  void note_all_shared_mappings(bool mapped);
+  /**
+   * The cached mappings [begin, end) that verify() compares against the
+   * kernel segments overlapping [start, finish).
+   */
+  struct VerifyWindow {
+    MemoryMap::const_iterator begin;
+    MemoryMap::const_iterator end;
+    remote_ptr<void> start;
+    remote_ptr<void> finish;
+  };
+  VerifyWindow verify_window_for(const MemoryRange& range) const;
+
   /** Set the dynamic heap segment to |[start, end)| */
   void update_heap(remote_ptr<void> start, remote_ptr<void> end) {
     heap = Mapping(start, end, PROT_READ | PROT_WRITE,
@@ -894,6 +1136,9 @@ private:
 
   // All breakpoints set in this VM.
   BreakpointMap breakpoints;
+  uint32_t breakpoint_page_filter[BREAKPOINT_PAGE_FILTER_SIZE];
+  // Breakpoints removed by suspend_breakpoints().
+  BreakpointMap suspended_breakpoints;
   /* Path of the executable image this address space was
    * exec()'d with. */
   std::string exe;
@@ -907,8 +1152,12 @@ private:
   Mapping heap;
   /* Were we cloned from another address space? */
   bool is_clone;
-  /* All segments mapped into this address space. */
-  MemoryMap mem;
+  /* All segments mapped into this address space. Clones (e.g. checkpoints)
+   * share it until one of them changes its mappings; see writable_mem(). */
+  std::shared_ptr<MemoryMap> mem_;
+  // How many bytes of each shared file (emulated file during replay) |mem|
+  // maps.
+  std::map<FileId, size_t> shared_mapping_bytes;
   // The session that created this.  We save a ref to it so that
   // we can notify it when we die.
   Session* session_;
@@ -921,6 +1170,16 @@ private:
   // behalf of debuggers that assume that model.
   std::map<MemoryRange, Watchpoint> watchpoints;
   std::vector<std::map<MemoryRange, Watchpoint> > saved_watchpoints;
+  struct PageWatch {
+    std::vector<uint8_t> value;
+    bool changed;
+  };
+  // Watched ranges whose writes are caught by page protection, and the
+  // original protection of each page we write-protected for them. These
+  // are never copied to clones; sessions are cloned with the pages
+  // unprotected.
+  std::map<MemoryRange, PageWatch> page_watches;
+  std::map<remote_ptr<void>, int> protected_watch_pages;
   // Tracee memory is read and written through this fd, which is
   // opened for the tracee's magic /proc/[tid]/mem device.  The
   // advantage of this over ptrace is that we can access it even
@@ -935,6 +1194,29 @@ private:
   remote_ptr<uint8_t> untraced_syscall_ip_;
   remote_ptr<void> syscallbuf_lib_start_;
   remote_ptr<void> syscallbuf_lib_end_;
+  // The preload library's table of syscallbuf_site_stats, or null.
+  remote_ptr<struct syscallbuf_site_stats> syscallbuf_sites;
+  remote_ptr<char> syscallbuf_fds_disabled_;
+  remote_ptr<char> syscallbuf_fds_nonblocking_;
+  // Ranges whose mappings changed since the last verify(). When
+  // |verify_all_dirty| is set, or every FULL_VERIFY_INTERVAL verifies,
+  // all mappings are checked instead.
+  mutable std::vector<MemoryRange> verify_dirty_ranges;
+  mutable bool verify_all_dirty;
+  mutable uint32_t verify_count;
+  enum { FULL_VERIFY_INTERVAL = 256 };
+  std::map<remote_ptr<void>, uint32_t> page_checksums_;
+  std::map<remote_ptr<void>, Hash128> recorded_file_pages_;
+  // Scratch regions, in the order they were added, and the range of
+  // scratch each task blocked in a syscall is using. Reservations are
+  // never copied to clones; no task in the clone is in a syscall using
+  // them.
+  std::vector<MemoryRange> scratch_regions_;
+  std::map<Task*, MemoryRange> scratch_reservations;
+  // Syscallbufs of exited threads. These aren't copied to clones either:
+  // a clone's copies would still share the segments with this, so a
+  // thread of the clone that needs a syscallbuf maps a new one over them.
+  std::vector<PooledSyscallbuf> syscallbuf_pool;
 
   /**
    * For each architecture, the offset of a syscall instruction with that
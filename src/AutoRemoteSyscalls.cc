@@ -108,6 +108,59 @@ long AutoRemoteSyscalls::wait_syscall(int syscallno) {
   return t->regs().syscall_result_signed();
 }
 
+void AutoRemoteSyscalls::syscall_batch(vector<BatchedSyscall>& syscalls) {
+  if (arch() != x86_64) {
+    for (auto& s : syscalls) {
+      Registers callregs = regs();
+      for (int i = 0; i < 6; ++i) {
+        callregs.set_arg(i + 1, s.args[i]);
+      }
+      s.result = syscall_helper(WAIT, s.syscallno, callregs);
+    }
+    return;
+  }
+
+  const size_t entry_words = AddressSpace::SYSCALL_BATCH_ENTRY_WORDS;
+  for (size_t start = 0; start < syscalls.size();
+       start += AddressSpace::SYSCALL_BATCH_MAX) {
+    size_t count = min<size_t>(syscalls.size() - start,
+                               AddressSpace::SYSCALL_BATCH_MAX);
+    vector<uint64_t> entries(count * entry_words);
+    for (size_t i = 0; i < count; ++i) {
+      const BatchedSyscall& s = syscalls[start + i];
+      uint64_t* entry = &entries[i * entry_words];
+      entry[0] = s.syscallno;
+      for (int j = 0; j < 6; ++j) {
+        entry[j + 1] = s.args[j];
+      }
+      entry[7] = -ENOSYS;
+    }
+
+    AutoRestoreMem remote_entries(*this, (const uint8_t*)entries.data(),
+                                  entries.size() * sizeof(uint64_t));
+    Registers callregs = regs();
+    callregs.set_ip(AddressSpace::rr_page_syscall_batch_ip(count));
+    callregs.set_bx(remote_entries.get().as_int());
+    t->set_regs(callregs);
+    // Syscalls made from the stub are traced by our seccomp filter during
+    // recording; just let them run.
+    do {
+      t->cont_nonblocking();
+      t->wait();
+    } while (t->is_ptrace_seccomp_event() || SIGCHLD == t->pending_sig());
+    ASSERT(t, t->ptrace_event() == 0 && SIGTRAP == t->pending_sig() &&
+                  t->ip() == AddressSpace::rr_page_syscall_batch_end())
+        << "Syscall batch stopped unexpectedly at " << t->ip();
+
+    t->read_bytes_helper(remote_entries.get(),
+                         entries.size() * sizeof(uint64_t),
+                         (uint8_t*)entries.data());
+    for (size_t i = 0; i < count; ++i) {
+      syscalls[start + i].result = (long)entries[i * entry_words + 7];
+    }
+  }
+}
+
 SupportedArch AutoRemoteSyscalls::arch() const { return t->arch(); }
 
 template <typename Arch>
@@ -363,3 +416,14 @@ remote_ptr<void> AutoRemoteSyscalls::mmap_syscall(remote_ptr<void> addr,
   }
   return t->regs().syscall_result();
 }
+
+AutoRemoteSyscalls::BatchedSyscall AutoRemoteSyscalls::mmap_batched(
+    remote_ptr<void> addr, size_t length, int prot, int flags, int child_fd,
+    uint64_t offset_pages) {
+  if (has_mmap2_syscall(arch())) {
+    return BatchedSyscall(syscall_number_for_mmap2(arch()), addr.as_int(),
+                          length, prot, flags, child_fd, offset_pages);
+  }
+  return BatchedSyscall(syscall_number_for_mmap(arch()), addr.as_int(), length,
+                        prot, flags, child_fd, offset_pages * page_size());
+}
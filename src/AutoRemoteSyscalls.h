@@ -135,12 +135,44 @@ public:
     return syscall_helper<1>(syscallno, callregs, args...);
   }
 
+  /**
+   * A syscall to be made by syscall_batch().
+   */
+  struct BatchedSyscall {
+    BatchedSyscall(int syscallno, uintptr_t arg1 = 0, uintptr_t arg2 = 0,
+                   uintptr_t arg3 = 0, uintptr_t arg4 = 0, uintptr_t arg5 = 0,
+                   uintptr_t arg6 = 0)
+        : syscallno(syscallno),
+          args{ arg1, arg2, arg3, arg4, arg5, arg6 },
+          result(0) {}
+    int syscallno;
+    uintptr_t args[6];
+    /* Raw kernel return value, filled in by syscall_batch(). */
+    long result;
+  };
+  /**
+   * Make the syscalls in |syscalls| in order, storing each raw kernel
+   * return value in its |result|. On x86-64 up to
+   * AddressSpace::SYSCALL_BATCH_MAX syscalls are made with a single resume
+   * of the tracee via the rr page's batch stub, instead of stopping at the
+   * entry and exit of each one. The syscalls' arguments can't depend on
+   * the results of earlier syscalls in the batch, and each syscall must
+   * return normally (no execve, exit, clone, sigreturn etc).
+   */
+  void syscall_batch(std::vector<BatchedSyscall>& syscalls);
+
   /**
    * Remote mmap syscalls are common and non-trivial due to the need to
    * select either mmap2 or mmap.
    */
   remote_ptr<void> mmap_syscall(remote_ptr<void> addr, size_t length, int prot,
                                 int flags, int child_fd, uint64_t offset_pages);
+  /**
+   * The syscall mmap_syscall() would make with these arguments, for
+   * making the mapping in a syscall_batch().
+   */
+  BatchedSyscall mmap_batched(remote_ptr<void> addr, size_t length, int prot,
+                              int flags, int child_fd, uint64_t offset_pages);
 
   /** The Task in the context of which we're making syscalls. */
   Task* task() const { return t; }
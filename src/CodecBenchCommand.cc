@@ -0,0 +1,379 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "Command.h"
+#include "CompressedReader.h"
+#include "CompressedWriter.h"
+#include "main.h"
+#include "TraceStream.h"
+#include "util.h"
+
+using namespace std;
+
+class CodecBenchCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  CodecBenchCommand(const char* name, const char* help)
+      : Command(name, help) {}
+
+  static CodecBenchCommand singleton;
+};
+
+CodecBenchCommand CodecBenchCommand::singleton(
+    "codec-bench",
+    " rr codec-bench [OPTION]... [<trace_dir>]\n"
+    "  Recompress the start of each substream of a trace with every\n"
+    "  available codec, level and block size, and report the compression\n"
+    "  ratio, compression and decompression throughput, and how long the\n"
+    "  recorder would have stalled waiting for compression, projected from\n"
+    "  the recording's duration and the measured compression speed.\n"
+    "  -b, --block-sizes=<KB,...> block sizes to try (default:\n"
+    "                             64,256,1024,8192)\n"
+    "  -c, --codec=<CODEC>        only try zlib, lz4 or zstd\n"
+    "  -j, --jobs=<N>             compress with N threads (default: the\n"
+    "                             substream's recording thread count)\n"
+    "  -l, --levels=<N,...>       levels to try (default: a few per codec\n"
+    "                             from fastest to best ratio)\n"
+    "  -m, --sample=<MB>          use at most the first MB megabytes of each\n"
+    "                             substream (default 256)\n"
+    "  -s, --substream=<NAME>     only benchmark the substream NAME, e.g.\n"
+    "                             `data'\n");
+
+struct CodecBenchFlags {
+  vector<size_t> block_sizes;
+  // Empty to try every available codec.
+  vector<CompressedWriter::Codec> codecs;
+  // Empty to use the codecs' defaults.
+  vector<int> levels;
+  // 0 to use the substream's recording thread count.
+  int jobs;
+  uint64_t sample_bytes;
+  // Empty to benchmark every substream.
+  string substream;
+
+  CodecBenchFlags() : jobs(0), sample_bytes(256 * 1024 * 1024) {}
+};
+
+/**
+ * Parse a comma-separated list of integers in [min, max] into |out|.
+ */
+static bool parse_int_list(const string& s, int64_t min, int64_t max,
+                           vector<int64_t>* out) {
+  out->clear();
+  const char* p = s.c_str();
+  while (*p) {
+    char* end;
+    long long v = strtoll(p, &end, 10);
+    if (end == p || v < min || v > max || (*end && *end != ',')) {
+      fprintf(stderr, "Invalid list `%s'\n", s.c_str());
+      return false;
+    }
+    out->push_back(v);
+    p = *end ? end + 1 : end;
+  }
+  return !out->empty();
+}
+
+static bool parse_codec_bench_arg(std::vector<std::string>& args,
+                                  CodecBenchFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = {
+    { 'b', "block-sizes", HAS_PARAMETER }, { 'c', "codec", HAS_PARAMETER },
+    { 'j', "jobs", HAS_PARAMETER },        { 'l', "levels", HAS_PARAMETER },
+    { 'm', "sample", HAS_PARAMETER },      { 's', "substream", HAS_PARAMETER }
+  };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  vector<int64_t> values;
+  switch (opt.short_name) {
+    case 'b':
+      // Blocks must fit BlockHeader::compressed_length.
+      if (!parse_int_list(opt.value, 4, 64 * 1024, &values)) {
+        return false;
+      }
+      flags.block_sizes.clear();
+      for (auto v : values) {
+        flags.block_sizes.push_back(v * 1024);
+      }
+      break;
+    case 'c': {
+      CompressedWriter::Codec codec;
+      if (!CompressedWriter::parse_codec(opt.value, &codec)) {
+        fprintf(stderr, "Unknown codec `%s'\n", opt.value.c_str());
+        return false;
+      }
+      if (!CompressedWriter::codec_available(codec)) {
+        fprintf(stderr, "rr was built without %s support\n",
+                opt.value.c_str());
+        return false;
+      }
+      flags.codecs = { codec };
+      break;
+    }
+    case 'j':
+      if (!opt.verify_valid_int(1, 1024)) {
+        return false;
+      }
+      flags.jobs = opt.int_value;
+      break;
+    case 'l':
+      if (!parse_int_list(opt.value, 0, 65537, &values)) {
+        return false;
+      }
+      flags.levels.assign(values.begin(), values.end());
+      break;
+    case 'm':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.sample_bytes = (uint64_t)opt.int_value * 1024 * 1024;
+      break;
+    case 's':
+      flags.substream = opt.value;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+/**
+ * Levels tried when none are given, from fastest to best ratio. For LZ4
+ * the level is the acceleration factor, so higher is faster.
+ */
+static vector<int> default_levels(CompressedWriter::Codec codec) {
+  switch (codec) {
+    case CompressedWriter::ZLIB:
+      return { 1, 6, 9 };
+    case CompressedWriter::LZ4:
+      return { 16, 4, 1 };
+    case CompressedWriter::ZSTD:
+      return { 1, 3, 9, 19 };
+    default:
+      return { 0 };
+  }
+}
+
+/**
+ * The recorder writes records from a few bytes to a piece of raw data at a
+ * time; write the sample in pieces of this size.
+ */
+static const size_t BENCH_WRITE_SIZE = 64 * 1024;
+
+static double monotonic_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct BenchResult {
+  uint64_t compressed_bytes;
+  // Wall-clock seconds to compress through the writer's thread pool.
+  double compress_seconds;
+  // Seconds the compression threads spent compressing, summed.
+  double compress_thread_seconds;
+  double decompress_seconds;
+};
+
+/**
+ * Compress |data| to |file| with a CompressedWriter configured as given,
+ * then read it back with a CompressedReader, and delete |file|.
+ */
+static bool bench_one(const vector<uint8_t>& data, const string& file,
+                      CompressedWriter::Codec codec, int level,
+                      size_t block_size, int threads, BenchResult* result) {
+  double start = monotonic_now();
+  vector<CompressedWriter::ThreadStats> thread_stats;
+  {
+    CompressedWriter out(file, block_size, threads, codec, level);
+    for (size_t offset = 0; offset < data.size() && out.good();
+         offset += BENCH_WRITE_SIZE) {
+      out.write(data.data() + offset,
+                min(BENCH_WRITE_SIZE, data.size() - offset));
+    }
+    out.close();
+    if (!out.good()) {
+      unlink(file.c_str());
+      return false;
+    }
+    thread_stats = out.thread_stats();
+  }
+  result->compress_seconds = monotonic_now() - start;
+  result->compress_thread_seconds = 0;
+  for (auto& st : thread_stats) {
+    result->compress_thread_seconds += st.seconds;
+  }
+
+  struct stat st;
+  result->compressed_bytes = stat(file.c_str(), &st) == 0 ? st.st_size : 0;
+
+  start = monotonic_now();
+  bool ok;
+  {
+    CompressedReader in(file);
+    size_t remaining = data.size();
+    while (remaining > 0 && in.good()) {
+      CompressedReader::Span span;
+      size_t len = min(remaining, block_size);
+      if (!in.read_span(len, &span)) {
+        break;
+      }
+      remaining -= len;
+    }
+    ok = remaining == 0 && in.good();
+  }
+  result->decompress_seconds = monotonic_now() - start;
+  unlink(file.c_str());
+  return ok;
+}
+
+/**
+ * Return |bytes| per |seconds| in MB/s.
+ */
+static double mb_per_sec(uint64_t bytes, double seconds) {
+  return seconds > 0 ? bytes / seconds / (1024 * 1024) : 0;
+}
+
+static bool bench_substream(TraceReader& trace, TraceStream::Substream s,
+                            const CodecBenchFlags& flags, double duration,
+                            const string& tmp_dir, FILE* out) {
+  vector<uint8_t> data;
+  uint64_t total_bytes;
+  if (!trace.read_substream(s, flags.sample_bytes, &data, &total_bytes)) {
+    fprintf(stderr, "Can't read substream %s\n",
+            TraceStream::substream_name(s));
+    return false;
+  }
+  int threads =
+      flags.jobs ? flags.jobs : TraceStream::substream_compression_threads(s);
+  fprintf(out, "%s: %" PRIu64 " bytes, sampled %zu; recorded with %s level "
+               "%d, %zu KB blocks\n",
+          TraceStream::substream_name(s), total_bytes, data.size(),
+          CompressedWriter::codec_name(TraceStream::substream_codec(s)),
+          TraceStream::substream_level(s),
+          TraceStream::substream_block_size(s) / 1024);
+  if (data.empty()) {
+    return true;
+  }
+  fprintf(out, "  %-5s %6s %8s %7s %12s %12s %12s %10s\n", "codec", "level",
+          "block KB", "ratio", "compress", "per thread", "decompress",
+          "stall s");
+
+  vector<CompressedWriter::Codec> codecs = flags.codecs;
+  if (codecs.empty()) {
+    for (int c = 0; c < CompressedWriter::CODEC_COUNT; ++c) {
+      if (CompressedWriter::codec_available((CompressedWriter::Codec)c)) {
+        codecs.push_back((CompressedWriter::Codec)c);
+      }
+    }
+  }
+  string file = tmp_dir + "/" + TraceStream::substream_name(s);
+  for (auto codec : codecs) {
+    vector<int> levels =
+        flags.levels.empty() ? default_levels(codec) : flags.levels;
+    for (int level : levels) {
+      for (size_t block_size : flags.block_sizes) {
+        BenchResult r;
+        if (!bench_one(data, file, codec, level, block_size, threads, &r)) {
+          fprintf(stderr, "Benchmark of %s level %d failed\n",
+                  CompressedWriter::codec_name(codec), level);
+          return false;
+        }
+        // Recording only stalls when the compression threads, each at the
+        // measured speed, can't keep up with the rate the substream was
+        // produced at.
+        double thread_speed = data.size() / r.compress_thread_seconds;
+        double compress_time = total_bytes / (thread_speed * threads);
+        char stall[32] = "-";
+        if (duration > 0) {
+          snprintf(stall, sizeof(stall), "%.1f",
+                   max(0.0, compress_time - duration));
+        }
+        fprintf(out, "  %-5s %6d %8zu %7.2f %7.1f MB/s %7.1f MB/s %7.1f MB/s "
+                     "%10s\n",
+                CompressedWriter::codec_name(codec), level, block_size / 1024,
+                double(data.size()) / r.compressed_bytes,
+                mb_per_sec(data.size(), r.compress_seconds),
+                mb_per_sec(data.size(), r.compress_thread_seconds),
+                mb_per_sec(data.size(), r.decompress_seconds), stall);
+      }
+    }
+  }
+  return true;
+}
+
+static int codec_bench(const string& trace_dir, CodecBenchFlags& flags,
+                       FILE* out) {
+  TraceReader trace(trace_dir);
+  TraceMetadata metadata;
+  double duration = 0;
+  if (trace.read_metadata(&metadata)) {
+    duration = metadata.duration;
+    fprintf(out, "Recording took %.1f seconds\n", duration);
+  } else {
+    fprintf(out, "Trace has no metadata; stalls can't be projected\n");
+  }
+  if (flags.block_sizes.empty()) {
+    flags.block_sizes = { 64 * 1024, 256 * 1024, 1024 * 1024,
+                          8 * 1024 * 1024 };
+  }
+
+  const char* tmp = getenv("TMPDIR");
+  string tmp_template = string(tmp ? tmp : "/tmp") + "/rr-codec-bench-XXXXXX";
+  vector<char> tmp_dir(tmp_template.begin(), tmp_template.end());
+  tmp_dir.push_back(0);
+  if (!mkdtemp(tmp_dir.data())) {
+    fprintf(stderr, "Can't create %s\n", tmp_template.c_str());
+    return 1;
+  }
+
+  bool found = false;
+  bool ok = true;
+  for (int i = TraceStream::SUBSTREAM_FIRST;
+       ok && i < TraceStream::SUBSTREAM_COUNT; ++i) {
+    auto s = (TraceStream::Substream)i;
+    if (!flags.substream.empty() &&
+        flags.substream != TraceStream::substream_name(s)) {
+      continue;
+    }
+    found = true;
+    ok = bench_substream(trace, s, flags, duration, tmp_dir.data(), out);
+  }
+  rmdir(tmp_dir.data());
+  if (!found) {
+    fprintf(stderr, "No substream `%s'\n", flags.substream.c_str());
+    return 1;
+  }
+  return ok ? 0 : 1;
+}
+
+int CodecBenchCommand::run(std::vector<std::string>& args) {
+  CodecBenchFlags flags;
+  while (parse_codec_bench_arg(args, flags)) {
+  }
+
+  string trace_dir;
+  if (!parse_optional_trace_dir(args, &trace_dir)) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return codec_bench(trace_dir, flags, stdout);
+}
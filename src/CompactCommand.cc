@@ -0,0 +1,227 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "Command.h"
+#include "CompressedWriter.h"
+#include "main.h"
+#include "TraceStream.h"
+#include "util.h"
+
+using namespace std;
+
+class CompactCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  CompactCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static CompactCommand singleton;
+};
+
+CompactCommand CompactCommand::singleton(
+    "compact",
+    " rr compact [OPTION]... [<trace_dir>]\n"
+    "  Rewrite a finished trace to make it smaller for archiving: recompress\n"
+    "  every substream with a slower codec or level than recording can\n"
+    "  afford, write the sidecar block indexes if the trace has none, and\n"
+    "  delete the checksums file, which only `rr replay --checksum' reads.\n"
+    "  Substreams are rewritten in parallel. Don't compact a trace that is\n"
+    "  being recorded or replayed.\n"
+    "  -c, --codec=<CODEC>        zlib, lz4 or zstd (default: zstd if rr was\n"
+    "                             built with it, otherwise zlib)\n"
+    "  -j, --jobs=<N>             rewrite N substreams at once (default:\n"
+    "                             number of CPUs)\n"
+    "  -k, --keep-checksums       don't delete the checksums file\n"
+    "  -l, --level=<N>            compression level (default: the codec's\n"
+    "                             highest practical level)\n");
+
+/**
+ * Levels used when none is given. zstd's levels above 19 need much more
+ * memory to decompress. For LZ4 the level is the acceleration factor, so
+ * its default is already the best ratio.
+ */
+static const int DEFAULT_ZLIB_LEVEL = 9;
+static const int DEFAULT_ZSTD_LEVEL = 19;
+
+struct CompactFlags {
+  CompressedWriter::Codec codec;
+  // -1 to use the codec's default for compaction.
+  int level;
+  int jobs;
+  bool keep_checksums;
+
+  CompactFlags()
+      : codec(CompressedWriter::codec_available(CompressedWriter::ZSTD)
+                  ? CompressedWriter::ZSTD
+                  : CompressedWriter::ZLIB),
+        level(-1),
+        jobs(get_num_cpus()),
+        keep_checksums(false) {}
+};
+
+static bool parse_compact_arg(std::vector<std::string>& args,
+                              CompactFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'c', "codec", HAS_PARAMETER },
+                                        { 'j', "jobs", HAS_PARAMETER },
+                                        { 'k', "keep-checksums",
+                                          NO_PARAMETER },
+                                        { 'l', "level", HAS_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'c':
+      if (!CompressedWriter::parse_codec(opt.value, &flags.codec)) {
+        fprintf(stderr, "Unknown codec `%s'\n", opt.value.c_str());
+        return false;
+      }
+      if (!CompressedWriter::codec_available(flags.codec)) {
+        fprintf(stderr, "rr was built without %s support\n",
+                opt.value.c_str());
+        return false;
+      }
+      break;
+    case 'j':
+      if (!opt.verify_valid_int(1, 1024)) {
+        return false;
+      }
+      flags.jobs = opt.int_value;
+      break;
+    case 'k':
+      flags.keep_checksums = true;
+      break;
+    case 'l':
+      if (!opt.verify_valid_int(0, 22)) {
+        return false;
+      }
+      flags.level = opt.int_value;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+/**
+ * Return the level to compact with when |flags| doesn't give one.
+ */
+static int compaction_level(const CompactFlags& flags) {
+  if (flags.level >= 0) {
+    return flags.level;
+  }
+  switch (flags.codec) {
+    case CompressedWriter::ZLIB:
+      return DEFAULT_ZLIB_LEVEL;
+    case CompressedWriter::ZSTD:
+      return DEFAULT_ZSTD_LEVEL;
+    default:
+      return 0;
+  }
+}
+
+struct CompactState {
+  string trace_dir;
+  CompressedWriter::Codec codec;
+  int level;
+  uint64_t old_bytes[TraceStream::SUBSTREAM_COUNT];
+  uint64_t new_bytes[TraceStream::SUBSTREAM_COUNT];
+  atomic<int> next;
+  atomic<bool> failed;
+};
+
+static void* compact_thread(void* p) {
+  CompactState* state = static_cast<CompactState*>(p);
+  // Each thread has its own reader, since recompress() doesn't touch the
+  // reader's streams, only the files.
+  TraceReader trace(state->trace_dir);
+  while (true) {
+    int s = state->next++;
+    if (s >= TraceStream::SUBSTREAM_COUNT) {
+      return nullptr;
+    }
+    if (!trace.recompress((TraceStream::Substream)s, state->codec,
+                          state->level, &state->old_bytes[s],
+                          &state->new_bytes[s])) {
+      state->failed = true;
+    }
+  }
+}
+
+static int compact(const string& trace_dir, const CompactFlags& flags) {
+  CompactState state;
+  state.trace_dir = TraceReader(trace_dir).dir();
+  state.codec = flags.codec;
+  state.level = compaction_level(flags);
+  state.next = 0;
+  state.failed = false;
+
+  int jobs = min<int>(flags.jobs, TraceStream::SUBSTREAM_COUNT);
+  vector<pthread_t> threads(jobs);
+  for (auto& thread : threads) {
+    pthread_create(&thread, nullptr, compact_thread, &state);
+  }
+  for (auto& thread : threads) {
+    pthread_join(thread, nullptr);
+  }
+  if (state.failed) {
+    fprintf(stderr, "Failed to compact %s\n", state.trace_dir.c_str());
+    return 1;
+  }
+
+  uint64_t old_total = 0, new_total = 0;
+  for (int s = 0; s < TraceStream::SUBSTREAM_COUNT; ++s) {
+    old_total += state.old_bytes[s];
+    new_total += state.new_bytes[s];
+  }
+  if (!flags.keep_checksums) {
+    string checksums = state.trace_dir + "/checksums";
+    uint64_t size = 0;
+    struct stat st;
+    if (stat(checksums.c_str(), &st) == 0) {
+      size = st.st_size;
+    }
+    if (unlink(checksums.c_str()) == 0) {
+      old_total += size;
+    } else if (errno != ENOENT) {
+      fprintf(stderr, "Can't delete %s: %s\n", checksums.c_str(),
+              strerror(errno));
+      return 1;
+    }
+  }
+  fprintf(stdout, "Compacted %s with %s level %d: %" PRIu64 " -> %" PRIu64
+                  " bytes\n",
+          state.trace_dir.c_str(), CompressedWriter::codec_name(state.codec),
+          state.level, old_total, new_total);
+  return 0;
+}
+
+int CompactCommand::run(std::vector<std::string>& args) {
+  CompactFlags flags;
+  while (parse_compact_arg(args, flags)) {
+  }
+
+  string trace_dir;
+  if (!parse_optional_trace_dir(args, &trace_dir)) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return compact(trace_dir, flags);
+}
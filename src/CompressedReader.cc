@@ -10,28 +10,206 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/vfs.h>
 #include <unistd.h>
 #include <zlib.h>
+#ifdef RR_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef RR_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include <algorithm>
 
 #include "CompressedWriter.h"
+#include "Flags.h"
+#include "MemoryAccounting.h"
+#include "RemoteTrace.h"
+
+/**
+ * A read-only mapping of a whole input file, shared by copies of a reader.
+ */
+struct CompressedReader::Mapping {
+  Mapping(const uint8_t* data, size_t size) : data(data), size(size) {}
+  ~Mapping() { munmap(const_cast<uint8_t*>(data), size); }
+
+  const uint8_t* data;
+  size_t size;
+};
+
+struct CompressedReader::ReadAheadBlock {
+  ReadAheadBlock(const std::shared_ptr<ScopedFd>& fd,
+                 const std::shared_ptr<RemoteFile>& remote,
+                 const std::shared_ptr<const Mapping>& mapping,
+                 uint64_t file_offset,
+                 const CompressedWriter::BlockHeader& header)
+      : fd(fd),
+        remote(remote),
+        mapping(mapping),
+        file_offset(file_offset),
+        header(header),
+        data(std::make_shared<std::vector<uint8_t> >()),
+        charge(header.compressed_length + header.uncompressed_length),
+        done(false),
+        ok(false) {}
+  ~ReadAheadBlock();
+
+  std::shared_ptr<ScopedFd> fd;
+  std::shared_ptr<RemoteFile> remote;
+  std::shared_ptr<const Mapping> mapping;
+  uint64_t file_offset;
+  CompressedWriter::BlockHeader header;
+  // Filled by the worker thread before it sets 'done'.
+  std::shared_ptr<std::vector<uint8_t> > data;
+  // Bytes charged against the read-ahead budget until we're destroyed.
+  size_t charge;
+  // BEGIN protected by the pool mutex
+  bool done;
+  bool ok;
+  // END protected by the pool mutex
+};
+
+/**
+ * Threads that decompress ReadAheadBlocks. Started on first use and never
+ * stopped.
+ */
+class ReadAheadPool {
+public:
+  static ReadAheadPool& get() {
+    static ReadAheadPool* pool = new ReadAheadPool();
+    return *pool;
+  }
+
+  /**
+   * Queue 'block' for decompression, unless that would take read-ahead
+   * memory beyond 'limit'. Returns false if the block wasn't queued.
+   */
+  bool submit(const std::shared_ptr<CompressedReader::ReadAheadBlock>& block,
+              size_t limit);
+  /**
+   * Wait for 'block' to be decompressed. Returns false on error.
+   */
+  bool wait(CompressedReader::ReadAheadBlock& block);
+  void release(size_t charge);
+
+private:
+  ReadAheadPool();
+
+  static void* worker_callback(void* p);
+  void worker();
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  std::deque<std::shared_ptr<CompressedReader::ReadAheadBlock> > queue;
+  size_t bytes_charged;
+};
+
+CompressedReader::ReadAheadBlock::~ReadAheadBlock() {
+  ReadAheadPool::get().release(charge);
+}
+
+/**
+ * Return true if 'fd' is on a disk-backed local filesystem, where mapping
+ * the file is cheaper than reading it. On network filesystems page faults
+ * can stall for a long time, so we stick to pread there.
+ */
+static bool is_on_local_filesystem(int fd) {
+  struct statfs buf;
+  if (fstatfs(fd, &buf) < 0) {
+    return false;
+  }
+  switch ((uint32_t)buf.f_type) {
+    case 0xEF53:     // ext2/3/4
+    case 0x58465342: // XFS
+    case 0x9123683E: // btrfs
+    case 0xF2F52010: // F2FS
+    case 0x01021994: // tmpfs
+      return true;
+    default:
+      return false;
+  }
+}
+
+static std::shared_ptr<const CompressedReader::Mapping> map_file(int fd) {
+  struct stat st;
+  if (!is_on_local_filesystem(fd) || fstat(fd, &st) < 0 || st.st_size == 0 ||
+      (uint64_t)st.st_size > SIZE_MAX) {
+    return nullptr;
+  }
+  void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+  // We mostly read the file front to back.
+  madvise(p, st.st_size, MADV_SEQUENTIAL);
+  return std::make_shared<CompressedReader::Mapping>(
+      static_cast<const uint8_t*>(p), st.st_size);
+}
+
+/**
+ * How long a reader following a file that's being written sleeps before
+ * looking for a new block again.
+ */
+static const useconds_t FOLLOW_POLL_INTERVAL_US = 20000;
+
+static bool at_file_end(const ScopedFd& fd, RemoteFile* remote,
+                        const CompressedReader::Mapping* mapping,
+                        uint64_t offset) {
+  if (remote) {
+    return offset >= remote->size();
+  }
+  if (mapping) {
+    return offset >= mapping->size;
+  }
+  char ch;
+  return pread(fd, &ch, 1, offset) == 0;
+}
 
 CompressedReader::CompressedReader(const std::string& filename)
     : fd(new ScopedFd(filename.c_str(), O_CLOEXEC | O_RDONLY | O_LARGEFILE)) {
+  if (fd->is_open()) {
+    mapping = map_file(*fd);
+  }
   fd_offset = 0;
+  fd_uncompressed_offset = 0;
+  end_offset = UINT64_MAX;
   error = !fd->is_open();
-  eof = false;
+  // An empty file is at its end before we read anything.
+  eof = !error && at_file_end(*fd, nullptr, mapping.get(), 0);
+  buffer = std::make_shared<std::vector<uint8_t> >();
+  buffer_read_pos = 0;
+  have_saved_state = false;
+}
+
+CompressedReader::CompressedReader(const std::shared_ptr<RemoteFile>& remote)
+    : fd(new ScopedFd()), remote(remote) {
+  fd_offset = 0;
+  fd_uncompressed_offset = 0;
+  end_offset = UINT64_MAX;
+  error = !remote->good();
+  eof = !error && at_file_end(*fd, remote.get(), nullptr, 0);
+  buffer = std::make_shared<std::vector<uint8_t> >();
   buffer_read_pos = 0;
   have_saved_state = false;
 }
 
 CompressedReader::CompressedReader(const CompressedReader& other) {
   fd = other.fd;
+  remote = other.remote;
+  mapping = other.mapping;
+  block_index = other.block_index;
+  follow_finished = other.follow_finished;
   fd_offset = other.fd_offset;
+  fd_uncompressed_offset = other.fd_uncompressed_offset;
+  end_offset = other.end_offset;
   error = other.error;
   eof = other.eof;
   buffer_read_pos = other.buffer_read_pos;
+  // Blocks are immutable, so we can share the current one.
   buffer = other.buffer;
   have_saved_state = false;
   assert(!other.have_saved_state);
@@ -39,8 +217,24 @@ CompressedReader::CompressedReader(const CompressedReader& other) {
 
 CompressedReader::~CompressedReader() { close(); }
 
-static bool read_all(const ScopedFd& fd, size_t size, void* data,
-                     uint64_t* offset) {
+static bool read_all(const ScopedFd& fd, RemoteFile* remote,
+                     const CompressedReader::Mapping* mapping, size_t size,
+                     void* data, uint64_t* offset) {
+  if (remote) {
+    if (!remote->read(data, size, *offset)) {
+      return false;
+    }
+    *offset += size;
+    return true;
+  }
+  if (mapping) {
+    if (*offset > mapping->size || mapping->size - *offset < size) {
+      return false;
+    }
+    memcpy(data, mapping->data + *offset, size);
+    *offset += size;
+    return true;
+  }
   while (size > 0) {
     ssize_t result = pread(fd, data, size, *offset);
     if (result <= 0) {
@@ -53,8 +247,29 @@ static bool read_all(const ScopedFd& fd, size_t size, void* data,
   return true;
 }
 
-static bool do_decompress(std::vector<uint8_t>& compressed,
-                          std::vector<uint8_t>& uncompressed) {
+/**
+ * Return a pointer to the 'size' bytes at 'offset'. They're in the mapping
+ * if there is one, otherwise they're read into 'buf'. Returns null on error.
+ */
+static const uint8_t* file_bytes(const ScopedFd& fd, RemoteFile* remote,
+                                 const CompressedReader::Mapping* mapping,
+                                 uint64_t offset, size_t size,
+                                 std::vector<uint8_t>& buf) {
+  if (mapping) {
+    if (offset > mapping->size || mapping->size - offset < size) {
+      return nullptr;
+    }
+    return mapping->data + offset;
+  }
+  buf.resize(size);
+  return read_all(fd, remote, nullptr, size, buf.data(), &offset)
+             ? buf.data()
+             : nullptr;
+}
+
+static bool do_decompress_zlib(const uint8_t* compressed,
+                               size_t compressed_len,
+                               std::vector<uint8_t>& uncompressed) {
   z_stream stream;
   memset(&stream, 0, sizeof(stream));
   int result = inflateInit(&stream);
@@ -63,8 +278,8 @@ static bool do_decompress(std::vector<uint8_t>& compressed,
     return false;
   }
 
-  stream.next_in = &compressed[0];
-  stream.avail_in = compressed.size();
+  stream.next_in = const_cast<uint8_t*>(compressed);
+  stream.avail_in = compressed_len;
   stream.next_out = &uncompressed[0];
   stream.avail_out = uncompressed.size();
   result = inflate(&stream, Z_FINISH);
@@ -82,15 +297,142 @@ static bool do_decompress(std::vector<uint8_t>& compressed,
   return true;
 }
 
+static bool do_decompress(CompressedWriter::Codec codec,
+                          const uint8_t* compressed, size_t compressed_len,
+                          std::vector<uint8_t>& uncompressed) {
+  switch (codec) {
+    case CompressedWriter::ZLIB:
+      return do_decompress_zlib(compressed, compressed_len, uncompressed);
+#ifdef RR_HAVE_LZ4
+    case CompressedWriter::LZ4: {
+      int result = LZ4_decompress_safe(
+          reinterpret_cast<const char*>(compressed),
+          reinterpret_cast<char*>(uncompressed.data()), compressed_len,
+          uncompressed.size());
+      if (result < 0 || (size_t)result != uncompressed.size()) {
+        assert(0 && "LZ4_decompress_safe failed!");
+        return false;
+      }
+      return true;
+    }
+#endif
+#ifdef RR_HAVE_ZSTD
+    case CompressedWriter::ZSTD: {
+      size_t result =
+          ZSTD_decompress(uncompressed.data(), uncompressed.size(),
+                          compressed, compressed_len);
+      if (ZSTD_isError(result) || result != uncompressed.size()) {
+        assert(0 && "ZSTD_decompress failed!");
+        return false;
+      }
+      return true;
+    }
+#endif
+    default:
+      // The trace was recorded by an rr built with a codec we don't have.
+      return false;
+  }
+}
+
+ReadAheadPool::ReadAheadPool() : bytes_charged(0) {
+  pthread_mutex_init(&mutex, nullptr);
+  pthread_cond_init(&cond, nullptr);
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int num_threads = std::max(1L, std::min(cpus, 4L));
+  for (int i = 0; i < num_threads; ++i) {
+    pthread_t thread;
+    pthread_create(&thread, nullptr, worker_callback, this);
+    pthread_setname_np(thread, "decompress");
+    pthread_detach(thread);
+  }
+}
+
+void* ReadAheadPool::worker_callback(void* p) {
+  static_cast<ReadAheadPool*>(p)->worker();
+  return nullptr;
+}
+
+bool ReadAheadPool::submit(
+    const std::shared_ptr<CompressedReader::ReadAheadBlock>& block,
+    size_t limit) {
+  pthread_mutex_lock(&mutex);
+  bool fits = bytes_charged + block->charge <= limit;
+  if (fits) {
+    bytes_charged += block->charge;
+    MemoryAccounting::add(MemoryAccounting::TRACE_READ_AHEAD, block->charge);
+    queue.push_back(block);
+    pthread_cond_broadcast(&cond);
+  } else {
+    // Our destructor will release the charge we didn't take.
+    block->charge = 0;
+  }
+  pthread_mutex_unlock(&mutex);
+  return fits;
+}
+
+bool ReadAheadPool::wait(CompressedReader::ReadAheadBlock& block) {
+  pthread_mutex_lock(&mutex);
+  while (!block.done) {
+    pthread_cond_wait(&cond, &mutex);
+  }
+  bool ok = block.ok;
+  pthread_mutex_unlock(&mutex);
+  return ok;
+}
+
+void ReadAheadPool::release(size_t charge) {
+  if (!charge) {
+    return;
+  }
+  pthread_mutex_lock(&mutex);
+  bytes_charged -= charge;
+  pthread_mutex_unlock(&mutex);
+  MemoryAccounting::remove(MemoryAccounting::TRACE_READ_AHEAD, charge);
+}
+
+void ReadAheadPool::worker() {
+  pthread_mutex_lock(&mutex);
+  while (true) {
+    if (queue.empty()) {
+      pthread_cond_wait(&cond, &mutex);
+      continue;
+    }
+    auto block = queue.front();
+    queue.pop_front();
+    pthread_mutex_unlock(&mutex);
+
+    std::vector<uint8_t> compressed_buf;
+    const uint8_t* compressed =
+        file_bytes(*block->fd, block->remote.get(), block->mapping.get(),
+                   block->file_offset + sizeof(block->header),
+                   block->header.compressed_length, compressed_buf);
+    block->data->resize(block->header.uncompressed_length);
+    bool ok = compressed &&
+              do_decompress((CompressedWriter::Codec)block->header.codec,
+                            compressed, block->header.compressed_length,
+                            *block->data);
+
+    pthread_mutex_lock(&mutex);
+    block->done = true;
+    block->ok = ok;
+    pthread_cond_broadcast(&cond);
+    // Drop our reference without holding the lock, since the destructor
+    // takes it.
+    pthread_mutex_unlock(&mutex);
+    block = nullptr;
+    pthread_mutex_lock(&mutex);
+  }
+}
+
 bool CompressedReader::read(void* data, size_t size) {
   while (size > 0) {
     if (error) {
       return false;
     }
 
-    if (buffer_read_pos < buffer.size()) {
-      size_t amount = std::min(size, buffer.size() - buffer_read_pos);
-      memcpy(data, &buffer[buffer_read_pos], amount);
+    if (buffer_read_pos < buffer->size()) {
+      size_t amount = std::min(size, buffer->size() - buffer_read_pos);
+      memcpy(data, buffer->data() + buffer_read_pos, amount);
       size -= amount;
       data = static_cast<char*>(data) + amount;
       buffer_read_pos += amount;
@@ -98,53 +440,320 @@ bool CompressedReader::read(void* data, size_t size) {
     }
 
     if (have_saved_state && !have_saved_buffer) {
-      std::swap(buffer, saved_buffer);
+      saved_buffer = buffer;
       have_saved_buffer = true;
     }
 
-    CompressedWriter::BlockHeader header;
-    if (!read_all(*fd, sizeof(header), &header, &fd_offset)) {
-      error = true;
+    if (!read_block()) {
       return false;
     }
+  }
+  return true;
+}
 
-    std::vector<uint8_t> compressed_buf;
-    compressed_buf.resize(header.compressed_length);
-    if (!read_all(*fd, compressed_buf.size(), &compressed_buf[0], &fd_offset)) {
-      error = true;
+bool CompressedReader::read_span(size_t size, Span* out) {
+  if (buffer_read_pos == buffer->size() && size > 0 && !error) {
+    if (have_saved_state && !have_saved_buffer) {
+      saved_buffer = buffer;
+      have_saved_buffer = true;
+    }
+    if (!read_block()) {
       return false;
     }
+  }
+  if (buffer->size() - buffer_read_pos >= size) {
+    out->owner = buffer;
+    out->ptr = buffer->data() + buffer_read_pos;
+    out->len = size;
+    buffer_read_pos += size;
+    return !error;
+  }
 
-    char ch;
-    if (pread(*fd, &ch, 1, fd_offset) == 0) {
-      eof = true;
+  // The data spans blocks, so we have to copy it.
+  auto copy = std::make_shared<std::vector<uint8_t> >(size);
+  out->owner = copy;
+  out->ptr = copy->data();
+  out->len = size;
+  return read(copy->data(), size);
+}
+
+bool CompressedReader::take_read_ahead_block() {
+  auto it = read_ahead.begin();
+  while (it != read_ahead.end() && (*it)->file_offset != fd_offset) {
+    ++it;
+  }
+  if (it == read_ahead.end()) {
+    if (!have_saved_state) {
+      // We've moved somewhere else; the read-ahead is useless.
+      read_ahead.clear();
     }
+    return false;
+  }
 
-    buffer.resize(header.uncompressed_length);
-    buffer_read_pos = 0;
-    if (!do_decompress(compressed_buf, buffer)) {
+  auto block = *it;
+  if (!ReadAheadPool::get().wait(*block)) {
+    error = true;
+    return true;
+  }
+  buffer = block->data;
+  if (!have_saved_state) {
+    // If we have saved state we'll probably be restored to before this
+    // block and read it again, so leave it in the queue.
+    read_ahead.erase(read_ahead.begin(), it + 1);
+  }
+  buffer_read_pos = 0;
+  fd_offset = block->file_offset + sizeof(block->header) +
+              block->header.compressed_length;
+  fd_uncompressed_offset += block->header.uncompressed_length;
+  if (!follow_finished &&
+      at_file_end(*fd, remote.get(), mapping.get(), fd_offset)) {
+    eof = true;
+  }
+  return true;
+}
+
+void CompressedReader::schedule_read_ahead() {
+  size_t limit = Flags::get().read_ahead_bytes;
+  if (!limit || eof) {
+    return;
+  }
+  uint64_t offset = fd_offset;
+  if (!read_ahead.empty()) {
+    auto& last = *read_ahead.back();
+    offset = last.file_offset + sizeof(last.header) +
+             last.header.compressed_length;
+  }
+  while (read_ahead.size() < READ_AHEAD_BLOCKS) {
+    CompressedWriter::BlockHeader header;
+    uint64_t header_offset = offset;
+    if (!read_all(*fd, remote.get(), mapping.get(), sizeof(header), &header,
+                  &offset)) {
+      // Probably end of file.
+      return;
+    }
+    if (follow_finished && !block_written(header_offset)) {
+      // Not all written yet.
+      return;
+    }
+    auto block = std::make_shared<ReadAheadBlock>(fd, remote, mapping,
+                                                  header_offset, header);
+    if (!ReadAheadPool::get().submit(block, limit)) {
+      return;
+    }
+    read_ahead.push_back(block);
+    offset += header.compressed_length;
+    if (mapping) {
+      // Start paging the block in so the worker doesn't fault on it.
+      uint64_t page_mask = ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+      uint64_t start = header_offset & page_mask;
+      madvise(const_cast<uint8_t*>(mapping->data) + start,
+              std::min<uint64_t>(offset, mapping->size) - start,
+              MADV_WILLNEED);
+    }
+  }
+}
+
+bool CompressedReader::read_block() {
+  if (take_read_ahead_block()) {
+    if (error) {
+      return false;
+    }
+    schedule_read_ahead();
+    return true;
+  }
+
+  if (follow_finished && !wait_for_block(fd_offset)) {
+    error = true;
+    return false;
+  }
+  CompressedWriter::BlockHeader header;
+  if (!read_all(*fd, remote.get(), mapping.get(), sizeof(header), &header,
+                &fd_offset)) {
+    error = true;
+    return false;
+  }
+
+  std::vector<uint8_t> compressed_buf;
+  const uint8_t* compressed =
+      file_bytes(*fd, remote.get(), mapping.get(), fd_offset,
+                 header.compressed_length, compressed_buf);
+  if (!compressed) {
+    error = true;
+    return false;
+  }
+  fd_offset += header.compressed_length;
+
+  if (!follow_finished &&
+      at_file_end(*fd, remote.get(), mapping.get(), fd_offset)) {
+    eof = true;
+  }
+
+  buffer = std::make_shared<std::vector<uint8_t> >(header.uncompressed_length);
+  buffer_read_pos = 0;
+  fd_uncompressed_offset += header.uncompressed_length;
+  if (!do_decompress((CompressedWriter::Codec)header.codec, compressed,
+                     header.compressed_length, *buffer)) {
+    error = true;
+    return false;
+  }
+  schedule_read_ahead();
+  return true;
+}
+
+void CompressedReader::build_block_index() {
+  auto index = std::make_shared<CompressedWriter::BlockIndex>();
+  uint64_t offset = 0;
+  uint64_t uncompressed_offset = 0;
+  CompressedWriter::BlockHeader header;
+  while (true) {
+    uint64_t header_offset = offset;
+    if (!read_all(*fd, remote.get(), mapping.get(), sizeof(header), &header,
+                  &offset)) {
+      break;
+    }
+    CompressedWriter::BlockIndexEntry entry = { uncompressed_offset,
+                                                header_offset };
+    index->push_back(entry);
+    uncompressed_offset += header.uncompressed_length;
+    offset += header.compressed_length;
+  }
+  block_index = index;
+}
+
+bool CompressedReader::seek(uint64_t uncompressed_offset) {
+  assert(!have_saved_state);
+  if (error) {
+    return false;
+  }
+  if (!block_index) {
+    build_block_index();
+  }
+
+  uint64_t buffer_start = fd_uncompressed_offset - buffer->size();
+  if (buffer_start <= uncompressed_offset &&
+      uncompressed_offset < fd_uncompressed_offset) {
+    buffer_read_pos = uncompressed_offset - buffer_start;
+    return true;
+  }
+
+  // Find the last block starting at or before uncompressed_offset.
+  auto it = std::upper_bound(
+      block_index->begin(), block_index->end(), uncompressed_offset,
+      [](uint64_t offset, const CompressedWriter::BlockIndexEntry& entry) {
+        return offset < entry.uncompressed_offset;
+      });
+  if (it == block_index->begin()) {
+    // Only an empty stream has no blocks, and offset 0 is its end.
+    if (uncompressed_offset > 0) {
       error = true;
       return false;
     }
+    fd_offset = 0;
+    fd_uncompressed_offset = 0;
+    buffer = std::make_shared<std::vector<uint8_t> >();
+    buffer_read_pos = 0;
+    return true;
   }
+  --it;
+  read_ahead.clear();
+  fd_offset = it->file_offset;
+  fd_uncompressed_offset = it->uncompressed_offset;
+  buffer = std::make_shared<std::vector<uint8_t> >();
+  buffer_read_pos = 0;
+  eof = false;
+  if (!read_block()) {
+    return false;
+  }
+  if (uncompressed_offset - it->uncompressed_offset > buffer->size()) {
+    error = true;
+    return false;
+  }
+  buffer_read_pos = uncompressed_offset - it->uncompressed_offset;
   return true;
 }
 
+void CompressedReader::prefetch(uint64_t end_file_offset) {
+  size_t limit = Flags::get().read_ahead_bytes;
+  if (error || !fd || !limit) {
+    return;
+  }
+  if (end_file_offset > fd_offset) {
+    uint64_t len = std::min<uint64_t>(end_file_offset - fd_offset, limit);
+    if (remote) {
+      remote->prefetch(fd_offset, len);
+    } else if (mapping) {
+      uint64_t page_mask = ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+      uint64_t start = fd_offset & page_mask;
+      uint64_t end = std::min<uint64_t>(fd_offset + len, mapping->size);
+      if (start < end) {
+        madvise(const_cast<uint8_t*>(mapping->data) + start, end - start,
+                MADV_WILLNEED);
+      }
+    } else {
+      posix_fadvise(*fd, fd_offset, len, POSIX_FADV_WILLNEED);
+    }
+  }
+  schedule_read_ahead();
+}
+
 void CompressedReader::rewind() {
   assert(!have_saved_state);
+  read_ahead.clear();
   fd_offset = 0;
+  fd_uncompressed_offset = 0;
   buffer_read_pos = 0;
-  buffer.clear();
+  buffer = std::make_shared<std::vector<uint8_t> >();
+  eof = !follow_finished && at_file_end(*fd, remote.get(), mapping.get(), 0);
+}
+
+void CompressedReader::follow(const std::function<bool()>& finished) {
+  assert(!remote && "Can't follow a remote file");
+  follow_finished = std::make_shared<const std::function<bool()> >(finished);
+  mapping = nullptr;
   eof = false;
 }
 
-void CompressedReader::close() { fd = nullptr; }
+bool CompressedReader::block_written(uint64_t offset) const {
+  // Get the size first; the block may be completed after it.
+  struct stat st;
+  if (fstat(*fd, &st) < 0) {
+    return false;
+  }
+  CompressedWriter::BlockHeader header;
+  uint64_t data_offset = offset;
+  return read_all(*fd, nullptr, nullptr, sizeof(header), &header,
+                  &data_offset) &&
+         (uint64_t)st.st_size >= data_offset + header.compressed_length;
+}
+
+bool CompressedReader::wait_for_block(uint64_t offset) const {
+  while (true) {
+    // Ask before looking, so we can't miss a block written just before
+    // the writer finished.
+    bool finished = (*follow_finished)();
+    if (block_written(offset)) {
+      return true;
+    }
+    if (finished) {
+      return false;
+    }
+    usleep(FOLLOW_POLL_INTERVAL_US);
+  }
+}
+
+void CompressedReader::close() {
+  read_ahead.clear();
+  remote = nullptr;
+  mapping = nullptr;
+  fd = nullptr;
+}
 
 void CompressedReader::save_state() {
   assert(!have_saved_state);
   have_saved_state = true;
   have_saved_buffer = false;
   saved_fd_offset = fd_offset;
+  saved_fd_uncompressed_offset = fd_uncompressed_offset;
   saved_buffer_read_pos = buffer_read_pos;
 }
 
@@ -155,9 +764,10 @@ void CompressedReader::restore_state() {
     eof = false;
   }
   fd_offset = saved_fd_offset;
+  fd_uncompressed_offset = saved_fd_uncompressed_offset;
   if (have_saved_buffer) {
-    std::swap(buffer, saved_buffer);
-    saved_buffer.clear();
+    buffer = saved_buffer;
+    saved_buffer = nullptr;
   }
   buffer_read_pos = saved_buffer_read_pos;
 }
@@ -166,7 +776,8 @@ uint64_t CompressedReader::uncompressed_bytes() const {
   uint64_t offset = 0;
   uint64_t uncompressed_bytes = 0;
   CompressedWriter::BlockHeader header;
-  while (read_all(*fd, sizeof(header), &header, &offset)) {
+  while (read_all(*fd, remote.get(), mapping.get(), sizeof(header), &header,
+                  &offset)) {
     uncompressed_bytes += header.uncompressed_length;
     offset += header.compressed_length;
   }
@@ -174,5 +785,8 @@ uint64_t CompressedReader::uncompressed_bytes() const {
 }
 
 uint64_t CompressedReader::compressed_bytes() const {
+  if (remote) {
+    return remote->size();
+  }
   return lseek(*fd, 0, SEEK_END);
 }
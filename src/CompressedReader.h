@@ -6,30 +6,141 @@
 #include <pthread.h>
 #include <stdint.h>
 
+#include <deque>
+#include <functional>
 #include <memory>
 #include <vector>
 #include <string>
 
+#include "CompressedWriter.h"
 #include "ScopedFd.h"
 
+class RemoteFile;
+
 /**
  * CompressedReader opens an input file written by CompressedWriter
- * and reads data from it. Currently data is decompressed by the thread that
- * calls read().
+ * and reads data from it. While the caller consumes one block, the next few
+ * blocks are decompressed ahead of the read cursor by a pool of background
+ * threads shared by all readers. The total memory used for read-ahead is
+ * capped by Flags::read_ahead_bytes; when the cap is reached, or the reader
+ * seeks, blocks are decompressed by the thread that calls read().
+ *
+ * Files on local disk-backed filesystems are mapped into memory and
+ * decompressed straight from the mapping, with madvise() paging in blocks
+ * ahead of the reader. Other files are read with pread(). Files of a
+ * trace served by `rr serve` are read through a RemoteFile.
+ *
+ * A reader can also follow a file that CompressedWriter is still writing;
+ * see follow().
  */
 class CompressedReader {
 public:
   CompressedReader(const std::string& filename);
+  CompressedReader(const std::shared_ptr<RemoteFile>& remote);
   CompressedReader(const CompressedReader& aOther);
   ~CompressedReader();
   bool good() const { return !error; }
-  bool at_end() const { return eof && buffer_read_pos == buffer.size(); }
+  bool at_end() const {
+    return uncompressed_offset() >= end_offset ||
+           (buffer_read_pos == buffer->size() &&
+            (eof || (follow_finished && !wait_for_block(fd_offset))));
+  }
   // Returns true if successful. Otherwise there's an error and good()
   // will be false.
   bool read(void* data, size_t size);
+
+  /**
+   * A read-only view of bytes returned by read_span(). If the bytes lay
+   * within one decompressed block, the view keeps that block alive and
+   * points into it; otherwise it owns a copy.
+   */
+  class Span {
+  public:
+    Span() : ptr(nullptr), len(0) {}
+    explicit Span(const std::shared_ptr<const std::vector<uint8_t> >& bytes)
+        : owner(bytes), ptr(bytes->data()), len(bytes->size()) {}
+    const uint8_t* data() const { return ptr; }
+    size_t size() const { return len; }
+    /**
+     * Return a view of |size| bytes at |offset| in this one, keeping
+     * the same bytes alive.
+     */
+    Span sub(size_t offset, size_t size) const {
+      Span s;
+      s.owner = owner;
+      s.ptr = ptr + offset;
+      s.len = size;
+      return s;
+    }
+
+  private:
+    friend class CompressedReader;
+    std::shared_ptr<const std::vector<uint8_t> > owner;
+    const uint8_t* ptr;
+    size_t len;
+  };
+  /**
+   * Like read(), but avoids copying the data when possible. Returns true
+   * if successful.
+   */
+  bool read_span(size_t size, Span* out);
   void rewind();
   void close();
 
+  /**
+   * Follow a file that's still being written. Reading past the blocks
+   * written so far, or checking at_end() there, waits for the next block
+   * until 'finished' returns true, after which the file is known to be
+   * complete. The file isn't mapped, since it grows. Copies of this reader
+   * follow the file too. Not supported for remote files.
+   */
+  void follow(const std::function<bool()>& finished);
+
+  /**
+   * Treat the stream as ending at 'uncompressed_offset', e.g. because the
+   * file may have been cut off after it. Copies of this reader inherit
+   * the end.
+   */
+  void set_end(uint64_t uncompressed_offset) {
+    end_offset = uncompressed_offset;
+  }
+
+  /**
+   * Supply the index of blocks in this file, enabling seek(). The index
+   * is shared with copies of this reader.
+   */
+  void set_block_index(
+      const std::shared_ptr<const CompressedWriter::BlockIndex>& index) {
+    block_index = index;
+  }
+  bool has_block_index() const { return block_index != nullptr; }
+  /**
+   * Position the reader so the next read() returns the byte at
+   * 'uncompressed_offset'. Only the block containing that byte is
+   * decompressed. If no block index has been supplied, one is built by
+   * walking the block headers. Requires no saved state.
+   * Returns false on error.
+   */
+  bool seek(uint64_t uncompressed_offset);
+  /**
+   * The offset in the uncompressed stream of the next byte read() will
+   * return.
+   */
+  uint64_t uncompressed_offset() const {
+    return fd_uncompressed_offset - (buffer->size() - buffer_read_pos);
+  }
+  /**
+   * The offset in the file of the next block read() will need.
+   */
+  uint64_t file_offset() const { return fd_offset; }
+  /**
+   * Hint that the reader is about to read forward to (roughly) file offset
+   * 'end_file_offset': ask the kernel to start reading that range, up to
+   * Flags::read_ahead_bytes of it, and start decompressing the next blocks
+   * in the background.
+   */
+  void prefetch(uint64_t end_file_offset);
+
   /**
    * Save the current position. Nested saves are not allowed.
    */
@@ -76,21 +187,62 @@ public:
     return *this;
   }
 
+  /**
+   * The maximum number of blocks decompressed ahead of the read cursor.
+   */
+  static const size_t READ_AHEAD_BLOCKS = 4;
+
+  struct ReadAheadBlock;
+  struct Mapping;
+
 protected:
+  // Read and decompress the block at fd_offset into buffer.
+  bool read_block();
+  void build_block_index();
+  // Fill buffer from a read-ahead block for fd_offset, if there is one.
+  // Returns false if there isn't.
+  bool take_read_ahead_block();
+  void schedule_read_ahead();
+  // Return true if the whole block at file offset 'offset' is in the file.
+  bool block_written(uint64_t offset) const;
+  // When following, wait until the block at 'offset' has been written.
+  // Returns false if the writer finished without writing it.
+  bool wait_for_block(uint64_t offset) const;
+
   /* Our fd might be the dup of another fd, so we can't rely on its current file
      position.
      Instead track the current position in fd_offset and use pread. */
   uint64_t fd_offset;
+  /* Offset in the uncompressed stream corresponding to fd_offset */
+  uint64_t fd_uncompressed_offset;
   std::shared_ptr<ScopedFd> fd;
+  // Where we read from instead of |fd| if the file is remote.
+  std::shared_ptr<RemoteFile> remote;
+  // The whole file mapped read-only, or null if we use pread() on fd.
+  std::shared_ptr<const Mapping> mapping;
+  std::shared_ptr<const CompressedWriter::BlockIndex> block_index;
+  // Set if we're following a file that's being written; returns true once
+  // the writer has finished.
+  std::shared_ptr<const std::function<bool()> > follow_finished;
+  // at_end() is true from here on; UINT64_MAX if the file's end is the
+  // stream's end.
+  uint64_t end_offset;
   bool error;
   bool eof;
-  std::vector<uint8_t> buffer;
+  // The current decompressed block. Never modified once filled, since
+  // Spans and copies of this reader may share it; reading the next block
+  // replaces it. Never null.
+  std::shared_ptr<std::vector<uint8_t> > buffer;
   size_t buffer_read_pos;
+  // Blocks being decompressed in the background, in file order. Not
+  // shared with copies of this reader.
+  std::deque<std::shared_ptr<ReadAheadBlock> > read_ahead;
 
   bool have_saved_state;
   bool have_saved_buffer;
   uint64_t saved_fd_offset;
-  std::vector<uint8_t> saved_buffer;
+  uint64_t saved_fd_uncompressed_offset;
+  std::shared_ptr<std::vector<uint8_t> > saved_buffer;
   size_t saved_buffer_read_pos;
 };
 
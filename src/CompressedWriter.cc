@@ -7,29 +7,148 @@
 #include "CompressedWriter.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 #include <zlib.h>
+#ifdef RR_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef RR_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "MemoryAccounting.h"
 
 using namespace std;
 
+bool CompressedWriter::codec_available(Codec codec) {
+  switch (codec) {
+    case ZLIB:
+      return true;
+#ifdef RR_HAVE_LZ4
+    case LZ4:
+      return true;
+#endif
+#ifdef RR_HAVE_ZSTD
+    case ZSTD:
+      return true;
+#endif
+    default:
+      return false;
+  }
+}
+
+const char* CompressedWriter::codec_name(Codec codec) {
+  switch (codec) {
+    case ZLIB:
+      return "zlib";
+    case LZ4:
+      return "lz4";
+    case ZSTD:
+      return "zstd";
+    default:
+      return "unknown";
+  }
+}
+
+bool CompressedWriter::parse_codec(const string& name, Codec* codec) {
+  for (int c = ZLIB; c < CODEC_COUNT; ++c) {
+    if (name == codec_name((Codec)c)) {
+      *codec = (Codec)c;
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t CompressedWriter::max_compressed_size(Codec codec, size_t length) {
+  switch (codec) {
+#ifdef RR_HAVE_LZ4
+    case LZ4:
+      return LZ4_compressBound(length);
+#endif
+#ifdef RR_HAVE_ZSTD
+    case ZSTD:
+      return ZSTD_compressBound(length);
+#endif
+    default:
+      // Add slop for incompressible data
+      return (size_t)(length * 1.1) + 64;
+  }
+}
+
+/**
+ * The level 'codec' compresses at when asked for 'level', 0 being the
+ * codec's default.
+ */
+static int resolved_level(CompressedWriter::Codec codec, int level) {
+  if (level > 0) {
+    return level;
+  }
+  switch (codec) {
+    case CompressedWriter::LZ4:
+      // The acceleration factor.
+      return 1;
+#ifdef RR_HAVE_ZSTD
+    case CompressedWriter::ZSTD:
+      return ZSTD_CLEVEL_DEFAULT;
+#endif
+    default:
+      return 6;
+  }
+}
+
+// Higher LZ4 levels are faster; higher zlib and zstd levels are slower.
+static const int MAX_LZ4_ACCELERATION = 64;
+
+static int faster_level(CompressedWriter::Codec codec, int level) {
+  if (codec == CompressedWriter::LZ4) {
+    return min(level * 2, MAX_LZ4_ACCELERATION);
+  }
+  return max(level - 1, 1);
+}
+
+static int slower_level(CompressedWriter::Codec codec, int level,
+                        int configured) {
+  if (codec == CompressedWriter::LZ4) {
+    return max(level / 2, configured);
+  }
+  return min(level + 1, configured);
+}
+
+// Waits in a row before switching to a faster level, and updates in a row
+// without a wait before switching back one step.
+static const uint32_t ADAPT_AFTER_WAITS = 4;
+static const uint32_t RESTORE_AFTER_CALM = 64;
+
 void* CompressedWriter::compression_thread_callback(void* p) {
   static_cast<CompressedWriter*>(p)->compression_thread();
   return nullptr;
 }
 
 CompressedWriter::CompressedWriter(const string& filename, size_t block_size,
-                                   uint32_t num_threads)
+                                   uint32_t num_threads, Codec codec,
+                                   int level)
     : fd(filename.c_str(),
          O_CLOEXEC | O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, 0400) {
   this->block_size = block_size;
+  this->codec = codec_available(codec) ? codec : ZLIB;
+  // A level only makes sense for the codec it was chosen for.
+  this->level = this->codec == codec ? level : 0;
+  assert(max_compressed_size(this->codec, block_size) < (1 << 28) &&
+         "Block too large for BlockHeader::compressed_length");
   threads.resize(num_threads);
   thread_pos.resize(num_threads);
   buffer.resize(block_size * (num_threads + 2));
+  MemoryAccounting::add(MemoryAccounting::TRACE_WRITE_BUFFERS, buffer.size());
   pthread_mutex_init(&mutex, nullptr);
   pthread_cond_init(&cond, nullptr);
 
@@ -38,8 +157,26 @@ CompressedWriter::CompressedWriter(const string& filename, size_t block_size,
   }
   next_thread_pos = 0;
   next_thread_end_pos = 0;
+  flush_pos = 0;
   closing = false;
   write_error = false;
+  next_file_pos = 0;
+  written_pos = 0;
+  sync_writes = false;
+  local_blocks = 0;
+  compression_done = false;
+  producer_waits = 0;
+  producer_wait_time = 0;
+  memset(producer_wait_histogram, 0, sizeof(producer_wait_histogram));
+  producer_max_in_flight = 0;
+  adaptive_level = false;
+  waits_in_a_row = 0;
+  calm_in_a_row = 0;
+  level_now = resolved_level(this->codec, this->level);
+  stats.assign(num_threads, ThreadStats{ 0, 0, 0, 0 });
+  // Enough queued blocks to keep the I/O thread busy while every
+  // compressor works on its next block.
+  max_pending_writes = num_threads + 2;
 
   producer_reserved_pos = 0;
   producer_reserved_write_pos = 0;
@@ -50,27 +187,42 @@ CompressedWriter::CompressedWriter(const string& filename, size_t block_size,
     return;
   }
 
+  size_t last_slash = filename.rfind('/');
+  string base_name = last_slash == string::npos
+                         ? filename
+                         : filename.substr(last_slash + 1);
   // Hold the lock so threads don't inspect the 'threads' array
   // until we've finished initializing it.
   pthread_mutex_lock(&mutex);
   for (uint32_t i = 0; i < num_threads; ++i) {
     pthread_create(&threads[i], nullptr, compression_thread_callback, this);
-    size_t last_slash = filename.rfind('/');
-    string thread_name =
-        string("compress ") + (last_slash == string::npos
-                                   ? filename
-                                   : filename.substr(last_slash + 1));
+    string thread_name = string("compress ") + base_name;
     pthread_setname_np(threads[i], thread_name.substr(0, 15).c_str());
   }
+  pthread_create(&io_thread_id, nullptr, io_thread_callback, this);
+  pthread_setname_np(io_thread_id,
+                     (string("write ") + base_name).substr(0, 15).c_str());
   pthread_mutex_unlock(&mutex);
 }
 
 CompressedWriter::~CompressedWriter() {
   close();
+  MemoryAccounting::remove(MemoryAccounting::TRACE_WRITE_BUFFERS,
+                           buffer.size());
   pthread_mutex_destroy(&mutex);
   pthread_cond_destroy(&cond);
 }
 
+void CompressedWriter::set_sink(shared_ptr<BlockSink> sink,
+                                size_t local_blocks) {
+  pthread_mutex_lock(&mutex);
+  assert(next_thread_pos == 0 && producer_reserved_write_pos == 0 &&
+         "set_sink() called after data was written");
+  this->sink = sink;
+  this->local_blocks = local_blocks;
+  pthread_mutex_unlock(&mutex);
+}
+
 void CompressedWriter::write(const void* data, size_t size) {
   while (!error && size > 0) {
     uint64_t reservation_size =
@@ -94,6 +246,29 @@ void CompressedWriter::write(const void* data, size_t size) {
   }
 }
 
+void CompressedWriter::write_filled(size_t size, const Filler& fill) {
+  size_t offset = 0;
+  while (!error && offset < size) {
+    uint64_t reservation_size =
+        producer_reserved_upto_pos - producer_reserved_write_pos;
+    if (reservation_size == 0) {
+      update_reservation(WAIT);
+      continue;
+    }
+    size_t buf_offset = (size_t)(producer_reserved_write_pos % buffer.size());
+    size_t amount = min(buffer.size() - buf_offset,
+                        (size_t)min<uint64_t>(reservation_size, size - offset));
+    fill(offset, &buffer[buf_offset], amount);
+    producer_reserved_write_pos += amount;
+    offset += amount;
+  }
+
+  if (!error && producer_reserved_write_pos - producer_reserved_pos >=
+                    buffer.size() / 2) {
+    update_reservation(NOWAIT);
+  }
+}
+
 void CompressedWriter::update_reservation(WaitFlag wait_flag) {
   pthread_mutex_lock(&mutex);
 
@@ -103,6 +278,7 @@ void CompressedWriter::update_reservation(WaitFlag wait_flag) {
   // Wake up threads that might be waiting to consume data.
   pthread_cond_broadcast(&cond);
 
+  bool waited = false;
   while (!error) {
     if (write_error) {
       error = true;
@@ -113,18 +289,69 @@ void CompressedWriter::update_reservation(WaitFlag wait_flag) {
     for (uint32_t i = 0; i < thread_pos.size(); ++i) {
       completed_pos = min(completed_pos, thread_pos[i]);
     }
+    producer_max_in_flight = max(producer_max_in_flight,
+                                 producer_reserved_pos - completed_pos);
     producer_reserved_upto_pos = completed_pos + buffer.size();
     if (producer_reserved_pos < producer_reserved_upto_pos ||
         wait_flag == NOWAIT) {
       break;
     }
 
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     pthread_cond_wait(&cond, &mutex);
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double wait =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    ++producer_waits;
+    producer_wait_time += wait;
+    int bucket = 0;
+    for (double limit = 1e-5;
+         bucket < WAIT_HISTOGRAM_BUCKETS - 1 && wait >= limit; limit *= 10) {
+      ++bucket;
+    }
+    ++producer_wait_histogram[bucket];
+    waited = true;
+  }
+  if (adaptive_level) {
+    adapt_level(waited);
   }
 
   pthread_mutex_unlock(&mutex);
 }
 
+void CompressedWriter::adapt_level(bool waited) {
+  int configured = resolved_level(codec, level);
+  if (waited) {
+    calm_in_a_row = 0;
+    if (++waits_in_a_row >= ADAPT_AFTER_WAITS) {
+      waits_in_a_row = 0;
+      level_now = faster_level(codec, level_now);
+    }
+    return;
+  }
+  waits_in_a_row = 0;
+  if (level_now != configured && ++calm_in_a_row >= RESTORE_AFTER_CALM) {
+    calm_in_a_row = 0;
+    level_now = slower_level(codec, level_now, configured);
+  }
+}
+
+vector<CompressedWriter::ThreadStats> CompressedWriter::thread_stats() const {
+  pthread_mutex_lock(&mutex);
+  vector<ThreadStats> result = stats;
+  pthread_mutex_unlock(&mutex);
+  return result;
+}
+
+int CompressedWriter::current_level() const {
+  pthread_mutex_lock(&mutex);
+  int result = level_now;
+  pthread_mutex_unlock(&mutex);
+  return result;
+}
+
 void CompressedWriter::compression_thread() {
   pthread_mutex_lock(&mutex);
 
@@ -133,33 +360,57 @@ void CompressedWriter::compression_thread() {
   for (thread_index = 0; threads[thread_index] != self; ++thread_index) {
   }
 
-  // Add slop for incompressible data
   vector<uint8_t> outputbuf;
-  outputbuf.resize((size_t)(block_size * 1.1) + sizeof(BlockHeader));
-  BlockHeader* header = reinterpret_cast<BlockHeader*>(&outputbuf[0]);
 
   while (true) {
+    // Blocks end at multiples of block_size, even after a flush() made a
+    // short block.
+    uint64_t block_end = next_thread_pos - next_thread_pos % block_size +
+                         block_size;
     if (!write_error && next_thread_pos < next_thread_end_pos &&
-        (closing || next_thread_pos + block_size <= next_thread_end_pos)) {
+        (closing || block_end <= next_thread_end_pos ||
+         next_thread_pos < flush_pos)) {
       thread_pos[thread_index] = next_thread_pos;
-      next_thread_pos = min(next_thread_end_pos, next_thread_pos + block_size);
-      // header->uncompressed_length must be <= block_size,
-      // therefore fits in a size_t.
-      header->uncompressed_length =
-          (size_t)(next_thread_pos - thread_pos[thread_index]);
+      next_thread_pos = min(next_thread_end_pos, block_end);
+      // length must be <= block_size, therefore fits in a size_t.
+      size_t length = (size_t)(next_thread_pos - thread_pos[thread_index]);
+      int block_level = level_now;
+      if (outputbuf.empty() && !free_buffers.empty()) {
+        outputbuf.swap(free_buffers.back());
+        free_buffers.pop_back();
+      }
 
       pthread_mutex_unlock(&mutex);
-      header->compressed_length =
-          do_compress(thread_pos[thread_index], header->uncompressed_length,
-                      &outputbuf[sizeof(BlockHeader)],
-                      outputbuf.size() - sizeof(BlockHeader));
+      if (outputbuf.empty()) {
+        outputbuf.resize(max_compressed_size(codec, block_size) +
+                         sizeof(BlockHeader));
+      }
+      BlockHeader* header = reinterpret_cast<BlockHeader*>(&outputbuf[0]);
+      header->codec = codec;
+      header->uncompressed_length = length;
+      struct timespec start;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      header->compressed_length = do_compress(
+          thread_pos[thread_index], header->uncompressed_length, block_level,
+          &outputbuf[sizeof(BlockHeader)],
+          outputbuf.size() - sizeof(BlockHeader));
+      struct timespec end;
+      clock_gettime(CLOCK_MONOTONIC, &end);
       pthread_mutex_lock(&mutex);
 
+      ThreadStats& st = stats[thread_index];
+      ++st.blocks;
+      st.uncompressed_bytes += length;
+      st.compressed_bytes += header->compressed_length;
+      st.seconds +=
+          (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
       if (header->compressed_length == 0) {
         write_error = true;
       }
 
-      // wait until we're the next thread that needs to write
+      // wait until we're the next thread that needs to write, and the
+      // I/O thread has room for another block
       while (!write_error) {
         bool other_thread_write_first = false;
         for (uint32_t i = 0; i < thread_pos.size(); ++i) {
@@ -167,22 +418,36 @@ void CompressedWriter::compression_thread() {
             other_thread_write_first = true;
           }
         }
-        if (!other_thread_write_first) {
+        if (!other_thread_write_first &&
+            pending_writes.size() < max_pending_writes) {
           break;
         }
         pthread_cond_wait(&cond, &mutex);
       }
 
       if (!write_error) {
-        pthread_mutex_unlock(&mutex);
-        ::write(fd, &outputbuf[0],
-                sizeof(BlockHeader) + header->compressed_length);
-        pthread_mutex_lock(&mutex);
+        BlockIndexEntry entry = { thread_pos[thread_index], next_file_pos };
+        index.push_back(entry);
+        PendingWrite w;
+        w.length = sizeof(BlockHeader) + header->compressed_length;
+        w.uncompressed_end = thread_pos[thread_index] + length;
+        next_file_pos += w.length;
+        // The block that falls out of the local ring once this one has
+        // been delivered, if any.
+        w.release_offset = 0;
+        w.release_length = 0;
+        if (sink && local_blocks > 0 && index.size() > local_blocks) {
+          size_t i = index.size() - 1 - local_blocks;
+          w.release_offset = index[i].file_offset;
+          w.release_length = index[i + 1].file_offset - w.release_offset;
+        }
+        w.data.swap(outputbuf);
+        pending_writes.push_back(move(w));
       }
 
       thread_pos[thread_index] = UINT64_MAX;
       // do a broadcast because we might need to unblock
-      // the producer thread or a compressor thread waiting
+      // the producer thread, the I/O thread or a compressor thread waiting
       // for us to write.
       pthread_cond_broadcast(&cond);
       continue;
@@ -198,6 +463,129 @@ void CompressedWriter::compression_thread() {
   pthread_mutex_unlock(&mutex);
 }
 
+void* CompressedWriter::io_thread_callback(void* p) {
+  static_cast<CompressedWriter*>(p)->io_thread();
+  return nullptr;
+}
+
+/**
+ * Write 'count' buffers to 'fd' with as few syscalls as possible.
+ * Modifies 'iov'.
+ */
+static bool write_all(int fd, struct iovec* iov, int count) {
+  while (count > 0) {
+    ssize_t ret = writev(fd, iov, count);
+    if (ret < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return false;
+    }
+    while (count > 0 && (size_t)ret >= iov->iov_len) {
+      ret -= iov->iov_len;
+      ++iov;
+      --count;
+    }
+    if (count > 0) {
+      iov->iov_base = static_cast<char*>(iov->iov_base) + ret;
+      iov->iov_len -= ret;
+    }
+  }
+  return true;
+}
+
+void CompressedWriter::io_thread() {
+  pthread_mutex_lock(&mutex);
+
+  vector<PendingWrite> batch;
+  vector<struct iovec> iov;
+
+  while (true) {
+    if (!pending_writes.empty() && !write_error) {
+      // Take everything that's ready; blocks are queued in file order.
+      while (!pending_writes.empty() && batch.size() < MAX_WRITE_BATCH) {
+        batch.push_back(move(pending_writes.front()));
+        pending_writes.pop_front();
+      }
+      bool sync = sync_writes;
+      // Compressors may be waiting for queue space.
+      pthread_cond_broadcast(&cond);
+      pthread_mutex_unlock(&mutex);
+
+      iov.resize(batch.size());
+      for (size_t i = 0; i < batch.size(); ++i) {
+        iov[i].iov_base = batch[i].data.data();
+        iov[i].iov_len = batch[i].length;
+      }
+      bool ok = write_all(fd, iov.data(), iov.size());
+      if (ok && sync) {
+        ok = fdatasync(fd) == 0;
+      }
+      for (size_t i = 0; ok && i < batch.size(); ++i) {
+        ok = !sink || sink->write_block(batch[i].data.data(), batch[i].length);
+        if (ok && batch[i].release_length > 0) {
+          // Failure just means the space stays in use, e.g. on filesystems
+          // that can't punch holes.
+          fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    batch[i].release_offset, batch[i].release_length);
+        }
+      }
+
+      pthread_mutex_lock(&mutex);
+      if (!ok) {
+        write_error = true;
+      } else {
+        written_pos = batch.back().uncompressed_end;
+      }
+      for (auto& w : batch) {
+        free_buffers.push_back(move(w.data));
+      }
+      batch.clear();
+      // The producer may be waiting to find out about write_error.
+      pthread_cond_broadcast(&cond);
+      continue;
+    }
+
+    if (compression_done && (write_error || pending_writes.empty())) {
+      break;
+    }
+
+    pthread_cond_wait(&cond, &mutex);
+  }
+
+  pthread_mutex_unlock(&mutex);
+}
+
+uint64_t CompressedWriter::written_offset() const {
+  pthread_mutex_lock(&mutex);
+  uint64_t pos = written_pos;
+  pthread_mutex_unlock(&mutex);
+  return pos;
+}
+
+void CompressedWriter::set_sync_writes(bool sync) {
+  pthread_mutex_lock(&mutex);
+  sync_writes = sync;
+  pthread_mutex_unlock(&mutex);
+}
+
+void CompressedWriter::set_thread_affinity(const cpu_set_t& cpus) {
+  for (auto thread : threads) {
+    pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+  }
+  pthread_setaffinity_np(io_thread_id, sizeof(cpus), &cpus);
+}
+
+void CompressedWriter::flush() {
+  if (error) {
+    return;
+  }
+  pthread_mutex_lock(&mutex);
+  flush_pos = producer_reserved_write_pos;
+  pthread_mutex_unlock(&mutex);
+  update_reservation(NOWAIT);
+}
+
 void CompressedWriter::close() {
   if (!fd.is_open()) {
     return;
@@ -214,14 +602,67 @@ void CompressedWriter::close() {
     pthread_join(*i, nullptr);
   }
 
+  pthread_mutex_lock(&mutex);
+  compression_done = true;
+  pthread_cond_broadcast(&cond);
+  pthread_mutex_unlock(&mutex);
+  pthread_join(io_thread_id, nullptr);
+  if (write_error) {
+    error = true;
+  }
+
+  // Let the sink know the stream is complete.
+  sink = nullptr;
   fd.close();
 }
 
 size_t CompressedWriter::do_compress(uint64_t offset, size_t length,
-                                     uint8_t* outputbuf, size_t outputbuf_len) {
+                                     int level, uint8_t* outputbuf,
+                                     size_t outputbuf_len) {
+  switch (codec) {
+    case ZLIB:
+      return do_compress_zlib(offset, length, level, outputbuf, outputbuf_len);
+#ifdef RR_HAVE_LZ4
+    case LZ4: {
+      // Blocks never cross a multiple of block_size and the buffer size is
+      // a multiple of block_size, so a block never wraps around the buffer.
+      size_t buf_offset = (size_t)(offset % buffer.size());
+      assert(buf_offset + length <= buffer.size());
+      int result = LZ4_compress_fast(
+          reinterpret_cast<const char*>(&buffer[buf_offset]),
+          reinterpret_cast<char*>(outputbuf), length, outputbuf_len, level);
+      if (result <= 0) {
+        assert(0 && "LZ4_compress_fast failed!");
+        return 0;
+      }
+      return result;
+    }
+#endif
+#ifdef RR_HAVE_ZSTD
+    case ZSTD: {
+      size_t buf_offset = (size_t)(offset % buffer.size());
+      assert(buf_offset + length <= buffer.size());
+      size_t result = ZSTD_compress(outputbuf, outputbuf_len,
+                                    &buffer[buf_offset], length, level);
+      if (ZSTD_isError(result)) {
+        assert(0 && "ZSTD_compress failed!");
+        return 0;
+      }
+      return result;
+    }
+#endif
+    default:
+      assert(0 && "Unsupported codec");
+      return 0;
+  }
+}
+
+size_t CompressedWriter::do_compress_zlib(uint64_t offset, size_t length,
+                                          int level, uint8_t* outputbuf,
+                                          size_t outputbuf_len) {
   z_stream stream;
   memset(&stream, 0, sizeof(stream));
-  int result = deflateInit(&stream, Z_DEFAULT_COMPRESSION);
+  int result = deflateInit(&stream, min(level, Z_BEST_COMPRESSION));
   if (result != Z_OK) {
     assert(0 && "deflateInit failed!");
     return 0;
@@ -6,6 +6,8 @@
 #include <pthread.h>
 #include <stdint.h>
 
+#include <deque>
+#include <functional>
 #include <memory>
 #include <vector>
 #include <string>
@@ -14,36 +16,200 @@
 
 /**
  * CompressedWriter opens an output file and writes compressed blocks to it.
- * Blocks of a fixed but unspecified size (currently 1MB) are compressed.
+ * Blocks of a fixed but unspecified size (currently 1MB) are compressed;
+ * flush() can end a block early.
  * Each block of compressed data is written to the file preceded by two
  * 32-bit words: the size of the compressed data (excluding block header)
- * and the size of the uncompressed data, in that order. See BlockHeader below.
+ * and the size of the uncompressed data, in that order. The top bits of the
+ * first word identify the codec used for the block. See BlockHeader below.
  *
- * We use multiple threads to perform compression. The threads are
- * responsible for the actual data writes. The thread that creates the
- * CompressedWriter is the "producer" thread and must also be the caller of
- * 'write'. The producer thread may block in 'write' if 'buffer_size' bytes are
- * being compressed.
+ * We use multiple threads to perform compression. Compressed blocks are
+ * queued in file order for a separate I/O thread, which writes them out in
+ * batches so that slow storage doesn't hold up compression; a failed write
+ * makes good() return false. The thread that creates the CompressedWriter
+ * is the "producer" thread and must also be the caller of 'write'. The
+ * producer thread may block in 'write' if 'buffer_size' bytes are being
+ * compressed.
  *
- * Each data block is compressed independently using zlib.
+ * Each data block is compressed independently using the writer's codec.
+ * zlib is always available; LZ4 and zstd are available when rr is built
+ * against those libraries. Requesting an unavailable codec falls back to
+ * zlib.
  */
 class CompressedWriter {
 public:
+  /**
+   * Codec tags stored in each BlockHeader. Blocks written before codecs
+   * were tagged have a zero tag, so ZLIB must stay 0.
+   */
+  enum Codec {
+    ZLIB = 0,
+    LZ4 = 1,
+    ZSTD = 2,
+    CODEC_COUNT
+  };
+
+  /**
+   * 'level' is passed to the codec; 0 means use the codec's default.
+   * For zlib and zstd higher levels compress better; for LZ4 the level is
+   * the acceleration factor, so higher levels compress faster.
+   */
   CompressedWriter(const std::string& filename, size_t buffer_size,
-                   uint32_t num_threads);
+                   uint32_t num_threads, Codec codec = ZLIB, int level = 0);
   ~CompressedWriter();
   // Call only on producer thread
   bool good() const { return !error; }
   // Call only on producer thread.
   void write(const void* data, size_t size);
+  /**
+   * Fills 'len' bytes at 'dest' with the stream data at 'offset' from the
+   * start of a write_filled() call.
+   */
+  typedef std::function<void(size_t offset, void* dest, size_t len)> Filler;
+  /**
+   * Like write(), but 'fill' produces the data directly in the writer's
+   * buffer, a piece at a time, instead of it being copied in.
+   * Call only on producer thread.
+   */
+  void write_filled(size_t size, const Filler& fill);
+  /**
+   * Compress and write out everything written so far, even if it doesn't
+   * fill a block, so a reader following the file sees it soon. Doesn't
+   * wait for the data to reach the file. Call only on producer thread.
+   */
+  void flush();
   // Call only on producer thread
   void close();
+  /**
+   * Restrict the compression and I/O threads to 'cpus'.
+   */
+  void set_thread_affinity(const cpu_set_t& cpus);
 
   struct BlockHeader {
-    uint32_t compressed_length;
+    uint32_t compressed_length : 28;
+    uint32_t codec : 4;
     uint32_t uncompressed_length;
   };
 
+  /**
+   * Locates one block in the output file. Entries are in file order, so
+   * both offsets are increasing.
+   */
+  struct BlockIndexEntry {
+    // Offset in the uncompressed stream of the block's first byte.
+    uint64_t uncompressed_offset;
+    // Offset in the file of the block's BlockHeader.
+    uint64_t file_offset;
+  };
+  typedef std::vector<BlockIndexEntry> BlockIndex;
+
+  /**
+   * The number of uncompressed bytes written so far. Call only on
+   * producer thread.
+   */
+  uint64_t uncompressed_offset() const { return producer_reserved_write_pos; }
+  /**
+   * The number of uncompressed bytes whose blocks have been written to the
+   * file (and synced, with set_sync_writes()). Call only on producer
+   * thread; doesn't wait for the I/O thread.
+   */
+  uint64_t written_offset() const;
+  /**
+   * fdatasync() the file after each batch of blocks the I/O thread writes,
+   * so written_offset() only counts data that would survive a machine
+   * crash. The producer never waits for the sync. Call only on producer
+   * thread.
+   */
+  void set_sync_writes(bool sync);
+  /**
+   * Every block written to the file. Only complete after close().
+   */
+  const BlockIndex& block_index() const { return index; }
+
+  /**
+   * Number of times write() had to wait for the compression threads to
+   * free buffer space, and the total time in seconds spent waiting.
+   */
+  uint64_t wait_count() const { return producer_waits; }
+  double wait_time() const { return producer_wait_time; }
+  /**
+   * Number of those waits that took <10us, <100us, <1ms, <10ms, <100ms,
+   * and longer.
+   */
+  static const int WAIT_HISTOGRAM_BUCKETS = 6;
+  const uint64_t* wait_histogram() const { return producer_wait_histogram; }
+  /**
+   * The most data that was written but not yet compressed at once.
+   * Call only on producer thread.
+   */
+  uint64_t max_bytes_in_flight() const { return producer_max_in_flight; }
+
+  struct ThreadStats {
+    uint64_t blocks;
+    uint64_t uncompressed_bytes;
+    uint64_t compressed_bytes;
+    // Time spent compressing.
+    double seconds;
+  };
+  /**
+   * What each compression thread has done so far.
+   */
+  std::vector<ThreadStats> thread_stats() const;
+
+  /**
+   * When the producer keeps having to wait for the compression threads,
+   * switch to a faster level of the codec, and return to the configured
+   * level once they keep up again. Call only on producer thread.
+   */
+  void set_adaptive_level(bool adaptive) { adaptive_level = adaptive; }
+  /**
+   * The level blocks are being compressed at now, resolved to the codec's
+   * actual level if the configured one is the default.
+   */
+  int current_level() const;
+
+  /**
+   * Receives a copy of each block, header included, as soon as it has been
+   * written to the output file. Blocks arrive in file order on the I/O
+   * thread.
+   */
+  class BlockSink {
+  public:
+    virtual ~BlockSink() {}
+    /**
+     * Return false if the block couldn't be delivered; the writer then
+     * fails as if the file write had failed.
+     */
+    virtual bool write_block(const void* data, size_t len) = 0;
+  };
+  /**
+   * Hand every block to 'sink' too. Once a block has been delivered and
+   * 'local_blocks' newer blocks have been written after it, its space in
+   * the output file is released. The file keeps its size and block offsets,
+   * but only the most recent blocks occupy disk. 0 keeps every block.
+   * The sink is destroyed when the writer is closed. Call only on producer
+   * thread, before anything has been written.
+   */
+  void set_sink(std::shared_ptr<BlockSink> sink, size_t local_blocks);
+
+  /**
+   * Return true if blocks tagged with 'codec' can be compressed and
+   * decompressed by this build of rr.
+   */
+  static bool codec_available(Codec codec);
+  /**
+   * Return the name of 'codec' as accepted by parse_codec().
+   */
+  static const char* codec_name(Codec codec);
+  /**
+   * Parse a codec name. Returns false if 'name' isn't a known codec.
+   */
+  static bool parse_codec(const std::string& name, Codec* codec);
+  /**
+   * Return an upper bound on the compressed size of 'length' bytes.
+   */
+  static size_t max_compressed_size(Codec codec, size_t length);
+
   template <typename T> CompressedWriter& operator<<(const T& value) {
     write(&value, sizeof(value));
     return *this;
@@ -72,15 +238,50 @@ protected:
 
   static void* compression_thread_callback(void* p);
   void compression_thread();
-  size_t do_compress(uint64_t offset, size_t length, uint8_t* outputbuf,
-                     size_t outputbuf_len);
+  static void* io_thread_callback(void* p);
+  void io_thread();
+  size_t do_compress(uint64_t offset, size_t length, int level,
+                     uint8_t* outputbuf, size_t outputbuf_len);
+  size_t do_compress_zlib(uint64_t offset, size_t length, int level,
+                          uint8_t* outputbuf, size_t outputbuf_len);
+  // Called with 'mutex' held after each reservation update.
+  void adapt_level(bool waited);
 
   // Immutable while threads are running
   ScopedFd fd;
   int block_size;
-  pthread_mutex_t mutex;
+  Codec codec;
+  int level;
+  mutable pthread_mutex_t mutex;
   pthread_cond_t cond;
   std::vector<pthread_t> threads;
+  pthread_t io_thread_id;
+  size_t max_pending_writes;
+
+  /**
+   * A compressed block, header included, waiting for the I/O thread.
+   */
+  struct PendingWrite {
+    std::vector<uint8_t> data;
+    size_t length;
+    // Offset in the uncompressed stream of the end of the block.
+    uint64_t uncompressed_end;
+    // Range of the output file to release once the block is delivered.
+    uint64_t release_offset;
+    uint64_t release_length;
+  };
+  // Most blocks the I/O thread writes with one writev().
+  static const size_t MAX_WRITE_BATCH = 64;
+
+  // Only touched by the producer thread
+  uint64_t producer_waits;
+  double producer_wait_time;
+  uint64_t producer_wait_histogram[WAIT_HISTOGRAM_BUCKETS];
+  uint64_t producer_max_in_flight;
+  bool adaptive_level;
+  // Reservation updates in a row that did or didn't have to wait.
+  uint32_t waits_in_a_row;
+  uint32_t calm_in_a_row;
 
   // Carefully shared...
   std::vector<uint8_t> buffer;
@@ -93,8 +294,28 @@ protected:
   uint64_t next_thread_pos;
   /* position in output stream of end of data ready to dispatch */
   uint64_t next_thread_end_pos;
+  /* position in output stream up to which data must be compressed even if
+   * it doesn't fill a block */
+  uint64_t flush_pos;
   bool closing;
   bool write_error;
+  /* file offset at which the next block will be written */
+  uint64_t next_file_pos;
+  /* position in output stream up to which blocks are in the file */
+  uint64_t written_pos;
+  bool sync_writes;
+  BlockIndex index;
+  std::shared_ptr<BlockSink> sink;
+  size_t local_blocks;
+  /* blocks compressed but not yet written, in file order */
+  std::deque<PendingWrite> pending_writes;
+  /* output buffers the I/O thread has finished with */
+  std::vector<std::vector<uint8_t> > free_buffers;
+  /* set once all compression threads have exited */
+  bool compression_done;
+  /* level for the next block; only differs from 'level' when adaptive */
+  int level_now;
+  std::vector<ThreadStats> stats;
   // END protected by 'mutex'
 
   /* producer thread only */
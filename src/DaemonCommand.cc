@@ -0,0 +1,567 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <list>
+#include <map>
+#include <sstream>
+
+#include "Command.h"
+#include "GdbServer.h"
+#include "log.h"
+#include "main.h"
+#include "ReplaySession.h"
+#include "ScopedFd.h"
+#include "TraceStream.h"
+
+using namespace std;
+
+class DaemonCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  DaemonCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static DaemonCommand singleton;
+};
+
+DaemonCommand DaemonCommand::singleton(
+    "daemon",
+    " rr daemon [OPTION]...\n"
+    " rr daemon -c [OPTION]... [<trace_dir>]\n"
+    "  Keep replays warm for debuggers. The first form runs the daemon. The\n"
+    "  second launches gdb on the daemon's replay of <trace_dir>, starting\n"
+    "  one if there isn't one yet. A warm replay has already replayed\n"
+    "  process startup and keeps its checkpoints, and when gdb detaches it\n"
+    "  waits for the next one where that one left off; `run' returns to\n"
+    "  where the replay was started. A replay serves one gdb at a time;\n"
+    "  the next waits until it detaches. When the replays use more than\n"
+    "  the memory budget, the least recently requested are stopped.\n"
+    "  -c, --connect              launch gdb on a warm replay\n"
+    "  -g, --goto=<EVENT-NUM>     with -c, use a replay started at event\n"
+    "                             <EVENT-NUM>\n"
+    "  -m, --memory=<MB>          memory budget of all replays, tracees and\n"
+    "                             checkpoints included (default 8192)\n"
+    "  -s, --socket=<PATH>        the daemon's socket (default:\n"
+    "                             $XDG_RUNTIME_DIR/rr-daemon, or\n"
+    "                             /tmp/rr-daemon-<uid>)\n"
+    "  -x, --gdb-x=<FILE>         with -c, execute gdb commands from <FILE>\n");
+
+struct DaemonFlags {
+  bool connect;
+  TraceFrame::Time goto_event;
+  uint64_t memory_budget;
+  string socket_path;
+  string gdb_command_file_path;
+
+  DaemonFlags()
+      : connect(false),
+        goto_event(0),
+        memory_budget(uint64_t(8192) * 1024 * 1024) {}
+};
+
+static bool parse_daemon_arg(std::vector<std::string>& args,
+                             DaemonFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'c', "connect", NO_PARAMETER },
+                                        { 'g', "goto", HAS_PARAMETER },
+                                        { 'm', "memory", HAS_PARAMETER },
+                                        { 's', "socket", HAS_PARAMETER },
+                                        { 'x', "gdb-x", HAS_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'c':
+      flags.connect = true;
+      break;
+    case 'g':
+      if (!opt.verify_valid_int(1, INT64_MAX)) {
+        return false;
+      }
+      flags.goto_event = opt.int_value;
+      break;
+    case 'm':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.memory_budget = uint64_t(opt.int_value) * 1024 * 1024;
+      break;
+    case 's':
+      flags.socket_path = opt.value;
+      break;
+    case 'x':
+      flags.gdb_command_file_path = opt.value;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+/**
+ * How often the daemon measures the replays' memory when no requests
+ * arrive.
+ */
+static const int MEASURE_INTERVAL_MS = 5000;
+
+static string default_socket_path() {
+  const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (runtime_dir && runtime_dir[0]) {
+    return string(runtime_dir) + "/rr-daemon";
+  }
+  stringstream path;
+  path << "/tmp/rr-daemon-" << getuid();
+  return path.str();
+}
+
+/**
+ * Fill |addr| for |path|. Returns false if the path is too long.
+ */
+static bool make_address(const string& path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", path.c_str());
+    return false;
+  }
+  strcpy(addr->sun_path, path.c_str());
+  return true;
+}
+
+static double now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * A debug server the daemon forked to replay one trace up to one event.
+ */
+struct WarmReplay {
+  string trace_dir;
+  TraceFrame::Time event;
+  pid_t pid;
+  // The server writes its connection parameters here once it's ready.
+  // Closed once they've been read.
+  ScopedFd params_fd;
+  // The parameters, in the form GdbServer::launch_gdb() reads them.
+  vector<uint8_t> params;
+  // Clients waiting for |params|.
+  vector<ScopedFd> waiting;
+  double last_requested;
+  // Proportional resident memory of the server and all its descendants,
+  // as last measured.
+  uint64_t memory;
+};
+
+/**
+ * Create the server for |replay| in a child process.
+ */
+static void start_replay(WarmReplay& replay, list<WarmReplay>& replays,
+                         const ScopedFd& listen_fd) {
+  int params_pipe[2];
+  if (pipe2(params_pipe, O_CLOEXEC)) {
+    FATAL() << "Couldn't open debugger params pipe";
+  }
+  replay.pid = fork();
+  if (replay.pid == 0) {
+    // Don't keep the daemon's clients waiting on us.
+    close(listen_fd);
+    for (auto& other : replays) {
+      other.params_fd.close();
+      other.waiting.clear();
+    }
+    close(params_pipe[0]);
+    ScopedFd params_write_fd(params_pipe[1]);
+    auto session = ReplaySession::create(replay.trace_dir);
+    GdbServer::Target target;
+    target.event = replay.event;
+    GdbServer::ConnectionFlags conn_flags;
+    conn_flags.debugger_params_write_pipe = &params_write_fd;
+    conn_flags.keep_listening = true;
+    GdbServer::serve(session, target, conn_flags, ReplaySession::Flags());
+    exit(0);
+  }
+  close(params_pipe[1]);
+  if (replay.pid < 0) {
+    close(params_pipe[0]);
+    FATAL() << "Couldn't fork replay of " << replay.trace_dir;
+  }
+  replay.params_fd = ScopedFd(params_pipe[0]);
+  LOG(info) << "Started replay " << replay.pid << " of " << replay.trace_dir
+            << " at event " << replay.event;
+}
+
+/**
+ * Hand |replay|'s connection parameters to |client|, which then launches
+ * gdb, or queue |client| until the server is ready.
+ */
+static void answer_client(WarmReplay& replay, ScopedFd client) {
+  if (replay.params.empty()) {
+    replay.waiting.push_back(move(client));
+    return;
+  }
+  // Small enough to be written in one go; the client is gone if not.
+  if (write(client, replay.params.data(), replay.params.size()) < 0) {
+    LOG(debug) << "Client of " << replay.trace_dir << " went away";
+  }
+}
+
+/**
+ * Read a request, "<event> <trace_dir>\n", from a new client and answer
+ * it.
+ */
+static void handle_client(ScopedFd client, list<WarmReplay>& replays,
+                          const ScopedFd& listen_fd) {
+  char buf[PATH_MAX + 64];
+  size_t len = 0;
+  while (len < sizeof(buf) - 1) {
+    ssize_t ret = read(client, buf + len, sizeof(buf) - 1 - len);
+    if (ret <= 0) {
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    len += ret;
+    if (memchr(buf, '\n', len)) {
+      break;
+    }
+  }
+  buf[len] = 0;
+  TraceFrame::Time event;
+  int dir_offset = 0;
+  if (sscanf(buf, "%" SCNu64 " %n", &event, &dir_offset) != 1 ||
+      !dir_offset) {
+    return;
+  }
+  string trace_dir(buf + dir_offset);
+  if (!trace_dir.empty() && trace_dir.back() == '\n') {
+    trace_dir.pop_back();
+  }
+
+  for (auto& replay : replays) {
+    if (replay.trace_dir == trace_dir && replay.event == event) {
+      replay.last_requested = now_sec();
+      answer_client(replay, move(client));
+      return;
+    }
+  }
+  replays.push_back(WarmReplay());
+  WarmReplay& replay = replays.back();
+  replay.trace_dir = trace_dir;
+  replay.event = event;
+  replay.last_requested = now_sec();
+  replay.memory = 0;
+  start_replay(replay, replays, listen_fd);
+  answer_client(replay, move(client));
+}
+
+/**
+ * The server is ready, or died before it was. Answer its waiting clients;
+ * if it died, closing their sockets tells them so.
+ */
+static void read_params(WarmReplay& replay) {
+  uint8_t buf[PATH_MAX + 64];
+  ssize_t nread;
+  do {
+    nread = read(replay.params_fd, buf, sizeof(buf));
+  } while (nread < 0 && errno == EINTR);
+  replay.params_fd.close();
+  if (nread > 0) {
+    replay.params.assign(buf, buf + nread);
+    for (auto& client : replay.waiting) {
+      answer_client(replay, move(client));
+    }
+  }
+  replay.waiting.clear();
+}
+
+/**
+ * Return the "Pss:" total of |pid|'s smaps, in bytes.
+ */
+static uint64_t proportional_memory(pid_t pid) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path) - 1, "/proc/%d/smaps_rollup", pid);
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    // Older kernels only have smaps.
+    snprintf(path, sizeof(path) - 1, "/proc/%d/smaps", pid);
+    f = fopen(path, "r");
+    if (!f) {
+      return 0;
+    }
+  }
+  uint64_t total = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    unsigned long kb;
+    if (sscanf(line, "Pss: %lu kB", &kb) == 1) {
+      total += uint64_t(kb) * 1024;
+    }
+  }
+  fclose(f);
+  return total;
+}
+
+/**
+ * Measure the memory of each replay: its server, the tracees and the
+ * checkpoints, which are all descendants of the server. Shared pages are
+ * split between the processes sharing them, so the sum is what the
+ * replays really cost.
+ */
+static void measure_replays(list<WarmReplay>& replays) {
+  multimap<pid_t, pid_t> children;
+  DIR* proc = opendir("/proc");
+  if (!proc) {
+    return;
+  }
+  while (struct dirent* ent = readdir(proc)) {
+    pid_t pid = atoi(ent->d_name);
+    if (pid <= 0) {
+      continue;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    FILE* f = fopen(path, "r");
+    if (!f) {
+      continue;
+    }
+    char buf[1024];
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[len] = 0;
+    // The command name can contain anything but ends at the last ')'.
+    char* after_comm = strrchr(buf, ')');
+    pid_t ppid;
+    if (after_comm && sscanf(after_comm + 1, " %*c %d", &ppid) == 1) {
+      children.insert(make_pair(ppid, pid));
+    }
+  }
+  closedir(proc);
+
+  for (auto& replay : replays) {
+    replay.memory = 0;
+    vector<pid_t> pending(1, replay.pid);
+    while (!pending.empty()) {
+      pid_t pid = pending.back();
+      pending.pop_back();
+      replay.memory += proportional_memory(pid);
+      auto range = children.equal_range(pid);
+      for (auto it = range.first; it != range.second; ++it) {
+        pending.push_back(it->second);
+      }
+    }
+  }
+}
+
+/**
+ * Stop the least recently requested replays until the rest fit in the
+ * budget. Replays with clients waiting, and the most recently requested
+ * one, are kept.
+ */
+static void enforce_budget(list<WarmReplay>& replays, uint64_t budget) {
+  uint64_t total = 0;
+  const WarmReplay* newest = nullptr;
+  for (auto& replay : replays) {
+    total += replay.memory;
+    if (!newest || replay.last_requested > newest->last_requested) {
+      newest = &replay;
+    }
+  }
+  vector<WarmReplay*> by_age;
+  for (auto& replay : replays) {
+    if (&replay != newest && replay.waiting.empty()) {
+      by_age.push_back(&replay);
+    }
+  }
+  sort(by_age.begin(), by_age.end(),
+       [](const WarmReplay* a, const WarmReplay* b) {
+         return a->last_requested < b->last_requested;
+       });
+  for (auto replay : by_age) {
+    if (total <= budget) {
+      break;
+    }
+    LOG(info) << "Stopping replay " << replay->pid << " of "
+              << replay->trace_dir << " (" << replay->memory / (1024 * 1024)
+              << " MB)";
+    // Tracees and checkpoints die with it.
+    kill(replay->pid, SIGKILL);
+    total -= replay->memory;
+    replay->memory = 0;
+  }
+}
+
+/**
+ * Forget replays whose servers have exited.
+ */
+static void reap_replays(list<WarmReplay>& replays) {
+  while (true) {
+    int status;
+    pid_t pid = waitpid(-1, &status, WNOHANG);
+    if (pid <= 0) {
+      return;
+    }
+    for (auto it = replays.begin(); it != replays.end(); ++it) {
+      if (it->pid == pid) {
+        LOG(info) << "Replay " << pid << " of " << it->trace_dir << " exited";
+        replays.erase(it);
+        break;
+      }
+    }
+  }
+}
+
+static int run_daemon(const DaemonFlags& flags) {
+  struct sockaddr_un addr;
+  if (!make_address(flags.socket_path, &addr)) {
+    return 1;
+  }
+  ScopedFd listen_fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  // A socket left behind by a daemon that died is in the way.
+  ScopedFd probe_fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if (connect(probe_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "A daemon is already listening on %s\n",
+            flags.socket_path.c_str());
+    return 1;
+  }
+  unlink(flags.socket_path.c_str());
+  if (!listen_fd.is_open() ||
+      ::bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+      listen(listen_fd, 16)) {
+    fprintf(stderr, "Can't listen on %s: %s\n", flags.socket_path.c_str(),
+            strerror(errno));
+    return 1;
+  }
+  fprintf(stdout, "Serving warm replays on %s\n", flags.socket_path.c_str());
+  fflush(stdout);
+
+  // A client hanging up mustn't kill us.
+  signal(SIGPIPE, SIG_IGN);
+  list<WarmReplay> replays;
+  double last_measured = 0;
+  while (true) {
+    reap_replays(replays);
+    if (now_sec() - last_measured >= MEASURE_INTERVAL_MS / 1000.0) {
+      measure_replays(replays);
+      enforce_budget(replays, flags.memory_budget);
+      last_measured = now_sec();
+    }
+
+    vector<struct pollfd> fds;
+    vector<WarmReplay*> starting;
+    struct pollfd listen_poll = { listen_fd, POLLIN, 0 };
+    fds.push_back(listen_poll);
+    for (auto& replay : replays) {
+      if (replay.params_fd.is_open()) {
+        struct pollfd p = { replay.params_fd, POLLIN, 0 };
+        fds.push_back(p);
+        starting.push_back(&replay);
+      }
+    }
+    int ret = poll(fds.data(), fds.size(), MEASURE_INTERVAL_MS);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "poll failed: %s\n", strerror(errno));
+      return 1;
+    }
+    for (size_t i = 1; i < fds.size(); ++i) {
+      if (fds[i].revents) {
+        read_params(*starting[i - 1]);
+      }
+    }
+    if (fds[0].revents & POLLIN) {
+      ScopedFd client(accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC));
+      if (client.is_open()) {
+        size_t count = replays.size();
+        handle_client(move(client), replays, listen_fd);
+        if (replays.size() > count) {
+          // Make room for the new replay now rather than at the next
+          // measurement.
+          last_measured = 0;
+        }
+      }
+    }
+  }
+}
+
+static int connect_to_daemon(const string& trace_dir,
+                             const DaemonFlags& flags) {
+  char real_dir[PATH_MAX];
+  if (!realpath(TraceReader(trace_dir).dir().c_str(), real_dir)) {
+    fprintf(stderr, "Can't find trace %s\n", trace_dir.c_str());
+    return 1;
+  }
+  struct sockaddr_un addr;
+  if (!make_address(flags.socket_path, &addr)) {
+    return 1;
+  }
+  ScopedFd fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if (!fd.is_open() || connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+    fprintf(stderr, "Can't connect to a daemon on %s: %s\n",
+            flags.socket_path.c_str(), strerror(errno));
+    return 1;
+  }
+  stringstream request;
+  request << flags.goto_event << ' ' << real_dir << '\n';
+  string s = request.str();
+  if (write(fd, s.data(), s.size()) != (ssize_t)s.size()) {
+    fprintf(stderr, "Can't send request to daemon: %s\n", strerror(errno));
+    return 1;
+  }
+  // Only returns if the daemon hung up instead of answering.
+  GdbServer::launch_gdb(fd, flags.gdb_command_file_path);
+  fprintf(stderr, "The daemon couldn't replay %s\n", real_dir);
+  return 1;
+}
+
+int DaemonCommand::run(std::vector<std::string>& args) {
+  DaemonFlags flags;
+  while (parse_daemon_arg(args, flags)) {
+  }
+  if (flags.socket_path.empty()) {
+    flags.socket_path = default_socket_path();
+  }
+
+  if (flags.connect) {
+    string trace_dir;
+    if (!parse_optional_trace_dir(args, &trace_dir)) {
+      print_help(stderr);
+      return 1;
+    }
+    return connect_to_daemon(trace_dir, flags);
+  }
+
+  if (!args.empty()) {
+    print_help(stderr);
+    return 1;
+  }
+  assert_prerequisites();
+  check_performance_settings();
+  return run_daemon(flags);
+}
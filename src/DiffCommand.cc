@@ -0,0 +1,472 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+#include <inttypes.h>
+
+#include <algorithm>
+#include <deque>
+#include <map>
+
+#include "preload/preload_interface.h"
+
+#include "Command.h"
+#include "kernel_metadata.h"
+#include "main.h"
+#include "TraceStream.h"
+
+using namespace std;
+
+class DiffCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  DiffCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static DiffCommand singleton;
+};
+
+DiffCommand DiffCommand::singleton(
+    "diff",
+    " rr diff [OPTION]... <trace_dir_a> <trace_dir_b>\n"
+    "  Compare two recordings of the same program. Each thread's syscalls,\n"
+    "  trapped or buffered, are aligned with those of the thread created in\n"
+    "  the same order in the other trace, and the first syscall that\n"
+    "  differs is reported, along with the first difference in the\n"
+    "  arguments of aligned trapped syscalls. Ticks each thread ran are\n"
+    "  compared in total and per phase of aligned syscalls. The traces are\n"
+    "  read as streams, so memory use doesn't grow with their size as long\n"
+    "  as the two runs were scheduled alike.\n"
+    "  -p, --phase=<N>            compare ticks over phases of N syscalls\n"
+    "                             (default 1000)\n"
+    "  -n, --top=<N>              show the N phases whose ticks changed the\n"
+    "                             most (default 10)\n");
+
+struct DiffFlags {
+  uint64_t phase_syscalls;
+  size_t top_phases;
+
+  DiffFlags() : phase_syscalls(1000), top_phases(10) {}
+};
+
+/**
+ * How many syscalls of a thread may be read from one trace before the
+ * other trace reaches them. Beyond this the runs were scheduled too
+ * differently to align in bounded memory.
+ */
+static const size_t MAX_PENDING_STEPS = 1 << 20;
+
+static bool parse_diff_arg(std::vector<std::string>& args, DiffFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'p', "phase", HAS_PARAMETER },
+                                        { 'n', "top", HAS_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'p':
+      if (!opt.verify_valid_int(1)) {
+        return false;
+      }
+      flags.phase_syscalls = opt.int_value;
+      break;
+    case 'n':
+      if (!opt.verify_valid_int(0, INT32_MAX)) {
+        return false;
+      }
+      flags.top_phases = opt.int_value;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+/**
+ * A syscall made by a thread, the unit the traces are aligned by.
+ */
+struct Step {
+  int syscallno;
+  SupportedArch arch;
+  // Buffered syscalls don't have their arguments in the trace.
+  bool trapped;
+  uint64_t args[6];
+  // Ticks the thread ran since its previous step.
+  Ticks ticks;
+  // The event that recorded the syscall.
+  TraceFrame::Time time;
+};
+
+/**
+ * Syscalls the preload library makes to talk to rr, which depend on how
+ * much was buffered rather than on what the program did.
+ */
+static bool is_rrcall(int syscallno) {
+  return syscallno == SYS_rrcall_init_preload ||
+         syscallno == SYS_rrcall_init_buffers ||
+         syscallno == SYS_rrcall_notify_syscall_hook_exit ||
+         syscallno == SYS_rrcall_init_desched;
+}
+
+/**
+ * One of the two traces being compared, read a frame at a time.
+ */
+struct DiffTrace {
+  DiffTrace(const string& dir) : dir(dir), trace(dir), max_pending(0) {}
+
+  struct Thread {
+    Thread() : tid(0), last_ticks(0), unassigned_ticks(0), total_ticks(0) {}
+    pid_t tid;
+    Ticks last_ticks;
+    // Ticks run since the thread's last step.
+    Ticks unassigned_ticks;
+    Ticks total_ticks;
+    // Steps the other trace hasn't reached yet.
+    deque<Step> pending;
+  };
+
+  string dir;
+  TraceReader trace;
+  // Threads are numbered in the order they first appear in the trace.
+  map<pid_t, size_t> thread_numbers;
+  vector<Thread> threads;
+  size_t max_pending;
+
+  /**
+   * Read the next frame, appending its syscalls to its thread's pending
+   * steps. Returns the thread's number.
+   */
+  size_t read_frame();
+};
+
+size_t DiffTrace::read_frame() {
+  auto frame = trace.read_frame();
+  auto it = thread_numbers.find(frame.tid());
+  if (it == thread_numbers.end()) {
+    it = thread_numbers.insert(make_pair(frame.tid(), threads.size())).first;
+    threads.push_back(Thread());
+    threads.back().tid = frame.tid();
+  }
+  Thread& thread = threads[it->second];
+  // Ticks are counted per thread, from the thread's start.
+  Ticks ticks = frame.ticks() - thread.last_ticks;
+  thread.last_ticks = frame.ticks();
+  thread.unassigned_ticks += ticks;
+  thread.total_ticks += ticks;
+
+  auto ev = frame.event();
+  Step step;
+  memset(&step, 0, sizeof(step));
+  step.arch = ev.arch();
+  step.time = frame.time();
+  if (ev.type == EV_SYSCALL && ev.state == SYSCALL_ENTRY &&
+      !is_rrcall(ev.data)) {
+    const Registers& regs = frame.regs();
+    step.syscallno = ev.data;
+    step.trapped = true;
+    step.args[0] = regs.arg1();
+    step.args[1] = regs.arg2();
+    step.args[2] = regs.arg3();
+    step.args[3] = regs.arg4();
+    step.args[4] = regs.arg5();
+    step.args[5] = regs.arg6();
+    step.ticks = thread.unassigned_ticks;
+    thread.unassigned_ticks = 0;
+    thread.pending.push_back(step);
+  } else if (ev.type == EV_SYSCALLBUF_FLUSH) {
+    // Buffered syscalls only show up in the flushed buffer. Whether a
+    // syscall was buffered depends on timing, so both kinds are aligned
+    // together.
+    TraceReader::RawData data;
+    if (trace.read_raw_data_for_frame(frame, data) &&
+        data.data.size() >= sizeof(struct syscallbuf_hdr)) {
+      auto flush_hdr =
+          reinterpret_cast<const syscallbuf_hdr*>(data.data.data());
+      size_t num_rec_bytes =
+          min<size_t>(flush_hdr->num_rec_bytes,
+                      data.data.size() - sizeof(struct syscallbuf_hdr));
+      auto record_ptr = reinterpret_cast<const uint8_t*>(flush_hdr + 1);
+      auto end_ptr = record_ptr + num_rec_bytes;
+      while (record_ptr + sizeof(struct syscallbuf_record) <= end_ptr) {
+        auto record =
+            reinterpret_cast<const struct syscallbuf_record*>(record_ptr);
+        if (record->size < sizeof(*record)) {
+          fprintf(stderr, "Malformed trace file (bad record size)\n");
+          abort();
+        }
+        step.syscallno = record->syscallno;
+        step.ticks = thread.unassigned_ticks;
+        thread.unassigned_ticks = 0;
+        thread.pending.push_back(step);
+        record_ptr += stored_record_size(record->size);
+      }
+    }
+  }
+  max_pending = max(max_pending, thread.pending.size());
+  return it->second;
+}
+
+/**
+ * Ticks two threads ran over the same phase of aligned syscalls.
+ */
+struct Phase {
+  size_t thread;
+  uint64_t first_step;
+  Ticks ticks_a;
+  Ticks ticks_b;
+
+  int64_t delta() const { return int64_t(ticks_b) - int64_t(ticks_a); }
+  uint64_t abs_delta() const {
+    return delta() < 0 ? -delta() : delta();
+  }
+};
+
+/**
+ * Alignment state of a pair of threads.
+ */
+struct ThreadDiff {
+  ThreadDiff() : steps(0), diverged(false) {
+    memset(&phase, 0, sizeof(phase));
+  }
+  uint64_t steps;
+  bool diverged;
+  Phase phase;
+};
+
+struct Divergence {
+  Divergence() : found(false) {}
+  bool found;
+  size_t thread;
+  uint64_t step;
+  // A missing step has time 0.
+  Step a;
+  Step b;
+};
+
+static string describe_step(const Step& step) {
+  if (!step.time) {
+    return "(no more syscalls)";
+  }
+  char buf[512];
+  int len = snprintf(buf, sizeof(buf), "event %" PRIu64 ": %s %s",
+                     uint64_t(step.time), step.trapped ? "trapped" : "buffered",
+                     syscall_name(step.syscallno, step.arch).c_str());
+  if (step.trapped) {
+    snprintf(buf + len, sizeof(buf) - len,
+             "(0x%" PRIx64 ", 0x%" PRIx64 ", 0x%" PRIx64 ", 0x%" PRIx64
+             ", 0x%" PRIx64 ", 0x%" PRIx64 ")",
+             step.args[0], step.args[1], step.args[2], step.args[3],
+             step.args[4], step.args[5]);
+  }
+  return buf;
+}
+
+static string percent_change(Ticks a, Ticks b) {
+  char buf[32];
+  if (!a) {
+    return b ? "(new)" : "";
+  }
+  snprintf(buf, sizeof(buf), "(%+.1f%%)", (double(b) - double(a)) * 100 / a);
+  return buf;
+}
+
+/**
+ * Keep |phase| if it's one of the |top| with the biggest change in ticks
+ * so far; |phases| is a heap with the smallest change on top.
+ */
+static void note_phase(vector<Phase>& phases, size_t top, const Phase& phase) {
+  auto smaller_change = [](const Phase& x, const Phase& y) {
+    return x.abs_delta() > y.abs_delta();
+  };
+  if (!top || (phases.size() == top &&
+               phases.front().abs_delta() >= phase.abs_delta())) {
+    return;
+  }
+  phases.push_back(phase);
+  push_heap(phases.begin(), phases.end(), smaller_change);
+  if (phases.size() > top) {
+    pop_heap(phases.begin(), phases.end(), smaller_change);
+    phases.pop_back();
+  }
+}
+
+static int diff(const string& dir_a, const string& dir_b,
+                const DiffFlags& flags, FILE* out) {
+  DiffTrace a(dir_a), b(dir_b);
+  vector<ThreadDiff> threads;
+  vector<Phase> top_phases;
+  Divergence divergence, arg_difference;
+
+  auto compare = [&](size_t thread) {
+    if (thread >= a.threads.size() || thread >= b.threads.size()) {
+      return;
+    }
+    if (threads.size() <= thread) {
+      threads.resize(thread + 1);
+    }
+    ThreadDiff& d = threads[thread];
+    auto& pending_a = a.threads[thread].pending;
+    auto& pending_b = b.threads[thread].pending;
+    while (!pending_a.empty() && !pending_b.empty()) {
+      Step sa = pending_a.front(), sb = pending_b.front();
+      pending_a.pop_front();
+      pending_b.pop_front();
+      if (d.diverged) {
+        continue;
+      }
+      if (sa.syscallno != sb.syscallno || sa.arch != sb.arch) {
+        d.diverged = true;
+        if (!divergence.found) {
+          divergence.found = true;
+          divergence.thread = thread;
+          divergence.step = d.steps;
+          divergence.a = sa;
+          divergence.b = sb;
+        }
+        continue;
+      }
+      if (!arg_difference.found && sa.trapped && sb.trapped &&
+          memcmp(sa.args, sb.args, sizeof(sa.args))) {
+        arg_difference.found = true;
+        arg_difference.thread = thread;
+        arg_difference.step = d.steps;
+        arg_difference.a = sa;
+        arg_difference.b = sb;
+      }
+      if (d.steps % flags.phase_syscalls == 0) {
+        if (d.steps) {
+          note_phase(top_phases, flags.top_phases, d.phase);
+        }
+        d.phase.thread = thread;
+        d.phase.first_step = d.steps;
+        d.phase.ticks_a = d.phase.ticks_b = 0;
+      }
+      d.phase.ticks_a += sa.ticks;
+      d.phase.ticks_b += sb.ticks;
+      ++d.steps;
+    }
+  };
+
+  // Read the traces in lockstep, so that threads scheduled alike reach
+  // each syscall at about the same time in both.
+  while (!a.trace.at_end() || !b.trace.at_end()) {
+    if (!a.trace.at_end()) {
+      compare(a.read_frame());
+    }
+    if (!b.trace.at_end()) {
+      compare(b.read_frame());
+    }
+    if (max(a.max_pending, b.max_pending) > MAX_PENDING_STEPS) {
+      fprintf(stderr, "The traces were scheduled too differently to align "
+                      "(one thread got more than %zu syscalls ahead); "
+                      "giving up\n",
+              MAX_PENDING_STEPS);
+      return 1;
+    }
+  }
+
+  size_t num_threads = max(a.threads.size(), b.threads.size());
+  threads.resize(num_threads);
+  for (size_t i = 0; i < num_threads; ++i) {
+    ThreadDiff& d = threads[i];
+    bool in_a = i < a.threads.size(), in_b = i < b.threads.size();
+    // A thread that made more syscalls in one trace diverged where the
+    // other one stopped.
+    bool more_a = in_a && !a.threads[i].pending.empty();
+    bool more_b = in_b && !b.threads[i].pending.empty();
+    if (!d.diverged && (more_a || more_b)) {
+      d.diverged = true;
+      if (!divergence.found) {
+        divergence.found = true;
+        divergence.thread = i;
+        divergence.step = d.steps;
+        memset(&divergence.a, 0, sizeof(divergence.a));
+        memset(&divergence.b, 0, sizeof(divergence.b));
+        if (more_a) {
+          divergence.a = a.threads[i].pending.front();
+        }
+        if (more_b) {
+          divergence.b = b.threads[i].pending.front();
+        }
+      }
+    }
+    // The last phase, which may be partial, hasn't been noted yet.
+    if (d.steps) {
+      note_phase(top_phases, flags.top_phases, d.phase);
+    }
+  }
+
+  auto tids = [&](size_t thread) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "thread %zu (tid %d / %d)", thread,
+             thread < a.threads.size() ? a.threads[thread].tid : 0,
+             thread < b.threads.size() ? b.threads[thread].tid : 0);
+    return string(buf);
+  };
+
+  fprintf(out, "a: %s\nb: %s\n\n", dir_a.c_str(), dir_b.c_str());
+  if (divergence.found) {
+    fprintf(out, "First divergence: %s, after %" PRIu64 " aligned syscalls\n"
+                 "  a: %s\n  b: %s\n",
+            tids(divergence.thread).c_str(), divergence.step,
+            describe_step(divergence.a).c_str(),
+            describe_step(divergence.b).c_str());
+  } else {
+    fprintf(out, "No divergence in the syscalls of %zu threads\n",
+            num_threads);
+  }
+  if (arg_difference.found) {
+    fprintf(out, "First argument difference: %s, aligned syscall %" PRIu64
+                 "\n  a: %s\n  b: %s\n",
+            tids(arg_difference.thread).c_str(), arg_difference.step,
+            describe_step(arg_difference.a).c_str(),
+            describe_step(arg_difference.b).c_str());
+  }
+
+  fprintf(out, "\nTicks per thread:\n");
+  Ticks total_a = 0, total_b = 0;
+  for (size_t i = 0; i < num_threads; ++i) {
+    Ticks ta = i < a.threads.size() ? a.threads[i].total_ticks : 0;
+    Ticks tb = i < b.threads.size() ? b.threads[i].total_ticks : 0;
+    total_a += ta;
+    total_b += tb;
+    fprintf(out, "  %s: %" PRIu64 " -> %" PRIu64 " %s\n", tids(i).c_str(),
+            uint64_t(ta), uint64_t(tb), percent_change(ta, tb).c_str());
+  }
+  fprintf(out, "  total: %" PRIu64 " -> %" PRIu64 " %s\n", uint64_t(total_a),
+          uint64_t(total_b), percent_change(total_a, total_b).c_str());
+
+  if (!top_phases.empty()) {
+    sort(top_phases.begin(), top_phases.end(),
+         [](const Phase& x, const Phase& y) {
+      return x.abs_delta() > y.abs_delta();
+    });
+    fprintf(out, "\nPhases with the biggest change in ticks:\n");
+    for (auto& p : top_phases) {
+      fprintf(out, "  %s, syscalls %" PRIu64 "-%" PRIu64 ": %" PRIu64
+                   " -> %" PRIu64 " %s\n",
+              tids(p.thread).c_str(), p.first_step,
+              p.first_step + flags.phase_syscalls - 1, uint64_t(p.ticks_a),
+              uint64_t(p.ticks_b), percent_change(p.ticks_a, p.ticks_b).c_str());
+    }
+  }
+  return 0;
+}
+
+int DiffCommand::run(std::vector<std::string>& args) {
+  DiffFlags flags;
+  while (parse_diff_arg(args, flags)) {
+  }
+
+  if (args.size() != 2 || !verify_not_option(args)) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return diff(args[0], args[1], flags, stdout);
+}
@@ -4,14 +4,18 @@
 
 #include "DiversionSession.h"
 
+#include <set>
+
 #include "AutoRemoteSyscalls.h"
 #include "log.h"
 #include "ReplaySession.h"
+#include "util.h"
 
 using namespace rr;
+using namespace std;
 
 DiversionSession::DiversionSession(const ReplaySession& other)
-    : emu_fs(other.emufs().clone()) {}
+    : emu_fs(other.emufs().clone()), can_reset(false) {}
 
 DiversionSession::~DiversionSession() {
   // We won't permanently leak any OS resources by not ensuring
@@ -20,7 +24,7 @@ DiversionSession::~DiversionSession() {
   // resources.
   kill_all_tasks();
   assert(tasks().size() == 0 && vms().size() == 0);
-  emu_fs->gc(*this);
+  emu_fs->gc();
   assert(emu_fs->size() == 0);
 }
 
@@ -141,7 +145,101 @@ DiversionSession::DiversionResult DiversionSession::diversion_step(
   }
 
   result.break_status.reason = BREAK_NONE;
+  // Syscalls can change kernel state that reset() can't restore.
+  can_reset = false;
   process_syscall(t, t->regs().original_syscallno());
   check_for_watchpoint_changes(t, result.break_status);
   return result;
 }
+
+void DiversionSession::save_reset_point() {
+  reset_regs.clear();
+  can_reset = true;
+  set<AddressSpace*> cleared;
+  for (auto& kv : tasks()) {
+    Task* t = kv.second;
+    reset_regs[t->rec_tid] = make_pair(t->regs(), t->extra_regs());
+    if (cleared.insert(t->vm().get()).second && !clear_soft_dirty_bits(t)) {
+      can_reset = false;
+    }
+  }
+}
+
+/**
+ * Copy the pages of |t|'s address space written since its soft-dirty bits
+ * were reset back from |orig|'s, with no breakpoints in either.
+ */
+bool DiversionSession::reset_memory(Task* t, Task* orig) {
+  size_t page = page_size();
+  bool ok = true;
+  vector<uint8_t> buf;
+  t->vm()->remove_all_breakpoints();
+  t->vm()->for_all_mappings([&](const Mapping& m, const MappableResource&) {
+    size_t num_pages = m.num_bytes() / page;
+    vector<bool> dirty = soft_dirty_pages(t, m.start, num_pages);
+    // Mappings with no pagemap entries, like [vsyscall], can't be written.
+    size_t i = 0;
+    while (ok && i < dirty.size()) {
+      if (!dirty[i]) {
+        ++i;
+        continue;
+      }
+      size_t run_end = i + 1;
+      while (run_end < dirty.size() && dirty[run_end]) {
+        ++run_end;
+      }
+      remote_ptr<void> addr = m.start + i * page;
+      size_t len = (run_end - i) * page;
+      buf.resize(len);
+      orig->vm()->suspend_breakpoints(addr.cast<uint8_t>(), len);
+      ssize_t nread = orig->read_bytes_fallible(addr, len, buf.data());
+      orig->vm()->resume_breakpoints();
+      if (nread != ssize_t(len)) {
+        ok = false;
+        break;
+      }
+      t->write_bytes_helper(addr, len, buf.data());
+      i = run_end;
+    }
+  });
+  if (!ok) {
+    return false;
+  }
+  t->vm()->copy_user_breakpoints_from(*orig->vm());
+  t->vm()->copy_watchpoints_from(*orig->vm());
+  return clear_soft_dirty_bits(t);
+}
+
+bool DiversionSession::reset(ReplaySession& replay) {
+  if (!can_reset || tasks().size() != reset_regs.size()) {
+    return false;
+  }
+  can_reset = false;
+  set<AddressSpace*> done;
+  for (auto& kv : tasks()) {
+    Task* t = kv.second;
+    Task* orig = replay.find_task(t->rec_tid);
+    if (!orig || !reset_regs.count(t->rec_tid)) {
+      return false;
+    }
+    // Buffered syscalls run without stopping, but write the syscallbuf.
+    if (!t->syscallbuf_child.is_null()) {
+      vector<bool> dirty = soft_dirty_pages(t, t->syscallbuf_child, 1);
+      if (dirty.empty() || dirty[0]) {
+        return false;
+      }
+    }
+    if (done.insert(t->vm().get()).second && !reset_memory(t, orig)) {
+      return false;
+    }
+  }
+  for (auto& kv : tasks()) {
+    Task* t = kv.second;
+    auto& regs = reset_regs[t->rec_tid];
+    t->set_regs(regs.first);
+    t->set_extra_regs(regs.second);
+  }
+  LOG(debug) << "Reset diversion session " << this;
+  can_reset = true;
+  return true;
+}
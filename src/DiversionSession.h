@@ -3,7 +3,12 @@
 #ifndef RR_DIVERSION_SESSION_H_
 #define RR_DIVERSION_SESSION_H_
 
+#include <map>
+#include <utility>
+
 #include "EmuFs.h"
+#include "ExtraRegisters.h"
+#include "Registers.h"
 #include "Session.h"
 
 class ReplaySession;
@@ -24,6 +29,12 @@ class ReplaySession;
  * "replayer" sessions, as required to support gdb's |call foo()|
  * feature.  A diversion is created for the call frame, then discarded
  * when the call finishes (loosely speaking).
+ *
+ * gdb often makes several calls in a row at the same stop, e.g. to
+ * evaluate a pretty-printer for each element of a container. Cloning a
+ * whole process tree for each of them is expensive, so a diversion that
+ * didn't make any syscalls can instead be reset() to the state it was
+ * cloned in, by copying back just the pages it wrote.
  */
 class DiversionSession : public Session {
 public:
@@ -32,6 +43,9 @@ public:
   ~DiversionSession();
 
   EmuFs& emufs() const { return *emu_fs; }
+  virtual void on_shared_mapping_change(const FileId& id, bool mapped) {
+    emu_fs->note_mapped(id, mapped);
+  }
 
   enum DiversionStatus {
     // Some execution was done. diversion_step() can be called again.
@@ -49,6 +63,16 @@ public:
    */
   DiversionResult diversion_step(Task* t, RunCommand command = RUN_CONTINUE);
 
+  /**
+   * Return this session to the state it was cloned in from |replay|,
+   * which must not have executed since. Only the pages the diversion
+   * wrote are copied back from |replay|. Returns false if that isn't
+   * possible because the diversion made syscalls, gained or lost tasks,
+   * or the kernel doesn't track soft-dirty pages; the session must then
+   * be discarded.
+   */
+  bool reset(ReplaySession& replay);
+
   virtual DiversionSession* as_diversion() { return this; }
 
 private:
@@ -56,7 +80,18 @@ private:
 
   DiversionSession(const ReplaySession& other);
 
+  /**
+   * Save the registers of all tasks and reset the soft-dirty bits of all
+   * address spaces, so reset() can return to the current state.
+   */
+  void save_reset_point();
+  bool reset_memory(Task* t, Task* orig);
+
   std::shared_ptr<EmuFs> emu_fs;
+  // The state reset() returns tasks to, by rec_tid.
+  std::map<pid_t, std::pair<Registers, ExtraRegisters> > reset_regs;
+  // False once the diversion did something reset() can't undo.
+  bool can_reset;
 };
 
 #endif // RR_DIVERSION_SESSION_H_
@@ -3,6 +3,7 @@
 #include <assert.h>
 #include <inttypes.h>
 
+#include <algorithm>
 #include <limits>
 
 #include "preload/preload_interface.h"
@@ -10,7 +11,9 @@
 #include "Command.h"
 #include "kernel_metadata.h"
 #include "main.h"
+#include "ParallelTraceReader.h"
 #include "TraceStream.h"
+#include "util.h"
 
 using namespace std;
 
@@ -34,19 +37,23 @@ DumpCommand DumpCommand::singleton(
     "  -r, --raw                  dump trace frames in a more easily\n"
     "                             machine-parseable format instead of the\n"
     "                             default human-readable format\n"
-    "  -s, --statistics           dump statistics about the trace\n");
+    "  -s, --statistics           dump statistics about the trace\n"
+    "  -t, --tid=<TID>            only dump events of thread TID\n");
 
 struct DumpFlags {
   bool dump_syscallbuf;
   bool dump_recorded_data_metadata;
   bool raw_dump;
   bool dump_statistics;
+  // 0 to dump the events of all threads.
+  pid_t only_tid;
 
   DumpFlags()
       : dump_syscallbuf(false),
         dump_recorded_data_metadata(false),
         raw_dump(false),
-        dump_statistics(false) {}
+        dump_statistics(false),
+        only_tid(0) {}
 };
 
 static bool parse_dump_arg(std::vector<std::string>& args, DumpFlags& flags) {
@@ -58,7 +65,8 @@ static bool parse_dump_arg(std::vector<std::string>& args, DumpFlags& flags) {
                                         { 'm', "recorded-metadata",
                                           NO_PARAMETER },
                                         { 'r', "raw", NO_PARAMETER },
-                                        { 's', "statistics", NO_PARAMETER } };
+                                        { 's', "statistics", NO_PARAMETER },
+                                        { 't', "tid", HAS_PARAMETER } };
   ParsedOption opt;
   if (!Command::parse_option(args, options, &opt)) {
     return false;
@@ -77,6 +85,12 @@ static bool parse_dump_arg(std::vector<std::string>& args, DumpFlags& flags) {
     case 's':
       flags.dump_statistics = true;
       break;
+    case 't':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.only_tid = opt.int_value;
+      break;
     default:
       assert(0 && "Unknown option");
   }
@@ -113,69 +127,129 @@ static void dump_syscallbuf_data(TraceReader& trace, FILE* out,
 }
 
 /**
- * Dump all events from the current to trace that match |spec| to
- * |out|.  |spec| has the following syntax: /\d+(-\d+)?/, expressing
- * either a single event number of a range, and may be null to
- * indicate "dump all events".
+ * Dump the events of |trace| in |range| that |flags| select to |out|.
+ */
+static void dump_events_in_range(TraceReader& trace, const DumpFlags& flags,
+                                 FILE* out,
+                                 const ParallelTraceReader::Range& range) {
+  bool process_raw_data =
+      flags.dump_syscallbuf || flags.dump_recorded_data_metadata;
+  ParallelTraceReader::for_each_frame(
+      trace, range, process_raw_data,
+      [&](TraceReader& trace, const TraceFrame& frame) {
+        if (flags.only_tid && flags.only_tid != frame.tid()) {
+          return;
+        }
+        if (flags.raw_dump) {
+          frame.dump_raw(out);
+        } else {
+          frame.dump(out);
+        }
+        if (flags.dump_syscallbuf) {
+          dump_syscallbuf_data(trace, out, frame);
+        }
+        TraceReader::RawData data;
+        while (flags.dump_recorded_data_metadata &&
+               trace.read_raw_data_for_frame(frame, data)) {
+          fprintf(out, "  { addr:%p, length:%p }\n", (void*)data.addr.as_int(),
+                  (void*)data.data.size());
+        }
+        if (!flags.raw_dump) {
+          fprintf(out, "}\n");
+        }
+      });
+}
+
+/**
+ * Dump all events from |trace| that match |spec| to |out|.  |spec| has
+ * the following syntax: /\d+(-\d+)?/, expressing either a single event
+ * number of a range, and may be null to indicate "dump all events".
  *
- * This function is side-effect-y, in that the trace file isn't
- * rewound in between matching each spec.  Therefore specs should be
- * constructed so as to match properly on a serial linear scan; that
- * is, they should comprise disjoint and monotonically increasing
- * event sets.  No attempt is made to enforce this or normalize specs.
+ * |trace| must be at the start of the trace. It isn't moved: the events
+ * are read through copies, decoding independently indexed parts of the
+ * range on several threads when the trace has an index. The output of
+ * every part is buffered until all earlier parts have been written out.
  */
-static void dump_events_matching(TraceReader& trace, const DumpFlags& flags,
-                                 FILE* out, const string* spec) {
+static void dump_events_matching(const TraceReader& trace,
+                                 const DumpFlags& flags, FILE* out,
+                                 const string* spec) {
 
-  uint32_t start = 0, end = numeric_limits<uint32_t>::max();
+  TraceFrame::Time start = 0, end = numeric_limits<TraceFrame::Time>::max();
 
   // Try to parse the "range" syntax '[start]-[end]'.
-  if (spec && 2 > sscanf(spec->c_str(), "%u-%u", &start, &end)) {
+  if (spec &&
+      2 > sscanf(spec->c_str(), "%" SCNu64 "-%" SCNu64, &start, &end)) {
     // Fall back on assuming the spec is a single event
-    // number, however it parses out with atoi().
-    start = end = atoi(spec->c_str());
+    // number, however it parses out with strtoull().
+    start = end = strtoull(spec->c_str(), nullptr, 10);
   }
 
-  bool process_raw_data =
-      flags.dump_syscallbuf || flags.dump_recorded_data_metadata;
-  while (!trace.at_end()) {
-    auto frame = trace.read_frame();
-    if (end < frame.time()) {
-      return;
-    }
-    if (start <= frame.time() && frame.time() <= end) {
-      if (flags.raw_dump) {
-        frame.dump_raw(out);
-      } else {
-        frame.dump(out);
-      }
-      if (flags.dump_syscallbuf) {
-        dump_syscallbuf_data(trace, out, frame);
-      }
-      TraceReader::RawData data;
-      while (process_raw_data && trace.read_raw_data_for_frame(frame, data)) {
-        if (flags.dump_recorded_data_metadata) {
-          fprintf(out, "  { addr:%p, length:%p }\n", (void*)data.addr.as_int(),
-                  (void*)data.data.size());
-        }
-      }
-      if (!flags.raw_dump) {
-        fprintf(out, "}\n");
-      }
-    } else {
-      TraceReader::RawData data;
-      while (process_raw_data && trace.read_raw_data_for_frame(frame, data)) {
+  ParallelTraceReader parallel(trace);
+  auto ranges = parallel.split(start, end);
+  struct Output {
+    char* data;
+    size_t size;
+  };
+  vector<Output> outputs(ranges.size());
+  parallel.for_each(ranges, 0,
+                    [&](TraceReader& reader, size_t i) {
+                      FILE* chunk_out =
+                          open_memstream(&outputs[i].data, &outputs[i].size);
+                      dump_events_in_range(reader, flags, chunk_out, ranges[i]);
+                      fclose(chunk_out);
+                    },
+                    [&](size_t i) {
+                      fwrite(outputs[i].data, 1, outputs[i].size, out);
+                      free(outputs[i].data);
+                    });
+}
+
+/**
+ * Print how each syscall was recorded, most expensive trapped syscalls
+ * first, so it's easy to see which ones would most benefit from being
+ * buffered.
+ */
+static void dump_syscall_statistics(TraceReader& trace, FILE* out) {
+  TraceSyscallStats stats;
+  if (!trace.read_syscall_stats(&stats)) {
+    fprintf(out, "// No syscall statistics (recording didn't finish or "
+                 "the trace is from an older rr)\n");
+    return;
+  }
+  typedef decltype(stats.syscalls)::value_type Entry;
+  vector<const Entry*> syscalls;
+  for (auto& kv : stats.syscalls) {
+    syscalls.push_back(&kv);
+  }
+  stable_sort(syscalls.begin(), syscalls.end(),
+              [](const Entry* a, const Entry* b) {
+                return a->second.trapped_seconds > b->second.trapped_seconds;
+              });
+  fprintf(out, "// %-24s %12s %12s %12s %10s\n", "syscall", "buffered",
+          "trapped", "trapped-sec", "mean-us");
+  for (auto s : syscalls) {
+    const TraceSyscallStats::Syscall& st = s->second;
+    fprintf(out, "// %-24s %12" PRIu64 " %12" PRIu64 " %12.6f %10.1f\n",
+            syscall_name(s->first.second, s->first.first).c_str(),
+            st.buffered, st.trapped, st.trapped_seconds,
+            st.trapped ? st.trapped_seconds * 1e6 / st.trapped : 0.0);
+    for (int b = 0; b < TraceSyscallStats::BUCKETS; ++b) {
+      if (st.buckets[b]) {
+        bool last = b == TraceSyscallStats::BUCKETS - 1;
+        fprintf(out, "//   %s%lluus: %" PRIu64 "\n", last ? ">=" : "<",
+                1ULL << (last ? b : b + 1), st.buckets[b]);
       }
     }
   }
 }
 
-static void dump_statistics(const TraceReader& trace, FILE* out) {
+static void dump_statistics(TraceReader& trace, FILE* out) {
   uint64_t uncompressed = trace.uncompressed_bytes();
   uint64_t compressed = trace.compressed_bytes();
   fprintf(stdout, "// Uncompressed bytes %" PRIu64 ", compressed bytes %" PRIu64
                   ", ratio %.2fx\n",
           uncompressed, compressed, double(uncompressed) / compressed);
+  dump_syscall_statistics(trace, out);
 }
 
 static void dump(const string& trace_dir, const DumpFlags& flags,
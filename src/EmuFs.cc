@@ -5,14 +5,14 @@
 #include "EmuFs.h"
 
 #include <syscall.h>
+#include <unistd.h>
 
-#include <fstream>
 #include <sstream>
 #include <string>
 
 #include "kernel_abi.h"
-#include "kernel_metadata.h"
 #include "log.h"
+#include "MemoryAccounting.h"
 #include "ReplaySession.h"
 
 using namespace rr;
@@ -26,16 +26,85 @@ static void replace_char(string& s, char c, char replacement) {
 }
 
 EmuFile::~EmuFile() {
+  MemoryAccounting::remove(MemoryAccounting::EMUFS, est.st_size);
   LOG(debug) << "    EmuFs::~File(einode:" << est.st_ino << ")";
 }
 
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+/**
+ * Create an anonymous memfd of |num_bytes| to back an emulated file, so
+ * emulated files never appear in (or need cleaning up from) a filesystem.
+ * Fall back to a SHMEM_FS file on kernels without memfd_create.
+ */
+static ScopedFd create_emufs_segment(const string& name, size_t num_bytes) {
+#ifdef SYS_memfd_create
+  static bool memfd_supported = true;
+  if (memfd_supported) {
+    // The kernel limits memfd names to NAME_MAX minus its "memfd:" prefix.
+    string memfd_name = name.substr(0, NAME_MAX - 6);
+    ScopedFd fd = syscall(SYS_memfd_create, memfd_name.c_str(), MFD_CLOEXEC);
+    if (fd.is_open()) {
+      resize_shmem_segment(fd, num_bytes);
+      LOG(debug) << "created memfd segment " << memfd_name;
+      return fd;
+    }
+    if (errno != ENOSYS) {
+      FATAL() << "Failed to create memfd segment " << memfd_name;
+    }
+    memfd_supported = false;
+  }
+#endif
+  return create_shmem_segment(name, num_bytes);
+}
+
+/**
+ * Copy the data of |src| to the (equally sized and initially empty)
+ * |dst|, skipping holes so that pages the tracees never touched aren't
+ * allocated in the copy.
+ */
+static void copy_file_data(const ScopedFd& src, const ScopedFd& dst,
+                           off_t size) {
+  char buf[64 * 1024];
+  off_t offset = 0;
+  while (offset < size) {
+    off_t data = lseek(src, offset, SEEK_DATA);
+    if (data < 0) {
+      if (errno == ENXIO) {
+        // Only a hole remains.
+        return;
+      }
+      // SEEK_DATA isn't supported; copy everything.
+      data = offset;
+    }
+    off_t hole = lseek(src, data, SEEK_HOLE);
+    if (hole < 0) {
+      hole = size;
+    }
+    offset = data;
+    while (offset < hole) {
+      ssize_t nread =
+          pread(src, buf, min<off_t>(sizeof(buf), hole - offset), offset);
+      if (nread <= 0) {
+        FATAL() << "Failed to read emulated file data";
+      }
+      if (nread != pwrite(dst, buf, nread, offset)) {
+        FATAL() << "Failed to write emulated file data";
+      }
+      offset += nread;
+    }
+  }
+}
+
 EmuFile::shr_ptr EmuFile::clone() {
   auto f = EmuFile::create(orig_path.c_str(), est);
-  // NB: this isn't the most efficient possible file copy, but
-  // it's simple and not too slow.
-  ifstream src(proc_path(), ifstream::binary);
-  ofstream dst(f->proc_path(), ofstream::binary);
-  dst << src.rdbuf();
+  struct stat st;
+  if (fstat(file, &st)) {
+    FATAL() << "Failed to stat emulated file";
+  }
+  copy_file_data(file, f->file, st.st_size);
   return f;
 }
 
@@ -49,6 +118,7 @@ void EmuFile::update(const struct stat& st) {
   assert(est.st_dev == st.st_dev && est.st_ino == st.st_ino);
   if (est.st_size != st.st_size) {
     resize_shmem_segment(file, st.st_size);
+    MemoryAccounting::add(MemoryAccounting::EMUFS, st.st_size - est.st_size);
   }
   est = st;
 }
@@ -63,7 +133,7 @@ void EmuFile::update(const struct stat& st) {
   stringstream name;
   name << "rr-emufs-" << getpid() << "-dev-" << est.st_dev << "-inode-"
        << est.st_ino << "-" << path_tag;
-  shr_ptr f(new EmuFile(create_shmem_segment(name.str(), est.st_size), est,
+  shr_ptr f(new EmuFile(create_emufs_segment(name.str(), est.st_size), est,
                         orig_path));
   LOG(debug) << "created emulated file for " << orig_path << " as "
              << name.str();
@@ -71,7 +141,9 @@ void EmuFile::update(const struct stat& st) {
 }
 
 EmuFile::EmuFile(ScopedFd&& fd, const struct stat& est, const string& orig_path)
-    : est(est), orig_path(orig_path), file(std::move(fd)), is_marked(false) {}
+    : est(est), orig_path(orig_path), file(std::move(fd)) {
+  MemoryAccounting::add(MemoryAccounting::EMUFS, est.st_size);
+}
 
 EmuFile::shr_ptr EmuFs::at(const FileId& id) const { return files.at(id); }
 
@@ -80,65 +152,52 @@ EmuFs::shr_ptr EmuFs::clone() {
   for (auto& kv : files) {
     const FileId& id = kv.first;
     fs->files[id] = kv.second->clone();
+    // The clone's address spaces will note their mappings as they're
+    // created.
+    fs->maybe_unmapped.push_back(id);
   }
   return fs;
 }
 
-void EmuFs::gc(const Session& session) {
-  // XXX this implementation is unnecessarily slow.  But before
-  // throwing it away for something different, give it another
-  // shot once rr is caching local mmaps for all address spaces,
-  // which obviates the need for the yuck slow maps parsing
-  // here.
-  LOG(debug) << "Beginning emufs gc of " << files.size() << " files";
-
-  // Mark in-use files by iterating through the mmaps of all
-  // tracee address spaces.
-  //
-  // We inject these maps into the tracee and are careful to
-  // close the injected fd after we finish the mmap.  That means
-  // that the only way tracees can hold a reference to the
-  // underlying inode is through a memory mapping.  So to
-  // determine if a file is in use, we only have to find a
-  // recognizable filename in some tracee's memory map.
-  //
-  // We check *all* tracee file tables because tracees can share
-  // fds with each other in many ways, and we don't attempt to
-  // track any of that.
-  //
-  // TODO: assuming AddressSpace == FileTable, but technically
-  // they're different things: two tracees could share an
-  // address space but have different file tables.
-  size_t nr_marked_files = 0;
-  for (auto& as : session.vms()) {
-    Task* t = *as->task_set().begin();
-    LOG(debug) << "  iterating /proc/" << t->tid << "/maps ...";
-
-    mark_used_vfiles(t, *as, &nr_marked_files);
-    if (files.size() == nr_marked_files) {
-      break;
-    }
+void EmuFs::note_mapped(const FileId& id, bool mapped) {
+  if (mapped) {
+    ++map_counts[id];
+    return;
   }
+  auto it = map_counts.find(id);
+  assert(it != map_counts.end() && it->second > 0);
+  if (--it->second == 0) {
+    map_counts.erase(it);
+    maybe_unmapped.push_back(id);
+  }
+}
 
-  // Sweep all the virtual files that weren't marked.  It might
-  // be possible that a later task will mmap the same underlying
-  // file that we're about to destroy.  That's perfectly fine;
-  // we'll just create it anew, and restore its addressible
-  // contents from the snapshot saved to the trace.  Since there
-  // are no live references to the file in the interim, tracees
-  // can't observe the destroy/recreate operation.
-  vector<FileId> garbage;
-  for (auto it = files.begin(); it != files.end(); ++it) {
-    if (!it->second->marked()) {
-      garbage.push_back(it->first);
+void EmuFs::release_unmapped() {
+  // It might be possible that a later task will mmap the same
+  // underlying file that we're about to destroy.  That's perfectly
+  // fine; we'll just create it anew, and restore its addressible
+  // contents from the snapshot saved to the trace.  Since there are no
+  // live references to the file in the interim, tracees can't observe
+  // the destroy/recreate operation.
+  for (auto& id : maybe_unmapped) {
+    auto it = files.find(id);
+    if (it == files.end() || map_counts.count(id) ||
+        id.psuedodevice() == PSEUDODEVICE_SYSV_SHM) {
+      continue;
     }
-    it->second->unmark();
+    LOG(debug) << "  emufs reclaiming einode:" << id.disp_inode()
+               << "; fs name `" << it->second->emu_path() << "'";
+    files.erase(it);
   }
-  for (auto it = garbage.begin(); it != garbage.end(); ++it) {
-    LOG(debug) << "  emufs gc reclaiming einode:" << it->disp_inode()
-               << "; fs name `" << files[*it]->emu_path() << "'";
-    files.erase(*it);
+  maybe_unmapped.clear();
+}
+
+void EmuFs::gc() {
+  maybe_unmapped.clear();
+  for (auto& kv : files) {
+    maybe_unmapped.push_back(kv.first);
   }
+  release_unmapped();
 }
 
 EmuFile::shr_ptr EmuFs::get_or_create(const TraceMappedRegion& mf) {
@@ -152,6 +211,7 @@ EmuFile::shr_ptr EmuFs::get_or_create(const TraceMappedRegion& mf) {
   }
   auto vf = EmuFile::create(mf.file_name(), mf.stat());
   files[id] = vf;
+  maybe_unmapped.push_back(id);
   return vf;
 }
 
@@ -165,6 +225,7 @@ EmuFile::shr_ptr EmuFs::create_anonymous(const FileId& id, size_t size) {
   name << "anonymous-" << id.internal_inode();
   auto vf = EmuFile::create(name.str(), fake_stat);
   files[id] = vf;
+  maybe_unmapped.push_back(id);
   return vf;
 }
 
@@ -180,44 +241,11 @@ void EmuFs::log() const {
 
 EmuFs::EmuFs() {}
 
-void EmuFs::mark_used_vfiles(Task* t, const AddressSpace& as,
-                             size_t* nr_marked_files) {
-  for (auto& kv : as.memmap()) {
-    const MappableResource& r = kv.second;
-    LOG(debug) << "  examining " << r.fsname.c_str() << " ...";
-
-    auto id_ef = files.find(r.id);
-    if (id_ef == files.end()) {
-      ASSERT(t, !r.is_shared_mmap_file());
-      continue;
-    }
-    auto ef = id_ef->second;
-    if (!ef->marked()) {
-      ef->mark();
-      LOG(debug) << "    marked einode:" << r.id.disp_inode();
-      ++*nr_marked_files;
-      if (files.size() == *nr_marked_files) {
-        LOG(debug) << "  (marked all files, bailing)";
-        return;
-      }
-    }
-  }
-}
-
-EmuFs::AutoGc::AutoGc(ReplaySession& session, SupportedArch arch, int syscallno,
-                      SyscallEntryOrExit state)
-    : session(session),
-      is_gc_point(session.emufs().size() > 0 && SYSCALL_EXIT == state &&
-                  (is_close_syscall(syscallno, arch) ||
-                   is_munmap_syscall(syscallno, arch))) {
-  if (is_gc_point) {
-    LOG(debug) << "emufs gc required because of syscall `"
-               << syscall_name(syscallno, arch) << "'";
-  }
-}
+EmuFs::AutoGc::AutoGc(ReplaySession& session, SyscallEntryOrExit state)
+    : session(session), is_gc_point(SYSCALL_EXIT == state) {}
 
 EmuFs::AutoGc::~AutoGc() {
   if (is_gc_point) {
-    session.gc_emufs();
+    session.emufs().release_unmapped();
   }
 }
@@ -37,9 +37,9 @@ class Task;
  * ID was recycled in [t_0, t_1), then all references to F_0 must have
  * been dropped in that inverval.  A corollary of that is that all
  * memory mappings of F_0 must have been fully unmapped in the
- * interval.  As per the first long comment in |gc()| below, an
- * emulated file can only be "live" during replay if some tracee still
- * has a mapping of it.  Tracees' mappings of emulated files is a
+ * interval.  We inject the mappings of emulated files into tracees and
+ * close the injected fd straight away, so an emulated file can only be
+ * "live" during replay if some tracee still has a mapping of it.  Tracees' mappings of emulated files is a
  * subset of the ways they can create references to real files during
  * recording.  Therefore the event during replay that drops the last
  * reference to the emulated F_0 must be a tracee unmapping of F_0.
@@ -83,13 +83,6 @@ public:
    */
   std::string proc_path() const;
 
-  /**
-   * Mark/unmark/check to see if this file is marked.
-   */
-  void mark() { is_marked = true; }
-  bool marked() const { return is_marked; }
-  void unmark() { is_marked = false; }
-
   /**
    * Ensure that the emulated file is sized to match a later
    * stat() of it, |st|.
@@ -112,7 +105,6 @@ private:
   struct stat est;
   std::string orig_path;
   ScopedFd file;
-  bool is_marked;
 
   EmuFile(const EmuFile&) = delete;
   EmuFile operator=(const EmuFile&) = delete;
@@ -160,12 +152,31 @@ public:
   static shr_ptr create();
 
   /**
-   * RAII helper that schedules an EmuFs GC when the exit of a given
-   * syscall may have dropped the last reference to an emulated file.
+   * Note that an address space of this fs's session started (|mapped|) or
+   * stopped mapping any part of the file |id|. AddressSpace calls this
+   * from map()/unmap(), so we know which files are live without looking
+   * at every tracee's mappings.
+   */
+  void note_mapped(const FileId& id, bool mapped);
+
+  /**
+   * Release the files that lost their last mapping, or were created and
+   * never mapped, since the last call. Files are released here rather
+   * than in note_mapped() because replacing a mapping unmaps the file
+   * before mapping it again.
+   *
+   * SysV shm segments are never released: a segment outlives its attaches,
+   * and a later attach only restores the pages that changed since the
+   * last one. The next full recording of the shmid reuses the file.
+   */
+  void release_unmapped();
+
+  /**
+   * RAII helper that releases unmapped emulated files at the exit of a
+   * syscall, which is when the last mapping of a file can go away.
    */
   struct AutoGc {
-    AutoGc(ReplaySession& session, SupportedArch arch, int syscallno,
-           SyscallEntryOrExit state);
+    AutoGc(ReplaySession& session, SyscallEntryOrExit state);
     ~AutoGc();
 
   private:
@@ -174,25 +185,19 @@ public:
   };
 
   /**
-   * Collect emulated files that aren't referenced by tracees.
-   * Call this only when a tracee's (possibly shared) file table
-   * has been destroyed.  All other gc triggers are handled
-   * internally.
+   * Release all emulated files that no tracee maps.
    */
-  void gc(const Session& session);
+  void gc();
 
 private:
   EmuFs();
 
-  /**
-   * Mark all the files being used by the tasks in |as|, and
-   * increment |nt_marked_files| by the number of files that
-   * were marked.
-   */
-  void mark_used_vfiles(Task* t, const AddressSpace& as,
-                        size_t* nr_marked_files);
-
   FileMap files;
+  // How many of the session's address spaces map each file.
+  std::map<FileId, uint32_t> map_counts;
+  // Files that may have become unmapped since the last
+  // release_unmapped().
+  std::vector<FileId> maybe_unmapped;
 
   EmuFs(const EmuFs&) = delete;
   EmuFs& operator=(const EmuFs&) = delete;
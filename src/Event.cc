@@ -43,6 +43,7 @@ Event::Event(EncodedEvent e) {
     case EV_SYSCALLBUF_ABORT_COMMIT:
     case EV_SYSCALLBUF_RESET:
     case EV_PATCH_SYSCALL:
+    case EV_PATCH_RDTSC:
     case EV_TRACE_TERMINATION:
     case EV_UNSTABLE_EXIT:
     case EV_INTERRUPTED_SYSCALL_NOT_RESTARTED:
@@ -139,6 +140,26 @@ Event& Event::operator=(const Event& o) {
   return *this;
 }
 
+void EventStack::push(const Event& ev) {
+  if (depth < events.size()) {
+    *events[depth] = ev;
+  } else {
+    events.push_back(std::unique_ptr<Event>(new Event(ev)));
+  }
+  ++depth;
+}
+
+EventStack& EventStack::operator=(const EventStack& o) {
+  if (this == &o) {
+    return *this;
+  }
+  depth = 0;
+  for (size_t i = 0; i < o.size(); ++i) {
+    push(o[i]);
+  }
+  return *this;
+}
+
 static void set_encoded_event_data(EncodedEvent* e, int data) {
   e->data = data;
   // Ensure that e->data is wide enough for the data
@@ -163,6 +184,7 @@ EncodedEvent Event::encode() const {
     case EV_SYSCALLBUF_ABORT_COMMIT:
     case EV_SYSCALLBUF_RESET:
     case EV_PATCH_SYSCALL:
+    case EV_PATCH_RDTSC:
     case EV_TRACE_TERMINATION:
     case EV_UNSTABLE_EXIT:
     case EV_INTERRUPTED_SYSCALL_NOT_RESTARTED:
@@ -329,6 +351,7 @@ std::string Event::type_name() const {
       CASE(SYSCALLBUF_ABORT_COMMIT);
       CASE(SYSCALLBUF_RESET);
       CASE(PATCH_SYSCALL);
+      CASE(PATCH_RDTSC);
       CASE(UNSTABLE_EXIT);
       CASE(DESCHED);
       CASE(SIGNAL);
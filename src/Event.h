@@ -5,9 +5,11 @@
 
 #include <assert.h>
 
+#include <memory>
 #include <ostream>
 #include <stack>
 #include <string>
+#include <vector>
 
 #include "kernel_abi.h"
 #include "Registers.h"
@@ -57,6 +59,10 @@ enum EventType {
   // Use .syscall.
   EV_SYSCALL,
   EV_SYSCALL_INTERRUPTION,
+  // An rdtsc trapped, was patched to call the rdtsc hook, and was not
+  // executed. Resume execution at the patch. (Added after the other events
+  // to keep the encoding of older traces.)
+  EV_PATCH_RDTSC,
   EV_LAST
 };
 
@@ -207,7 +213,8 @@ struct SyscallEvent : public BaseEvent {
         desched_rec(nullptr),
         state(NO_SYSCALL),
         number(syscallno),
-        is_restart(false) {}
+        is_restart(false),
+        entry_time(0) {}
   // The original (before scratch is set up) arguments to the
   // syscall passed by the tracee.  These are used to detect
   // restarted syscalls.
@@ -222,6 +229,9 @@ struct SyscallEvent : public BaseEvent {
   // Nonzero when this syscall was restarted after a signal
   // interruption.
   bool is_restart;
+  // When the recorder saw the entry stop (CLOCK_MONOTONIC seconds), to
+  // time trapped syscalls for TraceSyscallStats.
+  double entry_time;
 };
 
 struct syscall_interruption_t {};
@@ -354,6 +364,44 @@ private:
   };
 };
 
+/**
+ * A Task's stack of pending events. Every trapped syscall and signal
+ * pushes and pops an Event, so popped Events keep their storage and the
+ * next push at that depth reuses it; the stack only allocates when it
+ * grows deeper than it has been before. Events never move once pushed,
+ * so references to them stay valid while more events are pushed.
+ */
+class EventStack {
+public:
+  EventStack() : depth(0) {}
+  EventStack(const EventStack& o) : depth(0) { *this = o; }
+  EventStack& operator=(const EventStack& o);
+
+  void push(const Event& ev);
+  void pop() {
+    assert(depth > 0);
+    --depth;
+  }
+
+  Event& back() {
+    assert(depth > 0);
+    return *events[depth - 1];
+  }
+  const Event& back() const {
+    assert(depth > 0);
+    return *events[depth - 1];
+  }
+  Event& operator[](size_t i) { return *events[i]; }
+  const Event& operator[](size_t i) const { return *events[i]; }
+
+  size_t size() const { return depth; }
+  bool empty() const { return depth == 0; }
+
+private:
+  std::vector<std::unique_ptr<Event> > events;
+  size_t depth;
+};
+
 inline static std::ostream& operator<<(std::ostream& o, const Event& ev) {
   return o << ev.str();
 }
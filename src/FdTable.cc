@@ -2,6 +2,8 @@
 
 #include "FdTable.h"
 
+#include <algorithm>
+#include <set>
 #include <unordered_set>
 
 #include "Session.h"
@@ -9,33 +11,78 @@
 
 using namespace std;
 
+static bool fd_less(const pair<int, FileMonitor::shr_ptr>& entry, int fd) {
+  return entry.first < fd;
+}
+
+FileMonitor* FdTable::get_monitor(int fd) const {
+  if (!is_monitoring(fd)) {
+    return nullptr;
+  }
+  auto& by_fd = monitors->by_fd;
+  auto it = lower_bound(by_fd.begin(), by_fd.end(), fd, fd_less);
+  assert(it != by_fd.end() && it->first == fd);
+  return it->second.get();
+}
+
+void FdTable::set_monitor(int fd, const FileMonitor::shr_ptr& monitor) {
+  assert(fd >= 0);
+  if (!monitor && !is_monitoring(fd)) {
+    return;
+  }
+  if (monitors.use_count() > 1) {
+    monitors = make_shared<Monitors>(*monitors);
+  }
+
+  auto& has_monitor = monitors->has_monitor;
+  size_t word = size_t(fd) / 64;
+  uint64_t bit = uint64_t(1) << (fd % 64);
+  auto& by_fd = monitors->by_fd;
+  auto it = lower_bound(by_fd.begin(), by_fd.end(), fd, fd_less);
+  if (monitor) {
+    if (word >= has_monitor.size()) {
+      has_monitor.resize(word + 1, 0);
+    }
+    has_monitor[word] |= bit;
+    if (it != by_fd.end() && it->first == fd) {
+      it->second = monitor;
+    } else {
+      by_fd.insert(it, make_pair(fd, monitor));
+    }
+  } else {
+    has_monitor[word] &= ~bit;
+    by_fd.erase(it);
+  }
+}
+
 Switchable FdTable::will_write(Task* t, int fd) {
-  auto it = fds.find(fd);
-  if (it != fds.end()) {
-    return it->second->will_write(t);
+  FileMonitor* monitor = get_monitor(fd);
+  if (monitor) {
+    return monitor->will_write(t);
   }
   return ALLOW_SWITCH;
 }
 
 void FdTable::did_write(Task* t, int fd,
                         const std::vector<FileMonitor::Range>& ranges) {
-  auto it = fds.find(fd);
-  if (it != fds.end()) {
-    it->second->did_write(t, ranges);
+  FileMonitor* monitor = get_monitor(fd);
+  if (monitor) {
+    monitor->did_write(t, ranges);
   }
 }
 
 void FdTable::dup(int from, int to) {
-  if (fds.count(from)) {
-    fds[to] = fds[from];
-  } else {
-    fds.erase(to);
+  FileMonitor::shr_ptr monitor;
+  if (is_monitoring(from)) {
+    auto& by_fd = monitors->by_fd;
+    monitor = lower_bound(by_fd.begin(), by_fd.end(), from, fd_less)->second;
   }
+  set_monitor(to, monitor);
   update_syscallbuf_fds_disabled(to);
 }
 
 void FdTable::close(int fd) {
-  fds.erase(fd);
+  set_monitor(fd, nullptr);
   update_syscallbuf_fds_disabled(fd);
 }
 
@@ -48,6 +95,19 @@ static bool is_fd_monitored_in_any_task(AddressSpace* vm, int fd) {
   return false;
 }
 
+// The byte of the syscallbuf-disabled bitmap holding |fd|'s bit, with the
+// bits of the fds sharing it set for those monitored in any task of |vm|.
+static char fds_disabled_byte(AddressSpace* vm, int fd) {
+  char byte = 0;
+  int first_fd = fd & ~7;
+  for (int i = 0; i < 8; ++i) {
+    if (is_fd_monitored_in_any_task(vm, first_fd + i)) {
+      byte |= 1 << i;
+    }
+  }
+  return byte;
+}
+
 void FdTable::update_syscallbuf_fds_disabled(int fd) {
   assert(fd >= 0);
 
@@ -61,37 +121,39 @@ void FdTable::update_syscallbuf_fds_disabled(int fd) {
     }
     vms_updated.insert(vm);
 
-    if (!t->syscallbuf_fds_disabled_child.is_null() &&
+    if (!vm->syscallbuf_fds_disabled().is_null() &&
         fd < SYSCALLBUF_FDS_DISABLED_SIZE) {
-      bool is_monitored = is_fd_monitored_in_any_task(vm, fd);
-      t->write_mem(t->syscallbuf_fds_disabled_child + fd, (char)is_monitored);
+      t->write_mem(vm->syscallbuf_fds_disabled() + (fd >> 3),
+                   fds_disabled_byte(vm, fd));
     }
   }
 }
 
 void FdTable::init_syscallbuf_fds_disabled(Task* t) {
-  if (t->syscallbuf_fds_disabled_child.is_null()) {
+  if (t->vm()->syscallbuf_fds_disabled().is_null()) {
     return;
   }
 
-  char disabled[SYSCALLBUF_FDS_DISABLED_SIZE];
-  memset(disabled, 0, sizeof(disabled));
-
   // It's possible that some tasks in this address space have a different
   // FdTable. We need to disable syscallbuf for an fd if any tasks for this
   // address space are monitoring the fd.
+  // The bitmap is in the freshly loaded preload library's bss, so it's all
+  // clear; only write the bytes that need bits set, to avoid touching
+  // pages of it we don't need.
+  set<int> bytes;
   for (Task* vm_t : t->vm()->task_set()) {
-    for (auto& it : vm_t->fd_table()->fds) {
+    for (auto& it : vm_t->fd_table()->monitors->by_fd) {
       int fd = it.first;
       assert(fd >= 0);
       if (fd < SYSCALLBUF_FDS_DISABLED_SIZE) {
-        disabled[fd] = 1;
+        bytes.insert(fd >> 3);
       }
     }
   }
-
-  t->write_mem(t->syscallbuf_fds_disabled_child, disabled,
-               SYSCALLBUF_FDS_DISABLED_SIZE);
+  for (int byte : bytes) {
+    t->write_mem(t->vm()->syscallbuf_fds_disabled() + byte,
+                 fds_disabled_byte(t->vm().get(), byte << 3));
+  }
 }
 
 static bool is_fd_open(Task* t, int fd) {
@@ -105,7 +167,7 @@ void FdTable::update_for_cloexec(Task* t, TraceTaskEvent& event) {
   vector<int> fds_to_close;
 
   if (t->session().is_recording()) {
-    for (auto& it : fds) {
+    for (auto& it : monitors->by_fd) {
       if (!is_fd_open(t, it.first)) {
         fds_to_close.push_back(it.first);
       }
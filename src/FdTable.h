@@ -3,8 +3,8 @@
 #ifndef RR_FD_TABLE_H_
 #define RR_FD_TABLE_H_
 
-#include <unordered_map>
 #include <memory>
+#include <vector>
 
 #include "AddressSpace.h"
 #include "FileMonitor.h"
@@ -19,7 +19,7 @@ public:
     // In the future we could support multiple monitors on an fd, but we don't
     // need to yet.
     assert(!is_monitoring(fd));
-    fds[fd] = FileMonitor::shr_ptr(monitor);
+    set_monitor(fd, FileMonitor::shr_ptr(monitor));
   }
   Switchable will_write(Task* t, int fd);
   void did_write(Task* t, int fd,
@@ -39,7 +39,11 @@ public:
     return fds;
   }
 
-  bool is_monitoring(int fd) { return fds.count(fd) > 0; }
+  bool is_monitoring(int fd) const {
+    size_t word = size_t(fd) / 64;
+    return word < monitors->has_monitor.size() &&
+           (monitors->has_monitor[word] >> (fd % 64) & 1);
+  }
 
   /**
    * Regenerate syscallbuf_fds_disabled in task |t|.
@@ -57,12 +61,24 @@ public:
   void update_for_cloexec(Task* t, TraceTaskEvent& event);
 
 private:
-  FdTable() {}
-  FdTable(const FdTable& other) : fds(other.fds) {}
+  FdTable() : monitors(std::make_shared<Monitors>()) {}
+  // Clones share |monitors| until one of them changes it, so forking
+  // costs nothing however many fds are monitored.
+  FdTable(const FdTable& other) : monitors(other.monitors) {}
 
+  FileMonitor* get_monitor(int fd) const;
+  // Make |fd|'s monitor |monitor|, or remove it if |monitor| is null.
+  void set_monitor(int fd, const FileMonitor::shr_ptr& monitor);
   void update_syscallbuf_fds_disabled(int fd);
 
-  std::unordered_map<int, FileMonitor::shr_ptr> fds;
+  struct Monitors {
+    // Bit |fd| is set iff |fd| has a monitor. Most fds don't, so this is
+    // all will_write() and did_write() usually look at.
+    std::vector<uint64_t> has_monitor;
+    // The monitored fds and their monitors, sorted by fd.
+    std::vector<std::pair<int, FileMonitor::shr_ptr> > by_fd;
+  };
+  std::shared_ptr<Monitors> monitors;
 };
 
 #endif /* RR_FD_TABLE_H_ */
@@ -24,20 +24,24 @@ struct Flags {
    * CHECKSUM_SYSCALL or CHECKSUM_ALL, or a positive integer representing the
    * event time at which to start checksumming.
    */
-  int checksum;
+  int64_t checksum;
 
   enum {
     DUMP_ON_ALL = 10000,
     DUMP_ON_NONE = -DUMP_ON_ALL
   };
   /* event(s) to create memory dumps for */
-  TraceFrame::Time dump_on; // event
+  int dump_on; // event
 
   enum {
     DUMP_AT_NONE = -1
   };
   /* time at which to create memory dump */
-  int dump_at; // global time
+  int64_t dump_at; // global time
+
+  /* Write memory dumps as a directory of compressed mappings rather than
+   * as text. */
+  bool dump_binary;
 
   /* True when not-absolutely-urgently-critical messages will be
    * logged. */
@@ -66,15 +70,48 @@ struct Flags {
   // under valgrind.
   std::string forced_uarch;
 
+  // Maximum memory used to decompress trace data ahead of the reader.
+  // 0 disables read-ahead.
+  size_t read_ahead_bytes;
+
+  // Maximum private memory the reverse-execution checkpoints of a replay
+  // may use before the oldest are discarded. 0 means no limit.
+  size_t checkpoint_memory_budget;
+
+  // Mark the anonymous private memory of replay checkpoints MADV_MERGEABLE
+  // so KSM can share identical pages between them.
+  bool merge_checkpoint_pages;
+
+  // File to write a JSON log of replay checkpoint and seek events to.
+  std::string timeline_log;
+
+  // During replay, compare registers against the recording only at events
+  // whose global time is a multiple of this.
+  uint32_t check_regs_interval;
+
+  // Replay a trace that's still being recorded, waiting for the recorder
+  // when replay catches up with it.
+  bool follow_trace;
+
+  // Print rr's memory use by subsystem when the command finishes.
+  bool memory_report;
+
   Flags()
       : checksum(CHECKSUM_NONE),
         dump_on(DUMP_ON_NONE),
         dump_at(DUMP_AT_NONE),
+        dump_binary(false),
         verbose(false),
         force_things(false),
         mark_stdio(false),
         check_cached_mmaps(false),
-        suppress_environment_warnings(false) {}
+        suppress_environment_warnings(false),
+        read_ahead_bytes(64 * 1024 * 1024),
+        checkpoint_memory_budget(0),
+        merge_checkpoint_pages(false),
+        check_regs_interval(1),
+        follow_trace(false),
+        memory_report(false) {}
 
   static const Flags& get() { return singleton; }
 
@@ -0,0 +1,95 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "Command.h"
+#include "Event.h"
+#include "FlightRecorder.h"
+#include "kernel_metadata.h"
+#include "main.h"
+#include "ScopedFd.h"
+
+using namespace std;
+
+class FlightCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  FlightCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static FlightCommand singleton;
+};
+
+FlightCommand FlightCommand::singleton(
+    "flight",
+    " rr flight <file>\n"
+    "  Print the flight recorder log that rr wrote to <file> when it hit a\n"
+    "  fatal error or failed assertion, oldest entry first.\n");
+
+static void print_entry(const FlightRecorder::Entry& e, FILE* out) {
+  fprintf(out, "%" PRIu64 " %s tid:%d time:%" PRIu64 " ticks:%" PRId64
+               " regs:%016" PRIx64 " ",
+          e.seq, FlightRecorder::type_name(e.type), e.tid, e.time, e.ticks,
+          e.regs_hash);
+  switch (e.type) {
+    case FlightRecorder::RESUME:
+      fprintf(out, "%s sig:%d\n", ptrace_req_name(uint32_t(e.data)),
+              int(e.data >> 32));
+      break;
+    case FlightRecorder::STOP:
+      fprintf(out, "status:0x%" PRIx64 "\n", e.data);
+      break;
+    case FlightRecorder::RECORD_EVENT:
+    case FlightRecorder::REPLAY_EVENT: {
+      EncodedEvent encoded;
+      encoded.encoded = int(e.data);
+      fprintf(out, "%s\n", Event(encoded).str().c_str());
+      break;
+    }
+    default:
+      fprintf(out, "0x%" PRIx64 "\n", e.data);
+      break;
+  }
+}
+
+static int print_log(const string& path, FILE* out) {
+  ScopedFd fd(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (!fd.is_open()) {
+    fprintf(stderr, "Can't open %s: %s\n", path.c_str(), strerror(errno));
+    return 1;
+  }
+  FlightRecorder::DumpHeader header;
+  if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+      memcmp(header.magic, FlightRecorder::MAGIC, sizeof(header.magic)) ||
+      header.version != FlightRecorder::VERSION ||
+      header.entry_size != sizeof(FlightRecorder::Entry)) {
+    fprintf(stderr, "%s isn't a flight recorder log from this rr\n",
+            path.c_str());
+    return 1;
+  }
+  for (uint64_t i = 0; i < header.num_entries; ++i) {
+    FlightRecorder::Entry e;
+    if (read(fd, &e, sizeof(e)) != sizeof(e)) {
+      fprintf(stderr, "%s is truncated\n", path.c_str());
+      return 1;
+    }
+    print_entry(e, out);
+  }
+  return 0;
+}
+
+int FlightCommand::run(std::vector<std::string>& args) {
+  while (parse_global_option(args)) {
+  }
+
+  if (args.size() != 1) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return print_log(args[0], stdout);
+}
@@ -0,0 +1,116 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "FlightRecorder.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "ScopedFd.h"
+#include "task.h"
+
+using namespace std;
+
+const char FlightRecorder::MAGIC[8] = { 'r', 'r', 'f', 'l', 'i', 'g', 'h', 't' };
+const uint32_t FlightRecorder::VERSION;
+const size_t FlightRecorder::NUM_ENTRIES;
+
+FlightRecorder::Entry FlightRecorder::entries[NUM_ENTRIES];
+atomic<uint64_t> FlightRecorder::next_seq(0);
+
+/**
+ * FNV-1a over the registers that matter most for spotting a divergence.
+ * This is much cheaper than hashing the whole register file, and a
+ * divergence shows up in one of these soon after it happens.
+ */
+static uint64_t hash_regs(const Registers& regs) {
+  uint64_t values[] = { regs.ip().as_int(),  regs.sp().as_int(),
+                        uint64_t(regs.original_syscallno()),
+                        regs.syscall_result(), regs.arg1(), regs.arg2(),
+                        regs.arg3(),           regs.arg4(), regs.arg5(),
+                        regs.arg6() };
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (uint64_t v : values) {
+    for (int i = 0; i < 8; ++i) {
+      hash ^= (v >> (i * 8)) & 0xff;
+      hash *= 0x100000001b3ULL;
+    }
+  }
+  return hash;
+}
+
+void FlightRecorder::record(Type type, Task* t, uint64_t data) {
+  uint64_t seq = next_seq.fetch_add(1, memory_order_relaxed);
+  Entry& e = entries[seq % NUM_ENTRIES];
+  e.seq = seq;
+  e.tid = t->tid;
+  e.type = type;
+  e.time = t->trace_time();
+  e.ticks = t->tick_count();
+  e.data = data;
+  e.regs_hash = hash_regs(t->regs());
+}
+
+void FlightRecorder::dump() {
+  static atomic<bool> dumped(false);
+  if (dumped.exchange(true)) {
+    return;
+  }
+  uint64_t end = next_seq.load(memory_order_relaxed);
+  if (end == 0) {
+    return;
+  }
+  uint64_t start = end > NUM_ENTRIES ? end - NUM_ENTRIES : 0;
+
+  const char* tmp_dir = getenv("TMPDIR");
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path) - 1, "%s/rr-flight-%d",
+           tmp_dir ? tmp_dir : "/tmp", getpid());
+  ScopedFd fd(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (!fd.is_open()) {
+    log_stream() << "Can't write flight recorder log to " << path << ": "
+                 << strerror(errno) << std::endl;
+    return;
+  }
+  DumpHeader header;
+  memcpy(header.magic, MAGIC, sizeof(header.magic));
+  header.version = VERSION;
+  header.entry_size = sizeof(Entry);
+  header.num_entries = end - start;
+  bool ok = write(fd, &header, sizeof(header)) == sizeof(header);
+  // The ring wraps at most once between |start| and |end|.
+  size_t first = start % NUM_ENTRIES;
+  size_t count = end - start;
+  size_t head = min(count, NUM_ENTRIES - first);
+  ok = ok && write(fd, &entries[first], head * sizeof(Entry)) ==
+                 ssize_t(head * sizeof(Entry));
+  ok = ok && write(fd, &entries[0], (count - head) * sizeof(Entry)) ==
+                 ssize_t((count - head) * sizeof(Entry));
+  if (!ok) {
+    log_stream() << "Failed to write flight recorder log to " << path
+                 << std::endl;
+    return;
+  }
+  log_stream() << "Wrote the last " << count
+               << " flight recorder entries to " << path
+               << "; decode them with `rr flight " << path << "`"
+               << std::endl;
+}
+
+const char* FlightRecorder::type_name(uint32_t type) {
+  switch (type) {
+    case RESUME:
+      return "RESUME";
+    case STOP:
+      return "STOP";
+    case RECORD_EVENT:
+      return "RECORD_EVENT";
+    case REPLAY_EVENT:
+      return "REPLAY_EVENT";
+    default:
+      return "???";
+  }
+}
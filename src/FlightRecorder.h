@@ -0,0 +1,80 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_FLIGHT_RECORDER_H_
+#define RR_FLIGHT_RECORDER_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+
+class Task;
+
+/**
+ * An always-on log of the last NUM_ENTRIES things rr did to tracees:
+ * each resume, each stop, and each event recorded or replayed, with the
+ * task's tick count and a hash of its registers. Logging an entry is a
+ * few stores into a fixed ring buffer, so unlike LOG(debug) it can stay
+ * enabled in production.
+ *
+ * FATAL() and ASSERT() dump the ring in binary to
+ * $TMPDIR/rr-flight-<pid>, and `rr flight` decodes the dump. Comparing
+ * the REPLAY_EVENT entries of a failed replay with the RECORD_EVENT
+ * entries of the recording shows where they diverged.
+ */
+class FlightRecorder {
+public:
+  enum Type {
+    // |data| is the ptrace request, with the signal in the high 32 bits.
+    RESUME,
+    // |data| is the wait status.
+    STOP,
+    // |data| is the EncodedEvent.
+    RECORD_EVENT,
+    REPLAY_EVENT
+  };
+
+  struct Entry {
+    uint64_t seq;
+    pid_t tid;
+    uint32_t type;
+    uint64_t time;
+    int64_t ticks;
+    uint64_t data;
+    uint64_t regs_hash;
+  };
+
+  /**
+   * The start of a dump. |num_entries| entries follow, oldest first.
+   */
+  struct DumpHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t num_entries;
+  };
+  static const char MAGIC[8];
+  static const uint32_t VERSION = 1;
+
+  /**
+   * Log that |t| did |type|. |t|'s registers must be known.
+   */
+  static void record(Type type, Task* t, uint64_t data);
+
+  /**
+   * Write the log to $TMPDIR/rr-flight-<pid> and say so on the log
+   * stream. Only the first call does anything, so nested failures don't
+   * overwrite the dump.
+   */
+  static void dump();
+
+  static const char* type_name(uint32_t type);
+
+private:
+  static const size_t NUM_ENTRIES = 4096;
+
+  static Entry entries[NUM_ENTRIES];
+  static std::atomic<uint64_t> next_seq;
+};
+
+#endif /* RR_FLIGHT_RECORDER_H_ */
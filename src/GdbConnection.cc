@@ -22,6 +22,7 @@
 #include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <sstream>
@@ -30,6 +31,7 @@
 #include "log.h"
 #include "ReplaySession.h"
 #include "ScopedFd.h"
+#include "StdioOutput.h"
 #include "StringVectorToCharArray.h"
 
 static const char INTERRUPT_CHAR = '\x03';
@@ -58,9 +60,29 @@ static bool request_needs_immediate_response(const GdbRequest* req) {
   }
 }
 
+/**
+ * The packet size we advertise to gdb. It bounds the size of memory
+ * transfers, so a large value lets gdb read big arrays and stacks in one
+ * round trip.
+ */
+static const size_t PACKET_SIZE = 256 * 1024;
+
+/**
+ * The most thread ids we send in one qfThreadInfo or qsThreadInfo reply.
+ * gdb asks for more until we say the list has ended.
+ */
+static const size_t THREADS_PER_PACKET = 512;
+
 GdbConnection::GdbConnection(pid_t tgid)
-    : tgid(tgid), no_ack(false), inlen(0), outlen(0) {
-  memset(&req, 0, sizeof(req));
+    : tgid(tgid),
+      no_ack(false),
+      listen_port(0),
+      inbuf(32768),
+      inlen(0),
+      outbuf(32768),
+      outlen(0),
+      last_sniff_ms(0) {
+  req = GdbRequest();
 }
 
 static ScopedFd open_socket(const char* address, unsigned short* port,
@@ -121,7 +143,8 @@ struct DebuggerParams {
 
 unique_ptr<GdbConnection> GdbConnection::await_client_connection(
     unsigned short desired_port, ProbePort probe, pid_t tgid,
-    const string& exe_image, ScopedFd* client_params_fd) {
+    const string& exe_image, ScopedFd* client_params_fd,
+    bool keep_listening) {
   auto dbg = unique_ptr<GdbConnection>(new GdbConnection(tgid));
   unsigned short port = desired_port;
   ScopedFd listen_fd = open_socket(connection_addr, &port, probe);
@@ -142,6 +165,23 @@ unique_ptr<GdbConnection> GdbConnection::await_client_connection(
   }
   LOG(debug) << "limiting debugger traffic to tgid " << tgid;
   dbg->await_debugger(listen_fd);
+  if (keep_listening) {
+    dbg->listen_fd = move(listen_fd);
+    dbg->listen_port = port;
+  }
+  return dbg;
+}
+
+unique_ptr<GdbConnection> GdbConnection::await_next_client() {
+  assert(is_listening());
+  sock_fd.close();
+  auto dbg = unique_ptr<GdbConnection>(new GdbConnection(tgid));
+  fprintf(stderr, "Debugger detached; attach the next one with:\n"
+                  "  target remote :%d\n",
+          listen_port);
+  dbg->await_debugger(listen_fd);
+  dbg->listen_fd = move(listen_fd);
+  dbg->listen_port = listen_port;
   return dbg;
 }
 
@@ -247,10 +287,18 @@ static int poll_outgoing(const ScopedFd& sock_fd, int timeoutMs) {
  */
 void GdbConnection::read_data_once() {
   ssize_t nread;
-  /* Wait until there's data, instead of busy-looping on
-   * EAGAIN. */
-  poll_incoming(sock_fd, -1 /* wait forever */);
-  nread = read(sock_fd, inbuf + inlen, sizeof(inbuf) - inlen);
+  if (inbuf.size() - inlen < inbuf.size() / 4) {
+    inbuf.resize(inbuf.size() * 2);
+  }
+  while (true) {
+    nread = read(sock_fd, inbuf.data() + inlen, inbuf.size() - inlen);
+    if (nread >= 0 || errno != EAGAIN) {
+      break;
+    }
+    /* Wait until there's data, instead of busy-looping on
+     * EAGAIN. */
+    poll_incoming(sock_fd, -1 /* wait forever */);
+  }
   if (0 == nread) {
     LOG(info) << "(gdb closed debugging socket, exiting)";
     exit(0);
@@ -259,22 +307,24 @@ void GdbConnection::read_data_once() {
     FATAL() << "Error reading from gdb";
   }
   inlen += nread;
-  assert("Impl dynamic alloc if this fails (or double inbuf size)" &&
-         inlen < int(sizeof(inbuf)));
 }
 
 void GdbConnection::write_flush() {
   ssize_t write_index = 0;
 
 #ifdef DEBUGTAG
-  outbuf[outlen] = '\0';
-  LOG(debug) << "write_flush: '" << outbuf << "'";
+  LOG(debug) << "write_flush: '" << string((char*)outbuf.data(), outlen)
+             << "'";
 #endif
   while (write_index < outlen) {
     ssize_t nwritten;
 
-    poll_outgoing(sock_fd, -1 /*wait forever*/);
-    nwritten = write(sock_fd, outbuf + write_index, outlen - write_index);
+    nwritten =
+        write(sock_fd, outbuf.data() + write_index, outlen - write_index);
+    if (nwritten < 0 && errno == EAGAIN) {
+      poll_outgoing(sock_fd, -1 /*wait forever*/);
+      continue;
+    }
     if (nwritten < 0) {
       FATAL() << "Error writing to gdb";
     }
@@ -284,10 +334,11 @@ void GdbConnection::write_flush() {
 }
 
 void GdbConnection::write_data_raw(const uint8_t* data, ssize_t len) {
-  assert("Impl dynamic alloc if this fails (or double outbuf size)" &&
-         (outlen + len) < int(sizeof(inbuf)));
+  if (outlen + len > ssize_t(outbuf.size())) {
+    outbuf.resize(max<size_t>(outbuf.size() * 2, outlen + len));
+  }
 
-  memcpy(outbuf + outlen, data, len);
+  memcpy(outbuf.data() + outlen, data, len);
   outlen += len;
 }
 
@@ -319,17 +370,17 @@ void GdbConnection::write_packet(const char* data) {
 void GdbConnection::write_binary_packet(const char* pfx, const uint8_t* data,
                                         ssize_t num_bytes) {
   ssize_t pfx_num_chars = strlen(pfx);
-  uint8_t buf[2 * num_bytes + pfx_num_chars];
+  vector<uint8_t> buf(2 * num_bytes + pfx_num_chars);
   ssize_t buf_num_bytes = 0;
   int i;
 
-  strncpy((char*)buf, pfx, sizeof(buf) - 1);
+  memcpy(buf.data(), pfx, pfx_num_chars);
   buf_num_bytes += pfx_num_chars;
 
   for (i = 0; i < num_bytes; ++i) {
     uint8_t b = data[i];
 
-    if (buf_num_bytes + 2 > ssize_t(sizeof(buf))) {
+    if (buf_num_bytes + 2 > ssize_t(buf.size())) {
       break;
     }
     switch (b) {
@@ -348,7 +399,7 @@ void GdbConnection::write_binary_packet(const char* pfx, const uint8_t* data,
 
   LOG(debug) << " ***** NOTE: writing binary data, upcoming debug output may "
                 "be truncated";
-  return write_packet_bytes(buf, buf_num_bytes);
+  return write_packet_bytes(buf.data(), buf_num_bytes);
 }
 
 void GdbConnection::write_hex_bytes_packet(const uint8_t* bytes, size_t len) {
@@ -357,12 +408,13 @@ void GdbConnection::write_hex_bytes_packet(const uint8_t* bytes, size_t len) {
     return;
   }
 
-  char buf[2 * len + 1];
+  static const char hex_chars[] = "0123456789abcdef";
+  vector<uint8_t> buf(2 * len);
   for (size_t i = 0; i < len; ++i) {
-    unsigned long b = bytes[i];
-    snprintf(&buf[2 * i], 3, "%02lx", b);
+    buf[2 * i] = hex_chars[bytes[i] >> 4];
+    buf[2 * i + 1] = hex_chars[bytes[i] & 0xf];
   }
-  write_packet(buf);
+  write_packet_bytes(buf.data(), buf.size());
 }
 
 static string decode_ascii_encoded_hex_str(const char* encoded) {
@@ -372,8 +424,8 @@ static string decode_ascii_encoded_hex_str(const char* encoded) {
   for (int i = 0; i < enc_len / 2; ++i) {
     char enc_byte[] = { encoded[2 * i], encoded[2 * i + 1], '\0' };
     char* endp;
+    // File names aren't necessarily ASCII.
     int c = strtol(enc_byte, &endp, 16);
-    assert(c < 128);
     str += static_cast<char>(c);
   }
   return str;
@@ -398,20 +450,37 @@ bool GdbConnection::skip_to_packet_start() {
     return false;
   }
   /* Discard bytes up to start-of-packet. */
-  memmove(inbuf, p, inlen - (p - inbuf));
-  inlen -= (p - inbuf);
+  memmove(inbuf.data(), p, inlen - (p - inbuf.data()));
+  inlen -= (p - inbuf.data());
 
   assert(1 <= inlen);
   assert('$' == inbuf[0] || INTERRUPT_CHAR == inbuf[0]);
   return true;
 }
 
+static const int64_t SNIFF_INTERVAL_MS = 10;
+
+static int64_t monotonic_coarse_now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return int64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
 bool GdbConnection::sniff_packet() {
   if (skip_to_packet_start()) {
     /* We've already seen a (possibly partial) packet. */
     return true;
   }
   assert(0 == inlen);
+  /* This is called between every pair of replay steps while gdb has us
+   * running, and the only thing gdb can send then is an interrupt. The
+   * coarse clock is read from the vdso, so checking it is much cheaper
+   * than a poll() syscall per step. */
+  int64_t now = monotonic_coarse_now_ms();
+  if (now - last_sniff_ms < SNIFF_INTERVAL_MS) {
+    return false;
+  }
+  last_sniff_ms = now;
   return poll_incoming(sock_fd, 0 /*don't wait*/);
 }
 
@@ -440,11 +509,12 @@ void GdbConnection::read_packet() {
   }
 
   /* Read until we see end-of-packet. */
-  for (checkedlen = 0; !(p = (uint8_t*)memchr(inbuf + checkedlen, '#', inlen));
+  for (checkedlen = 0; !(p = (uint8_t*)memchr(inbuf.data() + checkedlen, '#',
+                                               inlen - checkedlen));
        checkedlen = inlen) {
     read_data_once();
   }
-  packetend = (p - inbuf);
+  packetend = (p - inbuf.data());
   /* NB: we're ignoring the gdb packet checksums here too.  If
    * gdb is corrupted enough to garble a checksum over TCP, it's
    * not really clear why asking for the packet again might make
@@ -470,6 +540,25 @@ static void read_binary_data(const uint8_t* payload, ssize_t data_len,
   }
 }
 
+/**
+ * Parse an agent expression "<len>,<hex bytecode>" at *|payload|, and
+ * advance *|payload| past it.
+ */
+static vector<uint8_t> parse_bytecode(char** payload) {
+  size_t len = strtoul(*payload, payload, 16);
+  assert(',' == **payload);
+  ++*payload;
+  vector<uint8_t> bytecode;
+  char* p = *payload;
+  for (size_t i = 0; i < len && p[0] && p[1]; ++i) {
+    char hex[3] = { p[0], p[1], '\0' };
+    bytecode.push_back(strtoul(hex, nullptr, 16));
+    p += 2;
+  }
+  *payload = p;
+  return bytecode;
+}
+
 /**
  * Parse and return a gdb thread-id from |str|.  |endptr| points to
  * the character just after the last character in the thread-id.  It
@@ -530,6 +619,17 @@ bool GdbConnection::xfer(const char* name, char* args) {
     UNHANDLED_REQ() << "Unhandled 'siginfo' request: " << args;
     return false;
   }
+  if (!strcmp(name, "libraries-svr4")) {
+    assert(!strncmp(args, "read::", sizeof("read::") - 1));
+    args += sizeof("read::") - 1;
+
+    req.type = DREQ_GET_LIBRARIES_SVR4;
+    req.target = query_thread;
+    req.mem.addr = strtoul(args, &args, 16);
+    assert(',' == *args++);
+    req.mem.len = strtoul(args, &args, 16);
+    return true;
+  }
 
   UNHANDLED_REQ() << "Unhandled gdb xfer request: " << name << "(" << args
                   << ")";
@@ -615,9 +715,14 @@ bool GdbConnection::query(char* payload) {
     return true;
   }
   if (!strcmp(name, "sThreadInfo")) {
-    write_packet("l"); /* "end of list" */
+    write_thread_list_part();
     return false;
   }
+  if (!strcmp(name, "RRThreadsPcSp")) {
+    LOG(debug) << "gdb asks for the pc and sp of all threads";
+    req.type = DREQ_GET_THREADS_PC_SP;
+    return true;
+  }
   if (!strcmp(name, "GetTLSAddr")) {
     LOG(debug) << "gdb asks for TLS addr";
     /* TODO */
@@ -642,13 +747,14 @@ bool GdbConnection::query(char* payload) {
     LOG(debug) << "gdb supports " << args;
 
     snprintf(supported, sizeof(supported) - 1,
-             "PacketSize=%zd;QStartNoAckMode+;qXfer:auxv:read+"
+             "PacketSize=%zx;QStartNoAckMode+;qXfer:auxv:read+"
              ";qXfer:siginfo:read+;qXfer:siginfo:write+"
 #ifdef REVERSE_EXECUTION
              ";ReverseContinue+;ReverseStep+"
 #endif
-             ";multiprocess+",
-             sizeof(outbuf));
+             ";multiprocess+;binary-upload+;ConditionalBreakpoints+"
+             ";BreakpointCommands+;qXfer:libraries-svr4:read+;qRRThreadsPcSp+",
+             PACKET_SIZE);
     write_packet(supported);
     return false;
   }
@@ -712,7 +818,7 @@ bool GdbConnection::set_var(char* payload) {
 }
 
 void GdbConnection::consume_request() {
-  memset(&req, 0, sizeof(req));
+  req = GdbRequest();
   write_flush();
 }
 
@@ -848,14 +954,61 @@ bool GdbConnection::process_vpacket(char* payload) {
   }
 
   if (name == strstr(name, "File:")) {
-    write_packet("");
-    return false;
+    return process_vfile(payload + strlen("File:"));
   }
 
   UNHANDLED_REQ() << "Unhandled gdb vpacket: v" << name;
   return false;
 }
 
+bool GdbConnection::process_vfile(char* payload) {
+  char* args = strchr(payload, ':');
+  if (args) {
+    *args++ = '\0';
+  }
+  const char* name = payload;
+
+  if (!strcmp(name, "setfs")) {
+    // We only ever serve files from the target's view of the filesystem.
+    write_vfile_reply(0, 0);
+    return false;
+  }
+  if (!strcmp(name, "open")) {
+    char* comma = strchr(args, ',');
+    assert(comma);
+    *comma = '\0';
+    req.type = DREQ_FILE_OPEN;
+    req.file_name = decode_ascii_encoded_hex_str(args);
+    req.file.flags = strtol(comma + 1, &args, 16);
+    // The mode follows, but we never create files.
+    return true;
+  }
+  if (!strcmp(name, "pread")) {
+    req.type = DREQ_FILE_PREAD;
+    req.file.fd = strtol(args, &args, 16);
+    assert(',' == *args++);
+    req.file.len = strtoul(args, &args, 16);
+    assert(',' == *args++);
+    req.file.offset = strtoull(args, &args, 16);
+    return true;
+  }
+  if (!strcmp(name, "fstat")) {
+    req.type = DREQ_FILE_FSTAT;
+    req.file.fd = strtol(args, &args, 16);
+    return true;
+  }
+  if (!strcmp(name, "close")) {
+    req.type = DREQ_FILE_CLOSE;
+    req.file.fd = strtol(args, &args, 16);
+    return true;
+  }
+
+  // gdb falls back to reading files itself when we don't support
+  // something.
+  UNHANDLED_REQ() << "Unhandled gdb vFile request: vFile:" << name;
+  return false;
+}
+
 bool GdbConnection::process_packet() {
   char request;
   char* payload = nullptr;
@@ -863,7 +1016,8 @@ bool GdbConnection::process_packet() {
 
   assert(INTERRUPT_CHAR == inbuf[0] ||
          ('$' == inbuf[0] &&
-          (((uint8_t*)memchr(inbuf, '#', inlen) - inbuf) == packetend)));
+          (((uint8_t*)memchr(inbuf.data(), '#', inlen) - inbuf.data()) ==
+           packetend)));
 
   if (INTERRUPT_CHAR == inbuf[0]) {
     request = INTERRUPT_CHAR;
@@ -931,6 +1085,20 @@ bool GdbConnection::process_packet() {
       LOG(debug) << "gdb requests memory (addr=" << HEX(req.mem.addr)
                  << ", len=" << req.mem.len << ")";
 
+      ret = true;
+      break;
+    case 'x':
+      req.type = DREQ_GET_MEM;
+      req.target = query_thread;
+      req.mem.addr = strtoul(payload, &payload, 16);
+      ++payload;
+      req.mem.len = strtoul(payload, &payload, 16);
+      req.mem.binary = true;
+      assert('\0' == *payload);
+
+      LOG(debug) << "gdb requests binary memory (addr=" << HEX(req.mem.addr)
+                 << ", len=" << req.mem.len << ")";
+
       ret = true;
       break;
     case 'M':
@@ -1013,6 +1181,23 @@ bool GdbConnection::process_packet() {
       req.mem.addr = strtoul(payload, &payload, 16);
       assert(',' == *payload++);
       req.mem.len = strtoul(payload, &payload, 16);
+      // Conditions come as ";X<len>,<hex bytecode>" items, followed by
+      // the commands as ";cmds:<persist>,X<len>,<hex bytecode>X...".
+      while (';' == *payload && 'X' == payload[1]) {
+        payload += 2;
+        req.breakpoint_conditions.push_back(parse_bytecode(&payload));
+      }
+      if (!strncmp(payload, ";cmds:", 6)) {
+        payload += 6;
+        // We don't keep breakpoints after gdb disconnects, so
+        // persistence doesn't matter.
+        strtoul(payload, &payload, 16);
+        assert(',' == *payload++);
+        while ('X' == *payload) {
+          ++payload;
+          req.breakpoint_commands.push_back(parse_bytecode(&payload));
+        }
+      }
       assert('\0' == *payload);
 
       LOG(debug) << "gdb requests " << ('Z' == request ? "set" : "remove")
@@ -1038,7 +1223,7 @@ bool GdbConnection::process_packet() {
       ret = false;
   }
   /* Erase the newly processed packet from the input buffer. */
-  memmove(inbuf, inbuf + packetend, inlen - packetend);
+  memmove(inbuf.data(), inbuf.data() + packetend, inlen - packetend);
   inlen = (inlen - packetend);
 
   /* If we processed the request internally, consume it. */
@@ -1074,7 +1259,7 @@ void GdbConnection::notify_restart() {
   resume_thread = GdbThreadId::ANY;
   query_thread = GdbThreadId::ANY;
 
-  memset(&req, 0, sizeof(req));
+  req = GdbRequest();
 }
 
 GdbRequest GdbConnection::get_request() {
@@ -1123,6 +1308,7 @@ void GdbConnection::notify_exit_code(int code) {
 
   assert(req.is_resume_request() || req.type == DREQ_INTERRUPT);
 
+  StdioOutput::get().flush();
   snprintf(buf, sizeof(buf) - 1, "W%02x", code);
   write_packet(buf);
 
@@ -1134,6 +1320,7 @@ void GdbConnection::notify_exit_signal(int sig) {
 
   assert(req.is_resume_request() || req.type == DREQ_INTERRUPT);
 
+  StdioOutput::get().flush();
   snprintf(buf, sizeof(buf) - 1, "X%02x", sig);
   write_packet(buf);
 
@@ -1223,8 +1410,9 @@ static int to_gdb_signum(int sig) {
   }
 }
 
-void GdbConnection::send_stop_reply_packet(GdbThreadId thread, int sig,
-                                           uintptr_t watch_addr) {
+void GdbConnection::send_stop_reply_packet(
+    GdbThreadId thread, int sig, uintptr_t watch_addr,
+    const vector<GdbRegisterValue>& expedited_regs) {
   if (sig < 0) {
     write_packet("E01");
     return;
@@ -1238,11 +1426,25 @@ void GdbConnection::send_stop_reply_packet(GdbThreadId thread, int sig,
   char buf[PATH_MAX];
   snprintf(buf, sizeof(buf) - 1, "T%02xthread:p%02x.%02x;%s",
            to_gdb_signum(sig), thread.pid, thread.tid, watch);
-  write_packet(buf);
+  string reply = buf;
+  for (auto& reg : expedited_regs) {
+    if (!reg.defined) {
+      continue;
+    }
+    snprintf(buf, sizeof(buf) - 1, "%02x:", reg.name);
+    reply += buf;
+    for (size_t i = 0; i < reg.size; ++i) {
+      snprintf(buf, sizeof(buf) - 1, "%02x", reg.value[i]);
+      reply += buf;
+    }
+    reply += ';';
+  }
+  write_packet(reply.c_str());
 }
 
-void GdbConnection::notify_stop(GdbThreadId thread, int sig,
-                                uintptr_t watch_addr) {
+void GdbConnection::notify_stop(
+    GdbThreadId thread, int sig, uintptr_t watch_addr,
+    const vector<GdbRegisterValue>& expedited_regs) {
   assert(req.is_resume_request() || req.type == DREQ_INTERRUPT);
 
   if (tgid != thread.pid) {
@@ -1252,7 +1454,9 @@ void GdbConnection::notify_stop(GdbThreadId thread, int sig,
     // the next stop we're willing to tell gdb about.
     return;
   }
-  send_stop_reply_packet(thread, sig, watch_addr);
+  // Let the user see the tracee's output up to where it stopped.
+  StdioOutput::get().flush();
+  send_stop_reply_packet(thread, sig, watch_addr, expedited_regs);
 
   // This isn't documented in the gdb remote protocol, but if we
   // don't do this, gdb will sometimes continue to send requests
@@ -1337,6 +1541,8 @@ void GdbConnection::reply_get_mem(const vector<uint8_t>& mem) {
 
   if (req.mem.len > 0 && mem.size() == 0) {
     write_packet("E01");
+  } else if (req.mem.binary) {
+    write_binary_packet("b", mem.data(), mem.size());
   } else {
     write_hex_bytes_packet(mem.data(), mem.size());
   }
@@ -1404,10 +1610,12 @@ void GdbConnection::reply_set_reg(bool ok) {
   consume_request();
 }
 
-void GdbConnection::reply_get_stop_reason(GdbThreadId which, int sig) {
+void GdbConnection::reply_get_stop_reason(
+    GdbThreadId which, int sig,
+    const vector<GdbRegisterValue>& expedited_regs) {
   assert(DREQ_GET_STOP_REASON == req.type);
 
-  send_stop_reply_packet(which, sig);
+  send_stop_reply_packet(which, sig, 0, expedited_regs);
 
   consume_request();
 }
@@ -1415,32 +1623,54 @@ void GdbConnection::reply_get_stop_reason(GdbThreadId which, int sig) {
 void GdbConnection::reply_get_thread_list(const vector<GdbThreadId>& threads) {
   assert(DREQ_GET_THREAD_LIST == req.type);
 
-  if (threads.empty()) {
-    write_packet("l");
-  } else {
-    ssize_t maxlen =
-        1 /*m char*/ +
-        threads.size() * (1 /*p*/ + 2 * sizeof(threads[0]) + 1 /*,*/) +
-        1 /*\0*/;
-    char* str = (char*)malloc(maxlen);
-    int offset = 0;
-
-    str[offset++] = 'm';
-    for (size_t i = 0; i < threads.size(); ++i) {
-      const GdbThreadId& t = threads[i];
-      if (tgid != t.pid) {
-        continue;
-      }
-      offset +=
-          snprintf(&str[offset], maxlen - offset, "p%02x.%02x,", t.pid, t.tid);
+  pending_thread_list.clear();
+  // Send the first ids last, so write_thread_list_part() can pop them off
+  // the end.
+  for (auto it = threads.rbegin(); it != threads.rend(); ++it) {
+    if (tgid == it->pid) {
+      pending_thread_list.push_back(*it);
     }
-    /* Overwrite the trailing ',' */
-    str[offset - 1] = '\0';
+  }
+  write_thread_list_part();
 
-    write_packet(str);
-    free(str);
+  consume_request();
+}
+
+void GdbConnection::write_thread_list_part() {
+  if (pending_thread_list.empty()) {
+    write_packet("l"); /* "end of list" */
+    return;
   }
 
+  string list = "m";
+  for (size_t i = 0;
+       i < THREADS_PER_PACKET && !pending_thread_list.empty(); ++i) {
+    const GdbThreadId& t = pending_thread_list.back();
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%sp%02x.%02x", i ? "," : "", t.pid, t.tid);
+    list += buf;
+    pending_thread_list.pop_back();
+  }
+  write_packet(list.c_str());
+}
+
+void GdbConnection::reply_get_threads_pc_sp(
+    const vector<GdbThreadPcSp>& threads) {
+  assert(DREQ_GET_THREADS_PC_SP == req.type);
+
+  string reply;
+  for (auto& t : threads) {
+    if (tgid != t.thread.pid) {
+      continue;
+    }
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%sp%02x.%02x:%" PRIx64 ",%" PRIx64,
+             reply.empty() ? "" : ";", t.thread.pid, t.thread.tid,
+             uint64_t(t.pc), uint64_t(t.sp));
+    reply += buf;
+  }
+  write_packet(reply.c_str());
+
   consume_request();
 }
 
@@ -1479,3 +1709,129 @@ void GdbConnection::reply_write_siginfo(/* TODO*/) {
 
   consume_request();
 }
+
+void GdbConnection::reply_get_libraries_svr4(const string& xml) {
+  assert(DREQ_GET_LIBRARIES_SVR4 == req.type);
+
+  size_t offset = min<size_t>(req.mem.addr, xml.size());
+  size_t len = min(req.mem.len, xml.size() - offset);
+  // 'm' means there's more to read after this, 'l' that this is the last
+  // part.
+  write_binary_packet(offset + len < xml.size() ? "m" : "l",
+                      (const uint8_t*)xml.data() + offset, len);
+
+  consume_request();
+}
+
+/**
+ * Translate |err| to the errno values of gdb's File-I/O protocol.
+ */
+static int to_fileio_errno(int err) {
+  switch (err) {
+    case EPERM:
+    case ENOENT:
+    case EINTR:
+    case EBADF:
+    case EACCES:
+    case EFAULT:
+    case EBUSY:
+    case EEXIST:
+    case ENODEV:
+    case ENOTDIR:
+    case EISDIR:
+    case EINVAL:
+    case ENFILE:
+    case EMFILE:
+    case EFBIG:
+    case ENOSPC:
+    case ESPIPE:
+    case EROFS:
+      // These have the same values on Linux.
+      return err;
+    case ENAMETOOLONG:
+      return 91;
+    default:
+      // EUNKNOWN
+      return 9999;
+  }
+}
+
+void GdbConnection::write_vfile_reply(int64_t result, int err,
+                                      const uint8_t* data, size_t num_bytes) {
+  char buf[64];
+  if (err) {
+    snprintf(buf, sizeof(buf), "F-1,%x", to_fileio_errno(err));
+    write_packet(buf);
+    return;
+  }
+  if (result < 0) {
+    snprintf(buf, sizeof(buf), "F-%" PRIx64, uint64_t(-result));
+  } else {
+    snprintf(buf, sizeof(buf), "F%" PRIx64, uint64_t(result));
+  }
+  if (!data) {
+    write_packet(buf);
+    return;
+  }
+  strcat(buf, ";");
+  write_binary_packet(buf, data, num_bytes);
+}
+
+void GdbConnection::reply_open_file(int fd, int err) {
+  assert(DREQ_FILE_OPEN == req.type);
+
+  write_vfile_reply(fd, err);
+
+  consume_request();
+}
+
+void GdbConnection::reply_pread_file(const uint8_t* data, size_t len,
+                                     int err) {
+  assert(DREQ_FILE_PREAD == req.type);
+
+  // Even an empty read has to send its (empty) data.
+  static const uint8_t empty = 0;
+  write_vfile_reply(len, err, data ? data : &empty, len);
+
+  consume_request();
+}
+
+/**
+ * Store |v| big-endian, as gdb's File-I/O structures are.
+ */
+template <typename T> static void put_fileio_field(uint8_t* dest, T v) {
+  for (size_t i = 0; i < sizeof(T); ++i) {
+    dest[i] = uint8_t(uint64_t(v) >> (8 * (sizeof(T) - 1 - i)));
+  }
+}
+
+void GdbConnection::reply_fstat_file(const struct stat& st, int err) {
+  assert(DREQ_FILE_FSTAT == req.type);
+
+  // gdb's struct fio_stat.
+  uint8_t buf[64];
+  put_fileio_field<uint32_t>(buf, st.st_dev);
+  put_fileio_field<uint32_t>(buf + 4, st.st_ino);
+  put_fileio_field<uint32_t>(buf + 8, st.st_mode);
+  put_fileio_field<uint32_t>(buf + 12, st.st_nlink);
+  put_fileio_field<uint32_t>(buf + 16, st.st_uid);
+  put_fileio_field<uint32_t>(buf + 20, st.st_gid);
+  put_fileio_field<uint32_t>(buf + 24, st.st_rdev);
+  put_fileio_field<uint64_t>(buf + 28, st.st_size);
+  put_fileio_field<uint64_t>(buf + 36, st.st_blksize);
+  put_fileio_field<uint64_t>(buf + 44, st.st_blocks);
+  put_fileio_field<uint32_t>(buf + 52, st.st_atime);
+  put_fileio_field<uint32_t>(buf + 56, st.st_mtime);
+  put_fileio_field<uint32_t>(buf + 60, st.st_ctime);
+  write_vfile_reply(sizeof(buf), err, buf, sizeof(buf));
+
+  consume_request();
+}
+
+void GdbConnection::reply_close_file(int err) {
+  assert(DREQ_FILE_CLOSE == req.type);
+
+  write_vfile_reply(0, err);
+
+  consume_request();
+}
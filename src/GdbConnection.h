@@ -4,10 +4,12 @@
 #define RR_GDB_CONNECTION_H_
 
 #include <stddef.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 
 #include <memory>
 #include <ostream>
+#include <string>
 #include <vector>
 
 #include "GdbRegister.h"
@@ -72,6 +74,9 @@ enum GdbRequestType {
   DREQ_GET_REGS,
   DREQ_GET_STOP_REASON,
   DREQ_GET_THREAD_LIST,
+  // rr's qRRThreadsPcSp extension: the pc and sp of every thread in one
+  // reply, for front-ends that show all threads at each stop.
+  DREQ_GET_THREADS_PC_SP,
 
   /* These use params.target. */
   DREQ_GET_AUXV,
@@ -124,6 +129,20 @@ enum GdbRequestType {
   //
   // TODO: actual interface NYI.
   DREQ_WRITE_SIGINFO,
+
+  // gdb wants the list of shared libraries loaded in the target, as
+  // qXfer:libraries-svr4 XML.
+  //
+  // Uses .mem for offset/len.
+  DREQ_GET_LIBRARIES_SVR4,
+
+  // Host I/O (vFile) requests, for gdb to read the target's exe and
+  // libraries through the connection. They use params.file, and open
+  // uses file_name.
+  DREQ_FILE_OPEN,
+  DREQ_FILE_PREAD,
+  DREQ_FILE_FSTAT,
+  DREQ_FILE_CLOSE,
 };
 
 enum GdbRestartType {
@@ -137,6 +156,12 @@ enum GdbRestartType {
  * by rr, the target.
  */
 struct GdbRequest {
+  GdbRequest(GdbRequestType type = DREQ_NONE)
+      : type(type), target(), suppress_debugger_stop(false) {
+    memset(&mem, 0, sizeof(mem));
+    memset(&reg, 0, sizeof(reg));
+  }
+
   GdbRequestType type;
   GdbThreadId target;
   bool suppress_debugger_stop;
@@ -147,6 +172,9 @@ struct GdbRequest {
       // For SET_MEM requests, the stream of |len|
       // number of raw bytes that are to be written.
       const uint8_t* data;
+      // For GET_MEM requests, true if gdb asked for the memory as
+      // binary data ('x') rather than hex ('m').
+      bool binary;
     } mem;
 
     GdbRegisterValue reg;
@@ -157,8 +185,29 @@ struct GdbRequest {
     } restart;
 
     RunDirection run_direction;
+
+    struct {
+      // The descriptor gdb got from an earlier DREQ_FILE_OPEN.
+      int fd;
+      // gdb's File-I/O open flags; rr only opens files for reading.
+      int flags;
+      size_t len;
+      uint64_t offset;
+    } file;
   };
 
+  // For DREQ_FILE_OPEN requests, the path in the target.
+  std::string file_name;
+
+  // For SET_SW_BREAK requests, the agent expression bytecode of each
+  // condition gdb attached to the breakpoint. The breakpoint only needs
+  // to stop when one of them is true (or can't be evaluated).
+  std::vector<std::vector<uint8_t> > breakpoint_conditions;
+  // For SET_SW_BREAK requests, the agent expression bytecode of the
+  // commands gdb wants run at each hit instead of stopping (dprintf with
+  // dprintf-style agent).
+  std::vector<std::vector<uint8_t> > breakpoint_commands;
+
   /**
    * Return nonzero if this requires that program execution be resumed
    * in some way.
@@ -168,6 +217,15 @@ struct GdbRequest {
   }
 };
 
+/**
+ * The pc and sp of a thread, for DREQ_GET_THREADS_PC_SP replies.
+ */
+struct GdbThreadPcSp {
+  GdbThreadId thread;
+  uintptr_t pc;
+  uintptr_t sp;
+};
+
 /**
  * An item in a process's auxiliary vector, for example { AT_SYSINFO,
  * 0xb7fff414 }.
@@ -200,6 +258,9 @@ public:
    * process that will be debugged by client, or null ptr if there isn't
    * a client.
    *
+   * If |keep_listening| is true, the listening socket stays open after
+   * the client connects, so await_next_client() can accept another one.
+   *
    * This function is infallible: either it will return a valid
    * debugging context, or it won't return.
    */
@@ -209,7 +270,20 @@ public:
   };
   static std::unique_ptr<GdbConnection> await_client_connection(
       unsigned short desired_port, ProbePort probe, pid_t tgid,
-      const std::string& exe_image, ScopedFd* client_params_fd = nullptr);
+      const std::string& exe_image, ScopedFd* client_params_fd = nullptr,
+      bool keep_listening = false);
+
+  /**
+   * Return true if this connection was created with |keep_listening|.
+   */
+  bool is_listening() { return listen_fd.is_open(); }
+  /**
+   * Close this connection and block until the next debugger client
+   * connects to the same port, returning a fresh connection to it. The
+   * listening socket moves to the new connection. Only valid when
+   * is_listening().
+   */
+  std::unique_ptr<GdbConnection> await_next_client();
 
   /**
    * Exec gdb using the params that were written to
@@ -259,8 +333,12 @@ public:
    * Notify the host that a resume request has "finished", i.e., the
    * target has stopped executing for some reason.  |sig| is the signal
    * that stopped execution, or 0 if execution stopped otherwise.
+   * The values in |expedited_regs| are sent along with the stop, so gdb
+   * doesn't have to ask for them.
    */
-  void notify_stop(GdbThreadId which, int sig, uintptr_t watch_addr = 0);
+  void notify_stop(GdbThreadId which, int sig, uintptr_t watch_addr = 0,
+                   const std::vector<GdbRegisterValue>& expedited_regs =
+                       std::vector<GdbRegisterValue>());
 
   /** Notify the debugger that a restart request failed. */
   void notify_restart_failed();
@@ -329,7 +407,9 @@ public:
   /**
    * Reply to the DREQ_GET_STOP_REASON request.
    */
-  void reply_get_stop_reason(GdbThreadId which, int sig);
+  void reply_get_stop_reason(GdbThreadId which, int sig,
+                             const std::vector<GdbRegisterValue>&
+                                 expedited_regs);
 
   /**
    * |threads| contains the list of live threads, of which there are
@@ -337,6 +417,11 @@ public:
    */
   void reply_get_thread_list(const std::vector<GdbThreadId>& threads);
 
+  /**
+   * Reply to DREQ_GET_THREADS_PC_SP with each thread's pc and sp.
+   */
+  void reply_get_threads_pc_sp(const std::vector<GdbThreadPcSp>& threads);
+
   /**
    * |ok| is true if the request was successfully applied, false if
    * not.
@@ -364,6 +449,31 @@ public:
    */
   void reply_write_siginfo(/* TODO*/);
 
+  /**
+   * Send the part of |xml| that a DREQ_GET_LIBRARIES_SVR4 request asked
+   * for.
+   */
+  void reply_get_libraries_svr4(const std::string& xml);
+
+  /**
+   * Reply to DREQ_FILE_OPEN with the descriptor of the opened file, or -1
+   * and the errno of the failure.
+   */
+  void reply_open_file(int fd, int err = 0);
+  /**
+   * Reply to DREQ_FILE_PREAD with the bytes read, which may be fewer
+   * than requested (none at end of file), or with |err| if it's nonzero.
+   */
+  void reply_pread_file(const uint8_t* data, size_t len, int err = 0);
+  /**
+   * Reply to DREQ_FILE_FSTAT with |st|, or with |err| if it's nonzero.
+   */
+  void reply_fstat_file(const struct stat& st, int err = 0);
+  /**
+   * Reply to DREQ_FILE_CLOSE with |err|, zero on success.
+   */
+  void reply_close_file(int err = 0);
+
   /**
    * Create a checkpoint of the given Session with the given id. Delete the
    * existing checkpoint with that id if there is one.
@@ -414,7 +524,9 @@ private:
   bool skip_to_packet_start();
   /**
    * Return true if there's a new packet to be read/process (whether
-   * incomplete or not), and false if there isn't one.
+   * incomplete or not), and false if there isn't one. While gdb has us
+   * running, the socket is only polled every SNIFF_INTERVAL_MS, so a
+   * pending interrupt may be noticed that much later.
    */
   bool sniff_packet();
   /**
@@ -446,6 +558,18 @@ private:
    * false if we already handled the packet internally.
    */
   bool process_vpacket(char* payload);
+  /**
+   * Return true if we need to do something in a debugger request,
+   * false if we already handled the packet internally.
+   */
+  bool process_vfile(char* payload);
+  /**
+   * Send gdb's File-I/O reply to a vFile request: |result|, or -1 and
+   * |err| translated to a File-I/O errno if |err| is nonzero, followed by
+   * |num_bytes| bytes of binary |data|.
+   */
+  void write_vfile_reply(int64_t result, int err,
+                         const uint8_t* data = nullptr, size_t num_bytes = 0);
   /**
    * Return true if we need to do something in a debugger request,
    * false if we already handled the packet internally.
@@ -457,8 +581,13 @@ private:
    */
   bool process_packet();
   void consume_request();
-  void send_stop_reply_packet(GdbThreadId thread, int sig,
-                              uintptr_t watch_addr = 0);
+  /**
+   * Send the next part of |pending_thread_list|, or the end of the list.
+   */
+  void write_thread_list_part();
+  void send_stop_reply_packet(
+      GdbThreadId thread, int sig, uintptr_t watch_addr,
+      const std::vector<GdbRegisterValue>& expedited_regs);
 
   // Current request to be processed.
   GdbRequest req;
@@ -466,6 +595,9 @@ private:
   GdbThreadId resume_thread;
   // Thread for get/set requests.
   GdbThreadId query_thread;
+  // Threads of the last DREQ_GET_THREAD_LIST reply that gdb hasn't been
+  // sent yet, last to be sent first.
+  std::vector<GdbThreadId> pending_thread_list;
   // gdb and rr don't work well together in multi-process and
   // multi-exe-image debugging scenarios, so we pretend only
   // this task group exists when interfacing with gdb
@@ -474,12 +606,18 @@ private:
   // to send ack packets back to gdb.  This is a huge perf win.
   bool no_ack;
   ScopedFd sock_fd;
-  /* XXX probably need to dynamically size these */
-  uint8_t inbuf[32768];  /* buffered input from gdb */
-  ssize_t inlen;         /* length of valid data */
-  ssize_t packetend;     /* index of '#' character */
-  uint8_t outbuf[32768]; /* buffered output for gdb */
+  // Open when we accept more clients after this one goes away.
+  ScopedFd listen_fd;
+  unsigned short listen_port;
+  /* These grow as needed to hold packets up to (and beyond)
+   * PACKET_SIZE. */
+  std::vector<uint8_t> inbuf; /* buffered input from gdb */
+  ssize_t inlen;              /* length of valid data */
+  ssize_t packetend;          /* index of '#' character */
+  std::vector<uint8_t> outbuf; /* buffered output for gdb */
   ssize_t outlen;
+  /* CLOCK_MONOTONIC_COARSE time of the last poll in sniff_packet(). */
+  int64_t last_sniff_ms;
 };
 
 #endif /* RR_GDB_CONNECTION_H_ */
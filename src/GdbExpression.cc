@@ -0,0 +1,504 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "GdbExpression"
+
+#include "GdbExpression.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "GdbConnection.h"
+#include "log.h"
+#include "task.h"
+
+using namespace rr;
+using namespace std;
+
+GdbExpression::GdbExpression(const uint8_t* data, size_t size)
+    : bytecode(data, data + size) {}
+
+/**
+ * Agent expression bytecodes, as listed in gdb's ax.def.
+ */
+enum Opcode {
+  OP_ADD = 0x02,
+  OP_SUB = 0x03,
+  OP_MUL = 0x04,
+  OP_DIV_SIGNED = 0x05,
+  OP_DIV_UNSIGNED = 0x06,
+  OP_REM_SIGNED = 0x07,
+  OP_REM_UNSIGNED = 0x08,
+  OP_LSH = 0x09,
+  OP_RSH_SIGNED = 0x0a,
+  OP_RSH_UNSIGNED = 0x0b,
+  OP_LOG_NOT = 0x0e,
+  OP_BIT_AND = 0x0f,
+  OP_BIT_OR = 0x10,
+  OP_BIT_XOR = 0x11,
+  OP_BIT_NOT = 0x12,
+  OP_EQUAL = 0x13,
+  OP_LESS_SIGNED = 0x14,
+  OP_LESS_UNSIGNED = 0x15,
+  OP_EXT = 0x16,
+  OP_REF8 = 0x17,
+  OP_REF16 = 0x18,
+  OP_REF32 = 0x19,
+  OP_REF64 = 0x1a,
+  OP_IF_GOTO = 0x20,
+  OP_GOTO = 0x21,
+  OP_CONST8 = 0x22,
+  OP_CONST16 = 0x23,
+  OP_CONST32 = 0x24,
+  OP_CONST64 = 0x25,
+  OP_REG = 0x26,
+  OP_END = 0x27,
+  OP_DUP = 0x28,
+  OP_POP = 0x29,
+  OP_ZERO_EXT = 0x2a,
+  OP_SWAP = 0x2b,
+  OP_PICK = 0x32,
+  OP_ROT = 0x33,
+  OP_PRINTF = 0x34,
+};
+
+/**
+ * Bounds on the work a single evaluation may do, so a bogus condition
+ * can't hang or exhaust the replay.
+ */
+static const size_t MAX_STACK_DEPTH = 1024;
+static const size_t MAX_STEPS = 100000;
+
+/**
+ * Read the |size|-byte big-endian immediate at |pc| into *value.
+ */
+static bool read_immediate(const vector<uint8_t>& bytecode, size_t pc,
+                           size_t size, uint64_t* value) {
+  if (pc + size > bytecode.size()) {
+    return false;
+  }
+  uint64_t v = 0;
+  for (size_t i = 0; i < size; ++i) {
+    v = (v << 8) | bytecode[pc + i];
+  }
+  *value = v;
+  return true;
+}
+
+static uint64_t sign_extend(uint64_t v, uint64_t bits) {
+  if (bits == 0 || bits >= 64) {
+    return v;
+  }
+  uint64_t sign = uint64_t(1) << (bits - 1);
+  v &= (sign << 1) - 1;
+  return (v ^ sign) - sign;
+}
+
+static uint64_t zero_extend(uint64_t v, uint64_t bits) {
+  if (bits >= 64) {
+    return v;
+  }
+  return v & ((uint64_t(1) << bits) - 1);
+}
+
+/**
+ * The longest string a printf %s reads from the tracee.
+ */
+static const size_t MAX_PRINTF_STRING = 4096;
+
+static bool read_c_string(Task* t, remote_ptr<void> addr, string* str) {
+  while (str->size() < MAX_PRINTF_STRING) {
+    char buf[256];
+    ssize_t nread = t->read_bytes_fallible(addr, sizeof(buf), buf);
+    if (nread <= 0) {
+      return !str->empty();
+    }
+    size_t len = strnlen(buf, nread);
+    str->append(buf, len);
+    if (len < size_t(nread)) {
+      return true;
+    }
+    addr += nread;
+  }
+  return true;
+}
+
+template <typename T>
+static void append_formatted(string* out, const string& spec, T arg) {
+  int len = snprintf(nullptr, 0, spec.c_str(), arg);
+  if (len <= 0) {
+    return;
+  }
+  vector<char> buf(len + 1);
+  snprintf(buf.data(), buf.size(), spec.c_str(), arg);
+  out->append(buf.data(), len);
+}
+
+/**
+ * Format |args| with the printf |format| gdb compiled into a printf
+ * bytecode, the way gdbserver does. Returns false for conversions gdb
+ * can't send through an agent expression (floating point, '*' widths).
+ */
+static bool format_printf(Task* t, const char* format,
+                          const vector<uint64_t>& args, string* out) {
+  size_t arg = 0;
+  for (const char* p = format; *p;) {
+    if (*p != '%') {
+      out->push_back(*p++);
+      continue;
+    }
+    if (p[1] == '%') {
+      out->push_back('%');
+      p += 2;
+      continue;
+    }
+    const char* start = p++;
+    while (*p && strchr("-+ #0'", *p)) {
+      ++p;
+    }
+    while (isdigit(*p) || *p == '.') {
+      ++p;
+    }
+    const char* length = p;
+    while (*p && strchr("hlLqjzt", *p)) {
+      ++p;
+    }
+    string length_mod(length, p);
+    char conv = *p++;
+    if (!conv || arg >= args.size()) {
+      return false;
+    }
+    // The flags, width and precision, without the length modifier;
+    // we supply our own to match the type we pass.
+    string spec(start, length);
+    uint64_t v = args[arg++];
+    switch (conv) {
+      case 'd':
+      case 'i':
+        if (length_mod.empty()) {
+          v = int64_t(int32_t(v));
+        } else if (length_mod == "h") {
+          v = int64_t(int16_t(v));
+        } else if (length_mod == "hh") {
+          v = int64_t(int8_t(v));
+        }
+        append_formatted(out, spec + "ll" + conv, (long long)v);
+        break;
+      case 'o':
+      case 'u':
+      case 'x':
+      case 'X':
+        if (length_mod.empty()) {
+          v = uint32_t(v);
+        } else if (length_mod == "h") {
+          v = uint16_t(v);
+        } else if (length_mod == "hh") {
+          v = uint8_t(v);
+        }
+        append_formatted(out, spec + "ll" + conv, (unsigned long long)v);
+        break;
+      case 'c':
+        append_formatted(out, spec + conv, int(v));
+        break;
+      case 'p':
+        append_formatted(out, spec + conv, (void*)uintptr_t(v));
+        break;
+      case 's': {
+        string str;
+        if (!v) {
+          str = "(null)";
+        } else if (!read_c_string(t, remote_ptr<void>(v), &str)) {
+          str = "<error>";
+        }
+        append_formatted(out, spec + conv, str.c_str());
+        break;
+      }
+      default:
+        LOG(debug) << "Unsupported printf conversion " << conv;
+        return false;
+    }
+  }
+  return true;
+}
+
+bool GdbExpression::evaluate(Task* t, int64_t* result, string* printed) const {
+  vector<uint64_t> stack;
+  size_t pc = 0;
+
+  for (size_t steps = 0; steps < MAX_STEPS; ++steps) {
+    if (pc >= bytecode.size() || stack.size() > MAX_STACK_DEPTH) {
+      return false;
+    }
+    uint8_t op = bytecode[pc++];
+    uint64_t imm = 0;
+    size_t imm_size = 0;
+    switch (op) {
+      case OP_EXT:
+      case OP_ZERO_EXT:
+      case OP_CONST8:
+      case OP_PICK:
+        imm_size = 1;
+        break;
+      case OP_IF_GOTO:
+      case OP_GOTO:
+      case OP_CONST16:
+      case OP_REG:
+        imm_size = 2;
+        break;
+      case OP_CONST32:
+        imm_size = 4;
+        break;
+      case OP_CONST64:
+        imm_size = 8;
+        break;
+    }
+    if (imm_size) {
+      if (!read_immediate(bytecode, pc, imm_size, &imm)) {
+        return false;
+      }
+      pc += imm_size;
+    }
+    // printf's immediates are the argument count, then the format
+    // string's length and the (NUL-terminated) string itself.
+    uint64_t format_len = 0;
+    const char* format = nullptr;
+    if (op == OP_PRINTF) {
+      if (!read_immediate(bytecode, pc, 1, &imm) ||
+          !read_immediate(bytecode, pc + 1, 2, &format_len) ||
+          format_len == 0 || pc + 3 + format_len > bytecode.size() ||
+          bytecode[pc + 3 + format_len - 1] != 0) {
+        return false;
+      }
+      format = reinterpret_cast<const char*>(bytecode.data() + pc + 3);
+      pc += 3 + format_len;
+    }
+
+    // Every other bytecode needs at least one operand.
+    size_t operands = 1;
+    switch (op) {
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MUL:
+      case OP_DIV_SIGNED:
+      case OP_DIV_UNSIGNED:
+      case OP_REM_SIGNED:
+      case OP_REM_UNSIGNED:
+      case OP_LSH:
+      case OP_RSH_SIGNED:
+      case OP_RSH_UNSIGNED:
+      case OP_BIT_AND:
+      case OP_BIT_OR:
+      case OP_BIT_XOR:
+      case OP_EQUAL:
+      case OP_LESS_SIGNED:
+      case OP_LESS_UNSIGNED:
+      case OP_SWAP:
+        operands = 2;
+        break;
+      case OP_ROT:
+        operands = 3;
+        break;
+      case OP_PICK:
+        operands = imm + 1;
+        break;
+      case OP_PRINTF:
+        // The arguments, the channel and the function.
+        operands = imm + 2;
+        break;
+      case OP_GOTO:
+      case OP_CONST8:
+      case OP_CONST16:
+      case OP_CONST32:
+      case OP_CONST64:
+      case OP_REG:
+        operands = 0;
+        break;
+    }
+    if (stack.size() < operands) {
+      LOG(debug) << "Stack underflow at bytecode " << HEX(op);
+      return false;
+    }
+
+    uint64_t a = stack.size() >= 2 ? stack[stack.size() - 2] : 0;
+    uint64_t b = stack.empty() ? 0 : stack.back();
+    switch (op) {
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MUL:
+      case OP_DIV_SIGNED:
+      case OP_DIV_UNSIGNED:
+      case OP_REM_SIGNED:
+      case OP_REM_UNSIGNED:
+      case OP_LSH:
+      case OP_RSH_SIGNED:
+      case OP_RSH_UNSIGNED:
+      case OP_BIT_AND:
+      case OP_BIT_OR:
+      case OP_BIT_XOR:
+      case OP_EQUAL:
+      case OP_LESS_SIGNED:
+      case OP_LESS_UNSIGNED: {
+        uint64_t v;
+        switch (op) {
+          case OP_ADD:
+            v = a + b;
+            break;
+          case OP_SUB:
+            v = a - b;
+            break;
+          case OP_MUL:
+            v = a * b;
+            break;
+          case OP_DIV_SIGNED:
+          case OP_REM_SIGNED:
+            if (b == 0 || (int64_t(a) == INT64_MIN && int64_t(b) == -1)) {
+              return false;
+            }
+            v = op == OP_DIV_SIGNED ? int64_t(a) / int64_t(b)
+                                    : int64_t(a) % int64_t(b);
+            break;
+          case OP_DIV_UNSIGNED:
+          case OP_REM_UNSIGNED:
+            if (b == 0) {
+              return false;
+            }
+            v = op == OP_DIV_UNSIGNED ? a / b : a % b;
+            break;
+          case OP_LSH:
+            v = b >= 64 ? 0 : a << b;
+            break;
+          case OP_RSH_SIGNED:
+            v = int64_t(a) >> (b >= 64 ? 63 : b);
+            break;
+          case OP_RSH_UNSIGNED:
+            v = b >= 64 ? 0 : a >> b;
+            break;
+          case OP_BIT_AND:
+            v = a & b;
+            break;
+          case OP_BIT_OR:
+            v = a | b;
+            break;
+          case OP_BIT_XOR:
+            v = a ^ b;
+            break;
+          case OP_EQUAL:
+            v = a == b;
+            break;
+          case OP_LESS_SIGNED:
+            v = int64_t(a) < int64_t(b);
+            break;
+          default:
+            v = a < b;
+            break;
+        }
+        stack.pop_back();
+        stack.back() = v;
+        break;
+      }
+      case OP_LOG_NOT:
+        stack.back() = !b;
+        break;
+      case OP_BIT_NOT:
+        stack.back() = ~b;
+        break;
+      case OP_EXT:
+        stack.back() = sign_extend(b, imm);
+        break;
+      case OP_ZERO_EXT:
+        stack.back() = zero_extend(b, imm);
+        break;
+      case OP_REF8:
+      case OP_REF16:
+      case OP_REF32:
+      case OP_REF64: {
+        size_t size = size_t(1) << (op - OP_REF8);
+        uint64_t v = 0;
+        if (t->read_bytes_fallible(remote_ptr<void>(b), size, &v) !=
+            ssize_t(size)) {
+          LOG(debug) << "Can't read " << size << " bytes at " << HEX(b);
+          return false;
+        }
+        stack.back() = v;
+        break;
+      }
+      case OP_IF_GOTO:
+        stack.pop_back();
+        if (b) {
+          pc = imm;
+        }
+        break;
+      case OP_GOTO:
+        pc = imm;
+        break;
+      case OP_CONST8:
+      case OP_CONST16:
+      case OP_CONST32:
+      case OP_CONST64:
+        stack.push_back(imm);
+        break;
+      case OP_REG: {
+        uint8_t buf[GdbRegisterValue::MAX_SIZE];
+        bool defined = false;
+        size_t size = t->get_reg(buf, GdbRegister(imm), &defined);
+        if (!defined || size == 0 || size > sizeof(uint64_t)) {
+          LOG(debug) << "Can't read register " << imm;
+          return false;
+        }
+        uint64_t v = 0;
+        memcpy(&v, buf, size);
+        stack.push_back(v);
+        break;
+      }
+      case OP_END:
+        *result = int64_t(b);
+        return true;
+      case OP_DUP:
+        stack.push_back(b);
+        break;
+      case OP_POP:
+        stack.pop_back();
+        break;
+      case OP_SWAP:
+        stack[stack.size() - 2] = b;
+        stack.back() = a;
+        break;
+      case OP_PICK:
+        stack.push_back(stack[stack.size() - 1 - imm]);
+        break;
+      case OP_ROT: {
+        // a b c => c a b
+        uint64_t c = stack[stack.size() - 3];
+        stack[stack.size() - 3] = b;
+        stack[stack.size() - 2] = c;
+        stack.back() = a;
+        break;
+      }
+      case OP_PRINTF: {
+        if (!printed) {
+          return false;
+        }
+        // We ignore the function and channel, like gdbserver. The first
+        // argument is on top.
+        stack.resize(stack.size() - 2);
+        vector<uint64_t> args;
+        for (uint64_t i = 0; i < imm; ++i) {
+          args.push_back(stack.back());
+          stack.pop_back();
+        }
+        if (!format_printf(t, format, args, printed)) {
+          return false;
+        }
+        if (stack.empty()) {
+          // gdb ends the command with OP_END, which needs a value.
+          stack.push_back(0);
+        }
+        break;
+      }
+      default:
+        LOG(debug) << "Unsupported bytecode " << HEX(op);
+        return false;
+    }
+  }
+  return false;
+}
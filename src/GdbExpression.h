@@ -0,0 +1,40 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_GDB_EXPRESSION_H_
+#define RR_GDB_EXPRESSION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+class Task;
+
+/**
+ * A gdb agent expression, as sent with breakpoint conditions. See
+ * https://sourceware.org/gdb/onlinedocs/gdb/Agent-Expressions.html.
+ * Only the bytecodes gdb emits for ordinary conditions (arithmetic,
+ * comparisons, branches, memory and register reads) and for agent-style
+ * dprintf commands (printf) are supported.
+ */
+class GdbExpression {
+public:
+  GdbExpression(const uint8_t* data, size_t size);
+
+  /**
+   * Evaluate the expression against the current state of |t| and
+   * store its value in *result. Returns false if the expression couldn't
+   * be evaluated (unsupported or invalid bytecode, unreadable memory or
+   * registers, stack underflow, etc).
+   * Text the expression prints is appended to *printed; if |printed| is
+   * null, an expression that prints can't be evaluated.
+   */
+  bool evaluate(Task* t, int64_t* result,
+                std::string* printed = nullptr) const;
+
+private:
+  std::vector<uint8_t> bytecode;
+};
+
+#endif /* RR_GDB_EXPRESSION_H_ */
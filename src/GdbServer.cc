@@ -5,6 +5,7 @@
 #include "GdbServer.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/wait.h>
@@ -47,6 +48,15 @@ static const uintptr_t DBG_COMMAND_MSG_CREATE_CHECKPOINT = 0x01000000;
  * command parameter.
  */
 static const uintptr_t DBG_COMMAND_MSG_DELETE_CHECKPOINT = 0x02000000;
+/**
+ * Print the current session's statistics, including the time spent in
+ * each phase of replay, to rr's stderr.
+ */
+static const uintptr_t DBG_COMMAND_MSG_PRINT_STATISTICS = 0x03000000;
+/**
+ * Print rr's memory use by subsystem to rr's stderr.
+ */
+static const uintptr_t DBG_COMMAND_MSG_PRINT_MEMORY = 0x04000000;
 
 static const uintptr_t DBG_COMMAND_PARAMETER_MASK = 0x00FFFFFF;
 
@@ -56,6 +66,16 @@ static const uintptr_t DBG_COMMAND_PARAMETER_MASK = 0x00FFFFFF;
  */
 static const uintptr_t DBG_WHEN_MAGIC_ADDRESS = DBG_COMMAND_MAGIC_ADDRESS + 4;
 
+/**
+ * A 16-byte write to DBG_WRITTEN_AT_MAGIC_ADDRESS of a 64-bit address and
+ * a 64-bit length starts a query for the events at which recorded data
+ * (syscall outputs, mapped data, etc) was written to that range. Each
+ * following 64-bit read returns the next such event, in increasing order,
+ * and -1 once there are no more.
+ */
+static const uintptr_t DBG_WRITTEN_AT_MAGIC_ADDRESS =
+    DBG_COMMAND_MAGIC_ADDRESS + 12;
+
 // Special-sauce macros defined by rr when launching the gdb client,
 // which implement functionality outside of the gdb remote protocol.
 // (Don't stare at them too long or you'll go blind ;).)
@@ -76,9 +96,24 @@ static const char gdb_rr_macros[] =
     "define restart\n"
     "  run c$arg0\n"
     "end\n"
+    "define replay-stats\n"
+    "  p (*(int*)29298 = 0x03000000), 0\n"
+    "end\n"
+    "define memory-stats\n"
+    "  p (*(int*)29298 = 0x04000000), 0\n"
+    "end\n"
     "define when\n"
     "  p *(long long int*)(29298 + 4)\n"
     "end\n"
+    "define written-at\n"
+    "  set *(unsigned long long(*)[2])(29298 + 12) = "
+    "{ (unsigned long long)($arg0), (unsigned long long)($arg1) }\n"
+    "  set $_rr_written_at = *(long long int*)(29298 + 12)\n"
+    "  while $_rr_written_at != -1\n"
+    "    p $_rr_written_at\n"
+    "    set $_rr_written_at = *(long long int*)(29298 + 12)\n"
+    "  end\n"
+    "end\n"
     // In gdb version "Fedora 7.8.1-30.fc21", a raw "run" command
     // issued before any user-generated resume-execution command
     // results in gdb hanging just after the inferior hits an internal
@@ -134,6 +169,29 @@ static GdbRegisterValue get_reg(Task* t, GdbRegister which) {
   return reg;
 }
 
+/**
+ * Return the registers gdb needs to start unwinding the stack of |t|,
+ * which we send with every stop reply.
+ */
+static vector<GdbRegisterValue> get_expedited_regs(Task* t) {
+  vector<GdbRegisterValue> regs;
+  switch (t->arch()) {
+    case x86:
+      regs.push_back(get_reg(t, DREG_EBP));
+      regs.push_back(get_reg(t, DREG_ESP));
+      regs.push_back(get_reg(t, DREG_EIP));
+      break;
+    case x86_64:
+      regs.push_back(get_reg(t, DREG_RBP));
+      regs.push_back(get_reg(t, DREG_RSP));
+      regs.push_back(get_reg(t, DREG_RIP));
+      break;
+    default:
+      assert(0 && "Unknown architecture");
+  }
+  return regs;
+}
+
 static GdbThreadId get_threadid(Task* t) {
   GdbThreadId thread;
   thread.pid = t->tgid();
@@ -177,7 +235,45 @@ static void maybe_singlestep_for_event(Task* t, GdbRequest* req) {
   }
 }
 
+void GdbServer::query_written_at(remote_ptr<void> addr, size_t len) {
+  if (written_ranges.empty()) {
+    written_ranges = timeline.current_session().trace_reader()
+                         .read_raw_data_ranges();
+    sort(written_ranges.begin(), written_ranges.end(),
+         [](const TraceReader::RawDataRange& a,
+            const TraceReader::RawDataRange& b) { return a.addr < b.addr; });
+    uintptr_t max_end = 0;
+    for (auto& r : written_ranges) {
+      max_end = max(max_end, (r.addr + r.num_bytes).as_int());
+      written_ranges_max_end.push_back(max_end);
+    }
+  }
+
+  // written_ranges_max_end is nondecreasing, so everything before the first
+  // entry ending after |addr| is entirely below the query range.
+  size_t i = upper_bound(written_ranges_max_end.begin(),
+                         written_ranges_max_end.end(), addr.as_int()) -
+             written_ranges_max_end.begin();
+  set<TraceFrame::Time> times;
+  remote_ptr<void> end = addr + len;
+  for (; i < written_ranges.size() && written_ranges[i].addr < end; ++i) {
+    auto& r = written_ranges[i];
+    if (r.addr + r.num_bytes > addr) {
+      times.insert(r.time);
+    }
+  }
+  // Results are popped from the back.
+  written_at_results.assign(times.rbegin(), times.rend());
+}
+
 bool GdbServer::maybe_process_magic_command(Task* t, const GdbRequest& req) {
+  if (req.mem.addr == DBG_WRITTEN_AT_MAGIC_ADDRESS && req.mem.len == 16) {
+    uint64_t range[2];
+    memcpy(range, req.mem.data, sizeof(range));
+    query_written_at(remote_ptr<void>(range[0]), range[1]);
+    dbg->reply_set_mem(true);
+    return true;
+  }
   if (!(req.mem.addr == DBG_COMMAND_MAGIC_ADDRESS && req.mem.len == 4)) {
     return false;
   }
@@ -197,6 +293,12 @@ bool GdbServer::maybe_process_magic_command(Task* t, const GdbRequest& req) {
       }
       break;
     }
+    case DBG_COMMAND_MSG_PRINT_STATISTICS:
+      t->session().print_statistics(stderr);
+      break;
+    case DBG_COMMAND_MSG_PRINT_MEMORY:
+      timeline.print_memory_usage(stderr);
+      break;
     default:
       return false;
   }
@@ -215,9 +317,245 @@ bool GdbServer::maybe_process_magic_read(Task* t, const GdbRequest& req) {
     dbg->reply_get_mem(mem);
     return true;
   }
+  if (req.mem.addr == DBG_WRITTEN_AT_MAGIC_ADDRESS && req.mem.len == 8) {
+    vector<uint8_t> mem;
+    mem.resize(req.mem.len);
+    int64_t when = -1;
+    if (!written_at_results.empty()) {
+      when = written_at_results.back();
+      written_at_results.pop_back();
+    }
+    memcpy(mem.data(), &when, mem.size());
+    dbg->reply_get_mem(mem);
+    return true;
+  }
   return false;
 }
 
+/**
+ * The path of the file holding the contents |t| has mapped for |name|:
+ * the trace's copy of the file if replay mapped one, or |name| itself.
+ */
+static string file_for_debugger(Task* t, const string& name) {
+  string backing;
+  t->vm()->for_all_mappings(
+      [&](const Mapping& m, const MappableResource& r) {
+        if (backing.empty() && r.fsname == name) {
+          backing = r.backing_fsname;
+        }
+      });
+  return backing.empty() ? name : backing;
+}
+
+void GdbServer::process_file_request(Task* t, const GdbRequest& req) {
+  switch (req.type) {
+    case DREQ_FILE_OPEN: {
+      // Only File-I/O's O_RDONLY, which is 0, is allowed: the trace's
+      // files must not change.
+      if (req.file.flags != 0) {
+        dbg->reply_open_file(-1, EROFS);
+        return;
+      }
+      string path = file_for_debugger(t, req.file_name);
+      LOG(debug) << "gdb opens " << req.file_name << " as " << path;
+      ScopedFd fd(path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (!fd.is_open()) {
+        dbg->reply_open_file(-1, errno);
+        return;
+      }
+      int handle = fd.get();
+      debugger_files[handle] = move(fd);
+      dbg->reply_open_file(handle);
+      return;
+    }
+    case DREQ_FILE_PREAD: {
+      auto it = debugger_files.find(req.file.fd);
+      if (it == debugger_files.end()) {
+        dbg->reply_pread_file(nullptr, 0, EBADF);
+        return;
+      }
+      vector<uint8_t> buf(req.file.len);
+      ssize_t nread = pread64(it->second, buf.data(), buf.size(),
+                              req.file.offset);
+      if (nread < 0) {
+        dbg->reply_pread_file(nullptr, 0, errno);
+        return;
+      }
+      dbg->reply_pread_file(buf.data(), nread);
+      return;
+    }
+    case DREQ_FILE_FSTAT: {
+      struct stat st;
+      memset(&st, 0, sizeof(st));
+      auto it = debugger_files.find(req.file.fd);
+      if (it == debugger_files.end()) {
+        dbg->reply_fstat_file(st, EBADF);
+        return;
+      }
+      if (fstat(it->second, &st) < 0) {
+        dbg->reply_fstat_file(st, errno);
+        return;
+      }
+      dbg->reply_fstat_file(st);
+      return;
+    }
+    case DREQ_FILE_CLOSE:
+      dbg->reply_close_file(debugger_files.erase(req.file.fd) ? 0 : EBADF);
+      return;
+    default:
+      FATAL() << "Unknown file request " << req.type;
+  }
+}
+
+/**
+ * The r_debug the dynamic loader keeps for debuggers, up to the link map.
+ */
+template <typename Arch> struct RDebug {
+  typename Arch::signed_int r_version;
+  typename Arch::unsigned_word r_map;
+};
+
+/**
+ * The public part of the loader's struct link_map.
+ */
+template <typename Arch> struct LinkMap {
+  typename Arch::unsigned_word l_addr;
+  typename Arch::unsigned_word l_name;
+  typename Arch::unsigned_word l_ld;
+  typename Arch::unsigned_word l_next;
+  typename Arch::unsigned_word l_prev;
+};
+
+/**
+ * Read a |T| at |addr| in |t|, returning false if it can't be read.
+ */
+template <typename T>
+static bool read_debugger_struct(Task* t, remote_ptr<void> addr, T* out) {
+  return t->read_bytes_fallible(addr, sizeof(*out), out) == sizeof(*out);
+}
+
+/**
+ * Return the address of the r_debug of |t|'s process, found through the
+ * DT_DEBUG entry of the exe's dynamic section, or null if the process
+ * isn't dynamically linked or the loader hasn't set it up yet.
+ */
+template <typename Arch> static remote_ptr<void> find_r_debug(Task* t) {
+  char filename[] = "/proc/01234567890/auxv";
+  snprintf(filename, sizeof(filename) - 1, "/proc/%d/auxv", t->real_tgid());
+  ScopedFd fd(filename, O_RDONLY);
+  typename Arch::unsigned_word auxv[4096];
+  ssize_t len = fd.is_open() ? read(fd, auxv, sizeof(auxv)) : -1;
+  remote_ptr<void> phdrs;
+  size_t num_phdrs = 0;
+  for (ssize_t i = 0; i + 1 < len / ssize_t(sizeof(auxv[0])); i += 2) {
+    if (auxv[i] == AT_PHDR) {
+      phdrs = auxv[i + 1];
+    } else if (auxv[i] == AT_PHNUM) {
+      num_phdrs = auxv[i + 1];
+    }
+  }
+
+  uintptr_t load_bias = 0;
+  remote_ptr<void> dynamic;
+  for (size_t i = 0; i < num_phdrs; ++i) {
+    typename Arch::ElfPhdr phdr;
+    if (!read_debugger_struct(t, phdrs + i * sizeof(phdr), &phdr)) {
+      return nullptr;
+    }
+    if (phdr.p_type == PT_PHDR) {
+      load_bias = phdrs.as_int() - phdr.p_vaddr;
+    } else if (phdr.p_type == PT_DYNAMIC) {
+      dynamic = phdr.p_vaddr;
+    }
+  }
+  if (dynamic.is_null()) {
+    return nullptr;
+  }
+
+  for (remote_ptr<void> p = dynamic + load_bias;;
+       p += sizeof(typename Arch::ElfDyn)) {
+    typename Arch::ElfDyn dyn;
+    if (!read_debugger_struct(t, p, &dyn) || dyn.d_tag == DT_NULL) {
+      return nullptr;
+    }
+    if (dyn.d_tag == DT_DEBUG) {
+      return remote_ptr<void>(dyn.d_un.d_ptr);
+    }
+  }
+}
+
+/**
+ * Append |s| to |out|, escaped for an XML attribute value.
+ */
+static void append_xml_escaped(string& out, const string& s) {
+  for (char c : s) {
+    switch (c) {
+      case '<':
+        out += "&lt;";
+        break;
+      case '>':
+        out += "&gt;";
+        break;
+      case '&':
+        out += "&amp;";
+        break;
+      case '"':
+        out += "&quot;";
+        break;
+      default:
+        out += c;
+        break;
+    }
+  }
+}
+
+template <typename Arch> static string libraries_svr4_xml_arch(Task* t) {
+  string xml = "<library-list-svr4 version=\"1.0\"";
+  RDebug<Arch> r_debug;
+  remote_ptr<void> r_debug_addr = find_r_debug<Arch>(t);
+  if (r_debug_addr.is_null() ||
+      !read_debugger_struct(t, r_debug_addr, &r_debug) || !r_debug.r_map) {
+    return xml + "/>";
+  }
+
+  char buf[256];
+  snprintf(buf, sizeof(buf), " main-lm=\"0x%llx\">",
+           (unsigned long long)r_debug.r_map);
+  xml += buf;
+  // The first entry is the exe itself, which gdb doesn't want listed.
+  LinkMap<Arch> lm;
+  remote_ptr<void> lm_addr = r_debug.r_map;
+  // Guard against a corrupt, circular list.
+  for (int i = 0; i < 100000 && !lm_addr.is_null(); ++i) {
+    if (!read_debugger_struct(t, lm_addr, &lm)) {
+      break;
+    }
+    if (lm_addr.as_int() != r_debug.r_map && lm.l_name) {
+      string name = t->read_c_str(remote_ptr<void>(lm.l_name));
+      if (!name.empty()) {
+        xml += "<library name=\"";
+        append_xml_escaped(xml, name);
+        snprintf(buf, sizeof(buf),
+                 "\" lm=\"0x%llx\" l_addr=\"0x%llx\" l_ld=\"0x%llx\"/>",
+                 (unsigned long long)lm_addr.as_int(),
+                 (unsigned long long)lm.l_addr, (unsigned long long)lm.l_ld);
+        xml += buf;
+      }
+    }
+    lm_addr = lm.l_next;
+  }
+  return xml + "</library-list-svr4>";
+}
+
+/**
+ * Return the qXfer:libraries-svr4 list of the libraries loaded in |t|'s
+ * process, read from the dynamic loader's link map. gdb would otherwise
+ * walk the link map itself with many memory reads.
+ */
+static string libraries_svr4_xml(Task* t) {
+  RR_ARCH_FUNCTION(libraries_svr4_xml_arch, t->arch(), t);
+}
+
 void GdbServer::dispatch_debugger_request(Session& session, Task* t,
                                           const GdbRequest& req) {
   assert(!req.is_resume_request());
@@ -244,10 +582,26 @@ void GdbServer::dispatch_debugger_request(Session& session, Task* t,
       dbg->reply_get_thread_list(tids);
       return;
     }
+    case DREQ_GET_THREADS_PC_SP: {
+      vector<GdbThreadPcSp> threads;
+      for (auto& kv : t->session().tasks()) {
+        Task* t = kv.second;
+        threads.push_back({ get_threadid(t), t->regs().ip().as_int(),
+                            t->regs().sp().as_int() });
+      }
+      dbg->reply_get_threads_pc_sp(threads);
+      return;
+    }
     case DREQ_INTERRUPT:
       // Tell the debugger we stopped and await further
       // instructions.
-      dbg->notify_stop(get_threadid(t), 0);
+      dbg->notify_stop(get_threadid(t), 0, 0, get_expedited_regs(t));
+      return;
+    case DREQ_FILE_OPEN:
+    case DREQ_FILE_PREAD:
+    case DREQ_FILE_FSTAT:
+    case DREQ_FILE_CLOSE:
+      process_file_request(t, req);
       return;
     case DREQ_DETACH:
       LOG(info) << ("(debugger detached from us, rr exiting)");
@@ -321,12 +675,7 @@ void GdbServer::dispatch_debugger_request(Session& session, Task* t,
       if (maybe_process_magic_read(target, req)) {
         return;
       }
-      vector<uint8_t> mem;
-      mem.resize(req.mem.len);
-      ssize_t nread =
-          target->read_bytes_fallible(req.mem.addr, req.mem.len, mem.data());
-      mem.resize(max(ssize_t(0), nread));
-      dbg->reply_get_mem(mem);
+      dbg->reply_get_mem(read_debugger_mem(target, req.mem.addr, req.mem.len));
       return;
     }
     case DREQ_SET_MEM: {
@@ -352,23 +701,22 @@ void GdbServer::dispatch_debugger_request(Session& session, Task* t,
       LOG(debug) << "Writing " << req.mem.len << " bytes to " << req.mem.addr;
       // TODO fallible
       target->write_bytes_helper(req.mem.addr, req.mem.len, req.mem.data);
+      memory_cache.clear();
       dbg->reply_set_mem(true);
       return;
     }
     case DREQ_GET_REG: {
-      GdbRegisterValue reg = get_reg(target, req.reg.name);
-      dbg->reply_get_reg(reg);
-      return;
-    }
-    case DREQ_GET_REGS: {
-      size_t n_regs = target->regs().total_registers();
-      GdbRegisterFile file(n_regs);
-      for (size_t i = 0; i < n_regs; ++i) {
-        file.regs[i] = get_reg(target, GdbRegister(i));
+      const GdbRegisterFile& file = get_debugger_regs(target);
+      if (size_t(req.reg.name) < file.total_registers()) {
+        dbg->reply_get_reg(file.regs[req.reg.name]);
+      } else {
+        dbg->reply_get_reg(get_reg(target, req.reg.name));
       }
-      dbg->reply_get_regs(file);
       return;
     }
+    case DREQ_GET_REGS:
+      dbg->reply_get_regs(get_debugger_regs(target));
+      return;
     case DREQ_SET_REG: {
       if (!session.is_diversion()) {
         // gdb sets orig_eax to -1 during a restart. For a
@@ -389,27 +737,57 @@ void GdbServer::dispatch_debugger_request(Session& session, Task* t,
         Registers regs = target->regs();
         regs.write_register(req.reg.name, req.reg.value, req.reg.size);
         target->set_regs(regs);
+        register_cache.erase(target);
       }
       dbg->reply_set_reg(true /*currently infallible*/);
       return;
     }
     case DREQ_GET_STOP_REASON: {
-      dbg->reply_get_stop_reason(get_threadid(target), target->child_sig);
+      dbg->reply_get_stop_reason(get_threadid(target), target->child_sig,
+                                 get_expedited_regs(target));
       return;
     }
     case DREQ_SET_SW_BREAK: {
       ASSERT(target, (req.mem.len == sizeof(AddressSpace::breakpoint_insn)))
           << "Debugger setting bad breakpoint insn";
-      bool ok =
-          &session == &timeline.current_session()
-              ? timeline.add_breakpoint(target, req.mem.addr)
-              : target->vm()->add_breakpoint(req.mem.addr, TRAP_BKPT_USER);
-      dbg->reply_watchpoint_request(ok);
+      if (&session != &timeline.current_session()) {
+        dbg->reply_watchpoint_request(
+            target->vm()->add_breakpoint(req.mem.addr, TRAP_BKPT_USER));
+        return;
+      }
+      // gdb sets an already-inserted breakpoint again when its conditions
+      // change, so only the conditions need updating then.
+      auto key = make_pair(target->vm()->uid(),
+                           remote_ptr<uint8_t>(req.mem.addr));
+      auto it = gdb_breakpoints.find(key);
+      if (it == gdb_breakpoints.end()) {
+        if (!timeline.add_breakpoint(target, req.mem.addr)) {
+          dbg->reply_watchpoint_request(false);
+          return;
+        }
+        it = gdb_breakpoints.insert(make_pair(key, GdbBreakpoint()))
+                 .first;
+      }
+      it->second.conditions.clear();
+      for (auto& bytecode : req.breakpoint_conditions) {
+        it->second.conditions.push_back(
+            GdbExpression(bytecode.data(), bytecode.size()));
+      }
+      it->second.commands.clear();
+      for (auto& bytecode : req.breakpoint_commands) {
+        it->second.commands.push_back(
+            GdbExpression(bytecode.data(), bytecode.size()));
+      }
+      dbg->reply_watchpoint_request(true);
       return;
     }
     case DREQ_REMOVE_SW_BREAK:
       if (&session == &timeline.current_session()) {
-        timeline.remove_breakpoint(target, req.mem.addr);
+        auto key = make_pair(target->vm()->uid(),
+                             remote_ptr<uint8_t>(req.mem.addr));
+        if (gdb_breakpoints.erase(key)) {
+          timeline.remove_breakpoint(target, req.mem.addr);
+        }
       } else {
         target->vm()->remove_breakpoint(req.mem.addr, TRAP_BKPT_USER);
       }
@@ -440,6 +818,9 @@ void GdbServer::dispatch_debugger_request(Session& session, Task* t,
       dbg->reply_watchpoint_request(ok);
       return;
     }
+    case DREQ_GET_LIBRARIES_SVR4:
+      dbg->reply_get_libraries_svr4(libraries_svr4_xml(target));
+      return;
     case DREQ_READ_SIGINFO:
       LOG(warn) << "READ_SIGINFO request outside of diversion session";
       dbg->reply_read_siginfo(vector<uint8_t>());
@@ -464,7 +845,7 @@ Task* GdbServer::diverter_process_debugger_requests(
     Task* t, DiversionSession& diversion_session, uint32_t& diversion_refcount,
     GdbRequest* req) {
   while (true) {
-    *req = dbg->get_request();
+    *req = get_debugger_request();
 
     if (req->is_resume_request()) {
       if (diversion_refcount == 0) {
@@ -477,6 +858,13 @@ Task* GdbServer::diverter_process_debugger_requests(
       case DREQ_RESTART:
         return nullptr;
 
+      case DREQ_DETACH:
+        // Let the replay session pass control to the next debugger.
+        if (dbg->is_listening()) {
+          return nullptr;
+        }
+        break;
+
       case DREQ_READ_SIGINFO: {
         LOG(debug) << "Adding ref to diversion session";
         ++diversion_refcount;
@@ -544,8 +932,19 @@ GdbRequest GdbServer::divert(ReplaySession& replay, pid_t task) {
   GdbRequest req;
   LOG(debug) << "Starting debugging diversion for " << &replay;
 
-  DiversionSession::shr_ptr diversion_session = replay.clone_diversion();
+  DiversionSession::shr_ptr diversion_session;
+  if (reusable_diversion && reusable_diversion->reset(replay)) {
+    diversion_session = reusable_diversion;
+    // Pages read in the last diversion may have been reset.
+    memory_cache.clear();
+  } else {
+    diversion_session = replay.clone_diversion();
+  }
+  // The diversion's tasks are new, and may reuse a dead task's address.
+  register_cache.clear();
+  reusable_diversion = nullptr;
   uint32_t diversion_refcount = 1;
+  bool exited = false;
 
   Task* t = diversion_session->find_task(task);
   while (true) {
@@ -557,7 +956,7 @@ GdbRequest GdbServer::divert(ReplaySession& replay, pid_t task) {
     if (req.run_direction == RUN_BACKWARD) {
       // We don't support reverse execution in a diversion. Just issue
       // an immediate stop.
-      dbg->notify_stop(get_threadid(t), SIGTRAP, 0);
+      dbg->notify_stop(get_threadid(t), SIGTRAP, 0, get_expedited_regs(t));
       continue;
     }
 
@@ -569,6 +968,7 @@ GdbRequest GdbServer::divert(ReplaySession& replay, pid_t task) {
 
     if (result.status == DiversionSession::DIVERSION_EXITED) {
       diversion_refcount = 0;
+      exited = true;
       req.type = DREQ_NONE;
       dbg->notify_exit_code(0);
       break;
@@ -594,7 +994,8 @@ GdbRequest GdbServer::divert(ReplaySession& replay, pid_t task) {
     /* Notify the debugger and process any new requests
      * that might have triggered before resuming. */
     dbg->notify_stop(get_threadid(result.break_status.task), sig,
-                     watch_addr.as_int());
+                     watch_addr.as_int(),
+                     get_expedited_regs(result.break_status.task));
   }
 
   LOG(debug) << "... ending debugging diversion";
@@ -610,17 +1011,75 @@ GdbRequest GdbServer::divert(ReplaySession& replay, pid_t task) {
     orig->vm()->copy_watchpoints_from(*t->vm());
   }
 
-  diversion_session->kill_all_tasks();
+  // Keep the diversion around in case gdb makes another call before the
+  // replay moves on.
+  if (exited) {
+    diversion_session->kill_all_tasks();
+  } else {
+    reusable_diversion = diversion_session;
+  }
+  return req;
+}
+
+GdbRequest GdbServer::get_debugger_request() {
+  GdbRequest req = dbg->get_request();
+  if (req.is_resume_request() || req.type == DREQ_RESTART) {
+    memory_cache.clear();
+    register_cache.clear();
+  }
   return req;
 }
 
+const GdbRegisterFile& GdbServer::get_debugger_regs(Task* t) {
+  auto it = register_cache.find(t);
+  if (it == register_cache.end()) {
+    size_t n_regs = t->regs().total_registers();
+    GdbRegisterFile file(n_regs);
+    for (size_t i = 0; i < n_regs; ++i) {
+      file.regs[i] = get_reg(t, GdbRegister(i));
+    }
+    it = register_cache.insert(make_pair(t, move(file))).first;
+  }
+  return it->second;
+}
+
+vector<uint8_t> GdbServer::read_debugger_mem(Task* t, remote_ptr<void> addr,
+                                             size_t len) {
+  vector<uint8_t> mem;
+  mem.reserve(len);
+  size_t page_size = ::page_size();
+  while (mem.size() < len) {
+    remote_ptr<void> p = addr + mem.size();
+    remote_ptr<void> page = floor_page_size(p);
+    auto key = make_pair(t->vm().get(), page);
+    auto it = memory_cache.find(key);
+    if (it == memory_cache.end()) {
+      vector<uint8_t> data(page_size);
+      if (t->read_bytes_fallible(page, page_size, data.data()) !=
+          ssize_t(page_size)) {
+        data.clear();
+      }
+      it = memory_cache.insert(make_pair(key, move(data))).first;
+    }
+    if (it->second.empty()) {
+      // Return the readable prefix, like read_bytes_fallible().
+      break;
+    }
+    size_t offset = p - page;
+    size_t n = min(len - mem.size(), page_size - offset);
+    mem.insert(mem.end(), it->second.begin() + offset,
+               it->second.begin() + offset + n);
+  }
+  return mem;
+}
+
 /**
  * Reply to debugger requests until the debugger asks us to resume
  * execution.
  */
 GdbRequest GdbServer::process_debugger_requests(Task* t) {
   while (true) {
-    GdbRequest req = dbg->get_request();
+    GdbRequest req = get_debugger_request();
     req.suppress_debugger_stop = false;
 
     if (req.type == DREQ_READ_SIGINFO) {
@@ -656,14 +1115,86 @@ GdbRequest GdbServer::process_debugger_requests(Task* t) {
       return req;
     }
 
+    if (req.type == DREQ_DETACH && dbg->is_listening()) {
+      dbg->reply_detach();
+      await_next_debugger();
+      continue;
+    }
+
     dispatch_debugger_request(t->session(), t, req);
   }
 }
 
+void GdbServer::await_next_debugger() {
+  LOG(info) << "(debugger detached from us, waiting for the next one)";
+  // The next debugger starts out with none of this one's breakpoints or
+  // checkpoints, but at the same point in the replay.
+  timeline.remove_breakpoints_and_watchpoints();
+  gdb_breakpoints.clear();
+  report_breakpoint_hits();
+  checkpoints.clear();
+  memory_cache.clear();
+  register_cache.clear();
+  written_at_results.clear();
+  debugger_files.clear();
+  dbg = dbg->await_next_client();
+}
+
+bool GdbServer::breakpoint_condition_holds(Task* t) {
+  auto it = gdb_breakpoints.find(
+      make_pair(t->vm()->uid(), t->ip()));
+  if (it == gdb_breakpoints.end() || it->second.conditions.empty()) {
+    return true;
+  }
+  for (auto& condition : it->second.conditions) {
+    int64_t value;
+    if (!condition.evaluate(t, &value) || value) {
+      return true;
+    }
+  }
+  LOG(debug) << "Breakpoint conditions at " << t->ip() << " are false";
+  return false;
+}
+
+bool GdbServer::run_breakpoint_commands(Task* t) {
+  BreakpointKey key = make_pair(t->vm()->uid(), t->ip());
+  auto it = gdb_breakpoints.find(key);
+  if (it == gdb_breakpoints.end() || it->second.commands.empty()) {
+    return false;
+  }
+  ++breakpoint_hits[key];
+  string printed;
+  for (auto& command : it->second.commands) {
+    int64_t value;
+    if (!command.evaluate(t, &value, &printed)) {
+      LOG(debug) << "Can't run breakpoint commands at " << t->ip();
+      fputs(printed.c_str(), dprintf_output);
+      return false;
+    }
+  }
+  // Leave flushing to stdio, so a hot dprintf costs a buffer append.
+  fputs(printed.c_str(), dprintf_output);
+  return true;
+}
+
+void GdbServer::report_breakpoint_hits() {
+  for (auto& hits : breakpoint_hits) {
+    fprintf(dprintf_output, "rr: breakpoint at %p hit %" PRIu64 " times\n",
+            (void*)hits.first.second.as_int(), hits.second);
+  }
+  breakpoint_hits.clear();
+  fflush(dprintf_output);
+}
+
 ReplayStatus GdbServer::replay_one_step() {
   ReplayResult result;
   bool suppress_debugger_stop = false;
+  RunCommand command = RUN_CONTINUE;
+  RunDirection direction = RUN_FORWARD;
   Task* t = timeline.current_session().current_task();
+  // Any replay execution invalidates the state the diversion was cloned
+  // from.
+  reusable_diversion = nullptr;
 
   if (debugger_active && t && t->task_group()->tguid() == debuggee_tguid) {
     GdbRequest req = process_debugger_requests(t);
@@ -673,10 +1204,10 @@ ReplayStatus GdbServer::replay_one_step() {
     }
     suppress_debugger_stop = req.suppress_debugger_stop;
     assert(req.is_resume_request());
-    RunCommand command =
-        (DREQ_STEP == req.type && get_threadid(t) == req.target)
-            ? RUN_SINGLESTEP
-            : RUN_CONTINUE;
+    command = (DREQ_STEP == req.type && get_threadid(t) == req.target)
+                  ? RUN_SINGLESTEP
+                  : RUN_CONTINUE;
+    direction = req.run_direction;
     result = timeline.replay_step(
         command, req.run_direction,
         req.run_direction == RUN_FORWARD ? target.event : 0);
@@ -692,6 +1223,18 @@ ReplayStatus GdbServer::replay_one_step() {
     return result.status;
   }
 
+  // Resuming without a stop notification resumes with the same request,
+  // so a continue that hits a breakpoint whose conditions are false, or
+  // whose commands rr can run itself, just keeps going without a round
+  // trip to gdb.
+  if (debugger_active && command == RUN_CONTINUE &&
+      result.break_status.reason == BREAK_BREAKPOINT &&
+      (!breakpoint_condition_holds(result.break_status.task) ||
+       (direction == RUN_FORWARD &&
+        run_breakpoint_commands(result.break_status.task)))) {
+    return result.status;
+  }
+
   if (debugger_active && !suppress_debugger_stop) {
     int sig = SIGTRAP;
     remote_ptr<void> watch_addr = nullptr;
@@ -705,10 +1248,13 @@ ReplayStatus GdbServer::replay_one_step() {
       default:
         break;
     }
+    // Show dprintf output from before the stop before gdb prompts.
+    fflush(dprintf_output);
     /* Notify the debugger and process any new requests
      * that might have triggered before resuming. */
     dbg->notify_stop(get_threadid(result.break_status.task), sig,
-                     watch_addr.as_int());
+                     watch_addr.as_int(),
+                     get_expedited_regs(result.break_status.task));
   }
   return result.status;
 }
@@ -759,11 +1305,16 @@ void GdbServer::maybe_connect_debugger(const ConnectionFlags& flags) {
   if (target.event > 0 || target.pid) {
     fprintf(stderr, "\a\n"
                     "--------------------------------------------------\n"
-                    " ---> Reached target process %d at event %u.\n"
+                    " ---> Reached target process %d at event %" PRIu64 ".\n"
                     "--------------------------------------------------\n",
             target.pid, event_now);
   }
 
+  // Validate replay from here on, including from the checkpoint.
+  if (timeline.current_session().fast_forwarding()) {
+    timeline.stop_fast_forward();
+  }
+
   // Have the "checkpoint" be the original replay
   // session, and then switch over to using the cloned
   // session.  The cloned tasks will look like children
@@ -776,6 +1327,7 @@ void GdbServer::maybe_connect_debugger(const ConnectionFlags& flags) {
   // for the next replay session, if we end up restarting.  This
   // allows us to determine if a later session has reached this
   // target without necessarily replaying up to this point.
+  TraceFrame::Time requested_event = target.event;
   target.pid = t->tgid();
   target.require_exec = false;
   target.event = event_now;
@@ -791,7 +1343,7 @@ void GdbServer::maybe_connect_debugger(const ConnectionFlags& flags) {
                                     : GdbConnection::PROBE_PORT;
     dbg = GdbConnection::await_client_connection(
         port, probe, t->tgid(), t->vm()->exe_image(),
-        flags.debugger_params_write_pipe);
+        flags.debugger_params_write_pipe, flags.keep_listening);
     if (flags.debugger_params_write_pipe) {
       flags.debugger_params_write_pipe->close();
     }
@@ -799,11 +1351,47 @@ void GdbServer::maybe_connect_debugger(const ConnectionFlags& flags) {
 
   debuggee_tguid = t->task_group()->tguid();
   debugger_active = true;
+  add_target_checkpoint(requested_event);
+}
+
+/**
+ * Upper bound on the number of target checkpoints we keep. Each one pins
+ * a cloned session.
+ */
+static const size_t MAX_TARGET_CHECKPOINTS = 8;
+
+void GdbServer::add_target_checkpoint(TraceFrame::Time requested_event) {
+  if (target_checkpoints.empty()) {
+    initial_target_event = requested_event;
+  }
+  if (target_checkpoints.count(requested_event)) {
+    return;
+  }
+  TargetCheckpoint& c = target_checkpoints[requested_event];
+  c.mark = timeline.add_explicit_checkpoint();
+  c.debuggee_tguid = debuggee_tguid;
+  c.last_used = ++target_checkpoint_uses;
+
+  if (target_checkpoints.size() <= MAX_TARGET_CHECKPOINTS) {
+    return;
+  }
+  auto victim = target_checkpoints.end();
+  for (auto it = target_checkpoints.begin(); it != target_checkpoints.end();
+       ++it) {
+    if (it->first != initial_target_event &&
+        (victim == target_checkpoints.end() ||
+         it->second.last_used < victim->second.last_used)) {
+      victim = it;
+    }
+  }
+  timeline.remove_explicit_checkpoint(victim->second.mark);
+  target_checkpoints.erase(victim);
 }
 
 void GdbServer::maybe_restart_session(const GdbRequest& req) {
   assert(req.type == DREQ_RESTART);
   assert(dbg);
+  reusable_diversion = nullptr;
 
   ReplayTimeline::Mark mark_to_restore;
   if (req.restart.type == RESTART_FROM_CHECKPOINT) {
@@ -818,6 +1406,7 @@ void GdbServer::maybe_restart_session(const GdbRequest& req) {
     mark_to_restore = debugger_restart_mark;
   }
   timeline.remove_breakpoints_and_watchpoints();
+  gdb_breakpoints.clear();
   if (mark_to_restore) {
     timeline.seek_to_mark(mark_to_restore);
     if (debugger_restart_mark) {
@@ -828,9 +1417,26 @@ void GdbServer::maybe_restart_session(const GdbRequest& req) {
     return;
   }
 
+  assert(req.restart.type == RESTART_FROM_EVENT);
+  if (debugger_restart_mark) {
+    timeline.remove_explicit_checkpoint(debugger_restart_mark);
+    debugger_restart_mark = ReplayTimeline::Mark();
+  }
+
+  auto it = target_checkpoints.find(req.restart.param);
+  if (it != target_checkpoints.end()) {
+    // We've started the debugger for this event before, so go straight
+    // back to where we did.
+    timeline.seek_to_mark(it->second.mark);
+    it->second.last_used = ++target_checkpoint_uses;
+    debugger_restart_mark = timeline.add_explicit_checkpoint();
+    debuggee_tguid = it->second.debuggee_tguid;
+    target.event = timeline.current_session().current_trace_frame().time();
+    return;
+  }
+
   debugger_active = false;
 
-  assert(req.restart.type == RESTART_FROM_EVENT);
   // Note that we don't reset the target pid; we intentionally keep targeting
   // the same process no matter what is running when we hit the event.
   target.event = req.restart.param;
@@ -838,6 +1444,15 @@ void GdbServer::maybe_restart_session(const GdbRequest& req) {
 }
 
 void GdbServer::serve_replay(const ConnectionFlags& flags) {
+  if (!flags.dprintf_file.empty()) {
+    dprintf_output = fopen(flags.dprintf_file.c_str(), "w");
+    if (!dprintf_output) {
+      FATAL() << "Can't open " << flags.dprintf_file;
+    }
+    // dprintf output comes in large batches between stops.
+    setvbuf(dprintf_output, nullptr, _IOFBF, 1024 * 1024);
+  }
+
   while (true) {
     while (true) {
       maybe_connect_debugger(flags);
@@ -870,6 +1485,10 @@ void GdbServer::serve_replay(const ConnectionFlags& flags) {
     FATAL() << "Received continue request after end-of-trace.";
   }
 
+  report_breakpoint_hits();
+  if (dprintf_output != stdout) {
+    fclose(dprintf_output);
+  }
   LOG(debug) << "debugger server exiting ...";
 }
 
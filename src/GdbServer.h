@@ -8,6 +8,7 @@
 #include <string>
 
 #include "DiversionSession.h"
+#include "GdbExpression.h"
 #include "GdbConnection.h"
 #include "ReplaySession.h"
 #include "ReplayTimeline.h"
@@ -18,7 +19,10 @@ class GdbServer {
 public:
   struct Target {
     Target() : pid(0), require_exec(true), event(0) {}
-    // Target process to debug, or 0 to just debug the first process
+    // Target process to debug, or 0 to just debug the first process. The
+    // other recorded processes are still replayed: the target is forked
+    // from them, and their writes to memory shared with it aren't in the
+    // trace. Use ReplaySession::Flags::fast_forward to replay them faster.
     pid_t pid;
     // If true, wait for the target process to exec() before attaching debugger
     bool require_exec;
@@ -34,8 +38,16 @@ public:
     // parameters through this pipe. GdbServer::launch_gdb is passed the
     // other end of this pipe to exec gdb with the parameters.
     ScopedFd* debugger_params_write_pipe;
+    // If true, keep serving the replay when the debugger detaches and wait
+    // for another debugger to attach at the point where it left off.
+    bool keep_listening;
+    // Where agent-style dprintf output goes. Empty for stdout.
+    std::string dprintf_file;
 
-    ConnectionFlags() : dbg_port(-1), debugger_params_write_pipe(nullptr) {}
+    ConnectionFlags()
+        : dbg_port(-1),
+          debugger_params_write_pipe(nullptr),
+          keep_listening(false) {}
   };
 
   /**
@@ -72,9 +84,16 @@ private:
             const ReplaySession::Flags& flags, const Target& target)
       : target(target),
         debugger_active(false),
-        timeline(std::move(session), flags) {}
+        timeline(std::move(session), flags),
+        initial_target_event(0),
+        target_checkpoint_uses(0),
+        dprintf_output(stdout) {}
   GdbServer(std::unique_ptr<GdbConnection>& dbg)
-      : dbg(std::move(dbg)), debugger_active(true) {}
+      : dbg(std::move(dbg)),
+        debugger_active(true),
+        initial_target_event(0),
+        target_checkpoint_uses(0),
+        dprintf_output(stdout) {}
 
   /**
    * If |req| is a magic-write command, interpret it and return true.
@@ -86,6 +105,17 @@ private:
    * Otherwise, do nothing and return false.
    */
   bool maybe_process_magic_read(Task* t, const GdbRequest& req);
+  /**
+   * Fill |written_at_results| with the events at which recorded data was
+   * written to [addr, addr + len), building the index the first time.
+   */
+  void query_written_at(remote_ptr<void> addr, size_t len);
+  /**
+   * Serve a vFile request from gdb. Files are opened for reading only,
+   * and a file |t| has mapped from a copy in the trace is read from that
+   * copy, which has the recorded contents and is local to us.
+   */
+  void process_file_request(Task* t, const GdbRequest& req);
   /**
    * Process the single debugger request |req|, made by |dbg| targeting
    * |t|, inside the session |session|.
@@ -106,7 +136,53 @@ private:
    */
   void maybe_connect_debugger(const ConnectionFlags& flags);
   void maybe_restart_session(const GdbRequest& req);
+  /**
+   * Remember the current state as the place the debugger starts for
+   * |requested_event|, evicting the least recently used such checkpoint
+   * if there are too many.
+   */
+  void add_target_checkpoint(TraceFrame::Time requested_event);
   GdbRequest process_debugger_requests(Task* t);
+  /**
+   * The debugger detached but more debuggers may attach. Drop its
+   * state and wait for the next one.
+   */
+  void await_next_debugger();
+  /**
+   * Return the next request from |dbg|, dropping |memory_cache| and
+   * |register_cache| if the request may change tracee state.
+   */
+  GdbRequest get_debugger_request();
+  /**
+   * Return all of |t|'s registers for the debugger, using and filling
+   * |register_cache|.
+   */
+  const GdbRegisterFile& get_debugger_regs(Task* t);
+  /**
+   * Read up to |len| bytes at |addr| in |t| for the debugger, using and
+   * filling |memory_cache|. Returns fewer bytes if the range isn't all
+   * readable.
+   */
+  std::vector<uint8_t> read_debugger_mem(Task* t, remote_ptr<void> addr,
+                                         size_t len);
+  /**
+   * Return true unless |t| is at a gdb breakpoint whose conditions all
+   * evaluate to false. A condition that can't be evaluated counts as true,
+   * so gdb gets to evaluate it instead.
+   */
+  bool breakpoint_condition_holds(Task* t);
+  /**
+   * |t| is at a gdb breakpoint whose conditions hold. Count the hit, and
+   * if gdb gave the breakpoint commands, run them and return true: gdb
+   * doesn't want to hear about the hit. Returns false if the hit should
+   * be reported, including when a command can't be evaluated here.
+   */
+  bool run_breakpoint_commands(Task* t);
+  /**
+   * Write the hit counts of the breakpoints that had commands to
+   * |dprintf_output|, and flush it.
+   */
+  void report_breakpoint_hits();
   ReplayStatus replay_one_step();
   void serve_replay(const ConnectionFlags& flags);
 
@@ -161,6 +237,59 @@ private:
 
   // gdb checkpoints, indexed by ID
   std::map<int, ReplayTimeline::Mark> checkpoints;
+
+  // Where the debugger was started for each event that was explicitly
+  // targeted (the initial -g target, then `run <event>`), indexed by the
+  // requested event. Lets a restart to one of those events restore a
+  // checkpoint instead of replaying from the start of the trace.
+  struct TargetCheckpoint {
+    ReplayTimeline::Mark mark;
+    TaskGroupUid debuggee_tguid;
+    uint64_t last_used;
+  };
+  std::map<TraceFrame::Time, TargetCheckpoint> target_checkpoints;
+  // The event the first debugger was started for. Its checkpoint is never
+  // evicted.
+  TraceFrame::Time initial_target_event;
+  uint64_t target_checkpoint_uses;
+
+  // The last diversion, if it can be reset for another diversion from the
+  // current replay state. Cleared whenever the replay executes.
+  DiversionSession::shr_ptr reusable_diversion;
+
+  // Tracee pages read by the debugger since the tracees last ran, keyed by
+  // address space and page address. After every stop gdb reads the stack
+  // and the code around the pc, mostly from the same few pages. An empty
+  // vector records a page that couldn't be read.
+  std::map<std::pair<AddressSpace*, remote_ptr<void> >, std::vector<uint8_t> >
+      memory_cache;
+  // Register files read by the debugger since the tracees last ran. IDEs
+  // read every thread's registers at each stop.
+  std::map<Task*, GdbRegisterFile> register_cache;
+
+  // Every raw data record in the trace, sorted by address, and the
+  // running maximum of their end addresses, for written-at queries.
+  std::vector<TraceReader::RawDataRange> written_ranges;
+  std::vector<uintptr_t> written_ranges_max_end;
+  // Pending results of the last written-at query, latest event first.
+  std::vector<TraceFrame::Time> written_at_results;
+
+  struct GdbBreakpoint {
+    // The conditions gdb attached to the breakpoint. A breakpoint with no
+    // conditions is always hit.
+    std::vector<GdbExpression> conditions;
+    // The commands to run when it's hit, instead of reporting the hit.
+    std::vector<GdbExpression> commands;
+  };
+  typedef std::pair<AddressSpaceUid, remote_ptr<uint8_t> > BreakpointKey;
+  // gdb's software breakpoints in the replay session.
+  std::map<BreakpointKey, GdbBreakpoint> gdb_breakpoints;
+  // How often each breakpoint with commands has been hit. gdb removes and
+  // reinserts its breakpoints at every stop, so this outlives them.
+  std::map<BreakpointKey, uint64_t> breakpoint_hits;
+  FILE* dprintf_output;
+  // Files gdb has opened with vFile:open, by the descriptor we gave it.
+  std::map<int, ScopedFd> debugger_files;
 };
 
 #endif /* RR_GDB_SERVER_H_ */
@@ -0,0 +1,442 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/perf_event.h>
+#include <math.h>
+#include <signal.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "Command.h"
+#include "kernel_supplement.h"
+#include "main.h"
+#include "PerfCounters.h"
+#include "ScopedFd.h"
+#include "seccomp-bpf.h"
+#include "util.h"
+
+using namespace std;
+
+class HostBenchCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  HostBenchCommand(const char* name, const char* help)
+      : Command(name, help) {}
+
+  static HostBenchCommand singleton;
+};
+
+HostBenchCommand HostBenchCommand::singleton(
+    "host-bench",
+    " rr host-bench [OPTION]...\n"
+    "  Measure the cost of the kernel operations recording depends on:\n"
+    "  ptrace stops and register access, reading tracee memory with\n"
+    "  PTRACE_PEEKDATA, process_vm_readv and /proc/<pid>/mem, opening and\n"
+    "  reprogramming the ticks counter, and seccomp filtering. Each is\n"
+    "  scored against a typical current bare-metal host (100 = as fast,\n"
+    "  higher is faster), and the overall score is their geometric mean.\n"
+    "  Like recording, the measurements run bound to one CPU.\n"
+    "  -n, --iterations=<N>       repeat each operation N times (default\n"
+    "                             10000)\n");
+
+struct HostBenchFlags {
+  int iterations;
+
+  HostBenchFlags() : iterations(10000) {}
+};
+
+static bool parse_host_bench_arg(std::vector<std::string>& args,
+                                 HostBenchFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'n', "iterations", HAS_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'n':
+      if (!opt.verify_valid_int(10, INT32_MAX)) {
+        return false;
+      }
+      flags.iterations = opt.int_value;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+/**
+ * Tracee memory reads are measured on this buffer, which the children
+ * inherit. It's touched before forking so every page is present.
+ */
+static const size_t BENCH_BUFFER_SIZE = 1024 * 1024;
+static uint8_t bench_buffer[BENCH_BUFFER_SIZE];
+
+struct Measurement {
+  const char* name;
+  // Microseconds per operation on a typical current bare-metal host.
+  double reference_us;
+  // Negative if the operation isn't available here.
+  double measured_us;
+};
+
+static double monotonic_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Return the microseconds per call of running |op| |n| times.
+ */
+template <typename Op> static double time_us(int n, Op op) {
+  double start = monotonic_now();
+  for (int i = 0; i < n; ++i) {
+    op();
+  }
+  return (monotonic_now() - start) * 1e6 / n;
+}
+
+static void syscall_forever() {
+  while (true) {
+    syscall(SYS_getppid);
+  }
+}
+
+/**
+ * Fork a child that stops itself under our ptrace with SIGSTOP, then runs
+ * |body|. Returns once the child is in its SIGSTOP stop.
+ */
+static pid_t spawn_traced_child(void (*body)()) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+    raise(SIGSTOP);
+    body();
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, __WALL);
+  ptrace(PTRACE_SETOPTIONS, pid, nullptr,
+         (void*)(PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL |
+                 PTRACE_O_TRACESECCOMP));
+  return pid;
+}
+
+static void kill_child(pid_t pid) {
+  int status;
+  kill(pid, SIGKILL);
+  waitpid(pid, &status, __WALL);
+}
+
+/**
+ * Resume |pid| with |request| and wait for its next stop.
+ */
+static void resume_and_wait(pid_t pid, int request) {
+  int status;
+  ptrace((__ptrace_request)request, pid, nullptr, nullptr);
+  waitpid(pid, &status, __WALL);
+}
+
+/**
+ * Return true if this host lets us count a task's retired branches. Probed
+ * with the generic event, since PerfCounters aborts when it can't open its
+ * counter.
+ */
+static bool perf_counters_available() {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_BRANCH_INSTRUCTIONS;
+  attr.exclude_kernel = 1;
+  attr.exclude_guest = 1;
+  ScopedFd fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  return fd.is_open();
+}
+
+static void bench_perf(pid_t pid, int n, vector<Measurement>* results) {
+  if (!perf_counters_available()) {
+    results->push_back({ "ticks counter open", 15, -1 });
+    results->push_back({ "ticks counter reprogram", 1, -1 });
+    results->push_back({ "ticks counter read", 0.5, -1 });
+    return;
+  }
+  PerfCounters counters(pid);
+  // A fresh open, as after a task is created or the ioctl path isn't
+  // usable.
+  results->push_back({ "ticks counter open", 15, time_us(max(n / 10, 10), [&] {
+                         counters.stop();
+                         counters.reset(1000000);
+                       }) });
+  // What every resume of a task with a running counter costs.
+  results->push_back({ "ticks counter reprogram", 1, time_us(n, [&] {
+                         counters.reset(1000000);
+                       }) });
+  results->push_back({ "ticks counter read", 0.5,
+                       time_us(n, [&] { counters.read_ticks(); }) });
+  counters.stop();
+}
+
+static void bench_ptrace(int n, vector<Measurement>* results) {
+  double syscall_us = time_us(n, [] { syscall(SYS_getppid); });
+  results->push_back({ "syscall, untraced", 0.1, syscall_us });
+
+  pid_t pid = spawn_traced_child(syscall_forever);
+  double stop_us = time_us(2 * n, [&] { resume_and_wait(pid, PTRACE_SYSCALL); });
+  results->push_back({ "ptrace syscall stop", 3, stop_us });
+
+  struct user_regs_struct regs;
+  results->push_back({ "PTRACE_GETREGS", 0.3, time_us(n, [&] {
+                         ptrace(PTRACE_GETREGS, pid, nullptr, &regs);
+                       }) });
+  results->push_back({ "PTRACE_SETREGS", 0.3, time_us(n, [&] {
+                         ptrace(PTRACE_SETREGS, pid, nullptr, &regs);
+                       }) });
+
+  size_t page = page_size();
+  vector<uint8_t> buf(BENCH_BUFFER_SIZE);
+  results->push_back(
+      { "PTRACE_PEEKDATA, 4KB", 100, time_us(max(n / 100, 10), [&] {
+          for (size_t i = 0; i < page; i += sizeof(long)) {
+            long v = ptrace(PTRACE_PEEKDATA, pid, bench_buffer + i, nullptr);
+            memcpy(buf.data() + i, &v, sizeof(v));
+          }
+        }) });
+
+  auto vm_readv = [&](size_t len) {
+    struct iovec local = { buf.data(), len };
+    struct iovec remote = { bench_buffer, len };
+    return syscall(SYS_process_vm_readv, pid, &local, 1, &remote, 1, 0);
+  };
+  if (vm_readv(page) == ssize_t(page)) {
+    results->push_back({ "process_vm_readv, 4KB", 1.5,
+                         time_us(n, [&] { vm_readv(page); }) });
+    results->push_back({ "process_vm_readv, 1MB", 100,
+                         time_us(max(n / 100, 10),
+                                 [&] { vm_readv(BENCH_BUFFER_SIZE); }) });
+  } else {
+    results->push_back({ "process_vm_readv, 4KB", 1.5, -1 });
+    results->push_back({ "process_vm_readv, 1MB", 100, -1 });
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path) - 1, "/proc/%d/mem", pid);
+  ScopedFd mem_fd(path, O_RDWR);
+  auto mem_read = [&](size_t len) {
+    return pread64(mem_fd, buf.data(), len, (uintptr_t)bench_buffer);
+  };
+  if (mem_fd.is_open() && mem_read(page) == ssize_t(page)) {
+    results->push_back({ "/proc/pid/mem read, 4KB", 1.5,
+                         time_us(n, [&] { mem_read(page); }) });
+    results->push_back({ "/proc/pid/mem read, 1MB", 100,
+                         time_us(max(n / 100, 10),
+                                 [&] { mem_read(BENCH_BUFFER_SIZE); }) });
+  } else {
+    results->push_back({ "/proc/pid/mem read, 4KB", 1.5, -1 });
+    results->push_back({ "/proc/pid/mem read, 1MB", 100, -1 });
+  }
+  mem_fd.close();
+
+  bench_perf(pid, n, results);
+  kill_child(pid);
+}
+
+/**
+ * Install a seccomp filter that applies |getppid_action| to getppid and
+ * allows everything else. Returns false if seccomp isn't available.
+ */
+static bool install_seccomp_filter(uint32_t getppid_action) {
+  struct sock_filter filter[] = {
+    BPF_STMT(BPF_LD + BPF_W + BPF_ABS, offsetof(struct seccomp_data, nr)),
+    BPF_JUMP(BPF_JMP + BPF_JEQ + BPF_K, SYS_getppid, 0, 1),
+    BPF_STMT(BPF_RET + BPF_K, getppid_action), ALLOW_PROCESS
+  };
+  struct sock_fprog prog;
+  prog.len = (unsigned short)(sizeof(filter) / sizeof(filter[0]));
+  prog.filter = filter;
+  return prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == 0 &&
+         prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, (uintptr_t)&prog, 0, 0) ==
+             0;
+}
+
+static void trace_getppid_forever() {
+  if (!install_seccomp_filter(SECCOMP_RET_TRACE)) {
+    _exit(1);
+  }
+  syscall_forever();
+}
+
+static void bench_seccomp(int n, vector<Measurement>* results) {
+  // The cost a filter adds to every untraced syscall is measured in a
+  // child, since filters can't be removed.
+  int fds[2];
+  if (pipe(fds)) {
+    return;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    double overhead = -1;
+    double before = time_us(n, [] { syscall(SYS_getppid); });
+    if (install_seccomp_filter(SECCOMP_RET_ALLOW)) {
+      overhead =
+          max(0.0, time_us(n, [] { syscall(SYS_getppid); }) - before);
+    }
+    ssize_t ret = write(fds[1], &overhead, sizeof(overhead));
+    _exit(ret == sizeof(overhead) ? 0 : 1);
+  }
+  close(fds[1]);
+  double overhead = -1;
+  if (read(fds[0], &overhead, sizeof(overhead)) != sizeof(overhead)) {
+    overhead = -1;
+  }
+  close(fds[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  results->push_back({ "seccomp filter overhead", 0.05, overhead });
+
+  // A syscall the filter hands to the tracer: how rr sees every syscall
+  // that isn't buffered.
+  pid = spawn_traced_child(trace_getppid_forever);
+  ptrace(PTRACE_CONT, pid, nullptr, nullptr);
+  waitpid(pid, &status, __WALL);
+  double stop_us = -1;
+  // The child exits instead if it couldn't install its filter.
+  if (WIFSTOPPED(status) && (status >> 16) == PTRACE_EVENT_SECCOMP) {
+    stop_us = time_us(n, [&] { resume_and_wait(pid, PTRACE_CONT); });
+    kill_child(pid);
+  }
+  results->push_back({ "seccomp trace stop", 3.5, stop_us });
+}
+
+/**
+ * Return the contents of the one-line file |path| without the newline,
+ * or "?" if it can't be read.
+ */
+static string read_one_line(const char* path) {
+  char line[256];
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    return "?";
+  }
+  if (!fgets(line, sizeof(line), f)) {
+    line[0] = 0;
+  }
+  fclose(f);
+  string s = line;
+  if (!s.empty() && s.back() == '\n') {
+    s.pop_back();
+  }
+  return s;
+}
+
+static void print_host(FILE* out) {
+  struct utsname uts;
+  uname(&uts);
+  unsigned int a, c, d;
+  cpuid(1, 0, &a, &c, &d);
+  // CPUID.1:ECX bit 31 is set by hypervisors.
+  bool virtualized = c & (1U << 31);
+  fprintf(out, "kernel %s %s, %s, %d CPUs\n", uts.release, uts.machine,
+          virtualized ? "virtual machine" : "bare metal", get_num_cpus());
+  fprintf(out, "perf_event_paranoid %s, ptrace_scope %s\n",
+          read_one_line("/proc/sys/kernel/perf_event_paranoid").c_str(),
+          read_one_line("/proc/sys/kernel/yama/ptrace_scope").c_str());
+}
+
+static void print_results(const vector<Measurement>& results, FILE* out) {
+  fprintf(out, "%-28s %10s %10s %6s\n", "operation", "us", "reference",
+          "score");
+  double log_sum = 0;
+  int scored = 0;
+  for (auto& m : results) {
+    if (m.measured_us < 0) {
+      fprintf(out, "%-28s %10s %10.2f %6s\n", m.name, "unavailable",
+              m.reference_us, "-");
+      continue;
+    }
+    // Operations too fast to measure count as matching the reference.
+    double score = 100 * m.reference_us / max(m.measured_us, 0.001);
+    if (m.measured_us < 0.001) {
+      score = 100;
+    }
+    fprintf(out, "%-28s %10.3f %10.2f %6.0f\n", m.name, m.measured_us,
+            m.reference_us, score);
+    log_sum += log(score);
+    ++scored;
+  }
+  if (scored) {
+    fprintf(out, "overall score %.0f (%d of %zu operations available)\n",
+            exp(log_sum / scored), scored, results.size());
+  }
+}
+
+/**
+ * Return the time measured for the operation called |name|, or -1.
+ */
+static double measured_us(const vector<Measurement>& results,
+                          const char* name) {
+  for (auto& m : results) {
+    if (!strcmp(m.name, name)) {
+      return m.measured_us;
+    }
+  }
+  return -1;
+}
+
+/**
+ * A remote syscall (AutoRemoteSyscalls) saves and sets the registers,
+ * resumes to the syscall entry and exit stops and restores the registers.
+ * It's derived rather than measured, so it isn't scored.
+ */
+static void print_remote_syscall_estimate(const vector<Measurement>& results,
+                                          FILE* out) {
+  double get = measured_us(results, "PTRACE_GETREGS");
+  double set = measured_us(results, "PTRACE_SETREGS");
+  double stop = measured_us(results, "ptrace syscall stop");
+  if (get < 0 || set < 0 || stop < 0) {
+    return;
+  }
+  fprintf(out, "estimated remote syscall %.3f us\n", get + 2 * set + 2 * stop);
+}
+
+int HostBenchCommand::run(std::vector<std::string>& args) {
+  HostBenchFlags flags;
+  while (parse_host_bench_arg(args, flags)) {
+  }
+  if (!args.empty()) {
+    print_help(stderr);
+    return 1;
+  }
+
+  memset(bench_buffer, 1, sizeof(bench_buffer));
+  set_cpu_affinity(0);
+  print_host(stdout);
+  vector<Measurement> results;
+  bench_ptrace(flags.iterations, &results);
+  bench_seccomp(flags.iterations, &results);
+  print_results(results, stdout);
+  print_remote_syscall_estimate(results, stdout);
+  return 0;
+}
@@ -2,6 +2,8 @@
 
 #include "MagicSaveDataMonitor.h"
 
+#include <string.h>
+
 #include <rr/rr.h>
 
 #include "log.h"
@@ -57,7 +59,8 @@ void MagicSaveDataMonitor::did_write(Task* t,
     } else if (t->session().is_replaying()) {
       auto bytes = t->read_mem(r.data.cast<uint8_t>(), r.length);
       auto rec = t->trace_reader().read_raw_data();
-      if (rec.data != bytes) {
+      if (rec.data.size() != bytes.size() ||
+          memcmp(rec.data.data(), bytes.data(), bytes.size())) {
         notify_save_data_error(t, rec.addr, rec.data.data(), rec.data.size(),
                                bytes.data(), bytes.size());
       }
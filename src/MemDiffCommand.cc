@@ -0,0 +1,302 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <sstream>
+
+#include "Command.h"
+#include "main.h"
+#include "util.h"
+
+using namespace std;
+
+class MemDiffCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  MemDiffCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static MemDiffCommand singleton;
+};
+
+MemDiffCommand MemDiffCommand::singleton(
+    "memdiff",
+    " rr memdiff [OPTION]... <dump_a> <dump_b>\n"
+    "  Compare two memory dumps written with --dump-binary, for example\n"
+    "  the `_rec' dump of an event and the `_rep' or `_checksum_error'\n"
+    "  dump of the same event. Mappings are matched by start address.\n"
+    "  For each mapping that differs, the ranges of pages that differ are\n"
+    "  listed. Mappings are compared in parallel.\n"
+    "  -j, --jobs=<N>             compare N mappings at once (default:\n"
+    "                             number of CPUs)\n"
+    "  -n, --max-ranges=<N>       list at most N ranges per mapping\n"
+    "                             (default 32)\n");
+
+struct MemDiffFlags {
+  int jobs;
+  int max_ranges;
+
+  MemDiffFlags() : jobs(get_num_cpus()), max_ranges(32) {}
+};
+
+static bool parse_memdiff_arg(std::vector<std::string>& args,
+                              MemDiffFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'j', "jobs", HAS_PARAMETER },
+                                        { 'n', "max-ranges", HAS_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'j':
+      if (!opt.verify_valid_int(1, 1024)) {
+        return false;
+      }
+      flags.jobs = opt.int_value;
+      break;
+    case 'n':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.max_ranges = opt.int_value;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+/**
+ * The mappings are compared this much at a time.
+ */
+static const size_t COMPARE_CHUNK_SIZE = 1024 * 1024;
+
+/**
+ * One line of a dump's index. See dump_process_memory().
+ */
+struct DumpedMapping {
+  string file;
+  uint64_t start;
+  uint64_t end;
+  uint64_t bytes_read;
+  string label;
+};
+
+/**
+ * Read the index of the binary dump in |dir|, keyed by start address.
+ * Returns false if it can't be read.
+ */
+static bool read_dump_index(const string& dir,
+                            map<uint64_t, DumpedMapping>* mappings) {
+  string index_name = dir + "/index";
+  FILE* index = fopen64(index_name.c_str(), "r");
+  if (!index) {
+    fprintf(stderr, "Can't open %s: %s\n", index_name.c_str(),
+            strerror(errno));
+    return false;
+  }
+  char* line = nullptr;
+  size_t line_size = 0;
+  bool ok = true;
+  while (getline(&line, &line_size, index) > 0) {
+    char file[64];
+    int label_offset = 0;
+    DumpedMapping m;
+    if (sscanf(line, "%63s %" SCNx64 " %" SCNx64 " %" SCNu64 " %n", file,
+               &m.start, &m.end, &m.bytes_read, &label_offset) < 4) {
+      fprintf(stderr, "Malformed line in %s: %s", index_name.c_str(), line);
+      ok = false;
+      break;
+    }
+    m.file = dir + "/" + file;
+    m.label = line + label_offset;
+    if (!m.label.empty() && m.label.back() == '\n') {
+      m.label.pop_back();
+    }
+    (*mappings)[m.start] = m;
+  }
+  free(line);
+  fclose(index);
+  return ok;
+}
+
+/**
+ * Read up to |len| bytes from |in| into |buf|, returning how many were read.
+ */
+static size_t read_chunk(gzFile in, uint8_t* buf, size_t len) {
+  if (!in) {
+    return 0;
+  }
+  int nread = gzread(in, buf, len);
+  return nread > 0 ? nread : 0;
+}
+
+/**
+ * Compare the contents of the matching mappings |a| and |b| page by page.
+ * A page that only one dump could read differs; one neither could read
+ * doesn't. Returns the report for the mapping, or an empty string if it's
+ * identical.
+ */
+static string compare_mappings(const DumpedMapping& a, const DumpedMapping& b,
+                               int max_ranges) {
+  stringstream out;
+  if (a.end != b.end) {
+    out << "    end differs: 0x" << hex << a.end << " vs 0x" << b.end << dec
+        << "\n";
+  }
+  gzFile in_a = gzopen(a.file.c_str(), "rb");
+  gzFile in_b = gzopen(b.file.c_str(), "rb");
+  if (!in_a || !in_b) {
+    out << "    can't open " << (in_a ? b.file : a.file) << "\n";
+  }
+
+  size_t page = page_size();
+  uint64_t length = min(a.end, b.end) - a.start;
+  vector<uint8_t> buf_a(COMPARE_CHUNK_SIZE), buf_b(COMPARE_CHUNK_SIZE);
+  uint64_t range_start = 0;
+  bool in_range = false;
+  uint64_t num_divergent = 0;
+  int num_ranges = 0;
+  auto end_range = [&](uint64_t offset) {
+    if (num_ranges++ < max_ranges) {
+      out << "    0x" << hex << a.start + range_start << "-0x"
+          << a.start + offset << dec << "\n";
+    }
+    in_range = false;
+  };
+  for (uint64_t offset = 0; offset < length; offset += COMPARE_CHUNK_SIZE) {
+    size_t len = min<uint64_t>(COMPARE_CHUNK_SIZE, length - offset);
+    size_t len_a = read_chunk(in_a, buf_a.data(), len);
+    size_t len_b = read_chunk(in_b, buf_b.data(), len);
+    for (size_t p = 0; p < len; p += page) {
+      size_t n = min(page, len - p);
+      bool readable_a = p + n <= len_a;
+      bool readable_b = p + n <= len_b;
+      bool differs =
+          readable_a != readable_b ||
+          (readable_a && memcmp(buf_a.data() + p, buf_b.data() + p, n) != 0);
+      if (differs) {
+        ++num_divergent;
+        if (!in_range) {
+          range_start = offset + p;
+          in_range = true;
+        }
+      } else if (in_range) {
+        end_range(offset + p);
+      }
+    }
+  }
+  if (in_range) {
+    end_range(length);
+  }
+  if (in_a) {
+    gzclose(in_a);
+  }
+  if (in_b) {
+    gzclose(in_b);
+  }
+
+  if (num_ranges > max_ranges) {
+    out << "    ... and " << num_ranges - max_ranges << " more ranges\n";
+  }
+  if (num_divergent > 0) {
+    out << "    (" << num_divergent << " of " << ceil_page_size(length) / page
+        << " pages differ)\n";
+  }
+  return out.str();
+}
+
+struct MemDiffState {
+  vector<pair<const DumpedMapping*, const DumpedMapping*> > pairs;
+  vector<string> reports;
+  int max_ranges;
+  atomic<size_t> next;
+};
+
+static void* memdiff_thread(void* p) {
+  MemDiffState* state = static_cast<MemDiffState*>(p);
+  while (true) {
+    size_t i = state->next++;
+    if (i >= state->pairs.size()) {
+      return nullptr;
+    }
+    state->reports[i] = compare_mappings(
+        *state->pairs[i].first, *state->pairs[i].second, state->max_ranges);
+  }
+}
+
+static int memdiff(const string& dir_a, const string& dir_b,
+                   const MemDiffFlags& flags, FILE* out) {
+  map<uint64_t, DumpedMapping> a, b;
+  if (!read_dump_index(dir_a, &a) || !read_dump_index(dir_b, &b)) {
+    return 2;
+  }
+
+  bool differ = false;
+  MemDiffState state;
+  state.max_ranges = flags.max_ranges;
+  state.next = 0;
+  for (auto& kv : a) {
+    auto it = b.find(kv.first);
+    if (it == b.end()) {
+      fprintf(out, "Only in %s: %s\n", dir_a.c_str(), kv.second.label.c_str());
+      differ = true;
+    } else {
+      state.pairs.push_back(make_pair(&kv.second, &it->second));
+    }
+  }
+  for (auto& kv : b) {
+    if (a.find(kv.first) == a.end()) {
+      fprintf(out, "Only in %s: %s\n", dir_b.c_str(), kv.second.label.c_str());
+      differ = true;
+    }
+  }
+
+  state.reports.resize(state.pairs.size());
+  int jobs = min<size_t>(flags.jobs, state.pairs.size());
+  vector<pthread_t> threads(jobs);
+  for (auto& thread : threads) {
+    pthread_create(&thread, nullptr, memdiff_thread, &state);
+  }
+  for (auto& thread : threads) {
+    pthread_join(thread, nullptr);
+  }
+
+  for (size_t i = 0; i < state.pairs.size(); ++i) {
+    if (state.reports[i].empty()) {
+      continue;
+    }
+    fprintf(out, "%s\n%s", state.pairs[i].first->label.c_str(),
+            state.reports[i].c_str());
+    differ = true;
+  }
+  return differ ? 1 : 0;
+}
+
+int MemDiffCommand::run(std::vector<std::string>& args) {
+  MemDiffFlags flags;
+  while (parse_memdiff_arg(args, flags)) {
+  }
+
+  if (args.size() != 2 || !verify_not_option(args)) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return memdiff(args[0], args[1], flags, stdout);
+}
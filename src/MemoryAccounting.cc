@@ -0,0 +1,90 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "MemoryAccounting.h"
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <atomic>
+
+using namespace std;
+
+static atomic<int64_t> current_bytes[MemoryAccounting::SUBSYSTEM_COUNT];
+static atomic<int64_t> max_bytes[MemoryAccounting::SUBSYSTEM_COUNT];
+
+/**
+ * Raise the peak of |s| to |value| if that's higher.
+ */
+static void update_peak(MemoryAccounting::Subsystem s, int64_t value) {
+  int64_t peak = max_bytes[s].load();
+  while (value > peak && !max_bytes[s].compare_exchange_weak(peak, value)) {
+  }
+}
+
+void MemoryAccounting::add(Subsystem s, int64_t bytes) {
+  update_peak(s, current_bytes[s] += bytes);
+}
+
+void MemoryAccounting::set(Subsystem s, int64_t bytes) {
+  current_bytes[s] = bytes;
+  update_peak(s, bytes);
+}
+
+int64_t MemoryAccounting::bytes(Subsystem s) { return current_bytes[s]; }
+
+int64_t MemoryAccounting::peak_bytes(Subsystem s) { return max_bytes[s]; }
+
+const char* MemoryAccounting::name(Subsystem s) {
+  switch (s) {
+    case TIMELINE_MARKS:
+      return "timeline marks";
+    case CHECKPOINTS:
+      return "checkpoints";
+    case EMUFS:
+      return "emulated files";
+    case TRACE_WRITE_BUFFERS:
+      return "trace write buffers";
+    case TRACE_READ_AHEAD:
+      return "trace read-ahead";
+    case TASKS:
+      return "tasks";
+    case ADDRESS_SPACES:
+      return "address spaces";
+    case SYSCALLBUF_POOL:
+      return "pooled syscallbufs";
+    default:
+      return "???";
+  }
+}
+
+/**
+ * Return the value in kB of the /proc/self/status field |field|, or 0.
+ */
+static uint64_t self_status_kb(const char* field) {
+  FILE* f = fopen("/proc/self/status", "r");
+  if (!f) {
+    return 0;
+  }
+  size_t field_len = strlen(field);
+  char line[256];
+  uint64_t kb = 0;
+  while (fgets(line, sizeof(line), f)) {
+    if (!strncmp(line, field, field_len) && line[field_len] == ':') {
+      sscanf(line + field_len + 1, "%" SCNu64, &kb);
+      break;
+    }
+  }
+  fclose(f);
+  return kb;
+}
+
+void MemoryAccounting::print(FILE* out) {
+  fprintf(out, "rr resident memory %" PRIu64 " kB, peak %" PRIu64 " kB\n",
+          self_status_kb("VmRSS"), self_status_kb("VmHWM"));
+  fprintf(out, "%-22s %14s %14s\n", "subsystem", "bytes", "peak bytes");
+  for (int i = 0; i < SUBSYSTEM_COUNT; ++i) {
+    Subsystem s = (Subsystem)i;
+    fprintf(out, "%-22s %14" PRId64 " %14" PRId64 "\n", name(s), bytes(s),
+            peak_bytes(s));
+  }
+}
@@ -0,0 +1,60 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_MEMORY_ACCOUNTING_H_
+#define RR_MEMORY_ACCOUNTING_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Counts the memory rr itself uses in each of its larger subsystems, so
+ * that when rr's footprint grows we can tell which one is responsible.
+ * Each subsystem adds and removes bytes as it creates and destroys its
+ * objects; counts are estimates, not exact heap usage. Counters are
+ * global to the process, so they cover every session, checkpoints
+ * included, and may be updated from any thread.
+ *
+ * A nonzero count after all sessions have been destroyed is a leak.
+ */
+class MemoryAccounting {
+public:
+  enum Subsystem {
+    // InternalMarks of ReplayTimelines.
+    TIMELINE_MARKS,
+    // Private memory of reverse-execution checkpoint processes. Not rr's
+    // own memory, but it's what checkpoints cost; set when measured.
+    CHECKPOINTS,
+    // Contents of emulated files, which live in memfds.
+    EMUFS,
+    // CompressedWriter block buffers.
+    TRACE_WRITE_BUFFERS,
+    // Blocks charged against the CompressedReader read-ahead budget.
+    TRACE_READ_AHEAD,
+    // Task objects.
+    TASKS,
+    // AddressSpace objects, excluding their memory maps.
+    ADDRESS_SPACES,
+    // Syscallbufs of exited tasks kept mapped for reuse.
+    SYSCALLBUF_POOL,
+    SUBSYSTEM_COUNT
+  };
+
+  static void add(Subsystem s, int64_t bytes);
+  static void remove(Subsystem s, int64_t bytes) { add(s, -bytes); }
+  /**
+   * For subsystems that are measured rather than counted.
+   */
+  static void set(Subsystem s, int64_t bytes);
+
+  static int64_t bytes(Subsystem s);
+  static int64_t peak_bytes(Subsystem s);
+  static const char* name(Subsystem s);
+
+  /**
+   * Print rr's resident memory and each subsystem's current and peak
+   * bytes to |out|.
+   */
+  static void print(FILE* out);
+};
+
+#endif /* RR_MEMORY_ACCOUNTING_H_ */
@@ -86,22 +86,30 @@ void Monkeypatcher::init_dynamic_syscall_patching(
   }
 }
 
+void Monkeypatcher::init_dynamic_rdtsc_patching(
+    Task* t, int rdtsc_patch_hook_count,
+    remote_ptr<struct syscall_patch_hook> rdtsc_patch_hooks) {
+  if (rdtsc_patch_hook_count) {
+    rdtsc_hooks = t->read_mem(rdtsc_patch_hooks, rdtsc_patch_hook_count);
+  }
+}
+
 template <typename Arch>
 static bool patch_syscall_with_hook_arch(Task* t,
+                                         remote_ptr<uint8_t> patch_start,
                                          const syscall_patch_hook& hook);
 
-static bool patch_syscall_with_hook_x86ish(Task* t,
-                                           const syscall_patch_hook& hook) {
-  // We can use the same patch code on x86 and x86-64.
+static bool patch_with_call_x86ish(Task* t, remote_ptr<uint8_t> patch_start,
+                                   size_t instruction_length,
+                                   const syscall_patch_hook& hook) {
   uint8_t patch[X86CallMonkeypatch::size];
   // We're patching in a relative jump, so we need to compute the offset from
   // the end of the jump to our actual destination.
-  remote_ptr<uint8_t> patch_start = t->regs().ip();
   remote_ptr<uint8_t> patch_end = patch_start + sizeof(patch);
   intptr_t offset = hook.hook_address - patch_end.as_int();
   int32_t offset32 = (int32_t)offset;
   if (offset32 != offset) {
-    LOG(debug) << "syscall can't be patched due to jump out of range from "
+    LOG(debug) << "instruction can't be patched due to jump out of range from "
                << HEX(patch_end.as_int()) << " to " << HEX(hook.hook_address);
     return false;
   }
@@ -110,28 +118,43 @@ static bool patch_syscall_with_hook_x86ish(Task* t,
 
   // pad with NOPs to the next instruction
   static const uint8_t NOP = 0x90;
-  assert(syscall_instruction_length(x86) == syscall_instruction_length(x86_64));
-  uint8_t nops[syscall_instruction_length(x86) + hook.next_instruction_length -
+  uint8_t nops[instruction_length + hook.next_instruction_length -
                sizeof(patch)];
   memset(nops, NOP, sizeof(nops));
   t->write_mem(patch_start + sizeof(patch), nops, sizeof(nops));
   return true;
 }
 
+static bool patch_syscall_with_hook_x86ish(Task* t,
+                                           remote_ptr<uint8_t> patch_start,
+                                           const syscall_patch_hook& hook) {
+  // We can use the same patch code on x86 and x86-64.
+  assert(syscall_instruction_length(x86) == syscall_instruction_length(x86_64));
+  return patch_with_call_x86ish(t, patch_start, syscall_instruction_length(x86),
+                                hook);
+}
+
 template <>
 bool patch_syscall_with_hook_arch<X86Arch>(Task* t,
+                                           remote_ptr<uint8_t> patch_start,
                                            const syscall_patch_hook& hook) {
-  return patch_syscall_with_hook_x86ish(t, hook);
+  return patch_syscall_with_hook_x86ish(t, patch_start, hook);
 }
 
 template <>
 bool patch_syscall_with_hook_arch<X64Arch>(Task* t,
+                                           remote_ptr<uint8_t> patch_start,
                                            const syscall_patch_hook& hook) {
-  return patch_syscall_with_hook_x86ish(t, hook);
+  return patch_syscall_with_hook_x86ish(t, patch_start, hook);
 }
 
-static bool patch_syscall_with_hook(Task* t, const syscall_patch_hook& hook) {
-  RR_ARCH_FUNCTION(patch_syscall_with_hook_arch, t->arch(), t, hook);
+/**
+ * Patch the syscall instruction at |patch_start| to call |hook|.
+ */
+static bool patch_syscall_with_hook(Task* t, remote_ptr<uint8_t> patch_start,
+                                    const syscall_patch_hook& hook) {
+  RR_ARCH_FUNCTION(patch_syscall_with_hook_arch, t->arch(), t, patch_start,
+                   hook);
 }
 
 // TODO de-dup
@@ -189,7 +212,14 @@ bool Monkeypatcher::try_patch_syscall(Task* t) {
       r.set_ip(r.ip() - syscall_instruction_length(t->arch()));
       t->set_regs(r);
 
-      patch_syscall_with_hook(t, hook);
+      patch_syscall_with_hook(t, t->ip(), hook);
+
+      auto m = t->vm()->mapping_of(t->ip());
+      ino_t inode = m.second.id.internal_inode();
+      if (inode && !m.second.fsname.empty()) {
+        patched_syscall_sites[SiteFile(inode, m.second.fsname)].insert(
+            m.first.offset + (t->ip() - m.first.start));
+      }
 
       // Return to caller, which resume normal execution.
       return true;
@@ -198,6 +228,91 @@ bool Monkeypatcher::try_patch_syscall(Task* t) {
   return false;
 }
 
+bool Monkeypatcher::patch_syscall_at(Task* t, remote_ptr<uint8_t> syscall_ip) {
+  remote_ptr<uint8_t> next_ip =
+      syscall_ip + syscall_instruction_length(t->arch());
+  if (!tried_to_patch_syscall_addresses.insert(next_ip.as_int()).second) {
+    return false;
+  }
+
+  syscall_patch_hook dummy;
+  auto next_instruction =
+      t->read_mem(next_ip, sizeof(dummy.next_instruction_bytes));
+  for (auto& hook : syscall_hooks) {
+    if (memcmp(next_instruction.data(), hook.next_instruction_bytes,
+               hook.next_instruction_length) == 0) {
+      return patch_syscall_with_hook(t, syscall_ip, hook);
+    }
+  }
+  return false;
+}
+
+void Monkeypatcher::patch_known_syscall_sites(Task* t) {
+  if (patched_syscall_sites.empty() || syscall_hooks.empty()) {
+    return;
+  }
+  int patched = 0;
+  for (auto& m : t->vm()->memmap()) {
+    const Mapping& mapping = m.first;
+    if (!(mapping.prot & PROT_EXEC) || !(mapping.flags & MAP_PRIVATE)) {
+      continue;
+    }
+    auto sites = patched_syscall_sites.find(
+        SiteFile(m.second.id.internal_inode(), m.second.fsname));
+    if (sites == patched_syscall_sites.end()) {
+      continue;
+    }
+    uint64_t file_start = mapping.offset;
+    uint64_t file_end = file_start + mapping.num_bytes();
+    for (auto it = sites->second.lower_bound(file_start);
+         it != sites->second.end() && *it < file_end; ++it) {
+      remote_ptr<uint8_t> syscall_ip =
+          mapping.start.cast<uint8_t>() + (*it - file_start);
+      // The mapping may have been written to since the site was patched.
+      if (is_at_syscall_instruction(t, syscall_ip) &&
+          patch_syscall_at(t, syscall_ip)) {
+        ++patched;
+      }
+    }
+  }
+  LOG(debug) << "patched " << patched << " known syscall sites";
+}
+
+static const uint8_t rdtsc_insn[] = { 0x0f, 0x31 };
+
+bool Monkeypatcher::try_patch_rdtsc(Task* t) {
+  if (!t->vm()->syscallbuf_enabled() || rdtsc_hooks.empty()) {
+    return false;
+  }
+  // Only patch rdtscs that trap more than once. A one-off rdtsc isn't worth
+  // patching, and leaving its first execution as a plain trap means a
+  // debugger single-stepping over it during replay sees a real rdtsc.
+  if (trapped_rdtsc_addresses.insert(t->ip().as_int()).second) {
+    return false;
+  }
+  return patch_rdtsc_at(t, t->ip().cast<uint8_t>());
+}
+
+bool Monkeypatcher::patch_rdtsc_at(Task* t, remote_ptr<uint8_t> rdtsc_ip) {
+  if (!tried_to_patch_rdtsc_addresses.insert(rdtsc_ip.as_int()).second) {
+    return false;
+  }
+
+  syscall_patch_hook dummy;
+  uint8_t insn[sizeof(rdtsc_insn) + sizeof(dummy.next_instruction_bytes)];
+  if (sizeof(insn) != t->read_bytes_fallible(rdtsc_ip, sizeof(insn), insn) ||
+      memcmp(insn, rdtsc_insn, sizeof(rdtsc_insn))) {
+    return false;
+  }
+  for (auto& hook : rdtsc_hooks) {
+    if (memcmp(insn + sizeof(rdtsc_insn), hook.next_instruction_bytes,
+               hook.next_instruction_length) == 0) {
+      return patch_with_call_x86ish(t, rdtsc_ip, sizeof(rdtsc_insn), hook);
+    }
+  }
+  return false;
+}
+
 template <typename Arch> struct VdsoSymbols {
   vector<typename Arch::ElfSym> symbols;
   vector<char> strtab;
@@ -247,6 +362,22 @@ template <typename Arch> static VdsoSymbols<Arch> read_vdso_symbols(Task* t) {
   return result;
 }
 
+/**
+ * The VDSO is the same in every process of an architecture (see
+ * AddressSpace::offset_to_syscall_in_vdso), so only read its symbols from
+ * a tracee the first time we need them.
+ */
+template <typename Arch>
+static const VdsoSymbols<Arch>& cached_vdso_symbols(Task* t) {
+  static VdsoSymbols<Arch> symbols;
+  static bool read = false;
+  if (!read) {
+    symbols = read_vdso_symbols<Arch>(t);
+    read = true;
+  }
+  return symbols;
+}
+
 /**
  * Return true iff |addr| points to a known |__kernel_vsyscall()|
  * implementation.
@@ -262,7 +393,7 @@ static bool is_kernel_vsyscall(Task* t, remote_ptr<void> addr) {
  * implementation in |t|'s address space.
  */
 static remote_ptr<void> locate_and_verify_kernel_vsyscall(Task* t) {
-  auto syms = read_vdso_symbols<X86Arch>(t);
+  auto& syms = cached_vdso_symbols<X86Arch>(t);
 
   remote_ptr<void> kernel_vsyscall = nullptr;
   // It is unlikely but possible that multiple, versioned __kernel_vsyscall
@@ -352,6 +483,9 @@ void patch_at_preload_init_arch<X86Arch>(Task* t, Monkeypatcher& patcher) {
 
   patcher.init_dynamic_syscall_patching(t, params.syscall_patch_hook_count,
                                         params.syscall_patch_hooks);
+  patcher.init_dynamic_rdtsc_patching(t, params.rdtsc_patch_hook_count,
+                                      params.rdtsc_patch_hooks);
+  patcher.patch_known_syscall_sites(t);
 }
 
 // x86-64 doesn't have a convenient vsyscall-esque function in the VDSO;
@@ -377,6 +511,25 @@ static const named_syscall syscalls_to_monkeypatch[] = {
 };
 #undef S
 
+/**
+ * Return where the x86-64 VDSO symbol with value |st_value| lives in a
+ * VDSO mapped at |vdso_start|.
+ */
+static uintptr_t x64_vdso_symbol_address(remote_ptr<void> vdso_start,
+                                         uint64_t st_value) {
+  // Absolutely-addressed symbols in the VDSO claim to start here.
+  static const uint64_t vdso_static_base = 0xffffffffff700000LL;
+  static const uintptr_t vdso_max_size = 0xffffLL;
+  uintptr_t sym_address = uintptr_t(st_value);
+  // The symbol values can be absolute or relative addresses.
+  // The first part of the assertion is for absolute
+  // addresses, and the second part is for relative.
+  assert((sym_address & ~vdso_max_size) == vdso_static_base ||
+         (sym_address & ~vdso_max_size) == 0);
+  uintptr_t sym_offset = sym_address & vdso_max_size;
+  return vdso_start.as_int() + sym_offset;
+}
+
 // Monkeypatch x86-64 vdso syscalls immediately after exec. The vdso syscalls
 // will cause replay to fail if called by the dynamic loader or some library's
 // static constructors, so we can't wait for our preload library to be
@@ -387,23 +540,14 @@ template <> void patch_after_exec_arch<X64Arch>(Task* t) {
 
   auto vdso_start = t->vm()->vdso().start;
 
-  auto syms = read_vdso_symbols<X64Arch>(t);
+  auto& syms = cached_vdso_symbols<X64Arch>(t);
 
   for (auto& sym : syms.symbols) {
     const char* symname = &syms.strtab[sym.st_name];
     for (size_t j = 0; j < array_length(syscalls_to_monkeypatch); ++j) {
       if (strcmp(symname, syscalls_to_monkeypatch[j].name) == 0) {
-        // Absolutely-addressed symbols in the VDSO claim to start here.
-        static const uint64_t vdso_static_base = 0xffffffffff700000LL;
-        static const uintptr_t vdso_max_size = 0xffffLL;
-        uintptr_t sym_address = uintptr_t(sym.st_value);
-        // The symbol values can be absolute or relative addresses.
-        // The first part of the assertion is for absolute
-        // addresses, and the second part is for relative.
-        assert((sym_address & ~vdso_max_size) == vdso_static_base ||
-               (sym_address & ~vdso_max_size) == 0);
-        uintptr_t sym_offset = sym_address & vdso_max_size;
-        uintptr_t absolute_address = vdso_start.as_int() + sym_offset;
+        uintptr_t absolute_address =
+            x64_vdso_symbol_address(vdso_start, sym.st_value);
 
         uint8_t patch[X64VsyscallMonkeypatch::size];
         uint32_t syscall_number = syscalls_to_monkeypatch[j].syscall_number;
@@ -427,6 +571,36 @@ void patch_at_preload_init_arch<X64Arch>(Task* t, Monkeypatcher& patcher) {
 
   patcher.init_dynamic_syscall_patching(t, params.syscall_patch_hook_count,
                                         params.syscall_patch_hooks);
+  patcher.init_dynamic_rdtsc_patching(t, params.rdtsc_patch_hook_count,
+                                      params.rdtsc_patch_hooks);
+
+  // The VDSO time functions are hot, so route them into the syscall
+  // hook now, instead of taking a traced syscall on the first call to
+  // each one to discover their syscall instructions.
+  auto vdso_start = t->vm()->vdso().start;
+  auto& syms = cached_vdso_symbols<X64Arch>(t);
+  for (auto& sym : syms.symbols) {
+    const char* symname = &syms.strtab[sym.st_name];
+    for (size_t j = 0; j < array_length(syscalls_to_monkeypatch); ++j) {
+      if (strcmp(symname, syscalls_to_monkeypatch[j].name) == 0) {
+        remote_ptr<uint8_t> patch_start =
+            x64_vdso_symbol_address(vdso_start, sym.st_value);
+        uint8_t patch[X64VsyscallMonkeypatch::size];
+        uint32_t syscall_number;
+        t->read_bytes(patch_start, patch);
+        if (!X64VsyscallMonkeypatch::match(patch, &syscall_number)) {
+          continue;
+        }
+        // The syscall instruction follows the 5-byte
+        // "mov $syscall_number, %eax".
+        if (patcher.patch_syscall_at(t, patch_start + 5)) {
+          LOG(debug) << "routed vdso " << symname << " to syscall hook";
+        }
+      }
+    }
+  }
+
+  patcher.patch_known_syscall_sites(t);
 }
 
 void Monkeypatcher::patch_after_exec(Task* t) {
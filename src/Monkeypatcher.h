@@ -3,6 +3,11 @@
 #ifndef RR_MONKEYPATCHER_H_
 #define RR_MONKEYPATCHER_H_
 
+#include <sys/types.h>
+
+#include <map>
+#include <set>
+#include <string>
 #include <unordered_set>
 #include <vector>
 
@@ -26,13 +31,20 @@ class Task;
  *
  * 3) Patch syscall instructions whose following instructions match a known
  * pattern to call the syscall hook.
+ *
+ * 4) Patch rdtsc instructions whose following instruction matches a known
+ * pattern to call the rdtsc hook, so they stop trapping to rr.
  */
 class Monkeypatcher {
 public:
   Monkeypatcher() {}
   Monkeypatcher(const Monkeypatcher& o)
       : syscall_hooks(o.syscall_hooks),
-        tried_to_patch_syscall_addresses(o.tried_to_patch_syscall_addresses) {}
+        tried_to_patch_syscall_addresses(o.tried_to_patch_syscall_addresses),
+        patched_syscall_sites(o.patched_syscall_sites),
+        rdtsc_hooks(o.rdtsc_hooks),
+        trapped_rdtsc_addresses(o.trapped_rdtsc_addresses),
+        tried_to_patch_rdtsc_addresses(o.tried_to_patch_rdtsc_addresses) {}
 
   /**
    * Apply any necessary patching immediately after exec.
@@ -56,10 +68,52 @@ public:
    */
   bool try_patch_syscall(Task* t);
 
+  /**
+   * Patch the syscall instruction at |syscall_ip| to call the syscall hook,
+   * without waiting for a task to execute it. Returns true if a hook
+   * matched the instructions following it.
+   */
+  bool patch_syscall_at(Task* t, remote_ptr<uint8_t> syscall_ip);
+
+  /**
+   * Patch the syscall sites in |t|'s file mappings that were patched
+   * in this address space, or in the address spaces it was forked or
+   * exec'd from, after trapping there. Called once the syscall hooks
+   * are known, so the sites don't each have to trap again first.
+   */
+  void patch_known_syscall_sites(Task* t);
+
+  /**
+   * Learn the syscall sites patched in the address space |o|, which
+   * is being replaced by an exec.
+   */
+  void inherit_syscall_sites(const Monkeypatcher& o) {
+    patched_syscall_sites = o.patched_syscall_sites;
+  }
+
+  /**
+   * Try to patch the rdtsc instruction at ip() that |t| just trapped on.
+   * If this returns true, the rdtsc was patched and ip() is unchanged, so
+   * resuming execution runs the patched code instead of the rdtsc. If this
+   * returns false, the rdtsc should be emulated as normal.
+   */
+  bool try_patch_rdtsc(Task* t);
+
+  /**
+   * Patch the rdtsc instruction at |rdtsc_ip| to call the rdtsc hook.
+   * Returns true if a hook matched the instruction following it. Replay
+   * uses this to redo a patch the recording made.
+   */
+  bool patch_rdtsc_at(Task* t, remote_ptr<uint8_t> rdtsc_ip);
+
   void init_dynamic_syscall_patching(
       Task* t, int syscall_patch_hook_count,
       remote_ptr<syscall_patch_hook> syscall_patch_hooks);
 
+  void init_dynamic_rdtsc_patching(
+      Task* t, int rdtsc_patch_hook_count,
+      remote_ptr<syscall_patch_hook> rdtsc_patch_hooks);
+
 private:
   /**
    * The list of supported syscall patches obtained from the preload
@@ -72,6 +126,26 @@ private:
    * (or are currently trying) to patch.
    */
   std::unordered_set<uintptr_t> tried_to_patch_syscall_addresses;
+  /**
+   * The file offsets of syscall instructions that try_patch_syscall()
+   * patched, keyed by the inode and name of the file. These are the
+   * ones recorded in the trace, so replay sees the same ones and so
+   * the same eager patches.
+   */
+  typedef std::pair<ino_t, std::string> SiteFile;
+  std::map<SiteFile, std::set<uint64_t> > patched_syscall_sites;
+  /**
+   * Like |syscall_hooks|, but matching the instruction after an rdtsc.
+   */
+  std::vector<syscall_patch_hook> rdtsc_hooks;
+  /**
+   * The addresses of rdtsc instructions that have trapped at least once.
+   */
+  std::unordered_set<uintptr_t> trapped_rdtsc_addresses;
+  /**
+   * The addresses of rdtsc instructions we've tried to patch.
+   */
+  std::unordered_set<uintptr_t> tried_to_patch_rdtsc_addresses;
 };
 
 #endif /* RR_MONKEYPATCHER_H_ */
@@ -0,0 +1,187 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <set>
+
+#include "Command.h"
+#include "main.h"
+#include "ScopedFd.h"
+#include "TraceStream.h"
+#include "util.h"
+
+using namespace std;
+
+class PackCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  PackCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static PackCommand singleton;
+};
+
+PackCommand PackCommand::singleton(
+    "pack",
+    " rr pack [OPTION]... [<trace_dir>]\n"
+    "  Copy the files outside the trace directory that a trace maps into\n"
+    "  the trace directory, so it can be moved to another machine.\n"
+    "  -j, --jobs=<N>             copy N files at once (default: number of\n"
+    "                             CPUs)\n");
+
+struct PackFlags {
+  int jobs;
+
+  PackFlags() : jobs(get_num_cpus()) {}
+};
+
+static bool parse_pack_arg(std::vector<std::string>& args, PackFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'j', "jobs", HAS_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'j':
+      if (!opt.verify_valid_int(1, 1024)) {
+        return false;
+      }
+      flags.jobs = opt.int_value;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+struct PackedFile {
+  string file_name;
+  string packed_path;
+  // Object store files and hardlinks in the trace are never modified, so
+  // a hardlink is as good as a copy.
+  bool can_link;
+};
+
+struct PackState {
+  vector<PackedFile> files;
+  string packed_dir;
+  atomic<size_t> next;
+  atomic<bool> failed;
+};
+
+static bool copy_file(const PackedFile& f, const string& tmp_path) {
+  if (f.can_link && link(f.file_name.c_str(), tmp_path.c_str()) == 0) {
+    return true;
+  }
+  ScopedFd src(f.file_name.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (!src.is_open() || fstat(src, &st)) {
+    return false;
+  }
+  ScopedFd dst(tmp_path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC,
+               0600);
+  if (!dst.is_open()) {
+    return false;
+  }
+  // Replay checks the copy's mode and mtime against the recorded ones.
+  struct timespec times[2] = { st.st_atim, st.st_mtim };
+  return copy_file_contents(src, dst, 0, st.st_size, st.st_size) &&
+         fchmod(dst, st.st_mode & 07777) == 0 && futimens(dst, times) == 0;
+}
+
+static void* pack_thread(void* p) {
+  PackState* state = static_cast<PackState*>(p);
+  while (true) {
+    size_t i = state->next++;
+    if (i >= state->files.size()) {
+      return nullptr;
+    }
+    const PackedFile& f = state->files[i];
+    // Copy to a temporary and rename it into place, so an interrupted
+    // pack never leaves a partial copy for replay to use.
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s/tmp_%zu",
+             state->packed_dir.c_str(), i);
+    if (!copy_file(f, tmp_path) ||
+        rename(tmp_path, f.packed_path.c_str())) {
+      fprintf(stderr, "Can't copy %s into the trace: %s\n",
+              f.file_name.c_str(), strerror(errno));
+      unlink(tmp_path);
+      state->failed = true;
+    }
+  }
+}
+
+static int pack(const string& trace_dir, const PackFlags& flags) {
+  TraceReader trace(trace_dir);
+  PackState state;
+  state.packed_dir = trace.dir() + "/packed";
+  state.next = 0;
+  state.failed = false;
+  string local_prefix = trace.dir() + "/";
+  set<string> seen;
+
+  while (!trace.mmaps_at_end()) {
+    TraceReader::MappedData data;
+    trace.read_mapped_region(&data);
+    if ((data.source != TraceReader::SOURCE_FILE &&
+         data.source != TraceReader::SOURCE_SNAPSHOT) ||
+        !data.unpacked || !seen.insert(data.file_name).second) {
+      continue;
+    }
+    // Old traces record hardlinks in the trace with absolute paths.
+    PackedFile f = { data.file_name, trace.packed_file_path(data.file_name),
+                     data.source == TraceReader::SOURCE_SNAPSHOT ||
+                         data.file_name.compare(0, local_prefix.size(),
+                                                local_prefix) == 0 };
+    state.files.push_back(f);
+  }
+  if (state.files.empty()) {
+    return 0;
+  }
+  if (mkdir(state.packed_dir.c_str(), S_IRWXU | S_IRWXG) && errno != EEXIST) {
+    fprintf(stderr, "Can't create %s: %s\n", state.packed_dir.c_str(),
+            strerror(errno));
+    return 1;
+  }
+
+  // Copying is I/O-bound, and large files are copied in the kernel, so
+  // keep several copies in flight.
+  int jobs = min<int>(flags.jobs, state.files.size());
+  vector<pthread_t> threads(jobs);
+  for (auto& thread : threads) {
+    pthread_create(&thread, nullptr, pack_thread, &state);
+  }
+  for (auto& thread : threads) {
+    pthread_join(thread, nullptr);
+  }
+  return state.failed ? 1 : 0;
+}
+
+int PackCommand::run(std::vector<std::string>& args) {
+  PackFlags flags;
+  while (parse_pack_arg(args, flags)) {
+  }
+
+  string trace_dir;
+  if (!parse_optional_trace_dir(args, &trace_dir)) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return pack(trace_dir, flags);
+}
@@ -0,0 +1,156 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "ParallelTraceReader.h"
+
+#include <pthread.h>
+
+#include <algorithm>
+
+#include "util.h"
+
+using namespace std;
+
+vector<ParallelTraceReader::Range> ParallelTraceReader::split(
+    TraceFrame::Time start, TraceFrame::Time end) {
+  vector<Range> ranges;
+  TraceReader indexed(trace);
+  for (auto time : indexed.indexed_frame_times()) {
+    if (start < time && time <= end) {
+      if (ranges.empty()) {
+        ranges.push_back(Range{ start, 0 });
+      }
+      ranges.back().end = time - 1;
+      ranges.push_back(Range{ time, 0 });
+    }
+  }
+  if (ranges.empty()) {
+    ranges.push_back(Range{ start, 0 });
+  }
+  ranges.back().end = end;
+  return ranges;
+}
+
+namespace {
+
+struct ParallelRead {
+  const TraceReader* trace;
+  const vector<ParallelTraceReader::Range>* ranges;
+  const function<void(TraceReader&, size_t)>* read;
+  // Set when a range's read has returned.
+  vector<bool> finished;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  // Next range for a worker to read.
+  size_t next_range;
+  // Next range to pass to |done|.
+  size_t next_done;
+  // Workers don't run ahead of |done| by more than this many ranges.
+  size_t max_pending;
+};
+
+} // namespace
+
+/**
+ * Call |read| for |range| with a copy of |trace| moved to its start.
+ */
+static void read_range(const TraceReader& trace,
+                       const ParallelTraceReader::Range& range,
+                       const function<void(TraceReader&, size_t)>& read,
+                       size_t index) {
+  TraceReader reader(trace);
+  // Avoid decompressing blocks entirely before the range, if we can.
+  reader.skip_to(range.start);
+  read(reader, index);
+}
+
+static void* read_ranges_thread(void* p) {
+  ParallelRead& r = *static_cast<ParallelRead*>(p);
+  pthread_mutex_lock(&r.mutex);
+  while (true) {
+    while (r.next_range < r.ranges->size() &&
+           r.next_range >= r.next_done + r.max_pending) {
+      pthread_cond_wait(&r.cond, &r.mutex);
+    }
+    if (r.next_range == r.ranges->size()) {
+      break;
+    }
+    size_t index = r.next_range++;
+    pthread_mutex_unlock(&r.mutex);
+
+    read_range(*r.trace, (*r.ranges)[index], *r.read, index);
+
+    pthread_mutex_lock(&r.mutex);
+    r.finished[index] = true;
+    pthread_cond_broadcast(&r.cond);
+  }
+  pthread_mutex_unlock(&r.mutex);
+  return nullptr;
+}
+
+void ParallelTraceReader::for_each(
+    const vector<Range>& ranges, size_t num_threads,
+    const function<void(TraceReader&, size_t)>& read,
+    const function<void(size_t)>& done) {
+  if (!num_threads) {
+    num_threads = get_num_cpus();
+  }
+  num_threads = min(num_threads, ranges.size());
+  if (num_threads <= 1) {
+    for (size_t i = 0; i < ranges.size(); ++i) {
+      read_range(trace, ranges[i], read, i);
+      done(i);
+    }
+    return;
+  }
+
+  ParallelRead r;
+  r.trace = &trace;
+  r.ranges = &ranges;
+  r.read = &read;
+  r.finished.resize(ranges.size());
+  pthread_mutex_init(&r.mutex, nullptr);
+  pthread_cond_init(&r.cond, nullptr);
+  r.next_range = 0;
+  r.next_done = 0;
+  r.max_pending = 2 * num_threads;
+  vector<pthread_t> threads(num_threads);
+  for (auto& thread : threads) {
+    pthread_create(&thread, nullptr, read_ranges_thread, &r);
+  }
+  for (size_t i = 0; i < ranges.size(); ++i) {
+    pthread_mutex_lock(&r.mutex);
+    while (!r.finished[i]) {
+      pthread_cond_wait(&r.cond, &r.mutex);
+    }
+    pthread_mutex_unlock(&r.mutex);
+
+    done(i);
+
+    pthread_mutex_lock(&r.mutex);
+    ++r.next_done;
+    pthread_cond_broadcast(&r.cond);
+    pthread_mutex_unlock(&r.mutex);
+  }
+  for (auto& thread : threads) {
+    pthread_join(thread, nullptr);
+  }
+  pthread_cond_destroy(&r.cond);
+  pthread_mutex_destroy(&r.mutex);
+}
+
+/*static*/ void ParallelTraceReader::for_each_frame(
+    TraceReader& reader, const Range& range, bool with_raw_data,
+    const function<void(TraceReader&, const TraceFrame&)>& fn) {
+  while (!reader.at_end()) {
+    auto frame = reader.read_frame();
+    if (range.end < frame.time()) {
+      return;
+    }
+    if (range.start <= frame.time()) {
+      fn(reader, frame);
+    }
+    TraceReader::RawData data;
+    while (with_raw_data && reader.read_raw_data_for_frame(frame, data)) {
+    }
+  }
+}
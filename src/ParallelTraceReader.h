@@ -0,0 +1,70 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_PARALLEL_TRACE_READER_H_
+#define RR_PARALLEL_TRACE_READER_H_
+
+#include <functional>
+#include <vector>
+
+#include "TraceStream.h"
+
+/**
+ * Reads the frames of a trace on several threads. The trace's sidecar
+ * index lists frames that can be decoded without reading any earlier
+ * frames, so a range of frames is split at those into independent parts,
+ * each read through its own copy of the TraceReader.
+ *
+ * This is the entry point for tools that link librrcore to analyze
+ * traces; see DumpCommand for an example.
+ */
+class ParallelTraceReader {
+public:
+  /**
+   * Frames [start, end] of the trace.
+   */
+  struct Range {
+    TraceFrame::Time start;
+    TraceFrame::Time end;
+  };
+
+  /**
+   * |trace| must be at the start of the trace. It isn't moved.
+   */
+  ParallelTraceReader(const TraceReader& trace) : trace(trace) {}
+
+  /**
+   * Split frames [start, end] into ranges that can be read independently,
+   * in trace order. Returns the whole range as one part if the trace has
+   * no index.
+   */
+  std::vector<Range> split(TraceFrame::Time start, TraceFrame::Time end);
+
+  /**
+   * Call |read(reader, i)| for each of |ranges| on up to |num_threads|
+   * threads (0 means one per CPU), with |reader| a copy of the trace
+   * positioned at or a little before ranges[i].start, so |read| must
+   * skip frames before the range and stop after its end. Then call
+   * |done(i)| on this thread, in order, once |read| has returned for
+   * ranges 0..i, so results can be combined in trace order. Reads don't
+   * get more than a couple of ranges per thread ahead of |done|, which
+   * bounds the memory buffered results use. |read| must be thread-safe.
+   */
+  void for_each(const std::vector<Range>& ranges, size_t num_threads,
+                const std::function<void(TraceReader&, size_t)>& read,
+                const std::function<void(size_t)>& done);
+
+  /**
+   * Read |reader| up to the end of |range|, calling |fn| for each frame
+   * in it. If |with_raw_data|, |fn| may read raw data of its frame, and
+   * whatever it doesn't read is skipped for it; otherwise raw data isn't
+   * touched, and isn't decompressed.
+   */
+  static void for_each_frame(
+      TraceReader& reader, const Range& range, bool with_raw_data,
+      const std::function<void(TraceReader&, const TraceFrame&)>& fn);
+
+private:
+  const TraceReader& trace;
+};
+
+#endif /* RR_PARALLEL_TRACE_READER_H_ */
@@ -6,11 +6,14 @@
 #include <err.h>
 #include <fcntl.h>
 #include <linux/perf_event.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
+#include <sys/utsname.h>
 #include <unistd.h>
 
 #include <algorithm>
@@ -23,6 +26,10 @@
 using namespace std;
 
 static bool attributes_initialized;
+// Some kernels don't apply a new sample period set with
+// PERF_EVENT_IOC_PERIOD until the counter next overflows, in which case we
+// have to reopen the ticks counter to change its period.
+static bool has_ioc_period_bug;
 static struct perf_event_attr ticks_attr;
 static struct perf_event_attr page_faults_attr;
 static struct perf_event_attr hw_interrupts_attr;
@@ -178,10 +185,6 @@ static void init_attributes() {
                        PERF_COUNT_SW_PAGE_FAULTS);
 }
 
-PerfCounters::PerfCounters(pid_t tid) : tid(tid), started(false) {
-  init_attributes();
-}
-
 static ScopedFd start_counter(pid_t tid, int group_fd,
                               struct perf_event_attr* attr) {
   int fd = syscall(__NR_perf_event_open, attr, tid, -1, group_fd, 0);
@@ -194,7 +197,125 @@ static ScopedFd start_counter(pid_t tid, int group_fd,
   return fd;
 }
 
+static void check_for_ioc_period_bug() {
+  // Start a ticks counter on ourselves with a huge period, then lower the
+  // period to 1. If the kernel applies the new period immediately, the
+  // counter overflows (and becomes readable) as soon as we execute a
+  // conditional branch.
+  struct perf_event_attr attr = ticks_attr;
+  attr.sample_period = 0xffffffff;
+  ScopedFd bug_fd = start_counter(0, -1, &attr);
+
+  uint64_t new_period = 1;
+  if (ioctl(bug_fd, PERF_EVENT_IOC_PERIOD, &new_period)) {
+    FATAL() << "PERF_EVENT_IOC_PERIOD failed";
+  }
+
+  struct pollfd poll_bug_fd = { bug_fd, POLLIN, 0 };
+  poll(&poll_bug_fd, 1, 0);
+  has_ioc_period_bug = poll_bug_fd.revents == 0;
+  LOG(debug) << "PERF_EVENT_IOC_PERIOD bug: " << has_ioc_period_bug;
+}
+
+/**
+ * The ioc-period probe's result only depends on the kernel and the ticks
+ * event, so it's cached in $TMPDIR/rr-probes-<uid> for later rr processes
+ * on the same boot. This returns the key the cached result is valid for.
+ */
+static string probe_cache_key() {
+  char boot_id[64] = "";
+  FILE* f = fopen("/proc/sys/kernel/random/boot_id", "r");
+  if (!f) {
+    return string();
+  }
+  int matched = fscanf(f, "%63s", boot_id);
+  fclose(f);
+  struct utsname uts;
+  if (matched != 1 || uname(&uts)) {
+    return string();
+  }
+  char key[256];
+  snprintf(key, sizeof(key), "%s %s %s %llx", boot_id, uts.release,
+           uts.version, (unsigned long long)ticks_attr.config);
+  return key;
+}
+
+static string probe_cache_path() {
+  const char* tmp_dir = getenv("TMPDIR");
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path) - 1, "%s/rr-probes-%d",
+           tmp_dir ? tmp_dir : "/tmp", getuid());
+  return path;
+}
+
+static bool read_cached_ioc_period_bug(const string& key) {
+  FILE* f = fopen(probe_cache_path().c_str(), "r");
+  if (!f) {
+    return false;
+  }
+  char line[512];
+  bool found = false;
+  struct stat st;
+  // Don't trust a file someone else left in a shared directory.
+  if (!fstat(fileno(f), &st) && st.st_uid == getuid() &&
+      fgets(line, sizeof(line), f)) {
+    size_t len = strlen(line);
+    if (len > key.size() + 1 && !key.compare(0, key.size(), line, key.size()) &&
+        line[key.size()] == ' ') {
+      has_ioc_period_bug = line[key.size() + 1] == '1';
+      found = true;
+    }
+  }
+  fclose(f);
+  return found;
+}
+
+static void write_cached_ioc_period_bug(const string& key) {
+  // Write a temporary and rename it into place so concurrent rr processes
+  // never see a partial file.
+  string path = probe_cache_path();
+  char tmp_path[PATH_MAX];
+  snprintf(tmp_path, sizeof(tmp_path) - 1, "%s.%d", path.c_str(), getpid());
+  FILE* f = fopen(tmp_path, "w");
+  if (!f) {
+    return;
+  }
+  bool ok = fprintf(f, "%s %d\n", key.c_str(), has_ioc_period_bug) > 0;
+  ok = fclose(f) == 0 && ok;
+  if (!ok || rename(tmp_path, path.c_str())) {
+    unlink(tmp_path);
+  }
+}
+
+PerfCounters::PerfCounters(pid_t tid) : tid(tid), started(false) {
+  if (!attributes_initialized) {
+    init_attributes();
+    string key = probe_cache_key();
+    if (key.empty() || !read_cached_ioc_period_bug(key)) {
+      check_for_ioc_period_bug();
+      if (!key.empty()) {
+        write_cached_ioc_period_bug(key);
+      }
+    }
+  }
+}
+
 void PerfCounters::reset(Ticks ticks_period) {
+  if (started && !has_ioc_period_bug) {
+    // Reprogram the counters we already have rather than paying for
+    // reopening them on every resume. IOC_RESET only zeroes the counts,
+    // so IOC_PERIOD is needed even when the period hasn't changed: it's
+    // what restarts the countdown to the next overflow interrupt.
+    if (ioctl(fd_ticks, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP)) {
+      FATAL() << "Failed to reset counters";
+    }
+    uint64_t period = ticks_period;
+    if (ioctl(fd_ticks, PERF_EVENT_IOC_PERIOD, &period)) {
+      FATAL() << "Failed to set ticks period to " << ticks_period;
+    }
+    return;
+  }
+
   stop();
 
   struct perf_event_attr attr = ticks_attr;
@@ -0,0 +1,373 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+
+#include "preload/preload_interface.h"
+
+#include "Command.h"
+#include "kernel_metadata.h"
+#include "main.h"
+#include "ReplaySession.h"
+#include "TraceStream.h"
+
+using namespace std;
+
+class ProfileCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  ProfileCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static ProfileCommand singleton;
+};
+
+ProfileCommand ProfileCommand::singleton(
+    "profile",
+    " rr profile [OPTION]... [<trace_dir>]\n"
+    "  Print a JSON summary of the trace per syscall and per thread: how\n"
+    "  often each syscall was trapped by rr or buffered by the syscallbuf,\n"
+    "  the raw bytes recorded for it, and the ticks threads ran between\n"
+    "  events.\n"
+    "  -t, --sample-ticks=<N>     instead, replay the trace and sample each\n"
+    "                             thread's stack every N ticks, printing the\n"
+    "                             samples as folded stacks (\"a;b;c count\"\n"
+    "                             lines, as read by flamegraph.pl and\n"
+    "                             speedscope). Ticks are deterministic, so\n"
+    "                             profiles of the same trace are identical.\n"
+    "  -o, --output=<FILE>        write the profile to FILE instead of stdout\n");
+
+struct ProfileFlags {
+  // Zero for the trace summary.
+  Ticks sample_ticks;
+  string output;
+
+  ProfileFlags() : sample_ticks(0) {}
+};
+
+/**
+ * Sampling more often than this would mostly measure skid.
+ */
+static const Ticks MIN_SAMPLE_TICKS = 10000;
+/**
+ * Don't follow frame pointers forever through a corrupt stack.
+ */
+static const size_t MAX_SAMPLE_FRAMES = 64;
+
+static bool parse_profile_arg(std::vector<std::string>& args,
+                              ProfileFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = {
+    { 't', "sample-ticks", HAS_PARAMETER }, { 'o', "output", HAS_PARAMETER }
+  };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 't':
+      if (!opt.verify_valid_int(MIN_SAMPLE_TICKS)) {
+        return false;
+      }
+      flags.sample_ticks = opt.int_value;
+      break;
+    case 'o':
+      flags.output = opt.value;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+struct SyscallProfile {
+  SyscallProfile()
+      : trapped(0), buffered(0), raw_bytes(0), ticks_before_trapped(0) {}
+  uint64_t total() const { return trapped + buffered; }
+  uint64_t trapped;
+  uint64_t buffered;
+  uint64_t raw_bytes;
+  // Ticks the thread ran since its previous event, summed over the trapped
+  // calls.
+  uint64_t ticks_before_trapped;
+};
+
+struct TidProfile {
+  TidProfile()
+      : events(0),
+        trapped_syscalls(0),
+        buffered_syscalls(0),
+        raw_bytes(0),
+        ticks(0) {}
+  uint64_t events;
+  uint64_t trapped_syscalls;
+  uint64_t buffered_syscalls;
+  uint64_t raw_bytes;
+  uint64_t ticks;
+};
+
+typedef pair<SupportedArch, int> SyscallKey;
+
+static const char* arch_name(SupportedArch arch) {
+  switch (arch) {
+    case x86:
+      return "x86";
+    case x86_64:
+      return "x86_64";
+    default:
+      return "unknown";
+  }
+}
+
+static void profile_syscallbuf_flush(const TraceFrame& frame,
+                                     const TraceReader::RawData& data,
+                                     map<SyscallKey, SyscallProfile>& syscalls,
+                                     TidProfile& tid) {
+  if (data.data.size() < sizeof(struct syscallbuf_hdr)) {
+    return;
+  }
+  auto flush_hdr = reinterpret_cast<const syscallbuf_hdr*>(data.data.data());
+  size_t num_rec_bytes =
+      min<size_t>(flush_hdr->num_rec_bytes,
+                  data.data.size() - sizeof(struct syscallbuf_hdr));
+  auto record_ptr = reinterpret_cast<const uint8_t*>(flush_hdr + 1);
+  auto end_ptr = record_ptr + num_rec_bytes;
+  while (record_ptr + sizeof(struct syscallbuf_record) <= end_ptr) {
+    auto record = reinterpret_cast<const struct syscallbuf_record*>(record_ptr);
+    if (record->size < sizeof(*record)) {
+      fprintf(stderr, "Malformed trace file (bad record size)\n");
+      abort();
+    }
+    auto& p = syscalls[SyscallKey(frame.event().arch(), record->syscallno)];
+    ++p.buffered;
+    p.raw_bytes += record->size - sizeof(*record);
+    ++tid.buffered_syscalls;
+    record_ptr += stored_record_size(record->size);
+  }
+}
+
+static void print_profile(const map<SyscallKey, SyscallProfile>& syscalls,
+                          const map<pid_t, TidProfile>& tids, FILE* out) {
+  vector<pair<SyscallKey, SyscallProfile> > sorted_syscalls(syscalls.begin(),
+                                                             syscalls.end());
+  stable_sort(sorted_syscalls.begin(), sorted_syscalls.end(),
+              [](const pair<SyscallKey, SyscallProfile>& a,
+                 const pair<SyscallKey, SyscallProfile>& b) {
+    return a.second.total() > b.second.total();
+  });
+  vector<pair<pid_t, TidProfile> > sorted_tids(tids.begin(), tids.end());
+  stable_sort(sorted_tids.begin(), sorted_tids.end(),
+              [](const pair<pid_t, TidProfile>& a,
+                 const pair<pid_t, TidProfile>& b) {
+    return a.second.raw_bytes > b.second.raw_bytes;
+  });
+
+  fprintf(out, "{\n  \"syscalls\": [");
+  const char* sep = "";
+  for (auto& it : sorted_syscalls) {
+    const SyscallProfile& p = it.second;
+    fprintf(out, "%s\n    { \"name\": \"%s\", \"number\": %d, "
+                 "\"arch\": \"%s\", \"trapped\": %" PRIu64 ", "
+                 "\"buffered\": %" PRIu64 ", \"buffered_ratio\": %.4f, "
+                 "\"raw_bytes\": %" PRIu64 ", "
+                 "\"mean_ticks_before_trapped\": %.1f }",
+            sep, syscall_name(it.first.second, it.first.first).c_str(),
+            it.first.second, arch_name(it.first.first), p.trapped, p.buffered,
+            double(p.buffered) / p.total(), p.raw_bytes,
+            p.trapped ? double(p.ticks_before_trapped) / p.trapped : 0.0);
+    sep = ",";
+  }
+  fprintf(out, "\n  ],\n  \"tids\": [");
+  sep = "";
+  for (auto& it : sorted_tids) {
+    const TidProfile& p = it.second;
+    uint64_t syscalls = p.trapped_syscalls + p.buffered_syscalls;
+    fprintf(out, "%s\n    { \"tid\": %d, \"events\": %" PRIu64 ", "
+                 "\"trapped_syscalls\": %" PRIu64 ", "
+                 "\"buffered_syscalls\": %" PRIu64 ", "
+                 "\"buffered_ratio\": %.4f, \"raw_bytes\": %" PRIu64 ", "
+                 "\"ticks\": %" PRIu64 ", "
+                 "\"mean_ticks_between_events\": %.1f }",
+            sep, it.first, p.events, p.trapped_syscalls, p.buffered_syscalls,
+            syscalls ? double(p.buffered_syscalls) / syscalls : 0.0,
+            p.raw_bytes, p.ticks, double(p.ticks) / p.events);
+    sep = ",";
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
+
+static void profile(const string& trace_dir, FILE* out) {
+  TraceReader trace(trace_dir);
+  map<SyscallKey, SyscallProfile> syscalls;
+  map<pid_t, TidProfile> tids;
+  map<pid_t, Ticks> last_ticks;
+
+  while (!trace.at_end()) {
+    auto frame = trace.read_frame();
+    auto ev = frame.event();
+    auto& tid = tids[frame.tid()];
+    ++tid.events;
+    // Ticks are counted per thread, from the thread's start.
+    Ticks ticks = frame.ticks() - last_ticks[frame.tid()];
+    last_ticks[frame.tid()] = frame.ticks();
+    tid.ticks += ticks;
+
+    SyscallProfile* syscall = nullptr;
+    if (ev.type == EV_SYSCALL) {
+      syscall = &syscalls[SyscallKey(ev.arch(), int(ev.data))];
+      if (ev.state == SYSCALL_ENTRY) {
+        ++syscall->trapped;
+        syscall->ticks_before_trapped += ticks;
+        ++tid.trapped_syscalls;
+      }
+    }
+
+    TraceReader::RawData data;
+    bool first = true;
+    while (trace.read_raw_data_for_frame(frame, data)) {
+      tid.raw_bytes += data.data.size();
+      if (syscall) {
+        syscall->raw_bytes += data.data.size();
+      }
+      if (first && ev.type == EV_SYSCALLBUF_FLUSH) {
+        profile_syscallbuf_flush(frame, data, syscalls, tid);
+      }
+      first = false;
+    }
+  }
+
+  print_profile(syscalls, tids, out);
+}
+
+/**
+ * Name the code at |addr| as "<file>+0x<offset into file>", which stays
+ * meaningful across runs with different load addresses, or as the bare
+ * address if it isn't in a file mapping.
+ */
+static string frame_name(Task* t, remote_ptr<void> addr) {
+  char buf[100];
+  auto& mem = t->vm()->memmap();
+  auto it = mem.find(Mapping(addr, 1));
+  if (it == mem.end() || it->second.fsname.empty()) {
+    snprintf(buf, sizeof(buf), "%p", (void*)addr.as_int());
+    return buf;
+  }
+  const string& fsname = it->second.fsname;
+  size_t slash = fsname.rfind('/');
+  snprintf(buf, sizeof(buf), "+0x%" PRIx64,
+           uint64_t(addr - it->first.start + it->first.offset));
+  return (slash == string::npos ? fsname : fsname.substr(slash + 1)) + buf;
+}
+
+/**
+ * Return |t|'s stack, outermost frame first, found by following frame
+ * pointers from its current registers. Code built without frame pointers
+ * shows up with its callers missing.
+ */
+static string sample_stack(Task* t) {
+  size_t word_size = t->arch() == x86 ? 4 : 8;
+  vector<string> frames;
+  frames.push_back(frame_name(t, t->ip()));
+  remote_ptr<void> bp = t->regs().bp();
+  while (frames.size() < MAX_SAMPLE_FRAMES && !bp.is_null()) {
+    uint64_t words[2] = { 0, 0 };
+    uint8_t buf[16];
+    if (t->read_bytes_fallible(bp, 2 * word_size, buf) !=
+        ssize_t(2 * word_size)) {
+      break;
+    }
+    for (int i = 0; i < 2; ++i) {
+      memcpy(&words[i], buf + i * word_size, word_size);
+    }
+    // The stack grows down, so the caller's frame must be above ours.
+    if (!words[1] || words[0] <= bp.as_int()) {
+      break;
+    }
+    // Name the call instruction, not the instruction after it.
+    frames.push_back(frame_name(t, remote_ptr<void>(words[1] - 1)));
+    bp = words[0];
+  }
+
+  string stack = t->name();
+  for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+    stack += ";" + *it;
+  }
+  return stack;
+}
+
+static void sample(const string& trace_dir, Ticks sample_ticks, FILE* out) {
+  ReplaySession::shr_ptr session = ReplaySession::create(trace_dir);
+  session->set_visible_execution(false);
+  map<TaskUid, Ticks> next_sample;
+  map<string, uint64_t> samples;
+
+  while (true) {
+    Task* t = session->current_task();
+    Ticks ticks_target = 0;
+    if (t) {
+      Ticks& next = next_sample[t->tuid()];
+      if (!next) {
+        next = t->tick_count() + sample_ticks;
+      }
+      ticks_target = next;
+    }
+    auto result = session->replay_step(RUN_CONTINUE, 0, ticks_target);
+    if (result.status == REPLAY_EXITED) {
+      break;
+    }
+    if (result.break_status.reason != BREAK_TICKS_TARGET) {
+      continue;
+    }
+    t = result.break_status.task;
+    ++samples[sample_stack(t)];
+    // Replay stops a little short of the target. Always move the target
+    // forward, so a thread that can't get any closer still makes progress.
+    Ticks& next = next_sample[t->tuid()];
+    next = max(next, t->tick_count()) + sample_ticks;
+  }
+
+  for (auto& it : samples) {
+    fprintf(out, "%s %" PRIu64 "\n", it.first.c_str(), it.second);
+  }
+}
+
+int ProfileCommand::run(std::vector<std::string>& args) {
+  ProfileFlags flags;
+  while (parse_profile_arg(args, flags)) {
+  }
+
+  string trace_dir;
+  if (!parse_optional_trace_dir(args, &trace_dir)) {
+    print_help(stderr);
+    return 1;
+  }
+
+  FILE* out = stdout;
+  if (!flags.output.empty()) {
+    out = fopen(flags.output.c_str(), "w");
+    if (!out) {
+      fprintf(stderr, "Can't open %s: %s\n", flags.output.c_str(),
+              strerror(errno));
+      return 1;
+    }
+  }
+  if (flags.sample_ticks) {
+    sample(trace_dir, flags.sample_ticks, out);
+  } else {
+    profile(trace_dir, out);
+  }
+  if (out != stdout) {
+    fclose(out);
+  }
+  return 0;
+}
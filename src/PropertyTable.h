@@ -16,11 +16,26 @@ template <typename T, typename Object> class Property;
  * type T. It owns the property values.
  * Property values can be created, accessed and removed in a type-safe way
  * via the Property class.
+ *
+ * The first NUM_SLOTS Properties constructed get a fixed slot index and
+ * keep their values in an inline array, so getting them is an array load.
+ * Properties are static objects, so the slots go to whichever are
+ * constructed first; later ones fall back to a hash table.
  */
 class PropertyTable {
 public:
-  PropertyTable() {}
+  PropertyTable() {
+    for (int i = 0; i < NUM_SLOTS; ++i) {
+      slot_values[i] = nullptr;
+      slot_owners[i] = nullptr;
+    }
+  }
   ~PropertyTable() {
+    for (int i = 0; i < NUM_SLOTS; ++i) {
+      if (slot_values[i]) {
+        slot_owners[i]->destroy_property(slot_values[i]);
+      }
+    }
     for (auto& p : values) {
       p.first->destroy_property(p.second);
     }
@@ -34,6 +49,19 @@ private:
     virtual void destroy_property(void* v) const = 0;
   };
 
+  static const int NUM_SLOTS = 4;
+  static const int NO_SLOT = -1;
+
+  /**
+   * Return the next free slot index, or NO_SLOT if they're all taken.
+   */
+  static int allocate_slot() {
+    static int next_slot = 0;
+    return next_slot < NUM_SLOTS ? next_slot++ : NO_SLOT;
+  }
+
+  void* slot_values[NUM_SLOTS];
+  const PropertyBase* slot_owners[NUM_SLOTS];
   std::unordered_map<const PropertyBase*, void*> values;
 };
 
@@ -45,14 +73,25 @@ private:
 template <typename T, typename Object>
 class Property : protected PropertyTable::PropertyBase {
 public:
+  Property() : slot(PropertyTable::allocate_slot()) {}
+
   T& create(Object& o) const {
     assert(!get(o));
     T* t = new T();
-    o.properties().values[this] = t;
+    auto& properties = o.properties();
+    if (slot != PropertyTable::NO_SLOT) {
+      properties.slot_values[slot] = t;
+      properties.slot_owners[slot] = this;
+    } else {
+      properties.values[this] = t;
+    }
     return *t;
   }
   T* get(Object& o) const {
     auto& properties = o.properties();
+    if (slot != PropertyTable::NO_SLOT) {
+      return static_cast<T*>(properties.slot_values[slot]);
+    }
     auto e = properties.values.find(this);
     if (e != properties.values.end()) {
       return static_cast<T*>(e->second);
@@ -68,8 +107,14 @@ public:
   }
   std::unique_ptr<T> remove(Object& o) const {
     auto& properties = o.properties();
-    auto e = properties.values.find(this);
     std::unique_ptr<T> result;
+    if (slot != PropertyTable::NO_SLOT) {
+      result =
+          std::unique_ptr<T>(static_cast<T*>(properties.slot_values[slot]));
+      properties.slot_values[slot] = nullptr;
+      return result;
+    }
+    auto e = properties.values.find(this);
     if (e != properties.values.end()) {
       result = std::unique_ptr<T>(static_cast<T*>(e->second));
       properties.values.erase(e);
@@ -79,6 +124,9 @@ public:
 
 protected:
   virtual void destroy_property(void* v) const { delete static_cast<T*>(v); }
+
+private:
+  const int slot;
 };
 
 #endif /* RR_PROPERTY_TABLE_H_ */
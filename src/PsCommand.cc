@@ -21,15 +21,19 @@ protected:
 
 PsCommand PsCommand::singleton("ps", " rr ps [<trace_dir>]\n");
 
-static void print_exec_cmd_line(const TraceTaskEvent& event, FILE* out) {
+static void print_cmd_line(const vector<string>& cmd_line, FILE* out) {
   bool first = true;
-  for (auto& word : event.cmd_line()) {
+  for (auto& word : cmd_line) {
     fprintf(out, "%s%s", first ? "" : " ", word.c_str());
     first = false;
   }
   fprintf(out, "\n");
 }
 
+static void print_exec_cmd_line(const TraceTaskEvent& event, FILE* out) {
+  print_cmd_line(event.cmd_line(), out);
+}
+
 static void update_tid_to_pid_map(std::map<pid_t, pid_t>& tid_to_pid,
                                   const TraceTaskEvent& e) {
   if (e.is_fork()) {
@@ -41,11 +45,36 @@ static void update_tid_to_pid_map(std::map<pid_t, pid_t>& tid_to_pid,
   }
 }
 
+static int ps_from_metadata(const TraceMetadata& metadata, FILE* out) {
+  if (metadata.processes.empty() || !metadata.processes[0].execed) {
+    fprintf(stderr, "Invalid trace\n");
+    return 1;
+  }
+  for (auto& p : metadata.processes) {
+    if (p.ppid) {
+      fprintf(out, "%d\t%d\t", p.pid, p.ppid);
+    } else {
+      fprintf(out, "%d\t--\t", p.pid);
+    }
+    if (p.execed) {
+      print_cmd_line(p.cmd_line, out);
+    } else {
+      fprintf(out, "(forked without exec)\n");
+    }
+  }
+  return 0;
+}
+
 static int ps(const string& trace_dir, FILE* out) {
   TraceReader trace(trace_dir);
 
   fprintf(out, "PID\tPPID\tCMD\n");
 
+  TraceMetadata metadata;
+  if (trace.read_metadata(&metadata)) {
+    return ps_from_metadata(metadata, out);
+  }
+
   vector<TraceTaskEvent> events;
   while (trace.good()) {
     events.push_back(trace.read_task_event());
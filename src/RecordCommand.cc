@@ -3,15 +3,24 @@
 #include "RecordCommand.h"
 
 #include <assert.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <sysexits.h>
 
+#include <map>
+
 #include "preload/preload_interface.h"
 
 #include "Flags.h"
 #include "kernel_metadata.h"
 #include "log.h"
 #include "main.h"
+#include "PerfCounters.h"
 #include "RecordSession.h"
+#include "ScopedFd.h"
 #include "util.h"
 
 using namespace std;
@@ -19,30 +28,77 @@ using namespace std;
 RecordCommand RecordCommand::singleton(
     "record",
     " rr record [OPTION]... <exe> [exe-args]...\n"
+    " rr record -L <SOCKET> [OPTION]...\n"
+    "  -A, --adaptive-compression compress the trace faster, at a worse\n"
+    "                             ratio, while the recorder keeps waiting\n"
+    "                             for the compression threads\n"
     "  -b, --force-syscall-buffer force the syscall buffer preload library\n"
     "                             to be used, even if that's probably a bad\n"
     "                             idea\n"
+    "  -B, --data-budget=<MB>     once <MB> megabytes of tracee data have\n"
+    "                             been recorded, record reads of system\n"
+    "                             files that can't change as references to\n"
+    "                             the files instead of copying the data\n"
     "  -c, --num-cpu-ticks=<NUM>  maximum number of 'CPU ticks' (currently \n"
     "                             retired conditional branches) to allow a \n"
     "                             task to run before interrupting it\n"
+    "  -C, --commit-interval=<MS> sync the trace files to disk so that if\n"
+    "                             recording is cut off by a crash, the\n"
+    "                             trace can still be replayed up to an\n"
+    "                             event at most about <MS> milliseconds\n"
+    "                             older\n"
+    "  -d, --dedup-raw-data       store each distinct 4KB chunk of recorded\n"
+    "                             memory only once in the trace\n"
     "  -e, --num-events=<NUM>     maximum number of events (syscall \n"
     "                             enter/exit, signal, CPU interrupt, ...) \n"
     "                             to allow a task before descheduling it\n"
+    "  -f, --fixed-timeslice      always give tasks the full -c timeslice,\n"
+    "                             instead of shortening it for tasks that\n"
+    "                             seem to spin and lengthening it for\n"
+    "                             compute-bound tasks\n"
     "  -i, --ignore-signal=<SIG>  block <SIG> from being delivered to "
     "tracees.\n"
     "                             Probably only useful for unit tests.\n"
+    "  -L, --listen=<SOCKET>      instead of recording, serve recordings\n"
+    "                             requested with -X on Unix socket\n"
+    "                             <SOCKET>, several at once, without\n"
+    "                             paying rr's startup for each\n"
+    "  -k, --upload-keep=<NUM>    with -U, keep only the most recent\n"
+    "                             <NUM> blocks of each trace file on local\n"
+    "                             disk (default 4, 0 keeps everything)\n"
     "  -n, --no-syscall-buffer    disable the syscall buffer preload "
     "library\n"
     "                             even if it would otherwise be used\n"
+    "  -O, --object-store=<DIR>   keep copies of mapped files in <DIR>\n"
+    "                             (e.g. ~/.rr/objects), shared with other\n"
+    "                             traces, instead of in the trace. Use\n"
+    "                             `rr pack` before moving the trace\n"
+    "  -P, --stats-sample=<HZ>    with -S, also sample which phase rr is in\n"
+    "                             <HZ> times per second of rr CPU time\n"
+    "  -s, --unpatched-syscalls   at exit, report the syscall sites that\n"
+    "                             could not be patched into the syscall\n"
+    "                             buffer, most frequently hit first\n"
+    "  -S, --stats                at exit and on SIGUSR1, report where\n"
+    "                             rr's recording overhead went\n"
     "  -u, --cpu-unbound          allow tracees to run on any virtual CPU.\n"
     "                             Default is to bind to CPU 0.  This option\n"
     "                             can cause replay divergence: use with\n"
-    "                             caution.\n");
+    "                             caution.\n"
+    "  -U, --upload-command=<CMD> stream each trace file to the stdin of\n"
+    "                             `sh -c <CMD>` as it's written. $1 is the\n"
+    "                             local path of the file.\n"
+    "  -X, --use-server=<SOCKET>  have the rr record -L server on <SOCKET>\n"
+    "                             do the recording, with this process's\n"
+    "                             stdio, environment and working\n"
+    "                             directory, and exit with its status\n");
 
 struct RecordFlags {
   /* Max counter value before the scheduler interrupts a tracee. */
   Ticks max_ticks;
 
+  /* When false, every timeslice is |max_ticks| long. */
+  bool adaptive_timeslice;
+
   /* Max number of trace events before the scheduler
    * de-schedules a tracee. */
   TraceFrame::Time max_events;
@@ -58,63 +114,171 @@ struct RecordFlags {
    * to run on any logical CPU. */
   bool cpu_unbound;
 
+  /* When true, report hot syscall sites the Monkeypatcher couldn't
+   * patch. */
+  bool report_unpatched_syscalls;
+
+  /* When true, store repeated chunks of raw data only once. */
+  bool dedup_raw_data;
+
+  /* Raw data bytes after which reads of immutable files are recorded
+   * by reference. */
+  uint64_t raw_data_budget;
+
+  /* When true, lower the compression level under backpressure. */
+  bool adaptive_compression;
+
+  /* If nonzero, keep the trace replayable up to an event at most this
+   * many milliseconds old. */
+  int commit_interval_ms;
+
+  /* When true, report per-phase recording overhead, sampling the phase
+   * |stats_sample_hz| times per CPU second if that's nonzero. */
+  bool report_stats;
+  int stats_sample_hz;
+
+  /* If nonempty, stream trace files to this command while recording,
+   * keeping only |upload_keep_blocks| blocks of each locally. */
+  string upload_command;
+  size_t upload_keep_blocks;
+
+  /* If nonempty, the directory shared mapped-file copies live in. */
+  string object_store;
+
+  /* If nonempty, serve recordings on this socket. */
+  string listen_socket;
+
+  /* If nonempty, ask the server on this socket to record. */
+  string server_socket;
+
   RecordFlags()
       : max_ticks(Scheduler::DEFAULT_MAX_TICKS),
+        adaptive_timeslice(true),
         max_events(Scheduler::DEFAULT_MAX_EVENTS),
         ignore_sig(0),
         use_syscall_buffer(true),
-        cpu_unbound(false) {}
+        cpu_unbound(false),
+        report_unpatched_syscalls(false),
+        dedup_raw_data(false),
+        raw_data_budget(UINT64_MAX),
+        adaptive_compression(false),
+        commit_interval_ms(0),
+        report_stats(false),
+        stats_sample_hz(0),
+        upload_keep_blocks(4) {}
 };
 
 static bool parse_record_arg(std::vector<std::string>& args,
                              RecordFlags& flags) {
-  if (parse_global_option(args)) {
-    return true;
-  }
-
   static const OptionSpec options[] = {
+    { 'A', "adaptive-compression", NO_PARAMETER },
     { 'b', "force-syscall-buffer", NO_PARAMETER },
+    { 'B', "data-budget", HAS_PARAMETER },
     { 'i', "ignore-signal", HAS_PARAMETER },
     { 'c', "num-cpu-ticks", HAS_PARAMETER },
+    { 'C', "commit-interval", HAS_PARAMETER },
+    { 'd', "dedup-raw-data", NO_PARAMETER },
     { 'e', "num-events", HAS_PARAMETER },
+    { 'f', "fixed-timeslice", NO_PARAMETER },
+    { 'k', "upload-keep", HAS_PARAMETER },
+    { 'L', "listen", HAS_PARAMETER },
     { 'n', "no-syscall-buffer", NO_PARAMETER },
-    { 'u', "cpu-unbound", NO_PARAMETER }
+    { 'O', "object-store", HAS_PARAMETER },
+    { 'P', "stats-sample", HAS_PARAMETER },
+    { 's', "unpatched-syscalls", NO_PARAMETER },
+    { 'S', "stats", NO_PARAMETER },
+    { 'u', "cpu-unbound", NO_PARAMETER },
+    { 'U', "upload-command", HAS_PARAMETER },
+    { 'X', "use-server", HAS_PARAMETER }
   };
   ParsedOption opt;
   auto args_copy = args;
   if (!Command::parse_option(args_copy, options, &opt)) {
-    return false;
+    // Our own options win over global options with the same short name;
+    // those can still be given before the command name.
+    return parse_global_option(args);
   }
 
   switch (opt.short_name) {
+    case 'A':
+      flags.adaptive_compression = true;
+      break;
     case 'b':
       flags.use_syscall_buffer = true;
       break;
+    case 'B':
+      if (!opt.verify_valid_int(0, INT32_MAX)) {
+        return false;
+      }
+      flags.raw_data_budget = uint64_t(opt.int_value) * 1024 * 1024;
+      break;
     case 'c':
       if (!opt.verify_valid_int(1, INT64_MAX)) {
         return false;
       }
       flags.max_ticks = opt.int_value;
       break;
+    case 'C':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.commit_interval_ms = opt.int_value;
+      break;
+    case 'd':
+      flags.dedup_raw_data = true;
+      break;
     case 'e':
-      if (!opt.verify_valid_int(1, UINT32_MAX)) {
+      if (!opt.verify_valid_int(1)) {
         return false;
       }
       flags.max_events = opt.int_value;
       ;
       break;
+    case 'f':
+      flags.adaptive_timeslice = false;
+      break;
     case 'i':
       if (!opt.verify_valid_int(1, _NSIG - 1)) {
         return false;
       }
       flags.ignore_sig = opt.int_value;
       break;
+    case 'k':
+      if (!opt.verify_valid_int(0, INT32_MAX)) {
+        return false;
+      }
+      flags.upload_keep_blocks = opt.int_value;
+      break;
+    case 'L':
+      flags.listen_socket = opt.value;
+      break;
     case 'n':
       flags.use_syscall_buffer = false;
       break;
+    case 'O':
+      flags.object_store = opt.value;
+      break;
+    case 'P':
+      if (!opt.verify_valid_int(1, 100000)) {
+        return false;
+      }
+      flags.stats_sample_hz = opt.int_value;
+      break;
+    case 's':
+      flags.report_unpatched_syscalls = true;
+      break;
+    case 'S':
+      flags.report_stats = true;
+      break;
     case 'u':
       flags.cpu_unbound = true;
       break;
+    case 'U':
+      flags.upload_command = opt.value;
+      break;
+    case 'X':
+      flags.server_socket = opt.value;
+      break;
     default:
       assert(0 && "Unknown option");
   }
@@ -124,9 +288,12 @@ static bool parse_record_arg(std::vector<std::string>& args,
 }
 
 static bool term_request;
+static volatile sig_atomic_t stats_request;
 
 static void terminate_recording(RecordSession& session, int status = 0) {
   session.terminate_recording();
+  session.print_unpatched_syscalls(stderr);
+  session.stats().print(stderr, session.trace_writer());
   LOG(info) << "  exiting, goodbye.";
   exit(status);
 }
@@ -165,11 +332,51 @@ static void maybe_process_term_request(RecordSession& session) {
   }
 }
 
+static void handle_stats_sig(int) { stats_request = true; }
+
+/**
+ * Print the overhead statistics so far whenever rr gets a SIGUSR1. Not
+ * SA_RESTART, so a scheduler blocked in waitpid() gets to print them.
+ */
+static void install_stats_handler(void) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_stats_sig;
+  sigaction(SIGUSR1, &sa, nullptr);
+}
+
+static void maybe_process_stats_request(RecordSession& session) {
+  if (stats_request) {
+    stats_request = false;
+    session.stats().print(stderr, session.trace_writer());
+  }
+}
+
 static void setup_session_from_flags(RecordSession& session,
                                      const RecordFlags& flags) {
   session.scheduler().set_max_ticks(flags.max_ticks);
   session.scheduler().set_max_events(flags.max_events);
+  session.scheduler().set_adaptive_timeslice(flags.adaptive_timeslice);
   session.set_ignore_sig(flags.ignore_sig);
+  session.set_track_unpatched_syscalls(flags.report_unpatched_syscalls);
+  if (flags.report_stats) {
+    session.stats().enable(flags.stats_sample_hz);
+    install_stats_handler();
+  }
+  session.trace_writer().set_dedup_raw_data(flags.dedup_raw_data);
+  session.trace_writer().set_raw_data_budget(flags.raw_data_budget);
+  session.trace_writer().set_adaptive_compression(flags.adaptive_compression);
+  if (flags.commit_interval_ms) {
+    session.trace_writer().set_commit_interval(flags.commit_interval_ms /
+                                               1000.0);
+  }
+  if (!flags.object_store.empty()) {
+    session.trace_writer().set_object_store(flags.object_store);
+  }
+  if (!flags.upload_command.empty()) {
+    session.trace_writer().set_upload_command(flags.upload_command,
+                                              flags.upload_keep_blocks);
+  }
 }
 
 static int record(const vector<string>& args, const RecordFlags& flags) {
@@ -187,6 +394,7 @@ static int record(const vector<string>& args, const RecordFlags& flags) {
   while ((step_result = session->record_step()).status ==
          RecordSession::STEP_CONTINUE) {
     maybe_process_term_request(*session);
+    maybe_process_stats_request(*session);
   }
 
   if (step_result.status == RecordSession::STEP_EXEC_FAILED) {
@@ -213,20 +421,346 @@ static int record(const vector<string>& args, const RecordFlags& flags) {
   }
 
   assert(step_result.status == RecordSession::STEP_EXITED);
+  session->print_unpatched_syscalls(stderr);
+  session->stats().print(stderr, session->trace_writer());
   LOG(info) << "Done recording -- cleaning up";
   return step_result.exit_code;
 }
 
+/**
+ * Fill |addr| for the Unix socket |path|. Returns false if the path is
+ * too long.
+ */
+static bool make_socket_address(const string& path, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "Socket path %s is too long\n", path.c_str());
+    return false;
+  }
+  strcpy(addr->sun_path, path.c_str());
+  return true;
+}
+
+/**
+ * A request to the recording server is a uint32_t length followed by
+ * that many bytes of NUL-terminated strings: the working directory, the
+ * decimal count of `rr record' arguments, the arguments and then the
+ * environment. The client's stdin, stdout and stderr come with the
+ * length. The server replies with the recording's exit status as an
+ * int32_t once it's finished.
+ */
+static const size_t MAX_REQUEST_SIZE = 16 * 1024 * 1024;
+
+struct RecordRequest {
+  string cwd;
+  vector<string> args;
+  vector<string> env;
+  ScopedFd stdio[3];
+};
+
+static bool send_record_request(int sock, const vector<string>& args) {
+  char cwd[PATH_MAX] = "";
+  if (!getcwd(cwd, sizeof(cwd))) {
+    return false;
+  }
+  string payload = string(cwd) + '\0' + to_string(args.size()) + '\0';
+  for (auto& arg : args) {
+    payload += arg + '\0';
+  }
+  for (char** e = environ; *e; ++e) {
+    payload += string(*e) + '\0';
+  }
+
+  uint32_t len = payload.size();
+  struct iovec iov = { &len, sizeof(len) };
+  int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+  char control[CMSG_SPACE(sizeof(fds))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if (sendmsg(sock, &msg, 0) != sizeof(len)) {
+    return false;
+  }
+  return write(sock, payload.data(), payload.size()) == (ssize_t)len;
+}
+
+static bool read_all(int fd, void* data, size_t size) {
+  while (size > 0) {
+    ssize_t ret = read(fd, data, size);
+    if (ret <= 0) {
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data = static_cast<uint8_t*>(data) + ret;
+    size -= ret;
+  }
+  return true;
+}
+
+static bool receive_record_request(int sock, RecordRequest* req) {
+  uint32_t len;
+  struct iovec iov = { &len, sizeof(len) };
+  char control[CMSG_SPACE(3 * sizeof(int))];
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(len)) {
+    return false;
+  }
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+    return false;
+  }
+  int fds[3];
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+  for (int i = 0; i < 3; ++i) {
+    req->stdio[i] = ScopedFd(fds[i]);
+  }
+  if (len > MAX_REQUEST_SIZE) {
+    return false;
+  }
+  string payload(len, '\0');
+  if (!read_all(sock, &payload[0], len)) {
+    return false;
+  }
+
+  vector<string> strings;
+  for (size_t start = 0; start < payload.size();) {
+    size_t end = payload.find('\0', start);
+    if (end == string::npos) {
+      return false;
+    }
+    strings.push_back(payload.substr(start, end - start));
+    start = end + 1;
+  }
+  if (strings.size() < 2) {
+    return false;
+  }
+  size_t argc = strtoul(strings[1].c_str(), nullptr, 10);
+  if (argc > strings.size() - 2) {
+    return false;
+  }
+  req->cwd = strings[0];
+  req->args.assign(strings.begin() + 2, strings.begin() + 2 + argc);
+  req->env.assign(strings.begin() + 2 + argc, strings.end());
+  return true;
+}
+
+/**
+ * In a child of the server, become the client's `rr record': take its
+ * stdio, working directory and environment, and record.
+ */
+static int record_for_client(RecordRequest& req) {
+  for (int i = 0; i < 3; ++i) {
+    dup2(req.stdio[i], i);
+    req.stdio[i].close();
+  }
+  if (chdir(req.cwd.c_str())) {
+    fprintf(stderr, "rr: can't change to directory %s\n", req.cwd.c_str());
+    return 1;
+  }
+  clearenv();
+  for (auto& e : req.env) {
+    putenv(strdup(e.c_str()));
+  }
+  // Children of the server would otherwise all pick the same CPU.
+  srandom(getpid() ^ time(nullptr));
+
+  RecordFlags flags;
+  while (parse_record_arg(req.args, flags)) {
+  }
+  if (!Command::verify_not_option(req.args) || req.args.size() == 0 ||
+      !flags.listen_socket.empty()) {
+    fprintf(stderr, "rr: bad request to the recording server\n");
+    return 1;
+  }
+  return record(req.args, flags);
+}
+
+/**
+ * Accept recording requests on |flags.listen_socket| forever, recording
+ * each in a child forked from this process, so the checks and probes rr
+ * does on startup are only done once. A client hanging up stops its
+ * recording as SIGTERM would.
+ */
+static int serve_recordings(const RecordFlags& flags) {
+  struct sockaddr_un addr;
+  if (!make_socket_address(flags.listen_socket, &addr)) {
+    return 1;
+  }
+  unlink(flags.listen_socket.c_str());
+  ScopedFd listen_fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if (!listen_fd.is_open() ||
+      ::bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+      listen(listen_fd, 64)) {
+    fprintf(stderr, "Can't listen on %s: %s\n", flags.listen_socket.c_str(),
+            strerror(errno));
+    return 1;
+  }
+  // Probe the ticks counter now, so the recordings inherit the results.
+  PerfCounters probe(getpid());
+
+  // Hear about recordings finishing through |child_fd|. The children
+  // restore the mask before recording, since tracees inherit it.
+  sigset_t old_mask, chld_mask;
+  sigemptyset(&chld_mask);
+  sigaddset(&chld_mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &chld_mask, &old_mask);
+  ScopedFd child_fd(signalfd(-1, &chld_mask, SFD_CLOEXEC | SFD_NONBLOCK));
+  signal(SIGPIPE, SIG_IGN);
+  fprintf(stderr, "rr: serving recordings on %s\n",
+          flags.listen_socket.c_str());
+
+  // The client connection of each recording.
+  map<pid_t, ScopedFd> clients;
+  while (true) {
+    vector<struct pollfd> fds;
+    vector<pid_t> pids;
+    struct pollfd listen_poll = { listen_fd, POLLIN, 0 };
+    struct pollfd child_poll = { child_fd, POLLIN, 0 };
+    fds.push_back(listen_poll);
+    fds.push_back(child_poll);
+    for (auto& c : clients) {
+      struct pollfd p = { c.second, POLLIN, 0 };
+      fds.push_back(p);
+      pids.push_back(c.first);
+    }
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      FATAL() << "poll failed";
+    }
+
+    for (size_t i = 2; i < fds.size(); ++i) {
+      if (fds[i].revents) {
+        // Clients only ever hang up. poll() skips the closed fd from now
+        // on, so the recording is only asked to stop once.
+        LOG(info) << "Client of recording " << pids[i - 2] << " went away";
+        kill(pids[i - 2], SIGTERM);
+        clients[pids[i - 2]].close();
+      }
+    }
+
+    if (fds[1].revents) {
+      struct signalfd_siginfo si;
+      while (read(child_fd, &si, sizeof(si)) > 0) {
+      }
+      int status;
+      pid_t pid;
+      while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        auto it = clients.find(pid);
+        if (it == clients.end()) {
+          continue;
+        }
+        int32_t exit_code = WIFEXITED(status) ? WEXITSTATUS(status)
+                                              : 128 + WTERMSIG(status);
+        if (write(it->second, &exit_code, sizeof(exit_code)) < 0) {
+          LOG(debug) << "Client of recording " << pid << " went away";
+        }
+        clients.erase(it);
+      }
+    }
+
+    if (fds[0].revents) {
+      ScopedFd client(accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC));
+      RecordRequest req;
+      if (!client.is_open() || !receive_record_request(client, &req)) {
+        continue;
+      }
+      pid_t pid = fork();
+      if (pid == 0) {
+        listen_fd.close();
+        child_fd.close();
+        // Other clients must see EOF when their recordings end.
+        clients.clear();
+        client.close();
+        sigprocmask(SIG_SETMASK, &old_mask, nullptr);
+        signal(SIGPIPE, SIG_DFL);
+        exit(record_for_client(req));
+      }
+      if (pid < 0) {
+        LOG(warn) << "Can't fork a recording";
+        continue;
+      }
+      LOG(info) << "Recording " << pid << " started";
+      clients[pid] = move(client);
+    }
+  }
+}
+
+/**
+ * Have the server on |socket_path| record |args|, the arguments of this
+ * `rr record', and return its exit status.
+ */
+static int record_via_server(const string& socket_path,
+                             const vector<string>& args) {
+  struct sockaddr_un addr;
+  if (!make_socket_address(socket_path, &addr)) {
+    return 1;
+  }
+  ScopedFd sock(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  if (!sock.is_open() ||
+      connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+    fprintf(stderr, "Can't connect to the recording server on %s: %s\n",
+            socket_path.c_str(), strerror(errno));
+    return 1;
+  }
+  if (!send_record_request(sock, args)) {
+    fprintf(stderr, "Can't send request to the recording server: %s\n",
+            strerror(errno));
+    return 1;
+  }
+  int32_t exit_code;
+  if (!read_all(sock, &exit_code, sizeof(exit_code))) {
+    fprintf(stderr, "The recording server hung up\n");
+    return 1;
+  }
+  return exit_code;
+}
+
 int RecordCommand::run(std::vector<std::string>& args) {
+  vector<string> request_args = args;
   RecordFlags flags;
   while (parse_record_arg(args, flags)) {
   }
 
+  if (!flags.listen_socket.empty()) {
+    if (!args.empty()) {
+      print_help(stderr);
+      return 1;
+    }
+    assert_prerequisites();
+    check_performance_settings();
+    return serve_recordings(flags);
+  }
+
   if (!verify_not_option(args) || args.size() == 0) {
     print_help(stderr);
     return 1;
   }
 
+  if (!flags.server_socket.empty()) {
+    return record_via_server(flags.server_socket, request_args);
+  }
+
   assert_prerequisites(flags.use_syscall_buffer);
   check_performance_settings();
 
@@ -4,6 +4,8 @@
 
 #include "RecordSession.h"
 
+#include <linux/futex.h>
+
 #include <algorithm>
 #include <sstream>
 
@@ -105,7 +107,9 @@ static bool handle_ptrace_exit_event(Task* t) {
   EventType ev = t->unstable ? EV_UNSTABLE_EXIT : EV_EXIT;
   t->record_event(Event(ev, NO_EXEC_INFO, t->arch()));
 
-  t->record_session().trace_writer().write_task_event(TraceTaskEvent(t->tid));
+  auto& trace_writer = t->record_session().trace_writer();
+  trace_writer.note_exit_code(t->tid, t->task_group()->exit_code);
+  trace_writer.write_task_event(TraceTaskEvent(t->tid));
 
   delete t;
   return true;
@@ -234,7 +238,7 @@ void RecordSession::task_continue(Task* t, const StepState& step_state) {
      * record in the traditional way (with PTRACE_SYSCALL)
      * until it is installed. */
     t->cont_syscall_nonblocking(step_state.continue_sig,
-                                t->record_session().scheduler().max_ticks());
+                                t->record_session().scheduler().timeslice(t));
   } else {
     /* When the seccomp filter is on, instead of capturing
      * syscalls by using PTRACE_SYSCALL, the filter will
@@ -247,7 +251,7 @@ void RecordSession::task_continue(Task* t, const StepState& step_state) {
      * the syscall (using cont_syscall_block()) and then
      * using the same logic as before. */
     t->cont_nonblocking(step_state.continue_sig,
-                        t->record_session().scheduler().max_ticks());
+                        t->record_session().scheduler().timeslice(t));
   }
 }
 
@@ -259,11 +263,12 @@ void RecordSession::task_continue(Task* t, const StepState& step_state) {
  * enter this function.)
  */
 static void advance_to_disarm_desched_syscall(Task* t) {
-  int old_sig = 0;
-
   LOG(debug) << "desched: DISARMING_DESCHED_EVENT";
-  /* TODO: send this through main loop. */
-  /* TODO: mask off signals and avoid this loop. */
+  /* Usually the first stop is the disarm ioctl's entry. Signals that
+   * arrive first cost a stop each; stash_sig() coalesces repeats of
+   * non-RT signals, so they're delivered once afterwards. Call sites
+   * that keep blocking stop taking this path at all: see
+   * note_buffered_syscall_descheduled(). */
   do {
     t->cont_syscall();
     /* We can safely ignore SIG_TIMESLICE while trying to
@@ -283,10 +288,6 @@ static void advance_to_disarm_desched_syscall(Task* t) {
     // We should not receive SYSCALLBUF_DESCHED_SIGNAL since it should already
     // have been disarmed.
     ASSERT(t, SYSCALLBUF_DESCHED_SIGNAL != sig);
-    if (sig && sig == old_sig) {
-      LOG(debug) << "  coalescing pending " << signal_name(sig);
-      continue;
-    }
     if (sig) {
       LOG(debug) << "  " << signal_name(sig) << " now pending";
       t->stash_sig();
@@ -311,6 +312,7 @@ void RecordSession::desched_state_changed(Task* t) {
        * recorded that syscall.  The following event sets
        * the abort-commit bit. */
       t->syscallbuf_hdr->abort_commit = 1;
+      t->vm()->note_buffered_syscall_descheduled(t);
       t->record_event(
           Event(EV_SYSCALLBUF_ABORT_COMMIT, NO_EXEC_INFO, t->arch()));
 
@@ -419,10 +421,63 @@ static void copy_syscall_arg_regs(Registers* to, const Registers& from) {
   to->set_arg6(from.arg6());
 }
 
+/**
+ * If |t|'s current syscall is a futex wait that may block, register |t| as a
+ * waiter with the scheduler.
+ */
+static void note_futex_wait(Task* t, Switchable switchable) {
+  if (switchable != ALLOW_SWITCH ||
+      !is_futex_syscall(t->ev().Syscall().number, t->arch())) {
+    return;
+  }
+  const Registers& r = t->ev().Syscall().regs;
+  switch (r.arg2() & FUTEX_CMD_MASK) {
+    case FUTEX_WAIT:
+    case FUTEX_WAIT_BITSET:
+      t->record_session().scheduler().on_futex_wait(t, r.arg1());
+      break;
+  }
+}
+
+/**
+ * If |t|'s completed syscall was a futex wake, tell the scheduler how many
+ * waiters it woke.
+ */
+static void note_futex_wake(Task* t, int retval) {
+  if (retval <= 0 || !is_futex_syscall(t->ev().Syscall().number, t->arch())) {
+    return;
+  }
+  const Registers& r = t->ev().Syscall().regs;
+  int woken;
+  switch (r.arg2() & FUTEX_CMD_MASK) {
+    case FUTEX_WAKE:
+    case FUTEX_WAKE_BITSET:
+      woken = retval;
+      break;
+    case FUTEX_WAKE_OP:
+    case FUTEX_REQUEUE:
+    case FUTEX_CMP_REQUEUE:
+      // The result also counts waiters woken on (or requeued to) the
+      // second futex; at most |val| were woken on the first.
+      woken = min<int>(retval, r.arg3());
+      break;
+    default:
+      return;
+  }
+  t->record_session().scheduler().on_futex_wake(t, r.arg1(), woken);
+}
+
+static double now_sec() {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (double)tp.tv_sec + (double)tp.tv_nsec / 1e9;
+}
+
 void RecordSession::syscall_state_changed(Task* t, StepState* step_state) {
   switch (t->ev().Syscall().state) {
     case ENTERING_SYSCALL: {
       debug_exec_state("EXEC_SYSCALL_ENTRY", t);
+      t->ev().Syscall().entry_time = now_sec();
 
       if (!t->ev().Syscall().is_restart) {
         /* Save a copy of the arg registers so that we
@@ -437,6 +492,7 @@ void RecordSession::syscall_state_changed(Task* t, StepState* step_state) {
       }
 
       last_task_switchable = rec_prepare_syscall(t);
+      note_futex_wait(t, last_task_switchable);
 
       debug_exec_state("after cont", t);
       t->ev().Syscall().state = PROCESSING_SYSCALL;
@@ -479,6 +535,8 @@ void RecordSession::syscall_state_changed(Task* t, StepState* step_state) {
 
       int syscallno = t->ev().Syscall().number;
       int retval = t->regs().syscall_result();
+      double entry_time = t->ev().Syscall().entry_time;
+      scheduler().on_futex_wait_done(t);
 
       // sigreturn is a special snowflake, because it
       // doesn't actually return.  Instead, it undoes the
@@ -502,6 +560,8 @@ void RecordSession::syscall_state_changed(Task* t, StepState* step_state) {
           desched_state_changed(t);
         }
 
+        trace_writer().syscall_stats().add_trapped(t->arch(), syscallno,
+                                                   now_sec() - entry_time);
         // XXX probably not necessary to leave the tracee unswitchable
         return;
       }
@@ -528,6 +588,7 @@ void RecordSession::syscall_state_changed(Task* t, StepState* step_state) {
        * restarted this will be done in the exit from the
        * restart_syscall */
       if (!may_restart) {
+        note_futex_wake(t, retval);
         rec_process_syscall(t);
         if (t->session().can_validate() && Flags::get().check_cached_mmaps) {
           t->vm()->verify(t);
@@ -563,6 +624,8 @@ void RecordSession::syscall_state_changed(Task* t, StepState* step_state) {
         t->ev().transform(EV_SYSCALL_INTERRUPTION);
         t->ev().Syscall().is_restart = true;
       }
+      trace_writer().syscall_stats().add_trapped(t->arch(), syscallno,
+                                                 now_sec() - entry_time);
       return;
     }
 
@@ -750,7 +813,7 @@ void RecordSession::signal_state_changed(Task* t, StepState* step_state) {
       }
 
       // We record this data regardless to simplify replay.
-      t->record_remote(t->sp(), sigframe_size);
+      t->record_sigframe(sig, sigframe_size);
 
       // This event is used by the replayer to set up the
       // signal handler frame, or to record the resulting
@@ -839,10 +902,12 @@ void RecordSession::runnable_state_changed(Task* t, RecordResult* step_result,
       t->pop_noop();
       break;
     case EV_SEGV_RDTSC:
+    case EV_PATCH_RDTSC:
       t->record_current_event();
       t->pop_event(t->ev().type());
       break;
     case EV_SCHED:
+      scheduler().on_timeslice_expired(t);
       t->record_current_event();
       t->pop_event(t->ev().type());
       last_task_switchable = ALLOW_SWITCH;
@@ -862,6 +927,9 @@ void RecordSession::runnable_state_changed(Task* t, RecordResult* step_result,
           t->record_event(Event(EV_PATCH_SYSCALL, NO_EXEC_INFO, t->arch()));
           break;
         }
+        if (track_unpatched_syscalls) {
+          note_unpatched_syscall(t);
+        }
 
         t->push_event(SyscallEvent(t->regs().original_syscallno(), t->arch()));
       }
@@ -878,6 +946,21 @@ void RecordSession::runnable_state_changed(Task* t, RecordResult* step_result,
   maybe_reset_syscallbuf(t);
 }
 
+/**
+ * While notify_on_syscall_hook_exit is set, |t|'s preload library traps
+ * with SYS_rrcall_notify_syscall_hook_exit when it leaves its syscall hook,
+ * so that we can deliver a signal we deferred. When no deferred signal is
+ * left, e.g. because it was delivered at a traced syscall inside the
+ * syscallbuf code, clear the flag so the tracee doesn't trap for nothing.
+ * Replay sets the flag only when the recorded trap happened, so this
+ * doesn't need replaying.
+ */
+static void cancel_unneeded_hook_exit_notification(Task* t) {
+  if (t->syscallbuf_hdr && !t->has_stashed_sig()) {
+    t->syscallbuf_hdr->notify_on_syscall_hook_exit = false;
+  }
+}
+
 bool RecordSession::prepare_to_inject_signal(Task* t, StepState* step_state) {
   if (!t->has_stashed_sig() || !can_deliver_signals ||
       step_state->continue_type != CONTINUE) {
@@ -888,6 +971,7 @@ bool RecordSession::prepare_to_inject_signal(Task* t, StepState* step_state) {
     LOG(info) << "Declining to deliver " << signal_name(si.si_signo)
               << " by user request";
     t->pop_stash_sig();
+    cancel_unneeded_hook_exit_notification(t);
     return false;
   }
   switch (handle_signal(t, &si)) {
@@ -904,6 +988,7 @@ bool RecordSession::prepare_to_inject_signal(Task* t, StepState* step_state) {
   }
   step_state->continue_type = DONT_CONTINUE;
   t->pop_stash_sig();
+  cancel_unneeded_hook_exit_notification(t);
   return true;
 }
 
@@ -994,6 +1079,7 @@ RecordSession::RecordSession(const std::vector<std::string>& argv,
       ignore_sig(0),
       last_task_switchable(PREVENT_SWITCH),
       use_syscall_buffer_(!(flags & DISABLE_SYSCALL_BUF)),
+      track_unpatched_syscalls(false),
       can_deliver_signals(false) {
   last_recorded_task = Task::spawn(*this, trace_out);
   initial_task_group = last_recorded_task->task_group();
@@ -1012,8 +1098,12 @@ RecordSession::RecordResult RecordSession::record_step() {
   result.status = STEP_CONTINUE;
 
   bool did_wait;
-  Task* t = scheduler().get_next_thread(last_recorded_task,
-                                        last_task_switchable, &did_wait);
+  Task* t;
+  {
+    RecordStats::Timer timer(stats_, RecordStats::PHASE_SCHEDULE);
+    t = scheduler().get_next_thread(last_recorded_task, last_task_switchable,
+                                    &did_wait);
+  }
   if (!t) {
     // The scheduler was waiting for some task to become active, but was
     // interrupted by a signal. Yield to our caller now to give the caller
@@ -1021,6 +1111,12 @@ RecordSession::RecordResult RecordSession::record_step() {
     // (e.g. terminate the recording).
     return result;
   }
+  if (stats_.enabled()) {
+    stats_.note_schedule(t != last_recorded_task);
+    if (did_wait) {
+      stats_.note_ptrace_stop();
+    }
+  }
   last_recorded_task = t;
 
   // Have to disable context-switching until we know it's safe
@@ -1032,7 +1128,9 @@ RecordSession::RecordResult RecordSession::record_step() {
 #ifdef DEBUGTAG
   t->log_pending_events();
 #endif
-  if (handle_ptrace_exit_event(t)) {
+  if (t->ptrace_event() == PTRACE_EVENT_EXIT) {
+    RecordStats::Timer timer(stats_, RecordStats::PHASE_PTRACE_EVENT);
+    handle_ptrace_exit_event(t);
     // t is dead and has been deleted.
     last_recorded_task = nullptr;
     return result;
@@ -1049,8 +1147,16 @@ RecordSession::RecordResult RecordSession::record_step() {
 
   StepState step_state(CONTINUE);
 
-  if (!(did_wait && handle_ptrace_event(t, &step_state)) &&
-      !(did_wait && handle_signal_event(t, &step_state))) {
+  bool handled = false;
+  if (did_wait && t->ptrace_event() != PTRACE_EVENT_NONE) {
+    RecordStats::Timer timer(stats_, RecordStats::PHASE_PTRACE_EVENT);
+    handled = handle_ptrace_event(t, &step_state);
+  }
+  if (!handled && did_wait && t->pending_sig()) {
+    RecordStats::Timer timer(stats_, RecordStats::PHASE_SIGNAL);
+    handled = handle_signal_event(t, &step_state);
+  }
+  if (!handled) {
     runnable_state_changed(t, &result, did_wait, &step_state);
     if (result.status != STEP_CONTINUE ||
         step_state.continue_type == DONT_CONTINUE) {
@@ -1058,16 +1164,22 @@ RecordSession::RecordResult RecordSession::record_step() {
     }
 
     switch (t->ev().type()) {
-      case EV_DESCHED:
+      case EV_DESCHED: {
+        RecordStats::Timer timer(stats_, RecordStats::PHASE_DESCHED);
         desched_state_changed(t);
         break;
-      case EV_SYSCALL:
+      }
+      case EV_SYSCALL: {
+        RecordStats::Timer timer(stats_, RecordStats::PHASE_SYSCALL);
         syscall_state_changed(t, &step_state);
         break;
+      }
       case EV_SIGNAL:
-      case EV_SIGNAL_DELIVERY:
+      case EV_SIGNAL_DELIVERY: {
+        RecordStats::Timer timer(stats_, RecordStats::PHASE_SIGNAL);
         signal_state_changed(t, &step_state);
         break;
+      }
       default:
         break;
     }
@@ -1075,8 +1187,12 @@ RecordSession::RecordResult RecordSession::record_step() {
 
   // We try to inject a signal if there's one pending; otherwise we continue
   // task execution.
-  if (!prepare_to_inject_signal(t, &step_state) &&
-      step_state.continue_type != DONT_CONTINUE) {
+  bool injected = false;
+  if (t->has_stashed_sig()) {
+    RecordStats::Timer timer(stats_, RecordStats::PHASE_SIGNAL);
+    injected = prepare_to_inject_signal(t, &step_state);
+  }
+  if (!injected && step_state.continue_type != DONT_CONTINUE) {
     // Ensure that we aren't allowing switches away from a running task.
     // Only tasks blocked in a syscall can be switched away from, otherwise
     // we have races.
@@ -1085,6 +1201,7 @@ RecordSession::RecordResult RecordSession::record_step() {
 
     debug_exec_state("EXEC_START", t);
 
+    RecordStats::Timer timer(stats_, RecordStats::PHASE_RESUME);
     task_continue(t, step_state);
   }
 
@@ -1107,6 +1224,63 @@ void RecordSession::terminate_recording() {
   trace_out.close();
 }
 
+void RecordSession::note_unpatched_syscall(Task* t) {
+  // Before the preload library is initialized every syscall traps, and
+  // traced syscalls made by the syscallbuf itself are expected.
+  if (!t->vm()->syscallbuf_enabled() || t->is_in_traced_syscall()) {
+    return;
+  }
+  remote_ptr<void> ip = t->ip();
+  auto m = t->vm()->mapping_of(ip);
+  auto key = make_pair(m.second.fsname, ip.as_int() - m.first.start.as_int());
+  auto it = unpatched_syscalls.find(key);
+  if (it != unpatched_syscalls.end()) {
+    ++it->second.count;
+    return;
+  }
+
+  UnpatchedSyscallSite site;
+  site.count = 1;
+  site.syscallno = t->regs().original_syscallno();
+  site.arch = t->arch();
+  uint8_t bytes[8];
+  ssize_t nread = t->read_bytes_fallible(ip, sizeof(bytes), bytes);
+  site.next_bytes.assign(bytes, bytes + max<ssize_t>(nread, 0));
+  unpatched_syscalls[key] = site;
+}
+
+void RecordSession::print_unpatched_syscalls(FILE* out) const {
+  if (!track_unpatched_syscalls) {
+    return;
+  }
+  static const size_t max_sites = 20;
+  vector<decltype(unpatched_syscalls)::const_iterator> sites;
+  for (auto it = unpatched_syscalls.begin(); it != unpatched_syscalls.end();
+       ++it) {
+    sites.push_back(it);
+  }
+  sort(sites.begin(), sites.end(),
+       [](decltype(unpatched_syscalls)::const_iterator a,
+          decltype(unpatched_syscalls)::const_iterator b) {
+         return a->second.count > b->second.count;
+       });
+
+  fprintf(out, "rr: %zu unpatched syscall site(s)%s:\n", sites.size(),
+          sites.size() > max_sites ? ", hottest first" : "");
+  for (size_t i = 0; i < sites.size() && i < max_sites; ++i) {
+    auto& key = sites[i]->first;
+    auto& site = sites[i]->second;
+    fprintf(out, "  %10llu  %-18s %s+0x%llx:", (unsigned long long)site.count,
+            syscall_name(site.syscallno, site.arch).c_str(),
+            key.first.empty() ? "<anonymous>" : key.first.c_str(),
+            (unsigned long long)key.second);
+    for (uint8_t b : site.next_bytes) {
+      fprintf(out, " %02x", b);
+    }
+    fputc('\n', out);
+  }
+}
+
 void RecordSession::on_create(Task* t) {
   Session::on_create(t);
   scheduler().on_create(t);
@@ -3,6 +3,9 @@
 #ifndef RR_RECORD_SESSION_H_
 #define RR_RECORD_SESSION_H_
 
+#include <map>
+
+#include "RecordStats.h"
 #include "Scheduler.h"
 #include "Session.h"
 #include "task.h"
@@ -26,6 +29,19 @@ public:
   bool use_syscall_buffer() const { return use_syscall_buffer_; }
   void set_ignore_sig(int ignore_sig) { this->ignore_sig = ignore_sig; }
   int get_ignore_sig() const { return ignore_sig; }
+  /**
+   * When set, count the traced syscalls that the Monkeypatcher could not
+   * redirect into the syscallbuf, per call site, so that the hottest
+   * unpatched sites can be reported by print_unpatched_syscalls().
+   */
+  void set_track_unpatched_syscalls(bool track) {
+    track_unpatched_syscalls = track;
+  }
+  /**
+   * Print the most frequently hit unpatched syscall sites to |out|.
+   * Does nothing unless tracking was enabled.
+   */
+  void print_unpatched_syscalls(FILE* out) const;
 
   enum RecordStatus {
     // Some execution was recorded. record_step() can be called again.
@@ -68,6 +84,27 @@ public:
 
   Scheduler& scheduler() { return scheduler_; }
 
+  /**
+   * Per-phase recording overhead. Call stats().enable() to start
+   * measuring.
+   */
+  RecordStats& stats() { return stats_; }
+
+  /**
+   * What was last recorded of a SysV shm segment, so that later attaches
+   * only record the pages that have changed.
+   */
+  struct SysVSegment {
+    // Shmids are reused, so these tell whether this is still the segment
+    // that was recorded.
+    time_t ctime;
+    pid_t cpid;
+    // The hash of each page of the segment as of its last attach. Empty if
+    // the segment hasn't been recorded.
+    std::vector<Hash128> page_hashes;
+  };
+  std::map<int, SysVSegment>& sysv_segments() { return sysv_segments_; }
+
 private:
   RecordSession(const std::vector<std::string>& argv,
                 const std::vector<std::string>& envp, const std::string& cwd,
@@ -100,9 +137,11 @@ private:
   void desched_state_changed(Task* t);
   bool prepare_to_inject_signal(Task* t, StepState* step_state);
   void task_continue(Task* t, const StepState& step_state);
+  void note_unpatched_syscall(Task* t);
 
   TraceWriter trace_out;
   Scheduler scheduler_;
+  RecordStats stats_;
   Task* last_recorded_task;
   TaskGroup::shr_ptr initial_task_group;
 
@@ -110,6 +149,22 @@ private:
   Switchable last_task_switchable;
   bool use_syscall_buffer_;
 
+  /* Unpatched syscall sites, keyed by (mapping name, offset of the
+   * syscall instruction's return address within the mapping). */
+  struct UnpatchedSyscallSite {
+    uint64_t count;
+    int syscallno;
+    SupportedArch arch;
+    /* The bytes following the syscall instruction at the first hit; these
+     * are what a new syscall_patch_hook would need to match. */
+    std::vector<uint8_t> next_bytes;
+  };
+  std::map<std::pair<std::string, uintptr_t>, UnpatchedSyscallSite>
+      unpatched_syscalls;
+  bool track_unpatched_syscalls;
+
+  std::map<int, SysVSegment> sysv_segments_;
+
   /* True when it's safe to deliver signals, namely, when the initial
    * tracee has exec()'d the tracee image.  Before then, the address
    * space layout will not be the same during replay as recording, so
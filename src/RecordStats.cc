@@ -0,0 +1,161 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "RecordStats"
+
+#include "RecordStats.h"
+
+#include <signal.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "TraceStream.h"
+
+static double now_sec(void) {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (double)tp.tv_sec + (double)tp.tv_nsec / 1e9;
+}
+
+/* Read by the SIGPROF handler, so these can't be RecordStats members. */
+static volatile sig_atomic_t current_phase = RecordStats::PHASE_OTHER;
+static volatile uint64_t phase_samples[RecordStats::PHASE_COUNT];
+
+static void handle_sample(int) { ++phase_samples[current_phase]; }
+
+static const char* phase_name(int phase) {
+  switch (phase) {
+    case RecordStats::PHASE_OTHER:
+      return "other";
+    case RecordStats::PHASE_SCHEDULE:
+      return "schedule";
+    case RecordStats::PHASE_PTRACE_EVENT:
+      return "ptrace-event";
+    case RecordStats::PHASE_SIGNAL:
+      return "signal";
+    case RecordStats::PHASE_SYSCALL:
+      return "syscall";
+    case RecordStats::PHASE_DESCHED:
+      return "desched";
+    case RecordStats::PHASE_RESUME:
+      return "resume";
+    default:
+      return "???";
+  }
+}
+
+RecordStats::RecordStats()
+    : enabled_(false),
+      start_time(0),
+      ptrace_stops(0),
+      schedule_decisions(0),
+      task_switches(0),
+      sample_hz(0) {
+  memset(phase_counts, 0, sizeof(phase_counts));
+  memset(phase_times, 0, sizeof(phase_times));
+}
+
+void RecordStats::enable(int sample_hz) {
+  enabled_ = true;
+  start_time = now_sec();
+  if (sample_hz <= 0) {
+    return;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_sample;
+  // Samples mustn't make the recorder's waitpid()s fail with EINTR.
+  sa.sa_flags = SA_RESTART;
+  sigaction(SIGPROF, &sa, nullptr);
+
+  // Only the recorder thread's CPU time is sampled; the compression
+  // threads' share shows up as compression waits when it matters.
+  struct sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SIGPROF;
+  sev._sigev_un._tid = syscall(SYS_gettid);
+  timer_t timer;
+  if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &timer) < 0) {
+    LOG(warn) << "Can't create sampling timer; not sampling";
+    return;
+  }
+  struct itimerspec its;
+  memset(&its, 0, sizeof(its));
+  int64_t period_ns = 1000000000LL / sample_hz;
+  its.it_interval.tv_sec = period_ns / 1000000000LL;
+  its.it_interval.tv_nsec = period_ns % 1000000000LL;
+  its.it_value = its.it_interval;
+  timer_settime(timer, 0, &its, nullptr);
+  this->sample_hz = sample_hz;
+}
+
+RecordStats::Timer::Timer(RecordStats& stats, Phase phase)
+    : stats(stats), phase(phase), saved_phase(PHASE_OTHER), start(0) {
+  if (!stats.enabled_) {
+    return;
+  }
+  saved_phase = (Phase)current_phase;
+  current_phase = phase;
+  start = now_sec();
+}
+
+RecordStats::Timer::~Timer() {
+  if (!stats.enabled_) {
+    return;
+  }
+  ++stats.phase_counts[phase];
+  stats.phase_times[phase] += now_sec() - start;
+  current_phase = saved_phase;
+}
+
+void RecordStats::print(FILE* out, const TraceWriter& trace) const {
+  if (!enabled_) {
+    return;
+  }
+  double elapsed = now_sec() - start_time;
+  double accounted = 0;
+  for (int i = PHASE_OTHER + 1; i < PHASE_COUNT; ++i) {
+    accounted += phase_times[i];
+  }
+
+  fprintf(out, "rr: recording overhead after %.3fs:\n", elapsed);
+  fprintf(out, "  %-14s %10s %12s\n", "phase", "count", "seconds");
+  for (int i = PHASE_OTHER + 1; i < PHASE_COUNT; ++i) {
+    fprintf(out, "  %-14s %10llu %12.6f\n", phase_name(i),
+            (unsigned long long)phase_counts[i], phase_times[i]);
+  }
+  fprintf(out, "  %-14s %10s %12.6f\n", phase_name(PHASE_OTHER), "",
+          elapsed - accounted);
+  // Compression waits happen inside the phases above.
+  fprintf(out, "  %-14s %10llu %12.6f\n", "compress-wait",
+          (unsigned long long)trace.compression_wait_count(),
+          trace.compression_wait_time());
+  trace.print_compression_stats(out);
+  fprintf(out, "  ptrace stops: %llu, scheduling decisions: %llu, "
+               "task switches: %llu\n",
+          (unsigned long long)ptrace_stops,
+          (unsigned long long)schedule_decisions,
+          (unsigned long long)task_switches);
+
+  if (!sample_hz) {
+    return;
+  }
+  uint64_t total = 0;
+  for (int i = 0; i < PHASE_COUNT; ++i) {
+    total += phase_samples[i];
+  }
+  fprintf(out, "  rr CPU samples at %dHz: %llu\n", sample_hz,
+          (unsigned long long)total);
+  for (int i = 0; i < PHASE_COUNT; ++i) {
+    if (!phase_samples[i]) {
+      continue;
+    }
+    fprintf(out, "  %-14s %10llu %11.1f%%\n", phase_name(i),
+            (unsigned long long)phase_samples[i],
+            100.0 * phase_samples[i] / total);
+  }
+}
@@ -0,0 +1,88 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_RECORD_STATS_H_
+#define RR_RECORD_STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+class TraceWriter;
+
+/**
+ * Accounts for where the recorder's own time goes. Each step of
+ * RecordSession::record_step() runs in one Phase and its wall-clock time
+ * is charged to that phase. Optionally, a SIGPROF timer samples the phase
+ * rr is in every 1/hz seconds of rr CPU time, like perf would, which
+ * tells CPU-bound phases apart from phases that mostly wait for tracees.
+ *
+ * Nothing is measured until enable() has been called.
+ */
+class RecordStats {
+public:
+  enum Phase {
+    // Not inside record_step().
+    PHASE_OTHER,
+    // Picking the next task, including waiting for it to stop.
+    PHASE_SCHEDULE,
+    // Handling ptrace events (clone, exec, exit, seccomp, ...).
+    PHASE_PTRACE_EVENT,
+    // Recording and delivering signals.
+    PHASE_SIGNAL,
+    // Recording syscalls, mostly saving and restoring their parameters.
+    PHASE_SYSCALL,
+    // Handling desched events of buffered syscalls.
+    PHASE_DESCHED,
+    // Resuming the task.
+    PHASE_RESUME,
+    PHASE_COUNT
+  };
+
+  RecordStats();
+
+  /**
+   * Start measuring. If |sample_hz| is nonzero, also sample the current
+   * phase |sample_hz| times per second of rr CPU time.
+   */
+  void enable(int sample_hz);
+  bool enabled() const { return enabled_; }
+
+  /**
+   * Charges the time between its construction and destruction to |phase|.
+   */
+  class Timer {
+  public:
+    Timer(RecordStats& stats, Phase phase);
+    ~Timer();
+
+  private:
+    RecordStats& stats;
+    Phase phase;
+    Phase saved_phase;
+    double start;
+  };
+
+  /** A task came out of a ptrace-stop (was reaped by waitpid). */
+  void note_ptrace_stop() { ++ptrace_stops; }
+  /** The scheduler picked |switched| ? a different : the same task. */
+  void note_schedule(bool switched) {
+    ++schedule_decisions;
+    if (switched) {
+      ++task_switches;
+    }
+  }
+
+  /** Print a summary to |out|. */
+  void print(FILE* out, const TraceWriter& trace) const;
+
+private:
+  bool enabled_;
+  double start_time;
+  uint64_t ptrace_stops;
+  uint64_t schedule_decisions;
+  uint64_t task_switches;
+  uint64_t phase_counts[PHASE_COUNT];
+  double phase_times[PHASE_COUNT];
+  int sample_hz;
+};
+
+#endif /* RR_RECORD_STATS_H_ */
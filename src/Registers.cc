@@ -395,10 +395,86 @@ template <>
   return match;
 }
 
+/**
+ * The bits of Arch::user_regs_struct that compare_registers_arch looks at,
+ * as whole words, except orig_eax/orig_rax which are compared
+ * conditionally.
+ */
+template <typename Arch> struct ComparisonMask {
+  static const size_t NUM_WORDS =
+      (sizeof(typename Arch::user_regs_struct) + sizeof(uint64_t) - 1) /
+      sizeof(uint64_t);
+  uint64_t words[NUM_WORDS];
+
+  ComparisonMask() {
+    uint8_t bytes[sizeof(words)];
+    memset(bytes, 0, sizeof(bytes));
+    for (auto& rv : RegisterInfo<Arch>::registers) {
+      for (size_t i = 0; i < rv.nbytes; ++i) {
+        bytes[rv.offset + i] |= (rv.comparison_mask >> (i * 8)) & 0xff;
+      }
+    }
+    add_special_registers(bytes);
+    memcpy(words, bytes, sizeof(words));
+  }
+
+  void add_special_registers(uint8_t*) {}
+};
+
+template <>
+void ComparisonMask<rr::X64Arch>::add_special_registers(uint8_t* bytes) {
+  typedef rr::X64Arch::user_regs_struct Regs;
+  static const size_t uppers[] = {
+    offsetof(Regs, cs_upper), offsetof(Regs, ds_upper),
+    offsetof(Regs, es_upper), offsetof(Regs, fs_upper),
+    offsetof(Regs, gs_upper), offsetof(Regs, ss_upper),
+    offsetof(Regs, eflags_upper)
+  };
+  for (size_t offset : uppers) {
+    memset(bytes + offset, 0xff, sizeof(Regs().cs_upper));
+  }
+}
+
+/**
+ * Return true if |reg1| and |reg2| would compare equal in
+ * compare_registers_arch. The masked words are OR-ed together without
+ * branching so the compiler can vectorize the loop.
+ */
+template <typename Arch>
+/* static */ bool Registers::registers_match_arch(const Registers& reg1,
+                                                  const Registers& reg2) {
+  static const ComparisonMask<Arch> mask;
+  const uint8_t* p1 = reinterpret_cast<const uint8_t*>(&reg1.u);
+  const uint8_t* p2 = reinterpret_cast<const uint8_t*>(&reg2.u);
+  uint64_t diff = 0;
+  for (size_t i = 0; i < ComparisonMask<Arch>::NUM_WORDS; ++i) {
+    uint64_t v1, v2;
+    memcpy(&v1, p1 + i * sizeof(v1), sizeof(v1));
+    memcpy(&v2, p2 + i * sizeof(v2), sizeof(v2));
+    diff |= (v1 ^ v2) & mask.words[i];
+  }
+  if (diff) {
+    return false;
+  }
+  // See compare_registers_arch.
+  return (reg1.original_syscallno() < 0 && reg2.original_syscallno() < 0) ||
+         reg1.original_syscallno() == reg2.original_syscallno();
+}
+
+/*static*/ bool Registers::registers_match(const Registers& reg1,
+                                          const Registers& reg2) {
+  RR_ARCH_FUNCTION(registers_match_arch, reg1.arch(), reg1, reg2);
+}
+
 /*static*/ bool Registers::compare_register_files_internal(
     const char* name1, const Registers& reg1, const char* name2,
     const Registers& reg2, MismatchBehavior mismatch_behavior) {
   assert(reg1.arch() == reg2.arch());
+  // Almost every comparison matches, so check everything at once and
+  // only go register by register to report a mismatch.
+  if (registers_match(reg1, reg2)) {
+    return true;
+  }
   RR_ARCH_FUNCTION(compare_registers_arch, reg1.arch(), name1, reg1, name2,
                    reg2, mismatch_behavior);
 }
@@ -113,6 +113,7 @@ public:
   void set_ip(remote_ptr<uint8_t> addr) { RR_SET_REG(eip, rip, addr.as_int()); }
   remote_ptr<void> sp() const { return RR_GET_REG(esp, rsp); }
   void set_sp(remote_ptr<void> addr) { RR_SET_REG(esp, rsp, addr.as_int()); }
+  remote_ptr<void> bp() const { return RR_GET_REG(ebp, rbp); }
 
   // Access the registers holding system-call numbers, results, and
   // parameters.
@@ -287,6 +288,9 @@ public:
   uintptr_t cx() const { return RR_GET_REG(ecx, rcx); }
   void set_cx(uintptr_t value) { RR_SET_REG(ecx, rcx, value); }
 
+  uintptr_t bx() const { return RR_GET_REG(ebx, rbx); }
+  void set_bx(uintptr_t value) { RR_SET_REG(ebx, rbx, value); }
+
   bool clear_singlestep_flag();
 
   // End of X86-specific stuff
@@ -370,6 +374,12 @@ private:
                                      const char* name2, const Registers& reg2,
                                      MismatchBehavior mismatch_behavior);
 
+  template <typename Arch>
+  static bool registers_match_arch(const Registers& reg1,
+                                   const Registers& reg2);
+
+  static bool registers_match(const Registers& reg1, const Registers& reg2);
+
   static bool compare_register_files_internal(
       const char* name1, const Registers& reg1, const char* name2,
       const Registers& reg2, MismatchBehavior mismatch_behavior);
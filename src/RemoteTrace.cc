@@ -0,0 +1,414 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "RemoteTrace"
+
+#include "RemoteTrace.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "log.h"
+#include "util.h"
+
+using namespace std;
+
+const uint64_t RemoteTrace::MAX_READ;
+const uint64_t RemoteFile::CHUNK_SIZE;
+const size_t RemoteFile::CACHE_BYTES;
+
+static const char URL_PREFIX[] = "rr://";
+
+static bool write_all(int fd, const void* data, size_t size) {
+  while (size > 0) {
+    ssize_t ret = write(fd, data, size);
+    if (ret <= 0) {
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data = static_cast<const uint8_t*>(data) + ret;
+    size -= ret;
+  }
+  return true;
+}
+
+static bool read_all(int fd, void* data, size_t size) {
+  while (size > 0) {
+    ssize_t ret = read(fd, data, size);
+    if (ret <= 0) {
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data = static_cast<uint8_t*>(data) + ret;
+    size -= ret;
+  }
+  return true;
+}
+
+bool RemoteTrace::is_url(const string& dir) {
+  return dir.compare(0, sizeof(URL_PREFIX) - 1, URL_PREFIX) == 0;
+}
+
+/**
+ * Remote traces by URL and by cache directory. They live until we exit.
+ */
+static map<string, shared_ptr<RemoteTrace> >& remote_traces() {
+  static map<string, shared_ptr<RemoteTrace> >* traces =
+      new map<string, shared_ptr<RemoteTrace> >();
+  return *traces;
+}
+
+shared_ptr<RemoteTrace> RemoteTrace::get(const string& dir) {
+  auto& traces = remote_traces();
+  auto it = traces.find(dir);
+  if (it != traces.end()) {
+    return it->second;
+  }
+  if (!is_url(dir)) {
+    return nullptr;
+  }
+
+  string address = dir.substr(sizeof(URL_PREFIX) - 1);
+  while (!address.empty() && address.back() == '/') {
+    address.pop_back();
+  }
+  size_t colon = address.rfind(':');
+  if (colon == string::npos || colon == 0 || colon + 1 == address.size()) {
+    fprintf(stderr, "rr: error: `%s' isn't of the form rr://<host>:<port>\n",
+            dir.c_str());
+    exit(EX_USAGE);
+  }
+  shared_ptr<RemoteTrace> trace(
+      new RemoteTrace(address.substr(0, colon), address.substr(colon + 1)));
+  traces[dir] = trace;
+  traces[trace->cache_dir()] = trace;
+  return trace;
+}
+
+RemoteTrace::RemoteTrace(const string& host, const string& port)
+    : host(host), port(port), prefetch_pid(0) {
+  pthread_mutex_init(&sock_mutex, nullptr);
+  pthread_mutex_init(&mutex, nullptr);
+  pthread_cond_init(&cond, nullptr);
+
+  sock = connect_to_server();
+  sock_pid = getpid();
+  vector<uint8_t> id;
+  int64_t result;
+  if (!sock.is_open() || !request(sock, HELLO, string(), 0, 0, &id, &result) ||
+      result < 0) {
+    fprintf(stderr, "rr: error: Can't connect to the trace server at %s:%s\n",
+            host.c_str(), port.c_str());
+    exit(EX_UNAVAILABLE);
+  }
+
+  // Name the cache after the trace, so a different trace served from the
+  // same address doesn't reuse it.
+  string key = host + ":" + port + "/";
+  key.append(id.begin(), id.end());
+  Hash128 h = hash_bytes(key.data(), key.size());
+  const char* tmp_dir = getenv("TMPDIR");
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/rr-remote-%016" PRIx64 "%016" PRIx64,
+           tmp_dir ? tmp_dir : "/tmp", h.h1, h.h2);
+  cache_dir_ = path;
+  if (mkdir(cache_dir_.c_str(), S_IRWXU) && errno != EEXIST) {
+    FATAL() << "Can't create trace cache directory " << cache_dir_;
+  }
+  LOG(debug) << "Caching " << host << ":" << port << " in " << cache_dir_;
+}
+
+ScopedFd RemoteTrace::connect_to_server() const {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* addrs;
+  if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs)) {
+    return ScopedFd();
+  }
+  ScopedFd fd;
+  for (struct addrinfo* a = addrs; a; a = a->ai_next) {
+    fd = ScopedFd(socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC,
+                         a->ai_protocol));
+    if (fd.is_open() && connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+      break;
+    }
+    fd.close();
+  }
+  freeaddrinfo(addrs);
+  return fd;
+}
+
+bool RemoteTrace::request(const ScopedFd& sock, Op op, const string& name,
+                          uint64_t offset, uint64_t length,
+                          vector<uint8_t>* payload, int64_t* result) {
+  Request req = { op, uint32_t(name.size()), offset, length };
+  Response resp;
+  if (!write_all(sock, &req, sizeof(req)) ||
+      !write_all(sock, name.data(), name.size()) ||
+      !read_all(sock, &resp, sizeof(resp))) {
+    return false;
+  }
+  *result = resp.result;
+  if (resp.result < 0) {
+    return true;
+  }
+  if (uint64_t(resp.result) > MAX_READ) {
+    return false;
+  }
+  payload->resize(resp.result);
+  return read_all(sock, payload->data(), payload->size());
+}
+
+bool RemoteTrace::request(Op op, const string& name, uint64_t offset,
+                          uint64_t length, vector<uint8_t>* payload,
+                          int64_t* result) {
+  pthread_mutex_lock(&sock_mutex);
+  if (sock_pid != getpid()) {
+    sock = connect_to_server();
+    sock_pid = getpid();
+  }
+  bool ok = request(sock, op, name, offset, length, payload, result);
+  pthread_mutex_unlock(&sock_mutex);
+  return ok;
+}
+
+bool RemoteTrace::fetch(const string& name) {
+  string path = cache_dir_ + "/" + name;
+  if (access(path.c_str(), F_OK) == 0) {
+    return true;
+  }
+  for (size_t slash = name.find('/'); slash != string::npos;
+       slash = name.find('/', slash + 1)) {
+    string dir = cache_dir_ + "/" + name.substr(0, slash);
+    if (mkdir(dir.c_str(), S_IRWXU) && errno != EEXIST) {
+      return false;
+    }
+  }
+
+  vector<uint8_t> payload;
+  int64_t result;
+  StatReply st;
+  if (!request(STAT, name, 0, 0, &payload, &result) || result < 0 ||
+      payload.size() != sizeof(st)) {
+    return false;
+  }
+  memcpy(&st, payload.data(), sizeof(st));
+
+  LOG(debug) << "Fetching " << name << " (" << st.size << " bytes)";
+  // Copy to a temporary and rename it into place, so an interrupted fetch
+  // never leaves a partial copy. Forked replays may fetch the same file
+  // at once, so the temporary is per-process.
+  char tmp_path[PATH_MAX];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp%d", path.c_str(), getpid());
+  ScopedFd dst(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (!dst.is_open()) {
+    return false;
+  }
+  bool ok = true;
+  for (uint64_t offset = 0; ok && offset < st.size;
+       offset += payload.size()) {
+    ok = request(READ, name, offset, min(st.size - offset, MAX_READ),
+                 &payload, &result) &&
+         result > 0 && write_all(dst, payload.data(), payload.size());
+  }
+  // Replay checks the copy's mode and mtime against the recorded ones.
+  struct timespec times[2] = { { st.mtime_sec, st.mtime_nsec },
+                               { st.mtime_sec, st.mtime_nsec } };
+  ok = ok && fchmod(dst, st.mode & 07777) == 0 && futimens(dst, times) == 0 &&
+       rename(tmp_path, path.c_str()) == 0;
+  if (!ok) {
+    unlink(tmp_path);
+  }
+  return ok;
+}
+
+shared_ptr<RemoteFile> RemoteTrace::open_file(const string& name) {
+  pthread_mutex_lock(&mutex);
+  shared_ptr<RemoteFile> file = files[name].lock();
+  if (!file) {
+    file = make_shared<RemoteFile>(this, name);
+    files[name] = file;
+  }
+  pthread_mutex_unlock(&mutex);
+  return file;
+}
+
+void* RemoteTrace::prefetch_thread(void* p) {
+  static_cast<RemoteTrace*>(p)->prefetch_loop();
+  return nullptr;
+}
+
+void RemoteTrace::prefetch_loop() {
+  ScopedFd prefetch_sock = connect_to_server();
+  if (!prefetch_sock.is_open()) {
+    LOG(warn) << "Can't make a prefetch connection to " << host << ":"
+              << port;
+    return;
+  }
+  pthread_mutex_lock(&mutex);
+  while (true) {
+    if (prefetch_queue.empty()) {
+      pthread_cond_wait(&cond, &mutex);
+      continue;
+    }
+    auto item = prefetch_queue.front();
+    prefetch_queue.pop_front();
+    pthread_mutex_unlock(&mutex);
+
+    RemoteFile& file = *item.first;
+    pthread_mutex_lock(&file.mutex);
+    file.get_chunk(item.second, &prefetch_sock);
+    pthread_mutex_unlock(&file.mutex);
+
+    pthread_mutex_lock(&mutex);
+  }
+}
+
+RemoteFile::RemoteFile(RemoteTrace* trace, const string& name)
+    : trace(trace), name(name), size_(-1), cached_bytes(0), use_count(0) {
+  pthread_mutex_init(&mutex, nullptr);
+  pthread_cond_init(&cond, nullptr);
+  vector<uint8_t> payload;
+  int64_t result;
+  RemoteTrace::StatReply st;
+  if (trace->request(RemoteTrace::STAT, name, 0, 0, &payload, &result) &&
+      result >= 0 && payload.size() == sizeof(st)) {
+    memcpy(&st, payload.data(), sizeof(st));
+    size_ = st.size;
+  }
+}
+
+shared_ptr<RemoteFile::Chunk> RemoteFile::get_chunk(
+    uint64_t index, const ScopedFd* prefetch_sock) {
+  while (true) {
+    auto it = chunks.find(index);
+    if (it == chunks.end()) {
+      break;
+    }
+    if (!it->second->loading) {
+      it->second->last_use = ++use_count;
+      return it->second;
+    }
+    // Someone else is fetching it.
+    pthread_cond_wait(&cond, &mutex);
+  }
+
+  auto chunk = make_shared<Chunk>();
+  chunk->loading = true;
+  chunks[index] = chunk;
+  pthread_mutex_unlock(&mutex);
+
+  uint64_t offset = index * CHUNK_SIZE;
+  uint64_t length = min<uint64_t>(CHUNK_SIZE, size_ - offset);
+  int64_t result;
+  bool ok = prefetch_sock
+                ? RemoteTrace::request(*prefetch_sock, RemoteTrace::READ, name,
+                                       offset, length, &chunk->data, &result)
+                : trace->request(RemoteTrace::READ, name, offset, length,
+                                 &chunk->data, &result);
+  ok = ok && result == int64_t(length);
+
+  pthread_mutex_lock(&mutex);
+  chunk->loading = false;
+  pthread_cond_broadcast(&cond);
+  if (!ok) {
+    chunks.erase(index);
+    return nullptr;
+  }
+  chunk->last_use = ++use_count;
+  cached_bytes += chunk->data.size();
+  evict();
+  return chunk;
+}
+
+void RemoteFile::evict() {
+  while (cached_bytes > CACHE_BYTES) {
+    auto victim = chunks.end();
+    for (auto it = chunks.begin(); it != chunks.end(); ++it) {
+      if (!it->second->loading &&
+          (victim == chunks.end() ||
+           it->second->last_use < victim->second->last_use)) {
+        victim = it;
+      }
+    }
+    if (victim == chunks.end()) {
+      return;
+    }
+    // Readers holding the chunk keep it alive.
+    cached_bytes -= victim->second->data.size();
+    chunks.erase(victim);
+  }
+}
+
+bool RemoteFile::read(void* data, size_t size, uint64_t offset) {
+  if (!good() || offset > uint64_t(size_) || size_ - offset < size) {
+    return false;
+  }
+  bool ok = true;
+  pthread_mutex_lock(&mutex);
+  while (size > 0) {
+    auto chunk = get_chunk(offset / CHUNK_SIZE, nullptr);
+    if (!chunk) {
+      ok = false;
+      break;
+    }
+    size_t chunk_offset = offset % CHUNK_SIZE;
+    size_t amount = min(size, chunk->data.size() - chunk_offset);
+    memcpy(data, chunk->data.data() + chunk_offset, amount);
+    data = static_cast<uint8_t*>(data) + amount;
+    size -= amount;
+    offset += amount;
+  }
+  pthread_mutex_unlock(&mutex);
+  return ok;
+}
+
+void RemoteFile::prefetch(uint64_t offset, uint64_t size) {
+  if (!good() || offset >= uint64_t(size_)) {
+    return;
+  }
+  uint64_t end = min<uint64_t>(offset + size, size_);
+  vector<uint64_t> wanted;
+  pthread_mutex_lock(&mutex);
+  for (uint64_t i = offset / CHUNK_SIZE; i * CHUNK_SIZE < end; ++i) {
+    if (!chunks.count(i)) {
+      wanted.push_back(i);
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+  if (wanted.empty()) {
+    return;
+  }
+
+  pthread_mutex_lock(&trace->mutex);
+  if (trace->prefetch_pid != getpid()) {
+    // The prefetch thread doesn't survive a fork, so a forked replay
+    // starts its own.
+    trace->prefetch_queue.clear();
+    trace->prefetch_pid = getpid();
+    pthread_t thread;
+    pthread_create(&thread, nullptr, RemoteTrace::prefetch_thread, trace);
+    pthread_setname_np(thread, "prefetch");
+    pthread_detach(thread);
+  }
+  for (uint64_t i : wanted) {
+    trace->prefetch_queue.push_back(make_pair(shared_from_this(), i));
+  }
+  pthread_cond_broadcast(&trace->cond);
+  pthread_mutex_unlock(&trace->mutex);
+}
@@ -0,0 +1,191 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_REMOTE_TRACE_H_
+#define RR_REMOTE_TRACE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "ScopedFd.h"
+
+class RemoteFile;
+
+/**
+ * A trace directory exported by `rr serve` on another machine, named by
+ * a URL rr://<host>:<port>. Replaying it doesn't require copying the
+ * trace first: substreams are read through RemoteFiles, which fetch the
+ * parts of the file CompressedReader asks for, and the small files and
+ * mapped files that replay opens by path are fetched whole, on first use,
+ * into a local cache directory that stands in for the trace directory.
+ * The cache survives across runs, so replaying the same trace again only
+ * refetches substream data.
+ *
+ * The protocol is a sequence of requests, each answered in order: a
+ * Request header followed by |name_len| bytes of file name (relative to
+ * the trace directory), answered by a Response header followed by
+ * |result| bytes of payload, or by no payload if |result| is negative
+ * (-errno). Both ends are the same rr build, so everything is in host
+ * byte order.
+ */
+class RemoteTrace {
+public:
+  enum Op {
+    // Payload: an identifier for the trace, stable while it's unchanged.
+    HELLO,
+    // Payload: a StatReply for the named file.
+    STAT,
+    // Payload: up to |length| bytes of the named file, from |offset|.
+    READ
+  };
+  struct Request {
+    uint32_t op;
+    uint32_t name_len;
+    uint64_t offset;
+    uint64_t length;
+  };
+  struct Response {
+    int64_t result;
+  };
+  struct StatReply {
+    uint64_t size;
+    uint32_t mode;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+  };
+  /**
+   * The most a READ returns, so one request can't tie up the connection
+   * for long.
+   */
+  static const uint64_t MAX_READ = 16 * 1024 * 1024;
+
+  static bool is_url(const std::string& dir);
+  /**
+   * Return the remote trace that |dir| names: either a URL, in which case
+   * we connect to the server (exiting on failure), or the cache directory
+   * of a remote trace opened earlier by this process. Returns null if
+   * |dir| is an ordinary trace directory.
+   */
+  static std::shared_ptr<RemoteTrace> get(const std::string& dir);
+
+  /**
+   * The local directory replay should use as the trace directory.
+   */
+  const std::string& cache_dir() const { return cache_dir_; }
+
+  /**
+   * Make sure the cache directory has a complete copy of |name|, with
+   * its original mode and mtime. Returns false if the server doesn't have
+   * |name| or it can't be copied.
+   */
+  bool fetch(const std::string& name);
+
+  /**
+   * Return a RemoteFile for |name|. Readers of the same file share one
+   * block cache.
+   */
+  std::shared_ptr<RemoteFile> open_file(const std::string& name);
+
+private:
+  friend class RemoteFile;
+
+  RemoteTrace(const std::string& host, const std::string& port);
+
+  ScopedFd connect_to_server() const;
+  static bool request(const ScopedFd& sock, Op op, const std::string& name,
+                      uint64_t offset, uint64_t length,
+                      std::vector<uint8_t>* payload, int64_t* result);
+  bool request(Op op, const std::string& name, uint64_t offset,
+               uint64_t length, std::vector<uint8_t>* payload,
+               int64_t* result);
+
+  static void* prefetch_thread(void* p);
+  void prefetch_loop();
+
+  std::string host;
+  std::string port;
+  std::string cache_dir_;
+  // Used by everything but the prefetch thread, which has its own
+  // connection so a prefetch never delays a read that needs its data now.
+  ScopedFd sock;
+  // The process |sock| belongs to. A forked child must not share its
+  // parent's connection, so it makes its own.
+  pid_t sock_pid;
+  pthread_mutex_t sock_mutex;
+
+  // BEGIN protected by |mutex|
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  std::map<std::string, std::weak_ptr<RemoteFile> > files;
+  std::deque<std::pair<std::shared_ptr<RemoteFile>, uint64_t> >
+      prefetch_queue;
+  // The process whose prefetch thread serves |prefetch_queue|, if any.
+  pid_t prefetch_pid;
+  // END protected by |mutex|
+};
+
+/**
+ * A file in a remote trace, read in CHUNK_SIZE-aligned chunks that are
+ * kept in memory (up to CACHE_BYTES, least recently used first out) so
+ * CompressedReader's small header reads and the block reads that follow
+ * them cost one round trip. Safe to use from several threads.
+ */
+class RemoteFile : public std::enable_shared_from_this<RemoteFile> {
+public:
+  static const uint64_t CHUNK_SIZE = 1024 * 1024;
+  static const size_t CACHE_BYTES = 256 * 1024 * 1024;
+
+  RemoteFile(RemoteTrace* trace, const std::string& name);
+
+  bool good() const { return size_ >= 0; }
+  uint64_t size() const { return good() ? size_ : 0; }
+  /**
+   * Read exactly |size| bytes at |offset|. Returns false on error or if
+   * the file is too short.
+   */
+  bool read(void* data, size_t size, uint64_t offset);
+  /**
+   * Start fetching the chunks covering [offset, offset + size) in the
+   * background.
+   */
+  void prefetch(uint64_t offset, uint64_t size);
+
+private:
+  friend class RemoteTrace;
+
+  struct Chunk {
+    Chunk() : last_use(0), loading(false) {}
+    std::vector<uint8_t> data;
+    uint64_t last_use;
+    bool loading;
+  };
+
+  /**
+   * Return chunk |index|, fetching it if necessary: over |prefetch_sock|
+   * if that's not null, otherwise over the trace's shared connection.
+   * Returns null on error. Called with |mutex| held.
+   */
+  std::shared_ptr<Chunk> get_chunk(uint64_t index,
+                                   const ScopedFd* prefetch_sock);
+  void evict();
+
+  RemoteTrace* trace;
+  std::string name;
+  int64_t size_;
+
+  // BEGIN protected by |mutex|
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  std::map<uint64_t, std::shared_ptr<Chunk> > chunks;
+  size_t cached_bytes;
+  uint64_t use_count;
+  // END protected by |mutex|
+};
+
+#endif /* RR_REMOTE_TRACE_H_ */
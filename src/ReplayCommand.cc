@@ -3,6 +3,7 @@
 //#define DEBUGTAG "ReplayCommand"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -16,6 +17,8 @@
 #include "main.h"
 #include "ReplaySession.h"
 #include "ScopedFd.h"
+#include "StdioOutput.h"
+#include "util.h"
 
 using namespace std;
 
@@ -35,12 +38,36 @@ ReplayCommand ReplayCommand::singleton(
     "replay",
     " rr replay [OPTION]... [<trace-dir>]\n"
     "  -a, --autopilot            replay without debugger server\n"
+    "  -b, --bisect-checksums=<N> with -a and --checksum, validate only every\n"
+    "                             Nth recorded checksum, then replay again\n"
+    "                             validating all checksums between the last\n"
+    "                             good and the first bad one.\n"
+    "  -B, --batch-output         echo tracee writes to stdout/stderr in\n"
+    "                             large batches, when the debugger stops\n"
+    "                             and at exit, instead of as each write\n"
+    "                             is replayed\n"
     "  -f, --onfork=<PID>         start a debug server when <PID> has been\n"
     "                             fork()d, AND the target event has been\n"
     "                             reached.\n"
+    "  -F, --fast-forward         with -g, -f or -p, skip consistency checks\n"
+    "                             until the debug server starts; with -T,\n"
+    "                             skip them for the whole replay\n"
     "  -g, --goto=<EVENT-NUM>     start a debug server on reaching "
     "<EVENT-NUM>\n"
     "                             in the trace.  See -m above.\n"
+    "  -j, --jobs=<N>             with -a or -T, split the trace into N\n"
+    "                             parts and check them in parallel, each\n"
+    "                             replay fast-forwarding to its part\n"
+    "  -k, --keep-listening       with -s, keep serving the replay after the\n"
+    "                             debugger detaches, so another debugger can\n"
+    "                             attach where it left off.\n"
+    "  -o, --output-file=<FILE>   echo tracee writes to stdout/stderr into\n"
+    "                             <FILE>, in large batches, instead of to\n"
+    "                             the console\n"
+    "  -P, --dprintf-file=<FILE>  write the output of gdb dprintfs that rr\n"
+    "                             runs itself (set dprintf-style agent), and\n"
+    "                             their hit counts, to <FILE> instead of\n"
+    "                             stdout\n"
     "  -p, --onprocess=<PID>|<COMMAND>\n"
     "                             start a debug server when <PID> or "
     "<COMMAND>\n"
@@ -48,9 +75,20 @@ ReplayCommand ReplayCommand::singleton(
     "been\n"
     "                             reached.\n"
     "  -q, --no-redirect-output   don't replay writes to stdout/stderr\n"
+    "  -R, --parallel             with -a or -T, let a process run towards\n"
+    "                             the end of its next time slice on another\n"
+    "                             CPU while the previous process finishes its\n"
+    "                             own, when they share no writable memory\n"
     "  -s, --dbgport=<PORT>       only start a debug server on <PORT>;\n"
     "                             don't automatically launch the debugger\n"
     "                             client too.\n"
+    "  -t, --tail-output=<BYTES>  only echo the last <BYTES> bytes the\n"
+    "                             tracee wrote to stdout/stderr before\n"
+    "                             each debugger stop, and at exit\n"
+    "  -T, --throughput           like -a, but only check that the trace\n"
+    "                             replays, as quickly as possible: tracee\n"
+    "                             output isn't echoed, and the replay time\n"
+    "                             is reported at the end\n"
     "  -x, --gdb-x=<FILE>         execute gdb commands from <FILE>\n");
 
 struct ReplayFlags {
@@ -82,38 +120,88 @@ struct ReplayFlags {
   // IP port to listen on for debug connections.
   int dbg_port;
 
+  // Accept another debug connection when the debugger detaches.
+  bool keep_listening;
+
   // Pass this file name to debugger with -x
   string gdb_command_file_path;
 
+  // Skip consistency checks until the debug server starts.
+  bool fast_forward;
+
+  // Autopilot replay that's only checking that the trace replays.
+  bool throughput;
+
+  // If > 1, check the autopilot replay in this many parallel parts.
+  int jobs;
+
+  // Overlap time slices of independent processes; see
+  // ReplaySession::Flags::parallel.
+  bool parallel;
+
   /* When true, echo tracee stdout/stderr writes to console. */
   bool redirect;
 
+  /* When true, buffer echoed stdout/stderr writes. */
+  bool batch_output;
+
+  /* If nonempty, echo stdout/stderr writes to this file instead. */
+  string output_file;
+
+  /* If nonempty, write agent-style dprintf output here. */
+  string dprintf_file;
+
+  /* If nonzero, only echo this many bytes of output before each stop. */
+  size_t tail_output_bytes;
+
+  // When nonzero, find checksum mismatches by first validating only every
+  // |checksum_bisect_stride|th checksum.
+  uint32_t checksum_bisect_stride;
+
   ReplayFlags()
       : goto_event(0),
         target_process(0),
         process_created_how(CREATED_NONE),
         dont_launch_debugger(false),
         dbg_port(-1),
-        redirect(true) {}
+        keep_listening(false),
+        fast_forward(false),
+        throughput(false),
+        jobs(1),
+        parallel(false),
+        redirect(true),
+        batch_output(false),
+        tail_output_bytes(0),
+        checksum_bisect_stride(0) {}
 };
 
 static bool parse_replay_arg(std::vector<std::string>& args,
                              ReplayFlags& flags) {
-  if (parse_global_option(args)) {
-    return true;
-  }
-
   static const OptionSpec options[] = { { 'a', "autopilot", NO_PARAMETER },
+                                        { 'B', "batch-output", NO_PARAMETER },
+                                        { 'b', "bisect-checksums",
+                                          HAS_PARAMETER },
                                         { 's', "dbgport", HAS_PARAMETER },
+                                        { 'F', "fast-forward", NO_PARAMETER },
                                         { 'g', "goto", HAS_PARAMETER },
+                                        { 'j', "jobs", HAS_PARAMETER },
+                                        { 'k', "keep-listening",
+                                          NO_PARAMETER },
                                         { 'q', "no-redirect-output",
                                           NO_PARAMETER },
+                                        { 'R', "parallel", NO_PARAMETER },
                                         { 'f', "onfork", HAS_PARAMETER },
+                                        { 'o', "output-file", HAS_PARAMETER },
+                                        { 'P', "dprintf-file", HAS_PARAMETER },
                                         { 'p', "onprocess", HAS_PARAMETER },
+                                        { 't', "tail-output", HAS_PARAMETER },
+                                        { 'T', "throughput", NO_PARAMETER },
                                         { 'x', "gdb-x", HAS_PARAMETER } };
   ParsedOption opt;
   if (!Command::parse_option(args, options, &opt)) {
-    return false;
+    // Our own options win over global options with the same short name;
+    // those can still be given before the command name.
+    return parse_global_option(args);
   }
 
   switch (opt.short_name) {
@@ -121,6 +209,15 @@ static bool parse_replay_arg(std::vector<std::string>& args,
       flags.goto_event = numeric_limits<decltype(flags.goto_event)>::max();
       flags.dont_launch_debugger = true;
       break;
+    case 'B':
+      flags.batch_output = true;
+      break;
+    case 'b':
+      if (!opt.verify_valid_int(1, UINT32_MAX)) {
+        return false;
+      }
+      flags.checksum_bisect_stride = opt.int_value;
+      break;
     case 'f':
       if (!opt.verify_valid_int(1, INT32_MAX)) {
         return false;
@@ -128,12 +225,30 @@ static bool parse_replay_arg(std::vector<std::string>& args,
       flags.target_process = opt.int_value;
       flags.process_created_how = ReplayFlags::CREATED_FORK;
       break;
+    case 'F':
+      flags.fast_forward = true;
+      break;
     case 'g':
-      if (!opt.verify_valid_int(1, UINT32_MAX)) {
+      if (!opt.verify_valid_int(1)) {
         return false;
       }
       flags.goto_event = opt.int_value;
       break;
+    case 'j':
+      if (!opt.verify_valid_int(1, 1024)) {
+        return false;
+      }
+      flags.jobs = opt.int_value;
+      break;
+    case 'k':
+      flags.keep_listening = true;
+      break;
+    case 'o':
+      flags.output_file = opt.value;
+      break;
+    case 'P':
+      flags.dprintf_file = opt.value;
+      break;
     case 'p':
       if (opt.int_value > 0) {
         if (!opt.verify_valid_int(1, INT32_MAX)) {
@@ -148,6 +263,9 @@ static bool parse_replay_arg(std::vector<std::string>& args,
     case 'q':
       flags.redirect = false;
       break;
+    case 'R':
+      flags.parallel = true;
+      break;
     case 's':
       if (!opt.verify_valid_int(1, INT32_MAX)) {
         return false;
@@ -155,6 +273,17 @@ static bool parse_replay_arg(std::vector<std::string>& args,
       flags.dbg_port = opt.int_value;
       flags.dont_launch_debugger = true;
       break;
+    case 't':
+      if (!opt.verify_valid_int(1, INT32_MAX)) {
+        return false;
+      }
+      flags.tail_output_bytes = opt.int_value;
+      break;
+    case 'T':
+      flags.goto_event = numeric_limits<decltype(flags.goto_event)>::max();
+      flags.dont_launch_debugger = true;
+      flags.throughput = true;
+      break;
     case 'x':
       flags.gdb_command_file_path = opt.value;
       break;
@@ -207,6 +336,13 @@ static void set_sig_blockedness(int sig, int blockedness) {
 static ReplaySession::Flags session_flags(ReplayFlags flags) {
   ReplaySession::Flags result;
   result.redirect_stdio = flags.redirect;
+  // With -a there's no debug server to fast-forward to, but -T doesn't want
+  // the checks at all.
+  result.fast_forward =
+      flags.fast_forward &&
+      (flags.throughput ||
+       flags.goto_event != numeric_limits<decltype(flags.goto_event)>::max());
+  result.parallel = flags.parallel;
   return result;
 }
 
@@ -214,14 +350,58 @@ static uint64_t to_microseconds(const struct timeval& tv) {
   return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
 }
 
+/**
+ * Replay with checksums validated only every |flags.checksum_bisect_stride|
+ * checksummed events until one doesn't match. If one doesn't, make
+ * |dense_flags| validate every checksum after the last good one, so
+ * replaying with them stops at the first divergent event, and return true.
+ */
+static bool bisect_checksums(const string& trace_dir, const ReplayFlags& flags,
+                             ReplaySession::Flags* dense_flags) {
+  ReplaySession::Flags sparse_flags = session_flags(flags);
+  sparse_flags.redirect_stdio = false;
+  sparse_flags.checksum_stride = flags.checksum_bisect_stride;
+  sparse_flags.fatal_checksum_mismatch = false;
+  ReplaySession::shr_ptr replay_session = ReplaySession::create(trace_dir);
+  replay_session->set_flags(sparse_flags);
+  while (!replay_session->first_bad_checksum_time()) {
+    auto result = replay_session->replay_step(RUN_CONTINUE);
+    if (result.status == REPLAY_EXITED) {
+      break;
+    }
+  }
+
+  if (!replay_session->first_bad_checksum_time()) {
+    fprintf(stderr, "rr: no checksum mismatch found\n");
+    return false;
+  }
+  fprintf(stderr, "rr: checksums diverge between events %" PRIu64
+                  " and %" PRIu64 "; "
+                  "replaying again to find the first divergent event\n",
+          replay_session->last_good_checksum_time(),
+          replay_session->first_bad_checksum_time());
+  dense_flags->checksums_after = replay_session->last_good_checksum_time();
+  return true;
+}
+
 static void serve_replay_no_debugger(const string& trace_dir,
                                      const ReplayFlags& flags) {
+  ReplaySession::Flags replay_flags = session_flags(flags);
+  if (flags.checksum_bisect_stride &&
+      Flags::get().checksum != Flags::CHECKSUM_NONE &&
+      !bisect_checksums(trace_dir, flags, &replay_flags)) {
+    return;
+  }
   ReplaySession::shr_ptr replay_session = ReplaySession::create(trace_dir);
-  replay_session->set_flags(session_flags(flags));
+  replay_session->set_flags(replay_flags);
+  // Not echoing output saves reading it from the tracee.
+  replay_session->set_visible_execution(!flags.throughput);
   uint32_t step_count = 0;
+  struct timeval start_time;
   struct timeval last_dump_time;
   Session::Statistics last_stats;
-  gettimeofday(&last_dump_time, NULL);
+  gettimeofday(&start_time, NULL);
+  last_dump_time = start_time;
 
   while (true) {
     auto result = replay_session->replay_step(RUN_CONTINUE);
@@ -232,10 +412,11 @@ static void serve_replay_no_debugger(const string& trace_dir,
       Session::Statistics stats = replay_session->statistics();
       printf(
           "[ReplayStatistics] ticks %lld syscalls %lld bytes_written %lld "
-          "microseconds %lld\n",
+          "ptrace_calls %lld microseconds %lld\n",
           (long long)(stats.ticks_processed - last_stats.ticks_processed),
           (long long)(stats.syscalls_performed - last_stats.syscalls_performed),
           (long long)(stats.bytes_written - last_stats.bytes_written),
+          (long long)(stats.ptrace_calls - last_stats.ptrace_calls),
           (long long)(to_microseconds(now) - to_microseconds(last_dump_time)));
       last_dump_time = now;
       last_stats = stats;
@@ -249,9 +430,98 @@ static void serve_replay_no_debugger(const string& trace_dir,
            result.break_status.reason == BREAK_SIGNAL);
   }
 
+  StdioOutput::get().flush();
+  if (flags.throughput) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    fprintf(stderr, "rr: replayed %" PRIu64 " events in %.3f seconds\n",
+            replay_session->trace_reader().time(),
+            (to_microseconds(now) - to_microseconds(start_time)) / 1e6);
+  }
   LOG(info) << ("Replayer successfully finished.");
 }
 
+/**
+ * Replay the whole trace, checking only events |first| through |last|:
+ * replay fast-forwards to |first| and stops after |last|.
+ */
+static void check_replay_part(const string& trace_dir, const ReplayFlags& flags,
+                              TraceFrame::Time first, TraceFrame::Time last,
+                              int cpu) {
+  ReplaySession::Flags replay_flags = session_flags(flags);
+  // With -T -F nothing is checked, so there's nothing to turn on.
+  bool start_checking = !replay_flags.fast_forward && first > 1;
+  replay_flags.fast_forward = replay_flags.fast_forward || first > 1;
+  ReplaySession::shr_ptr replay_session =
+      ReplaySession::create(trace_dir, cpu);
+  replay_session->set_flags(replay_flags);
+  replay_session->set_visible_execution(false);
+
+  while (replay_session->trace_reader().time() <= last) {
+    if (start_checking && replay_session->trace_reader().time() + 1 >= first) {
+      replay_flags.fast_forward = false;
+      replay_session->set_flags(replay_flags);
+      start_checking = false;
+    }
+    auto result = replay_session->replay_step(RUN_CONTINUE);
+    if (result.status == REPLAY_EXITED) {
+      break;
+    }
+  }
+}
+
+/**
+ * Check that the trace replays using |flags.jobs| processes. Each replays
+ * from the start, fast-forwarding to its share of the events and checking
+ * only those, so the slow checks run in parallel.
+ */
+static int check_replay_in_parallel(const string& trace_dir,
+                                    const ReplayFlags& flags) {
+  TraceFrame::Time last_event = 0;
+  {
+    TraceReader trace(trace_dir);
+    while (!trace.at_end()) {
+      last_event = trace.read_frame().time();
+    }
+  }
+
+  int num_cpus = get_num_cpus();
+  vector<pid_t> children;
+  vector<pair<TraceFrame::Time, TraceFrame::Time> > parts;
+  for (int i = 0; i < flags.jobs; ++i) {
+    TraceFrame::Time first = last_event * i / flags.jobs + 1;
+    TraceFrame::Time last = last_event * (i + 1) / flags.jobs;
+    if (first > last) {
+      continue;
+    }
+    pid_t child = fork();
+    if (child == 0) {
+      check_replay_part(trace_dir, flags, first, last, i % num_cpus);
+      _exit(0);
+    }
+    if (child < 0) {
+      FATAL() << "Can't fork";
+    }
+    children.push_back(child);
+    parts.push_back(make_pair(first, last));
+  }
+
+  int ret = 0;
+  for (size_t i = 0; i < children.size(); ++i) {
+    int status;
+    if (waitpid(children[i], &status, 0) != children[i]) {
+      FATAL() << "waitpid failed";
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+      fprintf(stderr,
+              "rr: replay failed checking events %" PRIu64 "-%" PRIu64 "\n",
+              parts[i].first, parts[i].second);
+      ret = 1;
+    }
+  }
+  return ret;
+}
+
 static void handle_signal(int sig) {
   switch (sig) {
     case SIGINT:
@@ -283,17 +553,30 @@ static int replay(const string& trace_dir, const ReplayFlags& flags) {
       break;
   }
   target.event = flags.goto_event;
+  StdioOutput& output = StdioOutput::get();
+  output.set_batching(flags.batch_output);
+  if (!flags.output_file.empty()) {
+    output.set_output_file(flags.output_file);
+  }
+  if (flags.tail_output_bytes) {
+    output.set_tail(flags.tail_output_bytes);
+  }
 
   // If we're not going to autolaunch the debugger, don't go
   // through the rigamarole to set that up.  All it does is
   // complicate the process tree and confuse users.
   if (flags.dont_launch_debugger) {
     if (target.event == numeric_limits<decltype(target.event)>::max()) {
+      if (flags.jobs > 1) {
+        return check_replay_in_parallel(trace_dir, flags);
+      }
       serve_replay_no_debugger(trace_dir, flags);
     } else {
       auto session = ReplaySession::create(trace_dir);
       GdbServer::ConnectionFlags conn_flags;
       conn_flags.dbg_port = flags.dbg_port;
+      conn_flags.keep_listening = flags.keep_listening;
+      conn_flags.dprintf_file = flags.dprintf_file;
       GdbServer::serve(session, target, conn_flags, session_flags(flags));
     }
     return 0;
@@ -324,6 +607,7 @@ static int replay(const string& trace_dir, const ReplayFlags& flags) {
     GdbServer::ConnectionFlags conn_flags;
     conn_flags.dbg_port = flags.dbg_port;
     conn_flags.debugger_params_write_pipe = &debugger_params_write_pipe;
+    conn_flags.dprintf_file = flags.dprintf_file;
     GdbServer::serve(session, target, conn_flags, session_flags(flags));
     return 0;
   }
@@ -377,6 +661,20 @@ int ReplayCommand::run(std::vector<std::string>& args) {
     return 1;
   }
 
+  if (flags.fast_forward && flags.checksum_bisect_stride) {
+    fprintf(stderr, "-F skips the checksums -b needs.\n");
+    return 1;
+  }
+  if (flags.parallel &&
+      flags.goto_event != numeric_limits<decltype(flags.goto_event)>::max()) {
+    fprintf(stderr, "-R only works with -a or -T.\n");
+    return 1;
+  }
+  if (flags.jobs > 1 && flags.checksum_bisect_stride) {
+    fprintf(stderr, "-j can't be combined with -b.\n");
+    return 1;
+  }
+
   if (!flags.target_command.empty()) {
     flags.target_process =
         find_pid_for_command(trace_dir, flags.target_command);
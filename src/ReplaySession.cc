@@ -6,13 +6,18 @@
 
 #include "ReplaySession.h"
 
+#include <poll.h>
+#include <sched.h>
 #include <syscall.h>
+#include <sys/mman.h>
 #include <sys/prctl.h>
 
 #include <algorithm>
+#include <set>
 
 #include "AutoRemoteSyscalls.h"
 #include "fast_forward.h"
+#include "FlightRecorder.h"
 #include "kernel_metadata.h"
 #include "log.h"
 #include "replay_syscall.h"
@@ -56,18 +61,88 @@ using namespace std;
  * could perhaps let it be deduced instead of arrived at empirically;
  * perhaps pipeline depth and things of that nature are involved.  But
  * those reasons if they exit are currently not understood.
+ *
+ * SKID_SIZE is what we start out with. Most CPUs skid much less, and every
+ * skidded tick is one we have to creep up on with breakpoints and
+ * singlesteps, so we measure the skid of the interrupts we program and,
+ * once we've seen enough of them, shrink the region to a safety factor
+ * times the worst skid observed (but never below MIN_SKID_SIZE).
  */
 static const int SKID_SIZE = 70;
+static const int MIN_SKID_SIZE = 10;
+static const int SKID_SAFETY_FACTOR = 2;
+static const uint32_t SKID_SAMPLES_BEFORE_ADAPTING = 100;
+
+/**
+ * decode_ahead() decodes at most this many frames each time a tracee is
+ * resumed, so it never delays noticing that the tracee stopped by much,
+ * and keeps at most DECODE_AHEAD_FRAMES decoded.
+ */
+static const size_t DECODE_AHEAD_PER_RESUME = 2;
+static const size_t DECODE_AHEAD_FRAMES = 16;
+
+static Ticks max_observed_skid = 0;
+static uint32_t skid_samples = 0;
+
+static Ticks skid_size() {
+  if (skid_samples < SKID_SAMPLES_BEFORE_ADAPTING) {
+    return SKID_SIZE;
+  }
+  Ticks skid =
+      max<Ticks>(MIN_SKID_SIZE, SKID_SAFETY_FACTOR * max_observed_skid);
+  return min<Ticks>(SKID_SIZE, skid);
+}
+
+/**
+ * |t| was interrupted by a ticks interrupt programmed for |tick_period|
+ * ticks after |ticks_before|.
+ */
+static void note_skid(Task* t, Ticks ticks_before, Ticks tick_period) {
+  Ticks skid = t->tick_count() - ticks_before - tick_period;
+  if (skid > max_observed_skid) {
+    LOG(debug) << "observed ticks interrupt skid of " << skid;
+    max_observed_skid = skid;
+  }
+  ++skid_samples;
+}
+
+void ReplaySession::check_memory_fingerprint(Task* t) {
+  const TraceFrame& frame = t->current_trace_frame();
+  uint32_t fingerprint;
+  if (!can_validate() || flags.fast_forward || !frame.has_fingerprint() ||
+      first_bad_checksum_time_ || !memory_fingerprint(t, frame, &fingerprint) ||
+      fingerprint == frame.fingerprint()) {
+    return;
+  }
+  if (!flags.fatal_checksum_mismatch) {
+    LOG(info) << "Memory fingerprint mismatch at event " << frame.time();
+    first_bad_checksum_time_ = frame.time();
+    return;
+  }
+  ASSERT(t, false) << "Memory fingerprint mismatch at event " << frame.time()
+                   << ": the stack from " << t->regs().sp()
+                   << " differs from the recording. Record with "
+                      "`rr --checksum=syscall record' to find which memory "
+                      "diverged.";
+}
 
-static void debug_memory(Task* t) {
+void ReplaySession::debug_memory(Task* t) {
   if (should_dump_memory(t, t->current_trace_frame())) {
     dump_process_memory(t, t->current_trace_frame().time(), "rep");
   }
-  if (t->session().can_validate() &&
-      should_checksum(t, t->current_trace_frame())) {
+  TraceFrame::Time time = t->current_trace_frame().time();
+  check_memory_fingerprint(t);
+  if (can_validate() && !flags.fast_forward &&
+      should_checksum(t, t->current_trace_frame()) &&
+      time > flags.checksums_after && !first_bad_checksum_time_ &&
+      checksum_count++ % flags.checksum_stride == 0) {
     /* Validate the checksum we computed during the
      * recording phase. */
-    validate_process_memory(t, t->current_trace_frame().time());
+    if (validate_process_memory(t, time, flags.fatal_checksum_mismatch)) {
+      last_good_checksum_time_ = time;
+    } else {
+      first_bad_checksum_time_ = time;
+    }
   }
 }
 
@@ -87,10 +162,12 @@ ReplaySession::shr_ptr ReplaySession::clone() {
 
   finish_initializing();
 
+  // Clones would inherit the protection without the page watches that
+  // explain it.
+  unprotect_page_watches();
+
   shr_ptr session(new ReplaySession(*this));
   LOG(debug) << "  deepfork session is " << session.get();
-  memcpy(session->syscallbuf_flush_buffer_array, syscallbuf_flush_buffer_array,
-         sizeof(syscallbuf_flush_buffer_array));
 
   copy_state_to(*session, session->emufs());
 
@@ -153,19 +230,28 @@ DiversionSession::shr_ptr ReplaySession::clone_diversion() {
   LOG(debug) << "Deepforking ReplaySession " << this
              << " to DiversionSession...";
 
+  unprotect_page_watches();
+
   DiversionSession::shr_ptr session(new DiversionSession(*this));
   LOG(debug) << "  deepfork session is " << session.get();
 
   copy_state_to(*session, session->emufs());
   session->finish_initializing();
+  session->save_reset_point();
 
   return session;
 }
 
-void ReplaySession::gc_emufs() { emu_fs->gc(*this); }
+void ReplaySession::gc_emufs() { emu_fs->gc(); }
 
-/*static*/ ReplaySession::shr_ptr ReplaySession::create(const string& dir) {
+/*static*/ ReplaySession::shr_ptr ReplaySession::create(const string& dir,
+                                                       int bind_cpu) {
   shr_ptr session(new ReplaySession(dir));
+  if (bind_cpu >= 0 && session->trace_in.bound_to_cpu() >= 0) {
+    session->trace_in.set_bound_to_cpu(bind_cpu);
+  }
+  // Decompress the start of the trace while we spawn the initial task.
+  session->trace_in.prefetch_start();
 
   // Because we execvpe() the tracee, we must ensure that $PATH
   // is the same as in recording so that libc searches paths in
@@ -195,6 +281,19 @@ void ReplaySession::advance_to_next_trace_frame(TraceFrame::Time stop_at_time) {
     return;
   }
 
+  // Log the frame that just finished replaying, with the task's state
+  // afterwards, to match the RECORD_EVENT logged when it was recorded.
+  Task* t = find_task(trace_frame.tid());
+  if (t) {
+    FlightRecorder::record(FlightRecorder::REPLAY_EVENT, t,
+                           trace_frame.event().encoded);
+  }
+  LOG(debug) << "event " << trace_frame.time() << " took "
+             << statistics_.ptrace_calls - frame_start_ptrace_calls
+             << " ptrace calls";
+  frame_start_ptrace_calls = statistics_.ptrace_calls;
+
+  PhaseTimer timer(*this, PHASE_DECODE);
   trace_frame = trace_in.read_frame();
 
   // Subsequent reschedule-events of the same thread can be
@@ -212,6 +311,11 @@ void ReplaySession::advance_to_next_trace_frame(TraceFrame::Time stop_at_time) {
   }
 }
 
+void ReplaySession::decode_ahead() {
+  PhaseTimer timer(*this, PHASE_DECODE);
+  trace_in.decode_ahead(DECODE_AHEAD_PER_RESUME, DECODE_AHEAD_FRAMES);
+}
+
 bool ReplaySession::is_ignored_signal(int sig) {
   switch (sig) {
     // SIGCHLD can arrive after tasks die during replay.  We don't
@@ -239,7 +343,7 @@ Completion ReplaySession::cont_syscall_boundary(Task* t, ExecOrEmulate emu,
                                                 Ticks ticks_target) {
   Ticks ticks_period = 0;
   if (ticks_target > 0) {
-    ticks_period = ticks_target - SKID_SIZE - t->tick_count();
+    ticks_period = ticks_target - skid_size() - t->tick_count();
     if (ticks_period <= 0) {
       return INCOMPLETE;
     }
@@ -280,12 +384,27 @@ Completion ReplaySession::cont_syscall_boundary(Task* t, ExecOrEmulate emu,
   } else {
     resume_how = RESUME_SYSCALL;
   }
+  if (is_syscall_entry) {
+    t->vm()->protect_page_watches(t);
+  } else {
+    // The kernel is about to execute the syscall, and mustn't fault on
+    // watched pages.
+    t->vm()->unprotect_page_watches(t);
+  }
   t->resume_execution(resume_how, RESUME_WAIT, 0, ticks_period);
 
   t->child_sig = t->pending_sig();
   if (is_ignored_signal(t->child_sig)) {
     return cont_syscall_boundary(t, emu, stepi, ticks_target);
   }
+  bool watch_changed;
+  if (handle_page_watch_fault(t, stepi, &watch_changed)) {
+    if (stepi == RUN_SINGLESTEP || watch_changed) {
+      // Stop for the debugger, with child_sig == SIGTRAP.
+      return INCOMPLETE;
+    }
+    return cont_syscall_boundary(t, emu, stepi, ticks_target);
+  }
 
   if (t->ptrace_event() == PTRACE_EVENT_EXEC) {
     t->post_exec(&t->current_trace_frame().regs(),
@@ -336,7 +455,15 @@ Completion ReplaySession::exit_syscall(Task* t, RunCommand stepi) {
 
   t->on_syscall_exit(current_step.syscall.number, current_trace_frame().regs());
 
-  t->apply_all_data_records_from_trace();
+  int syscallno = current_step.syscall.number;
+  if ((is_poll_syscall(syscallno, t->arch()) ||
+       is_ppoll_syscall(syscallno, t->arch())) &&
+      !current_trace_frame().regs().syscall_failed() &&
+      t->trace_reader().compact_poll_results()) {
+    rep_restore_poll_results(t);
+  } else {
+    t->apply_all_data_records_from_trace();
+  }
   t->set_return_value_from_trace();
 
   uint32_t flags = 0;
@@ -348,12 +475,52 @@ Completion ReplaySession::exit_syscall(Task* t, RunCommand stepi) {
   t->validate_regs(flags);
 
   if (emu == EMULATE) {
-    t->finish_emulated_syscall();
+    // The next event usually resumes with PTRACE_SYSEMU, which exits the
+    // syscall without the singlestep.
+    t->defer_finish_emulated_syscall();
   }
 
   return COMPLETE;
 }
 
+/**
+ * If |t| stopped for a write to a page protected for page watches, step it
+ * over the write with the pages temporarily unprotected, set
+ * |*watch_changed| to whether that changed a watched value, and return
+ * true. |t|'s debug status is left for the debugger if it's
+ * single-stepping.
+ */
+bool ReplaySession::handle_page_watch_fault(Task* t, RunCommand stepi,
+                                            bool* watch_changed) {
+  if (SIGSEGV != t->child_sig ||
+      !t->vm()->is_page_watch_fault((uintptr_t)t->get_siginfo().si_addr)) {
+    return false;
+  }
+  t->vm()->unprotect_page_watches(t);
+  t->resume_execution(RESUME_SINGLESTEP, RESUME_WAIT);
+  t->child_sig = t->pending_sig();
+  ASSERT(t, SIGTRAP == t->child_sig)
+      << "Unexpected signal " << t->child_sig
+      << " stepping over write to watched page";
+  if (stepi != RUN_SINGLESTEP) {
+    uintptr_t debug_status = t->consume_debug_status();
+    if (DS_WATCHPOINT_ANY & debug_status) {
+      t->vm()->notify_watchpoint_fired(debug_status);
+    }
+  }
+  *watch_changed = t->vm()->update_page_watch_values(true);
+  t->vm()->protect_page_watches(t);
+  return true;
+}
+
+void ReplaySession::unprotect_page_watches() {
+  for (auto& vm : vms()) {
+    if (!vm->task_set().empty()) {
+      vm->unprotect_page_watches(*vm->task_set().begin());
+    }
+  }
+}
+
 void ReplaySession::check_pending_sig(Task* t) {
   t->child_sig = t->pending_sig();
   bool child_sig_gt_zero = 0 < t->child_sig;
@@ -386,8 +553,15 @@ void ReplaySession::continue_or_step(Task* t, RunCommand stepi,
      * should be neglible. */
     resume_how = RESUME_SYSCALL;
   }
+  // Signal delivery and execution targets aren't prepared for page watch
+  // faults. Changes made here are only seen by comparing watched values.
+  t->vm()->unprotect_page_watches(t);
+  Ticks ticks_before = t->tick_count();
   t->resume_execution(resume_how, RESUME_WAIT, 0, tick_period);
   check_pending_sig(t);
+  if (tick_period > 0 && PerfCounters::TIME_SLICE_SIGNAL == t->child_sig) {
+    note_skid(t, ticks_before, tick_period);
+  }
 }
 
 /**
@@ -639,7 +813,8 @@ Completion ReplaySession::advance_to(Task* t, const Registers& regs, int sig,
              << ip;
 
   /* XXX should we only do this if (ticks > 10000)? */
-  while (ticks_left - SKID_SIZE > SKID_SIZE) {
+  Ticks skid = skid_size();
+  while (ticks_left - skid > skid) {
     if (SIGTRAP == t->child_sig) {
       /* We proved we're not at the execution
        * target, and we haven't set any internal
@@ -652,10 +827,10 @@ Completion ReplaySession::advance_to(Task* t, const Registers& regs, int sig,
     }
     t->child_sig = 0;
 
-    LOG(debug) << "  programming interrupt for " << (ticks_left - SKID_SIZE)
+    LOG(debug) << "  programming interrupt for " << (ticks_left - skid)
                << " ticks";
 
-    continue_or_step(t, stepi, ticks_left - SKID_SIZE);
+    continue_or_step(t, stepi, ticks_left - skid);
     if (PerfCounters::TIME_SLICE_SIGNAL == t->child_sig ||
         is_ignored_signal(t->child_sig)) {
       t->child_sig = 0;
@@ -899,7 +1074,8 @@ void ReplaySession::check_ticks_consistency(Task* t, const Event& ev) {
   Ticks ticks_now = t->tick_count();
   Ticks trace_ticks = trace_frame.ticks();
 
-  ASSERT(t, llabs(ticks_now - trace_ticks) <= ticks_slack)
+  ASSERT(t,
+         flags.fast_forward || llabs(ticks_now - trace_ticks) <= ticks_slack)
       << "ticks mismatch for '" << ev << "'; expected " << trace_ticks
       << ", got " << ticks_now << "";
   // Sync task ticks with trace ticks so we don't keep accumulating errors
@@ -928,7 +1104,12 @@ Completion ReplaySession::emulate_deterministic_signal(Task* t, int sig,
                                  << ")";
   check_ticks_consistency(t, ev);
 
-  if (EV_SEGV_RDTSC == ev.type()) {
+  if (EV_PATCH_RDTSC == ev.type()) {
+    bool did_patch =
+        t->vm()->monkeypatcher().patch_rdtsc_at(t, t->ip().cast<uint8_t>());
+    ASSERT(t, did_patch) << "Should have patched the rdtsc, but did not!";
+  }
+  if (EV_SEGV_RDTSC == ev.type() || EV_PATCH_RDTSC == ev.type()) {
     t->set_regs(trace_frame.regs());
     /* We just "delivered" this pseudosignal. */
     t->child_sig = 0;
@@ -964,9 +1145,45 @@ Completion ReplaySession::emulate_async_signal(Task* t, int sig,
  * if an unhandled interrupt occurred, COMPLETE if the ioctl() was
  * successfully skipped over.
  */
+/**
+ * Return true if a buffered syscall that |t| has just emulated can be left
+ * at its syscall-entry stop, because the PTRACE_SYSEMU resume to the next
+ * buffered syscall will finish it anyway. That saves the singlestep
+ * finish_emulated_syscall() would do. We don't defer when the debugger is
+ * singlestepping, or when cont_syscall_boundary() must make remote
+ * syscalls to protect watched pages before resuming.
+ */
+bool ReplaySession::can_defer_emulated_syscall_finish(Task* t,
+                                                      RunCommand stepi) {
+  return stepi != RUN_SINGLESTEP && !t->vm()->has_page_watches();
+}
+
+/**
+ * Call before resuming |t| in a flush with |emu|. Finishes a deferred
+ * emulated syscall unless the resume is a PTRACE_SYSEMU that will do it
+ * for us (PTRACE_SYSCALL would report the deferred syscall's exit, and
+ * cont_syscall_boundary() returns early without resuming when
+ * |ticks_target| is too close).
+ */
+void ReplaySession::finish_deferred_emulated_syscall(Task* t,
+                                                     ExecOrEmulate emu,
+                                                     Ticks ticks_target) {
+  if (!current_step.flush.emulated_syscall_unfinished) {
+    return;
+  }
+  current_step.flush.emulated_syscall_unfinished = false;
+  if (emu == EMULATE &&
+      (ticks_target == 0 ||
+       ticks_target - skid_size() - t->tick_count() > 0)) {
+    return;
+  }
+  t->finish_emulated_syscall();
+}
+
 Completion ReplaySession::skip_desched_ioctl(Task* t, ReplayDeschedState* ds,
                                              RunCommand stepi,
-                                             Ticks ticks_target) {
+                                             Ticks ticks_target,
+                                             bool defer_finish) {
   /* Skip ahead to the syscall entry. */
   if (DESCHED_ENTER == ds->state &&
       cont_syscall_boundary(t, EMULATE, stepi, ticks_target) == INCOMPLETE) {
@@ -989,7 +1206,11 @@ Completion ReplaySession::skip_desched_ioctl(Task* t, ReplayDeschedState* ds,
   Registers r = t->regs();
   r.set_syscall_result(0);
   t->set_regs(r);
-  t->finish_emulated_syscall();
+  if (defer_finish && can_defer_emulated_syscall_finish(t, stepi)) {
+    current_step.flush.emulated_syscall_unfinished = true;
+  } else {
+    t->finish_emulated_syscall();
+  }
   return COMPLETE;
 }
 
@@ -1013,8 +1234,8 @@ void ReplaySession::prepare_syscallbuf_records(Task* t) {
       ((struct syscallbuf_hdr*)buf.data.data())->num_rec_bytes;
 
   assert(current_step.flush.num_rec_bytes_remaining <= SYSCALLBUF_BUFFER_SIZE);
-  memcpy(syscallbuf_flush_buffer_array, buf.data.data(),
-         current_step.flush.num_rec_bytes_remaining);
+  assert(current_step.flush.num_rec_bytes_remaining <= buf.data.size());
+  syscallbuf_flush_buffer = buf.data;
 
   // The stored num_rec_bytes in the header doesn't include the
   // header bytes, but the stored trace data does.
@@ -1041,13 +1262,15 @@ static void assert_at_buffered_syscall(Task* t, int syscallno) {
 
 /**
  * Bail if |rec_rec| and |rep_rec| haven't been prepared for the same
- * syscall (including desched'd-ness and reserved extra space).
+ * syscall (including desched'd-ness and reserved extra space). A record
+ * may have been shrunk when it was committed, so |rec_rec| can be smaller
+ * than the space |rep_rec| reserved.
  */
 static void assert_same_rec(Task* t, const struct syscallbuf_record* rec_rec,
                             struct syscallbuf_record* rep_rec) {
   ASSERT(t, (rec_rec->syscallno == rep_rec->syscallno &&
              rec_rec->desched == rep_rec->desched &&
-             rec_rec->size == rep_rec->size))
+             rec_rec->size <= rep_rec->size))
       << "Recorded rec { no=" << rec_rec->syscallno
       << ", desched:" << rec_rec->desched << ", size: " << rec_rec->size
       << " } "
@@ -1080,6 +1303,25 @@ static void restore_futex_words(Task* t, const struct syscallbuf_record* rec) {
   }
 }
 
+/**
+ * Rebuild the pollfd array of a buffered poll() from the ready entries
+ * its record was compacted to. The tracee copied its input array into
+ * the record before the syscall, and the space it reserved still holds
+ * it.
+ */
+static void restore_poll_results(Task* t,
+                                 const struct syscallbuf_record* rec_rec,
+                                 struct syscallbuf_record* child_rec) {
+  size_t nfds = (child_rec->size - sizeof(*child_rec)) / sizeof(pollfd);
+  size_t num_ready =
+      (rec_rec->size - sizeof(*rec_rec)) / sizeof(poll_ready_entry);
+  vector<poll_ready_entry> ready(num_ready);
+  memcpy(ready.data(), rec_rec->extra_data,
+         num_ready * sizeof(poll_ready_entry));
+  rebuild_poll_results(t, reinterpret_cast<pollfd*>(child_rec->extra_data),
+                       nfds, ready.data(), num_ready);
+}
+
 /**
  * Try to flush one buffered syscall as described by |flush|.  Return
  * INCOMPLETE if an unhandled interrupt occurred, and COMPLETE if the syscall
@@ -1129,8 +1371,11 @@ Completion ReplaySession::flush_one_syscall(Task* t, RunCommand stepi,
       /* Skip past the ioctl that armed the desched
        * notification. */
       LOG(debug) << "  skipping over arm-desched ioctl";
+      finish_deferred_emulated_syscall(t, EMULATE, ticks_target);
+      // The buffered syscall itself follows, so this can always be
+      // deferred.
       if (skip_desched_ioctl(t, &current_step.flush.desched, stepi,
-                             ticks_target) == INCOMPLETE) {
+                             ticks_target, true) == INCOMPLETE) {
         return INCOMPLETE;
       }
       current_step.flush.state = FLUSH_ENTER;
@@ -1138,6 +1383,7 @@ Completion ReplaySession::flush_one_syscall(Task* t, RunCommand stepi,
 
     case FLUSH_ENTER:
       LOG(debug) << "  advancing to buffered syscall entry";
+      finish_deferred_emulated_syscall(t, emu, ticks_target);
       if (cont_syscall_boundary(t, emu, stepi, ticks_target) == INCOMPLETE) {
         return INCOMPLETE;
       }
@@ -1149,12 +1395,18 @@ Completion ReplaySession::flush_one_syscall(Task* t, RunCommand stepi,
     case FLUSH_EXIT: {
       LOG(debug) << "  advancing to buffered syscall exit";
 
-      EmuFs::AutoGc gc(*this, t->arch(), call, SYSCALL_EXIT);
+      EmuFs::AutoGc gc(*this, SYSCALL_EXIT);
 
       assert_at_buffered_syscall(t, call);
 
       // Restore saved trace data.
-      memcpy(child_rec->extra_data, rec_rec->extra_data, rec_rec->size);
+      if (is_poll_syscall(call, t->arch()) && rec_rec->ret >= 0 &&
+          t->trace_reader().compact_poll_results()) {
+        restore_poll_results(t, rec_rec, child_rec);
+      } else {
+        memcpy(child_rec->extra_data, rec_rec->extra_data,
+               rec_rec->size - sizeof(*rec_rec));
+      }
 
       // Restore return value.
       // TODO: try to share more code with cont_syscall_boundary()
@@ -1168,7 +1420,15 @@ Completion ReplaySession::flush_one_syscall(Task* t, RunCommand stepi,
       r.set_syscall_result(rec_rec->ret);
       t->set_regs(r);
       if (emu == EMULATE) {
-        t->finish_emulated_syscall();
+        bool more_to_flush =
+            rec_rec->desched ||
+            current_step.flush.num_rec_bytes_remaining >
+                (size_t)stored_record_size(rec_rec->size);
+        if (more_to_flush && can_defer_emulated_syscall_finish(t, stepi)) {
+          current_step.flush.emulated_syscall_unfinished = true;
+        } else {
+          t->finish_emulated_syscall();
+        }
       }
 
       if (is_futex_syscall(call, t->arch())) {
@@ -1190,8 +1450,12 @@ Completion ReplaySession::flush_one_syscall(Task* t, RunCommand stepi,
       /* And skip past the ioctl that disarmed the desched
        * notification. */
       LOG(debug) << "  skipping over disarm-desched ioctl";
+      finish_deferred_emulated_syscall(t, EMULATE, ticks_target);
       if (skip_desched_ioctl(t, &current_step.flush.desched, stepi,
-                             ticks_target) == INCOMPLETE) {
+                             ticks_target,
+                             current_step.flush.num_rec_bytes_remaining >
+                                 (size_t)stored_record_size(rec_rec->size)) ==
+          INCOMPLETE) {
         return INCOMPLETE;
       }
       current_step.flush.state = FLUSH_DONE;
@@ -1235,6 +1499,9 @@ Completion ReplaySession::flush_syscallbuf(Task* t, RunCommand stepi,
                << " bytes remain to flush";
   }
 
+  // The recorder may have resized the buffer after flushing it.
+  t->apply_all_data_records_from_trace();
+  t->refresh_syscallbuf_size();
   return COMPLETE;
 }
 
@@ -1268,10 +1535,11 @@ Completion ReplaySession::advance_to_ticks_target(Task* t, RunCommand stepi,
                                                   Ticks ticks_target) {
   while (true) {
     Ticks ticks_left = ticks_target - t->tick_count();
-    if (ticks_left <= SKID_SIZE) {
+    Ticks skid = skid_size();
+    if (ticks_left <= skid) {
       return INCOMPLETE;
     }
-    continue_or_step(t, stepi, ticks_left - SKID_SIZE);
+    continue_or_step(t, stepi, ticks_left - skid);
     if (SIGTRAP == t->child_sig) {
       return INCOMPLETE;
     }
@@ -1379,13 +1647,11 @@ void ReplaySession::setup_replay_one_trace_frame(Task* t) {
        * Other terminating signals have not been observed to
        * hang, so that's what's used here.. */
       syscall(SYS_tkill, t->tid, SIGABRT);
-      // TODO dissociate address space from file table
-      bool file_table_dying = (1 == t->vm()->task_set().size());
       delete t;
+      // If that was the last task in its address space, the address
+      // space's emulated files may have lost their last mapping.
+      emu_fs->release_unmapped();
       /* Early-return because |t| is gone now. */
-      if (file_table_dying) {
-        gc_emufs();
-      }
       return;
     }
     case EV_DESCHED:
@@ -1397,12 +1663,14 @@ void ReplaySession::setup_replay_one_trace_frame(Task* t) {
       break;
     case EV_SYSCALLBUF_ABORT_COMMIT:
       t->syscallbuf_hdr->abort_commit = 1;
+      t->vm()->note_buffered_syscall_descheduled(t);
       current_step.action = TSTEP_RETIRE;
       break;
     case EV_SYSCALLBUF_FLUSH:
       current_step.action = TSTEP_FLUSH_SYSCALLBUF;
       current_step.flush.need_buffer_restore = true;
       current_step.flush.num_rec_bytes_remaining = 0;
+      current_step.flush.emulated_syscall_unfinished = false;
       break;
     case EV_SYSCALLBUF_RESET:
       t->syscallbuf_hdr->num_rec_bytes = 0;
@@ -1417,6 +1685,7 @@ void ReplaySession::setup_replay_one_trace_frame(Task* t) {
       current_step.target.signo = 0;
       break;
     case EV_SEGV_RDTSC:
+    case EV_PATCH_RDTSC:
       current_step.action = TSTEP_DETERMINISTIC_SIGNAL;
       current_step.signo = SIGSEGV;
       break;
@@ -1452,6 +1721,110 @@ void ReplaySession::setup_replay_one_trace_frame(Task* t) {
   }
 }
 
+/**
+ * Return true if |vm| has shared writable memory other than its tasks'
+ * syscallbufs, through which another process could see what its tasks
+ * write or change what they read.
+ */
+static bool has_shared_writable_memory(AddressSpace& vm) {
+  set<remote_ptr<void> > syscallbufs;
+  for (Task* t : vm.task_set()) {
+    syscallbufs.insert(t->syscallbuf_child.cast<void>());
+  }
+  for (auto& m : vm.memmap()) {
+    if ((m.first.flags & MAP_SHARED) && (m.first.prot & PROT_WRITE) &&
+        !syscallbufs.count(m.first.start)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Restrict |t| to |cpu|. Returns false on failure.
+ */
+static bool bind_task_to_cpu(Task* t, int cpu) {
+  cpu_set_t mask;
+  CPU_ZERO(&mask);
+  CPU_SET(cpu, &mask);
+  return sched_setaffinity(t->tid, sizeof(mask), &mask) == 0;
+}
+
+/**
+ * Start the task of the next frame running towards that frame, if it's
+ * the end of a time slice and the task can't interact with |t| while |t|
+ * runs to the end of its own. Replaying the other task's frame then only
+ * has the last few ticks left to do. Returns false, with nothing started,
+ * if the next frame has to wait for |t|.
+ */
+bool ReplaySession::start_run_ahead(Task* t, RunCommand stepi,
+                                    RunAhead* ahead) {
+  if (!flags.parallel || stepi != RUN_CONTINUE ||
+      current_step.action != TSTEP_PROGRAM_ASYNC_SIGNAL_INTERRUPT ||
+      trace_in.at_end()) {
+    return false;
+  }
+  TraceFrame next = trace_in.peek_frame();
+  if (EV_SCHED != next.event().type) {
+    return false;
+  }
+  Task* u = find_task(next.tid());
+  // Tasks sharing an address space could be racing on any of it, and the
+  // debugger's breakpoints and watchpoints are only handled by advance_to().
+  if (!u || u->vm() == t->vm() || u->child_sig || u->unstable ||
+      u->vm()->has_breakpoints() || u->vm()->has_watchpoints() ||
+      u->vm()->has_page_watches() || has_shared_writable_memory(*t->vm()) ||
+      has_shared_writable_memory(*u->vm())) {
+    return false;
+  }
+  Ticks skid = skid_size();
+  Ticks ticks_left = next.ticks() - u->tick_count();
+  if (ticks_left - skid <= skid) {
+    return false;
+  }
+  // Tracees are normally all bound to the recording's CPU, along with us.
+  int cpu = trace_in.bound_to_cpu();
+  if (cpu >= 0 &&
+      (get_num_cpus() < 2 ||
+       !bind_task_to_cpu(u, (cpu + 1) % get_num_cpus()))) {
+    return false;
+  }
+
+  LOG(debug) << "running " << u->tid << " ahead " << (ticks_left - skid)
+             << " ticks while " << t->tid << " runs";
+  ahead->task = u;
+  ahead->ticks_before = u->tick_count();
+  ahead->tick_period = ticks_left - skid;
+  u->resume_execution(RESUME_SYSCALL, RESUME_NONBLOCKING, 0,
+                      ahead->tick_period);
+  return true;
+}
+
+/**
+ * Wait for the task started by start_run_ahead() to stop, and move it
+ * back to the recording's CPU.
+ */
+void ReplaySession::finish_run_ahead(const RunAhead& ahead) {
+  Task* u = ahead.task;
+  u->wait();
+  int sig = u->pending_sig();
+  // The task only runs user code until its frame, so anything but the
+  // ticks interrupt (or a signal replay ignores) is a divergence, just
+  // as it would be in advance_to().
+  ASSERT(u, PerfCounters::TIME_SLICE_SIGNAL == sig || is_ignored_signal(sig))
+      << "Replay got unrecorded "
+      << (sig ? string(signal_name(sig))
+              : u->syscall_name(u->regs().original_syscallno()))
+      << " while running ahead to its time slice";
+  if (PerfCounters::TIME_SLICE_SIGNAL == sig) {
+    note_skid(u, ahead.ticks_before, ahead.tick_period);
+  }
+  int cpu = trace_in.bound_to_cpu();
+  if (cpu >= 0 && !bind_task_to_cpu(u, cpu)) {
+    FATAL() << "Couldn't bind " << u->tid << " back to CPU " << cpu;
+  }
+}
+
 ReplayResult ReplaySession::replay_step(RunCommand command,
                                         TraceFrame::Time stop_at_time,
                                         Ticks ticks_target) {
@@ -1477,7 +1850,10 @@ ReplayResult ReplaySession::replay_step(RunCommand command,
    * computed already in which case step.action will not be TSTEP_NONE.
    */
   if (current_step.action == TSTEP_NONE) {
-    setup_replay_one_trace_frame(t);
+    {
+      PhaseTimer timer(*this, PHASE_EMULATE);
+      setup_replay_one_trace_frame(t);
+    }
     if (current_step.action == TSTEP_NONE) {
       // Already at the destination event.
       if (last_task()) {
@@ -1491,8 +1867,19 @@ ReplayResult ReplaySession::replay_step(RunCommand command,
 
   /* Advance towards fulfilling |current_step|. */
   ReplayTraceStepType current_action = current_step.action;
-  if (try_one_trace_step(t, command, stop_at_time, ticks_target) ==
-      INCOMPLETE) {
+  Completion completion;
+  {
+    // Tracee execution and memory restoration inside the step are
+    // charged to their own phases.
+    PhaseTimer timer(*this, PHASE_EMULATE);
+    RunAhead ahead;
+    bool running_ahead = start_run_ahead(t, command, &ahead);
+    completion = try_one_trace_step(t, command, stop_at_time, ticks_target);
+    if (running_ahead) {
+      finish_run_ahead(ahead);
+    }
+  }
+  if (completion == INCOMPLETE) {
     if (EV_TRACE_TERMINATION == trace_frame.event().type) {
       // An irregular trace step had to read the
       // next trace frame, and that frame was an
@@ -1528,7 +1915,8 @@ ReplayResult ReplaySession::replay_step(RunCommand command,
   if (TSTEP_ENTER_SYSCALL == current_step.action) {
     cpuid_bug_detector.notify_reached_syscall_during_replay(t);
   }
-  if (can_validate() && SYSCALL_EXIT == trace_frame.event().state &&
+  if (can_validate() && !flags.fast_forward &&
+      SYSCALL_EXIT == trace_frame.event().state &&
       ::Flags::get().check_cached_mmaps) {
     t->vm()->verify(t);
   }
@@ -66,6 +66,10 @@ struct ReplayFlushBufferedSyscallState {
   /* Track the state of retiring desched arm/disarm ioctls, when
    * necessary. */
   ReplayDeschedState desched;
+  /* True when the tracee was left at the entry stop of the last emulated
+   * syscall, because the PTRACE_SYSEMU that advances to the next buffered
+   * syscall also finishes that one. */
+  bool emulated_syscall_unfinished;
 };
 
 /**
@@ -200,7 +204,9 @@ public:
    * state of this, and vice versa.
    *
    * This operation is also called "checkpointing" the replay
-   * session.
+   * session. A checkpoint is a set of live, stopped processes forked
+   * from this session's tracees, so it only exists for the lifetime of
+   * this rr process.
    */
   shr_ptr clone();
 
@@ -217,6 +223,9 @@ public:
   DiversionSession::shr_ptr clone_diversion();
 
   EmuFs& emufs() const { return *emu_fs; }
+  virtual void on_shared_mapping_change(const FileId& id, bool mapped) {
+    emu_fs->note_mapped(id, mapped);
+  }
 
   /** Collect garbage files from this session's emufs. */
   void gc_emufs();
@@ -230,6 +239,14 @@ public:
    */
   const TraceFrame& current_trace_frame() const { return trace_frame; }
 
+  /**
+   * Decode a few of the trace frames to come, so that advancing to them
+   * doesn't have to. Task::resume_execution() calls this after resuming a
+   * tracee and before waiting for it, so decoding overlaps with the
+   * tracee's execution.
+   */
+  void decode_ahead();
+
   /**
    * The Task for the current trace record.
    */
@@ -255,8 +272,10 @@ public:
   /**
    * Create a replay session that will use the trace directory specified
    * by 'dir', or the latest trace if 'dir' is not supplied.
+   * If |bind_cpu| >= 0, replay on that CPU instead of the one the trace was
+   * recorded on.
    */
-  static shr_ptr create(const std::string& dir);
+  static shr_ptr create(const std::string& dir, int bind_cpu = -1);
 
   /**
    * Take a single replay step.
@@ -290,21 +309,66 @@ public:
   static bool is_ignored_signal(int sig);
 
   struct Flags {
-    Flags() : redirect_stdio(false) {}
+    Flags()
+        : redirect_stdio(false),
+          checksum_stride(1),
+          checksums_after(0),
+          fatal_checksum_mismatch(true),
+          fast_forward(false),
+          parallel(false) {}
     Flags(const Flags& other) = default;
     bool redirect_stdio;
+    // Only validate every |checksum_stride|th recorded checksum, and only
+    // those after event |checksums_after|.
+    uint32_t checksum_stride;
+    TraceFrame::Time checksums_after;
+    // When false, the first checksum mismatch stops further validation
+    // instead of aborting the replay; see first_bad_checksum_time().
+    bool fatal_checksum_mismatch;
+    // Skip the per-event consistency checks (ticks, registers, checksums
+    // and cached mmaps) to get to a distant target quickly. A divergence
+    // is only noticed once it breaks replay outright.
+    bool fast_forward;
+    // While the current task runs to the end of a time slice, start the
+    // task whose time slice comes next running towards its end on another
+    // CPU, when the two can't interact: they're in different address
+    // spaces with no shared writable memory, and only run user code
+    // until then. Otherwise replay stays serial. The other task is left
+    // partway into its slice when replay_step() returns, so this is only
+    // for replays no debugger looks at.
+    bool parallel;
   };
   bool redirect_stdio() { return flags.redirect_stdio; }
+  bool fast_forwarding() const { return flags.fast_forward; }
 
   void set_flags(const Flags& flags) { this->flags = flags; }
 
+  /**
+   * Return the last event whose checksums were validated successfully, or
+   * 0 if there was none.
+   */
+  TraceFrame::Time last_good_checksum_time() const {
+    return last_good_checksum_time_;
+  }
+  /**
+   * Return the first event whose checksums didn't match the recording, or
+   * 0 if there was none. Only set when mismatches aren't fatal.
+   */
+  TraceFrame::Time first_bad_checksum_time() const {
+    return first_bad_checksum_time_;
+  }
+
 private:
   ReplaySession(const std::string& dir)
       : emu_fs(EmuFs::create()),
         last_debugged_task(nullptr),
         trace_in(dir),
         trace_frame(),
-        current_step() {
+        current_step(),
+        checksum_count(0),
+        last_good_checksum_time_(0),
+        first_bad_checksum_time_(0),
+        frame_start_ptrace_calls(0) {
     advance_to_next_trace_frame(0);
   }
 
@@ -316,7 +380,12 @@ private:
         trace_frame(other.trace_frame),
         current_step(other.current_step),
         cpuid_bug_detector(other.cpuid_bug_detector),
-        flags(other.flags) {
+        flags(other.flags),
+        checksum_count(other.checksum_count),
+        last_good_checksum_time_(other.last_good_checksum_time_),
+        first_bad_checksum_time_(other.first_bad_checksum_time_),
+        frame_start_ptrace_calls(other.frame_start_ptrace_calls),
+        syscallbuf_flush_buffer(other.syscallbuf_flush_buffer) {
     assert(!other.last_debugged_task);
   }
 
@@ -333,9 +402,16 @@ private:
   }
 
   const struct syscallbuf_hdr* syscallbuf_flush_buffer_hdr() {
-    return (const struct syscallbuf_hdr*)syscallbuf_flush_buffer_array;
+    return (const struct syscallbuf_hdr*)syscallbuf_flush_buffer.data();
   }
 
+  /**
+   * Compare |t|'s memory fingerprint with the recorded one, if the
+   * current frame has one. A mismatch is treated like a checksum
+   * mismatch.
+   */
+  void check_memory_fingerprint(Task* t);
+  void debug_memory(Task* t);
   void setup_replay_one_trace_frame(Task* t);
   void advance_to_next_trace_frame(TraceFrame::Time stop_at_time);
   Completion emulate_signal_delivery(Task* oldtask, int sig,
@@ -351,6 +427,9 @@ private:
   void check_ticks_consistency(Task* t, const Event& ev);
   void check_pending_sig(Task* t);
   void continue_or_step(Task* t, RunCommand stepi, int64_t tick_period = 0);
+  bool handle_page_watch_fault(Task* t, RunCommand stepi,
+                               bool* watch_changed);
+  void unprotect_page_watches();
   enum ExecStateType {
     UNKNOWN,
     NOT_AT_TARGET,
@@ -370,12 +449,28 @@ private:
   Completion emulate_async_signal(Task* t, int sig, RunCommand stepi,
                                   Ticks ticks);
   Completion skip_desched_ioctl(Task* t, ReplayDeschedState* ds,
-                                RunCommand stepi, Ticks ticks_target = 0);
+                                RunCommand stepi, Ticks ticks_target = 0,
+                                bool defer_finish = false);
+  bool can_defer_emulated_syscall_finish(Task* t, RunCommand stepi);
+  void finish_deferred_emulated_syscall(Task* t, ExecOrEmulate emu,
+                                        Ticks ticks_target);
   void prepare_syscallbuf_records(Task* t);
   Completion flush_one_syscall(Task* t, RunCommand stepi, Ticks ticks_target);
   Completion flush_syscallbuf(Task* t, RunCommand stepi, Ticks ticks_target);
   Completion patch_next_syscall(Task* t, RunCommand stepi);
 
+  /**
+   * A task started towards the end of its next time slice while the
+   * current task runs; see Flags::parallel.
+   */
+  struct RunAhead {
+    Task* task;
+    Ticks ticks_before;
+    Ticks tick_period;
+  };
+  bool start_run_ahead(Task* t, RunCommand stepi, RunAhead* ahead);
+  void finish_run_ahead(const RunAhead& ahead);
+
   std::shared_ptr<EmuFs> emu_fs;
   Task* last_debugged_task;
   TraceReader trace_in;
@@ -383,18 +478,21 @@ private:
   ReplayTraceStep current_step;
   CPUIDBugDetector cpuid_bug_detector;
   Flags flags;
+  // Number of checksummed events replayed, for |flags.checksum_stride|.
+  uint32_t checksum_count;
+  TraceFrame::Time last_good_checksum_time_;
+  TraceFrame::Time first_bad_checksum_time_;
+  // statistics_.ptrace_calls when the current frame started replaying.
+  uint64_t frame_start_ptrace_calls;
   /**
    * Buffer for recorded syscallbuf bytes.  By definition buffer flushes
    * must be replayed sequentially, so we can use one buffer for all
-   * tracees.  At the start of the flush, the recorded bytes are read
-   * back into this buffer.  Then they're copied back to the tracee
+   * tracees.  At the start of the flush, this is pointed at the
+   * recorded bytes where the trace reader decompressed them, without
+   * another copy.  Then they're copied back to the tracee
    * record-by-record, as the tracee exits those syscalls.
-   * This needs to be word-aligned.
    */
-  union {
-    uint8_t syscallbuf_flush_buffer_array[SYSCALLBUF_BUFFER_SIZE];
-    uint64_t align_padding;
-  };
+  CompressedReader::Span syscallbuf_flush_buffer;
 };
 
 #endif // RR_REPLAY_SESSION_H_
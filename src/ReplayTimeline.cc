@@ -5,13 +5,37 @@
 #include "ReplayTimeline.h"
 
 #include <math.h>
+#include <stdio.h>
+#include <time.h>
 
+#include "Flags.h"
 #include "log.h"
 
 using namespace rr;
 using namespace std;
 
+// The longest an x86 instruction can be.
+static const size_t MAX_X86_INSN_LENGTH = 15;
+/**
+ * How many instructions mark() singlesteps, looking for the existing mark
+ * it comes before, before it switches to continuing to breakpoints at the
+ * existing marks.
+ */
+static const int MAX_MARK_SINGLESTEPS = 32;
+/**
+ * Don't bother compacting ReplayTimeline::marks until it has at least this
+ * many marks.
+ */
+static const size_t MIN_MARKS_TO_COMPACT = 4096;
+/**
+ * The most ticks before its origin that reverse_singlestep() starts
+ * singlestepping from.
+ */
+static const Ticks MAX_REVERSE_SINGLESTEP_TICKS = 64;
+
 ReplayTimeline::InternalMark::~InternalMark() {
+  MemoryAccounting::remove(MemoryAccounting::TIMELINE_MARKS,
+                           sizeof(InternalMark));
   if (owner && checkpoint) {
     owner->remove_mark_with_checkpoint(key);
   }
@@ -33,6 +57,16 @@ ostream& operator<<(ostream& s, const ReplayTimeline::Mark& o) {
   return s << *o.ptr.get();
 }
 
+/**
+ * Get the current time from the preferred monotonic clock in units of
+ * microseconds, relative to an unspecific point in the past.
+ */
+static double now_usec() {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (double)tp.tv_sec * 1e6 + (double)tp.tv_nsec / 1e3;
+}
+
 bool ReplayTimeline::less_than(const Mark& m1, const Mark& m2) {
   assert(m1.ptr->owner == m2.ptr->owner);
   if (m1.ptr->key < m2.ptr->key) {
@@ -56,13 +90,37 @@ bool ReplayTimeline::less_than(const Mark& m1, const Mark& m2) {
   return false;
 }
 
+void ReplayTimeline::stop_fast_forward() {
+  session_flags.fast_forward = false;
+  current->set_flags(session_flags);
+  for (auto& kv : marks) {
+    for (auto& m : kv.second) {
+      if (m->checkpoint) {
+        m->checkpoint->set_flags(session_flags);
+      }
+    }
+  }
+}
+
 ReplayTimeline::ReplayTimeline(std::shared_ptr<ReplaySession> session,
                                const ReplaySession::Flags& session_flags)
     : session_flags(session_flags),
       current(std::move(session)),
-      breakpoints_applied(false) {
+      mark_count(0),
+      mark_count_after_compaction(0),
+      breakpoints_applied(false),
+      event_log(nullptr),
+      event_log_start(now_usec()),
+      reverse_singlestep_ticks(1) {
   current->set_visible_execution(false);
   current->set_flags(session_flags);
+  const string& path = Flags::get().timeline_log;
+  if (!path.empty()) {
+    event_log = fopen(path.c_str(), "w");
+    if (!event_log) {
+      FATAL() << "Can't open timeline log " << path;
+    }
+  }
 }
 
 ReplayTimeline::~ReplayTimeline() {
@@ -71,6 +129,50 @@ ReplayTimeline::~ReplayTimeline() {
       itv->owner = nullptr;
     }
   }
+  if (event_log) {
+    fclose(event_log);
+  }
+}
+
+static void write_json_key(FILE* f, const char* name,
+                           TraceFrame::Time trace_time, Ticks ticks) {
+  fprintf(f, ",\"%s\":{\"time\":%lld,\"ticks\":%lld}", name,
+          (long long)trace_time, (long long)ticks);
+}
+
+void ReplayTimeline::log_checkpoint_event(const char* event, const Mark& m,
+                                          const char* reason) {
+  if (!event_log) {
+    return;
+  }
+  fprintf(event_log, "{\"event\":\"%s\",\"wall_usec\":%.0f", event,
+          now_usec() - event_log_start);
+  if (reason) {
+    fprintf(event_log, ",\"reason\":\"%s\"", reason);
+  }
+  write_json_key(event_log, "mark", m.ptr->key.trace_time,
+                 m.ptr->key.ticks);
+  auto it = reverse_exec_checkpoints.find(m);
+  if (it != reverse_exec_checkpoints.end()) {
+    fprintf(event_log, ",\"progress\":%lld", (long long)it->second);
+  }
+  fputs("}\n", event_log);
+  fflush(event_log);
+}
+
+void ReplayTimeline::log_restore_event(const MarkKey& from,
+                                       const MarkKey& target) {
+  if (!event_log) {
+    return;
+  }
+  fprintf(event_log, "{\"event\":\"restore\",\"wall_usec\":%.0f",
+          now_usec() - event_log_start);
+  write_json_key(event_log, "from", from.trace_time, from.ticks);
+  write_json_key(event_log, "target", target.trace_time, target.ticks);
+  MarkKey key = current_mark_key();
+  write_json_key(event_log, "checkpoint", key.trace_time, key.ticks);
+  fputs("}\n", event_log);
+  fflush(event_log);
 }
 
 static bool equal_regs(const Registers& r1, const Registers& r2) {
@@ -108,28 +210,56 @@ ReplayTimeline::Mark ReplayTimeline::mark() {
   auto& mark_vector = marks[key];
   if (mark_vector.empty()) {
     mark_vector.push_back(m);
+    ++mark_count;
   } else if (mark_vector[mark_vector.size() - 1] == current_at_or_after_mark) {
     mark_vector.push_back(m);
+    ++mark_count;
   } else {
     // Now the hard part: figuring out where to put it in the list of existing
     // marks.
-    unapply_breakpoints_and_watchpoints();
-    ReplaySession::shr_ptr tmp_session = current->clone();
+    ReplaySession::shr_ptr tmp_session = clone_without_breakpoints();
     vector<shared_ptr<InternalMark> >::iterator mark_index = mark_vector.end();
 
-    // We could set breakpoints at the marks and then continue with an
-    // interrupt set to fire when our tick-count increases. But that requires
-    // new replay functionality (probably a new RunCommand), so for now, do the
-    // simplest thing and just single-step until the MarkKey has increased.
+    // Single-step until the MarkKey has increased or we reach an existing
+    // mark. Some callers singlestep through N instructions, all with the
+    // same MarkKey, requesting a Mark after each step. If there's a Mark at
+    // the end of the N instructions, this could mean N(N+1)/2 singlestep
+    // operations total. To avoid that, add all the intermediate states to
+    // the mark map now, so the first mark() call will perform N singlesteps
+    // and the rest will perform none.
+    // If the existing marks are more than MAX_MARK_SINGLESTEPS instructions
+    // away, set breakpoints at them and continue instead, stepping off any
+    // breakpoint whose registers don't match a mark.
     vector<shared_ptr<InternalMark> > new_marks;
     new_marks.push_back(m);
-    while (true) {
-      auto result = tmp_session->replay_step(RUN_SINGLESTEP);
+    bool breakpoints_set = false;
+    bool at_breakpoint = false;
+    for (int steps = 0;; ++steps) {
+      if (!breakpoints_set && steps >= MAX_MARK_SINGLESTEPS) {
+        auto vm = tmp_session->current_task()->vm();
+        for (auto& existing_mark : mark_vector) {
+          vm->add_breakpoint(existing_mark->regs.ip(), TRAP_BKPT_USER);
+        }
+        breakpoints_set = true;
+      }
+      ReplayResult result;
+      if (!breakpoints_set) {
+        result = tmp_session->replay_step(RUN_SINGLESTEP);
+      } else if (at_breakpoint) {
+        Task* t = tmp_session->current_task();
+        auto vm = t->vm();
+        vm->suspend_breakpoints(t->ip(), MAX_X86_INSN_LENGTH);
+        result = tmp_session->replay_step(RUN_SINGLESTEP);
+        vm->resume_breakpoints();
+      } else {
+        result = tmp_session->replay_step(RUN_CONTINUE);
+      }
       if (session_mark_key(*tmp_session) != key ||
           result.status != REPLAY_CONTINUE) {
         break;
       }
-      if (result.break_status.reason != BREAK_SINGLESTEP) {
+      at_breakpoint = result.break_status.reason == BREAK_BREAKPOINT;
+      if (result.break_status.reason != BREAK_SINGLESTEP && !at_breakpoint) {
         continue;
       }
 
@@ -145,29 +275,55 @@ ReplayTimeline::Mark ReplayTimeline::mark() {
         break;
       }
 
-      // Some callers singlestep through N instructions, all with the same
-      // MarkKey, requesting a Mark after each step. If there's a Mark at the
-      // end of the N instructions, this could mean N(N+1)/2 singlestep
-      // operations total. To avoid that, add all the intermediate states to
-      // the mark map now, so the first mark() call will perform N singlesteps
-      // and the rest will perform none.
-      new_marks.push_back(make_shared<InternalMark>(this, t, key));
+      if (!breakpoints_set) {
+        new_marks.push_back(make_shared<InternalMark>(this, t, key));
+      }
     }
 
     // mark_index is the current index of the next mark after 'current'. So
     // insert our new marks at mark_index.
     mark_vector.insert(mark_index, new_marks.begin(), new_marks.end());
+    mark_count += new_marks.size();
   }
   swap(m, result.ptr);
   current_at_or_after_mark = result.ptr;
+  maybe_compact_marks();
   return result;
 }
 
+void ReplayTimeline::maybe_compact_marks() {
+  if (mark_count < 2 * max(mark_count_after_compaction, MIN_MARKS_TO_COMPACT)) {
+    return;
+  }
+  // A mark that only |marks| refers to can never be compared or seeked to
+  // again, and dropping it doesn't change the order of the others. Marks
+  // with checkpoints are kept, since seek_to_before_key() restores them.
+  // The intermediate marks mark() records to save singlesteps go too, but
+  // by now we've probably moved on from that part of the recording.
+  size_t before = mark_count;
+  for (auto it = marks.begin(); it != marks.end();) {
+    auto& v = it->second;
+    v.erase(remove_if(v.begin(), v.end(),
+                      [](const shared_ptr<InternalMark>& m) {
+                        return m.use_count() == 1 && !m->checkpoint;
+                      }),
+            v.end());
+    it = v.empty() ? marks.erase(it) : ++it;
+  }
+  mark_count = 0;
+  for (auto& kv : marks) {
+    mark_count += kv.second.size();
+  }
+  mark_count_after_compaction = mark_count;
+  LOG(debug) << "Compacted marks from " << before << " to " << mark_count
+             << " (" << mark_count * sizeof(InternalMark) << " bytes) in "
+             << marks.size() << " keys";
+}
+
 ReplayTimeline::Mark ReplayTimeline::add_explicit_checkpoint() {
   Mark m = mark();
   if (!m.ptr->checkpoint) {
-    unapply_breakpoints_and_watchpoints();
-    m.ptr->checkpoint = current->clone();
+    m.ptr->checkpoint = clone_without_breakpoints();
     auto key = m.ptr->key;
     if (marks_with_checkpoints.find(key) == marks_with_checkpoints.end()) {
       marks_with_checkpoints[key] = 1;
@@ -203,10 +359,13 @@ void ReplayTimeline::seek_to_before_key(const MarkKey& key) {
       // We can use the current session, so do nothing.
     } else {
       // nowhere earlier to go, so restart from beginning.
+      auto previous = current;
       current = ReplaySession::create(current->trace_reader().dir());
+      current->trace_reader().prefetch_to(previous->trace_reader());
       breakpoints_applied = false;
       current_at_or_after_mark = nullptr;
       current->set_flags(session_flags);
+      log_restore_event(current_key, key);
     }
   } else {
     --it;
@@ -216,6 +375,7 @@ void ReplayTimeline::seek_to_before_key(const MarkKey& key) {
       // have, so do nothing.
     } else {
       // Return one of the checkpoints at *it.
+      auto previous = current;
       current = nullptr;
       for (auto mark_it : marks[it->first]) {
         shared_ptr<InternalMark> m(mark_it);
@@ -225,8 +385,11 @@ void ReplayTimeline::seek_to_before_key(const MarkKey& key) {
         }
       }
       assert(current);
+      // We'll usually replay forward to near where we were.
+      current->trace_reader().prefetch_to(previous->trace_reader());
       breakpoints_applied = false;
       current_at_or_after_mark = nullptr;
+      log_restore_event(current_key, key);
     }
   }
 }
@@ -250,9 +413,13 @@ void ReplayTimeline::seek_up_to_mark(const Mark& mark) {
       at_or_before_mark = true;
     }
     if (at_or_before_mark && m->checkpoint) {
+      auto previous = current;
+      auto previous_key = current_mark_key();
       current = m->checkpoint->clone();
+      current->trace_reader().prefetch_to(previous->trace_reader());
       breakpoints_applied = false;
       current_at_or_after_mark = m;
+      log_restore_event(previous_key, mark.ptr->key);
       return;
     }
   }
@@ -271,7 +438,7 @@ static void clear_break_status_reason(BreakStatus& break_status,
 ReplayResult ReplayTimeline::replay_step_to_mark(const Mark& mark) {
   ReplayResult result;
   if (current->trace_reader().time() < mark.ptr->key.trace_time) {
-    result = current->replay_step(RUN_CONTINUE, mark.ptr->key.trace_time);
+    result = replay_current_step(RUN_CONTINUE, mark.ptr->key.trace_time);
   } else {
     Task* t = current->current_task();
     remote_ptr<uint8_t> mark_addr = mark.ptr->regs.ip();
@@ -279,14 +446,14 @@ ReplayResult ReplayTimeline::replay_step_to_mark(const Mark& mark) {
         current->current_step_key().in_execution()) {
       // At required IP, but not in the correct state. Singlestep over
       // this IP.
-      result = current->replay_step(RUN_SINGLESTEP);
+      result = replay_current_step(RUN_SINGLESTEP);
       // Hide internal singlestep
       clear_break_status_reason(result.break_status, BREAK_SINGLESTEP);
     } else {
       // Get a shared reference to t->vm() in case t dies during replay_step
       shared_ptr<AddressSpace> vm = t->vm();
       vm->add_breakpoint(mark_addr, TRAP_BKPT_USER);
-      result = current->replay_step(RUN_CONTINUE);
+      result = replay_current_step(RUN_CONTINUE);
       vm->remove_breakpoint(mark_addr, TRAP_BKPT_USER);
       // If our breakpoint is the only breakpoint there, and we hit it,
       // pretend we didn't so the caller doesn't get confused with its own
@@ -301,13 +468,28 @@ ReplayResult ReplayTimeline::replay_step_to_mark(const Mark& mark) {
 }
 
 void ReplayTimeline::seek_to_mark(const Mark& mark) {
+  MarkKey from = current_mark_key();
+  double start = now_usec();
   seek_up_to_mark(mark);
+  Ticks ticks_before = current->statistics().ticks_processed;
   while (current_mark() != mark.ptr) {
     unapply_breakpoints_and_watchpoints();
     replay_step_to_mark(mark);
   }
   current_at_or_after_mark = mark.ptr;
   // XXX handle cases where breakpoints can't yet be applied
+  if (event_log) {
+    double end = now_usec();
+    fprintf(event_log, "{\"event\":\"seek\",\"wall_usec\":%.0f",
+            end - event_log_start);
+    write_json_key(event_log, "from", from.trace_time, from.ticks);
+    write_json_key(event_log, "to", mark.ptr->key.trace_time,
+                   mark.ptr->key.ticks);
+    fprintf(event_log, ",\"replayed_ticks\":%lld,\"duration_usec\":%.0f}\n",
+            (long long)(current->statistics().ticks_processed - ticks_before),
+            end - start);
+    fflush(event_log);
+  }
 }
 
 bool ReplayTimeline::add_breakpoint(Task* t, remote_ptr<uint8_t> addr) {
@@ -337,11 +519,23 @@ bool ReplayTimeline::has_breakpoint_at_address(Task* t,
 
 bool ReplayTimeline::add_watchpoint(Task* t, remote_ptr<void> addr,
                                     size_t num_bytes, WatchType type) {
+  reverse_singlesteps.clear();
   // Apply breakpoints now; we need to actually try adding this breakpoint
   // to see if it works.
   apply_breakpoints_and_watchpoints();
   if (!t->vm()->add_watchpoint(addr, num_bytes, type)) {
-    return false;
+    // Don't let the rejected watchpoint keep the others from being
+    // allocated.
+    t->vm()->remove_watchpoint(addr, num_bytes, type);
+    if (type != WATCH_WRITE) {
+      return false;
+    }
+    // Out of debug registers. Fall back to a page watch, backed up by
+    // detecting changes to the value in replay_current_step.
+    software_watchpoints.insert(make_tuple(t->vm()->uid(), addr, num_bytes));
+    t->vm()->unprotect_page_watches(t);
+    t->vm()->add_page_watch(addr, num_bytes);
+    return true;
   }
   watchpoints.insert(make_tuple(t->vm()->uid(), addr, num_bytes, type));
   return true;
@@ -349,18 +543,32 @@ bool ReplayTimeline::add_watchpoint(Task* t, remote_ptr<void> addr,
 
 void ReplayTimeline::remove_watchpoint(Task* t, remote_ptr<void> addr,
                                        size_t num_bytes, WatchType type) {
+  reverse_singlesteps.clear();
   if (breakpoints_applied) {
     t->vm()->remove_watchpoint(addr, num_bytes, type);
   }
+  if (type == WATCH_WRITE) {
+    auto sw = software_watchpoints.find(
+        make_tuple(t->vm()->uid(), addr, num_bytes));
+    if (sw != software_watchpoints.end()) {
+      software_watchpoints.erase(sw);
+      // Page watches can only be removed all at once; the rest are
+      // reapplied lazily.
+      unapply_breakpoints_and_watchpoints();
+      return;
+    }
+  }
   auto it = watchpoints.find(make_tuple(t->vm()->uid(), addr, num_bytes, type));
   ASSERT(t, it != watchpoints.end());
   watchpoints.erase(it);
 }
 
 void ReplayTimeline::remove_breakpoints_and_watchpoints() {
+  reverse_singlesteps.clear();
   unapply_breakpoints_and_watchpoints();
   breakpoints.clear();
   watchpoints.clear();
+  software_watchpoints.clear();
 }
 
 void ReplayTimeline::apply_breakpoints_and_watchpoints() {
@@ -368,13 +576,20 @@ void ReplayTimeline::apply_breakpoints_and_watchpoints() {
     return;
   }
   breakpoints_applied = true;
-  for (auto& bp : breakpoints) {
-    AddressSpace* vm = current->find_address_space(bp.first);
+  // |breakpoints| is sorted by address space, so set each address space's
+  // breakpoints in one batch.
+  for (auto it = breakpoints.begin(); it != breakpoints.end();) {
+    AddressSpaceUid uid = it->first;
+    vector<remote_ptr<uint8_t> > addrs;
+    for (; it != breakpoints.end() && it->first == uid; ++it) {
+      addrs.push_back(it->second);
+    }
+    AddressSpace* vm = current->find_address_space(uid);
     // XXX handle cases where we can't apply a breakpoint right now. Later
     // during replay the address space might be created (or new mappings might
     // be created) and we should reapply breakpoints then.
     if (vm) {
-      vm->add_breakpoint(bp.second, TRAP_BKPT_USER);
+      vm->add_breakpoints(move(addrs), TRAP_BKPT_USER);
     }
   }
   for (auto& wp : watchpoints) {
@@ -388,6 +603,12 @@ void ReplayTimeline::apply_breakpoints_and_watchpoints() {
       vm->add_watchpoint(get<1>(wp), get<2>(wp), get<3>(wp));
     }
   }
+  for (auto& wp : software_watchpoints) {
+    AddressSpace* vm = current->find_address_space(get<0>(wp));
+    if (vm) {
+      vm->add_page_watch(get<1>(wp), get<2>(wp));
+    }
+  }
 }
 
 void ReplayTimeline::unapply_breakpoints_and_watchpoints() {
@@ -398,24 +619,44 @@ void ReplayTimeline::unapply_breakpoints_and_watchpoints() {
   for (auto& vm : current->vms()) {
     vm->remove_all_breakpoints();
     vm->remove_all_watchpoints();
+    if (vm->has_page_watches()) {
+      vm->remove_all_page_watches(*vm->task_set().begin());
+    }
   }
 }
 
-ReplayResult ReplayTimeline::singlestep_with_breakpoints_disabled() {
-  apply_breakpoints_and_watchpoints();
-  for (auto& vm : current->vms()) {
-    vm->remove_all_breakpoints();
-  }
-  auto result = current->replay_step(RUN_SINGLESTEP);
-  for (auto& bp : breakpoints) {
-    AddressSpace* vm = current->find_address_space(bp.first);
-    if (vm) {
-      vm->add_breakpoint(bp.second, TRAP_BKPT_USER);
+ReplaySession::shr_ptr ReplayTimeline::clone_without_breakpoints() {
+  ReplaySession::shr_ptr session = current->clone();
+  if (breakpoints_applied) {
+    // Strip the clone rather than unapplying and reapplying everything in
+    // the current session around the clone.
+    for (auto& vm : session->vms()) {
+      vm->remove_all_breakpoints();
+      vm->remove_all_watchpoints();
     }
   }
+  return session;
+}
+
+ReplayResult ReplayTimeline::singlestep_with_breakpoints_disabled() {
+  apply_breakpoints_and_watchpoints();
+  // Only breakpoints inside the instruction we're about to execute can
+  // affect it, so leave all the others in place.
+  Task* t = current->current_task();
+  auto vm = t->vm();
+  vm->suspend_breakpoints(t->ip(), MAX_X86_INSN_LENGTH);
+  auto result = replay_current_step(RUN_SINGLESTEP);
+  vm->resume_breakpoints();
   return result;
 }
 
+/**
+ * Search backward one checkpoint interval at a time, replaying each interval
+ * forward to find its last breakpoint/watchpoint/signal stop.
+ * The intervals are searched one after another (latest first), not
+ * concurrently: every tracee of every session is ptraced by rr's one
+ * tracer thread, so sessions can only make progress one at a time.
+ */
 ReplayResult ReplayTimeline::reverse_continue() {
   ReplayResult result;
   Mark end = mark();
@@ -500,25 +741,46 @@ ReplayResult ReplayTimeline::reverse_continue() {
   }
 }
 
-class AutoCheckpoint {
-public:
-  AutoCheckpoint(ReplayTimeline& timeline) : timeline(timeline) {
-    m = timeline.add_explicit_checkpoint();
-  }
-  ~AutoCheckpoint() { timeline.remove_explicit_checkpoint(m); }
-  const ReplayTimeline::Mark& mark() { return m; }
-
-private:
-  ReplayTimeline& timeline;
-  ReplayTimeline::Mark m;
-};
-
 ReplayResult ReplayTimeline::reverse_singlestep(const Mark& origin,
                                                 const TaskUid& tuid) {
   ReplayResult result;
 
   LOG(debug) << "ReplayTimeline::reverse_singlestep from " << origin;
 
+  if (tuid == reverse_singlesteps_tuid && !reverse_singlesteps.empty()) {
+    for (size_t i = 1; i <= reverse_singlesteps.size(); ++i) {
+      const Mark& stop = i < reverse_singlesteps.size()
+                             ? reverse_singlesteps[i].start
+                             : reverse_singlesteps_end;
+      if (stop == origin) {
+        ReverseSinglestep& step = reverse_singlesteps[i - 1];
+        LOG(debug) << "Found destination " << step.start
+                   << " among the last singlesteps";
+        seek_to_mark(step.start);
+        result = step.result;
+        result.break_status.task = current->find_task(tuid);
+        assert(result.break_status.task);
+        return result;
+      }
+    }
+    if (origin == reverse_singlesteps[0].start) {
+      reverse_singlestep_ticks =
+          min(2 * reverse_singlestep_ticks, MAX_REVERSE_SINGLESTEP_TICKS);
+    } else {
+      reverse_singlestep_ticks = 1;
+    }
+  } else {
+    reverse_singlestep_ticks = 1;
+  }
+  reverse_singlesteps.clear();
+  reverse_singlesteps_tuid = tuid;
+  // Start stepping this many ticks back, but never at or below 0 ticks,
+  // which would mean no ticks target at all.
+  Ticks origin_ticks = origin.ptr->key.ticks;
+  Ticks ticks_target =
+      origin_ticks -
+      min(reverse_singlestep_ticks, max<Ticks>(origin_ticks - 1, 1));
+
   while (true) {
     Mark end = origin;
     do {
@@ -548,14 +810,13 @@ ReplayResult ReplayTimeline::reverse_singlestep(const Mark& origin,
         unapply_breakpoints_and_watchpoints();
         Task* t = current->current_task();
         if (t->tuid() == tuid) {
-          result =
-              current->replay_step(RUN_CONTINUE, 0, origin.ptr->key.ticks - 1);
+          result = replay_current_step(RUN_CONTINUE, 0, ticks_target);
           if (result.break_status.reason == BREAK_TICKS_TARGET) {
             LOG(debug) << "   reached ticks target";
             break;
           }
         } else {
-          current->replay_step(RUN_CONTINUE);
+          replay_current_step(RUN_CONTINUE);
         }
       } while (current_mark() != end.ptr);
       end = start;
@@ -564,16 +825,23 @@ ReplayResult ReplayTimeline::reverse_singlestep(const Mark& origin,
 
     Mark destination_candidate;
     // Take a checkpoint now, before we start stepping, so the
-    // final seek_to_mark is fast
-    AutoCheckpoint stepping_started(*this);
-    Mark step_start = stepping_started.mark();
+    // final seek_to_mark is fast. Keep it after we return: repeated
+    // reverse-singlesteps through code without conditional branches all
+    // start stepping from this same point, and can reuse the checkpoint
+    // instead of forking a new one each time.
+    Mark step_start = add_explicit_checkpoint();
+    if (reverse_singlestep_checkpoint) {
+      remove_explicit_checkpoint(reverse_singlestep_checkpoint);
+    }
+    reverse_singlestep_checkpoint = step_start;
     ReplayResult destination_candidate_result;
+    reverse_singlesteps.clear();
 
     while (true) {
       Mark now;
       unapply_breakpoints_and_watchpoints();
       if (current->current_task()->tuid() == tuid) {
-        result = current->replay_step(RUN_SINGLESTEP);
+        result = replay_current_step(RUN_SINGLESTEP);
         now = mark();
         if (result.break_status.reason == BREAK_SINGLESTEP ||
             result.break_status.reason == BREAK_SIGNAL ||
@@ -585,10 +853,11 @@ ReplayResult ReplayTimeline::reverse_singlestep(const Mark& origin,
           }
           destination_candidate = step_start;
           destination_candidate_result = result;
+          reverse_singlesteps.push_back(ReverseSinglestep{ step_start, result });
           step_start = now;
         }
       } else {
-        result = current->replay_step(RUN_CONTINUE);
+        result = replay_current_step(RUN_CONTINUE);
         now = mark();
       }
       if (now >= origin) {
@@ -596,6 +865,7 @@ ReplayResult ReplayTimeline::reverse_singlestep(const Mark& origin,
       }
     }
 
+    reverse_singlesteps_end = step_start;
     if (destination_candidate) {
       LOG(debug) << "Found destination " << destination_candidate;
       seek_to_mark(destination_candidate);
@@ -614,7 +884,7 @@ ReplayResult ReplayTimeline::replay_step(RunCommand command,
   if (direction == RUN_FORWARD) {
     apply_breakpoints_and_watchpoints();
     current->set_visible_execution(true);
-    result = current->replay_step(command, stop_at_time);
+    result = replay_current_step(command, stop_at_time);
     current->set_visible_execution(false);
   } else {
     assert(stop_at_time == 0 &&
@@ -636,21 +906,207 @@ ReplayResult ReplayTimeline::replay_step(RunCommand command,
   return result;
 }
 
+// The following parameters were estimated by running Firefox startup
+// and shutdown in an opt build on a Lenovo W530 laptop, replaying with
+// DUMP_STATS_PERIOD set to 100 (twice, and using only values from the
+// second run, to ensure caches are warm), and then minimizing least-squares
+// error. They're the starting point for ProgressModel.
+static const double microseconds_per_tick = 0.0020503143;
+static const double microseconds_per_syscall = 39.6793587609;
+static const double microseconds_per_byte_written = 0.001833611;
+static const double microseconds_constant = 997.8257239043;
+
+/**
+ * How strongly the online fit is pulled back to the offline coefficients,
+ * in squared microseconds. About 100ms of replay attributable to a term is
+ * needed to move that term's coefficient halfway to its measured value.
+ */
+static const double progress_model_regularization = 1e10;
+
+static void progress_terms(const Session::Statistics& stats, double* terms) {
+  terms[0] = microseconds_per_tick * stats.ticks_processed;
+  terms[1] = microseconds_per_syscall * stats.syscalls_performed;
+  terms[2] = microseconds_per_byte_written * stats.bytes_written;
+}
+
+ReplayTimeline::ProgressModel::ProgressModel() : samples(0) {
+  for (int i = 0; i < TERMS; ++i) {
+    scale[i] = 1;
+    atb[i] = progress_model_regularization;
+    for (int j = 0; j < TERMS; ++j) {
+      ata[i][j] = i == j ? progress_model_regularization : 0;
+    }
+  }
+}
+
+ReplayTimeline::Progress ReplayTimeline::ProgressModel::estimate(
+    const Session::Statistics& stats) const {
+  double terms[TERMS];
+  progress_terms(stats, terms);
+  double result = microseconds_constant;
+  for (int i = 0; i < TERMS; ++i) {
+    result += scale[i] * terms[i];
+  }
+  return Progress(result);
+}
+
+bool ReplayTimeline::ProgressModel::add_sample(
+    const Session::Statistics& delta, double microseconds) {
+  double terms[TERMS];
+  progress_terms(delta, terms);
+  for (int i = 0; i < TERMS; ++i) {
+    atb[i] += terms[i] * microseconds;
+    for (int j = 0; j < TERMS; ++j) {
+      ata[i][j] += terms[i] * terms[j];
+    }
+  }
+  // Refitting is cheap, but there's no point doing it for every tiny step.
+  if (++samples % 8) {
+    return false;
+  }
+
+  // Solve ata * x = atb by Gaussian elimination. The regularization keeps
+  // ata positive definite, so no pivoting is needed.
+  double m[TERMS][TERMS + 1];
+  for (int i = 0; i < TERMS; ++i) {
+    for (int j = 0; j < TERMS; ++j) {
+      m[i][j] = ata[i][j];
+    }
+    m[i][TERMS] = atb[i];
+  }
+  for (int i = 0; i < TERMS; ++i) {
+    for (int k = i + 1; k < TERMS; ++k) {
+      double f = m[k][i] / m[i][i];
+      for (int j = i; j <= TERMS; ++j) {
+        m[k][j] -= f * m[i][j];
+      }
+    }
+  }
+  for (int i = TERMS - 1; i >= 0; --i) {
+    double x = m[i][TERMS];
+    for (int j = i + 1; j < TERMS; ++j) {
+      x -= m[i][j] * scale[j];
+    }
+    // Keep the model sane if the samples are degenerate.
+    scale[i] = min(max(x / m[i][i], 0.05), 20.0);
+  }
+  LOG(debug) << "Refit progress model: ticks x" << scale[0] << ", syscalls x"
+             << scale[1] << ", bytes x" << scale[2];
+  return true;
+}
+
 ReplayTimeline::Progress ReplayTimeline::estimate_progress() {
-  Session::Statistics stats = current->statistics();
-  // The following parameters were estimated by running Firefox startup
-  // and shutdown in an opt build on a Lenovo W530 laptop, replaying with
-  // DUMP_STATS_PERIOD set to 100 (twice, and using only values from the
-  // second run, to ensure caches are warm), and then minimizing least-squares
-  // error.
-  static const double microseconds_per_tick = 0.0020503143;
-  static const double microseconds_per_syscall = 39.6793587609;
-  static const double microseconds_per_byte_written = 0.001833611;
-  static const double microseconds_constant = 997.8257239043;
-  return Progress(microseconds_per_tick * stats.ticks_processed +
-                  microseconds_per_syscall * stats.syscalls_performed +
-                  microseconds_per_byte_written * stats.bytes_written +
-                  microseconds_constant);
+  return progress_model.estimate(current->statistics());
+}
+
+vector<vector<uint8_t> > ReplayTimeline::read_software_watchpoints() {
+  vector<vector<uint8_t> > values;
+  for (auto& wp : software_watchpoints) {
+    values.push_back(vector<uint8_t>());
+    AddressSpace* vm = current->find_address_space(get<0>(wp));
+    if (!vm || vm->task_set().empty()) {
+      continue;
+    }
+    auto& value = values.back();
+    value.resize(get<2>(wp));
+    ssize_t nread = (*vm->task_set().begin())
+                        ->read_bytes_fallible(get<1>(wp), value.size(),
+                                              value.data());
+    value.resize(max<ssize_t>(nread, 0));
+  }
+  return values;
+}
+
+remote_ptr<void> ReplayTimeline::changed_software_watchpoint(
+    const vector<vector<uint8_t> >& before,
+    const vector<vector<uint8_t> >& after) {
+  size_t i = 0;
+  for (auto& wp : software_watchpoints) {
+    if (before[i] != after[i]) {
+      return get<1>(wp);
+    }
+    ++i;
+  }
+  return nullptr;
+}
+
+ReplayResult ReplayTimeline::replay_current_step(RunCommand command,
+                                                 TraceFrame::Time stop_at_time,
+                                                 Ticks ticks_target) {
+  if (!breakpoints_applied || software_watchpoints.empty()) {
+    return replay_current_step_timed(command, stop_at_time, ticks_target);
+  }
+
+  // Software watchpoints: compare the watched values across the step, and
+  // if one changed, go back and singlestep to the instruction that
+  // changed it.
+  Mark before_step = mark();
+  apply_breakpoints_and_watchpoints();
+  auto before = read_software_watchpoints();
+  ReplayResult result =
+      replay_current_step_timed(command, stop_at_time, ticks_target);
+  remote_ptr<void> changed =
+      changed_software_watchpoint(before, read_software_watchpoints());
+  if (changed.is_null() || !result.break_status.watch_address.is_null()) {
+    return result;
+  }
+  if (command == RUN_SINGLESTEP) {
+    result.break_status.reason = BREAK_WATCHPOINT;
+    result.break_status.task = current->current_task();
+    result.break_status.watch_address = changed;
+    return result;
+  }
+
+  ReplayResult step_result = result;
+  TraceFrame::Time end_time = current_mark_key().trace_time;
+  seek_to_mark(before_step);
+  apply_breakpoints_and_watchpoints();
+  while (current_mark_key().trace_time <= end_time) {
+    before = read_software_watchpoints();
+    result = current->replay_step(RUN_SINGLESTEP);
+    changed = changed_software_watchpoint(before, read_software_watchpoints());
+    if (!changed.is_null()) {
+      result.break_status.reason = BREAK_WATCHPOINT;
+      result.break_status.task = current->current_task();
+      result.break_status.watch_address = changed;
+      return result;
+    }
+    if (result.status != REPLAY_CONTINUE) {
+      break;
+    }
+  }
+  // Replay should be deterministic, so we don't expect to get here.
+  LOG(warn) << "Software watchpoint change not reproduced by singlestepping";
+  return step_result;
+}
+
+ReplayResult ReplayTimeline::replay_current_step_timed(
+    RunCommand command, TraceFrame::Time stop_at_time, Ticks ticks_target) {
+  if (command != RUN_CONTINUE) {
+    // Singlestepping costs are dominated by per-step overhead the model
+    // doesn't account for.
+    return current->replay_step(command, stop_at_time, ticks_target);
+  }
+
+  Session::Statistics before = current->statistics();
+  double start = now_usec();
+  ReplayResult result = current->replay_step(command, stop_at_time,
+                                             ticks_target);
+  double elapsed = now_usec() - start;
+  Session::Statistics after = current->statistics();
+  Session::Statistics delta;
+  delta.ticks_processed = after.ticks_processed - before.ticks_processed;
+  delta.syscalls_performed =
+      after.syscalls_performed - before.syscalls_performed;
+  delta.bytes_written = after.bytes_written - before.bytes_written;
+  if (progress_model.add_sample(delta, elapsed)) {
+    // Progress values of existing checkpoints must stay comparable with
+    // new estimates.
+    for (auto& c : reverse_exec_checkpoints) {
+      c.second = progress_model.estimate(c.first.ptr->checkpoint->statistics());
+    }
+  }
+  return result;
 }
 
 /**
@@ -678,7 +1134,8 @@ static float checkpoint_interval_exponent = 2;
  * that is not in interval N-1. Repeat until there are no excess checkpoints.
  * All checkpoints after the current replay point are always discarded.
  * The script checkpoint-visualizer.html simulates this algorithm and
- * visualizes its results.
+ * visualizes its results. The global --timeline-log option records what
+ * it actually did during a replay.
  * The implementation here is quite naive, but that's OK because we will
  * never have a large number of checkpoints.
  */
@@ -690,8 +1147,7 @@ void ReplayTimeline::update_reverse_exec_checkpoints() {
     if (it == reverse_exec_checkpoints.rend() || it->second < now) {
       break;
     }
-    remove_explicit_checkpoint(it->first);
-    reverse_exec_checkpoints.erase(it->first);
+    discard_reverse_exec_checkpoint(it->first, "future");
   }
 
   auto it = reverse_exec_checkpoints.rbegin();
@@ -711,7 +1167,103 @@ void ReplayTimeline::update_reverse_exec_checkpoints() {
   // maximum checkpoint count by one.
   discard_excess_checkpoints(now);
 
-  reverse_exec_checkpoints[add_explicit_checkpoint()] = now;
+  Mark m = add_explicit_checkpoint();
+  reverse_exec_checkpoints[m] = now;
+  log_checkpoint_event("checkpoint", m);
+  if (Flags::get().checkpoint_memory_budget || Flags::get().verbose) {
+    // A fresh checkpoint shares all its pages with the current session, so
+    // it starts out costing nothing. Older checkpoints' costs grow as the
+    // current session dirties pages, so they're remeasured each time.
+    reverse_exec_checkpoint_memory[m] = 0;
+    measure_checkpoint_memory();
+  }
+}
+
+struct MemoryUsage {
+  MemoryUsage() : private_bytes(0), shared_bytes(0) {}
+  size_t private_bytes;
+  size_t shared_bytes;
+};
+
+/**
+ * Add the private (unshared) and shared resident memory of the process
+ * |tid| to |usage|.
+ */
+static void add_memory_of(pid_t tid, MemoryUsage* usage) {
+  char path[PATH_MAX];
+  // smaps_rollup is much cheaper to read, but older kernels only have smaps.
+  snprintf(path, sizeof(path) - 1, "/proc/%d/smaps_rollup", tid);
+  FILE* f = fopen(path, "r");
+  if (!f) {
+    snprintf(path, sizeof(path) - 1, "/proc/%d/smaps", tid);
+    f = fopen(path, "r");
+    if (!f) {
+      return;
+    }
+  }
+  char line[256];
+  while (fgets(line, sizeof(line), f)) {
+    unsigned long kb;
+    if (sscanf(line, "Private_Clean: %lu kB", &kb) == 1 ||
+        sscanf(line, "Private_Dirty: %lu kB", &kb) == 1) {
+      usage->private_bytes += kb * 1024;
+    } else if (sscanf(line, "Shared_Clean: %lu kB", &kb) == 1 ||
+               sscanf(line, "Shared_Dirty: %lu kB", &kb) == 1) {
+      usage->shared_bytes += kb * 1024;
+    }
+  }
+  fclose(f);
+}
+
+/**
+ * Return the memory usage of all the address spaces in |session|.
+ */
+static MemoryUsage memory_of(ReplaySession& session) {
+  MemoryUsage usage;
+  for (AddressSpace* vm : session.vms()) {
+    if (!vm->task_set().empty()) {
+      add_memory_of((*vm->task_set().begin())->tid, &usage);
+    }
+  }
+  return usage;
+}
+
+void ReplayTimeline::measure_checkpoint_memory() {
+  size_t total = 0;
+  for (auto& c : reverse_exec_checkpoints) {
+    MemoryUsage usage = memory_of(*c.first.ptr->checkpoint);
+    LOG(info) << "Checkpoint " << c.first << ": "
+              << usage.private_bytes / page_size() << " unique pages, "
+              << usage.shared_bytes / page_size() << " shared pages";
+    reverse_exec_checkpoint_memory[c.first] = usage.private_bytes;
+    total += usage.private_bytes;
+  }
+
+  size_t budget = Flags::get().checkpoint_memory_budget;
+  if (!budget) {
+    return;
+  }
+  // Evicting the oldest checkpoints first keeps the exponential spacing of
+  // the remaining ones intact; we just can't reverse-execute as far back
+  // cheaply.
+  while (total > budget && reverse_exec_checkpoints.size() > 1) {
+    auto it = reverse_exec_checkpoints.begin();
+    size_t size = reverse_exec_checkpoint_memory[it->first];
+    LOG(debug) << "Discarding checkpoint " << it->first << " using " << size
+               << " bytes; checkpoints use " << total << " of " << budget;
+    total -= size;
+    discard_reverse_exec_checkpoint(it->first, "budget");
+  }
+  MemoryAccounting::set(MemoryAccounting::CHECKPOINTS, total);
+}
+
+void ReplayTimeline::print_memory_usage(FILE* out) {
+  size_t total = 0;
+  for (auto& c : reverse_exec_checkpoints) {
+    total += memory_of(*c.first.ptr->checkpoint).private_bytes;
+  }
+  MemoryAccounting::set(MemoryAccounting::CHECKPOINTS, total);
+  current_session().print_memory_usage(out);
 }
 
 void ReplayTimeline::discard_excess_checkpoints(Progress now) {
@@ -746,7 +1298,14 @@ void ReplayTimeline::discard_excess_checkpoints(Progress now) {
   }
 
   for (auto& m : checkpoints_to_delete) {
-    remove_explicit_checkpoint(m);
-    reverse_exec_checkpoints.erase(m);
+    discard_reverse_exec_checkpoint(m, "spacing");
   }
 }
+
+void ReplayTimeline::discard_reverse_exec_checkpoint(Mark m,
+                                                     const char* reason) {
+  log_checkpoint_event("evict", m, reason);
+  remove_explicit_checkpoint(m);
+  reverse_exec_checkpoint_memory.erase(m);
+  reverse_exec_checkpoints.erase(m);
+}
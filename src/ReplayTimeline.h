@@ -3,12 +3,16 @@
 #ifndef RR_REPLAY_TIMELINE_H_
 #define RR_REPLAY_TIMELINE_H_
 
+#include <stdio.h>
+
 #include <iostream>
 #include <map>
 #include <memory>
+#include <set>
 #include <tuple>
 #include <vector>
 
+#include "MemoryAccounting.h"
 #include "Registers.h"
 #include "ReplaySession.h"
 #include "TraceFrame.h"
@@ -30,9 +34,17 @@ private:
 public:
   ReplayTimeline(std::shared_ptr<ReplaySession> session,
                  const ReplaySession::Flags& session_flags);
-  ReplayTimeline() : breakpoints_applied(false) {}
+  ReplayTimeline()
+      : mark_count(0), mark_count_after_compaction(0),
+        breakpoints_applied(false) {}
   ~ReplayTimeline();
 
+  /**
+   * Turn off ReplaySession::Flags::fast_forward in the current session,
+   * every checkpoint, and the sessions created later.
+   */
+  void stop_fast_forward();
+
   /**
    * An estimate of how much progress a session has made. This should roughly
    * correlate to the time required to replay from the start of a session
@@ -95,6 +107,12 @@ public:
    */
   void remove_explicit_checkpoint(const Mark& mark);
 
+  /**
+   * Measure the private memory of our reverse-execution checkpoints, then
+   * print rr's memory use by subsystem to |out|.
+   */
+  void print_memory_usage(FILE* out);
+
   /**
    * Return true if we're currently at the given mark.
    */
@@ -197,6 +215,8 @@ private:
       if (t) {
         regs = t->regs();
       }
+      MemoryAccounting::add(MemoryAccounting::TIMELINE_MARKS,
+                            sizeof(InternalMark));
     }
     ~InternalMark();
 
@@ -223,10 +243,16 @@ private:
   /**
    * unapply_breakpoints_and_watchpoints() forces the breakpoints/watchpoints
    * to not be applied to the current session. Use this when we need to
-   * clone the current session or replay the current session without
-   * triggering breakpoints.
+   * replay the current session without triggering breakpoints.
    */
   void unapply_breakpoints_and_watchpoints();
+  /**
+   * Clone the current session, with no breakpoints or watchpoints applied
+   * in the clone. The current session keeps whatever is applied to it, so
+   * taking a checkpoint doesn't mean rewriting every breakpoint when we
+   * next resume.
+   */
+  ReplaySession::shr_ptr clone_without_breakpoints();
 
   static MarkKey session_mark_key(ReplaySession& session) {
     Task* t = session.current_task();
@@ -237,6 +263,11 @@ private:
   // Returns a shared pointer to the mark if there is one for the current state.
   std::shared_ptr<InternalMark> current_mark();
   void remove_mark_with_checkpoint(const MarkKey& key);
+  /**
+   * Once |marks| has grown to twice its size after the last compaction,
+   * drop the marks nothing refers to any more.
+   */
+  void maybe_compact_marks();
   void seek_to_before_key(const MarkKey& key);
   ReplayResult replay_step_to_mark(const Mark& mark);
   ReplayResult singlestep_with_breakpoints_disabled();
@@ -247,7 +278,56 @@ private:
   // Reasonably fast since it just relies on checking the mark map.
   static bool less_than(const Mark& m1, const Mark& m2);
 
+  /**
+   * Linear model of the wall-clock time, in microseconds, needed to replay
+   * the work counted by a Session::Statistics. It starts out with
+   * coefficients fit offline, and refits them online from timed replay.
+   */
+  class ProgressModel {
+  public:
+    ProgressModel();
+    Progress estimate(const Session::Statistics& stats) const;
+    /**
+     * Record that replaying |delta| took |microseconds|. Returns true if the
+     * model changed.
+     */
+    bool add_sample(const Session::Statistics& delta, double microseconds);
+
+  private:
+    enum {
+      TERMS = 3
+    };
+    /* Multipliers applied to the offline coefficients for ticks, syscalls
+     * and bytes written. */
+    double scale[TERMS];
+    /* Normal equations of the regularized least-squares fit of |scale|. */
+    double ata[TERMS][TERMS];
+    double atb[TERMS];
+    uint32_t samples;
+  };
+
   Progress estimate_progress();
+  /**
+   * Replay |current| forward, timing it to refine the progress model.
+   */
+  ReplayResult replay_current_step(RunCommand command,
+                                   TraceFrame::Time stop_at_time = 0,
+                                   Ticks ticks_target = 0);
+  ReplayResult replay_current_step_timed(RunCommand command,
+                                         TraceFrame::Time stop_at_time,
+                                         Ticks ticks_target);
+  /**
+   * Read the current contents of each software watchpoint, in
+   * software_watchpoints order.
+   */
+  std::vector<std::vector<uint8_t> > read_software_watchpoints();
+  /**
+   * Return the address of the first software watchpoint whose contents
+   * differ between |before| and |after|, or null.
+   */
+  remote_ptr<void> changed_software_watchpoint(
+      const std::vector<std::vector<uint8_t> >& before,
+      const std::vector<std::vector<uint8_t> >& after);
   /**
    * Called whenever the current session moves to a new execution point.
    * Make add a new checkpoint or remove one or more checkpoints from
@@ -255,9 +335,34 @@ private:
    */
   void update_reverse_exec_checkpoints();
   void discard_excess_checkpoints(Progress now);
+  /**
+   * Drop |m| from reverse_exec_checkpoints. |reason| is recorded in the
+   * event log.
+   */
+  void discard_reverse_exec_checkpoint(Mark m, const char* reason);
+  /**
+   * Write a JSON record of a checkpoint being created or evicted to the
+   * event log, if there is one.
+   */
+  void log_checkpoint_event(const char* event, const Mark& m,
+                            const char* reason = nullptr);
+  /**
+   * Write a JSON record of the current session having been replaced by a
+   * checkpoint (or a fresh session) while seeking from |from| towards
+   * |target| to the event log, if there is one.
+   */
+  void log_restore_event(const MarkKey& from, const MarkKey& target);
+  /**
+   * Measure the unique and shared memory of each reverse-exec checkpoint
+   * (logging it in verbose mode), then discard the oldest ones until the
+   * unique memory of the rest fits in the checkpoint_memory_budget.
+   */
+  void measure_checkpoint_memory();
 
   ReplaySession::Flags session_flags;
 
+  ProgressModel progress_model;
+
   ReplaySession::shr_ptr current;
   // current is known to be at or after this mark
   std::shared_ptr<InternalMark> current_at_or_after_mark;
@@ -277,6 +382,12 @@ private:
    * but that's not too bad.
    */
   std::map<MarkKey, std::vector<std::shared_ptr<InternalMark> > > marks;
+  /**
+   * How many InternalMarks |marks| holds, and how many it held after the
+   * last maybe_compact_marks() that compacted.
+   */
+  size_t mark_count;
+  size_t mark_count_after_compaction;
 
   /**
    * All mark keys with at least one checkpoint. The value is the number of
@@ -288,12 +399,64 @@ private:
   std::multiset<std::pair<AddressSpaceUid, remote_ptr<uint8_t> > > breakpoints;
   std::multiset<std::tuple<AddressSpaceUid, remote_ptr<void>, size_t,
                            WatchType> > watchpoints;
+  /**
+   * Write watchpoints that didn't fit in the debug registers. While
+   * breakpoints are applied, these are set as AddressSpace page watches,
+   * which catch most writes where they happen. replay_current_step also
+   * compares their contents before and after each step, and singlesteps
+   * through a step that changed one without a page watch noticing to find
+   * the writing instruction. Like hardware watchpoints, only writes that
+   * change the value are reported.
+   */
+  std::set<std::tuple<AddressSpaceUid, remote_ptr<void>, size_t> >
+      software_watchpoints;
   bool breakpoints_applied;
 
   /**
    * Checkpoints used to accelerate reverse execution.
    */
   std::map<Mark, Progress> reverse_exec_checkpoints;
+  /**
+   * Private memory of each reverse-exec checkpoint, as of the last time it
+   * was measured.
+   */
+  std::map<Mark, size_t> reverse_exec_checkpoint_memory;
+
+  /**
+   * When Flags::timeline_log is set, checkpoint and seek events are written
+   * here, one JSON object per line, with wall-clock times in microseconds
+   * since this timeline was created.
+   */
+  FILE* event_log;
+  double event_log_start;
+
+  /**
+   * The checkpoint the last reverse_singlestep started stepping from.
+   */
+  Mark reverse_singlestep_checkpoint;
+  /**
+   * The usable singlesteps of |reverse_singlesteps_tuid| that the last
+   * reverse_singlestep() made, in order: where each started, and its
+   * result. |reverse_singlesteps_end| is where the last one stopped.
+   * Reverse-singlestepping from any of those stops is then just a seek to
+   * the one before, so stepping backwards through the span replays it
+   * forward once instead of once per instruction. Cleared when watchpoints
+   * change, since they change the results.
+   */
+  struct ReverseSinglestep {
+    Mark start;
+    ReplayResult result;
+  };
+  std::vector<ReverseSinglestep> reverse_singlesteps;
+  Mark reverse_singlesteps_end;
+  TaskUid reverse_singlesteps_tuid;
+  /**
+   * How many ticks before its origin reverse_singlestep() starts
+   * singlestepping. It grows while reverse-singlesteps keep backing out of
+   * the start of the span the last one stepped through, so a long run of
+   * them seeks far back once per span rather than once per branch.
+   */
+  Ticks reverse_singlestep_ticks;
 };
 
 std::ostream& operator<<(std::ostream& s, const ReplayTimeline::Mark& o);
@@ -21,6 +21,7 @@
 #include "log.h"
 #include "RecordSession.h"
 #include "task.h"
+#include "WaitHub.h"
 
 using namespace std;
 
@@ -46,11 +47,45 @@ Task* Scheduler::get_next_task_with_same_priority(Task* t) {
   return it->second;
 }
 
+void Scheduler::reap_blocked_tasks() {
+  // One waitpid(-1) sweep collects every pending state change, rather than
+  // polling each blocked task with its own waitpid.
+  while (true) {
+    int status;
+    pid_t tid = WaitHub::get().wait_any(&status, false);
+    if (tid <= 0) {
+      if (tid < 0 && errno != ECHILD && errno != EINTR) {
+        FATAL() << "Failed to waitpid(-1, NOHANG)";
+      }
+      return;
+    }
+    Task* t = session.find_task(tid);
+    if (!t) {
+      LOG(debug) << "  " << tid << " isn't in this session";
+      continue;
+    }
+    t->did_waitpid(status);
+    woken_tasks.insert(t);
+  }
+}
+
 /**
  * Returns true if we should return t as the runnable task. Otherwise we
  * should check the next task.
  */
-static bool is_task_runnable(Task* t, bool* by_waitpid) {
+bool Scheduler::is_task_runnable(Task* t, bool* by_waitpid) {
+  if (woken_tasks.count(t)) {
+    if (t->emulated_stop_type != NOT_STOPPED) {
+      LOG(debug) << "  " << t->tid << " is stopped by ptrace or signal";
+      return false;
+    }
+    LOG(debug) << "  " << t->tid << " woke with status " << HEX(t->status());
+    woken_tasks.erase(t);
+    t->pseudo_blocked = false;
+    *by_waitpid = true;
+    return true;
+  }
+
   if (t->unstable) {
     LOG(debug) << "  " << t->tid << " is unstable, doing waitpid(-1)";
     return true;
@@ -68,19 +103,20 @@ static bool is_task_runnable(Task* t, bool* by_waitpid) {
 
   LOG(debug) << "  " << t->tid << " is blocked on " << t->ev()
              << "; checking status ...";
-  bool did_wait_for_t;
   if (t->pseudo_blocked) {
     t->wait();
-    did_wait_for_t = true;
-  } else {
-    did_wait_for_t = t->try_wait();
-  }
-  if (did_wait_for_t) {
     t->pseudo_blocked = false;
     *by_waitpid = true;
     LOG(debug) << "  ready with status " << HEX(t->status());
     return true;
   }
+  if (!reaped_this_round) {
+    reap_blocked_tasks();
+    reaped_this_round = true;
+    if (woken_tasks.count(t)) {
+      return is_task_runnable(t, by_waitpid);
+    }
+  }
   LOG(debug) << "  still blocked";
   // Try next task
   return false;
@@ -88,6 +124,7 @@ static bool is_task_runnable(Task* t, bool* by_waitpid) {
 
 Task* Scheduler::find_next_runnable_task(bool* by_waitpid) {
   *by_waitpid = false;
+  reaped_this_round = false;
 
   while (true) {
     Task* t = get_next_round_robin_task();
@@ -103,6 +140,12 @@ Task* Scheduler::find_next_runnable_task(bool* by_waitpid) {
     remove_round_robin_task();
   }
 
+  Task* woken = get_runnable_futex_waiter(by_waitpid);
+  if (woken) {
+    LOG(debug) << "Choosing woken futex waiter " << woken->tid;
+    return woken;
+  }
+
   // The outer loop has one iteration per unique priority value.
   // The inner loop iterates over all tasks with that priority.
   for (auto same_priority_start = task_priority_set.begin();
@@ -179,6 +222,10 @@ Task* Scheduler::get_next_thread(Task* t, Switchable switchable,
 #endif
       *by_waitpid = true;
       LOG(debug) << "  new status is " << HEX(current->status());
+    } else if (woken_tasks.erase(current)) {
+      LOG(debug) << "  and already woke with status "
+                 << HEX(current->status());
+      *by_waitpid = true;
     }
     return current;
   }
@@ -196,37 +243,43 @@ Task* Scheduler::get_next_thread(Task* t, Switchable switchable,
 
   Task* next = find_next_runnable_task(by_waitpid);
 
-  if (next && !next->unstable) {
+  if (next && (!next->unstable || *by_waitpid)) {
     LOG(debug) << "  selecting task " << next->tid;
   } else {
     // All the tasks are blocked (or we found an unstable-exit task).
     // Wait for the next one to change state.
-    int status;
-    pid_t tid;
-
     LOG(debug) << "  all tasks blocked or some unstable, waiting for runnable ("
                << task_priority_set.size() << " total)";
-    do {
-      tid = waitpid(-1, &status, __WALL | WSTOPPED | WUNTRACED);
-      if (-1 == tid) {
-        if (EINTR == errno) {
-          LOG(debug) << "  waitpid(-1) interrupted";
-          return nullptr;
+    if (!woken_tasks.empty()) {
+      // A state change was already collected for a task that can't be
+      // scheduled normally (e.g. it's in an emulated stop). Hand it out
+      // rather than waiting for another one.
+      next = *woken_tasks.begin();
+      woken_tasks.erase(woken_tasks.begin());
+    } else {
+      int status;
+      pid_t tid;
+      do {
+        tid = WaitHub::get().wait_any(&status, true);
+        if (-1 == tid) {
+          if (EINTR == errno) {
+            LOG(debug) << "  waitpid(-1) interrupted";
+            return nullptr;
+          }
+          FATAL() << "Failed to waitpid()";
         }
-        FATAL() << "Failed to waitpid()";
-      }
-      LOG(debug) << "  " << tid << " changed status to " << HEX(status);
 
-      next = session.find_task(tid);
-      if (!next) {
-        LOG(debug) << "    ... but it's dead";
-      }
-    } while (!next);
-    ASSERT(next,
-           next->unstable || next->may_be_blocked() ||
-               Task::ptrace_event_from_status(status) == PTRACE_EVENT_EXIT)
+        next = session.find_task(tid);
+        if (!next) {
+          LOG(debug) << "  " << tid << " isn't in this session";
+        }
+      } while (!next);
+      next->did_waitpid(status);
+    }
+    ASSERT(next, next->unstable || next->may_be_blocked() ||
+                     next->ptrace_event() == PTRACE_EVENT_EXIT)
         << "Scheduled task should have been blocked or unstable";
-    next->did_waitpid(status);
+    next->pseudo_blocked = false;
     *by_waitpid = true;
   }
 
@@ -235,12 +288,123 @@ Task* Scheduler::get_next_thread(Task* t, Switchable switchable,
   return current;
 }
 
+Ticks Scheduler::timeslice(Task* t) const {
+  if (!adaptive_timeslice || !t->timeslice) {
+    return max_ticks_;
+  }
+  return t->timeslice;
+}
+
+void Scheduler::on_timeslice_expired(Task* t) {
+  Ticks slice = timeslice(t);
+  Ticks ticks = t->tick_count();
+  remote_ptr<uint8_t> ip = t->ip();
+  // The interrupt fires a little after the programmed tick count. If
+  // noticeably more ticks elapsed than one timeslice, the task stopped for
+  // a traced syscall (or signal) in between, which restarted the slice.
+  bool no_stops = t->timeslice_expired_ticks &&
+                  ticks - t->timeslice_expired_ticks <= slice + slice / 8;
+  bool same_loop = ip - t->timeslice_expired_ip < SPIN_IP_WINDOW &&
+                   t->timeslice_expired_ip - ip < SPIN_IP_WINDOW;
+  t->timeslice_expired_ticks = ticks;
+  t->timeslice_expired_ip = ip;
+  if (!adaptive_timeslice) {
+    return;
+  }
+
+  if (no_stops && same_loop) {
+    slice = max<Ticks>(slice / 2, max_ticks_ / MAX_TIMESLICE_SCALE);
+    LOG(debug) << "  " << t->tid << " seems to be spinning at " << ip
+               << "; timeslice now " << slice;
+  } else if (no_stops) {
+    slice = min<Ticks>(slice * 2, max_ticks_ * MAX_TIMESLICE_SCALE);
+    LOG(debug) << "  " << t->tid << " is compute-bound; timeslice now "
+               << slice;
+  } else {
+    slice = max_ticks_;
+  }
+  t->timeslice = max<Ticks>(slice, 1);
+}
+
+Task* Scheduler::get_runnable_futex_waiter(bool* by_waitpid) {
+  if (futex_woken.empty() || task_priority_set.empty()) {
+    return nullptr;
+  }
+  int top_priority = task_priority_set.begin()->first;
+  for (auto it = futex_woken.begin(); it != futex_woken.end(); ++it) {
+    Task* t = *it;
+    if (t->in_round_robin_queue || t->priority > top_priority) {
+      continue;
+    }
+    if (is_task_runnable(t, by_waitpid)) {
+      futex_woken.erase(it);
+      return t;
+    }
+  }
+  return nullptr;
+}
+
+void Scheduler::on_futex_wait(Task* t, remote_ptr<int> addr) {
+  on_futex_wait_done(t);
+  t->futex_wait_addr = addr;
+  futex_waiters[make_pair(t->vm().get(), addr)].push_back(t);
+}
+
+void Scheduler::on_futex_wait_done(Task* t) {
+  if (!t->futex_wait_addr.is_null()) {
+    auto it = futex_waiters.find(make_pair(t->vm().get(), t->futex_wait_addr));
+    if (it != futex_waiters.end()) {
+      auto& waiters = it->second;
+      auto w = find(waiters.begin(), waiters.end(), t);
+      if (w != waiters.end()) {
+        waiters.erase(w);
+      }
+      if (waiters.empty()) {
+        futex_waiters.erase(it);
+      }
+    }
+    t->futex_wait_addr = nullptr;
+  }
+  auto w = find(futex_woken.begin(), futex_woken.end(), t);
+  if (w != futex_woken.end()) {
+    futex_woken.erase(w);
+  }
+}
+
+void Scheduler::on_futex_wake(Task* t, remote_ptr<int> addr, int count) {
+  auto it = futex_waiters.find(make_pair(t->vm().get(), addr));
+  if (it == futex_waiters.end()) {
+    return;
+  }
+  auto& waiters = it->second;
+  while (count > 0 && !waiters.empty()) {
+    Task* waiter = waiters.front();
+    waiters.pop_front();
+    waiter->futex_wait_addr = nullptr;
+    LOG(debug) << "  " << t->tid << " woke futex waiter " << waiter->tid;
+    futex_woken.push_back(waiter);
+    --count;
+  }
+  if (waiters.empty()) {
+    futex_waiters.erase(it);
+  }
+}
+
+bool Scheduler::is_sole_task(Task* t) const {
+  // Every task is in exactly one of these.
+  return task_priority_set.size() + task_round_robin_queue.size() == 1 &&
+         (t->in_round_robin_queue ||
+          task_priority_set.count(make_pair(t->priority, t)));
+}
+
 void Scheduler::on_create(Task* t) {
   assert(!t->in_round_robin_queue);
   task_priority_set.insert(make_pair(t->priority, t));
 }
 
 void Scheduler::on_destroy(Task* t) {
+  on_futex_wait_done(t);
+  woken_tasks.erase(t);
   if (t == current) {
     current = get_next_task_with_same_priority(t);
     if (t == current) {
@@ -4,12 +4,15 @@
 #define RR_REC_SCHED_H_
 
 #include <deque>
+#include <map>
 #include <set>
+#include <unordered_set>
 
 #include "Ticks.h"
 #include "TraceFrame.h"
 #include "util.h"
 
+class AddressSpace;
 class RecordSession;
 class Task;
 
@@ -30,6 +33,20 @@ class Task;
  * sched_yield are often expecting some kind of fair scheduling and may deadlock
  * (e.g. trying to acquire a spinlock) if some other tasks don't get a chance
  * to run.
+ *
+ * At most one task executes user code at a time. Replay reproduces the
+ * interleaving of tasks by replaying each task's events at the same tick
+ * counts, which only determines the outcome of racing shared-memory
+ * accesses if those accesses were never concurrent during recording.
+ * Tasks blocked in syscalls (including desched'd buffered syscalls) do
+ * run in parallel with the scheduled task, since their results are
+ * recorded rather than re-executed.
+ *
+ * The scheduler tracks which tasks are blocked in FUTEX_WAIT on which futex
+ * word. When a traced FUTEX_WAKE wakes waiters, the woken waiters are
+ * preferred over other tasks of the same priority as soon as their wakeup
+ * is observed, so lock and condvar handoffs don't wait for a round-robin
+ * scan to reach the new owner.
  */
 class Scheduler {
 public:
@@ -95,15 +112,56 @@ public:
   enum {
     DEFAULT_MAX_EVENTS = 10
   };
+  /**
+   * With adaptive timeslices, a task whose timeslice keeps expiring inside
+   * the same small code window without it making any traced syscall is
+   * assumed to be spin-waiting on another task, and its timeslice is halved
+   * (down to max_ticks / MAX_TIMESLICE_SCALE) so the task it's waiting for
+   * gets to run sooner. A task that expires its timeslice with no syscalls
+   * but at varying ips is compute-bound, and its timeslice is doubled (up to
+   * max_ticks * MAX_TIMESLICE_SCALE) to cut preemption overhead. Any other
+   * task gets max_ticks again.
+   */
+  enum {
+    MAX_TIMESLICE_SCALE = 4
+  };
+  enum {
+    SPIN_IP_WINDOW = 64
+  };
 
   Scheduler(RecordSession& session)
       : session(session),
         current(nullptr),
+        reaped_this_round(false),
         max_ticks_(DEFAULT_MAX_TICKS),
-        max_events(DEFAULT_MAX_EVENTS) {}
+        max_events(DEFAULT_MAX_EVENTS),
+        adaptive_timeslice(true) {}
 
   void set_max_ticks(Ticks max_ticks) { max_ticks_ = max_ticks; }
   Ticks max_ticks() const { return max_ticks_; }
+  void set_adaptive_timeslice(bool adaptive) { adaptive_timeslice = adaptive; }
+  /**
+   * Return the number of ticks |t| may run before it's interrupted.
+   */
+  Ticks timeslice(Task* t) const;
+  /**
+   * Call when |t| was interrupted because its timeslice expired, to adapt
+   * its next timeslice.
+   */
+  void on_timeslice_expired(Task* t);
+
+  /**
+   * |t| is about to block in a FUTEX_WAIT on |addr|.
+   */
+  void on_futex_wait(Task* t, remote_ptr<int> addr);
+  /**
+   * |t|'s FUTEX_WAIT, if any, has returned.
+   */
+  void on_futex_wait_done(Task* t);
+  /**
+   * |t| woke |count| waiters on the futex at |addr|.
+   */
+  void on_futex_wake(Task* t, remote_ptr<int> addr, int count);
   void set_max_events(TraceFrame::Time max_events) {
     this->max_events = max_events;
   }
@@ -135,6 +193,12 @@ public:
    */
   void schedule_one_round_robin(Task* last_task);
 
+  /**
+   * Return true if |t| is the only task, so nothing else can run while
+   * |t| is blocked.
+   */
+  bool is_sole_task(Task* t) const;
+
   void on_create(Task* t);
   /**
    * De-register a thread. This function should be called when a thread exits.
@@ -164,6 +228,22 @@ private:
    */
   void remove_round_robin_task();
   Task* get_next_task_with_same_priority(Task* t);
+  /**
+   * Returns true if |t| can be scheduled now. Blocked tasks are only
+   * runnable once reap_blocked_tasks() has collected a state change for
+   * them.
+   */
+  bool is_task_runnable(Task* t, bool* by_waitpid);
+  /**
+   * Collect all pending tracee state changes with non-blocking waitpid(-1)
+   * calls, adding the tasks to |woken_tasks|.
+   */
+  void reap_blocked_tasks();
+  /**
+   * Return a woken futex waiter that is runnable now and would be a valid
+   * choice under strict priority scheduling, or null.
+   */
+  Task* get_runnable_futex_waiter(bool* by_waitpid);
 
   RecordSession& session;
 
@@ -186,8 +266,32 @@ private:
    */
   Task* current;
 
+  /**
+   * Tasks whose state change has been collected by reap_blocked_tasks()
+   * but which haven't been returned by get_next_thread() yet. Every
+   * runnability check of every task looks here.
+   */
+  std::unordered_set<Task*> woken_tasks;
+  /**
+   * True once reap_blocked_tasks() has run during the current scheduling
+   * decision.
+   */
+  bool reaped_this_round;
+
+  /**
+   * Tasks blocked in FUTEX_WAIT, per (address space, futex word), in the
+   * order they started waiting (the order the kernel wakes them in).
+   */
+  typedef std::pair<AddressSpace*, remote_ptr<int> > FutexKey;
+  std::map<FutexKey, std::deque<Task*> > futex_waiters;
+  /**
+   * Tasks woken by a FUTEX_WAKE that haven't been scheduled since.
+   */
+  TaskQueue futex_woken;
+
   Ticks max_ticks_;
   TraceFrame::Time max_events;
+  bool adaptive_timeslice;
 };
 
 #endif /* RR_REC_SCHED_H_ */
@@ -0,0 +1,261 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <sstream>
+
+#include "Command.h"
+#include "main.h"
+#include "RemoteTrace.h"
+#include "ScopedFd.h"
+#include "TraceStream.h"
+
+using namespace std;
+
+class ServeCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  ServeCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static ServeCommand singleton;
+};
+
+ServeCommand ServeCommand::singleton(
+    "serve",
+    " rr serve [OPTION]... [<trace_dir>]\n"
+    "  Export a trace over TCP, so `rr replay rr://<host>:<port>` on\n"
+    "  another machine can replay it without copying it first. Anyone who\n"
+    "  can connect can read the trace.\n"
+    "  -p, --port=<PORT>          listen on PORT (default: any free port)\n"
+    "  -a, --address=<ADDRESS>    listen on ADDRESS (default: 0.0.0.0)\n");
+
+struct ServeFlags {
+  int port;
+  string address;
+
+  ServeFlags() : port(0), address("0.0.0.0") {}
+};
+
+static bool parse_serve_arg(std::vector<std::string>& args,
+                            ServeFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'p', "port", HAS_PARAMETER },
+                                        { 'a', "address", HAS_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'p':
+      if (!opt.verify_valid_int(0, 65535)) {
+        return false;
+      }
+      flags.port = opt.int_value;
+      break;
+    case 'a':
+      flags.address = opt.value;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+static bool write_all(int fd, const void* data, size_t size) {
+  while (size > 0) {
+    ssize_t ret = write(fd, data, size);
+    if (ret <= 0) {
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data = static_cast<const uint8_t*>(data) + ret;
+    size -= ret;
+  }
+  return true;
+}
+
+static bool read_all(int fd, void* data, size_t size) {
+  while (size > 0) {
+    ssize_t ret = read(fd, data, size);
+    if (ret <= 0) {
+      if (ret < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data = static_cast<uint8_t*>(data) + ret;
+    size -= ret;
+  }
+  return true;
+}
+
+/**
+ * Clients may only name files inside the trace directory. Symlinks in it
+ * (e.g. into an object store) are followed, since the recording made them.
+ */
+static bool is_valid_name(const string& name) {
+  if (name.empty() || name[0] == '/') {
+    return false;
+  }
+  size_t start = 0;
+  while (start <= name.size()) {
+    size_t end = name.find('/', start);
+    if (end == string::npos) {
+      end = name.size();
+    }
+    if (name.compare(start, end - start, "..") == 0) {
+      return false;
+    }
+    start = end + 1;
+  }
+  return true;
+}
+
+/**
+ * Answer |client|'s requests until it hangs up.
+ */
+static void serve_client(const ScopedFd& client, const string& trace_dir,
+                         const string& id) {
+  while (true) {
+    RemoteTrace::Request req;
+    if (!read_all(client, &req, sizeof(req)) || req.name_len > PATH_MAX) {
+      return;
+    }
+    string name(req.name_len, '\0');
+    if (!read_all(client, &name[0], name.size())) {
+      return;
+    }
+
+    vector<uint8_t> payload;
+    int err = 0;
+    if (req.op == RemoteTrace::HELLO) {
+      payload.assign(id.begin(), id.end());
+    } else if (!is_valid_name(name)) {
+      err = EACCES;
+    } else {
+      string path = trace_dir + "/" + name;
+      ScopedFd fd(path.c_str(), O_RDONLY | O_CLOEXEC);
+      struct stat st;
+      if (!fd.is_open() || fstat(fd, &st)) {
+        err = errno;
+      } else if (!S_ISREG(st.st_mode)) {
+        err = EINVAL;
+      } else if (req.op == RemoteTrace::STAT) {
+        RemoteTrace::StatReply reply = { uint64_t(st.st_size), st.st_mode,
+                                         st.st_mtim.tv_sec,
+                                         st.st_mtim.tv_nsec };
+        payload.resize(sizeof(reply));
+        memcpy(payload.data(), &reply, sizeof(reply));
+      } else if (req.op == RemoteTrace::READ) {
+        payload.resize(min(req.length, RemoteTrace::MAX_READ));
+        ssize_t nread = pread(fd, payload.data(), payload.size(), req.offset);
+        if (nread < 0) {
+          err = errno;
+        } else {
+          payload.resize(nread);
+        }
+      } else {
+        return;
+      }
+    }
+
+    RemoteTrace::Response resp;
+    resp.result = err ? -int64_t(err) : int64_t(payload.size());
+    if (!write_all(client, &resp, sizeof(resp)) ||
+        (!err && !write_all(client, payload.data(), payload.size()))) {
+      return;
+    }
+  }
+}
+
+static int serve(const string& trace_dir, const ServeFlags& flags) {
+  TraceReader trace(trace_dir);
+  char real_dir[PATH_MAX];
+  struct stat dir_stat, version_stat;
+  if (!realpath(trace.dir().c_str(), real_dir) ||
+      stat(real_dir, &dir_stat) ||
+      stat((trace.dir() + "/version").c_str(), &version_stat)) {
+    fprintf(stderr, "Can't find trace %s\n", trace.dir().c_str());
+    return 1;
+  }
+  // Lets clients tell this trace's cached files from another's.
+  stringstream id;
+  id << real_dir << ':' << dir_stat.st_ino << ':'
+     << version_stat.st_mtim.tv_sec << '.' << version_stat.st_mtim.tv_nsec;
+
+  ScopedFd listen_fd(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(flags.port);
+  int reuseaddr = 1;
+  socklen_t len = sizeof(addr);
+  if (!listen_fd.is_open() ||
+      inet_pton(AF_INET, flags.address.c_str(), &addr.sin_addr) != 1 ||
+      setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuseaddr,
+                 sizeof(reuseaddr)) ||
+      ::bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+      listen(listen_fd, 16) ||
+      getsockname(listen_fd, (struct sockaddr*)&addr, &len)) {
+    fprintf(stderr, "Can't listen on %s:%d: %s\n", flags.address.c_str(),
+            flags.port, strerror(errno));
+    return 1;
+  }
+  fprintf(stdout, "Serving %s on port %d\n", real_dir, ntohs(addr.sin_port));
+  fflush(stdout);
+
+  // Each client gets its own process; don't leave zombies.
+  signal(SIGCHLD, SIG_IGN);
+  while (true) {
+    ScopedFd client(accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC));
+    if (!client.is_open()) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      fprintf(stderr, "accept failed: %s\n", strerror(errno));
+      return 1;
+    }
+    pid_t child = fork();
+    if (child == 0) {
+      listen_fd.close();
+      serve_client(client, real_dir, id.str());
+      _exit(0);
+    }
+    if (child < 0) {
+      fprintf(stderr, "Can't fork: %s\n", strerror(errno));
+    }
+  }
+}
+
+int ServeCommand::run(std::vector<std::string>& args) {
+  ServeFlags flags;
+  while (parse_serve_arg(args, flags)) {
+  }
+
+  string trace_dir;
+  if (!parse_optional_trace_dir(args, &trace_dir)) {
+    print_help(stderr);
+    return 1;
+  }
+
+  return serve(trace_dir, flags);
+}
@@ -4,15 +4,21 @@
 
 #include "Session.h"
 
+#include <inttypes.h>
+#include <string.h>
 #include <syscall.h>
 #include <sys/prctl.h>
+#include <time.h>
 
 #include <algorithm>
+#include <set>
 
 #include "AutoRemoteSyscalls.h"
 #include "EmuFs.h"
+#include "Flags.h"
 #include "kernel_metadata.h"
 #include "log.h"
+#include "MemoryAccounting.h"
 #include "task.h"
 #include "util.h"
 
@@ -29,7 +35,8 @@ struct Session::CloneCompletion {
 };
 
 Session::Session()
-    : next_task_serial_(1),
+    : current_phase_timer(nullptr),
+      next_task_serial_(1),
       tracees_consistent(false),
       visible_execution_(true) {
   LOG(debug) << "Session " << this << " created";
@@ -46,11 +53,126 @@ Session::~Session() {
 
 Session::Session(const Session& other) {
   statistics_ = other.statistics_;
+  current_phase_timer = nullptr;
   next_task_serial_ = other.next_task_serial_;
   tracees_consistent = other.tracees_consistent;
   visible_execution_ = other.visible_execution_;
 }
 
+static double now_sec() {
+  struct timespec tp;
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  return (double)tp.tv_sec + (double)tp.tv_nsec / 1e9;
+}
+
+Session::TimeHistogram::TimeHistogram() : count(0), total(0) {
+  memset(buckets, 0, sizeof(buckets));
+}
+
+void Session::TimeHistogram::add(double seconds) {
+  ++count;
+  total += seconds;
+  int bucket = 0;
+  for (double us = seconds * 1e6; us >= 2 && bucket < BUCKETS - 1; us /= 2) {
+    ++bucket;
+  }
+  ++buckets[bucket];
+}
+
+Session::PhaseTimer::PhaseTimer(Session& session, Phase phase)
+    : session(session),
+      parent(session.current_phase_timer),
+      phase(phase),
+      start(now_sec()),
+      nested(0) {
+  session.current_phase_timer = this;
+}
+
+Session::PhaseTimer::~PhaseTimer() {
+  double elapsed = now_sec() - start;
+  session.statistics_.phases[phase].add(elapsed - nested);
+  if (parent) {
+    parent->nested += elapsed;
+  }
+  session.current_phase_timer = parent;
+}
+
+static const char* phase_name(Session::Phase phase) {
+  switch (phase) {
+    case Session::PHASE_DECODE:
+      return "decode";
+    case Session::PHASE_EXECUTE:
+      return "execute";
+    case Session::PHASE_SINGLESTEP:
+      return "singlestep";
+    case Session::PHASE_RESTORE_MEMORY:
+      return "restore-memory";
+    case Session::PHASE_EMULATE:
+      return "emulate";
+    default:
+      return "???";
+  }
+}
+
+void Session::print_statistics(FILE* out) {
+  fprintf(out, "ticks %llu syscalls %llu bytes_written %llu "
+               "ptrace_stops %llu ptrace_calls %llu "
+               "ptrace_fallback_bytes %llu\n",
+          (unsigned long long)statistics_.ticks_processed,
+          (unsigned long long)statistics_.syscalls_performed,
+          (unsigned long long)statistics_.bytes_written,
+          (unsigned long long)statistics_.ptrace_stops,
+          (unsigned long long)statistics_.ptrace_calls,
+          (unsigned long long)statistics_.ptrace_fallback_bytes);
+  for (int i = 0; i < PHASE_COUNT; ++i) {
+    const TimeHistogram& h = statistics_.phases[i];
+    fprintf(out, "%-14s count %llu seconds %.6f\n", phase_name((Phase)i),
+            (unsigned long long)h.count, h.total);
+    for (int b = 0; b < TimeHistogram::BUCKETS; ++b) {
+      if (h.buckets[b]) {
+        bool last = b == TimeHistogram::BUCKETS - 1;
+        fprintf(out, "  %s%lluus: %llu\n", last ? ">=" : "<",
+                1ULL << (last ? b : b + 1),
+                (unsigned long long)h.buckets[b]);
+      }
+    }
+  }
+}
+
+/**
+ * Estimated heap bytes of each node of a std::map, beyond its value: the
+ * red-black tree's parent, child and color fields, and malloc overhead.
+ */
+static const size_t MAP_NODE_OVERHEAD = 4 * sizeof(void*) + 16;
+
+void Session::print_memory_usage(FILE* out) {
+  MemoryAccounting::print(out);
+
+  // Address spaces share their memory map until one of them changes it,
+  // so count each map once.
+  set<const AddressSpace::MemoryMap*> seen_maps;
+  uint64_t map_bytes = 0;
+  uint64_t checksum_bytes = 0;
+  for (AddressSpace* vm : vms()) {
+    const AddressSpace::MemoryMap& mem = vm->memmap();
+    if (seen_maps.insert(&mem).second) {
+      for (auto& kv : mem) {
+        map_bytes += sizeof(kv) + MAP_NODE_OVERHEAD;
+        if (kv.second.fsname.capacity() >= sizeof(string)) {
+          map_bytes += kv.second.fsname.capacity() + 1;
+        }
+      }
+    }
+    checksum_bytes += vm->page_checksums().size() *
+                      (sizeof(pair<remote_ptr<void>, uint32_t>) +
+                       MAP_NODE_OVERHEAD);
+  }
+  fprintf(out, "%-22s %14" PRIu64 " (this session)\n", "memory maps",
+          map_bytes);
+  fprintf(out, "%-22s %14" PRIu64 " (this session)\n", "page checksums",
+          checksum_bytes);
+}
+
 void Session::on_create(TaskGroup* tg) { task_group_map[tg->tguid()] = tg; }
 void Session::on_destroy(TaskGroup* tg) { task_group_map.erase(tg->tguid()); }
 
@@ -82,6 +204,7 @@ AddressSpace::shr_ptr Session::clone(Task* t, AddressSpace::shr_ptr vm) {
   AddressSpace::shr_ptr as(new AddressSpace(
       t, *vm, this == vm->session() ? 0 : vm->uid().exec_count()));
   as->session_ = this;
+  as->note_all_shared_mappings(true);
   vm_map[as->uid()] = as.get();
   return as;
 }
@@ -106,8 +229,8 @@ Task* Session::clone(Task* p, int flags, remote_ptr<void> stack,
 
 Task* Session::find_task(pid_t rec_tid) const {
   assert_fully_initialized();
-  auto it = tasks().find(rec_tid);
-  return tasks().end() != it ? it->second : nullptr;
+  auto it = task_index.find(rec_tid);
+  return task_index.end() != it ? it->second : nullptr;
 }
 
 Task* Session::find_task(const TaskUid& tuid) const {
@@ -154,9 +277,13 @@ void Session::on_destroy(AddressSpace* vm) {
 void Session::on_destroy(Task* t) {
   assert(task_map.count(t->rec_tid) == 1);
   task_map.erase(t->rec_tid);
+  task_index.erase(t->rec_tid);
 }
 
-void Session::on_create(Task* t) { task_map[t->rec_tid] = t; }
+void Session::on_create(Task* t) {
+  task_map[t->rec_tid] = t;
+  task_index[t->rec_tid] = t;
+}
 
 BreakStatus Session::diagnose_debugger_trap(Task* t, int stop_sig) {
   assert_fully_initialized();
@@ -325,14 +452,27 @@ void Session::copy_state_to(Session& dest, EmuFs& dest_emu_fs) {
 
     {
       AutoRemoteSyscalls remote(group.clone_leader);
+      vector<AutoRemoteSyscalls::BatchedSyscall> madvises;
       for (auto& kv : group.clone_leader->vm()->memmap()) {
         const Mapping& m = kv.first;
         const MappableResource& r = kv.second;
+        if (Flags::get().merge_checkpoint_pages &&
+            (m.flags & (MAP_ANONYMOUS | MAP_SHARED)) == MAP_ANONYMOUS) {
+          // Replaying writes recorded data into the original session's
+          // pages, breaking their COW sharing with this clone; KSM can
+          // share the ones that still end up identical.
+          madvises.push_back(AutoRemoteSyscalls::BatchedSyscall(
+              syscall_number_for_madvise(remote.arch()), m.start.as_int(),
+              m.num_bytes(), MADV_MERGEABLE));
+        }
         if (!r.is_shared_mmap_file()) {
           continue;
         }
         remap_shared_mmap(remote, dest_emu_fs, m, r);
       }
+      // Processes have many anonymous mappings, so advise them all with
+      // one resume of the clone.
+      remote.syscall_batch(madvises);
 
       for (auto t : group_leader->task_group()->task_set()) {
         if (group_leader == t) {
@@ -3,17 +3,21 @@
 #ifndef RR_SESSION_H_
 #define RR_SESSION_H_
 
+#include <stdio.h>
+
 #include <cassert>
 #include <map>
 #include <memory>
 #include <set>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "TaskishUid.h"
 #include "TraceStream.h"
 
 class AddressSpace;
+class FileId;
 class DiversionSession;
 class EmuFs;
 class RecordSession;
@@ -147,6 +151,11 @@ public:
   virtual void on_destroy(Task* t);
   void on_create(TaskGroup* tg);
   void on_destroy(TaskGroup* tg);
+  /**
+   * Called when an address space in this session starts (|mapped|) or
+   * stops mapping any part of the shared file |id|.
+   */
+  virtual void on_shared_mapping_change(const FileId& id, bool mapped) {}
 
   /** Return the set of Tasks being tracekd in this session. */
   const TaskMap& tasks() const {
@@ -170,12 +179,54 @@ public:
   bool visible_execution() const { return visible_execution_; }
   void set_visible_execution(bool visible) { visible_execution_ = visible; }
 
+  /**
+   * The parts of running a session whose wall-clock time is measured.
+   */
+  enum Phase {
+    // Reading and decoding trace frames.
+    PHASE_DECODE,
+    // Running tracees until their next ptrace-stop, other than singlesteps.
+    PHASE_EXECUTE,
+    PHASE_SINGLESTEP,
+    // Writing recorded data back into tracee memory.
+    PHASE_RESTORE_MEMORY,
+    // Emulating syscalls and signal delivery.
+    PHASE_EMULATE,
+    PHASE_COUNT
+  };
+  /**
+   * A log2 histogram of durations. Bucket i counts durations of at least
+   * 2^i and less than 2^(i+1) microseconds; bucket 0 also counts shorter
+   * ones and the last bucket also counts longer ones.
+   */
+  struct TimeHistogram {
+    enum {
+      BUCKETS = 24
+    };
+    TimeHistogram();
+    void add(double seconds);
+    uint64_t count;
+    double total;
+    uint64_t buckets[BUCKETS];
+  };
   struct Statistics {
     Statistics()
-        : bytes_written(0), ticks_processed(0), syscalls_performed(0) {}
+        : bytes_written(0),
+          ticks_processed(0),
+          syscalls_performed(0),
+          ptrace_stops(0),
+          ptrace_calls(0),
+          ptrace_fallback_bytes(0) {}
     uint64_t bytes_written;
     Ticks ticks_processed;
     uint32_t syscalls_performed;
+    uint64_t ptrace_stops;
+    // ptrace() requests made on tracees, including the resumes.
+    uint64_t ptrace_calls;
+    // Tracee memory read or written word-by-word with ptrace because no
+    // mem fd was open.
+    uint64_t ptrace_fallback_bytes;
+    TimeHistogram phases[PHASE_COUNT];
   };
   void accumulate_bytes_written(uint64_t bytes_written) {
     statistics_.bytes_written += bytes_written;
@@ -184,7 +235,40 @@ public:
   void accumulate_ticks_processed(Ticks ticks) {
     statistics_.ticks_processed += ticks;
   }
+  void accumulate_ptrace_stop() { statistics_.ptrace_stops += 1; }
+  void accumulate_ptrace_call() { statistics_.ptrace_calls += 1; }
+  void accumulate_ptrace_fallback_bytes(uint64_t bytes) {
+    statistics_.ptrace_fallback_bytes += bytes;
+  }
   Statistics statistics() { return statistics_; }
+  /**
+   * Print statistics() to |out|, with a histogram for each phase.
+   */
+  void print_statistics(FILE* out);
+  /**
+   * Print rr's memory use by subsystem (see MemoryAccounting) to |out|,
+   * followed by the memory maps and page checksum caches of this session's
+   * address spaces, which are measured now.
+   */
+  void print_memory_usage(FILE* out);
+
+  /**
+   * Charges the wall-clock time between its construction and destruction
+   * to |phase| of |session|'s statistics, minus the time charged by
+   * PhaseTimers nested inside it.
+   */
+  class PhaseTimer {
+  public:
+    PhaseTimer(Session& session, Phase phase);
+    ~PhaseTimer();
+
+  private:
+    Session& session;
+    PhaseTimer* parent;
+    Phase phase;
+    double start;
+    double nested;
+  };
 
 protected:
   Session();
@@ -208,6 +292,10 @@ protected:
 
   AddressSpaceMap vm_map;
   TaskMap task_map;
+  // The same tasks as |task_map|, for find_task(). Recordings of programs
+  // with thousands of threads look tasks up on every event, so that's a
+  // hash lookup; |task_map| keeps iteration in tid order.
+  std::unordered_map<pid_t, Task*> task_index;
   TaskGroupMap task_group_map;
 
   // If non-null, data required to finish initializing the tasks of this
@@ -215,6 +303,8 @@ protected:
   std::unique_ptr<CloneCompletion> clone_completion;
 
   Statistics statistics_;
+  // The innermost running PhaseTimer, if any.
+  PhaseTimer* current_phase_timer;
 
   uint32_t next_task_serial_;
 
@@ -2,16 +2,23 @@
 
 #include "StdioMonitor.h"
 
+#include <inttypes.h>
+
 #include "Flags.h"
 #include "log.h"
 #include "ReplaySession.h"
 #include "Session.h"
+#include "StdioOutput.h"
 #include "task.h"
 
 Switchable StdioMonitor::will_write(Task* t) {
-  if (Flags::get().mark_stdio && t->session().visible_execution()) {
+  if (t->session().is_replaying()) {
+    // The marker is written along with the data, by did_write().
+    write_times[t->tid] = t->trace_time();
+  } else if (Flags::get().mark_stdio && t->session().visible_execution()) {
     char buf[256];
-    snprintf(buf, sizeof(buf) - 1, "[rr %d %d]", t->tgid(), t->trace_time());
+    snprintf(buf, sizeof(buf) - 1, "[rr %d %" PRIu64 "]", t->tgid(),
+             t->trace_time());
     ssize_t len = strlen(buf);
     if (write(original_fd, buf, len) != len) {
       ASSERT(t, false) << "Couldn't write to " << original_fd;
@@ -22,14 +29,20 @@ Switchable StdioMonitor::will_write(Task* t) {
 }
 
 void StdioMonitor::did_write(Task* t, const std::vector<Range>& ranges) {
-  if (t->session().is_replaying() && t->replay_session().redirect_stdio() &&
-      t->session().visible_execution()) {
-    for (auto& r : ranges) {
-      auto bytes = t->read_mem(r.data.cast<uint8_t>(), r.length);
-      if (bytes.size() !=
-          (size_t)write(original_fd, bytes.data(), bytes.size())) {
-        ASSERT(t, false) << "Couldn't write to " << original_fd;
-      }
-    }
+  if (!t->session().is_replaying() || !t->session().visible_execution()) {
+    return;
+  }
+  auto it = write_times.find(t->tid);
+  TraceFrame::Time time =
+      it != write_times.end() ? it->second : t->trace_time();
+  auto& output = StdioOutput::get();
+  if (!t->replay_session().redirect_stdio()) {
+    // Only the marker, if any.
+    output.write(original_fd, t->tgid(), time, nullptr, 0);
+    return;
+  }
+  for (auto& r : ranges) {
+    auto bytes = t->read_mem(r.data.cast<uint8_t>(), r.length);
+    output.write(original_fd, t->tgid(), time, bytes.data(), bytes.size());
   }
 }
@@ -3,7 +3,10 @@
 #ifndef RR_STDIO_MONITOR_H_
 #define RR_STDIO_MONITOR_H_
 
+#include <unordered_map>
+
 #include "FileMonitor.h"
+#include "TraceFrame.h"
 
 /**
  * A FileMonitor to track writes to rr's stdout/stderr fds.
@@ -29,17 +32,20 @@ public:
    *
    * Also, if stdio-marking is enabled, prepend the stdio write with
    * "[rr <pid> <global-time>]".  This allows users to more easily correlate
-   * stdio with trace event numbers.
+   * stdio with trace event numbers. During replay the marker is written
+   * with the echoed data by StdioOutput, so it can be batched.
    */
   virtual Switchable will_write(Task* t);
 
   /**
-   * During replay, echo writes to stdout/stderr.
+   * During replay, echo writes to stdout/stderr through StdioOutput.
    */
   virtual void did_write(Task* t, const std::vector<Range>& ranges);
 
 private:
   int original_fd;
+  // The event each task's current write started at, for its marker.
+  std::unordered_map<pid_t, TraceFrame::Time> write_times;
 };
 
 #endif /* RR_STDIO_MONITOR_H_ */
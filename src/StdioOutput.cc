@@ -0,0 +1,142 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "StdioOutput.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <string>
+
+#include "Flags.h"
+#include "log.h"
+
+using namespace std;
+
+StdioOutput& StdioOutput::get() {
+  static StdioOutput singleton;
+  return singleton;
+}
+
+static void write_all(int fd, const void* data, size_t len) {
+  const char* p = static_cast<const char*>(data);
+  while (len > 0) {
+    ssize_t ret = ::write(fd, p, len);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      FATAL() << "Couldn't write to " << fd;
+    }
+    p += ret;
+    len -= ret;
+  }
+}
+
+static void append_marker(string& out, pid_t tgid, TraceFrame::Time time) {
+  char buf[256];
+  snprintf(buf, sizeof(buf) - 1, "[rr %d %" PRIu64 "]", tgid, time);
+  out += buf;
+}
+
+void StdioOutput::set_batching(bool batch) {
+  if (!batch) {
+    flush();
+  }
+  batching = batch;
+}
+
+void StdioOutput::set_output_file(const string& path) {
+  flush();
+  output_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                   0666);
+  if (output_fd < 0) {
+    FATAL() << "Can't open " << path;
+  }
+  batching = true;
+}
+
+void StdioOutput::set_tail(size_t bytes) {
+  tail_bytes = bytes;
+  batching = true;
+  trim();
+}
+
+void StdioOutput::write(int fd, pid_t tgid, TraceFrame::Time time,
+                        const uint8_t* data, size_t len) {
+  if (!batching) {
+    if (Flags::get().mark_stdio) {
+      string marker;
+      append_marker(marker, tgid, time);
+      write_all(fd, marker.data(), marker.size());
+    }
+    write_all(fd, data, len);
+    return;
+  }
+
+  IndexEntry entry = { output_fd >= 0 ? output_fd : fd, tgid, time,
+                       buffer.size(), len };
+  index.push_back(entry);
+  buffer.insert(buffer.end(), data, data + len);
+  buffered_bytes += len;
+  if (tail_bytes) {
+    trim();
+  } else if (buffered_bytes >= FLUSH_BYTES) {
+    flush();
+  }
+}
+
+void StdioOutput::trim() {
+  while (buffered_bytes > tail_bytes) {
+    auto& e = index.front();
+    size_t excess = buffered_bytes - tail_bytes;
+    if (e.len <= excess) {
+      buffered_bytes -= e.len;
+      dropped_bytes += e.len;
+      index.pop_front();
+    } else {
+      e.offset += excess;
+      e.len -= excess;
+      buffered_bytes -= excess;
+      dropped_bytes += excess;
+    }
+  }
+  if (index.empty()) {
+    buffer.clear();
+    return;
+  }
+  // Discard the dropped data once it's most of the buffer.
+  size_t start = index.front().offset;
+  if (start >= FLUSH_BYTES && start >= buffer.size() / 2) {
+    buffer.erase(buffer.begin(), buffer.begin() + start);
+    for (auto& e : index) {
+      e.offset -= start;
+    }
+  }
+}
+
+void StdioOutput::flush() {
+  if (dropped_bytes) {
+    fprintf(stderr, "rr: %zu bytes of tracee output omitted\n",
+            dropped_bytes);
+    dropped_bytes = 0;
+  }
+  bool mark = Flags::get().mark_stdio;
+  string run;
+  for (size_t i = 0; i < index.size(); ++i) {
+    auto& e = index[i];
+    if (mark) {
+      append_marker(run, e.tgid, e.time);
+    }
+    run.append(reinterpret_cast<const char*>(buffer.data()) + e.offset, e.len);
+    if (i + 1 == index.size() || index[i + 1].fd != e.fd) {
+      write_all(e.fd, run.data(), run.size());
+      run.clear();
+    }
+  }
+  index.clear();
+  buffer.clear();
+  buffered_bytes = 0;
+}
@@ -0,0 +1,96 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_STDIO_OUTPUT_H_
+#define RR_STDIO_OUTPUT_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "TraceFrame.h"
+
+/**
+ * Where replay echoes tracee writes to stdout/stderr.
+ *
+ * By default each write is echoed as it's replayed, preceded by its
+ * "[rr <pid> <global-time>]" marker when stdio-marking is enabled. In
+ * batching mode, writes are appended to a buffer with an index of which
+ * task wrote which bytes to which fd when. The markers are generated from
+ * the index when the buffer is flushed, with each run of writes to one fd
+ * written at once. The buffer is flushed when it fills up, when the
+ * debugger is told the tracee stopped, and when replay finishes.
+ *
+ * The output can also be sent to a file instead of rr's stdout/stderr,
+ * or trimmed to just its last few bytes, so that fast-forwarding through
+ * a chatty program only shows what it printed before the debugger
+ * stopped.
+ *
+ * This is a singleton because replay clones sessions for checkpoints and
+ * diversions, but the user sees one stream of output.
+ */
+class StdioOutput {
+public:
+  static StdioOutput& get();
+
+  void set_batching(bool batch);
+
+  /**
+   * Write all output to the file |path|, in batches, instead of to the
+   * fds it was written to.
+   */
+  void set_output_file(const std::string& path);
+
+  /**
+   * Only write the last |bytes| bytes of output before each flush; older
+   * output is dropped. Implies batching.
+   */
+  void set_tail(size_t bytes);
+
+  /**
+   * Echo |len| bytes at |data| that |tgid| wrote to |fd| in the event at
+   * |time|.
+   */
+  void write(int fd, pid_t tgid, TraceFrame::Time time, const uint8_t* data,
+             size_t len);
+
+  /**
+   * Write everything buffered so far.
+   */
+  void flush();
+
+private:
+  StdioOutput()
+      : batching(false), output_fd(-1), tail_bytes(0), buffered_bytes(0),
+        dropped_bytes(0) {}
+  ~StdioOutput() { flush(); }
+
+  struct IndexEntry {
+    int fd;
+    pid_t tgid;
+    TraceFrame::Time time;
+    // Offset of the write's data in |buffer|.
+    size_t offset;
+    size_t len;
+  };
+  static const size_t FLUSH_BYTES = 256 * 1024;
+
+  // Drop the oldest output until only |tail_bytes| remain.
+  void trim();
+
+  bool batching;
+  // If >= 0, where all output goes.
+  int output_fd;
+  // If nonzero, how much output to keep.
+  size_t tail_bytes;
+  std::vector<uint8_t> buffer;
+  std::deque<IndexEntry> index;
+  // Total |len| of |index|'s entries.
+  size_t buffered_bytes;
+  // Output dropped by trim() since the last flush.
+  size_t dropped_bytes;
+};
+
+#endif /* RR_STDIO_OUTPUT_H_ */
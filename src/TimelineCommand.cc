@@ -0,0 +1,246 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <map>
+
+#include "Command.h"
+#include "Event.h"
+#include "kernel_metadata.h"
+#include "main.h"
+#include "TraceStream.h"
+
+using namespace std;
+
+class TimelineCommand : public Command {
+public:
+  virtual int run(std::vector<std::string>& args);
+
+protected:
+  TimelineCommand(const char* name, const char* help) : Command(name, help) {}
+
+  static TimelineCommand singleton;
+};
+
+TimelineCommand TimelineCommand::singleton(
+    "timeline",
+    " rr timeline [OPTION]... [<trace_dir>]\n"
+    "  Convert the trace's events to the Chrome trace-event JSON format, for\n"
+    "  chrome://tracing or ui.perfetto.dev. Each thread gets a track with\n"
+    "  the stretches it ran, its trapped syscalls (from entry to exit, so\n"
+    "  time spent blocked shows up as the syscall's length), and instants for\n"
+    "  signals, preemptions, deschedules and syscallbuf flushes. Threads ran\n"
+    "  one at a time while recording, so the tracks never overlap.\n"
+    "  Timestamps are ticks, scaled so the whole trace lasts as long as the\n"
+    "  recording did; that is only an approximation, since threads don't\n"
+    "  retire ticks at a constant rate.\n"
+    "  -o, --output=<FILE>        write the timeline to FILE instead of stdout\n");
+
+struct TimelineFlags {
+  string output;
+};
+
+/**
+ * Used for traces whose metadata doesn't record how long recording took.
+ */
+static const double NS_PER_TICK_GUESS = 1.0;
+
+static bool parse_timeline_arg(std::vector<std::string>& args,
+                               TimelineFlags& flags) {
+  if (parse_global_option(args)) {
+    return true;
+  }
+
+  static const OptionSpec options[] = { { 'o', "output", HAS_PARAMETER } };
+  ParsedOption opt;
+  if (!Command::parse_option(args, options, &opt)) {
+    return false;
+  }
+
+  switch (opt.short_name) {
+    case 'o':
+      flags.output = opt.value;
+      break;
+    default:
+      assert(0 && "Unknown option");
+  }
+  return true;
+}
+
+/**
+ * Write |s| as a JSON string literal.
+ */
+static void print_json_string(const string& s, FILE* out) {
+  fputc('"', out);
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if ((unsigned char)c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+/**
+ * Emit metadata naming each process after the program it exec'd, and
+ * return the pid of each tid, as trace viewers group threads by process.
+ */
+static map<pid_t, pid_t> print_process_names(TraceReader& trace, FILE* out) {
+  map<pid_t, pid_t> tid_to_pid;
+  while (trace.good()) {
+    TraceTaskEvent e = trace.read_task_event();
+    if (e.is_fork() || tid_to_pid.empty()) {
+      tid_to_pid[e.tid()] = e.tid();
+    } else if (e.type() == TraceTaskEvent::CLONE) {
+      tid_to_pid[e.tid()] = tid_to_pid[e.parent_tid()];
+    }
+    if (e.type() == TraceTaskEvent::EXEC) {
+      const string& name = e.file_name();
+      size_t slash = name.rfind('/');
+      fprintf(out, "{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+                   "\"args\":{\"name\":",
+              tid_to_pid[e.tid()]);
+      print_json_string(slash == string::npos ? name : name.substr(slash + 1),
+                        out);
+      fprintf(out, "}},\n");
+    }
+  }
+  return tid_to_pid;
+}
+
+/**
+ * Return the total ticks retired by all threads, which is how long the
+ * timeline is in ticks.
+ */
+static Ticks total_ticks(TraceReader trace) {
+  map<pid_t, Ticks> last_ticks;
+  Ticks total = 0;
+  while (!trace.at_end()) {
+    auto frame = trace.read_frame();
+    Ticks& last = last_ticks[frame.tid()];
+    total += frame.ticks() - last;
+    last = frame.ticks();
+  }
+  return total;
+}
+
+static void timeline(const string& trace_dir, FILE* out) {
+  TraceReader trace(trace_dir);
+  // Only the EVENTS and TASKS substreams are read; the raw data, which is
+  // most of a large trace, is never decompressed.
+  Ticks ticks = total_ticks(trace);
+  TraceMetadata metadata;
+  double us_per_tick = NS_PER_TICK_GUESS / 1000;
+  if (trace.read_metadata(&metadata) && ticks > 0) {
+    us_per_tick = metadata.duration * 1e6 / ticks;
+  }
+
+  fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  map<pid_t, pid_t> tid_to_pid = print_process_names(trace, out);
+
+  map<pid_t, Ticks> last_ticks;
+  // Threads with a trapped syscall we haven't seen the exit of.
+  map<pid_t, bool> in_syscall;
+  // Ticks retired by all threads so far.
+  Ticks now = 0;
+  while (!trace.at_end()) {
+    auto frame = trace.read_frame();
+    pid_t tid = frame.tid();
+    pid_t pid = tid_to_pid.count(tid) ? tid_to_pid[tid] : tid;
+    Ticks& last = last_ticks[tid];
+    Ticks ran = frame.ticks() - last;
+    last = frame.ticks();
+    if (ran > 0) {
+      fprintf(out, "{\"ph\":\"X\",\"name\":\"running\",\"pid\":%d,\"tid\":%d,"
+                   "\"ts\":%.3f,\"dur\":%.3f},\n",
+              pid, tid, now * us_per_tick, ran * us_per_tick);
+      now += ran;
+    }
+    double ts = now * us_per_tick;
+
+    auto ev = frame.event();
+    string instant;
+    switch (ev.type) {
+      case EV_SYSCALL: {
+        bool& open = in_syscall[tid];
+        if (open) {
+          // Both an entry that was interrupted and never exited, and the
+          // exit that ends a syscall, close the open slice.
+          fprintf(out, "{\"ph\":\"E\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f},\n",
+                  pid, tid, ts);
+          open = false;
+        }
+        if (ev.state == SYSCALL_ENTRY) {
+          fprintf(out, "{\"ph\":\"B\",\"name\":\"%s\",\"cat\":\"syscall\","
+                       "\"pid\":%d,\"tid\":%d,\"ts\":%.3f},\n",
+                  syscall_name(ev.data, ev.arch()).c_str(), pid, tid, ts);
+          open = true;
+        }
+        break;
+      }
+      case EV_SIGNAL:
+      case EV_SIGNAL_DELIVERY:
+        instant = string(Event(ev).type_name()) + " " +
+                  signal_name(Event(ev).Signal().siginfo.si_signo);
+        break;
+      case EV_SCHED:
+      case EV_DESCHED:
+      case EV_SYSCALLBUF_FLUSH:
+        instant = Event(ev).type_name();
+        break;
+      default:
+        break;
+    }
+    if (!instant.empty()) {
+      fprintf(out, "{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"pid\":%d,"
+                   "\"tid\":%d,\"ts\":%.3f},\n",
+              instant.c_str(), pid, tid, ts);
+    }
+  }
+
+  double end = now * us_per_tick;
+  for (auto& it : in_syscall) {
+    if (it.second) {
+      pid_t pid = tid_to_pid.count(it.first) ? tid_to_pid[it.first] : it.first;
+      fprintf(out, "{\"ph\":\"E\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f},\n", pid,
+              it.first, end);
+    }
+  }
+  // Every event above ends with a comma, so end with one that doesn't.
+  fprintf(out, "{\"ph\":\"i\",\"s\":\"g\",\"name\":\"end of trace\","
+               "\"pid\":0,\"tid\":0,\"ts\":%.3f}\n]}\n",
+          end);
+}
+
+int TimelineCommand::run(std::vector<std::string>& args) {
+  TimelineFlags flags;
+  while (parse_timeline_arg(args, flags)) {
+  }
+
+  string trace_dir;
+  if (!parse_optional_trace_dir(args, &trace_dir)) {
+    print_help(stderr);
+    return 1;
+  }
+
+  FILE* out = stdout;
+  if (!flags.output.empty()) {
+    out = fopen(flags.output.c_str(), "w");
+    if (!out) {
+      fprintf(stderr, "Can't open %s: %s\n", flags.output.c_str(),
+              strerror(errno));
+      return 1;
+    }
+  }
+  timeline(trace_dir, out);
+  if (out != stdout) {
+    fclose(out);
+  }
+  return 0;
+}
@@ -24,7 +24,7 @@ void TraceFrame::dump(FILE* out) const {
   out = out ? out : stdout;
 
   fprintf(out,
-          "{\n  global_time:%u, event:`%s' (state:%d), tid:%d, ticks:%" PRId64,
+          "{\n  global_time:%" PRIu64 ", event:`%s' (state:%d), tid:%d, ticks:%" PRId64,
           time(), Event(event()).str().c_str(), event().state, tid(), ticks());
   if (!event().has_exec_info) {
     fprintf(out, "\n");
@@ -40,13 +40,16 @@ void TraceFrame::dump(FILE* out) const {
   } else {
     fprintf(out, "\n  ticks:%" PRId64 "\n", ticks());
   }
+  if (has_fingerprint()) {
+    fprintf(out, "  fingerprint:0x%08x\n", fingerprint());
+  }
   regs().print_register_file_for_trace(out);
 }
 
 void TraceFrame::dump_raw(FILE* out) const {
   out = out ? out : stdout;
 
-  fprintf(out, " %d %d %d %" PRId64, time(), tid(), event().encoded, ticks());
+  fprintf(out, " %" PRIu64 " %d %d %" PRId64, time(), tid(), event().encoded, ticks());
   if (!event().has_exec_info) {
     fprintf(out, "\n");
     return;
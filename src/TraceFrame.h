@@ -26,7 +26,7 @@ class TraceWriter;
  */
 class TraceFrame {
 public:
-  typedef uint32_t Time;
+  typedef uint64_t Time;
 
   TraceFrame(Time global_time, pid_t tid, EncodedEvent event,
              Ticks tick_count) {
@@ -34,12 +34,16 @@ public:
     basic_info.tid = tid;
     basic_info.ev = event;
     basic_info.ticks = tick_count;
+    has_fingerprint_ = false;
+    fingerprint_ = 0;
   }
   TraceFrame() {
     basic_info.global_time = 0;
     basic_info.tid = 0;
     basic_info.ev.encoded = 0;
     basic_info.ticks = 0;
+    has_fingerprint_ = false;
+    fingerprint_ = 0;
   }
 
   void set_exec_info(const Registers& regs,
@@ -54,6 +58,17 @@ public:
   const Registers& regs() const { return exec_info.recorded_regs; }
   const ExtraRegisters& extra_regs() const { return recorded_extra_regs; }
 
+  /**
+   * A cheap fingerprint of the tracee's memory at this event, which replay
+   * checks to catch divergence early. See memory_fingerprint().
+   */
+  void set_fingerprint(uint32_t fingerprint) {
+    has_fingerprint_ = true;
+    fingerprint_ = fingerprint;
+  }
+  bool has_fingerprint() const { return has_fingerprint_; }
+  uint32_t fingerprint() const { return fingerprint_; }
+
   /**
    * Log a human-readable representation of this to |out|
    * (defaulting to stdout), including a newline character.
@@ -87,6 +102,9 @@ private:
   // Only used when has_exec_info, but variable length (and usually not
   // present) so we don't want to stuff it into exec_info
   ExtraRegisters recorded_extra_regs;
+
+  bool has_fingerprint_;
+  uint32_t fingerprint_;
 };
 
 #endif /* RR_TRACE_FRAME_H_ */
@@ -43,7 +43,7 @@ public:
   remote_ptr<void> end() const { return end_; }
   uint64_t offset_pages() const { return file_offset_pages; }
 
-  size_t size() {
+  size_t size() const {
     intptr_t s = end() - start();
     assert(s >= 0);
     return s;
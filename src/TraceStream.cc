@@ -4,14 +4,23 @@
 
 #include "TraceStream.h"
 
+#include <fcntl.h>
 #include <inttypes.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <sysexits.h>
 
+#include <algorithm>
 #include <fstream>
 #include <string>
 #include <sstream>
 
+#include "Flags.h"
 #include "log.h"
+#include "RemoteTrace.h"
+#include "ScopedFd.h"
 #include "util.h"
 
 using namespace std;
@@ -25,26 +34,107 @@ using namespace std;
 // MUST increment this version number.  Otherwise users' old traces
 // will become unreplayable and they won't know why.
 //
-#define TRACE_VERSION 23
+#define TRACE_VERSION 36
+// Oldest trace version we can still read. Version 23 differs from 24 only
+// in that blocks carry no codec tag, and an untagged block is zlib.
+// Version 25 added chunk references to raw-data headers. Version 26
+// delta-encodes trace frames. Version 27 omits XSAVE components that are
+// in their initial state. Version 28 adds delta-encoded raw-data records
+// for signal frames. Version 29 records scratch memory once per address
+// space. Version 30 adds gathered raw-data records. Version 31 adds
+// snapshots of mapped files. Version 32 adds raw-data records that refer
+// to file contents. Version 33 widens event times to 64 bits, stored as
+// varints in raw-data headers. Version 34 stores repeated signal frames as
+// runs of bytes patched into an earlier frame instead of XOR deltas.
+// Version 35 adds memory fingerprints to syscall-exit frames. Version 36
+// records only the ready entries of poll() results.
+#define TRACE_VERSION_MIN_COMPATIBLE 23
+#define TRACE_VERSION_CHUNKED_RAW_DATA 25
+#define TRACE_VERSION_DELTA_FRAMES 26
+#define TRACE_VERSION_XSAVE_COMPONENTS 27
+#define TRACE_VERSION_SIGFRAME_DELTAS 28
+#define TRACE_VERSION_SHARED_SCRATCH 29
+#define TRACE_VERSION_GATHERED_RAW_DATA 30
+#define TRACE_VERSION_FILE_RAW_DATA 32
+#define TRACE_VERSION_WIDE_TIME 33
+#define TRACE_VERSION_SIGFRAME_PATCHES 34
+#define TRACE_VERSION_COMPACT_POLL 36
 
+const size_t TraceStream::RAW_DATA_CHUNK_SIZE;
+const size_t TraceStream::RAW_DATA_PIECE_SIZE;
+const uint64_t TraceStream::CHUNK_INLINE;
+const uint32_t TraceStream::RAW_DATA_DELTA;
+const uint32_t TraceStream::RAW_DATA_GATHER;
+const uint32_t TraceStream::RAW_DATA_FILE;
+const uint32_t TraceStream::RAW_DATA_PATCH;
+
+/**
+ * Per-substream compression policy. EVENTS and the other metadata streams
+ * are small and read in lockstep with replay, so they get small blocks and
+ * a single thread to keep memory use and close() latency down. RAW_DATA is
+ * bulk tracee data and gets large blocks and as many threads as we can
+ * spare.
+ */
 struct SubstreamData {
   const char* name;
+  // Size of each independently compressed block.
   size_t block_size;
+  // Number of compression threads. 0 means one per spare CPU, up to
+  // MAX_AUTO_COMPRESSION_THREADS.
   int threads;
+  // Falls back to zlib if rr was built without this codec.
+  CompressedWriter::Codec codec;
+  // Codec-specific level; 0 means the codec's default.
+  int level;
 };
 
+static const int MAX_AUTO_COMPRESSION_THREADS = 8;
+
 static const SubstreamData substreams[TraceStream::SUBSTREAM_COUNT] = {
-  { "events", 1024 * 1024, 1 },
-  { "data_header", 1024 * 1024, 1 },
-  { "data", 8 * 1024 * 1024, 3 },
-  { "mmaps", 64 * 1024, 1 },
-  { "tasks", 64 * 1024, 1 }
+  { "events", 256 * 1024, 1, CompressedWriter::ZLIB, 0 },
+  { "data_header", 256 * 1024, 1, CompressedWriter::ZLIB, 0 },
+  // Bulk tracee data dominates compression time during recording, so
+  // favor throughput over ratio.
+  { "data", 8 * 1024 * 1024, 0, CompressedWriter::LZ4, 0 },
+  { "mmaps", 64 * 1024, 1, CompressedWriter::ZLIB, 0 },
+  { "tasks", 64 * 1024, 1, CompressedWriter::ZLIB, 0 }
 };
 
 static const SubstreamData& substream(TraceStream::Substream s) {
   return substreams[s];
 }
 
+static int compression_threads(TraceStream::Substream s) {
+  int threads = substream(s).threads;
+  if (threads > 0) {
+    return threads;
+  }
+  // Tracees are normally bound to a single CPU, so leave one for them.
+  return max(1, min(get_num_cpus() - 1, MAX_AUTO_COMPRESSION_THREADS));
+}
+
+/*static*/ const char* TraceStream::substream_name(Substream s) {
+  return substream(s).name;
+}
+
+/*static*/ size_t TraceStream::substream_block_size(Substream s) {
+  return substream(s).block_size;
+}
+
+/*static*/ int TraceStream::substream_compression_threads(Substream s) {
+  return compression_threads(s);
+}
+
+/*static*/ CompressedWriter::Codec TraceStream::substream_codec(Substream s) {
+  CompressedWriter::Codec codec = substream(s).codec;
+  return CompressedWriter::codec_available(codec) ? codec
+                                                  : CompressedWriter::ZLIB;
+}
+
+/*static*/ int TraceStream::substream_level(Substream s) {
+  return substream(s).level;
+}
+
 static TraceStream::Substream operator++(TraceStream::Substream& s) {
   s = (TraceStream::Substream)(s + 1);
   return s;
@@ -99,61 +189,426 @@ bool TraceWriter::good() const {
   return true;
 }
 
+uint64_t TraceWriter::compression_wait_count() const {
+  uint64_t count = 0;
+  for (auto& w : writers) {
+    count += w->wait_count();
+  }
+  return count;
+}
+
+double TraceWriter::compression_wait_time() const {
+  double time = 0;
+  for (auto& w : writers) {
+    time += w->wait_time();
+  }
+  return time;
+}
+
+void TraceWriter::print_compression_stats(FILE* out) const {
+  static const char* const wait_buckets[] = { "<10us",  "<100us", "<1ms",
+                                              "<10ms",  "<100ms", ">=100ms" };
+  fprintf(out, "  %-12s %6s %10s %10s %6s %9s %9s %5s\n", "file", "thread",
+          "in MB", "out MB", "ratio", "seconds", "MB/s", "level");
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    auto& w = writer(s);
+    auto stats = w.thread_stats();
+    for (size_t i = 0; i < stats.size(); ++i) {
+      auto& st = stats[i];
+      if (!st.blocks) {
+        continue;
+      }
+      double in_mb = st.uncompressed_bytes / 1e6;
+      double out_mb = st.compressed_bytes / 1e6;
+      fprintf(out, "  %-12s %6zu %10.1f %10.1f %6.2f %9.3f %9.1f %5d\n",
+              substream(s).name, i, in_mb, out_mb,
+              in_mb / max(out_mb, 1e-9), st.seconds,
+              in_mb / max(st.seconds, 1e-9), w.current_level());
+    }
+    if (!w.wait_count()) {
+      continue;
+    }
+    fprintf(out, "  %-12s waited %llu times, %.6fs; at most %.1f MB "
+                 "uncompressed\n   ",
+            substream(s).name, (unsigned long long)w.wait_count(),
+            w.wait_time(), w.max_bytes_in_flight() / 1e6);
+    for (int b = 0; b < CompressedWriter::WAIT_HISTOGRAM_BUCKETS; ++b) {
+      fprintf(out, " %s: %llu", wait_buckets[b],
+              (unsigned long long)w.wait_histogram()[b]);
+    }
+    fprintf(out, "\n");
+  }
+}
+
+void TraceWriter::set_adaptive_compression(bool adaptive) {
+  for (auto& w : writers) {
+    w->set_adaptive_level(adaptive);
+  }
+}
+
+bool TraceReader::scratch_per_address_space() const {
+  return trace_version >= TRACE_VERSION_SHARED_SCRATCH;
+}
+
+bool TraceReader::compact_poll_results() const {
+  return trace_version >= TRACE_VERSION_COMPACT_POLL;
+}
+
 bool TraceReader::good() const {
   for (auto& r : readers) {
-    if (!r->good()) {
+    if (r && !r->good()) {
       return false;
     }
   }
   return true;
 }
 
+bool TraceWriter::index_time(Substream s, TraceFrame::Time time,
+                             uint64_t data_offset) {
+  uint64_t offset = writer(s).uncompressed_offset();
+  size_t block_size = substream(s).block_size;
+  auto& index = time_indexes[s];
+  if (index.empty() || index.back().offset / block_size != offset / block_size) {
+    TimeIndexEntry entry = { time, offset, data_offset };
+    index.push_back(entry);
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Frames are written as a flags byte, then varints for the global-time
+ * delta, tid, encoded event and zigzagged tick delta. The time and tick
+ * deltas are against the previous frame and the same tid's previous frame.
+ * If the event has exec info, the exec info and extra registers follow
+ * XORed against the tid's last frame that had them; see put_xor_delta().
+ * Only the XSAVE components in use are written; see
+ * xsave_recorded_ranges().
+ * A key frame is encoded against nothing, as if it were the first frame in
+ * the trace. If the frame has a memory fingerprint, it comes last, as a
+ * varint.
+ */
+enum FrameFlags {
+  FRAME_KEY = 1,
+  FRAME_FINGERPRINT = 2
+};
+
+static void put_varint(vector<uint8_t>& out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back((uint8_t)v | 0x80);
+    v >>= 7;
+  }
+  out.push_back((uint8_t)v);
+}
+
+static uint64_t get_varint(CompressedReader& in) {
+  uint64_t v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    uint8_t byte;
+    if (!in.read(&byte, 1)) {
+      FATAL() << "Truncated trace frame";
+    }
+    v |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  return v;
+}
+
+/**
+ * Write |time| at the start of a raw-data header.
+ */
+static void put_time(CompressedWriter& out, TraceFrame::Time time) {
+  uint8_t buf[10];
+  size_t len = 0;
+  while (time >= 0x80) {
+    buf[len++] = (uint8_t)time | 0x80;
+    time >>= 7;
+  }
+  buf[len++] = (uint8_t)time;
+  out.write(buf, len);
+}
+
+static uint64_t zigzag(int64_t v) { return ((uint64_t)v << 1) ^ (v >> 63); }
+
+static int64_t unzigzag(uint64_t v) {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static uint64_t load_word(const uint8_t* p, size_t len, size_t i) {
+  uint64_t w = 0;
+  if (p) {
+    memcpy(&w, p + i * sizeof(w), min(sizeof(w), len - i * sizeof(w)));
+  }
+  return w;
+}
+
+/**
+ * Encode 'len' bytes at 'cur' as a bitmap of the 64-bit words that differ
+ * from 'prev' (or from zero if 'prev' is null), followed by a varint of
+ * each differing word XORed with its old value.
+ */
+static void put_xor_delta(vector<uint8_t>& out, const uint8_t* cur,
+                          const uint8_t* prev, size_t len) {
+  size_t words = (len + 7) / 8;
+  size_t mask_start = out.size();
+  out.resize(mask_start + (words + 7) / 8);
+  for (size_t i = 0; i < words; ++i) {
+    uint64_t x = load_word(cur, len, i) ^ load_word(prev, len, i);
+    if (x) {
+      out[mask_start + i / 8] |= 1 << (i % 8);
+      put_varint(out, x);
+    }
+  }
+}
+
+static void get_xor_delta(CompressedReader& in, uint8_t* cur,
+                          const uint8_t* prev, size_t len) {
+  size_t words = (len + 7) / 8;
+  vector<uint8_t> mask((words + 7) / 8);
+  in.read(mask.data(), mask.size());
+  for (size_t i = 0; i < words; ++i) {
+    uint64_t w = load_word(prev, len, i);
+    if (mask[i / 8] & (1 << (i % 8))) {
+      w ^= get_varint(in);
+    }
+    memcpy(cur + i * sizeof(w), &w, min(sizeof(w), len - i * sizeof(w)));
+  }
+}
+
+// The XSAVE legacy (x87 and SSE) area and the XSAVE header, which holds
+// XSTATE_BV. These are always recorded.
+static const size_t xsave_header_end = 576;
+
+struct XSaveComponent {
+  size_t offset;
+  size_t size;
+};
+
+// Standard-format (as returned by PTRACE_GETREGSET) layout of the XSAVE
+// components, indexed by XSTATE_BV bit. Components 0 and 1 are in the legacy
+// area and component 8 is supervisor state, which is never in the user area.
+static const XSaveComponent xsave_components[] = {
+  { 0, 0 },       // x87
+  { 0, 0 },       // SSE
+  { 576, 256 },   // AVX
+  { 960, 64 },    // MPX bound registers
+  { 1024, 64 },   // MPX bound config
+  { 1088, 64 },   // AVX-512 opmask
+  { 1152, 512 },  // AVX-512 ZMM_Hi256
+  { 1664, 1024 }, // AVX-512 Hi16_ZMM
+  { 0, 0 },       // PT
+  { 2688, 8 },    // PKRU
+};
+static const size_t xsave_components_end = 2696;
+
+typedef pair<size_t, size_t> ByteRange;
+
+/**
+ * Set 'ranges' to the [start, end) ranges of the extra-register data 'data'
+ * that we record. For an XSAVE area that's the legacy area and header, the
+ * components whose XSTATE_BV bit is set, and anything past the components we
+ * know about. Components in their initial state are zero in the area the
+ * kernel gives us, so the reader restores omitted bytes as zero.
+ * The first range is always the header, so the reader can decode it and
+ * then compute the rest.
+ */
+static void xsave_recorded_ranges(ExtraRegisters::Format format,
+                                  const uint8_t* data, size_t len,
+                                  vector<ByteRange>& ranges) {
+  ranges.clear();
+  if (format != ExtraRegisters::XSAVE || len <= xsave_header_end) {
+    ranges.push_back(ByteRange(0, len));
+    return;
+  }
+  ranges.push_back(ByteRange(0, xsave_header_end));
+  uint64_t xstate_bv;
+  memcpy(&xstate_bv, data + 512, sizeof(xstate_bv));
+  for (size_t i = 2; i < array_length(xsave_components); ++i) {
+    const XSaveComponent& c = xsave_components[i];
+    if (!(xstate_bv & (uint64_t(1) << i)) || c.size == 0 || c.offset >= len) {
+      continue;
+    }
+    ranges.push_back(ByteRange(c.offset, min(len, c.offset + c.size)));
+  }
+  if (len > xsave_components_end) {
+    ranges.push_back(ByteRange(xsave_components_end, len));
+  }
+}
+
 void TraceWriter::write_frame(const TraceFrame& frame) {
   auto& events = writer(EVENTS);
-  events.write(&frame.basic_info, sizeof(frame.basic_info));
-  if (!events.good()) {
-    FATAL() << "Tried to save " << sizeof(frame.basic_info)
-            << " bytes to the trace, but failed";
+  bool key = index_time(EVENTS, frame.time(), 0);
+  if (key) {
+    frame_history.clear();
   }
+  auto it = frame_history.tids.find(frame.tid());
+  const FrameHistory::Tid* prev =
+      it == frame_history.tids.end() ? nullptr : &it->second;
+
+  auto& out = frame_buffer;
+  out.clear();
+  out.push_back((key ? FRAME_KEY : 0) |
+                (frame.has_fingerprint() ? FRAME_FINGERPRINT : 0));
+  put_varint(out, frame.time() - frame_history.last_time);
+  put_varint(out, (uint32_t)frame.tid());
+  put_varint(out, (uint32_t)frame.event().encoded);
+  put_varint(out, zigzag(frame.ticks() - (prev ? prev->ticks : 0)));
   // TODO: only store exec info for non-async-sig events when
   // debugging assertions are enabled.
   if (frame.event().has_exec_info == HAS_EXEC_INFO) {
-    events.write(&frame.exec_info, sizeof(frame.exec_info));
-    if (!events.good()) {
-      FATAL() << "Tried to save " << sizeof(frame.exec_info)
-              << " bytes to the trace, but failed";
+    put_xor_delta(out, (const uint8_t*)&frame.exec_info,
+                  prev && prev->has_exec_info
+                      ? (const uint8_t*)&prev->exec_frame.exec_info
+                      : nullptr,
+                  sizeof(frame.exec_info));
+    const ExtraRegisters& extra = frame.extra_regs();
+    const uint8_t* base = nullptr;
+    if (prev && prev->has_exec_info &&
+        prev->exec_frame.extra_regs().format() == extra.format() &&
+        prev->exec_frame.extra_regs().data_size() == extra.data_size()) {
+      base = prev->exec_frame.extra_regs().data_bytes();
     }
-
-    int extra_reg_bytes = frame.extra_regs().data_size();
-    char extra_reg_format = (char)frame.extra_regs().format();
-    events.write(&extra_reg_format, sizeof(extra_reg_format));
-    events.write((char*)&extra_reg_bytes, sizeof(extra_reg_bytes));
-    if (!events.good()) {
-      FATAL() << "Tried to save "
-              << sizeof(extra_reg_bytes) + sizeof(extra_reg_format)
-              << " bytes to the trace, but failed";
+    out.push_back((uint8_t)extra.format());
+    put_varint(out, extra.data_size());
+    xsave_recorded_ranges(extra.format(), extra.data_bytes(),
+                          extra.data_size(), xsave_ranges);
+    for (auto& r : xsave_ranges) {
+      put_xor_delta(out, extra.data_bytes() + r.first,
+                    base ? base + r.first : nullptr, r.second - r.first);
     }
-    if (extra_reg_bytes > 0) {
-      events.write((const char*)frame.extra_regs().data_bytes(),
-                   extra_reg_bytes);
-      if (!events.good()) {
-        FATAL() << "Tried to save " << extra_reg_bytes
-                << " bytes to the trace, but failed";
+  }
+  if (frame.has_fingerprint()) {
+    put_varint(out, frame.fingerprint());
+  }
+  events.write(out.data(), out.size());
+  if (!events.good()) {
+    FATAL() << "Tried to save " << out.size()
+            << " bytes to the trace, but failed";
+  }
+
+  frame_history.last_time = frame.time();
+  auto& t = frame_history.tids[frame.tid()];
+  t.ticks = frame.ticks();
+  if (frame.event().has_exec_info == HAS_EXEC_INFO) {
+    t.has_exec_info = true;
+    t.exec_frame = frame;
+    const ExtraRegisters& extra = frame.extra_regs();
+    if (extra.format() == ExtraRegisters::XSAVE &&
+        (size_t)extra.data_size() > xsave_header_end) {
+      // The next frame must be XORed against what the reader decodes, which
+      // has the omitted components zeroed.
+      vector<uint8_t> data(extra.data_size());
+      for (auto& r : xsave_ranges) {
+        memcpy(data.data() + r.first, extra.data_bytes() + r.first,
+               r.second - r.first);
       }
+      t.exec_frame.recorded_extra_regs.set_to_raw_data(extra.format(), data);
     }
   }
 
   tick_time();
+  flush_if_stale();
 }
 
-TraceFrame TraceReader::read_frame() {
+/**
+ * How far behind the recording a reader following the trace can be, at
+ * most, while frames are being written.
+ */
+static const double FLUSH_INTERVAL_SECS = 1.0;
+
+void TraceWriter::flush_if_stale() {
+  if (pending_commit_time) {
+    maybe_write_commit();
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if ((now.tv_sec - last_flush_time.tv_sec) +
+          (now.tv_nsec - last_flush_time.tv_nsec) / 1e9 <
+      flush_interval) {
+    return;
+  }
+  last_flush_time = now;
+  for (auto& w : writers) {
+    w->flush();
+  }
+  if (commit_interval > 0 && !pending_commit_time) {
+    // We're called right after a frame was written, and everything
+    // recorded for that frame was written before it, so this is a
+    // consistent place to stop reading.
+    pending_commit_time = global_time - 1;
+    for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+      pending_commit_offsets[s] = writer(s).uncompressed_offset();
+    }
+  }
+}
+
+void TraceWriter::set_commit_interval(double secs) {
+  commit_interval = secs;
+  // Half the budget for the data to be compressed, the other half for it
+  // to be written and synced.
+  flush_interval = min(FLUSH_INTERVAL_SECS, secs / 2);
+  for (auto& w : writers) {
+    w->set_sync_writes(true);
+  }
+  // Make sure the trace files themselves survive a crash.
+  ScopedFd dir(trace_dir.c_str(), O_RDONLY | O_DIRECTORY);
+  if (!dir.is_open() || fsync(dir)) {
+    LOG(warn) << "Failed to sync " << trace_dir;
+  }
+}
+
+void TraceWriter::maybe_write_commit() {
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    if (writer(s).written_offset() < pending_commit_offsets[s]) {
+      return;
+    }
+  }
+  // Like the metadata, written to a temporary and renamed into place. The
+  // record itself isn't synced, so as not to stall the recorder; if it's
+  // lost, the previous one still describes intact data.
+  string path = commit_path();
+  string tmp_path = path + ".tmp";
+  {
+    ofstream out(tmp_path);
+    out << pending_commit_time;
+    for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+      out << ' ' << pending_commit_offsets[s];
+    }
+    out << endl;
+    if (!out.good()) {
+      LOG(warn) << "Failed to write " << tmp_path;
+      unlink(tmp_path.c_str());
+      pending_commit_time = 0;
+      return;
+    }
+  }
+  if (rename(tmp_path.c_str(), path.c_str())) {
+    LOG(warn) << "Failed to rename " << tmp_path;
+    unlink(tmp_path.c_str());
+  }
+  pending_commit_time = 0;
+}
+
+void TraceReader::read_fixed_frame(TraceFrame* frame) {
   // Read the common event info first, to see if we also have
   // exec info to read.
   auto& events = reader(EVENTS);
-  TraceFrame frame;
-  events.read(&frame.basic_info, sizeof(frame.basic_info));
-  if (frame.event().has_exec_info) {
-    events.read(&frame.exec_info, sizeof(frame.exec_info));
+  // These traces predate 64-bit event times.
+  struct {
+    uint32_t global_time;
+    pid_t tid;
+    EncodedEvent ev;
+    Ticks ticks;
+  } basic_info;
+  events.read(&basic_info, sizeof(basic_info));
+  frame->basic_info.global_time = basic_info.global_time;
+  frame->basic_info.tid = basic_info.tid;
+  frame->basic_info.ev = basic_info.ev;
+  frame->basic_info.ticks = basic_info.ticks;
+  if (frame->event().has_exec_info) {
+    events.read(&frame->exec_info, sizeof(frame->exec_info));
 
     int extra_reg_bytes;
     char extra_reg_format;
@@ -163,21 +618,318 @@ TraceFrame TraceReader::read_frame() {
       vector<uint8_t> data;
       data.resize(extra_reg_bytes);
       events.read((char*)data.data(), extra_reg_bytes);
-      frame.recorded_extra_regs.set_arch(frame.event().arch());
-      frame.recorded_extra_regs.set_to_raw_data(
+      frame->recorded_extra_regs.set_arch(frame->event().arch());
+      frame->recorded_extra_regs.set_to_raw_data(
+          (ExtraRegisters::Format)extra_reg_format, data);
+    } else {
+      assert(extra_reg_format == ExtraRegisters::NONE);
+      frame->recorded_extra_regs = ExtraRegisters(frame->event().arch());
+    }
+  }
+}
+
+void TraceReader::read_delta_frame(TraceFrame* frame, bool update_history) {
+  auto& events = reader(EVENTS);
+  uint8_t flags;
+  events.read(&flags, sizeof(flags));
+  bool key = flags & FRAME_KEY;
+  if (key && update_history) {
+    frame_history.clear();
+  }
+
+  frame->basic_info.global_time =
+      (key ? 0 : frame_history.last_time) + get_varint(events);
+  frame->basic_info.tid = (pid_t)get_varint(events);
+  frame->basic_info.ev.encoded = (int)get_varint(events);
+  auto it = frame_history.tids.find(frame->tid());
+  const FrameHistory::Tid* prev =
+      key || it == frame_history.tids.end() ? nullptr : &it->second;
+  frame->basic_info.ticks =
+      (prev ? prev->ticks : 0) + unzigzag(get_varint(events));
+
+  if (frame->event().has_exec_info) {
+    get_xor_delta(events, (uint8_t*)&frame->exec_info,
+                  prev && prev->has_exec_info
+                      ? (const uint8_t*)&prev->exec_frame.exec_info
+                      : nullptr,
+                  sizeof(frame->exec_info));
+    uint8_t extra_reg_format;
+    events.read(&extra_reg_format, sizeof(extra_reg_format));
+    size_t extra_reg_bytes = get_varint(events);
+    frame->recorded_extra_regs = ExtraRegisters(frame->event().arch());
+    if (extra_reg_bytes > 0) {
+      vector<uint8_t> data;
+      data.resize(extra_reg_bytes);
+      const uint8_t* base = nullptr;
+      if (prev && prev->has_exec_info &&
+          prev->exec_frame.extra_regs().format() == extra_reg_format &&
+          (size_t)prev->exec_frame.extra_regs().data_size() ==
+              extra_reg_bytes) {
+        base = prev->exec_frame.extra_regs().data_bytes();
+      }
+      if (trace_version >= TRACE_VERSION_XSAVE_COMPONENTS) {
+        // Decode the header to learn which other ranges were recorded.
+        size_t header_end = (ExtraRegisters::Format)extra_reg_format ==
+                                        ExtraRegisters::XSAVE &&
+                                    extra_reg_bytes > xsave_header_end
+                                ? xsave_header_end
+                                : extra_reg_bytes;
+        get_xor_delta(events, data.data(), base, header_end);
+        vector<ByteRange> ranges;
+        xsave_recorded_ranges((ExtraRegisters::Format)extra_reg_format,
+                              data.data(), extra_reg_bytes, ranges);
+        for (size_t i = 1; i < ranges.size(); ++i) {
+          get_xor_delta(events, data.data() + ranges[i].first,
+                        base ? base + ranges[i].first : nullptr,
+                        ranges[i].second - ranges[i].first);
+        }
+      } else {
+        get_xor_delta(events, data.data(), base, extra_reg_bytes);
+      }
+      frame->recorded_extra_regs.set_to_raw_data(
           (ExtraRegisters::Format)extra_reg_format, data);
     } else {
       assert(extra_reg_format == ExtraRegisters::NONE);
-      frame.recorded_extra_regs = ExtraRegisters(frame.event().arch());
     }
   }
+  if (flags & FRAME_FINGERPRINT) {
+    frame->set_fingerprint((uint32_t)get_varint(events));
+  }
 
+  if (update_history) {
+    frame_history.last_time = frame->time();
+    auto& t = frame_history.tids[frame->tid()];
+    t.ticks = frame->ticks();
+    if (frame->event().has_exec_info) {
+      t.has_exec_info = true;
+      t.exec_frame = *frame;
+    }
+  }
+}
+
+TraceFrame TraceReader::decode_next_frame(bool update_history) {
+  TraceFrame frame;
+  if (trace_version >= TRACE_VERSION_DELTA_FRAMES) {
+    read_delta_frame(&frame, update_history);
+  } else {
+    read_fixed_frame(&frame);
+  }
+  return frame;
+}
+
+TraceFrame TraceReader::read_next_frame(bool update_history) {
+  TraceFrame frame = decode_next_frame(update_history);
+  tick_time();
+  assert(time() == frame.time());
+  return frame;
+}
+
+TraceFrame TraceReader::read_frame() {
+  if (decoded_frames.empty()) {
+    return read_next_frame(true);
+  }
+  TraceFrame frame = move(decoded_frames.front());
+  decoded_frames.pop_front();
   tick_time();
   assert(time() == frame.time());
   return frame;
 }
 
+void TraceReader::decode_ahead(size_t max_frames, size_t max_queued) {
+  if (following) {
+    return;
+  }
+  auto& events = reader(EVENTS);
+  for (size_t i = 0; i < max_frames && decoded_frames.size() < max_queued &&
+                         good() && !events.at_end();
+       ++i) {
+    decoded_frames.push_back(decode_next_frame(true));
+  }
+}
+
+static ostream& operator<<(ostream& out, const vector<string>& vs) {
+  out << vs.size() << endl;
+  for (auto& v : vs) {
+    out << v << '\0';
+  }
+  return out;
+}
+
+static istream& operator>>(istream& in, vector<string>& vs) {
+  size_t len;
+  in >> len;
+  in.ignore(1);
+  for (size_t i = 0; i < len; ++i) {
+    char buf[PATH_MAX];
+    in.getline(buf, sizeof(buf), '\0');
+    vs.push_back(buf);
+  }
+  return in;
+}
+
+void TraceWriter::update_metadata(const TraceTaskEvent& event) {
+  pid_t tid = event.tid();
+  switch (event.type()) {
+    case TraceTaskEvent::CLONE:
+    case TraceTaskEvent::FORK:
+      if (event.is_fork()) {
+        TraceMetadata::Process p = { tid, tid_to_pid[event.parent_tid()],
+                                     false, vector<string>(), -1 };
+        process_index[tid] = make_pair(metadata.processes.size(), false);
+        metadata.processes.push_back(p);
+        tid_to_pid[tid] = tid;
+      } else {
+        tid_to_pid[tid] = tid_to_pid[event.parent_tid()];
+      }
+      break;
+    case TraceTaskEvent::EXEC: {
+      auto pid = tid_to_pid.find(tid);
+      if (pid == tid_to_pid.end()) {
+        // The initial exec.
+        TraceMetadata::Process p = { tid, 0, false, vector<string>(), -1 };
+        process_index[tid] = make_pair(metadata.processes.size(), false);
+        metadata.processes.push_back(p);
+        pid = tid_to_pid.insert(make_pair(tid, tid)).first;
+      }
+      auto& index = process_index[pid->second];
+      auto& p = metadata.processes[index.first];
+      if (!index.second && !p.execed) {
+        p.execed = true;
+        p.cmd_line = event.cmd_line();
+      }
+      break;
+    }
+    case TraceTaskEvent::EXIT: {
+      auto pid = tid_to_pid.find(tid);
+      if (pid != tid_to_pid.end()) {
+        if (pid->second == tid) {
+          process_index[tid].second = true;
+        }
+        tid_to_pid.erase(pid);
+      }
+      break;
+    }
+    case TraceTaskEvent::NONE:
+      break;
+  }
+}
+
+void TraceWriter::note_exit_code(pid_t tid, int exit_code) {
+  auto pid = tid_to_pid.find(tid);
+  if (pid != tid_to_pid.end()) {
+    metadata.processes[process_index[pid->second].first].exit_code =
+        exit_code;
+  }
+}
+
+void TraceWriter::write_metadata() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  metadata.num_events = global_time;
+  metadata.duration = (now.tv_sec - start_time.tv_sec) +
+                      (now.tv_nsec - start_time.tv_nsec) / 1e9;
+  // Write a temporary and rename it into place, so a reader never sees a
+  // partial file.
+  string path = metadata_path();
+  string tmp_path = path + ".tmp";
+  {
+    ofstream out(tmp_path);
+    out << metadata.num_events << ' ' << metadata.duration << ' '
+        << metadata.processes.size() << endl;
+    for (auto& p : metadata.processes) {
+      out << p.pid << ' ' << p.ppid << ' ' << p.exit_code << ' ' << p.execed
+          << ' ' << p.cmd_line;
+    }
+    if (!out.good()) {
+      LOG(warn) << "Failed to write " << tmp_path;
+      unlink(tmp_path.c_str());
+      return;
+    }
+  }
+  if (rename(tmp_path.c_str(), path.c_str())) {
+    LOG(warn) << "Failed to rename " << tmp_path;
+    unlink(tmp_path.c_str());
+  }
+}
+
+void TraceSyscallStats::add_trapped(SupportedArch arch, int syscallno,
+                                    double seconds) {
+  Syscall& s = syscalls[make_pair(arch, syscallno)];
+  ++s.trapped;
+  s.trapped_seconds += seconds;
+  int bucket = 0;
+  for (double us = seconds * 1e6; us >= 2 && bucket < BUCKETS - 1; us /= 2) {
+    ++bucket;
+  }
+  ++s.buckets[bucket];
+}
+
+void TraceWriter::write_syscall_stats() {
+  // Like the metadata, written to a temporary and renamed into place.
+  string path = syscall_stats_path();
+  string tmp_path = path + ".tmp";
+  {
+    ofstream out(tmp_path);
+    out << syscall_stats_.syscalls.size() << endl;
+    for (auto& kv : syscall_stats_.syscalls) {
+      const TraceSyscallStats::Syscall& s = kv.second;
+      out << kv.first.first << ' ' << kv.first.second << ' ' << s.buffered
+          << ' ' << s.trapped << ' ' << s.trapped_seconds;
+      for (int b = 0; b < TraceSyscallStats::BUCKETS; ++b) {
+        out << ' ' << s.buckets[b];
+      }
+      out << endl;
+    }
+    if (!out.good()) {
+      LOG(warn) << "Failed to write " << tmp_path;
+      unlink(tmp_path.c_str());
+      return;
+    }
+  }
+  if (rename(tmp_path.c_str(), path.c_str())) {
+    LOG(warn) << "Failed to rename " << tmp_path;
+    unlink(tmp_path.c_str());
+  }
+}
+
+bool TraceReader::read_syscall_stats(TraceSyscallStats* stats) {
+  fetch_remote(syscall_stats_path());
+  ifstream in(syscall_stats_path());
+  size_t count;
+  in >> count;
+  if (!in.good()) {
+    return false;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    int arch, syscallno;
+    in >> arch >> syscallno;
+    TraceSyscallStats::Syscall& s =
+        stats->syscalls[make_pair((SupportedArch)arch, syscallno)];
+    in >> s.buffered >> s.trapped >> s.trapped_seconds;
+    for (int b = 0; b < TraceSyscallStats::BUCKETS; ++b) {
+      in >> s.buckets[b];
+    }
+  }
+  return !in.fail();
+}
+
+bool TraceReader::read_metadata(TraceMetadata* metadata) {
+  fetch_remote(metadata_path());
+  ifstream in(metadata_path());
+  size_t count;
+  in >> metadata->num_events >> metadata->duration >> count;
+  if (!in.good()) {
+    return false;
+  }
+  metadata->processes.resize(count);
+  for (auto& p : metadata->processes) {
+    in >> p.pid >> p.ppid >> p.exit_code >> p.execed >> p.cmd_line;
+  }
+  return !in.fail();
+}
+
 void TraceWriter::write_task_event(const TraceTaskEvent& event) {
+  update_metadata(event);
   auto& tasks = writer(TASKS);
   tasks << event.type() << event.tid();
   switch (event.type()) {
@@ -231,55 +983,212 @@ string TraceWriter::try_hardlink_file(const string& file_name) {
                         ? file_name.substr(last_slash + 1)
                         : file_name;
 
-  string link_path = dir() + "/" + link_name + "_" + basename;
+  // Record the link relative to the trace directory, so the trace can be
+  // moved.
+  string link_name_in_trace = string(link_name) + "_" + basename;
+  string link_path = dir() + "/" + link_name_in_trace;
   int ret = link(file_name.c_str(), link_path.c_str());
   if (ret < 0) {
     // maybe tried to link across filesystems?
     return file_name;
   }
-  return link_path;
+  return link_name_in_trace;
+}
+
+// Open the file |map| maps, if it's still the regular file that was mapped.
+static bool open_mapped_file(const TraceMappedRegion& map, ScopedFd* fd,
+                             struct stat* st) {
+  *fd = ScopedFd(map.file_name().c_str(), O_RDONLY | O_CLOEXEC);
+  return fd->is_open() && fstat(*fd, st) == 0 && S_ISREG(st->st_mode) &&
+         st->st_dev == map.stat().st_dev && st->st_ino == map.stat().st_ino;
+}
+
+string TraceWriter::try_snapshot_file(const TraceMappedRegion& map) {
+  ScopedFd src;
+  struct stat st;
+  if (!open_mapped_file(map, &src, &st)) {
+    // Unlinked or replaced since it was mapped, or not a regular file.
+    return string();
+  }
+
+  char name[PATH_MAX];
+  snprintf(name, sizeof(name), "mmap_%d_snapshot", mmap_count);
+  string path = dir() + "/" + name;
+  ScopedFd dst(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0400);
+  if (!dst.is_open()) {
+    return string();
+  }
+
+  // Copy just the mapped part, at its offset in the file, so replay can
+  // map the snapshot with the recorded offset.
+  int64_t offset = int64_t(map.offset_pages()) * page_size();
+  if (!copy_file_contents(src, dst, offset, offset + map.size(),
+                          st.st_size)) {
+    LOG(debug) << "  can't snapshot " << map.file_name() << ": "
+               << strerror(errno);
+    unlink(path.c_str());
+    return string();
+  }
+  LOG(debug) << "  copied " << map.file_name() << " to " << name;
+  return name;
+}
+
+void TraceWriter::set_object_store(const string& store_dir) {
+  if (mkdir(store_dir.c_str(), S_IRWXU | S_IRWXG) && errno != EEXIST) {
+    FATAL() << "Failed to create object store `" << store_dir << "'";
+  }
+  object_store = store_dir;
+}
+
+static string object_name(const Hash128& h) {
+  char name[33];
+  snprintf(name, sizeof(name), "%016" PRIx64 "%016" PRIx64, h.h1, h.h2);
+  return name;
+}
+
+string TraceWriter::try_store_object(const TraceMappedRegion& map) {
+  ScopedFd src;
+  struct stat st;
+  if (!open_mapped_file(map, &src, &st) || st.st_size == 0) {
+    return string();
+  }
+  void* contents =
+      mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, src, 0);
+  if (contents == MAP_FAILED) {
+    return string();
+  }
+  string path =
+      object_store + "/" + object_name(hash_bytes(contents, st.st_size));
+  munmap(contents, st.st_size);
+  if (access(path.c_str(), R_OK) == 0) {
+    LOG(debug) << "  " << map.file_name() << " is already stored as "
+               << path;
+    return path;
+  }
+
+  // Another recording may be storing the same object, so write a private
+  // temporary and rename it into place.
+  char tmp_name[PATH_MAX];
+  snprintf(tmp_name, sizeof(tmp_name), "%s/tmp_%d_%d", object_store.c_str(),
+           getpid(), mmap_count);
+  ScopedFd dst(tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+  if (!dst.is_open()) {
+    return string();
+  }
+  struct stat after;
+  bool ok = copy_file_contents(src, dst, 0, st.st_size, st.st_size) &&
+            fstat(src, &after) == 0;
+  // If the file was written while we hashed or copied it, the object
+  // might not match its name.
+  if (!ok || after.st_size != st.st_size ||
+      after.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+      after.st_mtim.tv_nsec != st.st_mtim.tv_nsec ||
+      rename(tmp_name, path.c_str())) {
+    LOG(debug) << "  can't store " << map.file_name() << " in "
+               << object_store;
+    unlink(tmp_name);
+    return string();
+  }
+  LOG(debug) << "  stored " << map.file_name() << " as " << path;
+  return path;
 }
 
 TraceWriter::RecordInTrace TraceWriter::write_mapped_region(
-    const TraceMappedRegion& map, int prot, int flags) {
+    const TraceMappedRegion& map, int prot, int flags, bool changes_only) {
   auto& mmaps = writer(MMAPS);
   TraceReader::MappedDataSource source;
   string backing_file_name;
   if (map.type() == TraceMappedRegion::SYSV_SHM) {
-    source = TraceReader::SOURCE_TRACE;
+    source = changes_only ? TraceReader::SOURCE_TRACE_CHANGES
+                          : TraceReader::SOURCE_TRACE;
   } else if (map.stat().st_ino == 0) {
     source = TraceReader::SOURCE_ZERO;
   } else {
-    if (should_copy_mmap_region(map.file_name(), &map.stat(), prot, flags)) {
+    const struct stat& st = map.stat();
+    MappedFileKey key(st.st_dev, st.st_ino, st.st_mtime, st.st_ctime,
+                      map.file_name(), (flags & MAP_PRIVATE) != 0,
+                      (prot & PROT_EXEC) != 0);
+    auto it = mapped_files.find(key);
+    struct stat now;
+    // A file that's been unlinked since we last saw it has to be copied
+    // now, so don't trust our earlier decision for it.
+    if (it == mapped_files.end() || stat(map.file_name().c_str(), &now)) {
+      MappedFile f;
+      f.copy = should_copy_mmap_region(map.file_name(), &st, prot, flags);
+      f.stored = false;
+      if (!f.copy) {
+        // Try hardlinking file into the trace directory. This will avoid
+        // replay failures if the original file is deleted or replaced (but
+        // not if it is overwritten in-place). If try_hardlink_file fails it
+        // just returns the original file name.
+        // A relative backing_file_name is relative to the trace directory.
+        f.backing_file_name = try_hardlink_file(map.file_name());
+        if (f.backing_file_name == map.file_name() && !object_store.empty()) {
+          // Probably on another file system. A stored copy survives
+          // the file being deleted or overwritten.
+          string object = try_store_object(map);
+          if (!object.empty()) {
+            f.backing_file_name = object;
+            f.stored = true;
+          }
+        }
+      }
+      it = mapped_files.insert(make_pair(key, f)).first;
+      it->second = f;
+    }
+    if (it->second.copy) {
+      // The file may change after this, so we need its current contents.
+      // Shared mappings have to be restored through the emulated file
+      // system, so those always go through RAW_DATA.
       source = TraceReader::SOURCE_TRACE;
+      if (flags & MAP_PRIVATE) {
+        if (!object_store.empty()) {
+          backing_file_name = try_store_object(map);
+        }
+        if (backing_file_name.empty()) {
+          backing_file_name = try_snapshot_file(map);
+        }
+        if (!backing_file_name.empty()) {
+          source = TraceReader::SOURCE_SNAPSHOT;
+        }
+      }
     } else {
-      source = TraceReader::SOURCE_FILE;
-      // Try hardlinking file into the trace directory. This will avoid
-      // replay failures if the original file is deleted or replaced (but not
-      // if it is overwritten in-place). If try_hardlink_file fails it
-      // just returns the original file name.
-      // A relative backing_file_name is relative to the trace directory.
-      backing_file_name = try_hardlink_file(map.file_name());
+      source = it->second.stored ? TraceReader::SOURCE_SNAPSHOT
+                                 : TraceReader::SOURCE_FILE;
+      backing_file_name = it->second.backing_file_name;
     }
   }
   mmaps << source << map.type() << map.file_name() << map.stat() << map.start()
         << map.end() << map.offset_pages() << backing_file_name;
   ++mmap_count;
-  return source == TraceReader::SOURCE_TRACE ? RECORD_IN_TRACE
-                                             : DONT_RECORD_IN_TRACE;
+  return source == TraceReader::SOURCE_TRACE ||
+                 source == TraceReader::SOURCE_TRACE_CHANGES
+             ? RECORD_IN_TRACE
+             : DONT_RECORD_IN_TRACE;
+}
+
+string TraceReader::packed_file_path(const string& file_name) const {
+  // Different directories can hold files with the same name, so the
+  // basename is only there for people looking at the trace.
+  return dir() + "/packed/" +
+         object_name(hash_bytes(file_name.data(), file_name.size())) + "_" +
+         file_name.substr(file_name.rfind('/') + 1);
 }
 
 static void verify_backing_file(const TraceMappedRegion& map,
-                                const string& backing_file_name) {
+                                const string& backing_file_name,
+                                bool packed) {
   struct stat backing_stat;
   if (stat(backing_file_name.c_str(), &backing_stat)) {
     FATAL() << "Failed to stat " << backing_file_name
             << ": replay is impossible";
   }
-  if (backing_stat.st_ino != map.stat().st_ino ||
+  // A packed copy keeps the original's size, mode and mtime, but not its
+  // inode or owner.
+  if ((!packed && (backing_stat.st_ino != map.stat().st_ino ||
+                   backing_stat.st_uid != map.stat().st_uid ||
+                   backing_stat.st_gid != map.stat().st_gid)) ||
       backing_stat.st_mode != map.stat().st_mode ||
-      backing_stat.st_uid != map.stat().st_uid ||
-      backing_stat.st_gid != map.stat().st_gid ||
       backing_stat.st_size != map.stat().st_size ||
       backing_stat.st_mtime != map.stat().st_mtime) {
     LOG(error)
@@ -288,72 +1197,507 @@ static void verify_backing_file(const TraceMappedRegion& map,
   }
 }
 
-TraceMappedRegion TraceReader::read_mapped_region(MappedData* data) {
-  auto& mmaps = reader(MMAPS);
-  TraceMappedRegion map;
-  string backing_file_name;
-  mmaps >> data->source >> map.type_ >> map.filename >> map.stat_ >>
-      map.start_ >> map.end_ >> map.file_offset_pages >> backing_file_name;
-  if (data->source == SOURCE_FILE) {
-    if (backing_file_name[0] != '/') {
-      backing_file_name = dir() + "/" + backing_file_name;
+TraceMappedRegion TraceReader::read_mapped_region(MappedData* data) {
+  auto& mmaps = reader(MMAPS);
+  TraceMappedRegion map;
+  string backing_file_name;
+  mmaps >> data->source >> map.type_ >> map.filename >> map.stat_ >>
+      map.start_ >> map.end_ >> map.file_offset_pages >> backing_file_name;
+  data->unpacked = false;
+  if (data->source == SOURCE_FILE || data->source == SOURCE_SNAPSHOT) {
+    bool packed = false;
+    if (backing_file_name[0] != '/') {
+      backing_file_name = dir() + "/" + backing_file_name;
+      // A file fetched from a remote trace is a copy, like a packed one.
+      packed = fetch_remote(backing_file_name);
+    } else {
+      // A file outside the trace (or a hardlink recorded with an absolute
+      // path by older rr), unless `rr pack` has copied it into the trace.
+      string packed_path = packed_file_path(backing_file_name);
+      if (fetch_remote(packed_path) ||
+          access(packed_path.c_str(), F_OK) == 0) {
+        backing_file_name = packed_path;
+        packed = true;
+      } else {
+        data->unpacked = true;
+      }
+    }
+    data->file_name = backing_file_name;
+    data->file_data_offset_pages = map.file_offset_pages;
+    if (data->source == SOURCE_FILE) {
+      verify_backing_file(map, backing_file_name, packed);
+    }
+  }
+  return map;
+}
+
+/**
+ * A raw-data header is the global time, tracee address, length and chunk
+ * count of the record. If the chunk count is RAW_DATA_DELTA, it's followed
+ * by the RAW_DATA offset of the record's delta base, and the record's data
+ * XORed with the base follows in RAW_DATA. If it's RAW_DATA_PATCH, it's
+ * followed by the base's offset and the runs to patch into the base, and
+ * the runs' bytes follow in RAW_DATA. If the chunk count is
+ * RAW_DATA_GATHER, it's followed by a range count and the address and
+ * length of each range, and the ranges' data follows in RAW_DATA. If the
+ * chunk count is otherwise
+ * nonzero, it's followed by one reference per chunk, and the record's data
+ * is split into RAW_DATA_CHUNK_SIZE chunks (the last possibly shorter).
+ * Otherwise the record's data follows in RAW_DATA.
+ */
+void TraceWriter::write_raw_inline(const void* d, size_t len,
+                                   remote_ptr<void> addr) {
+  auto& data = writer(RAW_DATA);
+  auto& data_header = writer(RAW_DATA_HEADER);
+  index_time(RAW_DATA_HEADER, global_time, data.uncompressed_offset());
+  put_time(data_header, global_time);
+  data_header << addr.as_int() << len << uint32_t(0);
+  data.write(d, len);
+}
+
+/**
+ * Changed bytes of a signal frame closer together than this are stored as
+ * one run, since each run costs a few header bytes.
+ */
+static const size_t SIGFRAME_PATCH_MIN_GAP = 8;
+
+void TraceWriter::write_sigframe(pid_t tid, int sig, const void* d, size_t len,
+                                 remote_ptr<void> addr) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(d);
+  auto& base = sigframe_bases[make_pair(tid, sig)];
+  if (len > 0 && base.addr == addr && base.data.size() == len) {
+    // Most of a frame (the XSAVE area, the signal mask, most registers)
+    // is the same from one delivery to the next, so only store the runs
+    // of bytes that differ from the base.
+    sigframe_runs.clear();
+    size_t patched = 0;
+    for (size_t i = 0; i < len;) {
+      if (bytes[i] == base.data[i]) {
+        ++i;
+        continue;
+      }
+      size_t start = i;
+      size_t end = i + 1;
+      for (i = end; i < len && i < end + SIGFRAME_PATCH_MIN_GAP; ++i) {
+        if (bytes[i] != base.data[i]) {
+          end = i + 1;
+        }
+      }
+      i = end;
+      sigframe_runs.push_back(make_pair(start, end - start));
+      patched += end - start;
+    }
+    // Once most of the frame differs, start over with a new base.
+    if (patched <= len / 2) {
+      auto& data = writer(RAW_DATA);
+      auto& data_header = writer(RAW_DATA_HEADER);
+      index_time(RAW_DATA_HEADER, global_time, data.uncompressed_offset());
+      put_time(data_header, global_time);
+      data_header << addr.as_int() << len << RAW_DATA_PATCH << base.offset
+                  << uint32_t(sigframe_runs.size());
+      vector<uint8_t> encoded_runs;
+      size_t prev_end = 0;
+      for (auto& r : sigframe_runs) {
+        put_varint(encoded_runs, r.first - prev_end);
+        put_varint(encoded_runs, r.second);
+        prev_end = r.first + r.second;
+        data.write(bytes + r.first, r.second);
+      }
+      data_header.write(encoded_runs.data(), encoded_runs.size());
+      ++delta_sigframes;
+      return;
+    }
+  }
+
+  base.addr = addr;
+  base.offset = writer(RAW_DATA).uncompressed_offset();
+  base.data.assign(bytes, bytes + len);
+  write_raw_inline(d, len, addr);
+}
+
+void TraceWriter::write_raw_gather(const void* d,
+                                   const vector<GatherRange>& ranges) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(d);
+  size_t len = 0;
+  bool any_chunked = false;
+  for (auto& r : ranges) {
+    len += r.num_bytes;
+    any_chunked |= dedup_raw_data && r.num_bytes >= RAW_DATA_CHUNK_SIZE;
+  }
+  if (ranges.size() == 1 || any_chunked) {
+    // Deduplicating large ranges saves more than sharing a header does.
+    for (auto& r : ranges) {
+      write_raw(bytes, r.num_bytes, r.addr);
+      bytes += r.num_bytes;
+    }
+    return;
+  }
+  if (ranges.empty()) {
+    return;
+  }
+
+  auto& data = writer(RAW_DATA);
+  auto& data_header = writer(RAW_DATA_HEADER);
+  index_time(RAW_DATA_HEADER, global_time, data.uncompressed_offset());
+  put_time(data_header, global_time);
+  data_header << ranges[0].addr.as_int() << len
+              << RAW_DATA_GATHER << uint32_t(ranges.size());
+  for (auto& r : ranges) {
+    data_header << r.addr.as_int() << r.num_bytes;
+  }
+  data.write(bytes, len);
+}
+
+void TraceWriter::write_raw_filled(size_t len, remote_ptr<void> addr,
+                                   const CompressedWriter::Filler& fill) {
+  auto& data = writer(RAW_DATA);
+  auto& data_header = writer(RAW_DATA_HEADER);
+  index_time(RAW_DATA_HEADER, global_time, data.uncompressed_offset());
+  put_time(data_header, global_time);
+  data_header << addr.as_int() << len;
+  if (!dedup_raw_data || len < RAW_DATA_CHUNK_SIZE) {
+    data_header << uint32_t(0);
+    data.write_filled(len, fill);
+    return;
+  }
+
+  // Deduplication has to hash each chunk before it's written, so stage the
+  // data a piece at a time rather than all at once; a huge read() doesn't
+  // then cost as much memory in rr as in the tracee. The chunk references
+  // only go into the header, which is a separate stream, at the end.
+  vector<uint64_t> chunks;
+  chunks.reserve((len + RAW_DATA_CHUNK_SIZE - 1) / RAW_DATA_CHUNK_SIZE);
+  vector<uint8_t> piece(min(len, RAW_DATA_PIECE_SIZE));
+  for (size_t offset = 0; offset < len; offset += piece.size()) {
+    size_t piece_len = min(piece.size(), len - offset);
+    fill(offset, piece.data(), piece_len);
+    write_raw_chunks(piece.data(), piece_len, chunks);
+  }
+  data_header << uint32_t(chunks.size());
+  data_header.write(chunks.data(), chunks.size() * sizeof(chunks[0]));
+}
+
+void TraceWriter::write_raw_file_data(size_t len, remote_ptr<void> addr,
+                                      const string& file_name, uint64_t offset,
+                                      const struct stat& st) {
+  auto& data_header = writer(RAW_DATA_HEADER);
+  index_time(RAW_DATA_HEADER, global_time,
+             writer(RAW_DATA).uncompressed_offset());
+  put_time(data_header, global_time);
+  data_header << addr.as_int() << len << RAW_DATA_FILE
+              << file_name << offset << int64_t(st.st_size)
+              << int64_t(st.st_mtim.tv_sec) << int64_t(st.st_mtim.tv_nsec);
+  file_data_bytes += len;
+}
+
+void TraceWriter::write_raw_chunks(const uint8_t* bytes, size_t len,
+                                   vector<uint64_t>& chunks) {
+  auto& data = writer(RAW_DATA);
+  for (size_t offset = 0; offset < len; offset += RAW_DATA_CHUNK_SIZE) {
+    size_t chunk_len = min(RAW_DATA_CHUNK_SIZE, len - offset);
+    // Only full chunks are deduplicated; a short tail stays inline.
+    if (chunk_len == RAW_DATA_CHUNK_SIZE) {
+      auto it = chunk_offsets.insert(make_pair(
+          hash_bytes(bytes + offset, chunk_len), data.uncompressed_offset()));
+      if (!it.second) {
+        chunks.push_back(it.first->second);
+        deduped_bytes += chunk_len;
+        continue;
+      }
+    }
+    chunks.push_back(CHUNK_INLINE);
+    data.write(bytes + offset, chunk_len);
+  }
+}
+
+void TraceWriter::write_raw(const void* d, size_t len, remote_ptr<void> addr) {
+  if (!dedup_raw_data || len < RAW_DATA_CHUNK_SIZE) {
+    write_raw_inline(d, len, addr);
+    return;
+  }
+
+  auto& data = writer(RAW_DATA);
+  auto& data_header = writer(RAW_DATA_HEADER);
+  index_time(RAW_DATA_HEADER, global_time, data.uncompressed_offset());
+  put_time(data_header, global_time);
+  data_header << addr.as_int() << len;
+
+  vector<uint64_t> chunks;
+  chunks.reserve((len + RAW_DATA_CHUNK_SIZE - 1) / RAW_DATA_CHUNK_SIZE);
+  write_raw_chunks(static_cast<const uint8_t*>(d), len, chunks);
+  data_header << uint32_t(chunks.size());
+  data_header.write(chunks.data(), chunks.size() * sizeof(chunks[0]));
+}
+
+size_t TraceReader::RawDataHeader::inline_bytes() const {
+  if (!file_name.empty()) {
+    return 0;
+  }
+  if (is_patch) {
+    size_t bytes = 0;
+    for (auto& p : patches) {
+      bytes += p.second;
     }
-    data->file_name = backing_file_name;
-    data->file_data_offset_pages = map.file_offset_pages;
-    verify_backing_file(map, backing_file_name);
+    return bytes;
   }
-  return map;
+  if (is_delta || chunks.empty()) {
+    return num_bytes;
+  }
+  size_t bytes = 0;
+  for (size_t i = 0; i < chunks.size(); ++i) {
+    if (chunks[i] == CHUNK_INLINE) {
+      bytes += min(RAW_DATA_CHUNK_SIZE, num_bytes - i * RAW_DATA_CHUNK_SIZE);
+    }
+  }
+  return bytes;
 }
 
-static ostream& operator<<(ostream& out, const vector<string>& vs) {
-  out << vs.size() << endl;
-  for (auto& v : vs) {
-    out << v << '\0';
+TraceFrame::Time TraceReader::read_record_time(
+    CompressedReader& data_header) const {
+  if (trace_version >= TRACE_VERSION_WIDE_TIME) {
+    return get_varint(data_header);
   }
-  return out;
+  uint32_t time;
+  data_header >> time;
+  return time;
 }
 
-static istream& operator>>(istream& in, vector<string>& vs) {
-  size_t len;
-  in >> len;
-  in.ignore(1);
-  for (size_t i = 0; i < len; ++i) {
-    char buf[PATH_MAX];
-    in.getline(buf, sizeof(buf), '\0');
-    vs.push_back(buf);
+void TraceReader::read_raw_data_header(CompressedReader& data_header,
+                                       RawDataHeader* header) const {
+  header->time = read_record_time(data_header);
+  data_header >> header->addr >> header->num_bytes;
+  header->chunks.clear();
+  header->is_delta = false;
+  header->is_patch = false;
+  header->patches.clear();
+  header->gather.clear();
+  header->file_name.clear();
+  if (trace_version >= TRACE_VERSION_CHUNKED_RAW_DATA) {
+    uint32_t num_chunks;
+    data_header >> num_chunks;
+    if (trace_version >= TRACE_VERSION_SIGFRAME_DELTAS &&
+        num_chunks == RAW_DATA_DELTA) {
+      header->is_delta = true;
+      data_header >> header->delta_base;
+      return;
+    }
+    if (trace_version >= TRACE_VERSION_SIGFRAME_PATCHES &&
+        num_chunks == RAW_DATA_PATCH) {
+      uint32_t num_runs;
+      header->is_patch = true;
+      data_header >> header->delta_base >> num_runs;
+      header->patches.resize(num_runs);
+      size_t prev_end = 0;
+      for (auto& r : header->patches) {
+        r.first = prev_end + get_varint(data_header);
+        r.second = get_varint(data_header);
+        prev_end = r.first + r.second;
+      }
+      return;
+    }
+    if (trace_version >= TRACE_VERSION_GATHERED_RAW_DATA &&
+        num_chunks == RAW_DATA_GATHER) {
+      uint32_t num_ranges;
+      data_header >> num_ranges;
+      header->gather.resize(num_ranges);
+      for (auto& r : header->gather) {
+        data_header >> r.first >> r.second;
+      }
+      return;
+    }
+    if (trace_version >= TRACE_VERSION_FILE_RAW_DATA &&
+        num_chunks == RAW_DATA_FILE) {
+      data_header >> header->file_name >> header->file_offset >>
+          header->file_size >> header->file_mtime_sec >>
+          header->file_mtime_nsec;
+      return;
+    }
+    header->chunks.resize(num_chunks);
+    data_header.read(header->chunks.data(),
+                     num_chunks * sizeof(header->chunks[0]));
   }
-  return in;
 }
 
-void TraceWriter::write_raw(const void* d, size_t len, remote_ptr<void> addr) {
-  auto& data = writer(RAW_DATA);
-  auto& data_header = writer(RAW_DATA_HEADER);
-  data_header << global_time << addr.as_int() << len;
-  data.write(d, len);
+CompressedReader& TraceReader::chunk_reader() {
+  if (!chunk_reader_) {
+    chunk_reader_ = unique_ptr<CompressedReader>(
+        new CompressedReader(reader(RAW_DATA)));
+  }
+  return *chunk_reader_;
+}
+
+CompressedReader::Span TraceReader::read_file_data(
+    const RawDataHeader& header, size_t offset, size_t len) {
+  ScopedFd fd(header.file_name.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (!fd.is_open() || fstat(fd, &st)) {
+    FATAL() << "Can't open " << header.file_name
+            << ", which the trace reads data from";
+  }
+  if (st.st_size != header.file_size ||
+      st.st_mtim.tv_sec != header.file_mtime_sec ||
+      st.st_mtim.tv_nsec != header.file_mtime_nsec) {
+    FATAL() << header.file_name << " changed since it was recorded; can't "
+            << "replay reads from it";
+  }
+  auto bytes = make_shared<vector<uint8_t> >(len);
+  ssize_t nread =
+      pread64(fd, bytes->data(), len, header.file_offset + offset);
+  if (nread != ssize_t(len)) {
+    FATAL() << "Can't read " << len << " bytes at offset "
+            << header.file_offset + offset << " of " << header.file_name;
+  }
+  return CompressedReader::Span(bytes);
 }
 
 TraceReader::RawData TraceReader::read_raw_data() {
   auto& data = reader(RAW_DATA);
-  auto& data_header = reader(RAW_DATA_HEADER);
-  TraceFrame::Time time;
+  RawDataHeader header;
   RawData d;
-  size_t num_bytes;
-  data_header >> time >> d.addr >> num_bytes;
-  assert(time == global_time);
-  d.data.resize(num_bytes);
-  data.read((char*)d.data.data(), num_bytes);
+  if (!pending_raw_data.empty()) {
+    assert(pending_raw_data_time == global_time);
+    d = pending_raw_data.front();
+    pending_raw_data.pop_front();
+    return d;
+  }
+  read_raw_data_header(&header);
+  assert(header.time == global_time);
+  d.addr = header.addr;
+  if (!header.gather.empty()) {
+    CompressedReader::Span all;
+    data.read_span(header.num_bytes, &all);
+    size_t offset = 0;
+    for (auto& r : header.gather) {
+      RawData sub;
+      sub.addr = r.first;
+      sub.data = all.sub(offset, r.second);
+      offset += r.second;
+      pending_raw_data.push_back(sub);
+    }
+    pending_raw_data_time = header.time;
+    d = pending_raw_data.front();
+    pending_raw_data.pop_front();
+    return d;
+  }
+  if (!header.file_name.empty()) {
+    d.data = read_file_data(header, 0, header.num_bytes);
+    return d;
+  }
+  if (header.is_patch) {
+    auto bytes = make_shared<vector<uint8_t> >(header.num_bytes);
+    if (!chunk_reader().seek(header.delta_base) ||
+        !chunk_reader().read(bytes->data(), header.num_bytes)) {
+      FATAL() << "Can't read patch base at " << header.delta_base;
+    }
+    for (auto& r : header.patches) {
+      if (r.first + r.second > header.num_bytes) {
+        FATAL() << "Patch run out of bounds";
+      }
+      data.read(bytes->data() + r.first, r.second);
+    }
+    d.data = CompressedReader::Span(bytes);
+    return d;
+  }
+  if (header.is_delta) {
+    auto bytes = make_shared<vector<uint8_t> >(header.num_bytes);
+    vector<uint8_t> base(header.num_bytes);
+    data.read(bytes->data(), header.num_bytes);
+    if (!chunk_reader().seek(header.delta_base) ||
+        !chunk_reader().read(base.data(), header.num_bytes)) {
+      FATAL() << "Can't read delta base at " << header.delta_base;
+    }
+    for (size_t i = 0; i < header.num_bytes; ++i) {
+      (*bytes)[i] ^= base[i];
+    }
+    d.data = CompressedReader::Span(bytes);
+    return d;
+  }
+  if (header.chunks.empty()) {
+    data.read_span(header.num_bytes, &d.data);
+    return d;
+  }
+
+  auto bytes = make_shared<vector<uint8_t> >(header.num_bytes);
+  for (size_t i = 0; i < header.chunks.size(); ++i) {
+    size_t offset = i * RAW_DATA_CHUNK_SIZE;
+    size_t chunk_len = min(RAW_DATA_CHUNK_SIZE, header.num_bytes - offset);
+    if (header.chunks[i] == CHUNK_INLINE) {
+      data.read(bytes->data() + offset, chunk_len);
+    } else if (!chunk_reader().seek(header.chunks[i]) ||
+               !chunk_reader().read(bytes->data() + offset, chunk_len)) {
+      FATAL() << "Can't read deduplicated chunk at " << header.chunks[i];
+    }
+  }
+  d.data = CompressedReader::Span(bytes);
   return d;
 }
 
-bool TraceReader::read_raw_data_for_frame(const TraceFrame& frame, RawData& d) {
+size_t TraceReader::read_raw_data_pieces(const RawDataPieceFn& fn) {
+  RawDataHeader header;
+  if (pending_raw_data.empty()) {
+    auto& data_header = reader(RAW_DATA_HEADER);
+    data_header.save_state();
+    read_raw_data_header(&header);
+    data_header.restore_state();
+  }
+  if (!pending_raw_data.empty() || header.num_bytes <= RAW_DATA_PIECE_SIZE ||
+      header.is_delta || !header.gather.empty()) {
+    RawData d = read_raw_data();
+    if (d.data.size() > 0) {
+      fn(d);
+    }
+    return d.data.size();
+  }
+
+  auto& data = reader(RAW_DATA);
+  read_raw_data_header(&header);
+  assert(header.time == global_time);
+  RawData piece;
+  for (size_t offset = 0; offset < header.num_bytes;
+       offset += RAW_DATA_PIECE_SIZE) {
+    size_t piece_len = min(RAW_DATA_PIECE_SIZE, header.num_bytes - offset);
+    piece.addr = header.addr + offset;
+    if (!header.file_name.empty()) {
+      piece.data = read_file_data(header, offset, piece_len);
+    } else if (header.chunks.empty()) {
+      data.read_span(piece_len, &piece.data);
+    } else {
+      // RAW_DATA_PIECE_SIZE is a multiple of RAW_DATA_CHUNK_SIZE, so pieces
+      // hold whole chunks.
+      auto bytes = make_shared<vector<uint8_t> >(piece_len);
+      for (size_t i = 0; i < piece_len; i += RAW_DATA_CHUNK_SIZE) {
+        uint64_t chunk = header.chunks[(offset + i) / RAW_DATA_CHUNK_SIZE];
+        size_t chunk_len = min(RAW_DATA_CHUNK_SIZE, piece_len - i);
+        if (chunk == CHUNK_INLINE) {
+          data.read(bytes->data() + i, chunk_len);
+        } else if (!chunk_reader().seek(chunk) ||
+                   !chunk_reader().read(bytes->data() + i, chunk_len)) {
+          FATAL() << "Can't read deduplicated chunk at " << chunk;
+        }
+      }
+      piece.data = CompressedReader::Span(bytes);
+    }
+    fn(piece);
+  }
+  return header.num_bytes;
+}
+
+bool TraceReader::next_raw_data_is_for_frame(const TraceFrame& frame) {
+  if (!pending_raw_data.empty()) {
+    if (pending_raw_data_time == frame.time()) {
+      return true;
+    }
+    if (pending_raw_data_time > frame.time()) {
+      return false;
+    }
+    pending_raw_data.clear();
+  }
   auto& data_header = reader(RAW_DATA_HEADER);
   while (!data_header.at_end()) {
-    TraceFrame::Time time;
     data_header.save_state();
-    data_header >> time;
+    TraceFrame::Time time = read_record_time(data_header);
     data_header.restore_state();
     if (time == frame.time()) {
-      d = read_raw_data();
       return true;
     }
     if (time > frame.time()) {
@@ -363,10 +1707,147 @@ bool TraceReader::read_raw_data_for_frame(const TraceFrame& frame, RawData& d) {
   return false;
 }
 
+bool TraceReader::read_raw_data_for_frame(const TraceFrame& frame, RawData& d) {
+  if (!next_raw_data_is_for_frame(frame)) {
+    return false;
+  }
+  d = read_raw_data();
+  return true;
+}
+
+bool TraceReader::read_raw_data_pieces_for_frame(const TraceFrame& frame,
+                                                 const RawDataPieceFn& fn) {
+  if (!next_raw_data_is_for_frame(frame)) {
+    return false;
+  }
+  read_raw_data_pieces(fn);
+  return true;
+}
+
+vector<TraceReader::RawDataRange> TraceReader::read_raw_data_ranges() const {
+  vector<RawDataRange> ranges;
+  CompressedReader data_header(reader(RAW_DATA_HEADER));
+  data_header.rewind();
+  RawDataHeader header;
+  while (!data_header.at_end()) {
+    read_raw_data_header(data_header, &header);
+    if (header.gather.empty()) {
+      ranges.push_back({ header.time, header.addr, header.num_bytes });
+    }
+    for (auto& r : header.gather) {
+      ranges.push_back({ header.time, r.first, r.second });
+    }
+  }
+  return ranges;
+}
+
+/**
+ * An index file holds the substream's block count and BlockIndexEntrys,
+ * followed by its time index count and TimeIndexEntrys.
+ */
+void TraceWriter::write_index(Substream s) {
+  ofstream out(index_path(s), ios::binary | ios::trunc);
+  auto& blocks = writer(s).block_index();
+  uint64_t count = blocks.size();
+  out.write((const char*)&count, sizeof(count));
+  out.write((const char*)blocks.data(), count * sizeof(blocks[0]));
+  auto& times = time_indexes[s];
+  count = times.size();
+  out.write((const char*)&count, sizeof(count));
+  out.write((const char*)times.data(), count * sizeof(times[0]));
+  if (!out.good()) {
+    LOG(warn) << "Failed to write " << index_path(s);
+  }
+}
+
+/**
+ * Streams blocks to the stdin of a shell command. The command is run as
+ * |sh -c <command> rr-upload <path>|, so it can find the name of the local
+ * substream file in $1.
+ */
+class CommandBlockSink : public CompressedWriter::BlockSink {
+public:
+  CommandBlockSink(const string& command, const string& path) : path(path) {
+    int fds[2];
+    // Use a socket rather than a pipe so that if the command dies, sending
+    // fails with EPIPE instead of killing us with SIGPIPE.
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+      FATAL() << "Failed to create upload socket for " << path;
+    }
+    pid = fork();
+    if (0 == pid) {
+      // dup2() clears close-on-exec on the new stdin.
+      dup2(fds[1], STDIN_FILENO);
+      execl("/bin/sh", "sh", "-c", command.c_str(), "rr-upload", path.c_str(),
+            (char*)nullptr);
+      _exit(EX_OSERR);
+    }
+    if (pid < 0) {
+      FATAL() << "Failed to fork upload command for " << path;
+    }
+    ::close(fds[1]);
+    sock = ScopedFd(fds[0]);
+  }
+
+  virtual ~CommandBlockSink() {
+    // EOF tells the command the stream is complete.
+    sock.close();
+    int status;
+    // If the scheduler's waitpid(-1) already reaped the command, it exited
+    // early and a write_block() has failed.
+    if (waitpid(pid, &status, 0) == pid &&
+        !(WIFEXITED(status) && 0 == WEXITSTATUS(status))) {
+      LOG(warn) << "Upload command for " << path << " failed with status "
+                << status;
+    }
+  }
+
+  virtual bool write_block(const void* data, size_t len) {
+    const char* p = static_cast<const char*>(data);
+    while (len > 0) {
+      ssize_t ret = send(sock, p, len, MSG_NOSIGNAL);
+      if (ret < 0) {
+        if (EINTR == errno) {
+          continue;
+        }
+        LOG(error) << "Upload command for " << path << " stopped reading";
+        return false;
+      }
+      p += ret;
+      len -= ret;
+    }
+    return true;
+  }
+
+private:
+  string path;
+  ScopedFd sock;
+  pid_t pid;
+};
+
+void TraceWriter::set_upload_command(const string& command,
+                                     size_t local_blocks) {
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    writer(s).set_sink(make_shared<CommandBlockSink>(command, path(s)),
+                       local_blocks);
+  }
+}
+
 void TraceWriter::close() {
-  for (auto& w : writers) {
-    w->close();
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    writer(s).close();
+    write_index(s);
+  }
+  write_metadata();
+  write_syscall_stats();
+  if (dedup_raw_data) {
+    LOG(info) << "Deduplicated " << deduped_bytes << " bytes of raw data";
   }
+  if (file_data_bytes) {
+    LOG(info) << "Recorded " << file_data_bytes
+              << " bytes of file data as references to the files";
+  }
+  LOG(info) << "Delta-encoded " << delta_sigframes << " signal frames";
 }
 
 static string make_trace_dir(const string& exe_path) {
@@ -396,7 +1877,18 @@ TraceWriter::TraceWriter(const vector<string>& argv, const vector<string>& envp,
     : TraceStream(make_trace_dir(argv[0]),
                   // Somewhat arbitrarily start the
                   // global time from 1.
-                  1) {
+                  1),
+      mmap_count(0),
+      dedup_raw_data(false),
+      raw_data_budget(UINT64_MAX),
+      file_data_bytes(0),
+      deduped_bytes(0),
+      delta_sigframes(0),
+      flush_interval(FLUSH_INTERVAL_SECS),
+      commit_interval(0),
+      pending_commit_time(0) {
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  last_flush_time = start_time;
   this->argv = argv;
   this->envp = envp;
   this->cwd = cwd;
@@ -404,7 +1896,25 @@ TraceWriter::TraceWriter(const vector<string>& argv, const vector<string>& envp,
 
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
     writers[s] = unique_ptr<CompressedWriter>(new CompressedWriter(
-        path(s), substream(s).block_size, substream(s).threads));
+        path(s), substream(s).block_size, compression_threads(s),
+        substream(s).codec, substream(s).level));
+  }
+  // Keep compression off the tracees' core, so it doesn't steal cycles
+  // from them, but on their package, so it reads their data from a
+  // shared cache.
+  cpu_set_t helper_cpus;
+  if (bind_to_cpu >= 0 && get_helper_cpus(bind_to_cpu, &helper_cpus)) {
+    for (auto& w : writers) {
+      w->set_thread_affinity(helper_cpus);
+    }
+    stringstream placement;
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+      if (CPU_ISSET(i, &helper_cpus)) {
+        placement << " " << i;
+      }
+    }
+    LOG(info) << "Tracees bound to CPU " << bind_to_cpu
+              << "; compression threads on CPUs" << placement.str();
   }
 
   string ver_path = version_path();
@@ -441,30 +1951,310 @@ TraceWriter::TraceWriter(const vector<string>& argv, const vector<string>& envp,
 }
 
 TraceFrame TraceReader::peek_frame() {
+  if (!decoded_frames.empty()) {
+    return decoded_frames.front();
+  }
   auto& events = reader(EVENTS);
   events.save_state();
   auto saved_time = global_time;
   TraceFrame frame;
   if (!at_end()) {
-    frame = read_frame();
+    frame = read_next_frame(false);
   }
   events.restore_state();
   global_time = saved_time;
   return frame;
 }
 
+template <typename T>
+static bool read_index_entries(ifstream& in, vector<T>* entries) {
+  uint64_t count;
+  in.read((char*)&count, sizeof(count));
+  if (!in.good()) {
+    return false;
+  }
+  entries->resize(count);
+  in.read((char*)entries->data(), count * sizeof(T));
+  return in.good();
+}
+
+bool TraceReader::load_indexes() {
+  if (indexes_loaded) {
+    return time_indexes[EVENTS] != nullptr;
+  }
+  indexes_loaded = true;
+
+  shared_ptr<const CompressedWriter::BlockIndex> blocks[SUBSTREAM_COUNT];
+  shared_ptr<const TimeIndex> times[SUBSTREAM_COUNT];
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    fetch_remote(index_path(s));
+    ifstream in(index_path(s), ios::binary);
+    auto b = make_shared<CompressedWriter::BlockIndex>();
+    auto t = make_shared<TimeIndex>();
+    if (!in.good() || !read_index_entries(in, b.get()) ||
+        !read_index_entries(in, t.get())) {
+      LOG(debug) << "No usable index " << index_path(s);
+      return false;
+    }
+    if (trace_version < TRACE_VERSION_WIDE_TIME) {
+      // Times were 32 bits, followed by padding we never initialized.
+      for (auto& e : *t) {
+        e.time &= 0xffffffff;
+      }
+    }
+    blocks[s] = b;
+    times[s] = t;
+  }
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    block_indexes[s] = blocks[s];
+    if (readers[s]) {
+      readers[s]->set_block_index(blocks[s]);
+    }
+    time_indexes[s] = times[s];
+  }
+  return true;
+}
+
+/**
+ * Return the size of the file at |path|, or 0 if it can't be stat'd.
+ */
+static uint64_t file_size(const string& path) {
+  struct stat st;
+  return stat(path.c_str(), &st) ? 0 : st.st_size;
+}
+
+bool TraceReader::recompress(Substream s, CompressedWriter::Codec codec,
+                             int level, uint64_t* old_bytes,
+                             uint64_t* new_bytes) {
+  if (remote) {
+    return false;
+  }
+  string file = path(s);
+  string tmp_file = file + ".tmp";
+  string index = index_path(s);
+  string tmp_index = index + ".tmp";
+  *old_bytes = file_size(file);
+
+  // The time index holds uncompressed offsets, so it stays valid; only
+  // the block index changes.
+  CompressedWriter::BlockIndex old_blocks;
+  TimeIndex times;
+  {
+    ifstream in(index, ios::binary);
+    if (!in.good() || !read_index_entries(in, &old_blocks) ||
+        !read_index_entries(in, &times)) {
+      times.clear();
+    }
+  }
+
+  {
+    CompressedReader in(file);
+    size_t block_size = substream(s).block_size;
+    uint64_t remaining = in.uncompressed_bytes();
+    CompressedWriter out(tmp_file, block_size, compression_threads(s), codec,
+                         level);
+    while (remaining > 0 && in.good() && out.good()) {
+      CompressedReader::Span span;
+      size_t len = min<uint64_t>(remaining, block_size);
+      if (!in.read_span(len, &span)) {
+        break;
+      }
+      out.write(span.data(), span.size());
+      remaining -= len;
+    }
+    out.close();
+    bool ok = remaining == 0 && in.good() && out.good();
+    if (ok) {
+      ofstream index_out(tmp_index, ios::binary | ios::trunc);
+      auto& blocks = out.block_index();
+      uint64_t count = blocks.size();
+      index_out.write((const char*)&count, sizeof(count));
+      index_out.write((const char*)blocks.data(), count * sizeof(blocks[0]));
+      count = times.size();
+      index_out.write((const char*)&count, sizeof(count));
+      index_out.write((const char*)times.data(), count * sizeof(times[0]));
+      ok = index_out.good();
+    }
+    if (!ok) {
+      LOG(warn) << "Failed to recompress " << file;
+      unlink(tmp_file.c_str());
+      unlink(tmp_index.c_str());
+      return false;
+    }
+  }
+
+  // Drop the old index first, so the trace never has an index that
+  // doesn't match its data.
+  if ((unlink(index.c_str()) && errno != ENOENT) ||
+      rename(tmp_file.c_str(), file.c_str()) ||
+      rename(tmp_index.c_str(), index.c_str())) {
+    LOG(warn) << "Failed to replace " << file;
+    unlink(tmp_file.c_str());
+    unlink(tmp_index.c_str());
+    return false;
+  }
+  *new_bytes = file_size(file);
+  return true;
+}
+
+void TraceReader::open_reader(Substream s) const {
+  if (remote) {
+    readers[s] = unique_ptr<CompressedReader>(
+        new CompressedReader(remote->open_file(substream(s).name)));
+  } else {
+    readers[s] = unique_ptr<CompressedReader>(new CompressedReader(path(s)));
+  }
+  if (following) {
+    string metadata = metadata_path();
+    readers[s]->follow(
+        [metadata]() { return access(metadata.c_str(), F_OK) == 0; });
+  }
+  if (commit_time) {
+    readers[s]->set_end(commit_offsets[s]);
+  }
+  if (block_indexes[s]) {
+    readers[s]->set_block_index(block_indexes[s]);
+  }
+}
+
+bool TraceReader::fetch_remote(const string& path) const {
+  string prefix = dir() + "/";
+  if (!remote || path.compare(0, prefix.size(), prefix)) {
+    return false;
+  }
+  return remote->fetch(path.substr(prefix.size()));
+}
+
+void TraceReader::prefetch_to(const TraceReader& other) {
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    // A substream |other| hasn't opened is still at its start.
+    if (other.readers[s]) {
+      reader(s).prefetch(other.readers[s]->file_offset());
+    }
+  }
+}
+
+void TraceReader::prefetch_start() {
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    reader(s).prefetch(0);
+  }
+}
+
+bool TraceReader::skip_to(TraceFrame::Time time) {
+  if (!load_indexes()) {
+    return false;
+  }
+
+  // Find the last indexed frame at or before 'time'.
+  auto& frames = *time_indexes[EVENTS];
+  auto frame = upper_bound(
+      frames.begin(), frames.end(), time,
+      [](TraceFrame::Time t, const TimeIndexEntry& e) { return t < e.time; });
+  if (frame == frames.begin()) {
+    return true;
+  }
+  --frame;
+  if (frame->time <= global_time + 1) {
+    return true;
+  }
+  if (!decoded_frames.empty()) {
+    if (frame->time <= decoded_frames.back().time() + 1) {
+      // Reading the decoded frames gets there.
+      return true;
+    }
+    decoded_frames.clear();
+  }
+
+  // Raw data for frame->time may start in an earlier block than the first
+  // indexed raw-data record with that time, so start from the last indexed
+  // record strictly before it and scan forward.
+  auto& records = *time_indexes[RAW_DATA_HEADER];
+  auto record = lower_bound(
+      records.begin(), records.end(), frame->time,
+      [](const TimeIndexEntry& e, TraceFrame::Time t) { return e.time < t; });
+  uint64_t header_offset = 0;
+  uint64_t data_offset = 0;
+  if (record != records.begin()) {
+    --record;
+    header_offset = record->offset;
+    data_offset = record->data_offset;
+  }
+
+  auto& data_header = reader(RAW_DATA_HEADER);
+  if (!reader(EVENTS).seek(frame->offset) ||
+      !data_header.seek(header_offset)) {
+    FATAL() << "Trace index doesn't match trace data";
+  }
+  while (!data_header.at_end()) {
+    data_header.save_state();
+    TraceFrame::Time record_time = read_record_time(data_header);
+    data_header.restore_state();
+    if (record_time >= frame->time) {
+      break;
+    }
+    RawDataHeader header;
+    read_raw_data_header(&header);
+    data_offset += header.inline_bytes();
+  }
+  if (!reader(RAW_DATA).seek(data_offset)) {
+    FATAL() << "Trace index doesn't match trace data";
+  }
+
+  global_time = frame->time - 1;
+  // The indexed frame is a key frame.
+  frame_history.clear();
+  pending_raw_data.clear();
+  return true;
+}
+
+vector<TraceFrame::Time> TraceReader::indexed_frame_times() {
+  vector<TraceFrame::Time> times;
+  if (load_indexes()) {
+    for (auto& e : *time_indexes[EVENTS]) {
+      times.push_back(e.time);
+    }
+  }
+  return times;
+}
+
 TraceFrame TraceReader::peek_to(pid_t pid, EventType type,
                                 SyscallEntryOrExit state) {
+  auto cached = peeked_frames.find(PeekKey(pid, type, state));
+  if (cached != peeked_frames.end()) {
+    if (cached->second.time() > time()) {
+      return cached->second;
+    }
+    peeked_frames.erase(cached);
+  }
+
+  // Remember |frame| for later searches, and return true if it's the one
+  // we're looking for.
+  auto passed = [&](const TraceFrame& frame) {
+    PeekKey key(frame.tid(), frame.event().type, frame.event().state);
+    auto it = peeked_frames.find(key);
+    if (it == peeked_frames.end()) {
+      peeked_frames.insert(make_pair(key, frame));
+    } else if (it->second.time() <= time()) {
+      it->second = frame;
+    }
+    return frame.tid() == pid && frame.event().type == type &&
+           frame.event().state == state;
+  };
+  for (auto& frame : decoded_frames) {
+    if (passed(frame)) {
+      return frame;
+    }
+  }
+
   auto& events = reader(EVENTS);
   TraceFrame frame;
   events.save_state();
-  auto saved_time = global_time;
-  while (good() && !at_end()) {
-    frame = read_frame();
-    if (frame.tid() == pid && frame.event().type == type &&
-        frame.event().state == state) {
+  auto saved_history = frame_history;
+  while (good() && !events.at_end()) {
+    frame = decode_next_frame(true);
+    if (passed(frame)) {
       events.restore_state();
-      global_time = saved_time;
+      frame_history = saved_history;
       return frame;
     }
   }
@@ -474,24 +2264,41 @@ TraceFrame TraceReader::peek_to(pid_t pid, EventType type,
 }
 
 void TraceReader::rewind() {
-  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
-    reader(s).rewind();
+  for (auto& r : readers) {
+    if (r) {
+      r->rewind();
+    }
   }
   global_time = 0;
+  frame_history.clear();
+  decoded_frames.clear();
+  peeked_frames.clear();
+  pending_raw_data.clear();
   assert(good());
 }
 
+static string reader_trace_dir(const string& dir) {
+  if (dir.empty()) {
+    return latest_trace_symlink();
+  }
+  auto remote = RemoteTrace::get(dir);
+  return remote ? remote->cache_dir() : dir;
+}
+
 TraceReader::TraceReader(const string& dir)
-    : TraceStream(dir.empty() ? latest_trace_symlink() : dir,
+    : TraceStream(reader_trace_dir(dir),
                   // Initialize the global time at 0, so
                   // that when we tick it when reading
                   // the first trace, it matches the
                   // initial global time at recording, 1.
-                  0) {
-  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
-    readers[s] = unique_ptr<CompressedReader>(new CompressedReader(path(s)));
-  }
-
+                  0),
+      remote(dir.empty() ? nullptr : RemoteTrace::get(dir)),
+      following(false),
+      commit_time(0),
+      indexes_loaded(false),
+      pending_raw_data_time(0) {
+  fetch_remote(version_path());
+  fetch_remote(args_env_path());
   string path = version_path();
   fstream vfile(path.c_str(), fstream::in);
   if (!vfile.good()) {
@@ -510,7 +2317,9 @@ TraceReader::TraceReader(const string& dir)
   }
   int version = 0;
   vfile >> version;
-  if (vfile.fail() || TRACE_VERSION != version) {
+  trace_version = version;
+  if (vfile.fail() || version < TRACE_VERSION_MIN_COMPATIBLE ||
+      version > TRACE_VERSION) {
     fprintf(stderr, "\n"
                     "rr: error: Recorded trace `%s' has an incompatible "
                     "version %d; expected\n"
@@ -532,6 +2341,37 @@ TraceReader::TraceReader(const string& dir)
   in >> argv;
   in >> envp;
   in >> bind_to_cpu;
+
+  // The recorder writes the metadata when it closes the trace.
+  if (Flags::get().follow_trace && !remote &&
+      access(metadata_path().c_str(), F_OK)) {
+    LOG(info) << "Following " << dir << " while it's being recorded";
+    following = true;
+  }
+  if (!following) {
+    read_commit();
+  }
+}
+
+void TraceReader::read_commit() {
+  fetch_remote(metadata_path());
+  if (access(metadata_path().c_str(), F_OK) == 0) {
+    // Recording finished, so every substream is complete.
+    return;
+  }
+  fetch_remote(commit_path());
+  ifstream in(commit_path());
+  TraceFrame::Time time;
+  in >> time;
+  for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
+    in >> commit_offsets[s];
+  }
+  if (in.fail() || time == 0) {
+    return;
+  }
+  LOG(info) << "Recording of " << dir() << " didn't finish; reading up to "
+            << "committed event " << time;
+  commit_time = time;
 }
 
 /**
@@ -540,10 +2380,25 @@ TraceReader::TraceReader(const string& dir)
  * clone won't affect the state of 'other' (and vice versa).
  */
 TraceReader::TraceReader(const TraceReader& other)
-    : TraceStream(other.dir(), other.time()) {
+    : TraceStream(other.dir(), other.time()),
+      remote(other.remote),
+      following(other.following),
+      commit_time(other.commit_time),
+      indexes_loaded(other.indexes_loaded),
+      pending_raw_data(other.pending_raw_data),
+      pending_raw_data_time(other.pending_raw_data_time),
+      trace_version(other.trace_version),
+      frame_history(other.frame_history),
+      decoded_frames(other.decoded_frames),
+      peeked_frames(other.peeked_frames) {
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
-    readers[s] =
-        unique_ptr<CompressedReader>(new CompressedReader(other.reader(s)));
+    if (other.readers[s]) {
+      readers[s] =
+          unique_ptr<CompressedReader>(new CompressedReader(*other.readers[s]));
+    }
+    block_indexes[s] = other.block_indexes[s];
+    commit_offsets[s] = other.commit_offsets[s];
+    time_indexes[s] = other.time_indexes[s];
   }
 
   argv = other.argv;
@@ -552,6 +2407,19 @@ TraceReader::TraceReader(const TraceReader& other)
   bind_to_cpu = other.bind_to_cpu;
 }
 
+bool TraceReader::read_substream(Substream s, uint64_t max_bytes,
+                                 vector<uint8_t>* data,
+                                 uint64_t* total_bytes) {
+  if (remote) {
+    return false;
+  }
+  CompressedReader in(path(s));
+  *total_bytes = in.uncompressed_bytes();
+  size_t len = min(*total_bytes, max_bytes);
+  data->resize(len);
+  return in.good() && in.read(data->data(), len);
+}
+
 uint64_t TraceReader::uncompressed_bytes() const {
   uint64_t total = 0;
   for (Substream s = SUBSTREAM_FIRST; s < SUBSTREAM_COUNT; ++s) {
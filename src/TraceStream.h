@@ -3,10 +3,18 @@
 #ifndef RR_TRACE_H_
 #define RR_TRACE_H_
 
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
+#include <deque>
+#include <functional>
+#include <map>
 #include <memory>
 #include <string>
+#include <tuple>
+#include <unordered_map>
 #include <vector>
 
 #include "CompressedReader.h"
@@ -16,6 +24,9 @@
 #include "TraceFrame.h"
 #include "TraceMappedRegion.h"
 #include "TraceTaskEvent.h"
+#include "util.h"
+
+class RemoteTrace;
 
 /**
  * TraceStream stores all the data common to both recording and
@@ -38,7 +49,11 @@ public:
     // Substream that stores events (trace frames).
     EVENTS = SUBSTREAM_FIRST,
     // Substreams that store raw data saved from tracees (|RAW_DATA|), and
-    // metadata about the stored data (|RAW_DATA_HEADER|).
+    // metadata about the stored data (|RAW_DATA_HEADER|). All tasks share
+    // them: the recorder is the single producer thread for every writer,
+    // and RAW_DATA is already compressed by a pool of threads, so
+    // per-process streams wouldn't write any faster. Replay reads the
+    // records in event order whichever process they belong to.
     RAW_DATA_HEADER,
     RAW_DATA,
     // Substream that stores metadata about files mmap'd during
@@ -57,6 +72,7 @@ public:
   const std::vector<string>& initial_envp() const { return envp; }
   const string& initial_cwd() const { return cwd; }
   int bound_to_cpu() const { return bind_to_cpu; }
+  void set_bound_to_cpu(int cpu) { bind_to_cpu = cpu; }
 
   /**
    * Return the current "global time" (event count) for this
@@ -64,6 +80,26 @@ public:
    */
   TraceFrame::Time time() const { return global_time; }
 
+  /**
+   * Raw data records bigger than this are recorded and replayed through a
+   * buffer of this size, so rr's memory use doesn't grow with the size of
+   * the tracee's reads. A multiple of RAW_DATA_CHUNK_SIZE.
+   */
+  static const size_t RAW_DATA_PIECE_SIZE = 1024 * 1024;
+
+  /**
+   * Return the name of the file of substream |s|.
+   */
+  static const char* substream_name(Substream s);
+  /**
+   * Return the block size, compression thread count, codec and level that
+   * substream |s| is recorded with.
+   */
+  static size_t substream_block_size(Substream s);
+  static int substream_compression_threads(Substream s);
+  static CompressedWriter::Codec substream_codec(Substream s);
+  static int substream_level(Substream s);
+
 protected:
   TraceStream(const string& trace_dir, TraceFrame::Time initial_time)
       : trace_dir(trace_dir), global_time(initial_time) {}
@@ -72,6 +108,12 @@ protected:
    * Return the path of the file for the given substream.
    */
   string path(Substream s);
+  /**
+   * Return the path of the sidecar block index for the given substream.
+   * It's written when the trace is closed, so it's absent for traces
+   * whose recording didn't finish cleanly.
+   */
+  string index_path(Substream s) { return path(s) + ".index"; }
 
   /**
    * Return the path of the "args_env" file, into which the
@@ -84,12 +126,104 @@ protected:
    * trace.
    */
   string version_path() const { return trace_dir + "/version"; }
+  /**
+   * Return the path of the "metadata" file, which summarizes the
+   * processes in the trace. It's written when recording finishes.
+   */
+  string metadata_path() const { return trace_dir + "/metadata"; }
+  /**
+   * Return the path of the "syscall_stats" file, which summarizes how
+   * each syscall was recorded. It's written when recording finishes.
+   */
+  string syscall_stats_path() const { return trace_dir + "/syscall_stats"; }
+  /**
+   * Return the path of the "commit" file, which records a point up to
+   * which every substream had reached the disk. It's only written when
+   * recording with a commit interval, and is replaced as recording goes.
+   */
+  string commit_path() const { return trace_dir + "/commit"; }
 
   /**
    * Increment the global time and return the incremented value.
    */
   void tick_time() { ++global_time; }
 
+  /**
+   * Locates the first record (trace frame or raw-data header) that starts
+   * in a block, so readers can seek by time. Only EVENTS and
+   * RAW_DATA_HEADER have time indexes.
+   */
+  struct TimeIndexEntry {
+    TraceFrame::Time time;
+    // Offset of the record in its substream's uncompressed data.
+    uint64_t offset;
+    // For RAW_DATA_HEADER, the offset of the record's data in RAW_DATA.
+    uint64_t data_offset;
+  };
+  typedef std::vector<TimeIndexEntry> TimeIndex;
+
+  /**
+   * What trace frames are delta-encoded against: the previous frame's
+   * time, and for each tid its last ticks and its last frame with exec
+   * info. Cleared at each key frame, so decoding can start there.
+   */
+  struct FrameHistory {
+    struct Tid {
+      Tid() : ticks(0), has_exec_info(false) {}
+      Ticks ticks;
+      bool has_exec_info;
+      TraceFrame exec_frame;
+    };
+    FrameHistory() : last_time(0) {}
+    void clear() {
+      last_time = 0;
+      tids.clear();
+    }
+
+    TraceFrame::Time last_time;
+    std::unordered_map<pid_t, Tid> tids;
+  };
+
+  /**
+   * When raw-data deduplication is enabled, records of at least this many
+   * bytes are split into chunks of this size. Each full chunk whose
+   * contents were already stored is replaced by a reference to the
+   * earlier copy.
+   */
+  static const size_t RAW_DATA_CHUNK_SIZE = 4096;
+  /**
+   * Chunk reference meaning "the chunk's data follows in RAW_DATA".
+   * Other values are the chunk's offset in the uncompressed RAW_DATA
+   * stream.
+   */
+  static const uint64_t CHUNK_INLINE = UINT64_MAX;
+  /**
+   * Chunk count meaning the record's data is stored in RAW_DATA XORed
+   * with an earlier inline record of the same length, whose offset in the
+   * uncompressed RAW_DATA stream follows in the header.
+   */
+  static const uint32_t RAW_DATA_DELTA = UINT32_MAX;
+  /**
+   * Chunk count meaning the record holds the data of several ranges,
+   * concatenated inline in RAW_DATA. A table of the ranges follows in the
+   * header.
+   */
+  static const uint32_t RAW_DATA_GATHER = UINT32_MAX - 1;
+  /**
+   * Chunk count meaning the record's data wasn't saved, because it was
+   * read from a file that won't change. The file's name, the offset the
+   * data was read from, and the file's size and mtime follow in the
+   * header.
+   */
+  static const uint32_t RAW_DATA_FILE = UINT32_MAX - 2;
+  /**
+   * Chunk count meaning the record's data is an earlier inline record of
+   * the same length with some runs of bytes replaced. The base's offset in
+   * the uncompressed RAW_DATA stream and the runs' offsets and lengths
+   * follow in the header, and the runs' new bytes follow in RAW_DATA.
+   */
+  static const uint32_t RAW_DATA_PATCH = UINT32_MAX - 3;
+
   // Directory into which we're saving the trace files.
   string trace_dir;
   // The initial argv and envp for a tracee.
@@ -105,13 +239,83 @@ protected:
   TraceFrame::Time global_time;
 };
 
+/**
+ * A summary of a finished trace, so commands like `rr ps` don't have to
+ * read all of TASKS.
+ */
+struct TraceMetadata {
+  struct Process {
+    pid_t pid;
+    // 0 for the initial process.
+    pid_t ppid;
+    bool execed;
+    // The first command line the process exec'd, if |execed|.
+    std::vector<std::string> cmd_line;
+    // -1 if the process didn't exit via exit/exit_group.
+    int exit_code;
+  };
+  // In creation order.
+  std::vector<Process> processes;
+  TraceFrame::Time num_events;
+  // Wall-clock seconds the recording took.
+  double duration;
+};
+
+/**
+ * How the recorder handled each syscall the tracees made: how many calls
+ * the preload library buffered, and how many trapped to rr and how long
+ * rr took over each. A trapped syscall is timed from when rr sees its
+ * entry stop until rr has recorded its exit, so the time the tracee
+ * spends waiting for rr to notice each of the two stops isn't included
+ * (`rr host-bench' measures that). Buffered syscalls run at close to
+ * native speed and aren't timed, since timing them from the tracee would
+ * take syscalls that replay would have to reproduce.
+ */
+struct TraceSyscallStats {
+  /**
+   * A log2 histogram of trapped syscall times, like
+   * Session::TimeHistogram: bucket i counts times of at least 2^i and less
+   * than 2^(i+1) microseconds.
+   */
+  enum {
+    BUCKETS = 24
+  };
+  struct Syscall {
+    Syscall() : buffered(0), trapped(0), trapped_seconds(0) {
+      memset(buckets, 0, sizeof(buckets));
+    }
+    uint64_t buffered;
+    uint64_t trapped;
+    double trapped_seconds;
+    uint64_t buckets[BUCKETS];
+  };
+  void add_buffered(SupportedArch arch, int syscallno) {
+    ++syscalls[std::make_pair(arch, syscallno)].buffered;
+  }
+  void add_trapped(SupportedArch arch, int syscallno, double seconds);
+
+  // Keyed by the tracee architecture and syscall number.
+  std::map<std::pair<SupportedArch, int>, Syscall> syscalls;
+};
+
+/**
+ * Writes a trace. A trace can only be replayed from its start: replay
+ * rebuilds tracee state by re-executing the recording from the initial
+ * exec, and later records refer back to earlier ones (delta frames,
+ * deduplicated chunks, mapped files saved at mmap time). So no prefix of
+ * a trace can be dropped while recording; keeping only a recent window
+ * would need snapshots of the whole process tree that replay could start
+ * from instead.
+ */
 class TraceWriter : public TraceStream {
 public:
   /**
    * Write trace frame to the trace.
    *
    * Recording a trace frame has the side effect of ticking
-   * the global time.
+   * the global time. Buffered trace data is flushed to the trace files
+   * at least every FLUSH_INTERVAL_SECS of frames, for readers following
+   * the trace, or more often with set_commit_interval().
    */
   void write_frame(const TraceFrame& frame);
 
@@ -123,9 +327,12 @@ public:
    * Write TraceMappedRegion record to the trace.
    * If this returns RECORD_IN_TRACE, then the data for the map should be
    * recorded in the trace raw-data.
+   * For a SysV shm segment that was recorded in full at an earlier attach,
+   * |changes_only| says that only the pages that changed since then will be
+   * recorded.
    */
   RecordInTrace write_mapped_region(const TraceMappedRegion& map, int prot,
-                                    int flags);
+                                    int flags, bool changes_only = false);
 
   /**
    * Write a raw-data record to the trace.
@@ -133,17 +340,126 @@ public:
    * restored to.
    */
   void write_raw(const void* data, size_t len, remote_ptr<void> addr);
+  /**
+   * Like write_raw(), but 'fill' produces the data straight into the trace
+   * buffers, e.g. by reading it from the tracee, so it isn't copied
+   * through a temporary buffer first.
+   */
+  void write_raw_filled(size_t len, remote_ptr<void> addr,
+                        const CompressedWriter::Filler& fill);
+
+  /**
+   * Write the signal frame for a delivery of |sig| to |tid| as a raw-data
+   * record. Programs driven by timer signals deliver the same signal over
+   * and over with nearly identical frames, so when this task's previous
+   * frame for |sig| was at the same address, only the runs of bytes that
+   * differ from that frame are stored.
+   */
+  void write_sigframe(pid_t tid, int sig, const void* data, size_t len,
+                      remote_ptr<void> addr);
+
+  struct GatherRange {
+    remote_ptr<void> addr;
+    size_t num_bytes;
+  };
+  /**
+   * Write the data of |ranges|, concatenated in |data|, as a single
+   * raw-data record. Readers see one record per range, in order.
+   */
+  void write_raw_gather(const void* data,
+                        const std::vector<GatherRange>& ranges);
+
+  /**
+   * Write a raw-data record for |len| bytes that were read into |addr|
+   * from |file_name|, at |offset|, by referring to the file instead of
+   * saving the data. |file_name| must be a file that won't change, see
+   * is_immutable_file(); replay checks that its size and mtime are still
+   * those in |st|.
+   */
+  void write_raw_file_data(size_t len, remote_ptr<void> addr,
+                           const string& file_name, uint64_t offset,
+                           const struct stat& st);
+
+  /**
+   * Store each distinct RAW_DATA_CHUNK_SIZE chunk of raw data only once.
+   */
+  void set_dedup_raw_data(bool dedup) { dedup_raw_data = dedup; }
+
+  /**
+   * Once |bytes| bytes of raw data have been stored, data read from files
+   * that won't change should be recorded with write_raw_file_data().
+   */
+  void set_raw_data_budget(uint64_t bytes) { raw_data_budget = bytes; }
+  bool over_raw_data_budget() const {
+    return writer(RAW_DATA).uncompressed_offset() >= raw_data_budget;
+  }
+
+  /**
+   * Keep copies of mapped files that can't be hardlinked into the trace,
+   * and snapshots of private mappings, in |store_dir| (e.g. ~/.rr/objects)
+   * instead, named by a hash of their contents, so that traces of the same
+   * binaries share them. `rr pack` copies a trace's objects into it.
+   */
+  void set_object_store(const string& store_dir);
+
+  /**
+   * Stream every substream block to a shell command as soon as it's
+   * written. One instance of |command| runs per substream and reads the
+   * substream file's contents on stdin; the file's local path is in $1.
+   * Only the most recent |local_blocks| blocks of each substream are kept
+   * on local disk (0 keeps everything). Call before recording starts.
+   */
+  void set_upload_command(const string& command, size_t local_blocks);
 
   /**
    * Write a task event (clone or exec record) to the trace.
    */
   void write_task_event(const TraceTaskEvent& event);
 
+  /**
+   * Note that task |tid|'s process is exiting with |exit_code|, for the
+   * metadata summary.
+   */
+  void note_exit_code(pid_t tid, int exit_code);
+
   /**
    * Return true iff all trace files are "good".
    */
   bool good() const;
 
+  /**
+   * Total number of times, and seconds, the recorder spent blocked on the
+   * compression threads of all trace files.
+   */
+  uint64_t compression_wait_count() const;
+  double compression_wait_time() const;
+  /**
+   * Print each trace file's compression throughput and ratio, per
+   * compression thread, and how long the recorder waited for them.
+   */
+  void print_compression_stats(FILE* out) const;
+
+  /**
+   * Compress faster when the recorder keeps waiting for the compression
+   * threads. See CompressedWriter::set_adaptive_level().
+   */
+  void set_adaptive_compression(bool adaptive);
+
+  /**
+   * Make the trace replayable up to a recent event even if recording is
+   * cut off by a crash: seal every substream at an event boundary often
+   * enough that the data up to it reaches the disk within about |secs|,
+   * and once it has, record that point in commit_path(). The I/O threads
+   * sync the files; the recorder never waits for them. Call before
+   * anything has been written.
+   */
+  void set_commit_interval(double secs);
+
+  /**
+   * Per-syscall statistics, written to syscall_stats_path() by close().
+   */
+  TraceSyscallStats& syscall_stats() { return syscall_stats_; }
+
   /** Call close() on all the relevant trace files.
    *  Normally this will be called by the destructor. It's helpful to
    *  call this before a crash that won't call the destructor, to ensure
@@ -164,22 +480,120 @@ public:
 
 private:
   std::string try_hardlink_file(const std::string& file_name);
+  /**
+   * Try to save the part of the file that |map| maps into the trace
+   * directory without reading it ourselves, by reflinking the whole file
+   * or with copy_file_range. Returns the snapshot's name relative to the
+   * trace directory, or an empty string if that's not possible.
+   */
+  std::string try_snapshot_file(const TraceMappedRegion& map);
+  /**
+   * Try to copy the whole file that |map| maps into the object store.
+   * Returns the object's absolute path, or an empty string on failure.
+   */
+  std::string try_store_object(const TraceMappedRegion& map);
+  /**
+   * Add a time index entry for a record about to be written to 's' if
+   * it's the first record starting in the current block. Returns true if
+   * an entry was added.
+   */
+  bool index_time(Substream s, TraceFrame::Time time, uint64_t data_offset);
+  void write_index(Substream s);
+  // Write a raw-data record whose data is all inline in RAW_DATA.
+  void write_raw_inline(const void* data, size_t len, remote_ptr<void> addr);
+  // Deduplicate |len| bytes of a chunked record, starting at a chunk
+  // boundary, writing new chunks to RAW_DATA and appending each chunk's
+  // reference to |chunks|.
+  void write_raw_chunks(const uint8_t* bytes, size_t len,
+                        std::vector<uint64_t>& chunks);
 
   CompressedWriter& writer(Substream s) { return *writers[s]; }
   const CompressedWriter& writer(Substream s) const { return *writers[s]; }
 
   std::unique_ptr<CompressedWriter> writers[SUBSTREAM_COUNT];
+  TimeIndex time_indexes[SUBSTREAM_COUNT];
   uint32_t mmap_count;
+  // How we stored each file we've seen mapped: whether its data went into
+  // the trace, and otherwise the file replay maps it from. Keyed by the
+  // file's device, inode, mtime and ctime, its name, and whether the
+  // mapping was private and executable, which is everything
+  // should_copy_mmap_region() looks at. Build systems map the same
+  // binaries and libraries over and over.
+  typedef std::tuple<dev_t, ino_t, time_t, time_t, std::string, bool, bool>
+      MappedFileKey;
+  struct MappedFile {
+    bool copy;
+    // True if |backing_file_name| is in the object store.
+    bool stored;
+    std::string backing_file_name;
+  };
+  std::map<MappedFileKey, MappedFile> mapped_files;
+  std::string object_store;
+  bool dedup_raw_data;
+  uint64_t raw_data_budget;
+  uint64_t file_data_bytes;
+  // Offset in RAW_DATA of the first copy of each chunk we've stored.
+  std::unordered_map<Hash128, uint64_t, Hash128::Hasher> chunk_offsets;
+  uint64_t deduped_bytes;
+  // Every indexed frame is a key frame.
+  FrameHistory frame_history;
+  // Scratch space for encoding frames.
+  std::vector<uint8_t> frame_buffer;
+  // The extra-register byte ranges recorded for the last frame.
+  std::vector<std::pair<size_t, size_t> > xsave_ranges;
+  // The signal frame each (tid, signal) pair's deltas are encoded against.
+  struct SigframeBase {
+    remote_ptr<void> addr;
+    // Offset in RAW_DATA of the inline copy of |data|.
+    uint64_t offset;
+    std::vector<uint8_t> data;
+  };
+  std::map<std::pair<pid_t, int>, SigframeBase> sigframe_bases;
+  // The (offset, length) runs of the frame being written that differ
+  // from its base.
+  std::vector<std::pair<size_t, size_t> > sigframe_runs;
+  uint64_t delta_sigframes;
+
+  // Update |metadata| for |event|, and write it to metadata_path().
+  void update_metadata(const TraceTaskEvent& event);
+  void write_metadata();
+  void write_syscall_stats();
+  TraceMetadata metadata;
+  TraceSyscallStats syscall_stats_;
+  // The process each live tid belongs to.
+  std::unordered_map<pid_t, pid_t> tid_to_pid;
+  // Index in |metadata.processes| of the latest process with each pid, and
+  // whether its main thread has exited, after which it can't exec.
+  std::unordered_map<pid_t, std::pair<size_t, bool> > process_index;
+  struct timespec start_time;
+
+  // Flush every substream if it's been |flush_interval| seconds since we
+  // last did.
+  void flush_if_stale();
+  struct timespec last_flush_time;
+  double flush_interval;
+
+  // Write the pending commit once every substream has reached the disk
+  // up to it.
+  void maybe_write_commit();
+  // Zero when commits aren't being written.
+  double commit_interval;
+  // The last frame, and each substream's offset after it, of the commit
+  // waiting for the I/O threads. |pending_commit_time| is 0 if there's
+  // none.
+  TraceFrame::Time pending_commit_time;
+  uint64_t pending_commit_offsets[SUBSTREAM_COUNT];
 };
 
 class TraceReader : public TraceStream {
 public:
   /**
    * A parcel of recorded tracee data.  |data| contains the data read
-   * from |addr| in the tracee.
+   * from |addr| in the tracee. It usually points straight into a
+   * decompressed trace block, so prefer not to keep RawData around.
    */
   struct RawData {
-    std::vector<uint8_t> data;
+    CompressedReader::Span data;
     remote_ptr<void> addr;
   };
 
@@ -192,10 +606,28 @@ public:
    */
   TraceFrame read_frame();
 
+  /**
+   * Decode up to |max_frames| of the frames after the current position
+   * ahead of time, keeping at most |max_queued| decoded frames, so that
+   * read_frame() and peek_frame() can return them without decoding them.
+   * Replay calls this while the tracee runs. Does nothing when following
+   * a trace that's being recorded, where decoding could wait for the
+   * recorder.
+   */
+  void decode_ahead(size_t max_frames, size_t max_queued);
+
   enum MappedDataSource {
     SOURCE_TRACE,
     SOURCE_FILE,
-    SOURCE_ZERO
+    SOURCE_ZERO,
+    // Like SOURCE_FILE, but the file is a copy of the recorded file's
+    // contents saved in the trace directory or an object store, not the
+    // file itself.
+    SOURCE_SNAPSHOT,
+    // A SysV shm segment whose contents were recorded at an earlier attach.
+    // The raw-data records of the attach's frame that fall in the segment
+    // are the pages that have changed since.
+    SOURCE_TRACE_CHANGES
   };
   /**
    * Where to obtain data for the mapped region.
@@ -206,6 +638,11 @@ public:
     string file_name;
     /** Data offset in pages within the file. */
     uint64_t file_data_offset_pages;
+    /**
+     * True if |file_name| is an absolute path recorded in the trace that
+     * hasn't been packed, so the trace can't be moved without it.
+     */
+    bool unpacked;
   };
   /**
    * Read the next mapped region descriptor and return it.
@@ -219,6 +656,27 @@ public:
    */
   TraceTaskEvent read_task_event();
 
+  /**
+   * Read the trace's metadata summary. Returns false if there isn't one,
+   * i.e. recording didn't finish cleanly or the trace is from an older
+   * rr; then read the TASKS substream instead.
+   */
+  bool read_metadata(TraceMetadata* metadata);
+
+  /**
+   * If recording was cut off after writing a commit record, reading the
+   * trace stops at the last committed frame, the end of what's known to
+   * be intact. Returns that frame's time, or 0 if reading isn't limited.
+   */
+  TraceFrame::Time committed_time() const { return commit_time; }
+
+  /**
+   * Read the per-syscall recording statistics. Returns false if there
+   * aren't any, because recording didn't finish cleanly or the trace is
+   * from an older rr.
+   */
+  bool read_syscall_stats(TraceSyscallStats* stats);
+
   /**
    * Read the next raw data record and return it.
    */
@@ -231,6 +689,37 @@ public:
    */
   bool read_raw_data_for_frame(const TraceFrame& frame, RawData& d);
 
+  typedef std::function<void(const RawData& piece)> RawDataPieceFn;
+  /**
+   * Like read_raw_data(), but instead of returning the record, pass its
+   * data to |fn| in consecutive pieces of at most RAW_DATA_PIECE_SIZE
+   * bytes, each with the tracee address it belongs at, so that huge
+   * records are never held in memory all at once. Delta and gathered
+   * records are small and come as one piece. |fn| isn't called for empty
+   * records. Returns the record's size.
+   */
+  size_t read_raw_data_pieces(const RawDataPieceFn& fn);
+  /**
+   * read_raw_data_for_frame() for read_raw_data_pieces().
+   */
+  bool read_raw_data_pieces_for_frame(const TraceFrame& frame,
+                                      const RawDataPieceFn& fn);
+
+  /**
+   * Where and when a raw data record was saved, without its data.
+   */
+  struct RawDataRange {
+    TraceFrame::Time time;
+    remote_ptr<void> addr;
+    size_t num_bytes;
+  };
+  /**
+   * Return the range of every raw data record in the trace, in trace
+   * order. Only RAW_DATA_HEADER is read, and this reader's position is
+   * unchanged.
+   */
+  std::vector<RawDataRange> read_raw_data_ranges() const;
+
   /**
    * Return true iff all trace files are "good".
    * for more details.
@@ -240,7 +729,29 @@ public:
   /**
    * Return true if we're at the end of the trace file.
    */
-  bool at_end() const { return reader(EVENTS).at_end(); }
+  bool at_end() const {
+    return decoded_frames.empty() && reader(EVENTS).at_end();
+  }
+  bool mmaps_at_end() const { return reader(MMAPS).at_end(); }
+
+  /**
+   * Where `rr pack` puts its copy of |file_name|, the absolute path of a
+   * file outside the trace directory that MMAPS refers to. The reader
+   * uses the copy instead when it exists.
+   */
+  string packed_file_path(const string& file_name) const;
+
+  /**
+   * Return true if the trace records scratch memory once per address
+   * space instead of once per task.
+   */
+  bool scratch_per_address_space() const;
+
+  /**
+   * Return true if successful poll()s record only their ready entries, as
+   * arrays of poll_ready_entry.
+   */
+  bool compact_poll_results() const;
 
   /**
    * Return the next trace frame, without mutating any stream
@@ -252,9 +763,44 @@ public:
    * Peek ahead in the stream to find the next trace frame that
    * matches the requested parameters. Returns the frame if one
    * was found, and issues a fatal error if not.
+   * Every frame the search passes is remembered as the next occurrence of
+   * its (tid, type, state), so later searches for those are lookups until
+   * the stream reaches them.
    */
   TraceFrame peek_to(pid_t pid, EventType type, SyscallEntryOrExit state);
 
+  /**
+   * Reposition the EVENTS and raw-data substreams so that reading
+   * continues at, or a little before, the frame at 'time', using the
+   * sidecar block indexes. Only whole blocks before the target are
+   * skipped, so callers must still read frames up to 'time'. The other
+   * substreams aren't moved, so this is only useful for tools that inspect
+   * frames, not for replay. Never moves backwards.
+   * Returns false if the trace has no index; the stream is unchanged.
+   */
+  bool skip_to(TraceFrame::Time time);
+  /**
+   * Return the times of the frames skip_to() can reposition the stream to,
+   * in increasing order. Frames from each of these times on can be decoded
+   * without reading any earlier frames. Returns an empty vector if the
+   * trace has no index.
+   */
+  std::vector<TraceFrame::Time> indexed_frame_times();
+
+  /**
+   * Hint that this reader is about to replay forward to where 'other' (a
+   * reader of the same trace) is now, so trace data for that range should
+   * be read and decompressed ahead of time.
+   */
+  void prefetch_to(const TraceReader& other);
+
+  /**
+   * Start reading and decompressing the beginning of the trace in the
+   * background, so it's ready by the time replay of the initial exec
+   * needs it.
+   */
+  void prefetch_start();
+
   /**
    * Restore the state of this to what it was just after
    * |open()|.
@@ -264,6 +810,30 @@ public:
   uint64_t uncompressed_bytes() const;
   uint64_t compressed_bytes() const;
 
+  /**
+   * Rewrite the file of substream |s| with |codec| at |level| (0 meaning
+   * the codec's default), keeping its uncompressed contents and block
+   * size, and rewrite its sidecar index to match. Traces without an index
+   * get one with an empty time index, so the blocks can be seeked but
+   * there are no key frames to start decoding at. The new files are
+   * renamed into place, so an interrupted rewrite leaves a trace that
+   * replays, at worst without its index. Only for local traces, and not
+   * while the trace is being recorded or replayed. Different substreams
+   * can be rewritten on different threads at once.
+   * Returns false on failure. Sets |*old_bytes| and |*new_bytes| to the
+   * file's size before and after.
+   */
+  bool recompress(Substream s, CompressedWriter::Codec codec, int level,
+                  uint64_t* old_bytes, uint64_t* new_bytes);
+
+  /**
+   * Read up to |max_bytes| of substream |s|, from its start, into |data|,
+   * without moving this reader. Sets |*total_bytes| to the substream's
+   * uncompressed size. Only for local traces. Returns false on failure.
+   */
+  bool read_substream(Substream s, uint64_t max_bytes,
+                      std::vector<uint8_t>* data, uint64_t* total_bytes);
+
   /**
    * Open the trace in 'dir'. When 'dir' is the empty string, open the
    * latest trace.
@@ -278,10 +848,113 @@ public:
   TraceReader(const TraceReader& other);
 
 private:
-  CompressedReader& reader(Substream s) { return *readers[s]; }
-  const CompressedReader& reader(Substream s) const { return *readers[s]; }
+  // Substreams are opened the first time they're used, so commands that
+  // only look at one or two of them don't pay for the rest.
+  CompressedReader& reader(Substream s) const {
+    if (!readers[s]) {
+      open_reader(s);
+    }
+    return *readers[s];
+  }
+  void open_reader(Substream s) const;
+  /**
+   * If this is a remote trace and |path| is in its cache directory, fetch
+   * the file there if we haven't already. Returns true if |path| is now a
+   * copy fetched from the server.
+   */
+  bool fetch_remote(const string& path) const;
 
-  std::unique_ptr<CompressedReader> readers[SUBSTREAM_COUNT];
+  /**
+   * Load the sidecar indexes if we haven't already. Returns false if any
+   * are missing or malformed.
+   */
+  bool load_indexes();
+
+  struct RawDataHeader {
+    TraceFrame::Time time;
+    remote_ptr<void> addr;
+    size_t num_bytes;
+    // Empty if the record isn't chunked, i.e. all its data is inline.
+    std::vector<uint64_t> chunks;
+    // For delta records, the RAW_DATA offset of the data they're XORed
+    // with. For patch records, the RAW_DATA offset of the data they patch.
+    bool is_delta;
+    uint64_t delta_base;
+    // For patch records, the offset and length of each run of bytes that
+    // replaces the base's.
+    bool is_patch;
+    std::vector<std::pair<size_t, size_t> > patches;
+    // For gathered records, the address and length of each range. |addr|
+    // and |num_bytes| are those of the whole record.
+    std::vector<std::pair<remote_ptr<void>, size_t> > gather;
+    // For records of file data, where the data is in which file, and the
+    // file's size and mtime when it was read.
+    std::string file_name;
+    uint64_t file_offset;
+    int64_t file_size;
+    int64_t file_mtime_sec;
+    int64_t file_mtime_nsec;
+    // The number of bytes of this record stored inline in RAW_DATA.
+    size_t inline_bytes() const;
+  };
+  void read_raw_data_header(RawDataHeader* header) {
+    read_raw_data_header(reader(RAW_DATA_HEADER), header);
+  }
+  // Read the time that starts a raw-data header.
+  TraceFrame::Time read_record_time(CompressedReader& data_header) const;
+  void read_raw_data_header(CompressedReader& data_header,
+                            RawDataHeader* header) const;
+  // Read a frame from a trace older than TRACE_VERSION_DELTA_FRAMES.
+  void read_fixed_frame(TraceFrame* frame);
+  // If update_history is false, frame_history is left untouched.
+  void read_delta_frame(TraceFrame* frame, bool update_history);
+  // Decode the next frame of EVENTS without ticking the global time.
+  TraceFrame decode_next_frame(bool update_history);
+  TraceFrame read_next_frame(bool update_history);
+  // Read |len| bytes at |offset| in the data of a record that refers to a
+  // file.
+  CompressedReader::Span read_file_data(const RawDataHeader& header,
+                                        size_t offset, size_t len);
+  // Returns true if the next raw data record is for |frame|, skipping
+  // records for earlier frames.
+  bool next_raw_data_is_for_frame(const TraceFrame& frame);
+  // Reader used to fetch deduplicated chunks from earlier in RAW_DATA.
+  CompressedReader& chunk_reader();
+
+  // Set if we're replaying a trace served by `rr serve`; dir() is then
+  // its local cache directory.
+  std::shared_ptr<RemoteTrace> remote;
+  // Set if we're following a trace that's still being recorded; readers
+  // follow their files when they're opened.
+  bool following;
+  // If the trace has no metadata but a commit record, the last committed
+  // frame and where each substream ends with it; readers are limited to
+  // that when they're opened. Otherwise |commit_time| is 0.
+  TraceFrame::Time commit_time;
+  uint64_t commit_offsets[SUBSTREAM_COUNT];
+  // Read commit_path() into |commit_time| and |commit_offsets|.
+  void read_commit();
+  mutable std::unique_ptr<CompressedReader> readers[SUBSTREAM_COUNT];
+  // Set on readers when they're opened.
+  std::shared_ptr<const CompressedWriter::BlockIndex>
+      block_indexes[SUBSTREAM_COUNT];
+  std::shared_ptr<const TimeIndex> time_indexes[SUBSTREAM_COUNT];
+  bool indexes_loaded;
+  std::unique_ptr<CompressedReader> chunk_reader_;
+  // The ranges of a gathered record not yet returned by read_raw_data(),
+  // and the time of that record.
+  std::deque<RawData> pending_raw_data;
+  TraceFrame::Time pending_raw_data_time;
+  // Version of the trace format we're reading.
+  int trace_version;
+  FrameHistory frame_history;
+  // Frames decode_ahead() has decoded but read_frame() hasn't returned yet.
+  // EVENTS and frame_history are positioned after the last of them.
+  std::deque<TraceFrame> decoded_frames;
+  typedef std::tuple<pid_t, EventType, SyscallEntryOrExit> PeekKey;
+  // The first frame after the position peek_to() searched from for each
+  // key it passed. An entry is current while its time is after time().
+  std::map<PeekKey, TraceFrame> peeked_frames;
 };
 
 #endif /* RR_TRACE_H_ */
@@ -0,0 +1,87 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+//#define DEBUGTAG "WaitHub"
+
+#include "WaitHub.h"
+
+#include <assert.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+
+#include "log.h"
+
+using namespace std;
+
+WaitHub& WaitHub::get() {
+  static WaitHub singleton;
+  return singleton;
+}
+
+void WaitHub::add_task(pid_t tid) { mailboxes[tid]; }
+
+void WaitHub::remove_task(pid_t tid) {
+  mailboxes.erase(tid);
+  arrivals.erase(remove(arrivals.begin(), arrivals.end(), tid),
+                 arrivals.end());
+}
+
+pid_t WaitHub::collect(int* status, bool block) {
+  int options = __WALL | WSTOPPED | WUNTRACED | (block ? 0 : WNOHANG);
+  while (true) {
+    pid_t tid = waitpid(-1, status, options);
+    if (tid <= 0) {
+      return tid;
+    }
+    if (mailboxes.count(tid)) {
+      LOG(debug) << "  " << tid << " changed status to " << HEX(*status);
+      return tid;
+    }
+    LOG(debug) << "  " << tid << " changed status to " << HEX(*status)
+               << ", but it's dead";
+  }
+}
+
+void WaitHub::stash(pid_t tid, int status) {
+  mailboxes[tid].push_back(status);
+  arrivals.push_back(tid);
+}
+
+bool WaitHub::take_stashed(pid_t tid, int* status) {
+  auto it = mailboxes.find(tid);
+  if (it == mailboxes.end() || it->second.empty()) {
+    return false;
+  }
+  *status = it->second.front();
+  it->second.pop_front();
+  arrivals.erase(find(arrivals.begin(), arrivals.end(), tid));
+  return true;
+}
+
+pid_t WaitHub::wait(pid_t tid, int* status, bool block) {
+  assert(mailboxes.count(tid));
+  if (take_stashed(tid, status)) {
+    return tid;
+  }
+  while (true) {
+    int s;
+    pid_t ret = collect(&s, block);
+    if (ret <= 0) {
+      return ret;
+    }
+    if (ret == tid) {
+      *status = s;
+      return tid;
+    }
+    stash(ret, s);
+  }
+}
+
+pid_t WaitHub::wait_any(int* status, bool block) {
+  if (!arrivals.empty()) {
+    pid_t tid = arrivals.front();
+    take_stashed(tid, status);
+    return tid;
+  }
+  return collect(status, block);
+}
@@ -0,0 +1,65 @@
+/* -*- Mode: C++; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#ifndef RR_WAIT_HUB_H_
+#define RR_WAIT_HUB_H_
+
+#include <sys/types.h>
+
+#include <deque>
+#include <unordered_map>
+
+/**
+ * Collects the wait statuses of all our tasks with waitpid(-1, __WALL).
+ *
+ * Waiting for a specific task used to mean a waitpid() on its tid, and
+ * finding out which of many blocked tasks had changed state meant a
+ * waitpid() per task. Instead, every status is collected here by a single
+ * waitpid(-1) loop. A status that arrives while we're looking for some
+ * other task is kept in its task's mailbox until someone waits for it.
+ *
+ * Only statuses for tids registered with add_task() are kept; anything
+ * else belongs to a task we've already forgotten about and is dropped.
+ */
+class WaitHub {
+public:
+  static WaitHub& get();
+
+  void add_task(pid_t tid);
+  /**
+   * Forget |tid| and drop any statuses in its mailbox.
+   */
+  void remove_task(pid_t tid);
+
+  /**
+   * Like waitpid(tid, status, __WALL), with WNOHANG if |block| is false:
+   * returns |tid| with a status, 0 if none is available and we're not
+   * blocking, or -1 with errno set (e.g. EINTR).
+   */
+  pid_t wait(pid_t tid, int* status, bool block);
+
+  /**
+   * Like waitpid(-1, status, __WALL) restricted to registered tasks.
+   * Statuses already in mailboxes are returned first, oldest first.
+   */
+  pid_t wait_any(int* status, bool block);
+
+  /**
+   * If |tid|'s mailbox has a status, remove the oldest into |status| and
+   * return true. Never calls waitpid().
+   */
+  bool take_stashed(pid_t tid, int* status);
+
+private:
+  WaitHub() {}
+
+  // Like waitpid(-1), but statuses for tasks we don't know are dropped
+  // and we keep waiting.
+  pid_t collect(int* status, bool block);
+  void stash(pid_t tid, int status);
+
+  std::unordered_map<pid_t, std::deque<int> > mailboxes;
+  // The tid of each stashed status, in arrival order.
+  std::deque<pid_t> arrivals;
+};
+
+#endif /* RR_WAIT_HUB_H_ */
@@ -0,0 +1,147 @@
+#!/usr/bin/env python
+"""Records and replays the rr microbenchmarks and reports, per benchmark,
+how much slower than native recording and replay are, how fast the trace
+grows and how long checkpoints take. Results can be saved as a baseline
+and later runs compared against it.
+
+Usage: bench.py --objdir <rr build dir> [options] [benchmark...]
+"""
+
+from __future__ import print_function
+
+import argparse, json, os, sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from benchutil import *
+
+# Benchmark program (built from src/bench/<name>.c) and its arguments.
+BENCHMARKS = [
+    ('syscall_bench', []),
+    ('thread_bench', []),
+    ('signal_bench', []),
+    ('mmap_bench', []),
+]
+
+# Metrics that count as regressions when they grow past the threshold.
+CHECKED_METRICS = set([ 'record_slowdown', 'replay_slowdown', 'trace_bytes',
+                        'checkpoint_sec', 'restart_checkpoint_sec' ])
+
+NUM_CHECKPOINTS = 5
+
+def measure_checkpoints(objdir, trace_dir, num_events):
+    '''Return (median seconds to create a checkpoint, median seconds to
+  restart from one) halfway through the trace.'''
+    gdb = GdbDriver(objdir, trace_dir, ['-g', str(max(1, num_events//2))])
+    try:
+        create = []
+        restart = []
+        for i in range(1, NUM_CHECKPOINTS + 1):
+            create.append(gdb.run('checkpoint'))
+            gdb.run('stepi')
+            restart.append(gdb.run('restart %d'%i, 'Start it from the beginning') +
+                           gdb.run('y'))
+        return (percentile(create, 50), percentile(restart, 50))
+    finally:
+        gdb.close()
+
+def run_benchmark(objdir, name, args, repeat, keep):
+    exe = os.path.join(objdir, 'bin', name)
+    with Workdir(name, keep) as workdir:
+        env = dict(os.environ)
+        env['_RR_TRACE_DIR'] = workdir.path
+        native = min(run_timed([exe] + args) for i in range(repeat))
+        records = []
+        for i in range(repeat):
+            records.append(run_timed(rr_command(objdir, 'record', exe, *args),
+                                     env))
+        record = min(records)
+        trace_dir = os.path.realpath(os.path.join(workdir.path, 'latest-trace'))
+        replay = min(run_timed(rr_command(objdir, 'replay', '-a', trace_dir))
+                     for i in range(repeat))
+        trace_bytes = dir_size(trace_dir)
+        num_events = count_events(objdir, trace_dir)
+        results = {
+            'native_sec': native,
+            'record_sec': record,
+            'record_slowdown': record/native,
+            'replay_sec': replay,
+            'replay_slowdown': replay/native,
+            'replay_events_per_sec': num_events/replay,
+            'events': num_events,
+            'trace_bytes': trace_bytes,
+            'trace_bytes_per_sec': trace_bytes/record,
+        }
+        try:
+            create, restart = measure_checkpoints(objdir, trace_dir, num_events)
+            results['checkpoint_sec'] = create
+            results['restart_checkpoint_sec'] = restart
+        except (ImportError, BenchError) as e:
+            print('%s: not measuring checkpoints: %s'%(name, e),
+                  file=sys.stderr)
+        return results
+
+def print_results(results):
+    print('%-14s %9s %9s %12s %12s %10s'%
+          ('benchmark', 'record', 'replay', 'events/s', 'trace KB/s',
+           'checkpoint'))
+    for name, r in sorted(results.items()):
+        checkpoint = r.get('checkpoint_sec')
+        print('%-14s %8.2fx %8.2fx %12.0f %12.1f %10s'%
+              (name, r['record_slowdown'], r['replay_slowdown'],
+               r['replay_events_per_sec'], r['trace_bytes_per_sec']/1024,
+               '%.3fs'%checkpoint if checkpoint is not None else '-'))
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--objdir', required=True,
+                        help='rr build directory')
+    parser.add_argument('--repeat', type=int, default=3,
+                        help='runs per measurement; the fastest is kept')
+    parser.add_argument('--baseline',
+                        help='compare against the results in this file')
+    parser.add_argument('--save-baseline', action='store_true',
+                        help='write the results to the --baseline file')
+    parser.add_argument('--threshold', type=float, default=0.1,
+                        help='fraction by which a metric may get worse '
+                             'before it counts as a regression')
+    parser.add_argument('--json', help='also write the results to this file')
+    parser.add_argument('--keep', action='store_true',
+                        help='keep the recorded traces')
+    parser.add_argument('benchmarks', nargs='*',
+                        help='benchmarks to run (default: all)')
+    opts = parser.parse_args()
+
+    results = {}
+    for name, args in BENCHMARKS:
+        if opts.benchmarks and name not in opts.benchmarks:
+            continue
+        print('Running %s ...'%name, file=sys.stderr)
+        try:
+            results[name] = run_benchmark(opts.objdir, name, args, opts.repeat,
+                                          opts.keep)
+        except BenchError as e:
+            print('FAILED: %s: %s'%(name, e))
+            return 1
+    print_results(results)
+
+    if opts.json:
+        save_baseline(opts.json, results)
+    if opts.save_baseline:
+        if not opts.baseline:
+            parser.error('--save-baseline needs --baseline')
+        save_baseline(opts.baseline, results)
+        print('Saved baseline to', opts.baseline)
+        return 0
+
+    baseline = load_baseline(opts.baseline)
+    if baseline is None:
+        return 0
+    regressions = compare_to_baseline(results, baseline, opts.threshold,
+                                      CHECKED_METRICS)
+    for bench, metric, old, new in regressions:
+        print('REGRESSION: %s %s: %.4g -> %.4g (%+.0f%%)'%
+              (bench, metric, old, new, 100.0*(new - old)/old))
+    return 1 if regressions else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
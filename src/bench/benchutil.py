@@ -0,0 +1,124 @@
+"""Helpers shared by the rr benchmark drivers."""
+
+from __future__ import print_function
+
+import json, os, shutil, subprocess, tempfile, time
+
+__all__ = [ 'BenchError', 'Workdir', 'GdbDriver', 'rr_command', 'run_timed',
+            'count_events', 'dir_size', 'load_baseline', 'save_baseline',
+            'compare_to_baseline', 'percentile' ]
+
+class BenchError(Exception):
+    pass
+
+class Workdir(object):
+    '''A temporary directory holding one benchmark's traces. It is removed
+  on exit unless |keep| is set.'''
+    def __init__(self, name, keep=False):
+        self.path = tempfile.mkdtemp(prefix='rr-bench-%s-'%name)
+        self.keep = keep
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        if self.keep:
+            print('Leaving traces in', self.path)
+        else:
+            shutil.rmtree(self.path, ignore_errors=True)
+
+def rr_command(objdir, *args):
+    return [os.path.join(objdir, 'bin', 'rr'),
+            '--suppress-environment-warnings'] + list(args)
+
+def run_timed(cmd, env=None):
+    '''Run |cmd| to completion with its output discarded, and return the
+  wall-clock time it took.'''
+    start = time.time()
+    with open(os.devnull, 'w') as null:
+        status = subprocess.call(cmd, stdout=null, stderr=null, env=env)
+    elapsed = time.time() - start
+    if status != 0:
+        raise BenchError('%s exited with status %d'%(' '.join(cmd), status))
+    return elapsed
+
+def count_events(objdir, trace_dir):
+    '''Return the number of events in the trace, per |rr profile|.'''
+    out = subprocess.check_output(rr_command(objdir, 'profile', trace_dir))
+    profile = json.loads(out.decode('utf-8'))
+    return sum(t['events'] for t in profile['tids'])
+
+def dir_size(path):
+    total = 0
+    for root, dirs, files in os.walk(path):
+        for f in files:
+            total += os.path.getsize(os.path.join(root, f))
+    return total
+
+def percentile(values, p):
+    '''Return the |p|th percentile (0-100) of the nonempty list |values|.'''
+    values = sorted(values)
+    i = int(round((len(values) - 1)*p/100.0))
+    return values[i]
+
+def load_baseline(path):
+    if not path or not os.path.exists(path):
+        return None
+    with open(path) as f:
+        return json.load(f)
+
+def save_baseline(path, results):
+    with open(path, 'w') as f:
+        json.dump(results, f, indent=2, sort_keys=True)
+        f.write('\n')
+
+def compare_to_baseline(results, baseline, threshold, checked_metrics):
+    '''Return a list of (benchmark, metric, baseline, current) tuples for
+  every metric named in |checked_metrics| that grew by more than
+  |threshold| (a fraction) compared to |baseline|. Checked metrics must
+  be better when lower; the others are only reported.'''
+    regressions = []
+    for bench, metrics in sorted(results.items()):
+        old_metrics = baseline.get(bench, {})
+        for metric, value in sorted(metrics.items()):
+            old = old_metrics.get(metric)
+            if (metric not in checked_metrics or
+                not isinstance(old, (int, float)) or old <= 0):
+                continue
+            if value > old*(1 + threshold):
+                regressions.append((bench, metric, old, value))
+    return regressions
+
+class GdbDriver(object):
+    '''Drives |rr replay| with gdb attached, like the debugger tests do,
+  timing each command from sending it until gdb prompts again.'''
+    PROMPT = r'\(gdb\) '
+
+    def __init__(self, objdir, trace_dir, replay_args=[], timeout=600):
+        import pexpect
+        cmd = rr_command(objdir, 'replay') + replay_args + [trace_dir]
+        self.gdb = pexpect.spawn(cmd[0], cmd[1:], timeout=timeout)
+        self.run(None)
+
+    def run(self, command, expect=PROMPT):
+        '''Send |command| (if not None) and return the seconds taken until
+  gdb prints something matching the regex |expect|, by default the
+  prompt.'''
+        start = time.time()
+        if command is not None:
+            self.gdb.send(command + '\n')
+        try:
+            self.gdb.expect(expect)
+        except Exception as e:
+            raise BenchError('waiting for "%s" after "%s": %s'%
+                             (expect, command, e))
+        return time.time() - start
+
+    def output(self):
+        '''The text gdb printed before the last expected pattern.'''
+        return self.gdb.before.decode('utf-8', 'replace')
+
+    def close(self):
+        self.gdb.send('q\n')
+        self.gdb.send('y\n')
+        self.gdb.close(force=True)
@@ -0,0 +1,27 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "../test/rrutil.h"
+
+#define NUM_PAGES 64
+
+int main(int argc, char* argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 5000;
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t len = NUM_PAGES * page_size;
+  int i;
+  size_t j;
+
+  for (i = 0; i < iterations; ++i) {
+    char* p = (char*)mmap(NULL, len, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    test_assert(p != MAP_FAILED);
+    for (j = 0; j < len; j += page_size) {
+      p[j] = (char)i;
+    }
+    test_assert(0 == mprotect(p, len / 2, PROT_READ));
+    test_assert(0 == munmap(p, len));
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
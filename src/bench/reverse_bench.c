@@ -0,0 +1,35 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "../test/rrutil.h"
+
+static int counter;
+
+/* reverse_bench.py sets its breakpoints here. */
+static void breakpoint_target(int i) {
+  counter += i;
+  test_assert(getppid() > 0);
+}
+
+int main(int argc, char* argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 200;
+  int fds[2];
+  char buf[64];
+  int i;
+  int j;
+
+  memset(buf, 'x', sizeof(buf));
+  test_assert(0 == pipe(fds));
+  for (i = 0; i < iterations; ++i) {
+    /* Work between breakpoint hits, so reverse execution has to replay
+       through a realistic mix of syscalls and user-space code. */
+    for (j = 0; j < 500; ++j) {
+      test_assert(sizeof(buf) == write(fds[1], buf, sizeof(buf)));
+      test_assert(sizeof(buf) == read(fds[0], buf, sizeof(buf)));
+      buf[j % sizeof(buf)] += (char)j;
+    }
+    breakpoint_target(i);
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
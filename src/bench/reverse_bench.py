@@ -0,0 +1,158 @@
+#!/usr/bin/env python
+"""Records reverse_bench once, then drives |rr replay| through gdb with a
+fixed script of breakpoints, continues, reverse-continues, reverse-steps
+and seeks, and reports the latency distribution of each kind of operation.
+Use it to evaluate changes to ReplayTimeline's checkpointing policy.
+
+Usage: reverse_bench.py --objdir <rr build dir> [options]
+"""
+
+from __future__ import print_function
+
+import argparse, os, sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from benchutil import *
+
+PROGRAM = 'reverse_bench'
+BREAKPOINT = 'breakpoint_target'
+
+# Latencies are checked at these percentiles when comparing to a baseline.
+CHECKED_PERCENTILES = [ 50, 90 ]
+
+class Script(object):
+    '''Runs gdb commands and collects the latency of each, keyed by the
+  kind of operation.'''
+    def __init__(self, gdb):
+        self.gdb = gdb
+        self.latencies = {}
+
+    def op(self, kind, command, expect=GdbDriver.PROMPT):
+        t = self.gdb.run(command, expect)
+        self.latencies.setdefault(kind, []).append(t)
+        return t
+
+def run_script(s, hits):
+    s.op('break', 'break %s'%BREAKPOINT)
+    # Walk forward through the first half of the breakpoint hits, then
+    # reverse over part of it; this is the pattern ReplayTimeline's
+    # checkpoints are meant to make cheap.
+    for i in range(hits//2):
+        s.op('continue', 'continue')
+    for i in range(hits//4):
+        s.op('reverse-continue', 'reverse-continue')
+    for i in range(hits//4):
+        s.op('continue', 'continue')
+    # Fine-grained reverse execution around a breakpoint hit.
+    for i in range(hits//4):
+        s.op('reverse-step', 'reverse-step')
+        s.op('reverse-stepi', 'reverse-stepi')
+        s.op('reverse-next', 'reverse-next')
+        s.op('continue', 'continue')
+        s.op('reverse-finish', 'reverse-finish')
+        s.op('continue', 'continue')
+    # Seeking: jump back and forth between explicit checkpoints spread
+    # over the trace.
+    checkpoints = 0
+    for i in range(hits//4):
+        s.op('checkpoint', 'checkpoint')
+        checkpoints += 1
+        s.op('continue', 'continue')
+    for i in range(hits//4):
+        s.op('seek', 'restart %d'%(1 + (i*3)%checkpoints),
+             'Start it from the beginning')
+        s.gdb.run('y')
+    s.op('delete', 'delete')
+
+def summarize(latencies):
+    '''Return a {op: {metric: value}} dict of latency statistics.'''
+    results = {}
+    for kind, values in latencies.items():
+        r = { 'count': len(values), 'max_sec': max(values),
+              'total_sec': sum(values) }
+        for p in CHECKED_PERCENTILES:
+            r['p%d_sec'%p] = percentile(values, p)
+        results[kind] = r
+    return results
+
+def print_results(results):
+    print('%-17s %6s %10s %10s %10s'%('operation', 'count', 'median',
+                                      'p90', 'max'))
+    for kind, r in sorted(results.items()):
+        print('%-17s %6d %9.1fms %9.1fms %9.1fms'%
+              (kind, r['count'], 1000*r['p50_sec'], 1000*r['p90_sec'],
+               1000*r['max_sec']))
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('--objdir', required=True,
+                        help='rr build directory')
+    parser.add_argument('--hits', type=int, default=40,
+                        help='breakpoint hits the script walks through; '
+                             'more gives smoother distributions')
+    parser.add_argument('--trace',
+                        help='use this reference trace of reverse_bench '
+                             'instead of recording a new one')
+    parser.add_argument('--baseline',
+                        help='compare against the results in this file')
+    parser.add_argument('--save-baseline', action='store_true',
+                        help='write the results to the --baseline file')
+    parser.add_argument('--threshold', type=float, default=0.2,
+                        help='fraction by which a latency may grow before '
+                             'it counts as a regression')
+    parser.add_argument('--json', help='also write the results to this file')
+    parser.add_argument('--keep', action='store_true',
+                        help='keep the recorded trace')
+    opts = parser.parse_args()
+
+    with Workdir(PROGRAM, opts.keep) as workdir:
+        trace_dir = opts.trace
+        if not trace_dir:
+            # Record more breakpoint hits than the script visits, so it
+            # never runs off the end of the trace.
+            env = dict(os.environ)
+            env['_RR_TRACE_DIR'] = workdir.path
+            exe = os.path.join(opts.objdir, 'bin', PROGRAM)
+            try:
+                run_timed(rr_command(opts.objdir, 'record', exe,
+                                     str(2*opts.hits)), env)
+            except BenchError as e:
+                print('FAILED: recording: %s'%e)
+                return 1
+            trace_dir = os.path.join(workdir.path, 'latest-trace')
+        gdb = GdbDriver(opts.objdir, os.path.realpath(trace_dir))
+        s = Script(gdb)
+        try:
+            run_script(s, opts.hits)
+        except BenchError as e:
+            print('FAILED: %s'%e)
+            return 1
+        finally:
+            gdb.close()
+
+    # Keyed like bench.py's results so the baseline helpers apply.
+    results = summarize(s.latencies)
+    print_results(results)
+
+    if opts.json:
+        save_baseline(opts.json, results)
+    if opts.save_baseline:
+        if not opts.baseline:
+            parser.error('--save-baseline needs --baseline')
+        save_baseline(opts.baseline, results)
+        print('Saved baseline to', opts.baseline)
+        return 0
+
+    baseline = load_baseline(opts.baseline)
+    if baseline is None:
+        return 0
+    checked = set('p%d_sec'%p for p in CHECKED_PERCENTILES)
+    regressions = compare_to_baseline(results, baseline, opts.threshold,
+                                      checked)
+    for op, metric, old, new in regressions:
+        print('REGRESSION: %s %s: %.1fms -> %.1fms (%+.0f%%)'%
+              (op, metric, 1000*old, 1000*new, 100.0*(new - old)/old))
+    return 1 if regressions else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
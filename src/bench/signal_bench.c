@@ -0,0 +1,32 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "../test/rrutil.h"
+
+static volatile int caught;
+
+static void handle_usr1(__attribute__((unused)) int sig) { ++caught; }
+
+int main(int argc, char* argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+  struct sigaction sa;
+  sigset_t mask;
+  int i;
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handle_usr1;
+  test_assert(0 == sigaction(SIGUSR1, &sa, NULL));
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+
+  for (i = 0; i < iterations; ++i) {
+    test_assert(0 == raise(SIGUSR1));
+    /* A blocked signal that's delivered when it's unblocked. */
+    test_assert(0 == sigprocmask(SIG_BLOCK, &mask, NULL));
+    test_assert(0 == raise(SIGUSR1));
+    test_assert(0 == sigprocmask(SIG_UNBLOCK, &mask, NULL));
+  }
+  test_assert(caught == 2 * iterations);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,24 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "../test/rrutil.h"
+
+/* Mostly syscalls the syscallbuf handles, plus one it doesn't. */
+int main(int argc, char* argv[]) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+  int fds[2];
+  char buf[64];
+  int i;
+
+  memset(buf, 'x', sizeof(buf));
+  test_assert(0 == pipe(fds));
+  for (i = 0; i < iterations; ++i) {
+    test_assert(sizeof(buf) == write(fds[1], buf, sizeof(buf)));
+    test_assert(sizeof(buf) == read(fds[0], buf, sizeof(buf)));
+    if (i % 16 == 0) {
+      test_assert(getppid() > 0);
+    }
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "../test/rrutil.h"
+
+#define NUM_THREADS 4
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int turn;
+static int iterations;
+
+/* Each thread waits for its turn, so every step is a lock handoff. */
+static void* run_thread(void* p) {
+  int id = (int)(uintptr_t)p;
+  int i;
+
+  for (i = 0; i < iterations; ++i) {
+    pthread_mutex_lock(&lock);
+    while (turn % NUM_THREADS != id) {
+      pthread_cond_wait(&cond, &lock);
+    }
+    ++turn;
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&lock);
+  }
+  return NULL;
+}
+
+static void* nop_thread(__attribute__((unused)) void* p) { return NULL; }
+
+int main(int argc, char* argv[]) {
+  pthread_t threads[NUM_THREADS];
+  int i;
+
+  iterations = argc > 1 ? atoi(argv[1]) : 5000;
+  for (i = 0; i < NUM_THREADS; ++i) {
+    test_assert(0 == pthread_create(&threads[i], NULL, run_thread,
+                                    (void*)(uintptr_t)i));
+  }
+  for (i = 0; i < NUM_THREADS; ++i) {
+    test_assert(0 == pthread_join(threads[i], NULL));
+  }
+  test_assert(turn == iterations * NUM_THREADS);
+
+  /* Thread creation and exit. */
+  for (i = 0; i < iterations / 50; ++i) {
+    pthread_t t;
+    test_assert(0 == pthread_create(&t, NULL, nop_thread, NULL));
+    test_assert(0 == pthread_join(t, NULL));
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -92,6 +92,72 @@ static bool decode_x86_string_instruction(const InstructionBuf& code,
   return true;
 }
 
+/**
+ * Decode a LOOP/LOOPE/LOOPNE instruction that branches to itself, i.e. a
+ * loop that does nothing but count CX down.
+ */
+static bool decode_x86_self_loop(const InstructionBuf& code,
+                                 DecodedInstruction* decoded) {
+  if (code.code_buf_len < 2) {
+    return false;
+  }
+  switch (code.code_buf[0]) {
+    case 0xE0: // LOOPNE
+    case 0xE1: // LOOPE
+    case 0xE2: // LOOP
+      break;
+    default:
+      return false;
+  }
+  if (code.code_buf[1] != 0xFE) {
+    // Not a branch to itself.
+    return false;
+  }
+  decoded->length = 2;
+  decoded->operand_size = 0;
+  decoded->modifies_flags = false;
+  return true;
+}
+
+/**
+ * The tracee has just executed one iteration of a self-looping LOOP
+ * instruction at |ip|, taking |ticks_per_iteration| ticks, and is still
+ * looping. Such an iteration only decrements CX (LOOPE/LOOPNE test ZF, which
+ * nothing in the loop changes), so instead of singlestepping each
+ * iteration, update CX and the tick count as if we had, stopping before
+ * the loop exits or reaches any of |states|.
+ */
+static void fast_forward_self_loop(Task* t, remote_ptr<uint8_t> ip,
+                                   Ticks ticks_per_iteration,
+                                   const Registers** states) {
+  uintptr_t cur_cx = t->regs().cx();
+  if (cur_cx <= 1) {
+    return;
+  }
+  // The iteration that takes CX to 0 leaves the loop; don't emulate it.
+  uintptr_t iterations = cur_cx - 1;
+  for (size_t i = 0; states[i]; ++i) {
+    auto state = states[i];
+    if (state->ip() == ip) {
+      uintptr_t dest_cx = state->cx();
+      if (dest_cx == 0 || dest_cx >= cur_cx) {
+        // This can't be reached in the current loop.
+        continue;
+      }
+      iterations = min(iterations, cur_cx - dest_cx - 1);
+    }
+  }
+  if (iterations == 0) {
+    return;
+  }
+
+  LOG(debug) << "x86-loop fast-forward: " << iterations << " iterations";
+  Registers r = t->regs();
+  r.set_cx(cur_cx - iterations);
+  t->set_regs(r);
+  t->set_tick_count(t->tick_count() + iterations * ticks_per_iteration);
+}
+
 static bool mem_intersect(remote_ptr<void> a1, int s1, remote_ptr<void> a2,
                           int s2) {
   assert(a1 + s1 > a1);
@@ -136,6 +202,7 @@ static void bound_iterations_for_watchpoint(Task* t, remote_ptr<void> reg,
 
 void fast_forward_through_instruction(Task* t, const Registers** states) {
   remote_ptr<uint8_t> ip = t->ip();
+  Ticks ticks_before = t->tick_count();
 
   t->resume_execution(RESUME_SINGLESTEP, RESUME_WAIT);
   ASSERT(t, t->pending_sig() == SIGTRAP);
@@ -162,6 +229,10 @@ void fast_forward_through_instruction(Task* t, const Registers** states) {
 
   InstructionBuf instruction_buf = read_instruction(t, ip);
   DecodedInstruction decoded;
+  if (decode_x86_self_loop(instruction_buf, &decoded)) {
+    fast_forward_self_loop(t, ip, t->tick_count() - ticks_before, states);
+    return;
+  }
   if (!decode_x86_string_instruction(instruction_buf, &decoded)) {
     return;
   }
@@ -10,7 +10,7 @@ class Registers;
  * Perform one or more synchronous singlesteps of |t|. Usually just does
  * one singlestep, except when a singlestep leaves the IP unchanged (i.e. a
  * single instruction represents a loop, such as an x86 REP-prefixed string
- * instruction).
+ * instruction, or a LOOP instruction that branches to itself).
  *
  * We always perform at least one singlestep. We stop after a singlestep if
  * one of the following is true, or will be true after one more singlestep:
@@ -62,19 +62,36 @@ def write_syscallname_arch(f):
         f.write("}\n")
         f.write("\n")
 
-def write_syscall_record_cases(f):
-    def write_recorder_for_arg(syscall, arg):
-        arg_descriptor = getattr(syscall, 'arg' + str(arg), None)
-        if isinstance(arg_descriptor, str):
-            f.write("    syscall_state.reg_parameter<%s>(%d);\n"
-                    % (arg_descriptor, arg))
-    for name, obj in syscalls.all():
-        # Irregular syscalls will be handled by hand-written code elsewhere.
-        if isinstance(obj, syscalls.RegularSyscall):
-            f.write("  case Arch::%s:\n" % name)
+def write_syscall_record_params(f):
+    for specializer, arch in [("X86Arch", "x86"), ("X64Arch", "x64")]:
+        f.write("template <> struct regular_syscall_params<%s> {\n" % specializer)
+        f.write("  static constexpr RegularSyscallParams table[] = {\n")
+        # The table is indexed by syscall number, so fill in the gaps.
+        by_number = dict((getattr(obj, arch), (name, obj))
+                         for name, obj in syscalls.for_arch(arch))
+        for number in range(max(by_number.keys()) + 1):
+            name, obj = by_number.get(number, (None, None))
+            if not isinstance(obj, syscalls.RegularSyscall):
+                if name:
+                    f.write("    /* %d %s */ { false, 0, {} },\n" % (number, name))
+                else:
+                    f.write("    /* %d */ { false, 0, {} },\n" % number)
+                continue
+            params = []
             for arg in range(1,6):
-                write_recorder_for_arg(obj, arg)
-            f.write("    return syscall_state.done_preparing(PREVENT_SWITCH);\n")
+                arg_descriptor = getattr(obj, 'arg' + str(arg), None)
+                if isinstance(arg_descriptor, str):
+                    arg_type = arg_descriptor.replace("typename Arch::",
+                                                      specializer + "::")
+                    params.append("{ %d, sizeof(%s) }" % (arg, arg_type))
+            f.write("    /* %d %s */ { true, %d, {%s} },\n"
+                    % (number, name, len(params),
+                       " %s " % ", ".join(params) if params else ""))
+        f.write("  };\n")
+        f.write("};\n")
+        f.write("constexpr RegularSyscallParams regular_syscall_params<%s>::table[];\n"
+                % specializer)
+        f.write("\n")
 
 has_syscall = string.Template("""inline bool
 has_${syscall}_syscall(SupportedArch arch) {
@@ -159,7 +176,7 @@ generators_for = {
     'SyscallEnumsX86': lambda f: write_syscall_enum(f, 'x86'),
     'SyscallEnumsX64': lambda f: write_syscall_enum(f, 'x64'),
     'SyscallnameArch': write_syscallname_arch,
-    'SyscallRecordCase': write_syscall_record_cases,
+    'SyscallRecordParams': write_syscall_record_params,
     'SyscallHelperFunctions': write_syscall_helper_functions,
 }
 
@@ -3,6 +3,8 @@
 #ifndef RR_KERNEL_SUPPLEMENT_H_
 #define RR_KERNEL_SUPPLEMENT_H_
 
+#include <stdint.h>
+#include <sys/ioctl.h>
 #include <sys/ptrace.h>
 
 /* Definitions that should be part of system headers (and maybe are on some but
@@ -42,6 +44,38 @@
 #define GRND_RANDOM 0x0002
 #endif
 
+// Linux 6.11's ioctl on /proc/<pid>/maps for looking up one mapping.
+#ifndef PROCMAP_QUERY
+enum procmap_query_flags {
+  PROCMAP_QUERY_VMA_READABLE = 0x01,
+  PROCMAP_QUERY_VMA_WRITABLE = 0x02,
+  PROCMAP_QUERY_VMA_EXECUTABLE = 0x04,
+  PROCMAP_QUERY_VMA_SHARED = 0x08,
+  PROCMAP_QUERY_COVERING_OR_NEXT_VMA = 0x10,
+  PROCMAP_QUERY_FILE_BACKED_VMA = 0x20,
+};
+
+struct procmap_query {
+  uint64_t size;
+  uint64_t query_flags;
+  uint64_t query_addr;
+  uint64_t vma_start;
+  uint64_t vma_end;
+  uint64_t vma_flags;
+  uint64_t vma_page_size;
+  uint64_t vma_offset;
+  uint64_t inode;
+  uint32_t dev_major;
+  uint32_t dev_minor;
+  uint32_t vma_name_size;
+  uint32_t build_id_size;
+  uint64_t vma_name_addr;
+  uint64_t build_id_addr;
+};
+
+#define PROCMAP_QUERY _IOWR('f', 17, struct procmap_query)
+#endif
+
 /* We need to complement sigsets in order to update the Task blocked
  * set, but POSIX doesn't appear to define a convenient helper.  So we
  * define our own linux-compatible sig_set_t and use bit operators to
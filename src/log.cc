@@ -2,6 +2,7 @@
 
 #include "log.h"
 
+#include "FlightRecorder.h"
 #include "GdbServer.h"
 #include "RecordSession.h"
 
@@ -21,8 +22,15 @@ static void emergency_debug(Task* t) {
   FATAL() << "Can't resume execution from invalid state";
 }
 
+FatalOstream::~FatalOstream() {
+  log_stream() << std::endl;
+  FlightRecorder::dump();
+  abort();
+}
+
 EmergencyDebugOstream::~EmergencyDebugOstream() {
   log_stream() << std::endl;
   t->log_pending_events();
+  FlightRecorder::dump();
   emergency_debug(t);
 }
@@ -16,6 +16,23 @@ enum LogLevel {
   LOG_debug
 };
 
+/**
+ * The most verbose level this file logs at. It's a compile-time constant,
+ * so LOG() sites above it are dead code; the levels below it can still be
+ * switched on and off at runtime by logging_enabled_for(). Files can
+ * #define LOG_MAX_LEVEL before including this to override the build-wide
+ * RR_LOG_MAX_LEVEL; defining DEBUGTAG compiles in debug logging.
+ */
+#ifndef LOG_MAX_LEVEL
+#if defined(DEBUGTAG)
+#define LOG_MAX_LEVEL LOG_debug
+#elif defined(RR_LOG_MAX_LEVEL)
+#define LOG_MAX_LEVEL RR_LOG_MAX_LEVEL
+#else
+#define LOG_MAX_LEVEL LOG_info
+#endif
+#endif
+
 inline static bool logging_enabled_for(LogLevel level) {
   switch (level) {
     case LOG_fatal:
@@ -25,12 +42,9 @@ inline static bool logging_enabled_for(LogLevel level) {
     case LOG_info:
       return Flags::get().verbose;
     case LOG_debug:
-// TODO make me dynamically-enable-able.
-#ifdef DEBUGTAG
+      // Only reached when LOG_MAX_LEVEL compiles debug logging in.
+      // TODO make me dynamically-enable-able.
       return true;
-#else
-      return false;
-#endif
     default:
       return false; // not reached
   }
@@ -89,10 +103,7 @@ NewlineTerminatingOstream& operator<<(NewlineTerminatingOstream& stream,
 // TODO: support stream modifiers.
 
 struct FatalOstream {
-  ~FatalOstream() {
-    log_stream() << std::endl;
-    abort();
-  }
+  ~FatalOstream();
 };
 template <typename T>
 FatalOstream& operator<<(FatalOstream& stream, const T& v) {
@@ -155,7 +166,7 @@ inline static T& prepare_log_stream(T&& stream, LogLevel level,
  * error, warn, info, debug }| in decreasing order of severity.
  */
 #define LOG(_level)                                                            \
-  if (logging_enabled_for(LOG_##_level))                                       \
+  if (LOG_##_level <= LOG_MAX_LEVEL && logging_enabled_for(LOG_##_level))      \
   prepare_log_stream(NewlineTerminatingOstream(LOG_##_level), LOG_##_level,    \
                      __FILE__, __LINE__, __FUNCTION__)
 
@@ -12,6 +12,7 @@
 #include "Command.h"
 #include "Flags.h"
 #include "log.h"
+#include "MemoryAccounting.h"
 #include "RecordCommand.h"
 
 using namespace std;
@@ -100,6 +101,11 @@ void print_usage(FILE* out) {
       "                             says otherwise.  NAME should be a string "
       "like\n"
       "                             'Ivy Bridge'.\n"
+      "  -B, --checkpoint-budget=<MB>\n"
+      "                             during replay, discard the oldest\n"
+      "                             reverse-execution checkpoints when they\n"
+      "                             use more than MB megabytes of private\n"
+      "                             memory (default 0; unlimited)\n"
       "  -C, --checksum={on-syscalls,on-all-events}|FROM_TIME\n"
       "                             compute and store (during recording) or\n"
       "                             read and verify (during replay) checksums\n"
@@ -121,20 +127,45 @@ void print_usage(FILE* out) {
       "                             like good ideas, for example launching an\n"
       "                             interactive emergency debugger if stderr\n"
       "                             isn't a tty.\n"
+      "  -G, --merge-checkpoint-pages\n"
+      "                             let the kernel's KSM merge identical\n"
+      "                             anonymous pages of replay checkpoints\n"
+      "                             (requires /sys/kernel/mm/ksm/run = 1)\n"
+      "  -I, --check-regs-interval=<N>\n"
+      "                             during replay, only check that registers\n"
+      "                             match the recording at every Nth event\n"
+      "                             (default 1)\n"
       "  -K, --check-cached-mmaps   verify that cached task mmaps match "
       "/proc/maps\n"
+      "  -L, --timeline-log=<FILE>  during replay, write checkpoint creation\n"
+      "                             and eviction and seek events to FILE as\n"
+      "                             JSON, one object per line\n"
       "  -E, --fatal-errors         any warning or error that is printed is\n"
       "                             treated as fatal\n"
       "  -M, --mark-stdio           mark stdio writes with [rr.<EVENT-NO>],\n"
       "                             where EVENT-NO is the global trace time "
       "at\n"
       "                             which the write occures.\n"
+      "  -O, --follow-trace         replay a trace that is still being\n"
+      "                             recorded, waiting for the recorder when\n"
+      "                             replay catches up with it\n"
+      "  -R, --read-ahead=<MB>      use up to MB megabytes of memory to\n"
+      "                             decompress trace data ahead of replay\n"
+      "                             (default 64; 0 disables)\n"
       "  -S, --suppress-environment-warnings\n"
       "                             suppress warnings about issues in the\n"
       "                             environment that rr has no control over\n"
       "  -T, --dump-at=TIME         dump memory at global timepoint TIME\n"
       "  -V, --verbose              log messages that may not be urgently \n"
       "                             critical to the user\n"
+      "  -Y, --memory-report        when the command finishes, print how much\n"
+      "                             memory each of rr's subsystems uses now\n"
+      "                             and used at most; anything still in use\n"
+      "                             after replay or recording ended leaked\n"
+      "  -Z, --dump-binary          write memory dumps as a directory with\n"
+      "                             one gzip file per mapping and an index,\n"
+      "                             using all CPUs; compare two such dumps\n"
+      "                             with `rr memdiff'\n"
       "  -W, --wait-secs=<NUM_SECS> wait NUM_SECS seconds just after startup,\n"
       "                             before initiating recording or replaying\n",
       out);
@@ -147,14 +178,22 @@ static void init_random() {
 
 bool parse_global_option(std::vector<std::string>& args) {
   static const OptionSpec options[] = {
+    { 'B', "checkpoint-budget", HAS_PARAMETER },
     { 'C', "checksum", HAS_PARAMETER },
+    { 'G', "merge-checkpoint-pages", NO_PARAMETER },
+    { 'I', "check-regs-interval", HAS_PARAMETER },
     { 'K', "check-cached-mmaps", NO_PARAMETER },
+    { 'L', "timeline-log", HAS_PARAMETER },
     { 'U', "cpu-unbound", NO_PARAMETER },
     { 'T', "dump-at", HAS_PARAMETER },
     { 'D', "dump-on", HAS_PARAMETER },
+    { 'Y', "memory-report", NO_PARAMETER },
+    { 'Z', "dump-binary", NO_PARAMETER },
     { 'F', "force-things", NO_PARAMETER },
     { 'A', "microarch", HAS_PARAMETER },
     { 'M', "mark-stdio", NO_PARAMETER },
+    { 'O', "follow-trace", NO_PARAMETER },
+    { 'R', "read-ahead", HAS_PARAMETER },
     { 'S', "suppress-environment-warnings", NO_PARAMETER },
     { 'E', "fatal-errors", NO_PARAMETER },
     { 'V', "verbose", NO_PARAMETER }
@@ -170,6 +209,12 @@ bool parse_global_option(std::vector<std::string>& args) {
     case 'A':
       flags.forced_uarch = opt.value;
       break;
+    case 'B':
+      if (!opt.verify_valid_int(0, SIZE_MAX / (1024 * 1024))) {
+        return false;
+      }
+      flags.checkpoint_memory_budget = (size_t)opt.int_value * 1024 * 1024;
+      break;
     case 'C':
       if (opt.value == "on-syscalls") {
         LOG(info) << "checksumming on syscall exit";
@@ -178,7 +223,7 @@ bool parse_global_option(std::vector<std::string>& args) {
         LOG(info) << "checksumming on all events";
         flags.checksum = Flags::CHECKSUM_ALL;
       } else {
-        flags.checksum = atoi(opt.value.c_str());
+        flags.checksum = strtoll(opt.value.c_str(), nullptr, 10);
         LOG(info) << "checksumming on at event " << flags.checksum;
       }
       break;
@@ -191,21 +236,48 @@ bool parse_global_option(std::vector<std::string>& args) {
     case 'F':
       flags.force_things = true;
       break;
+    case 'G':
+      flags.merge_checkpoint_pages = true;
+      break;
+    case 'I':
+      if (!opt.verify_valid_int(1, UINT32_MAX)) {
+        return false;
+      }
+      flags.check_regs_interval = opt.int_value;
+      break;
     case 'K':
       flags.check_cached_mmaps = true;
       break;
+    case 'L':
+      flags.timeline_log = opt.value;
+      break;
     case 'M':
       flags.mark_stdio = true;
       break;
+    case 'O':
+      flags.follow_trace = true;
+      break;
+    case 'R':
+      if (!opt.verify_valid_int(0, SIZE_MAX / (1024 * 1024))) {
+        return false;
+      }
+      flags.read_ahead_bytes = (size_t)opt.int_value * 1024 * 1024;
+      break;
     case 'S':
       flags.suppress_environment_warnings = true;
       break;
     case 'T':
-      flags.dump_at = atoi(opt.value.c_str());
+      flags.dump_at = strtoll(opt.value.c_str(), nullptr, 10);
       break;
     case 'V':
       flags.verbose = true;
       break;
+    case 'Y':
+      flags.memory_report = true;
+      break;
+    case 'Z':
+      flags.dump_binary = true;
+      break;
     default:
       assert(0 && "Invalid flag");
   }
@@ -239,5 +311,9 @@ int main(int argc, char* argv[]) {
     command = RecordCommand::get();
   }
 
-  return command->run(args);
+  int ret = command->run(args);
+  if (Flags::get().memory_report) {
+    MemoryAccounting::print(stderr);
+  }
+  return ret;
 }
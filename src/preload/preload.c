@@ -111,13 +111,39 @@ static int buffer_enabled;
 static int process_inited;
 
 /**
- * If syscallbuf_fds_disabled[fd] is nonzero, then operations on that fd
+ * If bit |fd| of syscallbuf_fds_disabled is set, then operations on that fd
  * must be performed through traced syscalls, not the syscallbuf.
- * The rr supervisor modifies this array directly to dynamically turn
- * syscallbuf on and off for particular fds. fds outside the array range must
- * never use the syscallbuf.
+ * The rr supervisor modifies this bitmap directly to dynamically turn
+ * syscallbuf on and off for particular fds. fds outside the bitmap's range
+ * must never use the syscallbuf.
  */
-static volatile char syscallbuf_fds_disabled[SYSCALLBUF_FDS_DISABLED_SIZE];
+static volatile char syscallbuf_fds_disabled[SYSCALLBUF_FDS_DISABLED_BYTES];
+
+/**
+ * If syscallbuf_fds_nonblocking[fd] is nonzero, then fd is known to be in
+ * O_NONBLOCK mode, so buffered syscalls on it can't block and don't need
+ * the desched event armed around them. We set entries when we see
+ * O_NONBLOCK applied by a buffered open() or fcntl(). Both we and the rr
+ * supervisor clear them whenever an fd may have been closed, replaced or
+ * switched back to blocking mode, so a stale entry can only err towards
+ * arming the event.
+ */
+static volatile char
+    syscallbuf_fds_nonblocking[SYSCALLBUF_FDS_NONBLOCKING_SIZE];
+
+/**
+ * Filled in by rr during SYS_rrcall_init_preload. Patched rdtsc
+ * instructions use it to turn a clock_gettime() result into a TSC value
+ * consistent with the ones rr returns for rdtscs it traps.
+ */
+static struct rdtsc_calibration rdtsc_calibration;
+
+/**
+ * Statistics of may-block syscall sites, which rr uses to decide which
+ * sites we should trace instead of buffering. See struct
+ * syscallbuf_site_stats.
+ */
+static struct syscallbuf_site_stats syscallbuf_sites[SYSCALLBUF_SITE_SLOTS];
 
 /**
  * Because this library is always loaded via LD_PRELOAD, we can use the
@@ -135,6 +161,9 @@ static __thread int thread_inited TLS_STORAGE_MODEL;
  * syscallbuf_hdr|, so |buffer| is also a pointer to the buffer
  * header. */
 static __thread uint8_t* buffer TLS_STORAGE_MODEL;
+/* How many bytes of |buffer|, counting the header, may be used.  rr
+ * sets this, and may change it whenever it flushes the buffer. */
+static __thread uint32_t buffer_size TLS_STORAGE_MODEL;
 /* This is used to support the buffering of "may-block" system calls.
  * The problem that needs to be addressed can be introduced with a
  * simple example; assume that we're buffering the "read" and "write"
@@ -170,6 +199,13 @@ static __thread uint8_t* buffer TLS_STORAGE_MODEL;
  * numerous implementation details that are documented in
  * handle_signal.c, where they're dealt with. */
 static __thread int desched_counter_fd TLS_STORAGE_MODEL;
+/* Set when a may-block syscall was traced because this thread's desched
+ * counter isn't open yet. syscall_hook() opens it when the syscall
+ * returns. */
+static __thread int desched_counter_wanted TLS_STORAGE_MODEL;
+/* The syscallbuf_site_stats slot of the site of the syscall this thread
+ * is making. */
+static __thread uint8_t current_site TLS_STORAGE_MODEL;
 
 /* Points at the libc/pthread pthread_create().  We wrap
  * pthread_create, so need to retain this pointer to call out to the
@@ -198,10 +234,10 @@ static uint8_t* buffer_last(void) {
 }
 
 /**
- * Return a pointer to the byte just after the very end of the mapped
- * region.
+ * Return a pointer to the byte just after the very end of the usable
+ * part of the mapped region.
  */
-static uint8_t* buffer_end(void) { return buffer + SYSCALLBUF_BUFFER_SIZE; }
+static uint8_t* buffer_end(void) { return buffer + buffer_size; }
 
 #define MEMCPY_UNROLL 4
 #define MEMCPY_WORD uintptr_t
@@ -521,14 +557,14 @@ static int open_desched_event_counter(size_t nr_descheds, pid_t tid) {
 static void set_up_buffer(void) {
   struct rrcall_init_buffers_params args;
 
-  /* NB: we want this setup emulated during replay. */
-  if (buffer_enabled) {
-    desched_counter_fd = open_desched_event_counter(1, traced_gettid());
-  } else {
-    desched_counter_fd = -1;
-  }
+  /* Many threads never buffer a may-block syscall, so the desched
+   * counter is opened on demand by set_up_desched_counter(). */
+  desched_counter_fd = -1;
+  desched_counter_wanted = 0;
 
-  args.desched_counter_fd = desched_counter_fd;
+  /* rr overwrites this with the size it picked for this thread. */
+  buffer_size = SYSCALLBUF_BUFFER_SIZE;
+  args.syscallbuf_size_ptr = &buffer_size;
 
   /* Trap to rr: let the magic begin!
    *
@@ -542,6 +578,25 @@ static void set_up_buffer(void) {
   buffer = args.syscallbuf_ptr;
 }
 
+/**
+ * Open this thread's desched counter and share it with rr, before the
+ * first may-block syscall the thread buffers.
+ */
+static void set_up_desched_counter(void) {
+  sigset_t mask;
+
+  desched_counter_wanted = 0;
+  enter_signal_critical_section(&mask);
+  /* A signal handler that ran before we masked signals may have beaten
+   * us to it. */
+  if (buffer && desched_counter_fd < 0) {
+    /* NB: we want this setup emulated during replay. */
+    desched_counter_fd = open_desched_event_counter(1, traced_gettid());
+    traced_syscall1(SYS_rrcall_init_desched, desched_counter_fd);
+  }
+  exit_signal_critical_section(&mask);
+}
+
 /**
  * Initialize thread-local buffering state, if enabled.
  */
@@ -591,6 +646,8 @@ static void __attribute__((constructor)) init_process(void) {
   params.syscallbuf_enabled = buffer_enabled;
   params.syscallbuf_fds_disabled =
       buffer_enabled ? syscallbuf_fds_disabled : NULL;
+  params.syscallbuf_fds_nonblocking =
+      buffer_enabled ? syscallbuf_fds_nonblocking : NULL;
   params.syscall_hook_trampoline = (void*)_syscall_hook_trampoline;
 #if defined(__i386__)
   extern RR_HIDDEN void _syscall_hook_trampoline_3d_01_f0_ff_ff(void);
@@ -603,9 +660,17 @@ static void __attribute__((constructor)) init_process(void) {
   params.syscall_patch_hook_count =
       sizeof(syscall_patch_hooks) / sizeof(syscall_patch_hooks[0]);
   params.syscall_patch_hooks = syscall_patch_hooks;
+  /* 32-bit code reads the TSC into %edx:%eax and uses it in too many
+   * different ways for a short list of patterns to be worthwhile. */
+  params.rdtsc_patch_hook_count = 0;
+  params.rdtsc_patch_hooks = NULL;
 #elif defined(__x86_64__)
   extern RR_HIDDEN void _syscall_hook_trampoline_48_3d_01_f0_ff_ff(void);
+  extern RR_HIDDEN void _syscall_hook_trampoline_48_3d_00_f0_ff_ff(void);
   extern RR_HIDDEN void _syscall_hook_trampoline_48_8b_3c_24(void);
+  extern RR_HIDDEN void _syscall_hook_trampoline_48_89_45_f8(void);
+  extern RR_HIDDEN void _syscall_hook_trampoline_48_89_c3(void);
+  extern RR_HIDDEN void _syscall_hook_trampoline_89_c2_f7_da(void);
   extern RR_HIDDEN void _syscall_hook_trampoline_90_90_90(void);
   struct syscall_patch_hook syscall_patch_hooks[] = {
     /* Many glibc syscall wrappers (e.g. read) have 'syscall' followed by
@@ -614,18 +679,48 @@ static void __attribute__((constructor)) init_process(void) {
       (uintptr_t)_syscall_hook_trampoline_48_3d_01_f0_ff_ff },
     /* Many glibc syscall wrappers (e.g. read) have 'syscall' followed by
      * mov (%rsp),%rdi (in glibc-2.18-16.fc20.x86_64) */
+    /* Inline syscalls compiled from newer glibc headers check the result
+     * with cmp $-4096,%rax */
+    { 6, { 0x48, 0x3d, 0x00, 0xf0, 0xff, 0xff },
+      (uintptr_t)_syscall_hook_trampoline_48_3d_00_f0_ff_ff },
     { 4, { 0x48, 0x8b, 0x3c, 0x24 },
       (uintptr_t)_syscall_hook_trampoline_48_8b_3c_24 },
+    /* Code that spills the result to a frame-pointer-based local has
+     * 'syscall' followed by mov %rax,-0x8(%rbp) */
+    { 4, { 0x48, 0x89, 0x45, 0xf8 },
+      (uintptr_t)_syscall_hook_trampoline_48_89_45_f8 },
+    /* Inline syscalls whose result is kept in a callee-saved register
+     * have 'syscall' followed by mov %rax,%rbx */
+    { 3, { 0x48, 0x89, 0xc3 }, (uintptr_t)_syscall_hook_trampoline_48_89_c3 },
+    /* Code that turns the result into a positive errno has 'syscall'
+     * followed by mov %eax,%edx; neg %edx */
+    { 4, { 0x89, 0xc2, 0xf7, 0xda },
+      (uintptr_t)_syscall_hook_trampoline_89_c2_f7_da },
     /* Our VDSO vsyscall patches have 'syscall' followed by "nop; nop; nop" */
     { 3, { 0x90, 0x90, 0x90 }, (uintptr_t)_syscall_hook_trampoline_90_90_90 }
   };
   params.syscall_patch_hook_count =
       sizeof(syscall_patch_hooks) / sizeof(syscall_patch_hooks[0]);
   params.syscall_patch_hooks = syscall_patch_hooks;
+
+  extern RR_HIDDEN void _rdtsc_hook_trampoline_48_c1_e2_20(void);
+  struct syscall_patch_hook rdtsc_patch_hooks[] = {
+    /* __rdtsc() and most hand-rolled equivalents compile to 'rdtsc'
+     * followed by shl $0x20,%rdx */
+    { 4, { 0x48, 0xc1, 0xe2, 0x20 },
+      (uintptr_t)_rdtsc_hook_trampoline_48_c1_e2_20 }
+  };
+  params.rdtsc_patch_hook_count =
+      sizeof(rdtsc_patch_hooks) / sizeof(rdtsc_patch_hooks[0]);
+  params.rdtsc_patch_hooks = rdtsc_patch_hooks;
 #else
   params.syscall_patch_hook_count = 0;
   params.syscall_patch_hooks = NULL;
+  params.rdtsc_patch_hook_count = 0;
+  params.rdtsc_patch_hooks = NULL;
 #endif
+  params.syscallbuf_sites = buffer_enabled ? syscallbuf_sites : NULL;
+  params.rdtsc_calibration = &rdtsc_calibration;
 
   enter_signal_critical_section(&mask);
   traced_syscall1(SYS_rrcall_init_preload, &params);
@@ -823,7 +918,7 @@ static void* prep_syscall(void) {
  */
 static void* prep_syscall_for_fd(int fd) {
   if (fd < 0 || fd >= SYSCALLBUF_FDS_DISABLED_SIZE ||
-      syscallbuf_fds_disabled[fd]) {
+      (syscallbuf_fds_disabled[fd >> 3] & (1 << (fd & 7)))) {
     return NULL;
   }
   return prep_syscall();
@@ -860,6 +955,44 @@ enum {
   MAY_BLOCK = -1,
   WONT_BLOCK = -2
 };
+
+/**
+ * Return WONT_BLOCK if |fd| is known to be nonblocking, MAY_BLOCK
+ * otherwise.
+ */
+static int fd_blockness(int fd) {
+  if (fd >= 0 && fd < SYSCALLBUF_FDS_NONBLOCKING_SIZE &&
+      syscallbuf_fds_nonblocking[fd]) {
+    return WONT_BLOCK;
+  }
+  return MAY_BLOCK;
+}
+
+/**
+ * Note whether |fd| is in O_NONBLOCK mode.  The mode belongs to the open
+ * file description, which other fds may share, so turning it off for
+ * one fd forgets what we knew about all of them.
+ */
+static void note_fd_nonblocking(int fd, int nonblocking) {
+  if (!nonblocking) {
+    int i;
+    for (i = 0; i < SYSCALLBUF_FDS_NONBLOCKING_SIZE; ++i) {
+      syscallbuf_fds_nonblocking[i] = 0;
+    }
+  } else if (fd >= 0 && fd < SYSCALLBUF_FDS_NONBLOCKING_SIZE) {
+    syscallbuf_fds_nonblocking[fd] = 1;
+  }
+}
+
+/**
+ * Forget whether |fd| is nonblocking, because it's being closed or
+ * replaced.
+ */
+static void forget_fd_nonblocking(int fd) {
+  if (fd >= 0 && fd < SYSCALLBUF_FDS_NONBLOCKING_SIZE) {
+    syscallbuf_fds_nonblocking[fd] = 0;
+  }
+}
 static int start_commit_buffered_syscall(int syscallno, void* record_end,
                                          int blockness) {
   void* record_start;
@@ -893,8 +1026,28 @@ static int start_commit_buffered_syscall(int syscallno, void* record_end,
    *
    * NBB: this *MUST* be set before the desched event is
    * armed. */
+  if (MAY_BLOCK == blockness) {
+    struct syscallbuf_site_stats* site = &syscallbuf_sites[current_site];
+    if (desched_counter_fd < 0) {
+      /* We can't make the traced syscalls that open the counter with the
+       * buffer locked, so trace this syscall and open it afterward. */
+      desched_counter_wanted = 1;
+      buffer_hdr()->locked = 0;
+      return 0;
+    }
+    if (++site->attempts >= SYSCALLBUF_SITE_WINDOW) {
+      site->attempts /= 2;
+      site->descheds /= 2;
+    }
+    if (site->trace && site->attempts % SYSCALLBUF_SITE_PROBE_PERIOD) {
+      /* This site usually blocks, so trap to rr directly. */
+      buffer_hdr()->locked = 0;
+      return 0;
+    }
+  }
   rec->syscallno = syscallno;
   rec->desched = MAY_BLOCK == blockness;
+  rec->site = current_site;
   rec->size = record_end - record_start;
   if (rec->desched) {
     /* NB: the ordering of the next two statements is
@@ -964,6 +1117,12 @@ static long commit_raw_syscall(int syscallno, void* record_end, long ret) {
           syscallno);
   }
 
+  if (rec->desched && !hdr->abort_commit) {
+    /* If this was a probe of a traced site, it didn't block this time,
+     * so go back to buffering it. */
+    syscallbuf_sites[rec->site].trace = 0;
+  }
+
   if (hdr->abort_commit) {
     /* We were descheduled in the middle of a may-block
      * syscall, and it was recorded as a normal entry/exit
@@ -972,6 +1131,9 @@ static long commit_raw_syscall(int syscallno, void* record_end, long ret) {
     hdr->abort_commit = 0;
   } else {
     rec->ret = ret;
+    if (record_end < record_start + rec->size) {
+      rec->size = record_end - record_start;
+    }
     hdr->num_rec_bytes += stored_record_size(rec->size);
   }
 
@@ -1040,6 +1202,7 @@ static long sys_close(const struct syscall_info* call) {
   void* ptr = prep_syscall_for_fd(fd);
   long ret;
 
+  forget_fd_nonblocking(fd);
   if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
     return traced_raw_syscall(call);
   }
@@ -1063,6 +1226,42 @@ static long sys_creat(const struct syscall_info* call) {
   return sys_open(&open_call);
 }
 
+static long sys_epoll_wait(const struct syscall_info* call) {
+  const int syscallno = SYS_epoll_wait;
+  int epfd = call->args[0];
+  struct epoll_event* events = (struct epoll_event*)call->args[1];
+  int maxevents = call->args[2];
+  int timeout = call->args[3];
+
+  void* ptr = prep_syscall_for_fd(epfd);
+  struct epoll_event* events2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (maxevents <= 0) {
+    /* Let the kernel report the error. */
+    return traced_raw_syscall(call);
+  }
+  events2 = ptr;
+  ptr += maxevents * sizeof(*events2);
+  if (!start_commit_buffered_syscall(syscallno, ptr,
+                                     timeout ? MAY_BLOCK : WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall4(syscallno, epfd, events2, maxevents, timeout);
+
+  /* Only the first |ret| events are written, so only they need to be
+   * kept in the record. */
+  ptr = events2;
+  if (ret > 0) {
+    local_memcpy(events, events2, ret * sizeof(*events));
+    ptr += ret * sizeof(*events2);
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static int sys_fcntl64_no_outparams(const struct syscall_info* call) {
   const int syscallno = RR_FCNTL_SYSCALL;
   int fd = call->args[0];
@@ -1080,6 +1279,23 @@ static int sys_fcntl64_no_outparams(const struct syscall_info* call) {
     return traced_raw_syscall(call);
   }
   ret = untraced_syscall3(syscallno, fd, cmd, arg);
+  if (ret >= 0) {
+    switch (cmd) {
+      case F_GETFL:
+        /* Finding blocking mode where we expected O_NONBLOCK means
+         * it was changed behind our back; see note_fd_nonblocking(). */
+        if ((ret & O_NONBLOCK) || fd_blockness(fd) == WONT_BLOCK) {
+          note_fd_nonblocking(fd, ret & O_NONBLOCK);
+        }
+        break;
+      case F_SETFL:
+        note_fd_nonblocking(fd, arg & O_NONBLOCK);
+        break;
+      case F_DUPFD:
+        forget_fd_nonblocking(ret);
+        break;
+    }
+  }
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
@@ -1269,6 +1485,34 @@ static long sys_futex(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+static long sys_getdents64(const struct syscall_info* call) {
+  const int syscallno = SYS_getdents64;
+  int fd = call->args[0];
+  void* dirp = (void*)call->args[1];
+  unsigned int count = call->args[2];
+
+  void* ptr = prep_syscall_for_fd(fd);
+  void* dirp2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (dirp && count > 0) {
+    dirp2 = ptr;
+    ptr += count;
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, WONT_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall3(syscallno, fd, dirp2, count);
+
+  if (dirp2 && ret > 0) {
+    local_memcpy(dirp, dirp2, ret);
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_gettimeofday(const struct syscall_info* call) {
   const int syscallno = SYS_gettimeofday;
   struct timeval* tp = (struct timeval*)call->args[0];
@@ -1379,6 +1623,35 @@ static long sys_madvise(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+static long sys_nanosleep(const struct syscall_info* call) {
+  const int syscallno = SYS_nanosleep;
+  const struct timespec* req = (const struct timespec*)call->args[0];
+  struct timespec* rem = (struct timespec*)call->args[1];
+
+  void* ptr = prep_syscall();
+  struct timespec* rem2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (rem) {
+    rem2 = ptr;
+    ptr += sizeof(*rem2);
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  ret = untraced_syscall2(syscallno, req, rem2);
+
+  /* The kernel only writes the remaining time if we were
+   * interrupted. */
+  if (rem2 && ret == -EINTR) {
+    local_memcpy(rem, rem2, sizeof(*rem));
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
 static long sys_open(const struct syscall_info* call) {
   const int syscallno = SYS_open;
   const char* pathname = (const char*)call->args[0];
@@ -1411,9 +1684,42 @@ static long sys_open(const struct syscall_info* call) {
   }
 
   ret = untraced_syscall3(syscallno, pathname, flags, mode);
+  if (ret >= 0) {
+    if (flags & O_NONBLOCK) {
+      note_fd_nonblocking(ret, 1);
+    } else {
+      forget_fd_nonblocking(ret);
+    }
+  }
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+/**
+ * Rewrite the pollfd array |fds| in place as the array of
+ * poll_ready_entry for its entries with nonzero revents, and return the
+ * end of the compacted array. rr rebuilds the rest at replay. This runs
+ * in replay too, after rr has rebuilt the array, so the record ends up
+ * the same.
+ */
+static void* compact_poll_results(struct pollfd* fds, unsigned int nfds) {
+  struct poll_ready_entry* entries = (struct poll_ready_entry*)fds;
+  unsigned int i;
+  unsigned int n = 0;
+
+  for (i = 0; i < nfds; ++i) {
+    short revents = fds[i].revents;
+    if (revents) {
+      /* |n| <= |i|, so this never overwrites an entry we haven't read
+       * yet. */
+      entries[n].index = i;
+      entries[n].revents = revents;
+      entries[n]._padding = 0;
+      ++n;
+    }
+  }
+  return entries + n;
+}
+
 static long sys_poll(const struct syscall_info* call) {
   const int syscallno = SYS_poll;
   struct pollfd* fds = (struct pollfd*)call->args[0];
@@ -1430,7 +1736,8 @@ static long sys_poll(const struct syscall_info* call) {
     fds2 = ptr;
     ptr += nfds * sizeof(*fds2);
   }
-  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+  if (!start_commit_buffered_syscall(syscallno, ptr,
+                                     timeout ? MAY_BLOCK : WONT_BLOCK)) {
     return traced_raw_syscall(call);
   }
   if (fds2) {
@@ -1447,7 +1754,63 @@ static long sys_poll(const struct syscall_info* call) {
      * but we assume those are rare enough not to merit a
      * special case here. */
     local_memcpy(fds, fds2, nfds * sizeof(*fds));
+    if (ret >= 0) {
+      ptr = compact_poll_results(fds2, nfds);
+    }
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+static long sys_pread64(const struct syscall_info* call) {
+  const int syscallno = SYS_pread64;
+  int fd = call->args[0];
+  void* buf = (void*)call->args[1];
+  size_t count = call->args[2];
+
+  void* ptr = prep_syscall_for_fd(fd);
+  void* buf2 = NULL;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (buf && count > 0) {
+    buf2 = ptr;
+    ptr += count;
+  }
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
+  }
+
+  /* On x86 the offset takes two argument registers; on x86-64 the
+   * kernel ignores the extra argument. */
+  ret = untraced_syscall5(syscallno, fd, buf2, count, call->args[3],
+                          call->args[4]);
+
+  if (buf2 && ret > 0) {
+    local_memcpy(buf, buf2, ret);
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+static long sys_pwrite64(const struct syscall_info* call) {
+  const int syscallno = SYS_pwrite64;
+  int fd = call->args[0];
+  const void* buf = (const void*)call->args[1];
+  size_t count = call->args[2];
+
+  void* ptr = prep_syscall_for_fd(fd);
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+    return traced_raw_syscall(call);
   }
+
+  /* See sys_pread64. */
+  ret = untraced_syscall5(syscallno, fd, buf, count, call->args[3],
+                          call->args[4]);
+
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
@@ -1467,7 +1830,7 @@ static long sys_read(const struct syscall_info* call) {
     buf2 = ptr;
     ptr += count;
   }
-  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+  if (!start_commit_buffered_syscall(syscallno, ptr, fd_blockness(fd))) {
     return traced_raw_syscall(call);
   }
 
@@ -1506,6 +1869,106 @@ static long sys_readlink(const struct syscall_info* call) {
   return commit_raw_syscall(syscallno, ptr, ret);
 }
 
+#if defined(SYS_socketcall)
+#define RR_RECVMSG_SYSCALL SYS_socketcall
+#define RR_SENDMSG_SYSCALL SYS_socketcall
+#define untraced_recvmsg(sockfd, msg, flags)                                   \
+  untraced_socketcall3(SYS_RECVMSG, sockfd, msg, flags)
+#define untraced_sendmsg(sockfd, msg, flags)                                   \
+  untraced_socketcall3(SYS_SENDMSG, sockfd, msg, flags)
+#else
+#define RR_RECVMSG_SYSCALL SYS_recvmsg
+#define RR_SENDMSG_SYSCALL SYS_sendmsg
+#define untraced_recvmsg(sockfd, msg, flags)                                   \
+  untraced_syscall3(SYS_recvmsg, sockfd, msg, flags)
+#define untraced_sendmsg(sockfd, msg, flags)                                   \
+  untraced_syscall3(SYS_sendmsg, sockfd, msg, flags)
+#endif
+
+/**
+ * recvmsg(), whether it came in directly or (on x86-32) as a socketcall
+ * with |call->args[1]| pointing at the arguments.
+ */
+static long sys_recvmsg_args(const struct syscall_info* call, int sockfd,
+                             struct msghdr* msg, int flags) {
+  const int syscallno = RR_RECVMSG_SYSCALL;
+
+  void* ptr = prep_syscall_for_fd(sockfd);
+  struct msghdr* msg2;
+  struct iovec* iov2;
+  void* name2 = NULL;
+  size_t i;
+  long ret;
+
+  assert(syscallno == call->no);
+
+  /* Control messages can install fds (SCM_RIGHTS) in the
+   * tracee, which we can't emulate during replay, so leave them
+   * to the traced path. */
+  if (!msg || msg->msg_controllen > 0) {
+    return traced_raw_syscall(call);
+  }
+
+  /* Give the kernel a copy of |msg| whose name and iovec
+   * buffers are in the syscallbuf. */
+  msg2 = ptr;
+  ptr += sizeof(*msg2);
+  iov2 = ptr;
+  ptr += msg->msg_iovlen * sizeof(*iov2);
+  if (msg->msg_name) {
+    ptr += msg->msg_namelen;
+  }
+  for (i = 0; i < msg->msg_iovlen; ++i) {
+    ptr += msg->msg_iov[i].iov_len;
+  }
+  if (!start_commit_buffered_syscall(
+          syscallno, ptr,
+          (flags & MSG_DONTWAIT) ? WONT_BLOCK : fd_blockness(sockfd))) {
+    return traced_raw_syscall(call);
+  }
+
+  ptr = iov2 + msg->msg_iovlen;
+  *msg2 = *msg;
+  msg2->msg_iov = iov2;
+  if (msg->msg_name) {
+    name2 = ptr;
+    msg2->msg_name = name2;
+    ptr += msg->msg_namelen;
+  }
+  for (i = 0; i < msg->msg_iovlen; ++i) {
+    iov2[i].iov_base = ptr;
+    iov2[i].iov_len = msg->msg_iov[i].iov_len;
+    ptr += iov2[i].iov_len;
+  }
+
+  ret = untraced_recvmsg(sockfd, msg2, flags);
+
+  if (ret >= 0) {
+    size_t remaining = ret;
+    if (name2) {
+      local_memcpy(msg->msg_name, name2,
+                   msg2->msg_namelen < msg->msg_namelen ? msg2->msg_namelen
+                                                        : msg->msg_namelen);
+    }
+    msg->msg_namelen = msg2->msg_namelen;
+    msg->msg_controllen = msg2->msg_controllen;
+    msg->msg_flags = msg2->msg_flags;
+    for (i = 0; i < msg->msg_iovlen && remaining > 0; ++i) {
+      size_t amount = remaining < iov2[i].iov_len ? remaining : iov2[i].iov_len;
+      local_memcpy(msg->msg_iov[i].iov_base, iov2[i].iov_base, amount);
+      remaining -= amount;
+    }
+  }
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+#if !defined(SYS_socketcall)
+static long sys_recvmsg(const struct syscall_info* call) {
+  return sys_recvmsg_args(call, call->args[0], (struct msghdr*)call->args[1],
+                          call->args[2]);
+}
+#endif
+
 #if defined(SYS_socketcall)
 static long sys_recv(const struct syscall_info* call) {
 #if defined(SYS_socketcall)
@@ -1521,6 +1984,7 @@ static long sys_recv(const struct syscall_info* call) {
 
   void* ptr = prep_syscall_for_fd(sockfd);
   void* buf2 = NULL;
+  int blockness = (flags & MSG_DONTWAIT) ? WONT_BLOCK : fd_blockness(sockfd);
   long ret;
 
   assert(syscallno == call->no);
@@ -1530,7 +1994,7 @@ static long sys_recv(const struct syscall_info* call) {
     ptr += len;
   }
 #if defined(SYS_socketcall)
-  if (!start_commit_buffered_syscall(SYS_socketcall, ptr, MAY_BLOCK)) {
+  if (!start_commit_buffered_syscall(SYS_socketcall, ptr, blockness)) {
     return traced_raw_syscall(call);
   }
 
@@ -1541,7 +2005,7 @@ static long sys_recv(const struct syscall_info* call) {
   }
   return commit_raw_syscall(SYS_socketcall, ptr, ret);
 #else
-  if (!start_commit_buffered_syscall(SYS_recvfrom, ptr, MAY_BLOCK)) {
+  if (!start_commit_buffered_syscall(SYS_recvfrom, ptr, blockness)) {
     return traced_raw_syscall(call);
   }
 
@@ -1553,11 +2017,46 @@ static long sys_recv(const struct syscall_info* call) {
   return commit_raw_syscall(SYS_recvfrom, ptr, ret);
 #endif
 }
+#endif
+
+static long sys_sendmsg_args(const struct syscall_info* call, int sockfd,
+                             const struct msghdr* msg, int flags) {
+  const int syscallno = RR_SENDMSG_SYSCALL;
+
+  void* ptr = prep_syscall_for_fd(sockfd);
+  long ret;
+
+  assert(syscallno == call->no);
+
+  if (!start_commit_buffered_syscall(
+          syscallno, ptr,
+          (flags & MSG_DONTWAIT) ? WONT_BLOCK : fd_blockness(sockfd))) {
+    return traced_raw_syscall(call);
+  }
 
+  ret = untraced_sendmsg(sockfd, msg, flags);
+
+  return commit_raw_syscall(syscallno, ptr, ret);
+}
+
+#if !defined(SYS_socketcall)
+static long sys_sendmsg(const struct syscall_info* call) {
+  return sys_sendmsg_args(call, call->args[0],
+                          (const struct msghdr*)call->args[1], call->args[2]);
+}
+#endif
+
+#if defined(SYS_socketcall)
 static long sys_socketcall(const struct syscall_info* call) {
+  long* args = (long*)call->args[1];
   switch (call->args[0]) {
     case SYS_RECV:
       return sys_recv(call);
+    case SYS_RECVMSG:
+      return sys_recvmsg_args(call, args[0], (struct msghdr*)args[1], args[2]);
+    case SYS_SENDMSG:
+      return sys_sendmsg_args(call, args[0], (const struct msghdr*)args[1],
+                              args[2]);
     default:
       return traced_raw_syscall(call);
   }
@@ -1623,7 +2122,7 @@ static long sys_write(const struct syscall_info* call) {
 
   assert(syscallno == call->no);
 
-  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+  if (!start_commit_buffered_syscall(syscallno, ptr, fd_blockness(fd))) {
     return traced_raw_syscall(call);
   }
 
@@ -1643,7 +2142,7 @@ static long sys_writev(const struct syscall_info* call) {
 
   assert(syscallno == call->no);
 
-  if (!start_commit_buffered_syscall(syscallno, ptr, MAY_BLOCK)) {
+  if (!start_commit_buffered_syscall(syscallno, ptr, fd_blockness(fd))) {
     return traced_raw_syscall(call);
   }
 
@@ -1661,12 +2160,14 @@ static long syscall_hook_internal(const struct syscall_info* call) {
     CASE(clock_gettime);
     CASE(close);
     CASE(creat);
+    CASE(epoll_wait);
 #if defined(SYS_fcntl64)
     CASE(fcntl64);
 #else
     CASE(fcntl);
 #endif
     CASE(futex);
+    CASE(getdents64);
     CASE(gettimeofday);
 #if defined(SYS__llseek)
     CASE(_llseek);
@@ -1674,12 +2175,18 @@ static long syscall_hook_internal(const struct syscall_info* call) {
     CASE(lseek);
 #endif
     CASE(madvise);
+    CASE(nanosleep);
     CASE(open);
     CASE(poll);
+    CASE(pread64);
+    CASE(pwrite64);
     CASE(read);
     CASE(readlink);
 #if defined(SYS_socketcall)
     CASE(socketcall);
+#else
+    CASE(recvmsg);
+    CASE(sendmsg);
 #endif
     CASE(time);
     CASE(write);
@@ -1709,8 +2216,37 @@ static long syscall_hook_internal(const struct syscall_info* call) {
 /* Explicitly declare this as hidden so we can call it from
  * _syscall_hook_trampoline without doing all sorts of special PIC handling.
  */
+#if RR_SYSCALL_FILTERING
+extern RR_HIDDEN char _syscall_hook_end[];
+
+/**
+ * Return the syscallbuf_site_stats slot of the site that made |call|. A
+ * patched syscall calls a stub that calls _syscall_hook_trampoline, while
+ * __kernel_vsyscall jumps there, so the site is the first return address
+ * above |call| that isn't in the hook code.
+ */
+static uint8_t site_of(const struct syscall_info* call) {
+  const uintptr_t* ret = (const uintptr_t*)(call + 1);
+  uintptr_t site = ret[0];
+  if (site >= (uintptr_t)_syscall_hook_trampoline &&
+      site < (uintptr_t)_syscall_hook_end) {
+    site = ret[1];
+  }
+  return (uint8_t)(((uint32_t)site * 2654435761u) >> 24);
+}
+#else
+static uint8_t site_of(__attribute__((unused)) const struct syscall_info* call) {
+  return 0;
+}
+#endif
+
 RR_HIDDEN long syscall_hook(const struct syscall_info* call) {
-  long result = syscall_hook_internal(call);
+  long result;
+  current_site = site_of(call);
+  result = syscall_hook_internal(call);
+  if (desched_counter_wanted) {
+    set_up_desched_counter();
+  }
   if (buffer_hdr() && buffer_hdr()->notify_on_syscall_hook_exit) {
     // This syscall will clear notify_on_syscall_hook_exit. Clearing it
     // ourselves is tricky to get right without races.
@@ -1746,6 +2282,27 @@ RR_HIDDEN long syscall_hook(const struct syscall_info* call) {
   return result;
 }
 
+/**
+ * Called from the trampolines of patched rdtsc instructions. Reads
+ * CLOCK_MONOTONIC_RAW through the syscall buffer (falling back to a
+ * traced syscall like any other buffered syscall) and converts it to a
+ * TSC value with the calibration rr gave us.
+ */
+RR_HIDDEN uint64_t rdtsc_hook(void) {
+  struct timespec ts;
+  struct syscall_info call = { SYS_clock_gettime,
+                               { CLOCK_MONOTONIC_RAW, (long)&ts } };
+  uint64_t ns;
+
+  if (syscall_hook(&call) < 0) {
+    return rdtsc_calibration.tsc_base;
+  }
+  ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+  return rdtsc_calibration.tsc_base +
+         (((ns - rdtsc_calibration.ns_base) * rdtsc_calibration.tsc_per_ns) >>
+          RDTSC_CALIBRATION_SHIFT);
+}
+
 /**
  * Exported glibc synonym for |sysconf()|.  We can't use |dlsym()| to
  * resolve the next "sysconf" symbol, because
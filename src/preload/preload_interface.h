@@ -29,16 +29,38 @@
  * normal applications don't use it either. */
 #define SYSCALLBUF_DESCHED_SIGNAL SIGSYS
 
-/* This size counts the header along with record data. */
+/* This size counts the header along with record data.  It's the size
+ * of the mapped segment and so the most a thread's buffer can grow to;
+ * rr picks the usable size of each thread's buffer between
+ * SYSCALLBUF_MIN_BUFFER_SIZE and this, and adjusts it at flush time. */
 #define SYSCALLBUF_BUFFER_SIZE (1 << 20)
+#define SYSCALLBUF_MIN_BUFFER_SIZE (1 << 16)
+#define SYSCALLBUF_INITIAL_BUFFER_SIZE (1 << 18)
 
 /* Set this env var to enable syscall buffering. */
 #define SYSCALLBUF_ENABLED_ENV_VAR "_RR_USE_SYSCALLBUF"
 
-/* Size of table mapping fd numbers to syscallbuf-disabled flag.
- * Most Linux kernels limit fds to 1024 so it probably doesn't make sense
- * to raise this value... */
-#define SYSCALLBUF_FDS_DISABLED_SIZE 1024
+/* Number of fds covered by the bitmap of syscallbuf-disabled fds. This is
+ * the kernel's default limit on fs.nr_open. The bitmap lives in the preload
+ * library's bss, so only the pages holding bits rr has set take any
+ * memory. */
+#define SYSCALLBUF_FDS_DISABLED_SIZE (1 << 20)
+#define SYSCALLBUF_FDS_DISABLED_BYTES (SYSCALLBUF_FDS_DISABLED_SIZE / 8)
+
+/* Size of table mapping fd numbers to known-nonblocking flag. */
+#define SYSCALLBUF_FDS_NONBLOCKING_SIZE 1024
+
+/* Number of entries in the table of may-block syscall sites. Sites are
+ * hashed into it, so unrelated sites may share an entry. */
+#define SYSCALLBUF_SITE_SLOTS 256
+/* Sites are judged on about this many recent calls: the preload library
+ * halves a site's counts when its attempts reach this. */
+#define SYSCALLBUF_SITE_WINDOW 1024
+/* rr doesn't judge a site until it's been called this often. */
+#define SYSCALLBUF_SITE_MIN_ATTEMPTS 8
+/* While a site is traced, every this-many calls are buffered anyway, to
+ * find out whether the site has stopped blocking. */
+#define SYSCALLBUF_SITE_PROBE_PERIOD 16
 
 #define RR_PAGE_ADDR 0x70000000
 #define RR_PAGE_IN_UNTRACED_SYSCALL_ADDR (RR_PAGE_ADDR + 4)
@@ -67,6 +89,12 @@
  * unlocking the syscallbuf and notify_after_syscall_hook_exit has been set.
  */
 #define SYS_rrcall_notify_syscall_hook_exit 444
+/**
+ * The preload library calls SYS_rrcall_init_desched with the fd of the
+ * thread's desched counter once it has opened it, before the first
+ * may-block syscall the thread buffers.
+ */
+#define SYS_rrcall_init_desched 445
 
 /* Define macros that let us compile a struct definition either "natively"
  * (when included by preload.c) or as a template over Arch for use by rr.
@@ -96,6 +124,25 @@ struct syscall_patch_hook {
   uint64_t hook_address;
 };
 
+/**
+ * rdtsc instructions are patched the same way: the rdtsc and the instruction
+ * following it are replaced by a call to a hook that returns a virtual TSC
+ * value computed from a buffered clock_gettime(CLOCK_MONOTONIC_RAW), so the
+ * common case never traps to rr. rr computes the virtual TSC for rdtscs it
+ * still traps with the same formula, using this calibration:
+ *
+ *   tsc = tsc_base + (((ns - ns_base) * tsc_per_ns) >> RDTSC_CALIBRATION_SHIFT)
+ *
+ * All fields are 64-bit so the layout is the same for 32- and 64-bit tracees.
+ */
+#define RDTSC_CALIBRATION_SHIFT 12
+struct rdtsc_calibration {
+  uint64_t tsc_base;
+  uint64_t ns_base;
+  /* TSC ticks per nanosecond, scaled by 2^RDTSC_CALIBRATION_SHIFT. */
+  uint64_t tsc_per_ns;
+};
+
 /**
  * Packs up the parameters passed to |SYS_rrcall_init_preload|.
  * We use this struct because it's a little cleaner.
@@ -110,8 +157,20 @@ struct rrcall_init_preload_params {
   int syscall_patch_hook_count;
   PTR(struct syscall_patch_hook) syscall_patch_hooks;
   PTR(void) syscall_hook_trampoline;
-  /* Array of size SYSCALLBUF_FDS_DISABLED_SIZE */
+  /* Bitmap of SYSCALLBUF_FDS_DISABLED_SIZE bits, bit (fd & 7) of byte
+   * (fd >> 3) for each fd */
   PTR(volatile char) syscallbuf_fds_disabled;
+  /* Array of size SYSCALLBUF_FDS_NONBLOCKING_SIZE */
+  PTR(volatile char) syscallbuf_fds_nonblocking;
+  int rdtsc_patch_hook_count;
+  PTR(struct syscall_patch_hook) rdtsc_patch_hooks;
+  /* Array of size SYSCALLBUF_SITE_SLOTS */
+  PTR(struct syscallbuf_site_stats) syscallbuf_sites;
+
+  /* "Out" params. */
+  /* rr fills this in (and records it) so that patched rdtscs and
+   * trapped rdtscs produce values on the same time base. */
+  PTR(struct rdtsc_calibration) rdtsc_calibration;
 };
 
 /**
@@ -121,8 +180,10 @@ struct rrcall_init_preload_params {
  */
 TEMPLATE_ARCH
 struct rrcall_init_buffers_params {
-  /* The fd we're using to track desched events. */
-  int desched_counter_fd;
+  /* Where the syscallbuf lib keeps the usable size of this thread's
+   * buffer.  rr writes the initial size here and updates it whenever
+   * it resizes the buffer after a flush. */
+  PTR(uint32_t) syscallbuf_size_ptr;
 
   /* "Out" params. */
   /* Returned pointer to and size of the shared syscallbuf
@@ -154,7 +215,9 @@ struct syscallbuf_record {
   /* Did the tracee arm/disarm the desched notification for this
    * syscall? */
   uint8_t desched;
-  uint8_t _padding;
+  /* The syscallbuf_site_stats slot of the call site, for may-block
+   * syscalls. */
+  uint8_t site;
   /* Size of entire record in bytes: this struct plus extra
    * recorded data stored inline after the last field, not
    * including padding.
@@ -165,6 +228,41 @@ struct syscallbuf_record {
   uint8_t extra_data[0];
 } __attribute__((__packed__));
 
+/**
+ * poll() and ppoll() don't record their whole pollfd array, only the
+ * entries whose revents came back nonzero, as an array of these. The
+ * kernel sets every other entry's revents to 0 and doesn't touch fd or
+ * events, so rr rebuilds the array at replay from the input array already
+ * in tracee memory. An entry is no bigger than a struct pollfd, so a
+ * buffered poll() can compact its record in place before committing it.
+ */
+struct poll_ready_entry {
+  uint32_t index;
+  int16_t revents;
+  uint16_t _padding;
+};
+
+/**
+ * How often the may-block syscalls made at a call site (or at the sites
+ * sharing its slot) are descheduled. Buffering a call that blocks costs
+ * more than tracing it, because rr has to guide the tracee through the
+ * desched signal, the aborted commit and the disarm ioctl. So rr, which
+ * sees the descheds, sets |trace| when most of a site's recent calls
+ * blocked, and the preload library then traces that site's calls. The
+ * table is per process and lives in the preload library.
+ */
+struct syscallbuf_site_stats {
+  /* Calls made at the site, buffered or not. Updated by the preload
+   * library. */
+  uint16_t attempts;
+  /* Buffered calls that were descheduled. Updated by rr. */
+  uint16_t descheds;
+  /* Set by rr when the site's calls usually block; cleared by the preload
+   * library when a probing call doesn't. */
+  uint8_t trace;
+  uint8_t _padding[3];
+};
+
 /**
  * This struct summarizes the state of the syscall buffer.  It happens
  * to be located at the start of the buffer.
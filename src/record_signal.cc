@@ -13,7 +13,6 @@
 #include <syscall.h>
 #include <sys/mman.h>
 #include <sys/user.h>
-#include <x86intrin.h>
 
 #include "preload/preload_interface.h"
 
@@ -30,8 +29,6 @@
 using namespace rr;
 using namespace std;
 
-static __inline__ unsigned long long rdtsc(void) { return __rdtsc(); }
-
 static const int STOPSIG_SYSCALL = 0x80 | SIGTRAP;
 
 /**
@@ -102,12 +99,6 @@ static bool try_handle_rdtsc(Task* t, siginfo_t* si) {
     return false;
   }
 
-  unsigned long long current_time = rdtsc();
-  Registers r = t->regs();
-  r.set_rdtsc_output(current_time);
-  r.set_ip(r.ip() + sizeof(rdtsc_insn));
-  t->set_regs(r);
-
   // When SIGSEGV is blocked, apparently the kernel has to do
   // some ninjutsu to raise the RDTSC trap.  We see the SIGSEGV
   // bit in the "SigBlk" mask in /proc/status cleared, and if
@@ -129,6 +120,20 @@ static bool try_handle_rdtsc(Task* t, siginfo_t* si) {
     restore_sigsegv_state(t);
   }
 
+  // If we can, patch the rdtsc to call into the preload library so we
+  // never see this trap again. Execution resumes at the patched call.
+  if (t->vm()->monkeypatcher().try_patch_rdtsc(t)) {
+    t->push_event(Event(EV_PATCH_RDTSC, HAS_EXEC_INFO, t->arch()));
+    LOG(debug) << "  patched rdtsc at " << t->ip();
+    return true;
+  }
+
+  uint64_t current_time = virtual_tsc_now();
+  Registers r = t->regs();
+  r.set_rdtsc_output(current_time);
+  r.set_ip(r.ip() + sizeof(rdtsc_insn));
+  t->set_regs(r);
+
   t->push_event(Event(EV_SEGV_RDTSC, HAS_EXEC_INFO, t->arch()));
   LOG(debug) << "  trapped for rdtsc: returning " << current_time;
   return true;
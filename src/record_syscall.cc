@@ -103,7 +103,11 @@ enum ArgMode {
   IN_OUT,
   // Syscall memory parameter is an in-out parameter but we must not use
   // scratch (e.g. for futexes, we must use the actual memory word).
-  IN_OUT_NO_SCRATCH
+  IN_OUT_NO_SCRATCH,
+  // Syscall memory parameter is an in-out parameter whose results are
+  // recorded by an after-syscall action rather than in full (e.g. only the
+  // ready entries of a pollfd array).
+  IN_OUT_NO_RECORD
 };
 
 /**
@@ -116,7 +120,7 @@ enum ArgMode {
  */
 struct ParamSize {
   ParamSize(size_t incoming_size = size_t(-1))
-      : incoming_size(incoming_size), from_syscall(false) {}
+      : incoming_size(incoming_size), elem_size(1), from_syscall(false) {}
   /**
    * p points to a tracee location that is already initialized with a
    * "maximum buffer size" passed in by the tracee, and which will be filled
@@ -152,6 +156,19 @@ struct ParamSize {
     r.read_size = sizeof(T);
     return r;
   }
+  /**
+   * When the syscall exits, the syscall result will be of type T and contain
+   * the number of 'elem_size'-byte elements in the data. A failed syscall
+   * wrote no elements. 'incoming_size', if present, is a bound on the size
+   * of the data in bytes.
+   */
+  template <typename T>
+  static ParamSize from_syscall_result_count(
+      size_t elem_size, size_t incoming_size = size_t(-1)) {
+    ParamSize r = from_syscall_result<T>(incoming_size);
+    r.elem_size = elem_size;
+    return r;
+  }
   /**
    * Indicate that the size will be at most 'max'.
    */
@@ -172,7 +189,7 @@ struct ParamSize {
   bool is_same_source(const ParamSize& other) const {
     return ((!mem_ptr.is_null() && other.mem_ptr == mem_ptr) ||
             (from_syscall && other.from_syscall)) &&
-           (read_size == other.read_size);
+           (read_size == other.read_size) && (elem_size == other.elem_size);
   }
   /**
    * Compute the actual size after the syscall has executed.
@@ -187,6 +204,8 @@ struct ParamSize {
   remote_ptr<void> mem_ptr;
   /** Size of the value at mem_ptr or in the syscall result register. */
   size_t read_size;
+  /** The syscall result counts elements of this many bytes. */
+  size_t elem_size;
   /** If true, the size is limited by the value of the syscall result. */
   bool from_syscall;
 };
@@ -222,6 +241,9 @@ size_t ParamSize::eval(Task* t, size_t already_consumed) const {
         ASSERT(t, false) << "Unknown read_size";
         return 0;
     }
+    if (elem_size > 1) {
+      syscall_size = t->regs().syscall_failed() ? 0 : syscall_size * elem_size;
+    }
     ASSERT(t, already_consumed <= syscall_size);
     s = min(s, syscall_size - already_consumed);
   }
@@ -229,6 +251,51 @@ size_t ParamSize::eval(Task* t, size_t already_consumed) const {
   return s;
 }
 
+/**
+ * A memory parameter of a RegularSyscall: an out-parameter of 'size' bytes
+ * whose address is in register 'arg'.
+ */
+struct RegularSyscallParam {
+  int arg;
+  size_t size;
+};
+
+// RegularSyscalls describe at most arg1...arg5 (see syscalls.py).
+static const int MAX_REGULAR_SYSCALL_PARAMS = 5;
+
+struct RegularSyscallParams {
+  /* False for syscalls that need hand-written recording code. */
+  bool is_regular;
+  int num_params;
+  RegularSyscallParam params[MAX_REGULAR_SYSCALL_PARAMS];
+};
+
+/**
+ * Per-arch tables, indexed by syscall number, of the memory parameters of
+ * every RegularSyscall in syscalls.py.
+ */
+template <typename Arch> struct regular_syscall_params;
+
+#include "SyscallRecordParams.generated"
+
+template <typename Arch>
+static const RegularSyscallParams* regular_syscall_params_for(int syscallno) {
+  auto& table = regular_syscall_params<Arch>::table;
+  if (syscallno < 0 || syscallno >= int(array_length(table)) ||
+      !table[syscallno].is_regular) {
+    return nullptr;
+  }
+  return &table[syscallno];
+}
+
+template <typename Arch> static size_t word_size_arch() {
+  return sizeof(typename Arch::unsigned_word);
+}
+
+static size_t arch_word_size(SupportedArch arch) {
+  RR_ARCH_FUNCTION(word_size_arch, arch);
+}
+
 /**
  * When tasks enter syscalls that may block and so must be
  * prepared for a context-switch, and the syscall params
@@ -237,7 +304,10 @@ size_t ParamSize::eval(Task* t, size_t already_consumed) const {
  * to serialize execution of what may be multiple blocked
  * syscalls completing "simultaneously" (from rr's
  * perspective).  After the syscall exits, we restore the data
- * saved in scratch memory to the original buffers.
+ * saved in scratch memory to the original buffers.  When the
+ * blocking task is the only task, nothing can race with the
+ * kernel's writes, so we skip scratch and record the buffers in
+ * place.
  *
  * Then during replay, we simply restore the saved data to the
  * tracee's passed-in buffer args and continue on.
@@ -273,7 +343,10 @@ struct TaskSyscallState {
       return;
     }
     this->t = t;
-    scratch = t->scratch_ptr;
+    word_size = arch_word_size(t->arch());
+    MemoryRange free = t->vm()->free_scratch();
+    scratch_base = scratch = free.addr;
+    scratch_available = free.num_bytes;
   }
 
   /**
@@ -369,6 +442,12 @@ struct TaskSyscallState {
    * otherwise returns 'sw'.
    */
   Switchable done_preparing(Switchable sw);
+  /**
+   * Prepare a RegularSyscall directly from its table entry. Regular syscalls
+   * never switch, so their out-parameters are recorded in place without
+   * scratch memory or any param_list entries.
+   */
+  Switchable done_preparing_regular(const RegularSyscallParams* params);
   enum WriteBack {
     WRITE_BACK,
     NO_WRITE_BACK
@@ -381,7 +460,7 @@ struct TaskSyscallState {
 
   /**
    * Upon successful syscall completion, each RestoreAndRecordScratch record
-   * in param_list consumes num_bytes from the t->scratch_ptr
+   * in param_list consumes num_bytes from the scratch_base
    * buffer, copying the data to remote_dest and recording the data at
    * remote_dest. If ptr_in_reg is greater than zero, updates the task's
    * ptr_in_reg register with 'remote_dest'. If ptr_in_memory is non-null,
@@ -399,12 +478,32 @@ struct TaskSyscallState {
   };
 
   Task* t;
+  /** The size of a tracee pointer, fixed when the syscall is entered so
+   *  pointer parameters don't dispatch on the task's arch one by one.
+   */
+  size_t word_size;
 
   vector<MemoryParam> param_list;
-  /** Tracks the position in t's scratch_ptr buffer where we should allocate
-   *  the next scratch area.
+  /** When non-null, the syscall was prepared by done_preparing_regular and
+   *  param_list is unused. regular_param_dests holds the tracee addresses
+   *  of the parameters (null for parameters passed as null).
+   */
+  const RegularSyscallParams* regular_params;
+  remote_ptr<void> regular_param_dests[MAX_REGULAR_SYSCALL_PARAMS];
+  /** The free scratch this syscall may use, which it reserves in t's
+   *  address space if it ends up using scratch.
+   */
+  remote_ptr<void> scratch_base;
+  size_t scratch_available;
+  /** Tracks the position in the scratch_base buffer where we should
+   *  allocate the next scratch area.
    */
   remote_ptr<void> scratch;
+  /** Nonzero when the syscall wanted this many bytes of scratch but fewer
+   *  were free. The address space's scratch is grown when the syscall
+   *  exits.
+   */
+  size_t scratch_shortfall;
 
   vector<AfterSyscallAction> after_syscall_actions;
 
@@ -413,9 +512,29 @@ struct TaskSyscallState {
   Task* ptraced_tracee;
 
   /** Saved syscall-entry registers, used by a couple of code paths that
-   *  modify the registers temporarily.
+   *  modify the registers temporarily. Null unless
+   *  save_syscall_entry_registers was called; then it points at
+   *  syscall_entry_registers_storage.
    */
-  std::unique_ptr<Registers> syscall_entry_registers;
+  Registers* syscall_entry_registers;
+  Registers syscall_entry_registers_storage;
+
+  /** Buffers reused by process_syscall_results. They keep their capacity
+   *  across syscalls (see reset()), like param_list and
+   *  after_syscall_actions, so that the trapped-syscall path doesn't
+   *  allocate once a task has warmed up.
+   */
+  vector<size_t> actual_sizes;
+  vector<uint8_t> scratch_data;
+  vector<MemoryRange> record_ranges;
+
+  /** When file_data is true, the syscall reads from file_data_name, which
+   *  won't change, at file_data_offset, so the data it reads is recorded
+   *  as a reference to the file. */
+  bool file_data;
+  string file_data_name;
+  uint64_t file_data_offset;
+  struct stat file_data_stat;
 
   /** When nonzero, syscall is expected to return the given errno and we should
    *  die if it does not. This is set when we detect an error condition during
@@ -446,38 +565,95 @@ struct TaskSyscallState {
    */
   bool scratch_enabled;
 
-  TaskSyscallState()
-      : t(nullptr),
-        ptraced_tracee(nullptr),
-        expect_errno(0),
-        should_emulate_result(false),
-        preparation_done(false),
-        scratch_enabled(false) {}
+  TaskSyscallState() { reset(); }
+
+  /**
+   * Return to the state of a newly-constructed TaskSyscallState, keeping the
+   * memory allocated by the vectors for the next syscall.
+   */
+  void reset() {
+    t = nullptr;
+    param_list.clear();
+    regular_params = nullptr;
+    scratch_base = nullptr;
+    scratch_available = 0;
+    scratch = nullptr;
+    scratch_shortfall = 0;
+    after_syscall_actions.clear();
+    exec_saved_event = nullptr;
+    ptraced_tracee = nullptr;
+    syscall_entry_registers = nullptr;
+    actual_sizes.clear();
+    record_ranges.clear();
+    file_data = false;
+    expect_errno = 0;
+    should_emulate_result = false;
+    preparation_done = false;
+    scratch_enabled = false;
+  }
+
+  void save_syscall_entry_registers() {
+    syscall_entry_registers_storage = t->regs();
+    syscall_entry_registers = &syscall_entry_registers_storage;
+  }
+};
+
+/**
+ * Each task keeps one TaskSyscallState for its whole life and reuses it for
+ * every syscall it makes, instead of allocating a new one per syscall.
+ * 'active' is true while a syscall is being recorded.
+ */
+struct TaskSyscallStateArena {
+  TaskSyscallStateArena() : active(false) {}
+
+  TaskSyscallState state;
+  bool active;
 };
 
-static const Property<TaskSyscallState, Task> syscall_state_property;
+static const Property<TaskSyscallStateArena, Task> syscall_state_property;
 
-template <typename Arch>
-static void set_remote_ptr_arch(Task* t, remote_ptr<void> addr,
-                                remote_ptr<void> value) {
-  auto typed_addr = addr.cast<typename Arch::unsigned_word>();
-  t->write_mem(typed_addr, (typename Arch::unsigned_word)value.as_int());
+/**
+ * Return the state of the syscall |t| is in, starting a new one if there
+ * isn't one.
+ */
+static TaskSyscallState& get_or_create_syscall_state(Task* t) {
+  auto& arena = syscall_state_property.get_or_create(*t);
+  arena.active = true;
+  return arena.state;
 }
 
-static void set_remote_ptr(Task* t, remote_ptr<void> addr,
-                           remote_ptr<void> value) {
-  RR_ARCH_FUNCTION(set_remote_ptr_arch, t->arch(), t, addr, value);
+/**
+ * Return the state of the syscall |t| is in, or null if there isn't one.
+ */
+static TaskSyscallState* get_syscall_state(Task* t) {
+  auto arena = syscall_state_property.get(*t);
+  return arena && arena->active ? &arena->state : nullptr;
 }
 
-template <typename Arch>
-static remote_ptr<void> get_remote_ptr_arch(Task* t, remote_ptr<void> addr) {
-  auto typed_addr = addr.cast<typename Arch::unsigned_word>();
-  auto old = t->read_mem(typed_addr);
-  return remote_ptr<void>(old);
+static void finish_syscall_state(Task* t) {
+  auto arena = syscall_state_property.get(*t);
+  if (arena && arena->active) {
+    t->vm()->release_scratch(t);
+    arena->state.reset();
+    arena->active = false;
+  }
 }
 
-static remote_ptr<void> get_remote_ptr(Task* t, remote_ptr<void> addr) {
-  RR_ARCH_FUNCTION(get_remote_ptr_arch, t->arch(), t, addr);
+/**
+ * Tracee pointers are little-endian words of |word_size| bytes, so one
+ * copy of the low bytes reads or writes them for any architecture.
+ */
+static void set_remote_ptr(Task* t, size_t word_size, remote_ptr<void> addr,
+                           remote_ptr<void> value) {
+  uint64_t v = value.as_int();
+  t->write_bytes_helper(addr, word_size, &v);
+}
+
+static remote_ptr<void> get_remote_ptr(Task* t, size_t word_size,
+                                       remote_ptr<void> addr) {
+  uint64_t v = 0;
+  t->read_bytes_helper(addr, word_size, &v);
+  return remote_ptr<void>(v);
 }
 
 static void align_scratch(remote_ptr<void>* scratch, uintptr_t amount = 8) {
@@ -514,7 +690,7 @@ remote_ptr<void> TaskSyscallState::mem_ptr_parameter(
   }
 
   MemoryParam param;
-  param.dest = get_remote_ptr(t, addr_of_buf_ptr);
+  param.dest = get_remote_ptr(t, word_size, addr_of_buf_ptr);
   if (param.dest.is_null()) {
     return remote_ptr<void>();
   }
@@ -554,15 +730,25 @@ Switchable TaskSyscallState::done_preparing(Switchable sw) {
   preparation_done = true;
   write_back = WRITE_BACK;
 
-  ssize_t scratch_num_bytes = scratch - t->scratch_ptr;
+  if (sw == ALLOW_SWITCH && !param_list.empty() &&
+      t->record_session().scheduler().is_sole_task(t)) {
+    // No other task can run and touch the buffers while |t| is
+    // blocked, so let the kernel write to them directly and record
+    // them from there at exit.
+    switchable = sw;
+    return switchable;
+  }
+
+  ssize_t scratch_num_bytes = scratch - scratch_base;
   ASSERT(t, scratch_num_bytes >= 0);
-  if (sw == ALLOW_SWITCH && scratch_num_bytes > t->scratch_size) {
-    LOG(warn)
-        << "`" << t->syscall_name(t->ev().Syscall().number)
-        << "' needed a scratch buffer of size " << scratch_num_bytes
-        << ", but only " << t->scratch_size
-        << " was available.  Disabling context switching: deadlock may follow.";
+  if (sw == ALLOW_SWITCH && size_t(scratch_num_bytes) > scratch_available) {
+    LOG(warn) << "`" << t->syscall_name(t->ev().Syscall().number)
+              << "' needed a scratch buffer of size " << scratch_num_bytes
+              << ", but only " << scratch_available
+              << " was free.  Disabling context switching for this call: "
+                 "deadlock may follow.  Scratch will be grown at its exit.";
     switchable = PREVENT_SWITCH;
+    scratch_shortfall = scratch_num_bytes;
   } else {
     switchable = sw;
   }
@@ -571,11 +757,15 @@ Switchable TaskSyscallState::done_preparing(Switchable sw) {
   }
 
   scratch_enabled = true;
+  if (scratch_num_bytes > 0) {
+    t->vm()->reserve_scratch(t, MemoryRange(scratch_base, scratch_num_bytes));
+  }
 
   // Step 1: Copy all IN/IN_OUT parameters to their scratch areas
   for (auto& param : param_list) {
     ASSERT(t, param.num_bytes.incoming_size < size_t(-1));
-    if (param.mode == IN_OUT || param.mode == IN) {
+    if (param.mode == IN_OUT || param.mode == IN_OUT_NO_RECORD ||
+        param.mode == IN) {
       // Initialize scratch buffer with input data
       t->remote_memcpy(param.scratch, param.dest,
                        param.num_bytes.incoming_size);
@@ -595,7 +785,7 @@ Switchable TaskSyscallState::done_preparing(Switchable sw) {
       // Update pointer to point to scratch.
       // Note that this can only happen after step 1 is complete and all
       // parameter data has been copied to scratch memory.
-      set_remote_ptr(t, p, param.scratch);
+      set_remote_ptr(t, word_size, p, param.scratch);
     }
     // If the number of bytes to record is coming from a memory location,
     // update that location to scratch.
@@ -608,6 +798,23 @@ Switchable TaskSyscallState::done_preparing(Switchable sw) {
   return switchable;
 }
 
+Switchable TaskSyscallState::done_preparing_regular(
+    const RegularSyscallParams* params) {
+  if (preparation_done) {
+    return switchable;
+  }
+  preparation_done = true;
+  write_back = WRITE_BACK;
+  switchable = PREVENT_SWITCH;
+
+  regular_params = params;
+  const Registers& r = t->regs();
+  for (int i = 0; i < params->num_params; ++i) {
+    regular_param_dests[i] = r.arg(params->params[i].arg);
+  }
+  return switchable;
+}
+
 size_t TaskSyscallState::eval_param_size(size_t i,
                                          vector<size_t>& actual_sizes) {
   assert(actual_sizes.size() == i);
@@ -630,10 +837,20 @@ void TaskSyscallState::process_syscall_results() {
   // record everything as if it succeeded. That handles failed syscalls that
   // wrote partial results, but doesn't handle syscalls that failed with
   // EFAULT.
-  vector<size_t> actual_sizes;
-  if (scratch_enabled) {
-    size_t scratch_num_bytes = scratch - t->scratch_ptr;
-    auto data = t->read_mem(t->scratch_ptr.cast<uint8_t>(), scratch_num_bytes);
+  actual_sizes.clear();
+  if (regular_params) {
+    for (int i = 0; i < regular_params->num_params; ++i) {
+      if (!regular_param_dests[i].is_null()) {
+        t->record_remote(regular_param_dests[i],
+                         regular_params->params[i].size);
+      }
+    }
+  } else if (scratch_enabled) {
+    size_t scratch_num_bytes = scratch - scratch_base;
+    scratch_data.resize(scratch_num_bytes);
+    t->read_bytes_helper(scratch_base, scratch_num_bytes,
+                         scratch_data.data());
+    const vector<uint8_t>& data = scratch_data;
     Registers r = t->regs();
     // Step 1: compute actual sizes of all buffers and copy outputs
     // from scratch back to their origin
@@ -641,8 +858,9 @@ void TaskSyscallState::process_syscall_results() {
       auto& param = param_list[i];
       size_t size = eval_param_size(i, actual_sizes);
       if (write_back == WRITE_BACK &&
-          (param.mode == IN_OUT || param.mode == OUT)) {
-        const uint8_t* d = data.data() + (param.scratch - t->scratch_ptr);
+          (param.mode == IN_OUT || param.mode == IN_OUT_NO_RECORD ||
+           param.mode == OUT)) {
+        const uint8_t* d = data.data() + (param.scratch - scratch_base);
         t->write_bytes_helper(param.dest, size, d);
       }
     }
@@ -655,37 +873,50 @@ void TaskSyscallState::process_syscall_results() {
       }
       if (!param.ptr_in_memory.is_null()) {
         memory_cleaned_up = true;
-        set_remote_ptr(t, param.ptr_in_memory, param.dest);
+        set_remote_ptr(t, word_size, param.ptr_in_memory, param.dest);
       }
     }
-    if (write_back == WRITE_BACK) {
-      // Step 3: record all output memory areas
+    if (write_back == WRITE_BACK && memory_cleaned_up) {
+      // Step 3: record all output memory areas. Pointers in memory were
+      // fixed up in step 2, so record from tracee memory to ensure we
+      // record such fixes.
+      // XXX This optimization can be improved if necessary...
+      record_ranges.clear();
+      for (size_t i = 0; i < param_list.size(); ++i) {
+        auto& param = param_list[i];
+        if (param.mode == IN_OUT_NO_SCRATCH || param.mode == IN_OUT ||
+            param.mode == OUT) {
+          record_ranges.push_back(MemoryRange(param.dest, actual_sizes[i]));
+        }
+      }
+      t->record_remote_ranges(record_ranges);
+    } else if (write_back == WRITE_BACK) {
+      // Step 3: record all output memory areas, from our local data
+      // where we have it.
       for (size_t i = 0; i < param_list.size(); ++i) {
         auto& param = param_list[i];
         size_t size = actual_sizes[i];
         if (param.mode == IN_OUT_NO_SCRATCH) {
           t->record_remote(param.dest, size);
         } else if (param.mode == IN_OUT || param.mode == OUT) {
-          // If pointers in memory were fixed up in step 2, then record
-          // from tracee memory to ensure we record such fixes. Otherwise we
-          // can record from our local data.
-          // XXX This optimization can be improved if necessary...
-          if (memory_cleaned_up) {
-            t->record_remote(param.dest, size);
-          } else {
-            const uint8_t* d = data.data() + (param.scratch - t->scratch_ptr);
-            t->record_local(param.dest, size, d);
-          }
+          const uint8_t* d = data.data() + (param.scratch - scratch_base);
+          t->record_local(param.dest, size, d);
         }
       }
     }
     t->set_regs(r);
   } else {
+    // Read all the buffers (e.g. every iovec of a readv or recvmmsg) at
+    // once, and store them as one record.
+    record_ranges.clear();
     for (size_t i = 0; i < param_list.size(); ++i) {
       auto& param = param_list[i];
       size_t size = eval_param_size(i, actual_sizes);
-      t->record_remote(param.dest, size);
+      if (param.mode != IN_OUT_NO_RECORD) {
+        record_ranges.push_back(MemoryRange(param.dest, size));
+      }
     }
+    t->record_remote_ranges(record_ranges);
   }
 
   if (should_emulate_result) {
@@ -1040,9 +1271,49 @@ static Switchable prepare_semctl(Task* t, TaskSyscallState& syscall_state,
   return PREVENT_SWITCH;
 }
 
+/**
+ * Record the pages of [addr, addr + num_bytes), a range of a shared file
+ * mapping, whose contents differ from what we last recorded for them.
+ * Pages that haven't changed still hold the recorded contents during
+ * replay. We compare contents rather than tracking writes because the
+ * writer is usually a device or another process, neither of which sets
+ * our tracee's soft-dirty bits.
+ */
+static void record_changed_file_pages(Task* t, remote_ptr<void> addr,
+                                      size_t num_bytes) {
+  vector<uint8_t> data = t->read_mem(addr.cast<uint8_t>(), num_bytes);
+  auto& recorded = t->vm()->recorded_file_pages();
+  remote_ptr<void> end = addr + num_bytes;
+  remote_ptr<void> run_start = end;
+  size_t recorded_bytes = 0;
+  auto record_run = [&](remote_ptr<void> run_end) {
+    if (run_start < run_end) {
+      t->record_local(run_start, run_end - run_start,
+                      data.data() + (run_start - addr));
+      recorded_bytes += run_end - run_start;
+    }
+    run_start = end;
+  };
+  for (remote_ptr<void> p = addr; p < end;) {
+    remote_ptr<void> next = min(end, floor_page_size(p) + page_size());
+    Hash128 hash = hash_bytes(data.data() + (p - addr), next - p);
+    auto it = recorded.find(p);
+    if (it != recorded.end() && it->second == hash) {
+      record_run(p);
+    } else {
+      recorded[p] = hash;
+      run_start = min(run_start, p);
+    }
+    p = next;
+  }
+  record_run(end);
+  LOG(debug) << "  recorded " << recorded_bytes << " changed bytes of "
+             << num_bytes << " at " << addr;
+}
+
 /**
  * A change has been made to file 'fd' in task t. If the file has been mmapped
- * somewhere in t's address space, record the changes.
+ * somewhere in t's address space, record the changed pages.
  * We check for matching files by comparing file names. This may not be
  * reliable but hopefully it's good enough for the cases where we need this.
  * This doesn't currently handle shared mappings very well. A file mapped
@@ -1060,7 +1331,8 @@ static void record_file_change(Task* t, int fd, uint64_t offset,
       uint64_t start = max(offset, uint64_t(m.offset));
       uint64_t end = min(offset + length, uint64_t(m.offset) + m.num_bytes());
       if (start < end) {
-        t->record_remote(m.start + (start - m.offset), end - start);
+        record_changed_file_pages(t, m.start + (start - m.offset),
+                                  end - start);
       }
     }
   };
@@ -1071,10 +1343,22 @@ template <typename Arch> static void record_v4l2_buffer_contents(Task* t) {
   remote_ptr<typename Arch::v4l2_buffer> bufp = t->regs().arg3();
   auto buf = t->read_mem(bufp);
 
+  // Only the first |bytesused| bytes of a dequeued buffer hold data; the
+  // rest of it is undefined, so there's no point recording it. Compressed
+  // formats often fill only a small part of their buffers. Drivers that
+  // don't report |bytesused| get the whole buffer recorded.
+  uint32_t valid_bytes = buf.length;
+  if (buf.bytesused > 0 && buf.bytesused < buf.length) {
+    valid_bytes = buf.bytesused;
+  }
+
   switch (buf.memory) {
     case V4L2_MEMORY_MMAP:
+      // record_changed_file_pages() skips pages that are the same as when
+      // we last recorded this buffer, which happens when the tracee
+      // dequeues it again.
       record_file_change(t, (int)t->regs().arg1_signed(), buf.m.offset,
-                         buf.length);
+                         valid_bytes);
       return;
 
     default:
@@ -1083,6 +1367,43 @@ template <typename Arch> static void record_v4l2_buffer_contents(Task* t) {
   }
 }
 
+/**
+ * Record the entries of the pollfd array of the poll() or ppoll() |t| just
+ * made whose revents are nonzero, as an array of poll_ready_entry. Failed
+ * calls record the whole array as they always have.
+ */
+template <typename Arch> static void record_poll_results(Task* t) {
+  remote_ptr<typename Arch::pollfd> fdsp = t->regs().arg1();
+  auto nfds = (nfds_t)t->regs().arg2();
+  if (t->regs().syscall_failed()) {
+    t->record_remote(fdsp, sizeof(typename Arch::pollfd) * nfds);
+    return;
+  }
+  if (fdsp.is_null() || nfds == 0) {
+    return;
+  }
+  auto fds = t->read_mem(fdsp, nfds);
+  vector<struct poll_ready_entry> ready;
+  for (size_t i = 0; i < nfds; ++i) {
+    if (fds[i].revents) {
+      struct poll_ready_entry e = { uint32_t(i), fds[i].revents, 0 };
+      ready.push_back(e);
+    }
+  }
+  t->record_local(fdsp, ready.size() * sizeof(ready[0]), ready.data());
+}
+
+/**
+ * Return the number of bytes of each fd_set that select() reads and writes
+ * for |nfds| fds, which is rounded up to a whole number of longs.
+ */
+template <typename Arch> static size_t select_fd_set_bytes(int nfds) {
+  typedef typename Arch::unsigned_long word;
+  size_t bits = 8 * sizeof(word);
+  size_t bytes = nfds <= 0 ? 0 : (nfds + bits - 1) / bits * sizeof(word);
+  return min(bytes, sizeof(typename Arch::fd_set));
+}
+
 static void record_page_below_stack_ptr(Task* t) {
   /* Record.the page above the top of |t|'s stack.  The SIOC* ioctls
    * have been observed to write beyond the end of tracees' stacks, as
@@ -1306,8 +1627,7 @@ static int64_t widen_buffer_signed(const void* buf, size_t size) {
 
 template <typename Arch>
 static Switchable prepare_ptrace(Task* t, TaskSyscallState& syscall_state) {
-  syscall_state.syscall_entry_registers =
-      unique_ptr<Registers>(new Registers(t->regs()));
+  syscall_state.save_syscall_entry_registers();
   pid_t pid = (pid_t)t->regs().arg2_signed();
   bool emulate = true;
   switch ((int)t->regs().arg1_signed()) {
@@ -1469,6 +1789,54 @@ static Switchable prepare_ptrace(Task* t, TaskSyscallState& syscall_state) {
   return PREVENT_SWITCH;
 }
 
+/**
+ * Once the trace is over its raw data budget, reads of at least a page from
+ * a file that won't change are recorded as references to the file instead
+ * of copies of the data. Returns true if this read will be.
+ */
+static bool prepare_file_data(Task* t, TaskSyscallState& syscall_state,
+                              int fd, bool is_pread, uint64_t pread_offset) {
+  if (t->regs().arg3() < (uintptr_t)page_size()) {
+    return false;
+  }
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path) - 1, "/proc/%d/fd/%d", t->tid, fd);
+  struct stat st;
+  if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  char file_name[PATH_MAX];
+  ssize_t nbytes = readlink(path, file_name, sizeof(file_name) - 1);
+  if (nbytes < 0) {
+    return false;
+  }
+  file_name[nbytes] = '\0';
+  if (!is_immutable_file(file_name, &st)) {
+    return false;
+  }
+
+  uint64_t offset = pread_offset;
+  if (!is_pread) {
+    // read() starts at the file position, which only the kernel knows.
+    snprintf(path, sizeof(path) - 1, "/proc/%d/fdinfo/%d", t->tid, fd);
+    FILE* f = fopen(path, "r");
+    if (!f) {
+      return false;
+    }
+    int matched = fscanf(f, "pos: %" SCNu64, &offset);
+    fclose(f);
+    if (matched != 1) {
+      return false;
+    }
+  }
+
+  syscall_state.file_data = true;
+  syscall_state.file_data_name = file_name;
+  syscall_state.file_data_offset = offset;
+  syscall_state.file_data_stat = st;
+  return true;
+}
+
 template <typename Arch>
 static Switchable rec_prepare_syscall_arch(Task* t,
                                            TaskSyscallState& syscall_state) {
@@ -1491,10 +1859,14 @@ static Switchable rec_prepare_syscall_arch(Task* t,
     return PREVENT_SWITCH;
   }
 
-  switch (syscallno) {
-// All the regular syscalls are handled here.
-#include "SyscallRecordCase.generated"
+  // All the regular syscalls are handled here.
+  const RegularSyscallParams* regular =
+      regular_syscall_params_for<Arch>(syscallno);
+  if (regular) {
+    return syscall_state.done_preparing_regular(regular);
+  }
 
+  switch (syscallno) {
     case Arch::splice: {
       syscall_state.reg_parameter<loff_t>(2, IN_OUT);
       syscall_state.reg_parameter<loff_t>(4, IN_OUT);
@@ -1511,8 +1883,7 @@ static Switchable rec_prepare_syscall_arch(Task* t,
     }
 
     case Arch::clone: {
-      syscall_state.syscall_entry_registers =
-          unique_ptr<Registers>(new Registers(t->regs()));
+      syscall_state.save_syscall_entry_registers();
       unsigned long flags = t->regs().arg1();
       if (flags & CLONE_UNTRACED) {
         Registers r = t->regs();
@@ -1544,8 +1915,7 @@ static Switchable rec_prepare_syscall_arch(Task* t,
 
     case Arch::execve: {
       if (!syscall_state.syscall_entry_registers) {
-        syscall_state.syscall_entry_registers =
-            unique_ptr<Registers>(new Registers(t->regs()));
+        syscall_state.save_syscall_entry_registers();
       }
 
       vector<string> cmd_line;
@@ -1723,22 +2093,29 @@ static Switchable rec_prepare_syscall_arch(Task* t,
 
     case Arch::select:
     case Arch::_newselect:
+      // The kernel only touches the part of each fd_set that covers the
+      // first nfds fds.
       if (syscallno == Arch::select &&
           Arch::select_semantics == Arch::SelectStructArguments) {
         auto argsp =
             syscall_state.reg_parameter<typename Arch::select_args>(1, IN);
-        syscall_state.mem_ptr_parameter_inferred(
-            REMOTE_PTR_FIELD(argsp, read_fds), IN_OUT);
-        syscall_state.mem_ptr_parameter_inferred(
-            REMOTE_PTR_FIELD(argsp, write_fds), IN_OUT);
-        syscall_state.mem_ptr_parameter_inferred(
-            REMOTE_PTR_FIELD(argsp, except_fds), IN_OUT);
+        auto args = t->read_mem(
+            remote_ptr<typename Arch::select_args>(t->regs().arg1()));
+        size_t fd_set_bytes = select_fd_set_bytes<Arch>(args.n_fds);
+        syscall_state.mem_ptr_parameter(REMOTE_PTR_FIELD(argsp, read_fds),
+                                        fd_set_bytes, IN_OUT);
+        syscall_state.mem_ptr_parameter(REMOTE_PTR_FIELD(argsp, write_fds),
+                                        fd_set_bytes, IN_OUT);
+        syscall_state.mem_ptr_parameter(REMOTE_PTR_FIELD(argsp, except_fds),
+                                        fd_set_bytes, IN_OUT);
         syscall_state.mem_ptr_parameter_inferred(
             REMOTE_PTR_FIELD(argsp, timeout), IN_OUT);
       } else {
-        syscall_state.reg_parameter<typename Arch::fd_set>(2, IN_OUT);
-        syscall_state.reg_parameter<typename Arch::fd_set>(3, IN_OUT);
-        syscall_state.reg_parameter<typename Arch::fd_set>(4, IN_OUT);
+        size_t fd_set_bytes =
+            select_fd_set_bytes<Arch>((int)t->regs().arg1_signed());
+        syscall_state.reg_parameter(2, fd_set_bytes, IN_OUT);
+        syscall_state.reg_parameter(3, fd_set_bytes, IN_OUT);
+        syscall_state.reg_parameter(4, fd_set_bytes, IN_OUT);
         syscall_state.reg_parameter<typename Arch::timeval>(5, IN_OUT);
       }
       return ALLOW_SWITCH;
@@ -1813,6 +2190,12 @@ static Switchable rec_prepare_syscall_arch(Task* t,
     case Arch::pread64:
     /* ssize_t read(int fd, void *buf, size_t count); */
     case Arch::read:
+      if (t->trace_writer().over_raw_data_budget() &&
+          (syscallno == Arch::read || Arch::arch() == x86_64) &&
+          prepare_file_data(t, syscall_state, (int)t->regs().arg1_signed(),
+                            syscallno == Arch::pread64, t->regs().arg4())) {
+        return PREVENT_SWITCH;
+      }
       syscall_state.reg_parameter(
           2, ParamSize::from_syscall_result<typename Arch::size_t>(
                  (size_t)t->regs().arg3()));
@@ -1897,8 +2280,7 @@ static Switchable rec_prepare_syscall_arch(Task* t,
      */
     case Arch::waitpid:
     case Arch::wait4: {
-      syscall_state.syscall_entry_registers =
-          unique_ptr<Registers>(new Registers(t->regs()));
+      syscall_state.save_syscall_entry_registers();
       syscall_state.reg_parameter<int>(2, IN_OUT);
       if (syscallno == Arch::wait4) {
         syscall_state.reg_parameter<typename Arch::rusage>(4);
@@ -1927,8 +2309,7 @@ static Switchable rec_prepare_syscall_arch(Task* t,
     }
 
     case Arch::waitid: {
-      syscall_state.syscall_entry_registers =
-          unique_ptr<Registers>(new Registers(t->regs()));
+      syscall_state.save_syscall_entry_registers();
       syscall_state.reg_parameter<typename Arch::siginfo_t>(3, IN_OUT);
       t->in_wait_pid = (id_t)t->regs().arg2();
       switch ((idtype_t)t->regs().arg1()) {
@@ -1990,15 +2371,15 @@ static Switchable rec_prepare_syscall_arch(Task* t,
     case Arch::ppoll: {
       auto nfds = (nfds_t)t->regs().arg2();
       syscall_state.reg_parameter(1, sizeof(typename Arch::pollfd) * nfds,
-                                  IN_OUT);
+                                  IN_OUT_NO_RECORD);
+      syscall_state.after_syscall_action(record_poll_results<Arch>);
       return ALLOW_SWITCH;
     }
 
     /* int prctl(int option, unsigned long arg2, unsigned long arg3, unsigned
      * long arg4, unsigned long arg5); */
     case Arch::prctl:
-      syscall_state.syscall_entry_registers =
-          unique_ptr<Registers>(new Registers(t->regs()));
+      syscall_state.save_syscall_entry_registers();
       switch ((int)t->regs().arg1_signed()) {
         case PR_GET_ENDIAN:
         case PR_GET_FPEMU:
@@ -2101,8 +2482,10 @@ static Switchable rec_prepare_syscall_arch(Task* t,
     /* int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int
      * timeout); */
     case Arch::epoll_wait:
-      syscall_state.reg_parameter(2, sizeof(typename Arch::epoll_event) *
-                                         t->regs().arg3_signed());
+      syscall_state.reg_parameter(
+          2, ParamSize::from_syscall_result_count<int>(
+                 sizeof(typename Arch::epoll_event),
+                 sizeof(typename Arch::epoll_event) * t->regs().arg3_signed()));
       return ALLOW_SWITCH;
 
     /* The following two syscalls enable context switching not for
@@ -2154,8 +2537,7 @@ static Switchable rec_prepare_syscall_arch(Task* t,
       return PREVENT_SWITCH;
 
     case Arch::sched_setaffinity: {
-      syscall_state.syscall_entry_registers =
-          unique_ptr<Registers>(new Registers(t->regs()));
+      syscall_state.save_syscall_entry_registers();
       // Ignore all sched_setaffinity syscalls. They might interfere
       // with our own affinity settings.
       Registers r = t->regs();
@@ -2193,6 +2575,7 @@ static Switchable rec_prepare_syscall_arch(Task* t,
     case Arch::mmap:
     case Arch::mmap2:
     case Arch::rrcall_init_buffers:
+    case Arch::rrcall_init_desched:
     case Arch::rrcall_init_preload:
     case Arch::rrcall_notify_syscall_hook_exit:
     case Arch::shmat:
@@ -2216,7 +2599,7 @@ static Switchable rec_prepare_syscall_internal(
 }
 
 Switchable rec_prepare_syscall(Task* t) {
-  auto& syscall_state = syscall_state_property.get_or_create(*t);
+  auto& syscall_state = get_or_create_syscall_state(t);
   syscall_state.init(t);
 
   Switchable s = rec_prepare_syscall_internal(t, syscall_state);
@@ -2224,7 +2607,7 @@ Switchable rec_prepare_syscall(Task* t) {
   if (is_sigreturn(syscallno, t->arch())) {
     // There isn't going to be an exit event for this syscall, so remove
     // syscall_state now.
-    syscall_state_property.remove(*t);
+    finish_syscall_state(t);
     return s;
   }
   return syscall_state.done_preparing(s);
@@ -2269,49 +2652,82 @@ static void rec_prepare_restart_syscall_internal(
 }
 
 void rec_prepare_restart_syscall(Task* t) {
-  auto& syscall_state = *syscall_state_property.get(*t);
+  auto& syscall_state = *get_syscall_state(t);
   rec_prepare_restart_syscall_internal(t, syscall_state);
-  syscall_state_property.remove(*t);
+  finish_syscall_state(t);
 }
 
-template <typename Arch> static void init_scratch_memory(Task* t) {
-  const int scratch_size = 512 * page_size();
-  size_t sz = scratch_size;
-  // The PROT_EXEC looks scary, and it is, but it's to prevent
-  // this region from being coalesced with another anonymous
-  // segment mapped just after this one.  If we named this
-  // segment, we could remove this hack.
-  int prot = PROT_READ | PROT_WRITE | PROT_EXEC;
-  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+static const size_t SCRATCH_CHUNK_PAGES = 512;
+
+// The PROT_EXEC looks scary, and it is, but it's to prevent
+// scratch from being coalesced with another anonymous
+// segment mapped just after it.  If we named these
+// segments, we could remove this hack.
+static const int SCRATCH_PROT = PROT_READ | PROT_WRITE | PROT_EXEC;
+static const int SCRATCH_FLAGS = MAP_PRIVATE | MAP_ANONYMOUS;
+
+// Scratch isn't madvise()d MADV_HUGEPAGE: it's only touched by syscalls
+// that block with outparams, and a forked child's first write to it
+// would copy a whole huge page instead of 4K.
+static remote_ptr<void> map_scratch(Task* t, size_t size) {
+  remote_ptr<void> addr;
   {
-    /* initialize the scratchpad for blocking system calls */
     AutoRemoteSyscalls remote(t);
+    addr = remote.mmap_syscall(remote_ptr<void>(), size, SCRATCH_PROT,
+                               SCRATCH_FLAGS, -1, 0);
+  }
+  t->vm()->map(addr, size, SCRATCH_PROT, SCRATCH_FLAGS, 0,
+               MappableResource::scratch(t->rec_tid));
+  t->vm()->add_scratch_region(MemoryRange(addr, size));
+  return addr;
+}
 
-    t->scratch_ptr =
-        remote.mmap_syscall(remote_ptr<void>(), sz, prot, flags, -1, 0);
-    t->scratch_size = scratch_size;
+template <typename Arch> static void init_scratch_memory(Task* t) {
+  if (t->vm()->has_scratch()) {
+    // Threads share their address space's scratch, and forked children
+    // get a copy of their parent's.
+    return;
   }
+
+  /* initialize the scratchpad for blocking system calls */
+  size_t scratch_size = SCRATCH_CHUNK_PAGES * page_size();
+  remote_ptr<void> scratch_ptr = map_scratch(t, scratch_size);
+
   // record this mmap for the replay
   Registers r = t->regs();
   uintptr_t saved_result = r.syscall_result();
-  r.set_syscall_result(t->scratch_ptr);
+  r.set_syscall_result(scratch_ptr);
   t->set_regs(r);
 
   char filename[PATH_MAX];
   sprintf(filename, "scratch for thread %d", t->tid);
   struct stat stat;
   memset(&stat, 0, sizeof(stat));
-  TraceMappedRegion file(TraceMappedRegion::MMAP, filename, stat,
-                         t->scratch_ptr, t->scratch_ptr + scratch_size);
+  TraceMappedRegion file(TraceMappedRegion::MMAP, filename, stat, scratch_ptr,
+                         scratch_ptr + scratch_size);
   auto record_in_trace =
-      t->trace_writer().write_mapped_region(file, prot, flags);
+      t->trace_writer().write_mapped_region(file, SCRATCH_PROT, SCRATCH_FLAGS);
   ASSERT(t, record_in_trace == TraceWriter::DONT_RECORD_IN_TRACE);
 
   r.set_syscall_result(saved_result);
   t->set_regs(r);
+}
 
-  t->vm()->map(t->scratch_ptr, sz, prot, flags, 0,
-               MappableResource::scratch(t->rec_tid));
+/**
+ * Add at least |needed| bytes of scratch to |t|'s address space, after
+ * a syscall had to give up switching because there wasn't enough free.
+ * Replay never uses scratch, so unlike the first region this isn't
+ * recorded in the trace; checksumming ignores scratch mappings.
+ */
+static void grow_scratch(Task* t, size_t needed) {
+  if (!t->vm()->has_scratch()) {
+    return;
+  }
+  size_t size =
+      max(ceil_page_size(needed), SCRATCH_CHUNK_PAGES * page_size());
+  remote_ptr<void> addr = map_scratch(t, size);
+  LOG(debug) << "Grew scratch of " << t->tid << " by " << size << " bytes at "
+             << addr;
 }
 
 // We have |keys_length| instead of using array_length(keys) to work
@@ -2435,10 +2851,6 @@ static void process_mmap(Task* t, size_t length, int prot, int flags, int fd,
   ASSERT(t, fd >= 0) << "Valid fd required for file mapping";
   assert(!(flags & MAP_GROWSDOWN));
 
-  // TODO: save a reflink copy of the resource to the
-  // trace directory as |fs/[st_dev].[st_inode]|.  Then
-  // we wouldn't have to care about looking up a name
-  // for the resource.
   auto result = t->fstat(fd);
   TraceMappedRegion file(TraceMappedRegion::MMAP, result.file_name, result.st,
                          addr, addr + size, offset_pages);
@@ -2466,6 +2878,57 @@ static void process_mmap(Task* t, size_t length, int prot, int flags, int fd,
                MappableResource(FileId(result.st), result.file_name));
 }
 
+/**
+ * Record the contents of the SysV shm segment just attached at |addr|. If
+ * |page_hashes| holds the segment's page hashes from an earlier attach,
+ * only the pages whose contents changed since then are recorded, a run of
+ * changed pages per record. Either way |page_hashes| is updated.
+ */
+static void record_sysv_shm(Task* t, remote_ptr<void> addr, size_t size,
+                            vector<Hash128>& page_hashes) {
+  size_t num_pages = size / page_size();
+  if (page_hashes.empty()) {
+    vector<uint8_t> data = t->read_mem(addr.cast<uint8_t>(), size);
+    t->record_local(addr, size, data.data());
+    page_hashes.resize(num_pages);
+    for (size_t i = 0; i < num_pages; ++i) {
+      page_hashes[i] = hash_bytes(data.data() + i * page_size(), page_size());
+    }
+    return;
+  }
+
+  // Segments can be huge, so read them a chunk at a time.
+  static const size_t CHUNK_PAGES = 256;
+  size_t recorded_bytes = 0;
+  for (size_t chunk = 0; chunk < num_pages; chunk += CHUNK_PAGES) {
+    size_t chunk_pages = min(CHUNK_PAGES, num_pages - chunk);
+    remote_ptr<void> chunk_addr = addr + chunk * page_size();
+    vector<uint8_t> data =
+        t->read_mem(chunk_addr.cast<uint8_t>(), chunk_pages * page_size());
+    size_t run_start = chunk_pages;
+    for (size_t i = 0; i <= chunk_pages; ++i) {
+      bool changed = false;
+      if (i < chunk_pages) {
+        Hash128 hash =
+            hash_bytes(data.data() + i * page_size(), page_size());
+        changed = !(hash == page_hashes[chunk + i]);
+        page_hashes[chunk + i] = hash;
+      }
+      if (changed) {
+        run_start = min(run_start, i);
+      } else if (run_start < i) {
+        size_t run_bytes = (i - run_start) * page_size();
+        t->record_local(chunk_addr + run_start * page_size(), run_bytes,
+                        data.data() + run_start * page_size());
+        recorded_bytes += run_bytes;
+        run_start = chunk_pages;
+      }
+    }
+  }
+  LOG(debug) << "  recorded " << recorded_bytes << " changed bytes of "
+             << size << "-byte SysV segment at " << addr;
+}
+
 static void process_shmat(Task* t, int shmid, int shm_flags,
                           remote_ptr<void> addr) {
   if (t->regs().syscall_failed()) {
@@ -2490,11 +2953,20 @@ static void process_shmat(Task* t, int shmid, int shm_flags,
   memset(&fake_stat, 0, sizeof(fake_stat));
   fake_stat.st_ino = shmid;
 
+  auto& segment = t->record_session().sysv_segments()[shmid];
+  if (segment.ctime != ds.shm_ctime || segment.cpid != ds.shm_cpid ||
+      segment.page_hashes.size() != size / page_size()) {
+    segment.ctime = ds.shm_ctime;
+    segment.cpid = ds.shm_cpid;
+    segment.page_hashes.clear();
+  }
+
   TraceMappedRegion file(TraceMappedRegion::SYSV_SHM, fake_file_name, fake_stat,
                          addr, addr + size, 0);
-  if (t->trace_writer().write_mapped_region(file, prot, flags) ==
+  if (t->trace_writer().write_mapped_region(file, prot, flags,
+                                            !segment.page_hashes.empty()) ==
       TraceWriter::RECORD_IN_TRACE) {
-    t->record_remote(addr, size);
+    record_sysv_shm(t, addr, size, segment.page_hashes);
   }
 
   LOG(debug) << "Optimistically hoping that SysV segment is not used outside "
@@ -2588,9 +3060,21 @@ static void rec_process_syscall_arch(Task* t, TaskSyscallState& syscall_state) {
   t->on_syscall_exit(syscallno, t->regs());
 
   if (const struct syscallbuf_record* rec = t->desched_rec()) {
+    size_t size = rec->size - sizeof(*rec);
+    if (syscallno == Arch::poll) {
+      // The pollfd array is the record's only outparam.
+      record_poll_results<Arch>(t);
+      return;
+    }
+    if (syscallno == Arch::epoll_wait) {
+      // Only the events that were returned have been written.
+      size_t result =
+          t->regs().syscall_failed() ? 0 : t->regs().syscall_result();
+      size = min(size, result * sizeof(typename Arch::epoll_event));
+    }
     t->record_local(t->syscallbuf_child.cast<void>() +
                         (rec->extra_data - (uint8_t*)t->syscallbuf_hdr),
-                    rec->size - sizeof(*rec), (uint8_t*)rec->extra_data);
+                    size, (uint8_t*)rec->extra_data);
     return;
   }
 
@@ -2607,6 +3091,16 @@ static void rec_process_syscall_arch(Task* t, TaskSyscallState& syscall_state) {
   // syscall completes --- and that our TaskSyscallState infrastructure can't
   // handle.
   switch (syscallno) {
+    case Arch::read:
+    case Arch::pread64:
+      if (syscall_state.file_data && t->regs().syscall_result_signed() > 0) {
+        t->record_file_data(t->regs().arg2(), t->regs().syscall_result(),
+                            syscall_state.file_data_name,
+                            syscall_state.file_data_offset,
+                            syscall_state.file_data_stat);
+      }
+      break;
+
     case Arch::clone: {
       uintptr_t flags = syscall_state.syscall_entry_registers->arg1();
       Registers r = t->regs();
@@ -2810,12 +3304,30 @@ static void rec_process_syscall_arch(Task* t, TaskSyscallState& syscall_state) {
     }
 
     case SYS_rrcall_init_buffers:
-      t->init_buffers(nullptr, SHARE_DESCHED_EVENT_FD);
+      t->init_buffers(nullptr);
       break;
 
+    case SYS_rrcall_init_desched: {
+      t->init_desched_fd(SHARE_DESCHED_EVENT_FD);
+
+      Registers r = t->regs();
+      r.set_syscall_result(0);
+      t->set_regs(r);
+      break;
+    }
+
     case SYS_rrcall_init_preload: {
       t->at_preload_init();
 
+      auto params = t->read_mem(
+          remote_ptr<rrcall_init_preload_params<Arch> >(t->regs().arg1()));
+      remote_ptr<rdtsc_calibration> calibration_ptr = params.rdtsc_calibration;
+      if (!calibration_ptr.is_null()) {
+        const rdtsc_calibration& calibration = get_rdtsc_calibration();
+        t->write_mem(calibration_ptr, calibration);
+        t->record_local(calibration_ptr, &calibration);
+      }
+
       Registers r = t->regs();
       r.set_syscall_result(0);
       t->set_regs(r);
@@ -2842,8 +3354,12 @@ static void rec_process_syscall_internal(Task* t,
 }
 
 void rec_process_syscall(Task* t) {
-  auto& syscall_state = *syscall_state_property.get(*t);
+  auto& syscall_state = *get_syscall_state(t);
   rec_process_syscall_internal(t, syscall_state);
   syscall_state.process_syscall_results();
-  syscall_state_property.remove(*t);
+  size_t scratch_shortfall = syscall_state.scratch_shortfall;
+  finish_syscall_state(t);
+  if (scratch_shortfall) {
+    grow_scratch(t, scratch_shortfall);
+  }
 }
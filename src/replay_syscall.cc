@@ -9,6 +9,7 @@
 #include <fcntl.h>
 #include <linux/futex.h>
 #include <linux/shm.h>
+#include <poll.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -17,6 +18,7 @@
 #include <syscall.h>
 #include <sys/mman.h>
 #include <sys/prctl.h>
+#include <sys/stat.h>
 
 #include <array>
 #include <initializer_list>
@@ -24,6 +26,7 @@
 #include <memory>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include "preload/preload_interface.h"
 
@@ -149,6 +152,10 @@ static void __ptrace_cont(Task* t) {
 }
 
 static void init_scratch_memory(Task* t) {
+  if (t->vm()->has_scratch() && t->trace_reader().scratch_per_address_space()) {
+    // The recorder shared the address space's scratch too.
+    return;
+  }
   /* Initialize the scratchpad as the recorder did, but make it
    * PROT_NONE. The idea is just to reserve the address space so
    * the replayed process address map looks like the recorded
@@ -159,23 +166,23 @@ static void init_scratch_memory(Task* t) {
   auto mapped_region = t->trace_reader().read_mapped_region(&data);
   ASSERT(t, data.source == TraceReader::SOURCE_ZERO);
 
-  t->scratch_ptr = mapped_region.start();
-  t->scratch_size = mapped_region.size();
-  size_t sz = t->scratch_size;
+  remote_ptr<void> scratch_ptr = mapped_region.start();
+  size_t sz = mapped_region.size();
   int prot = PROT_NONE;
   int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
   remote_ptr<void> map_addr;
   {
     AutoRemoteSyscalls remote(t);
-    map_addr = remote.mmap_syscall(t->scratch_ptr, sz, prot, flags, -1, 0);
+    map_addr = remote.mmap_syscall(scratch_ptr, sz, prot, flags, -1, 0);
   }
-  ASSERT(t, t->scratch_ptr == map_addr) << "scratch mapped "
-                                        << mapped_region.start()
-                                        << " during recording, but " << map_addr
-                                        << " in replay";
+  ASSERT(t, scratch_ptr == map_addr) << "scratch mapped "
+                                     << mapped_region.start()
+                                     << " during recording, but " << map_addr
+                                     << " in replay";
 
   t->vm()->map(map_addr, sz, prot, flags, 0,
                MappableResource::scratch(t->rec_tid));
+  t->vm()->add_scratch_region(MemoryRange(map_addr, sz));
 }
 
 /**
@@ -539,9 +546,10 @@ static void finish_direct_mmap(
   remote.syscall(syscall_number_for_close(remote.arch()), fd);
 
   if (note_task_map) {
-    t->vm()->map(
-        mapped_addr, length, prot, flags, page_size() * mmap_offset_pages,
-        MappableResource(FileId(file.stat()), file.file_name().c_str()));
+    MappableResource r(FileId(file.stat()), file.file_name().c_str());
+    r.backing_fsname = backing_file_name;
+    t->vm()->map(mapped_addr, length, prot, flags,
+                 page_size() * mmap_offset_pages, r);
   }
 }
 
@@ -619,6 +627,58 @@ static void create_sigbus_region(AutoRemoteSyscalls& remote, int prot,
   remote.syscall(syscall_number_for_close(remote.arch()), child_fd);
 }
 
+/**
+ * Return true if the file at |file.file_name()| still looks like the one
+ * mapped during recording: same inode, size and modification time.
+ */
+static bool is_unchanged_file(const TraceMappedRegion& file) {
+  struct stat st;
+  if (stat(file.file_name().c_str(), &st)) {
+    return false;
+  }
+  const struct stat& rec = file.stat();
+  return st.st_dev == rec.st_dev && st.st_ino == rec.st_ino &&
+         st.st_size == rec.st_size && st.st_mtim.tv_sec == rec.st_mtim.tv_sec &&
+         st.st_mtim.tv_nsec == rec.st_mtim.tv_nsec;
+}
+
+static bool is_zero_page(const uint8_t* p, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    if (p[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Restore the next data record, which is the contents of the freshly
+ * mapped (so zero-filled) anonymous region at its address. Pages that were
+ * recorded as all-zero are skipped, so they aren't materialized until the
+ * tracee touches them. Return the size of the record.
+ */
+static ssize_t set_mapped_data_from_trace(Task* t) {
+  auto buf = t->trace_reader().read_raw_data();
+  const uint8_t* data = buf.data.data();
+  size_t size = buf.data.size();
+  vector<RemoteIovec> ranges;
+  for (size_t offset = 0; offset < size; offset += page_size()) {
+    size_t len = min(page_size(), size - offset);
+    if (is_zero_page(data + offset, len)) {
+      continue;
+    }
+    if (!ranges.empty() &&
+        ranges.back().addr + ranges.back().size == buf.addr + offset) {
+      ranges.back().size += len;
+    } else {
+      ranges.push_back({ buf.addr + offset,
+                         const_cast<uint8_t*>(data + offset), len });
+    }
+  }
+  t->write_mem(ranges);
+  return size;
+}
+
 static void finish_private_mmap(AutoRemoteSyscalls& remote,
                                 const TraceFrame& trace_frame, size_t length,
                                 int prot, int flags, int fd,
@@ -627,6 +687,18 @@ static void finish_private_mmap(AutoRemoteSyscalls& remote,
   LOG(debug) << "  finishing private mmap of " << file.file_name();
 
   Task* t = remote.task();
+  if (is_unchanged_file(file)) {
+    // The recorded copy must match the file, so map the file itself and
+    // share its page cache instead of filling anonymous memory.
+    LOG(debug) << "  " << file.file_name() << " is unchanged; mapping it";
+    t->trace_reader().read_raw_data();
+    finish_direct_mmap(remote, trace_frame,
+                       trace_frame.regs().syscall_result(), length, prot,
+                       flags, file, offset_pages, file.file_name(),
+                       offset_pages);
+    return;
+  }
+
   size_t num_bytes = length;
   remote_ptr<void> mapped_addr =
       finish_anonymous_mmap(remote, trace_frame, length, prot,
@@ -634,7 +706,7 @@ static void finish_private_mmap(AutoRemoteSyscalls& remote,
                              * by file. */
                             flags | MAP_ANONYMOUS, fd, DONT_NOTE_TASK_MAP);
   /* Restore the map region we copied. */
-  ssize_t data_size = t->set_data_from_trace();
+  ssize_t data_size = set_mapped_data_from_trace(t);
 
   /* Ensure pages past the end of the file fault on access */
   size_t data_pages = ceil_page_size(data_size);
@@ -650,14 +722,17 @@ static void finish_private_mmap(AutoRemoteSyscalls& remote,
                                 file.file_name().c_str()));
 }
 
-static void finish_shared_mmap(AutoRemoteSyscalls& remote,
-                               const TraceFrame& trace_frame, int prot,
-                               int flags, off64_t offset_pages,
-                               const TraceMappedRegion& file) {
+/**
+ * Map the emulated file for |file| into the tracee, at |addr|, and return
+ * it.
+ */
+static EmuFile::shr_ptr map_emulated_file(AutoRemoteSyscalls& remote,
+                                          const TraceFrame& trace_frame,
+                                          remote_ptr<void> addr,
+                                          size_t num_bytes, int prot,
+                                          int flags, off64_t offset_pages,
+                                          const TraceMappedRegion& file) {
   Task* t = remote.task();
-  auto buf = t->trace_reader().read_raw_data();
-  size_t rec_num_bytes = ceil_page_size(buf.data.size());
-
   // Ensure there's a virtual file for the file that was mapped
   // during recording.
   auto emufile = t->replay_session().emufs().get_or_create(file);
@@ -668,9 +743,23 @@ static void finish_shared_mmap(AutoRemoteSyscalls& remote,
   // we exit/crash the kernel will clean up for us.
   TraceMappedRegion vfile(TraceMappedRegion::MMAP, emufile->proc_path(),
                           file.stat(), file.start(), file.end());
-  finish_direct_mmap(remote, trace_frame, buf.addr, rec_num_bytes, prot, flags,
-                     vfile, offset_pages, vfile.file_name(), offset_pages,
-                     DONT_NOTE_TASK_MAP);
+  finish_direct_mmap(remote, trace_frame, addr, ceil_page_size(num_bytes),
+                     prot, flags, vfile, offset_pages, vfile.file_name(),
+                     offset_pages, DONT_NOTE_TASK_MAP);
+  t->vm()->map(addr, num_bytes, prot, flags, page_size() * offset_pages,
+               MappableResource::shared_mmap_file(file));
+  return emufile;
+}
+
+static void finish_shared_mmap(AutoRemoteSyscalls& remote,
+                               const TraceFrame& trace_frame, int prot,
+                               int flags, off64_t offset_pages,
+                               const TraceMappedRegion& file) {
+  Task* t = remote.task();
+  auto buf = t->trace_reader().read_raw_data();
+  auto emufile = map_emulated_file(remote, trace_frame, buf.addr,
+                                   buf.data.size(), prot, flags, offset_pages,
+                                   file);
   // Write back the snapshot of the segment that we recorded.
   // We have to write directly to the underlying file, because
   // the tracee may have mapped its segment read-only.
@@ -682,13 +771,41 @@ static void finish_shared_mmap(AutoRemoteSyscalls& remote,
   if (ssize_t(buf.data.size()) !=
       pwrite64(emufile->fd(), buf.data.data(), buf.data.size(), offset_bytes)) {
     FATAL() << "Failed to write " << buf.data.size() << " bytes at "
-            << HEX(offset_bytes) << " to " << vfile.file_name();
+            << HEX(offset_bytes) << " to " << emufile->proc_path();
   }
   LOG(debug) << "  restored " << buf.data.size() << " bytes at "
-             << HEX(offset_bytes) << " to " << vfile.file_name();
+             << HEX(offset_bytes) << " to " << emufile->proc_path();
+}
 
-  t->vm()->map(buf.addr, buf.data.size(), prot, flags, offset_bytes,
-               MappableResource::shared_mmap_file(file));
+/**
+ * Map a SysV segment recorded as SOURCE_TRACE_CHANGES. The emulated file
+ * still has the segment's contents from its last attach, so only the
+ * changed pages are written to it. The frame's other raw-data records are
+ * applied to the tracee's memory as usual.
+ */
+static void finish_shm_changes(AutoRemoteSyscalls& remote,
+                               const TraceFrame& trace_frame, int prot,
+                               int flags, const TraceMappedRegion& file) {
+  Task* t = remote.task();
+  auto emufile = map_emulated_file(remote, trace_frame, file.start(),
+                                   file.size(), prot, flags, 0, file);
+  size_t restored_bytes = 0;
+  TraceReader::RawData buf;
+  while (t->trace_reader().read_raw_data_for_frame(trace_frame, buf)) {
+    if (buf.addr < file.start() || buf.addr >= file.end()) {
+      t->write_bytes_helper(buf.addr, buf.data.size(), buf.data.data());
+      continue;
+    }
+    off64_t offset_bytes = buf.addr - file.start();
+    if (ssize_t(buf.data.size()) != pwrite64(emufile->fd(), buf.data.data(),
+                                             buf.data.size(), offset_bytes)) {
+      FATAL() << "Failed to write " << buf.data.size() << " bytes at "
+              << HEX(offset_bytes) << " to " << emufile->proc_path();
+    }
+    restored_bytes += buf.data.size();
+  }
+  LOG(debug) << "  restored " << restored_bytes << " changed bytes to "
+             << emufile->proc_path();
 }
 
 static void process_mmap(Task* t, const TraceFrame& trace_frame,
@@ -723,7 +840,8 @@ static void process_mmap(Task* t, const TraceFrame& trace_frame,
       TraceReader::MappedData data;
       auto file = t->trace_reader().read_mapped_region(&data);
 
-      if (data.source == TraceReader::SOURCE_FILE) {
+      if (data.source == TraceReader::SOURCE_FILE ||
+          data.source == TraceReader::SOURCE_SNAPSHOT) {
         finish_direct_mmap(remote, trace_frame,
                            trace_frame.regs().syscall_result(), length, prot,
                            flags, file, offset_pages, data.file_name,
@@ -769,7 +887,11 @@ static void process_shmat(Task* t, const TraceFrame& trace_frame,
     auto file = t->trace_reader().read_mapped_region(&data);
     int prot = shm_flags_to_mmap_prot(shm_flags);
     int flags = MAP_SHARED;
-    finish_shared_mmap(remote, trace_frame, prot, flags, 0, file);
+    if (data.source == TraceReader::SOURCE_TRACE_CHANGES) {
+      finish_shm_changes(remote, trace_frame, prot, flags, file);
+    } else {
+      finish_shared_mmap(remote, trace_frame, prot, flags, 0, file);
+    }
 
     // Finally, we finish by emulating the return value.
     remote.regs().set_syscall_result(trace_frame.regs().syscall_result());
@@ -829,10 +951,10 @@ static void process_init_buffers(Task* t, SyscallEntryOrExit state,
   remote_ptr<void> rec_child_map_addr =
       t->current_trace_frame().regs().syscall_result();
 
-  /* We don't want the desched event fd during replay, because
-   * we already know where they were.  (The perf_event fd is
-   * emulated anyway.) */
-  t->init_buffers(rec_child_map_addr, DONT_SHARE_DESCHED_EVENT_FD);
+  t->init_buffers(rec_child_map_addr);
+  // Restore the buffer size the recorder picked.
+  t->apply_all_data_records_from_trace();
+  t->refresh_syscallbuf_size();
 
   ASSERT(t, t->syscallbuf_child.cast<void>() == rec_child_map_addr)
       << "Should have mapped syscallbuf at " << rec_child_map_addr
@@ -870,7 +992,7 @@ static void rep_process_syscall_arch(Task* t, ReplayTraceStep* step) {
   const TraceFrame& trace_frame = t->replay_session().current_trace_frame();
   SyscallEntryOrExit state = trace_frame.event().state;
   const Registers& trace_regs = trace_frame.regs();
-  EmuFs::AutoGc maybe_gc(t->replay_session(), t->arch(), syscall, state);
+  EmuFs::AutoGc maybe_gc(t->replay_session(), state);
 
   LOG(debug) << "processing " << t->syscall_name(syscall) << " ("
              << state_name(state) << ")";
@@ -1113,10 +1235,23 @@ static void rep_process_syscall_arch(Task* t, ReplayTraceStep* step) {
       t->set_return_value_from_trace();
       t->validate_regs();
       t->finish_emulated_syscall();
+      /* Restore the rdtsc calibration the recorder wrote. */
+      t->apply_all_data_records_from_trace();
       t->at_preload_init();
       step->action = TSTEP_RETIRE;
       return;
 
+    case SYS_rrcall_init_desched:
+      step->action = syscall_action(state);
+      step->syscall.emu = EMULATE;
+      if (SYSCALL_EXIT == state) {
+        /* We don't want the desched event fd during replay, because
+         * we already know where they were.  (The perf_event fd is
+         * emulated anyway.) */
+        t->init_desched_fd(DONT_SHARE_DESCHED_EVENT_FD);
+      }
+      return;
+
     case SYS_rrcall_notify_syscall_hook_exit:
       step->action = syscall_action(state);
       step->syscall.emu = EMULATE;
@@ -1139,3 +1274,39 @@ void rep_process_syscall(Task* t, ReplayTraceStep* step) {
   RR_ARCH_FUNCTION(rep_process_syscall_arch,
                    t->current_trace_frame().event().arch(), t, step)
 }
+
+void rebuild_poll_results(Task* t, struct pollfd* fds, size_t nfds,
+                          const struct poll_ready_entry* ready,
+                          size_t num_ready) {
+  for (size_t i = 0; i < nfds; ++i) {
+    fds[i].revents = 0;
+  }
+  for (size_t i = 0; i < num_ready; ++i) {
+    ASSERT(t, ready[i].index < nfds) << "Recorded ready entry "
+                                     << ready[i].index << " of poll() with "
+                                     << nfds << " fds";
+    fds[ready[i].index].revents = ready[i].revents;
+  }
+}
+
+void rep_restore_poll_results(Task* t) {
+  const Registers& trace_regs = t->current_trace_frame().regs();
+  remote_ptr<struct pollfd> fdsp = trace_regs.arg1();
+  auto nfds = (nfds_t)trace_regs.arg2();
+  TraceReader::RawData data;
+  if (!t->trace_reader().read_raw_data_for_frame(t->current_trace_frame(),
+                                                 data)) {
+    return;
+  }
+  size_t num_ready = data.data.size() / sizeof(poll_ready_entry);
+  ASSERT(t, data.addr == fdsp &&
+                num_ready * sizeof(poll_ready_entry) == data.data.size())
+      << "Bad poll() results record of " << data.data.size() << " bytes at "
+      << data.addr;
+  vector<poll_ready_entry> ready(num_ready);
+  memcpy(ready.data(), data.data.data(), data.data.size());
+  // The pollfd layout is the same for every arch.
+  auto fds = t->read_mem(fdsp, nfds);
+  rebuild_poll_results(t, fds.data(), nfds, ready.data(), num_ready);
+  t->write_mem(fdsp, fds.data(), nfds);
+}
@@ -7,6 +7,8 @@
 
 class Task;
 struct ReplayTraceStep;
+struct poll_ready_entry;
+struct pollfd;
 
 /**
  * Call this when |t| has just entered a syscall.  At this point, data
@@ -18,4 +20,18 @@ void rep_after_enter_syscall(Task* t, int syscallno);
  * a syscall. */
 void rep_process_syscall(Task* t, ReplayTraceStep* step);
 
+/**
+ * Rebuild the |nfds| pollfd results in |fds|, which holds poll()'s input
+ * array, from the |num_ready| entries that had nonzero revents.
+ */
+void rebuild_poll_results(Task* t, struct pollfd* fds, size_t nfds,
+                          const struct poll_ready_entry* ready,
+                          size_t num_ready);
+
+/**
+ * Restore the results of the successful poll() or ppoll() |t| is exiting
+ * from the trace, rebuilding the pollfd array in tracee memory.
+ */
+void rep_restore_poll_results(Task* t);
+
 #endif /* RR_REP_PROCESS_EVENT_H_ */
@@ -6,6 +6,7 @@
 
 #include <elf.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <linux/net.h>
 #include <linux/perf_event.h>
 #include <stdlib.h>
@@ -14,6 +15,7 @@
 #include <sys/personality.h>
 #include <sys/prctl.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <sys/user.h>
 
@@ -26,11 +28,13 @@
 
 #include "AutoRemoteSyscalls.h"
 #include "CPUIDBugDetector.h"
+#include "FlightRecorder.h"
 #include "kernel_abi.h"
 #include "kernel_metadata.h"
 #include "kernel_supplement.h"
 #include "log.h"
 #include "MagicSaveDataMonitor.h"
+#include "MemoryAccounting.h"
 #include "RecordSession.h"
 #include "record_signal.h"
 #include "ReplaySession.h"
@@ -39,6 +43,7 @@
 #include "StdioMonitor.h"
 #include "StringVectorToCharArray.h"
 #include "util.h"
+#include "WaitHub.h"
 
 /* The tracee doesn't open the desched event fd during replay, so it
  * can't be shared to this process.  We pretend that the tracee shared
@@ -234,12 +239,12 @@ Task::Task(Session& session, pid_t _tid, pid_t _rec_tid, uint32_t serial,
       stable_exit(false),
       priority(_priority),
       in_round_robin_queue(false),
+      timeslice(0),
+      timeslice_expired_ticks(0),
       emulated_stop_type(NOT_STOPPED),
       emulated_ptracer(nullptr),
       emulated_ptrace_stop_code(0),
       in_wait_type(WAIT_TYPE_NONE),
-      scratch_ptr(),
-      scratch_size(),
       flushed_syscallbuf(false),
       delay_syscallbuf_reset(false),
       delay_syscallbuf_flush(false),
@@ -253,14 +258,22 @@ Task::Task(Session& session, pid_t _tid, pid_t _rec_tid, uint32_t serial,
       rec_tid(_rec_tid > 0 ? _rec_tid : _tid),
       syscallbuf_hdr(),
       num_syscallbuf_bytes(),
+      syscallbuf_size(),
+      syscallbuf_idle_flushes(0),
       serial(serial),
       blocked_sigs(),
       prname("???"),
       ticks(0),
       registers(a),
+      registers_dirty(false),
+      emulated_syscall_unfinished(false),
+      unfinished_syscall_regs(a),
       is_stopped(false),
       extra_registers(a),
       extra_registers_known(false),
+      debug_control(0),
+      debug_regs_known(false),
+      debug_status_clear(false),
       robust_futex_list(),
       robust_futex_list_len(),
       session_(&session),
@@ -271,10 +284,13 @@ Task::Task(Session& session, pid_t _tid, pid_t _rec_tid, uint32_t serial,
       wait_status(),
       seen_ptrace_exit_event(false) {
   push_event(Event(EV_SENTINEL, NO_EXEC_INFO, RR_NATIVE_ARCH));
+  WaitHub::get().add_task(tid);
+  MemoryAccounting::add(MemoryAccounting::TASKS, sizeof(Task));
 }
 
 Task::~Task() {
   LOG(debug) << "task " << tid << " (rec:" << rec_tid << ") is dying ...";
+  MemoryAccounting::remove(MemoryAccounting::TASKS, sizeof(Task));
 
   if (emulated_ptracer) {
     emulated_ptracer->emulated_ptrace_tracees.erase(this);
@@ -300,6 +316,7 @@ Task::~Task() {
 
   session().on_destroy(this);
   tg->erase_task(this);
+  as->release_scratch(this);
   as->erase_task(this);
   fds->erase_task(this);
 
@@ -307,6 +324,7 @@ Task::~Task() {
 
   // We need the mem_fd in detach_and_reap().
   detach_and_reap();
+  WaitHub::get().remove_task(tid);
 
   LOG(debug) << "  dead";
 }
@@ -320,6 +338,7 @@ bool Task::at_may_restart_syscall() const {
 }
 
 void Task::finish_emulated_syscall() {
+  emulated_syscall_unfinished = false;
   // XXX verify that this can't be interrupted by a breakpoint trap
   Registers r = regs();
   remote_ptr<uint8_t> ip = r.ip();
@@ -358,6 +377,12 @@ void Task::finish_emulated_syscall() {
   wait_status = 0;
 }
 
+void Task::defer_finish_emulated_syscall() {
+  emulated_syscall_unfinished = true;
+  unfinished_syscall_regs = regs();
+  wait_status = 0;
+}
+
 const struct syscallbuf_record* Task::desched_rec() const {
   return (ev().is_syscall_event()
               ? ev().Syscall().desched_rec
@@ -377,10 +402,10 @@ void Task::destabilize_task_group() {
      * apply this offset.
      */
     int signal_delivery_event_offset = session().is_recording() ? -1 : 0;
-    printf(
-        "[rr.%d] Warning: task %d (process %d) dying from fatal signal %s.\n",
-        trace_time() + signal_delivery_event_offset, rec_tid, tgid(),
-        signal_name(ev().Signal().siginfo.si_signo));
+    printf("[rr.%" PRId64
+           "] Warning: task %d (process %d) dying from fatal signal %s.\n",
+           int64_t(trace_time()) + signal_delivery_event_offset, rec_tid,
+           tgid(), signal_name(ev().Signal().siginfo.si_signo));
   }
 
   tg->destabilize();
@@ -613,27 +638,34 @@ RecordSession& Task::record_session() const { return *session().as_record(); }
 ReplaySession& Task::replay_session() const { return *session().as_replay(); }
 
 template <typename Arch>
-void Task::init_buffers_arch(remote_ptr<void> map_hint,
-                             ShareDeschedEventFd share_desched_fd) {
+void Task::init_buffers_arch(remote_ptr<void> map_hint) {
   // NB: the tracee can't be interrupted with a signal while
   // we're processing the rrcall, because it's masked off all
   // signals.
-  AutoRemoteSyscalls remote(this);
 
   // Arguments to the rrcall.
-  remote_ptr<rrcall_init_buffers_params<Arch> > child_args =
-      remote.regs().arg1();
+  remote_ptr<rrcall_init_buffers_params<Arch> > child_args = regs().arg1();
   auto args = read_mem(child_args);
 
   if (as->syscallbuf_enabled()) {
-    init_syscall_buffer(remote, map_hint);
-    args.syscallbuf_ptr = syscallbuf_child;
-    if (share_desched_fd == SHARE_DESCHED_EVENT_FD) {
-      desched_fd_child = args.desched_counter_fd;
-      desched_fd = remote.retrieve_fd(desched_fd_child);
+    AddressSpace::PooledSyscallbuf pooled;
+    if (as->take_pooled_syscallbuf(map_hint, &pooled)) {
+      ASSERT(this, !syscallbuf_child)
+          << "Should not already have syscallbuf initialized!";
+      LOG(debug) << "  reusing pooled syscallbuf at " << pooled.child;
+      num_syscallbuf_bytes = pooled.num_bytes;
+      syscallbuf_child = pooled.child.cast<struct syscallbuf_hdr>();
+      syscallbuf_hdr = (struct syscallbuf_hdr*)pooled.local;
+      memset(syscallbuf_hdr, 0, sizeof(*syscallbuf_hdr));
     } else {
-      desched_fd_child = REPLAY_DESCHED_EVENT_FD;
+      AutoRemoteSyscalls remote(this);
+      init_syscall_buffer(remote, map_hint);
     }
+    args.syscallbuf_ptr = syscallbuf_child;
+    syscallbuf_size_child = args.syscallbuf_size_ptr.rptr();
+    // A fork child inherits its parent's counter fd, but not the counter.
+    desched_fd.close();
+    desched_fd_child = -1;
   } else {
     args.syscallbuf_ptr = remote_ptr<void>(nullptr);
   }
@@ -645,24 +677,71 @@ void Task::init_buffers_arch(remote_ptr<void> map_hint,
   // already written to the inout |args| param, but we stash it
   // away in the return value slot so that we can easily check
   // that we map the segment at the same addr during replay.
-  remote.regs().set_syscall_result(syscallbuf_child);
+  Registers r = regs();
+  r.set_syscall_result(syscallbuf_child);
+  set_regs(r);
   syscallbuf_hdr->locked = is_desched_sig_blocked();
+
+  if (!syscallbuf_child.is_null()) {
+    syscallbuf_idle_flushes = 0;
+    if (session().is_recording()) {
+      syscallbuf_size = num_syscallbuf_bytes;
+      set_syscallbuf_size(SYSCALLBUF_INITIAL_BUFFER_SIZE);
+    } else {
+      // Replay picks up the recorded size from the trace; see
+      // process_init_buffers().
+      syscallbuf_size = num_syscallbuf_bytes;
+    }
+  }
+}
+
+void Task::init_buffers(remote_ptr<void> map_hint) {
+  RR_ARCH_FUNCTION(init_buffers_arch, arch(), map_hint);
 }
 
-void Task::init_buffers(remote_ptr<void> map_hint,
-                        ShareDeschedEventFd share_desched_fd) {
-  RR_ARCH_FUNCTION(init_buffers_arch, arch(), map_hint, share_desched_fd);
+void Task::init_desched_fd(ShareDeschedEventFd share_desched_fd) {
+  ASSERT(this, !syscallbuf_child.is_null() && desched_fd_child < 0)
+      << "Desched counter set up without a syscallbuf, or twice";
+  if (share_desched_fd == SHARE_DESCHED_EVENT_FD) {
+    desched_fd_child = (int)regs().arg1_signed();
+    AutoRemoteSyscalls remote(this);
+    desched_fd = remote.retrieve_fd(desched_fd_child);
+  } else {
+    desched_fd_child = REPLAY_DESCHED_EVENT_FD;
+  }
 }
 
 void Task::destroy_buffers() {
-  AutoRemoteSyscalls remote(this);
-  remote.syscall(syscall_number_for_munmap(arch()), scratch_ptr, scratch_size);
-  vm()->unmap(scratch_ptr, scratch_size);
+  vector<AutoRemoteSyscalls::BatchedSyscall> syscalls;
+  // Other threads in our address space may still be using its scratch.
+  if (vm()->task_set().size() == 1) {
+    for (auto& r : vm()->scratch_regions()) {
+      syscalls.push_back({ syscall_number_for_munmap(arch()),
+                           r.addr.as_int(), r.num_bytes });
+      vm()->unmap(r.addr, r.num_bytes);
+    }
+    vm()->clear_scratch_regions();
+  }
   if (!syscallbuf_child.is_null()) {
-    remote.syscall(syscall_number_for_munmap(arch()), syscallbuf_child,
-                   num_syscallbuf_bytes);
-    vm()->unmap(syscallbuf_child, num_syscallbuf_bytes);
-    remote.syscall(syscall_number_for_close(arch()), desched_fd_child);
+    if (vm()->task_set().size() > 1 &&
+        vm()->pool_syscallbuf({ syscallbuf_child, syscallbuf_hdr,
+                                num_syscallbuf_bytes })) {
+      // The pool owns our local mapping now.
+      syscallbuf_child = nullptr;
+      syscallbuf_hdr = nullptr;
+    } else {
+      syscalls.push_back({ syscall_number_for_munmap(arch()),
+                           syscallbuf_child.as_int(), num_syscallbuf_bytes });
+      vm()->unmap(syscallbuf_child, num_syscallbuf_bytes);
+    }
+    if (desched_fd_child >= 0) {
+      syscalls.push_back(
+          { syscall_number_for_close(arch()), uintptr_t(desched_fd_child) });
+    }
+  }
+  if (!syscalls.empty()) {
+    AutoRemoteSyscalls remote(this);
+    remote.syscall_batch(syscalls);
   }
 }
 
@@ -672,6 +751,7 @@ bool Task::is_arm_desched_event_syscall() {
 
 bool Task::is_desched_event_syscall() {
   return is_ioctl_syscall(regs().original_syscallno(), arch()) &&
+         desched_fd_child != -1 &&
          (desched_fd_child == (int)regs().arg1_signed() ||
           desched_fd_child == REPLAY_DESCHED_EVENT_FD);
 }
@@ -782,8 +862,8 @@ void Task::log_pending_events() const {
 
   /* The event at depth 0 is the placeholder event, which isn't
    * useful to log.  Skip it. */
-  for (auto it = pending_events.rbegin(); it != pending_events.rend(); ++it) {
-    it->log();
+  for (ssize_t i = depth - 1; i >= 0; --i) {
+    pending_events[i].log();
   }
 }
 
@@ -880,9 +960,25 @@ void Task::on_syscall_exit_arch(int syscallno, const Registers& regs) {
     case Arch::dup2:
     case Arch::dup3:
       fd_table()->dup(regs.arg1(), regs.syscall_result());
+      forget_syscallbuf_fd_nonblocking(regs.syscall_result());
       return;
     case Arch::close:
       fd_table()->close(regs.arg1());
+      forget_syscallbuf_fd_nonblocking(regs.arg1());
+      return;
+    case Arch::fcntl:
+    case Arch::fcntl64:
+      switch ((int)regs.arg2_signed()) {
+        case Arch::DUPFD:
+        case Arch::DUPFD_CLOEXEC:
+          forget_syscallbuf_fd_nonblocking(regs.syscall_result());
+          break;
+        case Arch::SETFL:
+          // The flags belong to the open file description, which other
+          // fds may share.
+          forget_syscallbuf_fd_nonblocking(-1);
+          break;
+      }
       return;
 
     case Arch::write: {
@@ -969,8 +1065,11 @@ void Task::post_exec(const Registers* replay_regs,
    * start validating registers at events. */
   session().post_exec();
 
+  as->release_scratch(this);
   as->erase_task(this);
   fds->erase_task(this);
+  // exec() clears the debug registers.
+  debug_regs_known = false;
 
   string exe_file = exe_path(this);
   if (replay_regs) {
@@ -999,12 +1098,17 @@ void Task::post_exec(const Registers* replay_regs,
   // the clone.
   set_robust_list(nullptr, 0);
   syscallbuf_child = nullptr;
-  syscallbuf_fds_disabled_child = nullptr;
 
   sighandlers = sighandlers->clone();
   sighandlers->reset_user_handlers(arch());
 
+  auto old_as = as;
   as = session().create_vm(this, exe_file, as->uid().exec_count() + 1);
+  as->monkeypatcher().inherit_syscall_sites(old_as->monkeypatcher());
+  // Open the new mem fd now, so we don't fall back to ptrace for every
+  // memory access until post_exec_syscall(). If this fails, that opens
+  // it once remote syscalls work.
+  open_mem_fd_directly();
   // It's barely-documented, but Linux unshares the fd table on exec
   fds = fds->clone(this);
   prname = prname_from_exe_image(as->exe_image());
@@ -1019,7 +1123,7 @@ void Task::record_current_event() { record_event(ev()); }
 
 void Task::pop_event(EventType expected_type) {
   ASSERT(this, pending_events.back().type() == expected_type);
-  pending_events.pop_back();
+  pending_events.pop();
 }
 
 static bool record_extra_regs(const Event& ev) {
@@ -1053,6 +1157,10 @@ void Task::record_event(const Event& ev) {
                                     : nullptr,
                         record_extra_regs(ev) ? &extra_regs() : nullptr);
   }
+  uint32_t fingerprint;
+  if (memory_fingerprint(this, frame, &fingerprint)) {
+    frame.set_fingerprint(fingerprint);
+  }
 
   if (should_dump_memory(this, frame)) {
     dump_process_memory(this, frame.time(), "rec");
@@ -1061,6 +1169,8 @@ void Task::record_event(const Event& ev) {
     checksum_process_memory(this, frame.time());
   }
 
+  FlightRecorder::record(FlightRecorder::RECORD_EVENT, this,
+                         frame.event().encoded);
   trace_writer().write_frame(frame);
 }
 
@@ -1083,7 +1193,7 @@ void Task::record_local(remote_ptr<void> addr, ssize_t num_bytes,
 
 void Task::record_remote(remote_ptr<void> addr, ssize_t num_bytes) {
   // We shouldn't be recording a scratch address.
-  ASSERT(this, !addr || addr != scratch_ptr);
+  ASSERT(this, !addr || !as->is_scratch_region_start(addr));
 
   maybe_flush_syscallbuf();
 
@@ -1093,14 +1203,66 @@ void Task::record_remote(remote_ptr<void> addr, ssize_t num_bytes) {
     return;
   }
 
+  record_remote_data(addr, num_bytes);
+}
+
+void Task::record_remote_data(remote_ptr<void> addr, ssize_t num_bytes) {
+  trace_writer().write_raw_filled(
+      num_bytes, addr, [&](size_t offset, void* dest, size_t len) {
+        read_bytes_helper(addr + offset, len, dest);
+      });
+}
+
+void Task::record_file_data(remote_ptr<void> addr, ssize_t num_bytes,
+                            const string& file_name, uint64_t offset,
+                            const struct stat& st) {
+  ASSERT(this, !addr.is_null() && !as->is_scratch_region_start(addr));
+
+  maybe_flush_syscallbuf();
+
+  trace_writer().write_raw_file_data(num_bytes, addr, file_name, offset, st);
+}
+
+void Task::record_remote_ranges(const vector<MemoryRange>& ranges) {
+  maybe_flush_syscallbuf();
+
+  vector<TraceWriter::GatherRange> gather;
+  size_t total = 0;
+  for (auto& r : ranges) {
+    // We shouldn't be recording a scratch address.
+    ASSERT(this, !r.addr || !as->is_scratch_region_start(r.addr));
+    if (!r.addr) {
+      continue;
+    }
+    gather.push_back({ r.addr, r.num_bytes });
+    total += r.num_bytes;
+  }
+
+  vector<uint8_t> buf(total);
+  vector<RemoteIovec> iovecs;
+  size_t offset = 0;
+  for (auto& g : gather) {
+    iovecs.push_back({ g.addr, buf.data() + offset, g.num_bytes });
+    offset += g.num_bytes;
+  }
+  read_mem(iovecs);
+  trace_writer().write_raw_gather(buf.data(), gather);
+}
+
+void Task::record_sigframe(int sig, ssize_t num_bytes) {
+  maybe_flush_syscallbuf();
+
+  assert(num_bytes >= 0);
+
+  remote_ptr<void> addr = sp();
   auto buf = read_mem(addr.cast<uint8_t>(), num_bytes);
-  trace_writer().write_raw(buf.data(), num_bytes, addr);
+  trace_writer().write_sigframe(tid, sig, buf.data(), num_bytes, addr);
 }
 
 void Task::record_remote_even_if_null(remote_ptr<void> addr,
                                       ssize_t num_bytes) {
   // We shouldn't be recording a scratch address.
-  ASSERT(this, !addr || addr != scratch_ptr);
+  ASSERT(this, !addr || !as->is_scratch_region_start(addr));
 
   maybe_flush_syscallbuf();
 
@@ -1111,8 +1273,7 @@ void Task::record_remote_even_if_null(remote_ptr<void> addr,
     return;
   }
 
-  auto buf = read_mem(addr.cast<uint8_t>(), num_bytes);
-  trace_writer().write_raw(buf.data(), num_bytes, addr);
+  record_remote_data(addr, num_bytes);
 }
 
 void Task::record_remote_str(remote_ptr<void> str) {
@@ -1130,20 +1291,23 @@ void Task::record_remote_str(remote_ptr<void> str) {
 string Task::read_c_str(remote_ptr<void> child_addr) {
   // XXX handle invalid C strings
   string str;
+  char buf[page_size()];
   while (true) {
     // We're only guaranteed that [child_addr,
-    // end_of_page) is mapped.
+    // end_of_page) is mapped. Reading further could fault in pages the
+    // tracee never touches, since the kernel reads paths the same way.
     remote_ptr<void> end_of_page = ceil_page_size(child_addr + 1);
     ssize_t nbytes = end_of_page - child_addr;
-    char buf[nbytes];
 
     read_bytes_helper(child_addr, nbytes, buf);
-    for (int i = 0; i < nbytes; ++i) {
-      if ('\0' == buf[i]) {
-        return str;
-      }
-      str += buf[i];
+    // Paths are read for most syscalls we record, so find the end with
+    // memchr() and copy the string in one go rather than a byte at a time.
+    const char* end = static_cast<const char*>(memchr(buf, '\0', nbytes));
+    if (end) {
+      str.append(buf, end - buf);
+      return str;
     }
+    str.append(buf, nbytes);
     child_addr = end_of_page;
   }
 }
@@ -1226,7 +1390,11 @@ const ExtraRegisters& Task::extra_regs() {
 void Task::validate_regs(uint32_t flags) {
   /* don't validate anything before execve is done as the actual
    * process did not start prior to this point */
-  if (!session().can_validate()) {
+  if (!session().can_validate() || replay_session().fast_forwarding()) {
+    return;
+  }
+  uint32_t interval = Flags::get().check_regs_interval;
+  if (interval > 1 && current_trace_frame().time() % interval) {
     return;
   }
 
@@ -1258,7 +1426,8 @@ uintptr_t Task::debug_status() {
 uintptr_t Task::consume_debug_status() {
   uintptr_t status =
       fallible_ptrace(PTRACE_PEEKUSER, dr_user_word_offset(6), nullptr);
-  fallible_ptrace(PTRACE_POKEUSER, dr_user_word_offset(6), 0);
+  debug_status_clear =
+      0 == fallible_ptrace(PTRACE_POKEUSER, dr_user_word_offset(6), 0);
   return status;
 }
 
@@ -1277,6 +1446,20 @@ void Task::remote_memcpy(remote_ptr<void> dst, remote_ptr<void> src,
 
 void Task::resume_execution(ResumeRequest how, WaitRequest wait_how, int sig,
                             Ticks tick_period) {
+  if (emulated_syscall_unfinished) {
+    if (how == RESUME_SYSEMU) {
+      // Returning from the syscall-entry stop exits the emulated syscall
+      // without reporting it, and the resume then carries on as asked.
+      emulated_syscall_unfinished = false;
+    } else {
+      // Finish the syscall as it was left, then put back any register
+      // changes made since.
+      Registers r = regs();
+      set_regs(unfinished_syscall_regs);
+      finish_emulated_syscall();
+      set_regs(r);
+    }
+  }
   // Treat a 0 tick_period as a very large but finite number.
   // Always resetting here, and always to a nonzero number, improves
   // consistency between recording and replay and hopefully
@@ -1285,10 +1468,26 @@ void Task::resume_execution(ResumeRequest how, WaitRequest wait_how, int sig,
   // Accumulate any unknown stuff in tick_count().
   hpc.reset(tick_period == 0 ? 0xffffffff : tick_period);
   LOG(debug) << "resuming execution with " << ptrace_req_name(how);
+  flush_regs();
+  FlightRecorder::record(FlightRecorder::RESUME, this,
+                         uint32_t(how) | (uint64_t(sig) << 32));
   ptrace_if_alive(how, nullptr, (void*)(uintptr_t)sig);
   is_stopped = false;
   extra_registers_known = false;
+  if (!extra_registers.empty()) {
+    // Don't keep a copy of the XSAVE area, up to a few KB, for every
+    // thread that isn't stopped; it's reread when it's next needed.
+    extra_registers = ExtraRegisters(registers.arch());
+  }
+  debug_status_clear = false;
   if (RESUME_WAIT == wait_how) {
+    if (ReplaySession* replay = session().as_replay()) {
+      replay->decode_ahead();
+    }
+    bool singlestep =
+        how == RESUME_SINGLESTEP || how == RESUME_SYSEMU_SINGLESTEP;
+    Session::PhaseTimer timer(session(), singlestep ? Session::PHASE_SINGLESTEP
+                                                    : Session::PHASE_EXECUTE);
     wait();
   }
 }
@@ -1298,20 +1497,42 @@ const TraceFrame& Task::current_trace_frame() {
 }
 
 ssize_t Task::set_data_from_trace() {
-  auto buf = trace_reader().read_raw_data();
-  if (!buf.addr.is_null() && buf.data.size() > 0) {
-    write_bytes_helper(buf.addr, buf.data.size(), buf.data.data());
-  }
-  return buf.data.size();
+  Session::PhaseTimer timer(session(), Session::PHASE_RESTORE_MEMORY);
+  return trace_reader().read_raw_data_pieces(
+      [this](const TraceReader::RawData& piece) {
+        if (!piece.addr.is_null()) {
+          write_bytes_helper(piece.addr, piece.data.size(), piece.data.data());
+        }
+      });
 }
 
 void Task::apply_all_data_records_from_trace() {
-  TraceReader::RawData buf;
-  while (trace_reader().read_raw_data_for_frame(current_trace_frame(), buf)) {
-    if (!buf.addr.is_null() && buf.data.size() > 0) {
-      write_bytes_helper(buf.addr, buf.data.size(), buf.data.data());
+  Session::PhaseTimer timer(session(), Session::PHASE_RESTORE_MEMORY);
+  // Hold on to the records so their data stays valid until written. Huge
+  // records come in pieces, and we write out what we have whenever it adds
+  // up to a piece, so this holds at most about two pieces' worth.
+  vector<TraceReader::RawData> records;
+  vector<RemoteIovec> ranges;
+  size_t pending_bytes = 0;
+  auto apply = [&](const TraceReader::RawData& piece) {
+    if (piece.addr.is_null()) {
+      return;
+    }
+    ranges.push_back({ piece.addr, const_cast<uint8_t*>(piece.data.data()),
+                       piece.data.size() });
+    records.push_back(piece);
+    pending_bytes += piece.data.size();
+    if (pending_bytes >= TraceReader::RAW_DATA_PIECE_SIZE) {
+      write_mem(ranges);
+      records.clear();
+      ranges.clear();
+      pending_bytes = 0;
     }
+  };
+  while (trace_reader().read_raw_data_pieces_for_frame(current_trace_frame(),
+                                                       apply)) {
   }
+  write_mem(ranges);
 }
 
 void Task::set_return_value_from_trace() {
@@ -1323,8 +1544,16 @@ void Task::set_return_value_from_trace() {
 void Task::set_regs(const Registers& regs) {
   ASSERT(this, is_stopped);
   registers = regs;
+  registers_dirty = true;
+}
+
+void Task::flush_regs() {
+  if (!registers_dirty) {
+    return;
+  }
   auto ptrace_regs = registers.get_ptrace();
   ptrace_if_alive(PTRACE_SETREGS, nullptr, &ptrace_regs);
+  registers_dirty = false;
 }
 
 void Task::set_extra_regs(const ExtraRegisters& regs) {
@@ -1406,23 +1635,30 @@ bool Task::set_debug_regs(const DebugRegs& regs) {
   static_assert(sizeof(DebugControl) == sizeof(uintptr_t),
                 "Can't pack DebugControl");
 
+  static_assert(sizeof(debug_addrs) ==
+                    NUM_X86_WATCHPOINTS * sizeof(debug_addrs[0]),
+                "Wrong number of debug address registers");
+
   // Reset the debug status since we're about to change the set
   // of programmed watchpoints.
-  ptrace_if_alive(PTRACE_POKEUSER, dr_user_word_offset(6), 0);
-  // Ensure that we clear the programmed watchpoints in case
-  // enabling one of them fails.  We guarantee atomicity to the
-  // caller.
-  ptrace_if_alive(PTRACE_POKEUSER, dr_user_word_offset(7), 0);
+  if (!debug_status_clear) {
+    ptrace_if_alive(PTRACE_POKEUSER, dr_user_word_offset(6), 0);
+    debug_status_clear = true;
+  }
   if (regs.size() > NUM_X86_WATCHPOINTS) {
+    if (!debug_regs_known || debug_control) {
+      ptrace_if_alive(PTRACE_POKEUSER, dr_user_word_offset(7), 0);
+      debug_control = 0;
+    }
     return false;
   }
 
   size_t dr = 0;
+  uintptr_t addrs[NUM_X86_WATCHPOINTS];
+  bool addrs_changed = !debug_regs_known;
   for (auto reg : regs) {
-    if (fallible_ptrace(PTRACE_POKEUSER, dr_user_word_offset(dr),
-                        (void*)reg.addr.as_int())) {
-      return false;
-    }
+    addrs[dr] = reg.addr.as_int();
+    addrs_changed = addrs_changed || addrs[dr] != debug_addrs[dr];
     switch (dr++) {
 #define CASE_ENABLE_DR(_dr7, _i, _reg)                                         \
   case _i:                                                                     \
@@ -1439,8 +1675,45 @@ bool Task::set_debug_regs(const DebugRegs& regs) {
         FATAL() << "There's no debug register " << dr;
     }
   }
-  return 0 == fallible_ptrace(PTRACE_POKEUSER, dr_user_word_offset(7),
-                              (void*)dr7.packed());
+  if (!addrs_changed && debug_control == dr7.packed()) {
+    // Reverse execution with watchpoints reapplies the same ones around
+    // every step; don't pay for the pokes each time.
+    return true;
+  }
+
+  if (addrs_changed) {
+    // Ensure that we clear the programmed watchpoints in case
+    // enabling one of them fails.  We guarantee atomicity to the
+    // caller.
+    if (!debug_regs_known || debug_control) {
+      ptrace_if_alive(PTRACE_POKEUSER, dr_user_word_offset(7), 0);
+      debug_control = 0;
+    }
+    bool was_known = debug_regs_known;
+    debug_regs_known = true;
+    for (size_t i = 0; i < dr; ++i) {
+      if (was_known && addrs[i] == debug_addrs[i]) {
+        continue;
+      }
+      if (fallible_ptrace(PTRACE_POKEUSER, dr_user_word_offset(i),
+                          (void*)addrs[i])) {
+        // We don't know what the register holds now.
+        debug_regs_known = false;
+        return false;
+      }
+      debug_addrs[i] = addrs[i];
+    }
+  }
+  if (fallible_ptrace(PTRACE_POKEUSER, dr_user_word_offset(7),
+                      (void*)dr7.packed())) {
+    // The kernel may have put back the old DR7, but we promised to leave
+    // no watchpoint enabled.
+    ptrace_if_alive(PTRACE_POKEUSER, dr_user_word_offset(7), 0);
+    debug_control = 0;
+    return false;
+  }
+  debug_control = dr7.packed();
+  return true;
 }
 
 uintptr_t Task::get_debug_reg(size_t regno) {
@@ -1534,7 +1807,7 @@ void Task::stash_sig() {
 siginfo_t Task::pop_stash_sig() {
   assert(has_stashed_sig());
   siginfo_t si = stashed_signals.front().si;
-  stashed_signals.pop_front();
+  stashed_signals.erase(stashed_signals.begin());
   return si;
 }
 
@@ -1549,7 +1822,7 @@ const string& Task::trace_dir() const {
   return trace->dir();
 }
 
-uint32_t Task::trace_time() const {
+TraceFrame::Time Task::trace_time() const {
   const TraceStream* trace = trace_stream();
   return trace ? trace->time() : 0;
 }
@@ -1700,7 +1973,7 @@ void Task::wait(AllowInterrupt allow_interrupt) {
       // avoid it.
       alarm(3);
     }
-    ret = waitpid(tid, &status, __WALL);
+    ret = WaitHub::get().wait(tid, &status, true);
     if (enable_wait_interrupt) {
       alarm(0);
     }
@@ -1749,6 +2022,7 @@ void Task::wait(AllowInterrupt allow_interrupt) {
   LOG(debug) << "  waitpid(" << tid << ") returns " << ret << "; status "
              << HEX(status);
   ASSERT(this, tid == ret) << "waitpid(" << tid << ") failed with " << ret;
+  session().accumulate_ptrace_stop();
 
   // If some other ptrace-stop happened to race with our
   // PTRACE_INTERRUPT, then let the other event win.  We only
@@ -1781,6 +2055,7 @@ void Task::did_waitpid(int status, siginfo_t* override_siginfo) {
   LOG(debug) << "  (refreshing register cache)";
   // Skip reading registers immediately after a PTRACE_EVENT_EXEC, since
   // we may not know the correct architecture.
+  ASSERT(this, !registers_dirty) << "Register changes lost across a resume";
   if (ptrace_event() != PTRACE_EVENT_EXEC) {
     struct user_regs_struct ptrace_regs;
     if (ptrace_if_alive(PTRACE_GETREGS, nullptr, &ptrace_regs)) {
@@ -1821,11 +2096,12 @@ void Task::did_waitpid(int status, siginfo_t* override_siginfo) {
   if (registers.clear_singlestep_flag()) {
     set_regs(registers);
   }
+  FlightRecorder::record(FlightRecorder::STOP, this, wait_status);
 }
 
 bool Task::try_wait() {
   int status;
-  pid_t ret = waitpid(tid, &status, WNOHANG | __WALL | WSTOPPED);
+  pid_t ret = WaitHub::get().wait(tid, &status, false);
   LOG(debug) << "waitpid(" << tid << ", NOHANG) returns " << ret << ", status "
              << HEX(wait_status);
   ASSERT(this, 0 <= ret) << "waitpid(" << tid << ", NOHANG) failed with "
@@ -1985,9 +2261,6 @@ Task* Task::clone(int flags, remote_ptr<void> stack, remote_ptr<void> tls,
   }
   if (CLONE_SHARE_VM & flags) {
     t->as = as;
-    t->syscallbuf_fds_disabled_child = syscallbuf_fds_disabled_child;
-    // FdTable is either shared or copied, so we don't need to update
-    // syscallbuf_fds_disabled here.
   } else {
     t->as = sess.clone(t, as);
   }
@@ -2029,12 +2302,18 @@ Task* Task::clone(int flags, remote_ptr<void> stack, remote_ptr<void> tls,
       &session() == &t->session()) {
     AutoRemoteSyscalls remote(t);
     // Unshare the syscallbuf memory so when we lock it below, we don't
-    // also lock it in the task we cloned from!
+    // also lock it in the task we cloned from! Every fork child pays for
+    // this, so make it with a single resume.
     int prot = PROT_READ | PROT_WRITE;
     int flags = MAP_PRIVATE | MAP_FIXED | MAP_ANONYMOUS;
-    auto p = remote.mmap_syscall(syscallbuf_child, num_syscallbuf_bytes, prot,
-                                 flags, -1, 0);
-    ASSERT(t, p == syscallbuf_child.cast<void>());
+    vector<AutoRemoteSyscalls::BatchedSyscall> unshare;
+    unshare.push_back(remote.mmap_batched(syscallbuf_child,
+                                          num_syscallbuf_bytes, prot, flags,
+                                          -1, 0));
+    remote.syscall_batch(unshare);
+    remote_ptr<void> p = uintptr_t(unshare[0].result);
+    ASSERT(t, p == syscallbuf_child.cast<void>())
+        << "Unsharing syscallbuf failed with " << unshare[0].result;
     t->vm()->map(p, num_syscallbuf_bytes, prot, flags, 0,
                  MappableResource::anonymous());
 
@@ -2128,16 +2407,15 @@ Task::CapturedState Task::capture_state() {
   state.thread_area = thread_area;
   state.thread_area_valid = thread_area_valid;
   state.num_syscallbuf_bytes = num_syscallbuf_bytes;
+  state.syscallbuf_size = syscallbuf_size;
   state.desched_fd_child = desched_fd_child;
   state.syscallbuf_child = syscallbuf_child;
+  state.syscallbuf_size_child = syscallbuf_size_child;
   if (syscallbuf_hdr) {
     state.syscallbuf_hdr.resize(syscallbuf_data_size());
     memcpy(state.syscallbuf_hdr.data(), syscallbuf_hdr,
            state.syscallbuf_hdr.size());
   }
-  state.syscallbuf_fds_disabled_child = syscallbuf_fds_disabled_child;
-  state.scratch_ptr = scratch_ptr;
-  state.scratch_size = scratch_size;
   state.wait_status = wait_status;
   state.blocked_sigs = blocked_sigs;
   state.pending_events = pending_events;
@@ -2148,39 +2426,50 @@ Task::CapturedState Task::capture_state() {
 }
 
 void Task::copy_state(const CapturedState& state) {
-  long err;
   set_regs(state.regs);
   set_extra_regs(state.extra_regs);
   {
     AutoRemoteSyscalls remote(this);
+    copy_tls(state, remote);
+
+    auto ctid = state.tid_futex;
     {
       char prname[16];
       strncpy(prname, state.prname.c_str(), sizeof(prname));
       AutoRestoreMem remote_prname(remote, (const uint8_t*)prname,
                                    sizeof(prname));
       LOG(debug) << "    setting name to " << prname;
-      err = remote.syscall(syscall_number_for_prctl(arch()), PR_SET_NAME,
-                           remote_prname.get().as_int());
-      ASSERT(this, 0 == err);
+      // None of these depend on each other, so make them with a single
+      // resume of the tracee where we can. This runs for every thread of
+      // every cloned session, i.e. for every checkpoint and every
+      // seek that restores one.
+      vector<AutoRemoteSyscalls::BatchedSyscall> syscalls;
+      syscalls.push_back(AutoRemoteSyscalls::BatchedSyscall(
+          syscall_number_for_prctl(arch()), PR_SET_NAME,
+          remote_prname.get().as_int()));
+      if (!state.robust_futex_list.is_null()) {
+        set_robust_list(state.robust_futex_list, state.robust_futex_list_len);
+        LOG(debug) << "    setting robust-list " << this->robust_list()
+                   << " (size " << this->robust_list_len() << ")";
+        syscalls.push_back(AutoRemoteSyscalls::BatchedSyscall(
+            syscall_number_for_set_robust_list(arch()),
+            this->robust_list().as_int(), this->robust_list_len()));
+      }
+      if (!ctid.is_null()) {
+        syscalls.push_back(AutoRemoteSyscalls::BatchedSyscall(
+            syscall_number_for_set_tid_address(arch()), ctid.as_int()));
+      }
+      remote.syscall_batch(syscalls);
+      for (auto& s : syscalls) {
+        long expected =
+            s.syscallno == syscall_number_for_set_tid_address(arch()) ? tid
+                                                                       : 0;
+        ASSERT(this, expected == s.result) << "Restoring state with "
+                                           << syscall_name(s.syscallno)
+                                           << " failed: " << s.result;
+      }
       update_prname(remote_prname.get());
     }
-
-    if (!state.robust_futex_list.is_null()) {
-      set_robust_list(state.robust_futex_list, state.robust_futex_list_len);
-      LOG(debug) << "    setting robust-list " << this->robust_list()
-                 << " (size " << this->robust_list_len() << ")";
-      err = remote.syscall(syscall_number_for_set_robust_list(arch()),
-                           this->robust_list(), this->robust_list_len());
-      ASSERT(this, 0 == err);
-    }
-
-    copy_tls(state, remote);
-
-    auto ctid = state.tid_futex;
-    if (!ctid.is_null()) {
-      err = remote.syscall(syscall_number_for_set_tid_address(arch()), ctid);
-      ASSERT(this, tid == err);
-    }
     tid_futex = ctid;
 
     ASSERT(this, !syscallbuf_child)
@@ -2188,6 +2477,8 @@ void Task::copy_state(const CapturedState& state) {
     if (!state.syscallbuf_child.is_null()) {
       // All these fields are preserved by the fork.
       num_syscallbuf_bytes = state.num_syscallbuf_bytes;
+      syscallbuf_size = state.syscallbuf_size;
+      syscallbuf_size_child = state.syscallbuf_size_child;
       desched_fd_child = state.desched_fd_child;
 
       // The syscallbuf is mapped as a shared
@@ -2202,14 +2493,6 @@ void Task::copy_state(const CapturedState& state) {
              state.syscallbuf_hdr.size());
     }
   }
-  syscallbuf_fds_disabled_child = state.syscallbuf_fds_disabled_child;
-  // The scratch buffer (for now) is merely a private mapping in
-  // the remote task.  The CoW copy made by fork()'ing the
-  // address space has the semantics we want.  It's not used in
-  // replay anyway.
-  scratch_ptr = state.scratch_ptr;
-  scratch_size = state.scratch_size;
-
   // Whatever |from|'s last wait status was is what ours would
   // have been.
   wait_status = state.wait_status;
@@ -2224,7 +2507,9 @@ void Task::copy_state(const CapturedState& state) {
 
 void Task::destroy_local_buffers() {
   desched_fd.close();
-  munmap(syscallbuf_hdr, num_syscallbuf_bytes);
+  if (syscallbuf_hdr) {
+    munmap(syscallbuf_hdr, num_syscallbuf_bytes);
+  }
 }
 
 void Task::detach_and_reap() {
@@ -2233,6 +2518,7 @@ void Task::detach_and_reap() {
   ASSERT(this, as->mem_fd().is_open());
 
   if (unstable) {
+    flush_regs();
     fallible_ptrace(PTRACE_DETACH, nullptr, nullptr);
     // In addition to problems described in the long
     // comment at the prototype of this function, unstable
@@ -2250,7 +2536,13 @@ void Task::detach_and_reap() {
     // the PTRACE_EXIT_EVENT. Use brute force; keep trying to
     // detach over and over again.
     fallible_ptrace(PTRACE_DETACH, nullptr, nullptr);
-    int err = waitpid(tid, &wait_status, __WALL);
+    // A status may have been collected for us while waiting for another
+    // task. Otherwise wait for this tid alone; after the detach we may no
+    // longer be its tracer, and a waitpid(-1) could block forever.
+    int err = tid;
+    if (!WaitHub::get().take_stashed(tid, &wait_status)) {
+      err = waitpid(tid, &wait_status, __WALL);
+    }
     if (-1 == err && ECHILD == errno) {
       // child no longer exists for some reason. It's
       // already reaped or maybe it's no longer our child.
@@ -2293,16 +2585,32 @@ void Task::detach_and_reap() {
 }
 
 long Task::fallible_ptrace(int request, remote_ptr<void> addr, void* data) {
+  session().accumulate_ptrace_call();
   return ptrace(__ptrace_request(request), tid, addr, data);
 }
 
+bool Task::open_mem_fd_directly() {
+  char path[PATH_MAX];
+  sprintf(path, "/proc/%d/mem", tid);
+  ScopedFd fd(path, O_RDWR | O_CLOEXEC);
+  if (!fd.is_open()) {
+    LOG(debug) << "Can't open " << path << " directly: " << strerror(errno);
+    return false;
+  }
+  as->set_mem_fd(std::move(fd));
+  return true;
+}
+
 void Task::open_mem_fd() {
   // Use ptrace to read/write during open_mem_fd
   as->set_mem_fd(ScopedFd());
 
-  // We could try opening /proc/<pid>/mem directly first and
-  // only do this dance if that fails. But it's simpler to
-  // always take this path, and gives better test coverage.
+  // Opening the file ourselves needs no remote syscalls, so it works
+  // as soon as the task exists. Only if that fails do we make the
+  // tracee open it for us.
+  if (open_mem_fd_directly()) {
+    return;
+  }
   static const char path[] = "/proc/self/mem";
 
   AutoRemoteSyscalls remote(this);
@@ -2360,8 +2668,15 @@ void Task::init_syscall_buffer(AutoRemoteSyscalls& remote,
   if (!map_hint.is_null()) {
     flags |= MAP_FIXED;
   }
-  remote_ptr<void> child_map_addr = remote.mmap_syscall(
-      map_hint, num_syscallbuf_bytes, prot, flags, child_shmem_fd, 0);
+  // The tracee's fd is only needed for the mapping, so map and close it
+  // with one resume.
+  vector<AutoRemoteSyscalls::BatchedSyscall> syscalls;
+  syscalls.push_back(remote.mmap_batched(map_hint, num_syscallbuf_bytes, prot,
+                                         flags, child_shmem_fd, 0));
+  syscalls.push_back(AutoRemoteSyscalls::BatchedSyscall(
+      syscall_number_for_close(arch()), child_shmem_fd));
+  remote.syscall_batch(syscalls);
+  remote_ptr<void> child_map_addr = uintptr_t(syscalls[0].result);
   if (!map_hint.is_null()) {
     ASSERT(this, child_map_addr == map_hint)
         << "Tried to map syscallbuf at " << HEX(map_hint.as_int())
@@ -2379,7 +2694,6 @@ void Task::init_syscall_buffer(AutoRemoteSyscalls& remote,
             MappableResource::syscallbuf(rec_tid, shmem_fd, shmem_name));
 
   shmem_fd.close();
-  remote.syscall(syscall_number_for_close(arch()), child_shmem_fd);
 }
 
 bool Task::is_desched_sig_blocked() {
@@ -2427,9 +2741,30 @@ void Task::maybe_flush_syscallbuf() {
   // Write the entire buffer in one shot without parsing it,
   // because replay will take care of that.
   push_event(Event(EV_SYSCALLBUF_FLUSH, NO_EXEC_INFO, arch()));
+  size_t flushed_bytes = syscallbuf_data_size();
   record_local(syscallbuf_child,
                // Record the header for consistency checking.
-               syscallbuf_data_size(), syscallbuf_hdr);
+               flushed_bytes, syscallbuf_hdr);
+  // Count the buffered syscalls for the trace's syscall statistics. The
+  // records are tracee-writable, so stop at a malformed one.
+  TraceSyscallStats& stats = trace_writer().syscall_stats();
+  auto record_ptr = reinterpret_cast<const uint8_t*>(syscallbuf_hdr->recs);
+  auto end_ptr =
+      record_ptr + min<size_t>(syscallbuf_hdr->num_rec_bytes,
+                               flushed_bytes - sizeof(struct syscallbuf_hdr));
+  while (record_ptr + sizeof(struct syscallbuf_record) <= end_ptr) {
+    auto rec = reinterpret_cast<const struct syscallbuf_record*>(record_ptr);
+    if (rec->size < sizeof(*rec)) {
+      break;
+    }
+    stats.add_buffered(arch(), rec->syscallno);
+    record_ptr += stored_record_size(rec->size);
+  }
+  if (!delay_syscallbuf_reset && !syscallbuf_hdr->locked) {
+    // The buffer is about to be emptied, so this is a safe point to
+    // resize it. Any change is recorded as part of this event.
+    adapt_syscallbuf_size(flushed_bytes);
+  }
   record_current_event();
   pop_event(EV_SYSCALLBUF_FLUSH);
 
@@ -2441,6 +2776,59 @@ void Task::maybe_flush_syscallbuf() {
   flushed_syscallbuf = true;
 }
 
+/**
+ * A flush that finds the buffer more than half full means the task is
+ * producing records faster than it's interrupted by traced events, so
+ * double its buffer. After this many consecutive flushes that found it
+ * less than an eighth full, halve it again.
+ */
+static const uint32_t SYSCALLBUF_SHRINK_AFTER_IDLE_FLUSHES = 8;
+
+void Task::adapt_syscallbuf_size(size_t used) {
+  if (syscallbuf_size_child.is_null()) {
+    return;
+  }
+  uint32_t size = syscallbuf_size;
+  if (used > size / 2) {
+    syscallbuf_idle_flushes = 0;
+    size = min<uint32_t>(size * 2, num_syscallbuf_bytes);
+  } else if (used < size / 8 &&
+             ++syscallbuf_idle_flushes >=
+                 SYSCALLBUF_SHRINK_AFTER_IDLE_FLUSHES) {
+    syscallbuf_idle_flushes = 0;
+    size = max<uint32_t>(size / 2, SYSCALLBUF_MIN_BUFFER_SIZE);
+  }
+  if (size != syscallbuf_size) {
+    set_syscallbuf_size(size);
+  }
+}
+
+void Task::set_syscallbuf_size(uint32_t size) {
+  assert(session().is_recording());
+  assert(SYSCALLBUF_MIN_BUFFER_SIZE <= size && size <= num_syscallbuf_bytes);
+  LOG(debug) << "Resizing syscallbuf of " << tid << " from " << syscallbuf_size
+             << " to " << size << " bytes";
+  if (size < syscallbuf_size) {
+    // Give back the pages the tracee can no longer touch. The tail of
+    // the segment is never read, so it doesn't matter that it's zero
+    // from now on.
+    size_t start = ceil_page_size(size);
+    size_t end = ceil_page_size(syscallbuf_size);
+    if (start < end) {
+      madvise((uint8_t*)syscallbuf_hdr + start, end - start, MADV_REMOVE);
+    }
+  }
+  syscallbuf_size = size;
+  write_mem(syscallbuf_size_child, size);
+  record_local(syscallbuf_size_child, &size);
+}
+
+void Task::refresh_syscallbuf_size() {
+  if (!syscallbuf_size_child.is_null()) {
+    syscallbuf_size = read_mem(syscallbuf_size_child);
+  }
+}
+
 ssize_t Task::read_bytes_ptrace(remote_ptr<void> addr, ssize_t buf_size,
                                 void* buf) {
   ssize_t nread = 0;
@@ -2508,7 +2896,9 @@ ssize_t Task::read_bytes_fallible(remote_ptr<void> addr, ssize_t buf_size,
   }
 
   if (!as->mem_fd().is_open()) {
-    return read_bytes_ptrace(addr, buf_size, buf);
+    ssize_t nread = read_bytes_ptrace(addr, buf_size, buf);
+    session().accumulate_ptrace_fallback_bytes(max(nread, ssize_t(0)));
+    return nread;
   }
 
   errno = 0;
@@ -2535,6 +2925,102 @@ void Task::read_bytes_helper(remote_ptr<void> addr, ssize_t buf_size,
                                   << ", but only read " << nread;
 }
 
+ssize_t Task::transfer_mem_vectored(bool write,
+                                    const vector<RemoteIovec>& ranges,
+                                    size_t first, size_t* end) {
+  static bool process_vm_works = true;
+  if (!process_vm_works) {
+    *end = first + 1;
+    return -1;
+  }
+
+  vector<struct iovec> local;
+  vector<struct iovec> remote;
+  size_t i = first;
+  for (; i < ranges.size() && local.size() < IOV_MAX; ++i) {
+    const RemoteIovec& r = ranges[i];
+    uintptr_t addr = r.addr.as_int();
+    if (!remote.empty() &&
+        (uintptr_t)remote.back().iov_base + remote.back().iov_len == addr) {
+      remote.back().iov_len += r.size;
+    } else if (remote.size() < IOV_MAX) {
+      remote.push_back({ (void*)addr, r.size });
+    } else {
+      break;
+    }
+    local.push_back({ r.data, r.size });
+  }
+  *end = i;
+
+  // Both calls transfer the concatenation of the local buffers to or from
+  // the concatenation of the remote ranges, in order.
+  ssize_t ret =
+      write ? process_vm_writev(tid, local.data(), local.size(), remote.data(),
+                                remote.size(), 0)
+            : process_vm_readv(tid, local.data(), local.size(), remote.data(),
+                               remote.size(), 0);
+  if (ret < 0 && errno == ENOSYS) {
+    process_vm_works = false;
+  }
+  return ret;
+}
+
+ssize_t Task::read_bytes_fallible(const vector<RemoteIovec>& ranges) {
+  ssize_t total = 0;
+  size_t i = 0;
+  while (i < ranges.size()) {
+    size_t end;
+    ssize_t n = transfer_mem_vectored(false, ranges, i, &end);
+    for (; i < end && n >= (ssize_t)ranges[i].size; ++i) {
+      n -= ranges[i].size;
+      total += ranges[i].size;
+    }
+    if (i < end) {
+      // process_vm_readv can't read unreadable pages, but the mem fd can.
+      const RemoteIovec& r = ranges[i];
+      ssize_t nread = read_bytes_fallible(r.addr, r.size, r.data);
+      if (nread > 0) {
+        total += nread;
+      }
+      if (nread != (ssize_t)r.size) {
+        return total;
+      }
+      ++i;
+    }
+  }
+  return total;
+}
+
+void Task::read_mem(const vector<RemoteIovec>& ranges) {
+  ssize_t expected = 0;
+  for (auto& r : ranges) {
+    expected += r.size;
+  }
+  ssize_t nread = read_bytes_fallible(ranges);
+  ASSERT(this, nread == expected) << "Should have read " << expected
+                                  << " bytes from " << ranges.size()
+                                  << " ranges, but only read " << nread;
+}
+
+void Task::write_mem(const vector<RemoteIovec>& ranges) {
+  size_t i = 0;
+  while (i < ranges.size()) {
+    size_t end;
+    ssize_t n = transfer_mem_vectored(true, ranges, i, &end);
+    for (; i < end && n >= (ssize_t)ranges[i].size; ++i) {
+      n -= ranges[i].size;
+      vm()->notify_written(ranges[i].addr, ranges[i].size);
+    }
+    if (i < end) {
+      // Something (e.g. a read-only page) stopped process_vm_writev. Let
+      // write_bytes_helper's fallbacks deal with this range.
+      const RemoteIovec& r = ranges[i];
+      write_bytes_helper(r.addr, r.size, r.data);
+      ++i;
+    }
+  }
+}
+
 bool Task::try_replace_pages(remote_ptr<void> addr, ssize_t buf_size,
                              const void* buf) {
   // Check that there are private-mapping pages covering the destination area.
@@ -2598,6 +3084,7 @@ void Task::write_bytes_helper(remote_ptr<void> addr, ssize_t buf_size,
 
   if (!as->mem_fd().is_open()) {
     ssize_t nwritten = write_bytes_ptrace(addr, buf_size, buf);
+    session().accumulate_ptrace_fallback_bytes(max(nwritten, ssize_t(0)));
     vm()->notify_written(addr, nwritten);
     return;
   }
@@ -2669,25 +3156,25 @@ bool Task::clone_syscall_is_complete() {
   return false;
 }
 
-template <typename Arch>
-static remote_ptr<char> get_syscallbuf_fds_disabled_arch(Task* t) {
-  auto params = t->read_mem(
-      remote_ptr<rrcall_init_preload_params<Arch> >(t->regs().arg1()));
-  remote_ptr<volatile char> syscallbuf_fds_disabled =
-      params.syscallbuf_fds_disabled;
-  return syscallbuf_fds_disabled.cast<char>();
-}
-
-static remote_ptr<char> get_syscallbuf_fds_disabled(Task* t) {
-  RR_ARCH_FUNCTION(get_syscallbuf_fds_disabled_arch, t->arch(), t);
-}
-
 void Task::at_preload_init() {
   vm()->at_preload_init(this);
-  syscallbuf_fds_disabled_child = get_syscallbuf_fds_disabled(this);
   fd_table()->init_syscallbuf_fds_disabled(this);
 }
 
+void Task::forget_syscallbuf_fd_nonblocking(int fd) {
+  remote_ptr<char> table = vm()->syscallbuf_fds_nonblocking();
+  if (table.is_null()) {
+    return;
+  }
+  if (fd < 0) {
+    char none[SYSCALLBUF_FDS_NONBLOCKING_SIZE];
+    memset(none, 0, sizeof(none));
+    write_mem(table, none, sizeof(none));
+  } else if (fd < SYSCALLBUF_FDS_NONBLOCKING_SIZE) {
+    write_mem(table + fd, (char)0);
+  }
+}
+
 template <typename Arch>
 static void perform_remote_clone_arch(
     AutoRemoteSyscalls& remote, unsigned base_flags, remote_ptr<void> stack,
@@ -124,6 +124,16 @@ enum WaitRequest {
   RESUME_NONBLOCKING
 };
 
+/**
+ * One range of a vectored tracee memory access: |size| bytes at |addr| in
+ * the tracee, and at |data| in rr.
+ */
+struct RemoteIovec {
+  remote_ptr<void> addr;
+  void* data;
+  size_t size;
+};
+
 enum ShareDeschedEventFd {
   SHARE_DESCHED_EVENT_FD = 1,
   DONT_SHARE_DESCHED_EVENT_FD = 0
@@ -226,6 +236,13 @@ public:
    * assumption.
    */
   void finish_emulated_syscall();
+  /**
+   * Like |finish_emulated_syscall()|, but leave the task at its
+   * syscall-entry stop until it's next resumed. A PTRACE_SYSEMU resume
+   * exits the emulated syscall on the way, saving the singlestep; any
+   * other resume (or remote syscall) finishes the syscall first.
+   */
+  void defer_finish_emulated_syscall();
 
   /**
    * Shortcut to the single |pending_event->desched.rec| when
@@ -239,8 +256,8 @@ public:
     if (syscallbuf_hdr->locked) {
       // There may be an incomplete syscall record after num_rec_bytes that
       // we need to record. We don't know how big that record is,
-      // so just record the entire buffer. This should not be common.
-      return num_syscallbuf_bytes;
+      // so just record the entire usable buffer. This should not be common.
+      return syscallbuf_size;
     }
     return syscallbuf_hdr->num_rec_bytes + sizeof(*syscallbuf_hdr);
   }
@@ -451,16 +468,28 @@ public:
    * of *exit from* the rrcall.  Registers will be updated with
    * the return value from the rrcall, which is also returned
    * from this call.  |map_hint| suggests where to map the
-   * region; see |init_syscallbuf_buffer()|.
+   * region; see |init_syscallbuf_buffer()|. A syscallbuf pooled by
+   * the address space is taken over if there is one (at |map_hint|, if
+   * that's not null), in which case no remote syscalls are needed.
    *
-   * Pass SHARE_DESCHED_EVENT_FD to additionally share that fd.
+   * The desched counter isn't set up yet; see init_desched_fd().
    */
-  void init_buffers(remote_ptr<void> map_hint,
-                    ShareDeschedEventFd share_desched_fd);
+  void init_buffers(remote_ptr<void> map_hint);
 
   /**
-   * Destroy in the tracee task the scratch buffer and syscallbuf (if
-   * syscallbuf_child is non-null).
+   * Implement SYS_rrcall_init_desched, which the preload library makes
+   * before the first may-block syscall this thread buffers. This task
+   * must be at the point of exit from the rrcall. Pass
+   * SHARE_DESCHED_EVENT_FD to retrieve the counter's fd into
+   * |desched_fd|.
+   */
+  void init_desched_fd(ShareDeschedEventFd share_desched_fd);
+
+  /**
+   * Destroy in the tracee task the syscallbuf (if syscallbuf_child is
+   * non-null), and the address space's scratch if this is its last task.
+   * The syscallbuf is pooled instead while other tasks share the address
+   * space, and this task no longer has one.
    * This task must already be at a state in which remote syscalls can be
    * executed; if it's not, results are undefined.
    */
@@ -618,7 +647,7 @@ public:
    * helpers pop the event at top of the stack, which must be of
    * the specified type.
    */
-  void push_event(const Event& ev) { pending_events.push_back(ev); }
+  void push_event(const Event& ev) { pending_events.push(ev); }
   void pop_event(EventType expected_type);
   void pop_noop() { pop_event(EV_NOOP); }
   void pop_desched() { pop_event(EV_DESCHED); }
@@ -664,6 +693,21 @@ public:
   template <typename T> void record_remote(remote_ptr<T> addr) {
     record_remote(addr, sizeof(T));
   }
+  /**
+   * Like calling record_remote() on each of |ranges| in order, but the
+   * ranges are read with as few process_vm_readv calls as possible and
+   * stored as one raw-data record.
+   */
+  void record_remote_ranges(const std::vector<MemoryRange>& ranges);
+
+  /**
+   * Record that |num_bytes| at |addr| were read from |file_name| at
+   * |offset|, without saving the data; replay reads it back from the
+   * file. Only for files that won't change, see is_immutable_file().
+   */
+  void record_file_data(remote_ptr<void> addr, ssize_t num_bytes,
+                        const std::string& file_name, uint64_t offset,
+                        const struct stat& st);
 
   /**
    * Save tracee data to the trace.  |addr| is the address in
@@ -677,6 +721,13 @@ public:
 
   void record_remote_str(remote_ptr<void> str);
 
+  /**
+   * Save the |num_bytes| below the stack pointer, where the signal frame
+   * for a delivery of |sig| was just set up, to the trace. Repeated
+   * deliveries of the same signal are delta-encoded against each other.
+   */
+  void record_sigframe(int sig, ssize_t num_bytes);
+
   /**
    * Attempt to find the value of |regname| (a DebuggerRegister
    * name) in this task, and if so (i) write it to |buf|; (ii)
@@ -758,6 +809,12 @@ public:
     return v;
   }
 
+  /**
+   * Read each of |ranges| into its buffer, or don't return. The ranges are
+   * read with as few process_vm_readv calls as possible.
+   */
+  void read_mem(const std::vector<RemoteIovec>& ranges);
+
   /**
    * Read and return the C string located at |child_addr| in
    * this address space.
@@ -807,7 +864,11 @@ public:
    */
   void set_return_value_from_trace();
 
-  /** Set the tracee's registers to |regs|. */
+  /**
+   * Set the tracee's registers to |regs|. The registers are only written
+   * to the tracee (with one PTRACE_SETREGS, however many times they're
+   * set) when it is next resumed or detached; see flush_regs().
+   */
   void set_regs(const Registers& regs);
 
   /** Set the tracee's extra registers to |regs|. */
@@ -953,7 +1014,7 @@ public:
    * events.  |task_time()| returns that "time" wrt this task
    * only.
    */
-  uint32_t trace_time() const;
+  TraceFrame::Time trace_time() const;
 
   /**
    * Call this after the tracee successfully makes a
@@ -981,6 +1042,13 @@ public:
    */
   void maybe_flush_syscallbuf();
 
+  /**
+   * Set |syscallbuf_size| to the usable size the tracee's syscallbuf
+   * lib currently has for its buffer.  Replay calls this after
+   * restoring a recorded size change from the trace.
+   */
+  void refresh_syscallbuf_size();
+
   /**
    * Return the virtual memory mapping (address space) of this
    * task.
@@ -1043,6 +1111,12 @@ public:
     write_bytes_helper(child_addr, sizeof(*val) * count,
                        static_cast<const void*>(val));
   }
+  /**
+   * Write each of |ranges| from its buffer, in order, or don't return.
+   * Ranges that are adjacent in the tracee are coalesced and the whole
+   * set is written with as few process_vm_writev calls as possible.
+   */
+  void write_mem(const std::vector<RemoteIovec>& ranges);
 
   /**
    * Don't use these helpers directly; use the safer and more
@@ -1053,6 +1127,11 @@ public:
    */
   ssize_t read_bytes_fallible(remote_ptr<void> addr, ssize_t buf_size,
                               void* buf);
+  /**
+   * Like read_mem(ranges), but return the number of bytes read before the
+   * first range that couldn't be read completely.
+   */
+  ssize_t read_bytes_fallible(const std::vector<RemoteIovec>& ranges);
   void read_bytes_helper(remote_ptr<void> addr, ssize_t buf_size, void* buf);
   void write_bytes_helper(remote_ptr<void> addr, ssize_t buf_size,
                           const void* buf);
@@ -1079,6 +1158,12 @@ public:
    */
   void at_preload_init();
 
+  /**
+   * Tell the preload library that |fd|, or every fd if |fd| is negative,
+   * may no longer be in O_NONBLOCK mode.
+   */
+  void forget_syscallbuf_fd_nonblocking(int fd);
+
   /**
    * Open /proc/[tid]/mem fd for our AddressSpace, closing the old one
    * first.
@@ -1086,6 +1171,12 @@ public:
    * itself and smuggle the fd back to us.
    */
   void open_mem_fd();
+  /**
+   * Try to open /proc/[tid]/mem for our AddressSpace ourselves, without
+   * any remote syscalls. Returns false (and leaves the AddressSpace's fd
+   * alone) if that fails.
+   */
+  bool open_mem_fd_directly();
 
   /**
    * Calls open_mem_fd if this task's AddressSpace doesn't already have one.
@@ -1130,6 +1221,15 @@ public:
    * in_round_robin_queue instead of its task_priority_set.
    */
   bool in_round_robin_queue;
+  /* Ticks the scheduler grants this task per timeslice, or 0 if it hasn't
+   * adapted it yet. timeslice_expired_ticks and timeslice_expired_ip are
+   * the tick count and ip at the last expiry. */
+  Ticks timeslice;
+  Ticks timeslice_expired_ticks;
+  remote_ptr<uint8_t> timeslice_expired_ip;
+  /* Futex word this task is blocked on in FUTEX_WAIT, or null. Maintained
+   * by the scheduler. */
+  remote_ptr<int> futex_wait_addr;
   // The set of signals that were blocked during a sigsuspend. Only present
   // during the first EV_SIGNAL during an interrupted sigsuspend.
   std::unique_ptr<sig_set_t> sigsuspend_blocked_sigs;
@@ -1171,26 +1271,17 @@ public:
    * future, we may be able to use that fact to simplify
    * things.)
    *
-   * Because of nesting, at first blush it seems we should push
-   * scratch allocations onto a stack and pop them as syscalls
-   * (or restarts thereof) complete.  But under a critical
-   * assumption, we can actually skip that.  The critical
-   * assumption is that the kernel writes its (in)outparams
-   * atomically wrt signal interruptions, and only writes them
-   * on successful exit.  Each syscall will complete in stack
-   * order, and it's invariant that the syscall processors must
-   * only write back to user buffers *only* the data that was
-   * written by the kernel.  So as long as the atomicity
-   * assumption holds, the completion of syscalls higher in the
-   * event stack may overwrite scratch space, but the completion
-   * of each syscall will overwrite those overwrites again, and
-   * that over-overwritten data is exactly and only what we'll
-   * write back to the tracee.
-   *
-   * |scratch_ptr| points at the mapped address in the child,
-   * and |size| is the total available space. */
-  remote_ptr<void> scratch_ptr;
-  ssize_t scratch_size;
+   * Scratch memory belongs to the AddressSpace, not the task, so
+   * that threads share it instead of each mapping their own. A
+   * task reserves scratch for a syscall when it may switch out,
+   * and releases it when the syscall completes; see
+   * AddressSpace::free_scratch(). A nested syscall made from a
+   * signal handler replaces its task's reservation. That's safe
+   * under a critical assumption: the kernel writes its
+   * (in)outparams atomically wrt signal interruptions, and only
+   * writes them on successful exit, and syscall processors only
+   * write back to user buffers the data that was written by the
+   * kernel. */
 
   /* Nonzero after the trace recorder has flushed the
    * syscallbuf.  When this happens, the recorder must prepare a
@@ -1247,9 +1338,16 @@ public:
   /* Points at rr's mapping of the (shared) syscall buffer. */
   struct syscallbuf_hdr* syscallbuf_hdr;
   size_t num_syscallbuf_bytes;
+  /* How many of the |num_syscallbuf_bytes| mapped bytes, counting the
+   * header, the tracee may currently use. */
+  uint32_t syscallbuf_size;
+  /* Number of consecutive flushes that found the buffer mostly empty;
+   * see |adapt_syscallbuf_size()|. */
+  uint32_t syscallbuf_idle_flushes;
   /* Points at the tracee's mapping of the buffer. */
   remote_ptr<struct syscallbuf_hdr> syscallbuf_child;
-  remote_ptr<char> syscallbuf_fds_disabled_child;
+  /* Points at the tracee's copy of |syscallbuf_size|. */
+  remote_ptr<uint32_t> syscallbuf_size_child;
 
   PropertyTable& properties() { return properties_; }
 
@@ -1264,15 +1362,14 @@ public:
     struct user_desc thread_area;
     bool thread_area_valid;
     size_t num_syscallbuf_bytes;
+    uint32_t syscallbuf_size;
     int desched_fd_child;
     remote_ptr<struct syscallbuf_hdr> syscallbuf_child;
+    remote_ptr<uint32_t> syscallbuf_size_child;
     std::vector<uint8_t> syscallbuf_hdr;
-    remote_ptr<char> syscallbuf_fds_disabled_child;
-    remote_ptr<void> scratch_ptr;
-    ssize_t scratch_size;
     int wait_status;
     sig_set_t blocked_sigs;
-    std::deque<Event> pending_events;
+    EventStack pending_events;
     Ticks ticks;
     remote_ptr<int> tid_futex;
     remote_ptr<void> top_of_stack;
@@ -1288,10 +1385,14 @@ private:
   /** Helper function for update_sigaction. */
   template <typename Arch> void update_sigaction_arch(const Registers& regs);
 
+  /**
+   * Record |num_bytes| at non-null |addr|, reading them straight into the
+   * trace writer's buffers.
+   */
+  void record_remote_data(remote_ptr<void> addr, ssize_t num_bytes);
+
   /** Helper function for init_buffers. */
-  template <typename Arch>
-  void init_buffers_arch(remote_ptr<void> map_hint,
-                         ShareDeschedEventFd share_desched_fd);
+  template <typename Arch> void init_buffers_arch(remote_ptr<void> map_hint);
 
   /**
    * Return a new Task cloned from |p|.  |flags| are a set of
@@ -1330,6 +1431,12 @@ private:
    */
   void destroy_local_buffers();
 
+  /**
+   * Write |registers| to the tracee if set_regs() changed them. Must be
+   * called before the tracee can run or observe its own registers.
+   */
+  void flush_regs();
+
   /**
    * Detach this from rr and try hard to ensure any operations
    * related to it have completed by the time this function
@@ -1372,6 +1479,15 @@ private:
   ssize_t write_bytes_ptrace(remote_ptr<void> addr, ssize_t buf_size,
                              const void* buf);
 
+  /**
+   * Transfer a prefix of ranges[first..] with one process_vm_readv or
+   * process_vm_writev call, and set |*end| to one past the last range
+   * included. Return the number of bytes transferred, or -1.
+   */
+  ssize_t transfer_mem_vectored(bool write,
+                                const std::vector<RemoteIovec>& ranges,
+                                size_t first, size_t* end);
+
   /**
    * Try writing 'buf' to 'addr' by replacing pages in the tracee
    * address-space using a temporary file. This may work around PaX issues.
@@ -1389,6 +1505,21 @@ private:
   void init_syscall_buffer(AutoRemoteSyscalls& remote,
                            remote_ptr<void> map_hint);
 
+  /**
+   * Make |size| the usable size of the tracee's syscallbuf and record
+   * the change so replay makes it at the same point.  Only valid
+   * during recording, while the buffer is empty and unlocked.
+   */
+  void set_syscallbuf_size(uint32_t size);
+
+  /**
+   * Called after the recorder flushes |used| bytes of syscallbuf: grow
+   * the buffer of a task whose flush found it mostly full, and shrink
+   * the buffer of one that has been flushed mostly empty several times
+   * in a row.
+   */
+  void adapt_syscallbuf_size(size_t used);
+
   /**
    * True if this has blocked delivery of the desched signal.
    */
@@ -1464,10 +1595,8 @@ private:
   FdTable::shr_ptr fds;
   // The set of signals that are currently blocked.
   sig_set_t blocked_sigs;
-  // The current stack of events being processed.  (We use a
-  // deque instead of a stack because we need to iterate the
-  // events.)
-  std::deque<Event> pending_events;
+  // The current stack of events being processed.
+  EventStack pending_events;
   // Task's OS name.
   std::string prname;
   // Count of all ticks seen by this task since tracees became
@@ -1475,12 +1604,28 @@ private:
   Ticks ticks;
   // When |is_stopped|, these are our child registers.
   Registers registers;
+  // True when |registers| has been modified since it was last read from or
+  // written to the tracee.
+  bool registers_dirty;
+  // True when an emulated syscall has been left at its syscall-entry stop
+  // by defer_finish_emulated_syscall().
+  bool emulated_syscall_unfinished;
+  // The registers that syscall would have been finished with.
+  Registers unfinished_syscall_regs;
   // True when we know via waitpid() that the task is stopped and we haven't
   // resumed it.
   bool is_stopped;
   // When |extra_registers_known|, we have saved our extra registers.
   ExtraRegisters extra_registers;
   bool extra_registers_known;
+  // When |debug_regs_known|, DR0-3 and DR7 hold these values, so
+  // set_debug_regs() needn't poke the ones that aren't changing.
+  uintptr_t debug_addrs[4];
+  uintptr_t debug_control;
+  bool debug_regs_known;
+  // True if DR6 is known to be clear: we cleared it and haven't resumed
+  // the task since.
+  bool debug_status_clear;
   // Futex list passed to |set_robust_list()|.  We could keep a
   // strong type for this list head and read it if we wanted to,
   // but for now we only need to remember its address / size at
@@ -1500,12 +1645,13 @@ private:
   // of user sighandlers (see below). */
   std::shared_ptr<Sighandlers> sighandlers;
   // Stashed signal-delivery state, ready to be delivered at
-  // next opportunity.
+  // next opportunity. Rarely more than one, so a vector: an empty deque
+  // would still allocate a 512-byte block for every task.
   struct StashedSignal {
     StashedSignal(const siginfo_t& si) : si(si) {}
     siginfo_t si;
   };
-  std::deque<StashedSignal> stashed_signals;
+  std::vector<StashedSignal> stashed_signals;
   // The task group this belongs to.
   std::shared_ptr<TaskGroup> tg;
   // Contents of the |tls| argument passed to |clone()| and
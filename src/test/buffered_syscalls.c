@@ -0,0 +1,61 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+int main(int argc, char* argv[]) {
+  int sockets[2];
+  int epfd;
+  struct epoll_event ev;
+  struct epoll_event events[4];
+  char out1[] = "hello ";
+  char out2[] = "there";
+  char in1[4];
+  char in2[16];
+  struct iovec iov[2];
+  struct msghdr msg;
+  struct timespec ts = { 0, 1000 };
+  ssize_t nr;
+  int ret;
+
+  test_assert(0 == socketpair(AF_UNIX, SOCK_STREAM, 0, sockets));
+
+  epfd = epoll_create(1);
+  test_assert(epfd >= 0);
+  ev.events = EPOLLIN;
+  ev.data.u32 = 42;
+  test_assert(0 == epoll_ctl(epfd, EPOLL_CTL_ADD, sockets[1], &ev));
+  ret = epoll_wait(epfd, events, 4, 0);
+  test_assert(0 == ret);
+
+  iov[0].iov_base = out1;
+  iov[0].iov_len = sizeof(out1) - 1;
+  iov[1].iov_base = out2;
+  iov[1].iov_len = sizeof(out2);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  nr = sendmsg(sockets[0], &msg, 0);
+  test_assert(nr == sizeof(out1) - 1 + sizeof(out2));
+
+  ret = epoll_wait(epfd, events, 4, -1);
+  test_assert(1 == ret);
+  test_assert(events[0].data.u32 == 42);
+
+  iov[0].iov_base = in1;
+  iov[0].iov_len = sizeof(in1);
+  iov[1].iov_base = in2;
+  iov[1].iov_len = sizeof(in2);
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  nr = recvmsg(sockets[1], &msg, 0);
+  test_assert(nr == sizeof(out1) - 1 + sizeof(out2));
+  test_assert(0 == memcmp(in1, "hell", 4));
+  test_assert(0 == strcmp(in2, "o there"));
+  atomic_printf("Received ```%.4s%s'''\n", in1, in2);
+
+  test_assert(0 == nanosleep(&ts, NULL));
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,21 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static int hits;
+
+static void break_here(int i) {
+  atomic_printf("%d ", i);
+  ++hits;
+}
+
+int main(int argc, char** argv) {
+  int i;
+
+  for (i = 0; i < 100; ++i) {
+    break_here(i);
+  }
+
+  atomic_puts("\nEXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,16 @@
+from rrutil import *
+
+send_gdb('b break_here if i == 77\n')
+expect_gdb('Breakpoint 1')
+send_gdb('c\n')
+expect_gdb('Breakpoint 1, break_here \\(i=77\\)')
+send_gdb('p hits\n')
+expect_gdb('= 77')
+
+send_gdb('condition 1 i == 33 || i == 88\n')
+send_gdb('reverse-continue\n')
+expect_gdb('Breakpoint 1, break_here \\(i=33\\)')
+send_gdb('c\n')
+expect_gdb('Breakpoint 1, break_here \\(i=88\\)')
+
+ok()
@@ -0,0 +1,46 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+static int pipe_fds[2];
+
+static void* writer(void* p) {
+  struct timespec ts = { 0, 10000000 };
+  nanosleep(&ts, NULL);
+  test_assert(1 == write(pipe_fds[1], "y", 1));
+  return NULL;
+}
+
+int main(int argc, char* argv[]) {
+  pthread_t thread;
+  int flags;
+  char ch;
+
+  test_assert(0 == pipe(pipe_fds));
+  flags = fcntl(pipe_fds[0], F_GETFL);
+  test_assert(0 == fcntl(pipe_fds[0], F_SETFL, flags | O_NONBLOCK));
+
+  /* Known-nonblocking reads don't arm the desched event. */
+  test_assert(-1 == read(pipe_fds[0], &ch, 1));
+  test_assert(EAGAIN == errno);
+  test_assert(1 == write(pipe_fds[1], "x", 1));
+  test_assert(1 == read(pipe_fds[0], &ch, 1));
+  test_assert('x' == ch);
+
+  /* Once the fd is made blocking again, a read that blocks must still
+   * let the writer run. */
+  test_assert(0 == fcntl(pipe_fds[0], F_SETFL, flags));
+  pthread_create(&thread, NULL, writer, NULL);
+  test_assert(1 == read(pipe_fds[0], &ch, 1));
+  test_assert('y' == ch);
+  pthread_join(thread, NULL);
+
+  /* A dup of a nonblocking fd shares its mode. */
+  test_assert(0 == fcntl(pipe_fds[0], F_SETFL, flags | O_NONBLOCK));
+  test_assert(100 == dup2(pipe_fds[0], 100));
+  test_assert(-1 == read(100, &ch, 1));
+  test_assert(EAGAIN == errno);
+
+  atomic_puts("EXIT-SUCCESS");
+  return 0;
+}
@@ -0,0 +1,28 @@
+/* -*- Mode: C; tab-width: 8; c-basic-offset: 2; indent-tabs-mode: nil; -*- */
+
+#include "rrutil.h"
+
+#define ITERATIONS 10 * 1024 * 1024
+
+static uintptr_t count_down(uintptr_t count) {
+#if defined(__i386__) || defined(__x86_64__)
+  __asm__ __volatile__("1: loop 1b\n\t" : "+c"(count));
+#else
+  while (count > 0) {
+    --count;
+  }
+#endif
+  return count;
+}
+
+int main(int argc, char* argv[]) {
+  int i;
+
+  for (i = 0; i < 100; ++i) {
+    test_assert(count_down(ITERATIONS) == 0);
+  }
+
+  atomic_puts("EXIT-SUCCESS");
+
+  return 0;
+}
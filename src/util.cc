@@ -12,10 +12,22 @@
 #include <fcntl.h>
 #include <inttypes.h>
 #include <linux/magic.h>
+#include <nmmintrin.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/vfs.h>
+#include <time.h>
 #include <unistd.h>
+#include <x86intrin.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <sstream>
 
 #include "preload/preload_interface.h"
 
@@ -24,25 +36,13 @@
 #include "kernel_metadata.h"
 #include "log.h"
 #include "ReplaySession.h"
+#include "ScopedFd.h"
 #include "task.h"
 #include "TraceStream.h"
 
 using namespace std;
 using namespace rr;
 
-// FIXME this function assumes that there's only one address space.
-// Should instead only look at the address space of the task in
-// question.
-static bool is_start_of_scratch_region(Task* t, remote_ptr<void> start_addr) {
-  for (auto& kv : t->session().tasks()) {
-    Task* c = kv.second;
-    if (start_addr == c->scratch_ptr) {
-      return true;
-    }
-  }
-  return false;
-}
-
 bool probably_not_interactive(int fd) {
   /* Eminently tunable heuristic, but this is guaranteed to be
    * true during rr unit tests, where we care most about this
@@ -114,8 +114,8 @@ void dump_binary_data(const char* filename, const char* label,
 void format_dump_filename(Task* t, TraceFrame::Time global_time,
                           const char* tag, char* filename,
                           size_t filename_size) {
-  snprintf(filename, filename_size - 1, "%s/%d_%d_%s", t->trace_dir().c_str(),
-           t->rec_tid, global_time, tag);
+  snprintf(filename, filename_size - 1, "%s/%d_%" PRIu64 "_%s",
+           t->trace_dir().c_str(), t->rec_tid, global_time, tag);
 }
 
 bool should_dump_memory(Task* t, const TraceFrame& f) {
@@ -133,7 +133,141 @@ bool should_dump_memory(Task* t, const TraceFrame& f) {
   }
 #endif
   return flags->dump_on == Flags::DUMP_ON_ALL ||
-         flags->dump_at == int(f.time());
+         flags->dump_at == int64_t(f.time());
+}
+
+/**
+ * Binary dumps read and compress each mapping this much at a time.
+ */
+static const size_t BINARY_DUMP_CHUNK_SIZE = 1024 * 1024;
+
+/**
+ * One mapping of a binary dump. Each is written by one of the dump threads.
+ */
+struct BinaryDumpMapping {
+  remote_ptr<void> start;
+  size_t num_bytes;
+  string label;
+  // How much of the mapping could be read.
+  size_t bytes_read;
+  bool failed;
+};
+
+struct BinaryDumpState {
+  string dir;
+  // When the task has no mem fd, all mappings are dumped on the calling
+  // thread through |t|, since only it may use ptrace. Otherwise |t| is
+  // null and the threads pread() |mem_fd|, which is safe concurrently.
+  Task* t;
+  int mem_fd;
+  vector<BinaryDumpMapping> mappings;
+  atomic<size_t> next;
+};
+
+/**
+ * Compress the readable prefix of mapping |i| of |state| to its file.
+ */
+static void dump_binary_mapping(BinaryDumpState& state, size_t i) {
+  BinaryDumpMapping& m = state.mappings[i];
+  string filename = state.dir + "/" + to_string(i) + ".gz";
+  // Level 1: dumps are written while the tracee waits, and most of a large
+  // process compresses well even at the fastest level.
+  gzFile out = gzopen(filename.c_str(), "wb1");
+  if (!out) {
+    m.failed = true;
+    return;
+  }
+  vector<uint8_t> buf(min(BINARY_DUMP_CHUNK_SIZE, m.num_bytes));
+  while (m.bytes_read < m.num_bytes) {
+    size_t len = min(buf.size(), m.num_bytes - m.bytes_read);
+    remote_ptr<void> addr = m.start + m.bytes_read;
+    ssize_t nread =
+        state.t ? state.t->read_bytes_fallible(addr, len, buf.data())
+                : pread64(state.mem_fd, buf.data(), len, addr.as_int());
+    if (nread <= 0) {
+      break;
+    }
+    if (gzwrite(out, buf.data(), nread) != nread) {
+      m.failed = true;
+      break;
+    }
+    m.bytes_read += nread;
+    if (size_t(nread) < len) {
+      // The rest of the mapping can't be read either.
+      break;
+    }
+  }
+  if (gzclose(out) != Z_OK) {
+    m.failed = true;
+  }
+}
+
+static void* dump_binary_thread(void* p) {
+  BinaryDumpState* state = static_cast<BinaryDumpState*>(p);
+  while (true) {
+    size_t i = state->next++;
+    if (i >= state->mappings.size()) {
+      return nullptr;
+    }
+    dump_binary_mapping(*state, i);
+  }
+}
+
+/**
+ * Write the binary dump of |t|'s memory to the directory |dirname|, as
+ * described at dump_process_memory().
+ */
+static void dump_process_memory_binary(Task* t, const char* dirname) {
+  if (mkdir(dirname, 0700) != 0 && errno != EEXIST) {
+    LOG(warn) << "Can't create memory dump directory " << dirname;
+    return;
+  }
+
+  BinaryDumpState state;
+  state.dir = dirname;
+  state.next = 0;
+  for (auto& kv : t->vm()->memmap()) {
+    if (kv.second.is_scratch()) {
+      continue;
+    }
+    state.mappings.push_back({ kv.first.start, kv.first.num_bytes(),
+                               kv.first.str() + ' ' + kv.second.str(), 0,
+                               false });
+  }
+
+  ScopedFd& mem_fd = t->vm()->mem_fd();
+  if (mem_fd.is_open()) {
+    state.t = nullptr;
+    state.mem_fd = mem_fd.get();
+    int jobs = min<size_t>(get_num_cpus(), state.mappings.size());
+    vector<pthread_t> threads(jobs);
+    for (auto& thread : threads) {
+      pthread_create(&thread, nullptr, dump_binary_thread, &state);
+    }
+    for (auto& thread : threads) {
+      pthread_join(thread, nullptr);
+    }
+  } else {
+    state.t = t;
+    dump_binary_thread(&state);
+  }
+
+  string index_name = state.dir + "/index";
+  FILE* index = fopen64(index_name.c_str(), "w");
+  if (!index) {
+    LOG(warn) << "Can't write " << index_name;
+    return;
+  }
+  for (size_t i = 0; i < state.mappings.size(); ++i) {
+    const BinaryDumpMapping& m = state.mappings[i];
+    if (m.failed) {
+      LOG(warn) << "Failed to dump " << m.label;
+    }
+    fprintf(index, "%zu.gz 0x%" PRIx64 " 0x%" PRIx64 " %zu %s\n", i,
+            uint64_t(m.start.as_int()), uint64_t(m.start.as_int()) + m.num_bytes,
+            m.bytes_read, m.label.c_str());
+  }
+  fclose(index);
 }
 
 void dump_process_memory(Task* t, TraceFrame::Time global_time,
@@ -142,6 +276,10 @@ void dump_process_memory(Task* t, TraceFrame::Time global_time,
   FILE* dump_file;
 
   format_dump_filename(t, global_time, tag, filename, sizeof(filename));
+  if (Flags::get().dump_binary) {
+    dump_process_memory_binary(t, filename);
+    return;
+  }
   dump_file = fopen64(filename, "w");
 
   const AddressSpace& as = *(t->vm());
@@ -157,7 +295,7 @@ void dump_process_memory(Task* t, TraceFrame::Time global_time,
 
     string label = first.str() + ' ' + second.str();
 
-    if (!is_start_of_scratch_region(t, first.start)) {
+    if (!second.is_scratch()) {
       dump_binary_chunk(dump_file, label.c_str(), (const uint32_t*)mem.data(),
                         mem_len / sizeof(uint32_t), first.start);
     }
@@ -165,9 +303,51 @@ void dump_process_memory(Task* t, TraceFrame::Time global_time,
   fclose(dump_file);
 }
 
+/**
+ * Return the ranges of pages of the segment at |start| whose checksums in
+ * |page_checksums| and |rec_page_checksums| differ, as "start-end" lines.
+ */
+static string divergent_pages(remote_ptr<void> start,
+                              const vector<uint32_t>& page_checksums,
+                              const vector<uint32_t>& rec_page_checksums) {
+  static const int MAX_RANGES = 32;
+  stringstream out;
+  size_t num_pages = max(page_checksums.size(), rec_page_checksums.size());
+  size_t num_divergent = 0;
+  int num_ranges = 0;
+  size_t i = 0;
+  while (i < num_pages) {
+    auto differs = [&](size_t i) {
+      return i >= page_checksums.size() || i >= rec_page_checksums.size() ||
+             page_checksums[i] != rec_page_checksums[i];
+    };
+    if (!differs(i)) {
+      ++i;
+      continue;
+    }
+    size_t end = i + 1;
+    while (end < num_pages && differs(end)) {
+      ++end;
+    }
+    num_divergent += end - i;
+    if (num_ranges++ < MAX_RANGES) {
+      out << "    " << start + i * page_size() << "-"
+          << start + end * page_size() << "\n";
+    }
+    i = end;
+  }
+  if (num_ranges > MAX_RANGES) {
+    out << "    ... and " << num_ranges - MAX_RANGES << " more ranges\n";
+  }
+  out << "    (" << num_divergent << " of " << num_pages
+      << " pages differ)\n";
+  return out.str();
+}
+
 static void notify_checksum_error(Task* t, TraceFrame::Time global_time,
                                   unsigned checksum, unsigned rec_checksum,
-                                  const string& raw_map_line) {
+                                  const string& raw_map_line,
+                                  const string& pages) {
   char cur_dump[PATH_MAX];
   char rec_dump[PATH_MAX];
 
@@ -189,35 +369,316 @@ static void notify_checksum_error(Task* t, TraceFrame::Time global_time,
       << raw_map_line << "    (recorded checksum:" << HEX(rec_checksum)
       << "; replaying checksum:" << HEX(checksum) << ")\n"
                                                      "\n"
+      << "Divergent pages:\n" << pages << "\n"
       << "Dumped current memory contents to " << cur_dump
       << ". If you've created a memory dump for\n"
       << "the '" << ev << "' event (line " << t->trace_time()
       << ") during recording by using, for example with\n"
       << "the args\n"
          "\n"
-      << "$ rr --dump-at=" << t->trace_time() << " record ...\n"
-                                                 "\n"
+      << "$ rr " << (Flags::get().dump_binary ? "--dump-binary " : "")
+      << "--dump-at=" << t->trace_time() << " record ...\n"
+                                             "\n"
       << "then you can use the following to determine which memory cells "
          "differ:\n"
          "\n"
-      << "$ diff -u " << rec_dump << " " << cur_dump << " > mem-diverge.diff\n";
+      << (Flags::get().dump_binary ? "$ rr memdiff " : "$ diff -u ")
+      << rec_dump << " " << cur_dump
+      << (Flags::get().dump_binary ? "\n" : " > mem-diverge.diff\n");
 }
 
-/**
- * This helper does the heavy lifting of storing or validating
- * checksums.  The iterator data determines which behavior the helper
- * function takes on, and to/from which file it writes/read.
- */
 enum ChecksumMode {
   STORE_CHECKSUMS,
   VALIDATE_CHECKSUMS
 };
-struct checksum_iterator_data {
-  ChecksumMode mode;
-  FILE* checksums_file;
-  TraceFrame::Time global_time;
+
+/**
+ * All of a trace's checksums live in its "checksums" file, as a sequence of
+ * records: a ChecksumRecordHeader followed by |num_segments|
+ * SegmentChecksums in memory map order, each followed by the |num_pages|
+ * uint32_t checksums of its pages.
+ */
+struct ChecksumRecordHeader {
+  // Size of the record, excluding this header.
+  uint64_t data_size;
+  // The event time, split so the layout is the same as when it was 32
+  // bits, with the high half in what was zero padding.
+  uint32_t global_time_low;
+  pid_t tid;
+  uint32_t num_segments;
+  uint32_t global_time_high;
+
+  TraceFrame::Time global_time() const {
+    return (TraceFrame::Time(global_time_high) << 32) | global_time_low;
+  }
+};
+struct SegmentChecksum {
+  uint64_t start;
+  uint64_t end;
+  uint32_t checksum;
+  uint32_t num_pages;
 };
 
+static string checksums_path(Task* t) { return t->trace_dir() + "/checksums"; }
+
+/**
+ * Return the checksums file of |t|'s trace, opened for appending records.
+ */
+static FILE* checksums_file_for_store(Task* t) {
+  static FILE* file;
+  static string file_path;
+  string path = checksums_path(t);
+  if (!file || path != file_path) {
+    if (file) {
+      fclose(file);
+    }
+    file = fopen64(path.c_str(), "w");
+    if (!file) {
+      FATAL() << "Failed to open checksum file " << path;
+    }
+    file_path = path;
+  }
+  return file;
+}
+
+/**
+ * Return the checksums file of |t|'s trace, positioned at the record for
+ * |global_time|. Replay can validate events in any order (e.g. after
+ * seeking back to a checkpoint), so the first call indexes all records.
+ */
+static FILE* checksums_file_for_validate(Task* t,
+                                         TraceFrame::Time global_time,
+                                         ChecksumRecordHeader* header) {
+  static FILE* file;
+  static string file_path;
+  static map<pair<TraceFrame::Time, pid_t>, off64_t> record_offsets;
+  string path = checksums_path(t);
+  if (!file || path != file_path) {
+    if (file) {
+      fclose(file);
+    }
+    file = fopen64(path.c_str(), "r");
+    if (!file) {
+      FATAL() << "Failed to open checksum file " << path;
+    }
+    file_path = path;
+    record_offsets.clear();
+    ChecksumRecordHeader h;
+    off64_t offset = 0;
+    while (fread(&h, sizeof(h), 1, file) == 1) {
+      record_offsets[make_pair(h.global_time(), h.tid)] = offset;
+      offset += sizeof(h) + h.data_size;
+      if (fseeko64(file, offset, SEEK_SET)) {
+        break;
+      }
+    }
+  }
+  auto it = record_offsets.find(make_pair(global_time, t->rec_tid));
+  if (it == record_offsets.end()) {
+    FATAL() << "No checksums were recorded at event " << global_time
+            << " for tid " << t->rec_tid;
+  }
+  if (fseeko64(file, it->second, SEEK_SET) ||
+      fread(header, sizeof(*header), 1, file) != 1) {
+    FATAL() << "Failed to read checksum file " << path;
+  }
+  return file;
+}
+
+/**
+ * CRC32C (Castagnoli). We use the SSE4.2 crc32 instruction when the CPU
+ * has it and an equivalent table otherwise, so checksums recorded on one
+ * machine can be validated on another.
+ */
+static uint32_t crc32c_table[256];
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t* p, size_t len) {
+  for (size_t i = 0; i < len; ++i) {
+    crc = crc32c_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(uint32_t crc,
+                                                            const uint8_t* p,
+                                                            size_t len) {
+#ifdef __x86_64__
+  uint64_t crc64 = crc;
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    crc64 = _mm_crc32_u64(crc64, v);
+  }
+  crc = crc64;
+#endif
+  for (; len >= 4; p += 4, len -= 4) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    crc = _mm_crc32_u32(crc, v);
+  }
+  for (; len > 0; ++p, --len) {
+    crc = _mm_crc32_u8(crc, *p);
+  }
+  return crc;
+}
+
+static uint32_t crc32c(const void* data, size_t len) {
+  static int have_sse42 = -1;
+  if (have_sse42 < 0) {
+    have_sse42 = __builtin_cpu_supports("sse4.2");
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t crc = i;
+      for (int j = 0; j < 8; ++j) {
+        crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+      }
+      crc32c_table[i] = crc;
+    }
+  }
+  const uint8_t* p = static_cast<const uint8_t*>(data);
+  return ~(have_sse42 ? crc32c_hw(~0U, p, len) : crc32c_sw(~0U, p, len));
+}
+
+/**
+ * /proc/<pid>/pagemap entry bits. See Documentation/vm/pagemap.txt.
+ */
+static const uint64_t PAGEMAP_SOFT_DIRTY = 1ULL << 55;
+static const uint64_t PAGEMAP_FILE_OR_SHARED = 1ULL << 61;
+static const uint64_t PAGEMAP_SWAPPED = 1ULL << 62;
+static const uint64_t PAGEMAP_PRESENT = 1ULL << 63;
+
+/**
+ * Cleared when the kernel turns out to not support resetting soft-dirty
+ * bits (CONFIG_MEM_SOFT_DIRTY).
+ */
+static bool soft_dirty_supported = true;
+
+/**
+ * Return the pagemap entries of the |num_pages| pages at |start|, or an
+ * empty vector if they can't be read.
+ */
+static vector<uint64_t> read_pagemap(Task* t, remote_ptr<void> start,
+                                     size_t num_pages) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path) - 1, "/proc/%d/pagemap", t->tid);
+  ScopedFd fd(path, O_RDONLY);
+  vector<uint64_t> entries(num_pages);
+  size_t size = num_pages * sizeof(uint64_t);
+  off64_t offset = start.as_int() / page_size() * sizeof(uint64_t);
+  if (!fd.is_open() ||
+      pread64(fd, entries.data(), size, offset) != ssize_t(size)) {
+    entries.clear();
+  }
+  return entries;
+}
+
+/**
+ * Only exclusively owned anonymous (including COWed) pages change just
+ * when their soft-dirty bit gets set. Other pages can be written through
+ * other mappings of their file or shared memory.
+ */
+static bool page_checksum_cacheable(uint64_t pagemap_entry) {
+  return (pagemap_entry & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED)) &&
+         !(pagemap_entry & PAGEMAP_FILE_OR_SHARED);
+}
+
+/**
+ * Compute the checksum of the first |len| bytes of |m|, stopping at the
+ * first byte that can't be read. It's the CRC32C of the CRC32Cs of the
+ * pages, which are returned in |page_checksums|. If |use_cache| is set,
+ * whole pages that haven't been written since the last checksum of |t|'s
+ * address space reuse their previous checksum instead of being read.
+ */
+static uint32_t checksum_segment(Task* t, const Mapping& m, size_t len,
+                                 bool use_cache,
+                                 vector<uint32_t>& page_checksums) {
+  size_t page = page_size();
+  size_t num_pages = ceil_page_size(len) / page;
+  auto& cache = t->vm()->page_checksums();
+  vector<uint64_t> pagemap;
+  if (use_cache) {
+    pagemap = read_pagemap(t, m.start, num_pages);
+    use_cache = !pagemap.empty();
+  }
+  auto cached_checksum = [&](size_t i) {
+    if (!use_cache || !page_checksum_cacheable(pagemap[i]) ||
+        (pagemap[i] & PAGEMAP_SOFT_DIRTY)) {
+      return cache.end();
+    }
+    return cache.find(m.start + i * page);
+  };
+
+  page_checksums.assign(num_pages, 0);
+  size_t num_valid_pages = num_pages;
+  vector<uint8_t> buf;
+  size_t i = 0;
+  while (i < num_pages) {
+    auto it = cached_checksum(i);
+    if (it != cache.end()) {
+      page_checksums[i++] = it->second;
+      continue;
+    }
+    // Read the whole run of pages that need checksumming at once.
+    size_t run_end = i + 1;
+    while (run_end < num_pages && cached_checksum(run_end) == cache.end()) {
+      ++run_end;
+    }
+    size_t run_bytes = min(len, run_end * page) - i * page;
+    buf.resize(run_bytes);
+    ssize_t nread =
+        t->read_bytes_fallible(m.start + i * page, run_bytes, buf.data());
+    size_t valid_bytes = max(ssize_t(0), nread);
+    for (size_t j = i; j < run_end; ++j) {
+      size_t offset = (j - i) * page;
+      if (offset >= valid_bytes) {
+        break;
+      }
+      size_t n = min(page, valid_bytes - offset);
+      page_checksums[j] = crc32c(buf.data() + offset, n);
+      if (use_cache && n == page && page_checksum_cacheable(pagemap[j])) {
+        cache[m.start + j * page] = page_checksums[j];
+      } else {
+        cache.erase(m.start + j * page);
+      }
+    }
+    if (valid_bytes < run_bytes) {
+      num_valid_pages = i + ceil_page_size(valid_bytes) / page;
+      break;
+    }
+    i = run_end;
+  }
+  page_checksums.resize(num_valid_pages);
+  return crc32c(page_checksums.data(), num_valid_pages * sizeof(uint32_t));
+}
+
+bool clear_soft_dirty_bits(Task* t) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path) - 1, "/proc/%d/clear_refs", t->tid);
+  ScopedFd fd(path, O_WRONLY);
+  return fd.is_open() && write(fd, "4", 1) == 1;
+}
+
+vector<bool> soft_dirty_pages(Task* t, remote_ptr<void> start,
+                              size_t num_pages) {
+  vector<uint64_t> pagemap = read_pagemap(t, start, num_pages);
+  vector<bool> dirty(pagemap.size());
+  for (size_t i = 0; i < pagemap.size(); ++i) {
+    dirty[i] = (pagemap[i] & PAGEMAP_SOFT_DIRTY) != 0;
+  }
+  return dirty;
+}
+
+/**
+ * Reset the soft-dirty bits of |t|'s address space, so the next checksum
+ * only reads the pages written after this one.
+ */
+static void clear_soft_dirty(Task* t) {
+  if (!clear_soft_dirty_bits(t)) {
+    LOG(debug) << "Can't clear soft-dirty bits, checksumming all pages";
+    soft_dirty_supported = false;
+    t->vm()->page_checksums().clear();
+  }
+}
+
 static bool checksum_segment_filter(const Mapping& m,
                                     const MappableResource& r) {
   struct stat st;
@@ -243,110 +704,122 @@ static bool checksum_segment_filter(const Mapping& m,
 /**
  * Either create and store checksums for each segment mapped in |t|'s
  * address space, or validate an existing computed checksum.  Behavior
- * is selected by |mode|.
+ * is selected by |mode|. Returns false if validation found a mismatch
+ * and |fatal| is false.
  */
-static void iterate_checksums(Task* t, ChecksumMode mode,
-                              TraceFrame::Time global_time) {
-  struct checksum_iterator_data c;
-  memset(&c, 0, sizeof(c));
-  char filename[PATH_MAX];
-  const char* fmode = (STORE_CHECKSUMS == mode) ? "w" : "r";
-
-  c.mode = mode;
-  snprintf(filename, sizeof(filename) - 1, "%s/%d_%d", t->trace_dir().c_str(),
-           global_time, t->rec_tid);
-  c.checksums_file = fopen64(filename, fmode);
-  c.global_time = global_time;
-  if (!c.checksums_file) {
-    FATAL() << "Failed to open checksum file " << filename;
+static bool iterate_checksums(Task* t, ChecksumMode mode,
+                              TraceFrame::Time global_time, bool fatal) {
+  const AddressSpace& as = *(t->vm());
+  ChecksumRecordHeader header;
+  FILE* file;
+  vector<uint8_t> record;
+  if (STORE_CHECKSUMS == mode) {
+    file = checksums_file_for_store(t);
+    header.global_time_low = uint32_t(global_time);
+    header.tid = t->rec_tid;
+    header.num_segments = as.memmap().size();
+    header.global_time_high = uint32_t(global_time >> 32);
+  } else {
+    file = checksums_file_for_validate(t, global_time, &header);
   }
 
-  const AddressSpace& as = *(t->vm());
+  bool ok = true;
+  uint32_t segment_index = 0;
+  vector<uint32_t> page_checksums;
+  vector<uint32_t> rec_page_checksums;
   for (auto& kv : as.memmap()) {
     const Mapping& first = kv.first;
     const MappableResource& second = kv.second;
 
-    vector<uint8_t> mem;
-    ssize_t valid_mem_len = 0;
-
-    if (checksum_segment_filter(first, second)) {
-      mem.resize(first.num_bytes());
-      valid_mem_len =
-          t->read_bytes_fallible(first.start, first.num_bytes(), mem.data());
-      valid_mem_len = max(ssize_t(0), valid_mem_len);
-    }
-
-    unsigned* buf = (unsigned*)mem.data();
-    unsigned checksum = 0;
-    int i;
-
-    if (second.fsname.find(SYSCALLBUF_SHMEM_PATH_PREFIX) != string::npos) {
-      /* The syscallbuf consists of a region that's written
-      * deterministically wrt the trace events, and a
-      * region that's written nondeterministically in the
-      * same way as trace scratch buffers.  The
-      * deterministic region comprises committed syscallbuf
-      * records, and possibly the one pending record
-      * metadata.  The nondeterministic region starts at
-      * the "extra data" for the possibly one pending
-      * record.
-      *
-      * So here, we set things up so that we only checksum
-      * the deterministic region. */
-      auto child_hdr = first.start.cast<struct syscallbuf_hdr>();
-      auto hdr = t->read_mem(child_hdr);
-      valid_mem_len = !buf ? 0 : sizeof(hdr) + hdr.num_rec_bytes +
-                                     sizeof(struct syscallbuf_record);
+    if (second.is_scratch()) {
+      /* Replay doesn't touch scratch regions, so their
+       * contents are allowed to diverge. Scratch that was
+       * grown during recording isn't mapped in replay at
+       * all, so don't store or validate any of it. */
+      continue;
     }
 
-    ASSERT(t, buf || valid_mem_len == 0);
-    for (i = 0; i < ssize_t(valid_mem_len / sizeof(*buf)); ++i) {
-      checksum += buf[i];
+    uint32_t checksum = 0;
+    page_checksums.clear();
+    if (checksum_segment_filter(first, second)) {
+      size_t len = first.num_bytes();
+      bool is_syscallbuf =
+          second.fsname.find(SYSCALLBUF_SHMEM_PATH_PREFIX) != string::npos;
+      if (is_syscallbuf) {
+        /* The syscallbuf consists of a region that's written
+        * deterministically wrt the trace events, and a
+        * region that's written nondeterministically in the
+        * same way as trace scratch buffers.  The
+        * deterministic region comprises committed syscallbuf
+        * records, and possibly the one pending record
+        * metadata.  The nondeterministic region starts at
+        * the "extra data" for the possibly one pending
+        * record.
+        *
+        * So here, we set things up so that we only checksum
+        * the deterministic region. */
+        auto child_hdr = first.start.cast<struct syscallbuf_hdr>();
+        auto hdr = t->read_mem(child_hdr);
+        len = min(len, sizeof(hdr) + hdr.num_rec_bytes +
+                           sizeof(struct syscallbuf_record));
+      }
+      bool use_cache = soft_dirty_supported &&
+                       (first.flags & MAP_PRIVATE) && !is_syscallbuf;
+      checksum = checksum_segment(t, first, len, use_cache, page_checksums);
     }
 
     string raw_map_line = first.str() + ' ' + second.str();
-    if (STORE_CHECKSUMS == c.mode) {
-      fprintf(c.checksums_file, "(%x) %s\n", checksum, raw_map_line.c_str());
+    if (STORE_CHECKSUMS == mode) {
+      SegmentChecksum rec = { first.start.as_int(), first.end.as_int(),
+                              checksum, uint32_t(page_checksums.size()) };
+      const uint8_t* p = reinterpret_cast<const uint8_t*>(&rec);
+      record.insert(record.end(), p, p + sizeof(rec));
+      p = reinterpret_cast<const uint8_t*>(page_checksums.data());
+      record.insert(record.end(), p,
+                    p + page_checksums.size() * sizeof(uint32_t));
     } else {
-      char line[1024];
-      unsigned rec_checksum;
-      unsigned long rec_start;
-      unsigned long rec_end;
-      int nparsed;
-
-      fgets(line, sizeof(line), c.checksums_file);
-      nparsed =
-          sscanf(line, "(%x) %lx-%lx", &rec_checksum, &rec_start, &rec_end);
-      remote_ptr<void> rec_start_addr = rec_start;
-      remote_ptr<void> rec_end_addr = rec_end;
-      ASSERT(t, 3 == nparsed) << "Only parsed " << nparsed << " items";
+      SegmentChecksum rec;
+      ASSERT(t, segment_index++ < header.num_segments &&
+                    fread(&rec, sizeof(rec), 1, file) == 1)
+          << "Segment " << first << " wasn't mapped during recording";
+      rec_page_checksums.resize(rec.num_pages);
+      ASSERT(t, fread(rec_page_checksums.data(), sizeof(uint32_t),
+                      rec.num_pages, file) == rec.num_pages)
+          << "Truncated checksum record for " << first;
+      remote_ptr<void> rec_start_addr = rec.start;
+      remote_ptr<void> rec_end_addr = rec.end;
 
       ASSERT(t, rec_start_addr == first.start && rec_end_addr == first.end)
           << "Segment " << rec_start_addr << "-" << rec_end_addr
           << " changed to " << first << "??";
 
-      if (is_start_of_scratch_region(t, rec_start_addr)) {
-        /* Replay doesn't touch scratch regions, so
-         * their contents are allowed to diverge.
-         * Tracees can't observe those segments unless
-         * they do something sneaky (or disastrously
-         * buggy). */
-        LOG(debug) << "Not validating scratch starting at 0x" << hex
-                   << rec_start_addr << dec;
-        continue;
-      }
-      if (checksum != rec_checksum) {
-        notify_checksum_error(t, c.global_time, checksum, rec_checksum,
-                              raw_map_line.c_str());
+      if (checksum != rec.checksum) {
+        if (!fatal) {
+          LOG(info) << "Checksum mismatch in " << raw_map_line << " at event "
+                    << global_time;
+          ok = false;
+          break;
+        }
+        notify_checksum_error(
+            t, global_time, checksum, rec.checksum, raw_map_line,
+            divergent_pages(first.start, page_checksums, rec_page_checksums));
       }
     }
   }
 
-  fclose(c.checksums_file);
+  if (STORE_CHECKSUMS == mode) {
+    header.data_size = record.size();
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(record.data(), 1, record.size(), file);
+  }
+  if (soft_dirty_supported) {
+    clear_soft_dirty(t);
+  }
+  return ok;
 }
 
 bool should_checksum(Task* t, const TraceFrame& f) {
-  int checksum = Flags::get().checksum;
+  int64_t checksum = Flags::get().checksum;
   bool is_syscall_exit =
       EV_SYSCALL == f.event().type && SYSCALL_EXIT == f.event().state;
 
@@ -369,15 +842,48 @@ bool should_checksum(Task* t, const TraceFrame& f) {
     return is_syscall_exit;
   }
   /* |checksum| is a global time point. */
-  return checksum <= int(f.time());
+  return checksum <= int64_t(f.time());
 }
 
 void checksum_process_memory(Task* t, TraceFrame::Time global_time) {
-  iterate_checksums(t, STORE_CHECKSUMS, global_time);
+  iterate_checksums(t, STORE_CHECKSUMS, global_time, true);
+}
+
+bool validate_process_memory(Task* t, TraceFrame::Time global_time,
+                             bool fatal) {
+  return iterate_checksums(t, VALIDATE_CHECKSUMS, global_time, fatal);
 }
 
-void validate_process_memory(Task* t, TraceFrame::Time global_time) {
-  iterate_checksums(t, VALIDATE_CHECKSUMS, global_time);
+bool memory_fingerprint(Task* t, const TraceFrame& f, uint32_t* fingerprint) {
+  if (EV_SYSCALL != f.event().type || SYSCALL_EXIT != f.event().state ||
+      !t->vm()) {
+    return false;
+  }
+  // The new stack that execve builds is partly restored from the trace
+  // later in replay.
+  Event ev(f.event());
+  if (is_execve_syscall(ev.Syscall().number, ev.arch())) {
+    return false;
+  }
+  remote_ptr<void> sp = t->regs().sp();
+  const AddressSpace::MemoryMap& memmap = t->vm()->memmap();
+  auto it = memmap.find(Mapping(sp, 1));
+  if (it == memmap.end() || !it->first.has_subset(Mapping(sp, 1))) {
+    return false;
+  }
+  const Mapping& m = it->first;
+  const MappableResource& r = it->second;
+  // Scratch and the syscallbuf may legitimately differ in replay.
+  if (!(m.flags & MAP_PRIVATE) || !(m.prot & PROT_WRITE) || r.is_scratch() ||
+      r.fsname.find(SYSCALLBUF_SHMEM_PATH_PREFIX) != string::npos) {
+    return false;
+  }
+  size_t page = page_size();
+  remote_ptr<void> end = min(m.end, floor_page_size(sp) + 2 * page);
+  vector<uint8_t> buf(end - sp);
+  ssize_t nread = t->read_bytes_fallible(sp, buf.size(), buf.data());
+  *fingerprint = crc32c(buf.data(), max<ssize_t>(0, nread));
+  return true;
 }
 
 signal_action default_action(int sig) {
@@ -493,6 +999,12 @@ static bool is_tmp_file(const string& path) {
           path.c_str() == strstr(path.c_str(), "/tmp/"));
 }
 
+bool is_immutable_file(const string& file_name, const struct stat* stat) {
+  return S_ISREG(stat->st_mode) && 0 == stat->st_uid &&
+         has_fs_name(file_name) && !is_tmp_file(file_name) &&
+         0 != access(file_name.c_str(), W_OK);
+}
+
 bool should_copy_mmap_region(const string& file_name, const struct stat* stat,
                              int prot, int flags) {
   bool private_mapping = (flags & MAP_PRIVATE);
@@ -604,6 +1116,45 @@ void resize_shmem_segment(ScopedFd& fd, size_t num_bytes) {
   }
 }
 
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+
+static ssize_t copy_file_range_fallible(int fd_in, loff_t* off_in, int fd_out,
+                                        loff_t* off_out, size_t len) {
+#ifdef SYS_copy_file_range
+  return syscall(SYS_copy_file_range, fd_in, off_in, fd_out, off_out, len, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+bool copy_file_contents(int src_fd, int dest_fd, int64_t offset, int64_t end,
+                        int64_t file_size) {
+  if (ioctl(dest_fd, FICLONE, src_fd) == 0) {
+    return true;
+  }
+  if (ftruncate(dest_fd, file_size)) {
+    return false;
+  }
+  loff_t in_offset = offset;
+  loff_t out_offset = offset;
+  end = min(end, file_size);
+  while (in_offset < end) {
+    ssize_t n = copy_file_range_fallible(src_fd, &in_offset, dest_fd,
+                                         &out_offset, end - in_offset);
+    if (n <= 0) {
+      if (n == 0) {
+        // The file shrank under us.
+        errno = EIO;
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
 // TODO de-dup
 static void advance_syscall(Task* t) {
   do {
@@ -682,6 +1233,86 @@ int get_num_cpus() {
   return cpus > 0 ? cpus : 1;
 }
 
+/**
+ * Read the integer in the sysfs topology file |name| of |cpu|, or -1.
+ */
+static int read_cpu_topology(int cpu, const char* name) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s",
+           cpu, name);
+  ScopedFd fd(path, O_RDONLY | O_CLOEXEC);
+  char buf[32];
+  ssize_t len = fd.is_open() ? read(fd, buf, sizeof(buf) - 1) : -1;
+  if (len <= 0) {
+    return -1;
+  }
+  buf[len] = 0;
+  return atoi(buf);
+}
+
+bool get_helper_cpus(int cpu, cpu_set_t* cpus) {
+  int num_cpus = get_num_cpus();
+  int package = read_cpu_topology(cpu, "physical_package_id");
+  int core = read_cpu_topology(cpu, "core_id");
+  for (int same_package_only = 1; same_package_only >= 0;
+       --same_package_only) {
+    CPU_ZERO(cpus);
+    int count = 0;
+    for (int i = 0; i < num_cpus; ++i) {
+      int i_package = read_cpu_topology(i, "physical_package_id");
+      if (i == cpu ||
+          (i_package == package &&
+           read_cpu_topology(i, "core_id") == core && core >= 0)) {
+        continue;
+      }
+      if (same_package_only && i_package != package) {
+        continue;
+      }
+      CPU_SET(i, cpus);
+      ++count;
+    }
+    if (count > 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint64_t monotonic_raw_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+const rdtsc_calibration& get_rdtsc_calibration() {
+  static rdtsc_calibration calibration;
+  if (!calibration.tsc_per_ns) {
+    // This only has to be accurate enough that virtual TSC values advance
+    // at about the rate of the real TSC, so a few milliseconds will do.
+    uint64_t ns_start = monotonic_raw_ns();
+    uint64_t tsc_start = __rdtsc();
+    struct timespec delay = { 0, 5000000 };
+    nanosleep(&delay, nullptr);
+    uint64_t ns_end = monotonic_raw_ns();
+    uint64_t tsc_end = __rdtsc();
+
+    calibration.tsc_base = tsc_start;
+    calibration.ns_base = ns_start;
+    calibration.tsc_per_ns =
+        max<uint64_t>(1, ((tsc_end - tsc_start) << RDTSC_CALIBRATION_SHIFT) /
+                             (ns_end - ns_start));
+  }
+  return calibration;
+}
+
+uint64_t virtual_tsc_now() {
+  const rdtsc_calibration& calibration = get_rdtsc_calibration();
+  return calibration.tsc_base +
+         (((monotonic_raw_ns() - calibration.ns_base) *
+           calibration.tsc_per_ns) >>
+          RDTSC_CALIBRATION_SHIFT);
+}
+
 template <typename Arch>
 static void extract_clone_parameters_arch(const Registers& regs,
                                           remote_ptr<void>* stack,
@@ -752,3 +1383,103 @@ bool trace_instructions_up_to_event(TraceFrame::Time event) {
   return event > instruction_trace_at_event_start &&
          event <= instruction_trace_at_event_last;
 }
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+Hash128 hash_bytes(const void* data, size_t len) {
+  const uint8_t* bytes = static_cast<const uint8_t*>(data);
+  const size_t nblocks = len / 16;
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = 0;
+  uint64_t h2 = 0;
+
+  for (size_t i = 0; i < nblocks; ++i) {
+    uint64_t k1, k2;
+    memcpy(&k1, bytes + i * 16, sizeof(k1));
+    memcpy(&k2, bytes + i * 16 + 8, sizeof(k2));
+
+    k1 *= c1;
+    k1 = rotl64(k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+    h1 = rotl64(h1, 27);
+    h1 += h2;
+    h1 = h1 * 5 + 0x52dce729;
+
+    k2 *= c2;
+    k2 = rotl64(k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+    h2 = rotl64(h2, 31);
+    h2 += h1;
+    h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  const uint8_t* tail = bytes + nblocks * 16;
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+  switch (len & 15) {
+    case 15:
+      k2 ^= uint64_t(tail[14]) << 48;
+    case 14:
+      k2 ^= uint64_t(tail[13]) << 40;
+    case 13:
+      k2 ^= uint64_t(tail[12]) << 32;
+    case 12:
+      k2 ^= uint64_t(tail[11]) << 24;
+    case 11:
+      k2 ^= uint64_t(tail[10]) << 16;
+    case 10:
+      k2 ^= uint64_t(tail[9]) << 8;
+    case 9:
+      k2 ^= uint64_t(tail[8]);
+      k2 *= c2;
+      k2 = rotl64(k2, 33);
+      k2 *= c1;
+      h2 ^= k2;
+    case 8:
+      k1 ^= uint64_t(tail[7]) << 56;
+    case 7:
+      k1 ^= uint64_t(tail[6]) << 48;
+    case 6:
+      k1 ^= uint64_t(tail[5]) << 40;
+    case 5:
+      k1 ^= uint64_t(tail[4]) << 32;
+    case 4:
+      k1 ^= uint64_t(tail[3]) << 24;
+    case 3:
+      k1 ^= uint64_t(tail[2]) << 16;
+    case 2:
+      k1 ^= uint64_t(tail[1]) << 8;
+    case 1:
+      k1 ^= uint64_t(tail[0]);
+      k1 *= c1;
+      k1 = rotl64(k1, 31);
+      k1 *= c2;
+      h1 ^= k1;
+  }
+
+  h1 ^= len;
+  h2 ^= len;
+  h1 += h2;
+  h2 += h1;
+  h1 = fmix64(h1);
+  h2 = fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+
+  Hash128 result = { h1, h2 };
+  return result;
+}
@@ -3,8 +3,11 @@
 #ifndef RR_UTIL_H_
 #define RR_UTIL_H_
 
+#include <sched.h>
+
 #include <array>
 #include <string>
+#include <vector>
 
 #include "Event.h"
 #include "remote_ptr.h"
@@ -75,6 +78,11 @@ bool should_dump_memory(Task* t, const TraceFrame& f);
 /**
  * Dump all of the memory in |t|'s address to the file
  * "[trace_dir]/[t->tid]_[global_time]_[tag]".
+ *
+ * With --dump-binary that path is a directory instead. Each mapping is
+ * compressed to "[n].gz" by a pool of threads. The "index" file has one
+ * line per mapping: "[n].gz [start] [end] [bytes read] [description]",
+ * addresses in hex. `rr memdiff' compares two such dumps.
  */
 void dump_process_memory(Task* t, TraceFrame::Time global_time,
                          const char* tag);
@@ -92,9 +100,34 @@ bool should_checksum(Task* t, const TraceFrame& f);
 void checksum_process_memory(Task* t, TraceFrame::Time global_time);
 /**
  * Validate the checksum of |t|'s address space that was written
- * during recording.
+ * during recording. On a mismatch, report the divergent pages and abort
+ * if |fatal|, otherwise just return false.
+ */
+bool validate_process_memory(Task* t, TraceFrame::Time global_time,
+                             bool fatal = true);
+
+/**
+ * Compute a cheap fingerprint of |t|'s memory at |f|, to catch replay
+ * divergence without the cost of checksums: the CRC32C of the live stack
+ * from the stack pointer to the end of the next page. Only syscall exits,
+ * where memory is known to match between recording and replay, are
+ * fingerprinted, except execve's. Returns false if |f| isn't one or the
+ * stack isn't in ordinary private memory.
  */
-void validate_process_memory(Task* t, TraceFrame::Time global_time);
+bool memory_fingerprint(Task* t, const TraceFrame& f, uint32_t* fingerprint);
+
+/**
+ * Reset the soft-dirty bits of |t|'s address space. Returns false if the
+ * kernel doesn't support that.
+ */
+bool clear_soft_dirty_bits(Task* t);
+/**
+ * Return whether each of the |num_pages| pages at |start| in |t|'s
+ * address space has been written since its soft-dirty bits were last
+ * reset, or an empty vector if that can't be read.
+ */
+std::vector<bool> soft_dirty_pages(Task* t, remote_ptr<void> start,
+                                   size_t num_pages);
 
 /**
  * Return nonzero if the rr session is probably not interactive (that
@@ -159,6 +192,14 @@ SignalDeterministic is_deterministic_signal(const siginfo_t& si);
 bool should_copy_mmap_region(const std::string& filename,
                              const struct stat* stat, int prot, int flags);
 
+/**
+ * Return true if the regular file |filename| with metadata |stat| is a
+ * system file whose contents we assume don't change between recording
+ * and replay, for the same reasons should_copy_mmap_region() doesn't
+ * copy mappings of it: it's owned by root and rr can't write it.
+ */
+bool is_immutable_file(const std::string& filename, const struct stat* stat);
+
 /**
  * Return an fd referring to a new shmem segment with descriptive
  * |name| of size |num_bytes|.
@@ -213,6 +254,28 @@ void set_cpu_affinity(int cpu);
  */
 int get_num_cpus();
 
+/**
+ * Fill |cpus| with the CPUs that rr's helper threads should run on so
+ * they don't compete with tracees bound to |cpu|: the CPUs in |cpu|'s
+ * package that aren't on its core, or if there are none, any CPU that
+ * isn't on its core. Returns false if there's no such CPU.
+ */
+bool get_helper_cpus(int cpu, cpu_set_t* cpus);
+
+struct rdtsc_calibration;
+
+/**
+ * Return the calibration used to derive the TSC values tracees see from
+ * CLOCK_MONOTONIC_RAW. It's measured once per rr process.
+ */
+const rdtsc_calibration& get_rdtsc_calibration();
+
+/**
+ * Return the current virtual TSC value. Trapped and patched rdtscs both
+ * produce values on this time base.
+ */
+uint64_t virtual_tsc_now();
+
 /**
  * Extract various clone(2) parameters out of the given Task's registers.
  * Each remote_ptr parameter may be nullptr.
@@ -228,6 +291,33 @@ void extract_clone_parameters(Task* t, remote_ptr<void>* stack,
 const int NOT_ELF = 0x10000;
 int read_elf_class(const std::string& filename);
 
+/**
+ * Make |dest_fd| a |file_size|-byte file whose bytes in [offset, end) are
+ * those of |src_fd|, without reading them into our address space: by
+ * reflinking all of |src_fd| if the file system supports that, otherwise
+ * with copy_file_range. Bytes outside the range may be zero or copied.
+ * Returns false with errno set on failure.
+ */
+bool copy_file_contents(int src_fd, int dest_fd, int64_t offset, int64_t end,
+                        int64_t file_size);
+
 bool trace_instructions_up_to_event(TraceFrame::Time event);
 
+/**
+ * A 128-bit non-cryptographic hash (MurmurHash3_x64_128) of |len| bytes at
+ * |data|. Collisions are vanishingly unlikely for non-adversarial data.
+ */
+struct Hash128 {
+  uint64_t h1;
+  uint64_t h2;
+  bool operator==(const Hash128& other) const {
+    return h1 == other.h1 && h2 == other.h2;
+  }
+  /** For use as a std::unordered_map hasher. */
+  struct Hasher {
+    size_t operator()(const Hash128& h) const { return h.h1; }
+  };
+};
+Hash128 hash_bytes(const void* data, size_t len);
+
 #endif /* RR_UTIL_H_ */